@@ -102,10 +102,12 @@ LOCAL_C_INCLUDES :=                               \
 LOCAL_SRC_FILES :=                                \
 		jni/src/ban.cpp                           \
 		jni/src/base64.cpp                        \
+		jni/src/benchmark.cpp                     \
 		jni/src/camera.cpp                        \
 		jni/src/cavegen.cpp                       \
 		jni/src/chat.cpp                          \
 		jni/src/client.cpp                        \
+		jni/src/clientblockcache.cpp              \
 		jni/src/clientiface.cpp                   \
 		jni/src/clientmap.cpp                     \
 		jni/src/clientmedia.cpp                   \
@@ -152,6 +154,7 @@ LOCAL_SRC_FILES :=                                \
 		jni/src/itemdef.cpp                       \
 		jni/src/keycode.cpp                       \
 		jni/src/light.cpp                         \
+		jni/src/loadtest.cpp                      \
 		jni/src/localplayer.cpp                   \
 		jni/src/log.cpp                           \
 		jni/src/main.cpp                          \
@@ -159,12 +162,14 @@ LOCAL_SRC_FILES :=                                \
 		jni/src/mapblock.cpp                      \
 		jni/src/mapblock_mesh.cpp                 \
 		jni/src/mapgen.cpp                        \
+		jni/src/mapgen_benchmark.cpp              \
 		jni/src/mapgen_singlenode.cpp             \
 		jni/src/mapgen_v5.cpp                     \
 		jni/src/mapgen_v6.cpp                     \
 		jni/src/mapgen_v7.cpp                     \
 		jni/src/mapnode.cpp                       \
 		jni/src/mapsector.cpp                     \
+		jni/src/metrics.cpp                       \
 		jni/src/mesh.cpp                          \
 		jni/src/mg_biome.cpp                      \
 		jni/src/mg_decoration.cpp                 \
@@ -177,12 +182,16 @@ LOCAL_SRC_FILES :=                                \
 		jni/src/nodetimer.cpp                     \
 		jni/src/noise.cpp                         \
 		jni/src/object_properties.cpp             \
+		jni/src/packettrace.cpp                   \
 		jni/src/particles.cpp                     \
 		jni/src/pathfinder.cpp                    \
 		jni/src/player.cpp                        \
 		jni/src/porting_android.cpp               \
 		jni/src/porting.cpp                       \
+		jni/src/pregen.cpp                        \
+		jni/src/profiler.cpp                      \
 		jni/src/quicktune.cpp                     \
+		jni/src/raycast.cpp                       \
 		jni/src/rollback.cpp                      \
 		jni/src/rollback_interface.cpp            \
 		jni/src/serialization.cpp                 \
@@ -204,6 +213,7 @@ LOCAL_SRC_FILES :=                                \
 		jni/src/version.cpp                       \
 		jni/src/voxel.cpp                         \
 		jni/src/voxelalgorithms.cpp               \
+		jni/src/workerpool.cpp                    \
 		jni/src/util/directiontables.cpp          \
 		jni/src/util/numeric.cpp                  \
 		jni/src/util/pointedthing.cpp             \
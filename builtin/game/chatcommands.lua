@@ -613,6 +613,62 @@ core.register_chatcommand("status", {
 	end,
 })
 
+core.register_chatcommand("profiler_trace", {
+	description = "write the profiler trace to the world directory",
+	privs = {server=true},
+	func = function(name, param)
+		local path = core.write_profiler_trace()
+		if not path then
+			return false, "Tracing is disabled (see profiler_trace)."
+		end
+		core.log("action", name .. " writes the profiler trace")
+		return true, "Profiler trace written to " .. path
+	end,
+})
+
+core.register_chatcommand("callback_stats", {
+	params = "[<mod> | clear]",
+	description = "show the time spent in the callbacks of mods",
+	privs = {server=true},
+	func = function(name, param)
+		if param == "clear" then
+			core.clear_callback_stats()
+			return true, "Callback statistics cleared."
+		end
+		local stats = core.get_callback_stats()
+		local rows = {}
+		if param == "" then
+			for mod, callbacks in pairs(stats) do
+				local row = {label = mod, count = 0, time = 0}
+				for _, entry in pairs(callbacks) do
+					row.count = row.count + entry.count
+					row.time = row.time + entry.time
+				end
+				table.insert(rows, row)
+			end
+		else
+			if not stats[param] then
+				return false, "No callbacks of " .. param .. " have run."
+			end
+			for callback, entry in pairs(stats[param]) do
+				table.insert(rows, {label = callback,
+						count = entry.count, time = entry.time})
+			end
+		end
+		table.sort(rows, function(a, b) return a.time > b.time end)
+		local lines = {}
+		for i = 1, math.min(#rows, 10) do
+			local row = rows[i]
+			table.insert(lines, string.format("%.3fs in %d calls: %s",
+					row.time, row.count, row.label))
+		end
+		if #lines == 0 then
+			return true, "No callbacks have run."
+		end
+		return true, table.concat(lines, "\n")
+	end,
+})
+
 core.register_chatcommand("time", {
 	params = "<0...24000>",
 	description = "set time of day",
@@ -689,17 +745,106 @@ core.register_chatcommand("kick", {
 	end,
 })
 
+local function clear_objects_progress_string(progress)
+	return progress.objects_cleared .. " objects cleared in "
+			.. progress.blocks_cleared .. " blocks ("
+			.. progress.blocks_checked .. " blocks checked)"
+end
+
+local function announce_clear_objects_done()
+	local progress = core.get_clear_objects_progress()
+	if progress then
+		core.after(5, announce_clear_objects_done)
+		return
+	end
+	core.log("action", "Object clearing done.")
+	core.chat_send_all("*** Cleared all objects.")
+end
+
 core.register_chatcommand("clearobjects", {
-	description = "clear all objects in world",
+	params = "[restart]",
+	description = "clear all objects in world, "
+			.. "or show progress if already clearing",
 	privs = {server=true},
 	func = function(name, param)
+		local progress = core.get_clear_objects_progress()
+		if progress and param ~= "restart" then
+			return true, "Clearing objects: "
+					.. clear_objects_progress_string(progress)
+					.. ".  Use /clearobjects restart to start over."
+		end
 		core.log("action", name .. " clears all objects.")
-		core.chat_send_all("Clearing all objects.  This may take long."
-				.. "  You may experience a timeout.  (by "
-				.. name .. ")")
 		core.clear_objects()
-		core.log("action", "Object clearing done.")
-		core.chat_send_all("*** Cleared all objects.")
+		core.chat_send_all("Clearing all objects in the background.  (by "
+				.. name .. ")")
+		if not progress then
+			core.after(5, announce_clear_objects_done)
+		end
+	end,
+})
+
+core.register_chatcommand("pregenerate", {
+	params = "<X1>,<Y1>,<Z1> <X2>,<Y2>,<Z2> | stop",
+	description = "generate an area of the map in the background, "
+			.. "or show progress if there are no parameters",
+	privs = {server=true},
+	func = function(name, param)
+		if param == "" then
+			local progress = core.get_pregenerate_progress()
+			if not progress then
+				return true, "Not pregenerating."
+			end
+			local msg = "Pregenerating " .. core.pos_to_string(progress.minp)
+					.. " to " .. core.pos_to_string(progress.maxp) .. ": "
+					.. progress.done .. "/" .. progress.total .. " mapchunks ("
+					.. math.floor(progress.done * 100 / progress.total) .. "%)"
+			if progress.eta then
+				msg = msg .. ", about " .. math.ceil(progress.eta / 60)
+						.. " min left"
+			end
+			return true, msg
+		elseif param == "stop" then
+			core.pregenerate_stop()
+			core.log("action", name .. " stops map pregeneration")
+			return true, "Pregeneration stopped."
+		end
+		local p1, p2 = {}, {}
+		p1.x, p1.y, p1.z, p2.x, p2.y, p2.z = string.match(param,
+				"^([%d.-]+)[, ] *([%d.-]+)[, ] *([%d.-]+) +"
+				.. "([%d.-]+)[, ] *([%d.-]+)[, ] *([%d.-]+)$")
+		for _, p in ipairs({p1, p2}) do
+			p.x, p.y, p.z = tonumber(p.x), tonumber(p.y), tonumber(p.z)
+			if not (p.x and p.y and p.z) then
+				return false, "Invalid parameters (see /help pregenerate)"
+			end
+		end
+		core.pregenerate(p1, p2)
+		core.log("action", name .. " starts pregenerating "
+				.. core.pos_to_string(p1) .. " to " .. core.pos_to_string(p2))
+		return true, "Pregenerating " .. core.pos_to_string(p1)
+				.. " to " .. core.pos_to_string(p2)
+				.. ".  Use /pregenerate to see the progress."
+	end,
+})
+
+core.register_chatcommand("forceloads", {
+	description = "show the forceloaded blocks of each mod",
+	privs = {server=true},
+	func = function(name, param)
+		local stats = core.get_forceload_stats()
+		local lines = {}
+		for _, kind in ipairs({"normal", "lite"}) do
+			local s = stats[kind]
+			local mods = {}
+			for modname, count in pairs(s.mods) do
+				table.insert(mods, modname .. " " .. count)
+			end
+			table.sort(mods)
+			table.insert(lines, kind .. ": " .. s.blocks .. "/" .. s.limit
+					.. " blocks" .. (#mods > 0 and
+					" (" .. table.concat(mods, ", ") .. ")" or ""))
+		end
+		return true, table.concat(lines, "\n")
 	end,
 })
 
@@ -4,8 +4,19 @@ local forceload_free_block = core.forceload_free_block
 core.forceload_block = nil
 core.forceload_free_block = nil
 
-local blocks_forceloaded
-local total_forceloaded = 0
+-- Forceloaded blocks of each kind: normal ones are active, lite ones are
+-- only kept loaded and run their node timers.
+-- blocks[hash] = {count = n, mods = {[modname] = n}}; mods[modname] is the
+-- number of blocks of the kind that the mod forceloads
+local forceloaded = {
+	normal = {blocks = {}, total = 0, mods = {}},
+	lite = {blocks = {}, total = 0, mods = {}},
+}
+
+local limit_settings = {
+	normal = {"max_forceloaded_blocks", 16},
+	lite = {"max_forceloaded_lite_blocks", 256},
+}
 
 local BLOCKSIZE = 16
 local function get_blockpos(pos)
@@ -15,34 +26,114 @@ local function get_blockpos(pos)
 		z = math.floor(pos.z/BLOCKSIZE)}
 end
 
-function core.forceload_block(pos)
-	local blockpos = get_blockpos(pos)
-	local hash = core.hash_node_position(blockpos)
-	if blocks_forceloaded[hash] ~= nil then
-		blocks_forceloaded[hash] = blocks_forceloaded[hash] + 1
-		return true
-	else
-		if total_forceloaded >= (tonumber(core.setting_get("max_forceloaded_blocks")) or 16) then
+-- Forceloads are usually asked for from callbacks, when there is no
+-- current mod, so the mod is found from the source file of the caller of
+-- core.forceload_block()
+local modpaths
+local function get_calling_mod()
+	if not modpaths then
+		modpaths = {}
+		for _, modname in ipairs(core.get_modnames()) do
+			local path = core.get_modpath(modname)
+			if path then
+				table.insert(modpaths, {modname, path .. DIR_DELIM})
+			end
+		end
+		-- The longest path first, for mods inside modpacks
+		table.sort(modpaths, function(a, b) return #a[2] > #b[2] end)
+	end
+	local info = debug.getinfo(3, "S")
+	local source = info and info.source:gsub("^@", "") or ""
+	for _, mod in ipairs(modpaths) do
+		if source:sub(1, #mod[2]) == mod[2] then
+			return mod[1]
+		end
+	end
+	return core.get_current_modname() or "??"
+end
+
+local function get_limit(kind)
+	local setting = limit_settings[kind]
+	return tonumber(core.setting_get(setting[1])) or setting[2]
+end
+
+local function add_block(kind, hash, modname)
+	local list = forceloaded[kind]
+	local block = list.blocks[hash]
+	if not block then
+		block = {count = 0, mods = {}}
+		list.blocks[hash] = block
+		list.total = list.total + 1
+	end
+	block.count = block.count + 1
+	if not block.mods[modname] then
+		block.mods[modname] = 0
+		list.mods[modname] = (list.mods[modname] or 0) + 1
+	end
+	block.mods[modname] = block.mods[modname] + 1
+end
+
+function core.forceload_block(pos, lite)
+	local kind = lite and "lite" or "normal"
+	local list = forceloaded[kind]
+	local modname = get_calling_mod()
+	local hash = core.hash_node_position(get_blockpos(pos))
+	local block = list.blocks[hash]
+	if not block or not block.mods[modname] then
+		local quota = tonumber(core.setting_get(
+				"max_forceloaded_blocks_per_mod")) or 0
+		if quota > 0 and (list.mods[modname] or 0) >= quota then
 			return false
 		end
-		total_forceloaded = total_forceloaded+1
-		blocks_forceloaded[hash] = 1
-		forceload_block(blockpos)
-		return true
+	end
+	if not block then
+		if list.total >= get_limit(kind) then
+			return false
+		end
+		forceload_block(core.get_position_from_hash(hash), lite)
+	end
+	add_block(kind, hash, modname)
+	return true
+end
+
+function core.forceload_free_block(pos, lite)
+	local kind = lite and "lite" or "normal"
+	local list = forceloaded[kind]
+	local hash = core.hash_node_position(get_blockpos(pos))
+	local block = list.blocks[hash]
+	if not block then return end
+	-- Blocks forceloaded by one mod may be freed by another
+	local modname = get_calling_mod()
+	if not block.mods[modname] then
+		modname = next(block.mods)
+	end
+	block.count = block.count - 1
+	block.mods[modname] = block.mods[modname] - 1
+	if block.mods[modname] == 0 then
+		block.mods[modname] = nil
+		list.mods[modname] = list.mods[modname] - 1
+		if list.mods[modname] == 0 then
+			list.mods[modname] = nil
+		end
+	end
+	if block.count == 0 then
+		list.blocks[hash] = nil
+		list.total = list.total - 1
+		forceload_free_block(core.get_position_from_hash(hash), lite)
 	end
 end
 
-function core.forceload_free_block(pos)
-	local blockpos = get_blockpos(pos)
-	local hash = core.hash_node_position(blockpos)
-	if blocks_forceloaded[hash] == nil then return end
-	if blocks_forceloaded[hash] > 1 then
-		blocks_forceloaded[hash] = blocks_forceloaded[hash] - 1
-	else
-		total_forceloaded = total_forceloaded-1
-		blocks_forceloaded[hash] = nil
-		forceload_free_block(blockpos)
+function core.get_forceload_stats()
+	local stats = {}
+	for kind, list in pairs(forceloaded) do
+		local mods = {}
+		for modname, count in pairs(list.mods) do
+			mods[modname] = count
+		end
+		stats[kind] = {blocks = list.total, limit = get_limit(kind),
+				mods = mods}
 	end
+	return stats
 end
 
 -- Keep the forceloaded areas after restart
@@ -62,18 +153,35 @@ local function write_file(filename, table)
 	f:close()
 end
 
-blocks_forceloaded = read_file(wpath.."/force_loaded.txt")
-for _, __ in pairs(blocks_forceloaded) do
-	total_forceloaded = total_forceloaded + 1
+local files = {
+	normal = wpath.."/force_loaded.txt",
+	lite = wpath.."/force_loaded_lite.txt",
+}
+
+for kind, filename in pairs(files) do
+	for hash, block in pairs(read_file(filename)) do
+		-- Older worlds only have the count of each block
+		if type(block) == "number" then
+			block = {count = block, mods = {["??"] = block}}
+		end
+		for modname, count in pairs(block.mods) do
+			for i = 1, count do
+				add_block(kind, hash, modname)
+			end
+		end
+	end
 end
 
 core.after(5, function()
-	for hash, _ in pairs(blocks_forceloaded) do
-		local blockpos = core.get_position_from_hash(hash)
-		forceload_block(blockpos)
+	for kind, list in pairs(forceloaded) do
+		for hash, _ in pairs(list.blocks) do
+			forceload_block(core.get_position_from_hash(hash), kind == "lite")
+		end
 	end
 end)
 
 core.register_on_shutdown(function()
-	write_file(wpath.."/force_loaded.txt", blocks_forceloaded)
+	for kind, filename in pairs(files) do
+		write_file(filename, forceloaded[kind].blocks)
+	end
 end)
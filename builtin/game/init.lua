@@ -15,6 +15,7 @@ end
 dofile(gamepath.."item_entity.lua")
 dofile(gamepath.."deprecated.lua")
 dofile(gamepath.."misc.lua")
+dofile(commonpath.."async_event.lua")
 dofile(gamepath.."privileges.lua")
 dofile(gamepath.."auth.lua")
 dofile(gamepath.."chatcommands.lua")
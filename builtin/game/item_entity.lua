@@ -33,6 +33,8 @@ core.register_entity(":__builtin:item", {
 	itemstring = '',
 	physical_state = true,
 	age = 0,
+	-- Items lying still only need to age
+	idle_step_interval = 1,
 
 	set_item = function(self, itemstring)
 		self.itemstring = itemstring
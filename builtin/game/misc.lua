@@ -136,3 +136,35 @@ function core.record_protection_violation(pos, name)
 	end
 end
 
+
+-- Called by the engine with the ids of the entities of one kind to step
+-- and the time to step each of them by; returns a table with true for the
+-- ones that have no on_step
+function core.luaentity_step_batch(ids, dtimes)
+	local luaentities = core.luaentities
+	local without_on_step = {}
+	for i = 1, #ids do
+		local entity = luaentities[ids[i]]
+		local on_step = entity.on_step
+		if on_step then
+			on_step(entity, dtimes[i])
+		else
+			without_on_step[i] = true
+		end
+	end
+	return without_on_step
+end
+
+
+-- Called by the emerge thread with the VoxelManip of a generated chunk
+-- before it is put on the map; the stages share one array of the node
+-- ids, which is reused for every chunk
+local mapgen_stage_data = {}
+function core.run_mapgen_stages(vm, emin, emax, minp, maxp, blockseed)
+	local area = VoxelArea:new({MinEdge = emin, MaxEdge = emax})
+	local data = vm:get_data(mapgen_stage_data)
+	for _, func in ipairs(core.registered_mapgen_stages) do
+		func(minp, maxp, blockseed, data, area, vm)
+	end
+	vm:set_data(data)
+end
@@ -19,6 +19,7 @@ local replacement_table = {
 	"register_on_dignode",
 	"register_on_punchnode",
 	"register_on_generated",
+	"register_mapgen_stage",
 	"register_on_newplayer",
 	"register_on_dieplayer",
 	"register_on_respawnplayer",
@@ -144,7 +145,7 @@ end
 
 --------------------------------------------------------------------------------
 local function build_callback(log_id, fct)
-	return function( toregister )
+	return function(toregister, ...)
 		local modname = core.get_current_modname()
 		
 		fct(function(...)
@@ -155,7 +156,8 @@ local function build_callback(log_id, fct)
 			local delta = core.get_us_time() - starttime
 			mod_statistics.log_time(log_id, modname, delta)
 			return r0, r1, r2, r3, r4, r5, r6, r7, r8, r9
-			end
+			end,
+			...
 		)
 	end
 end
@@ -70,6 +70,8 @@ local function check_modname_prefix(name)
 end
 
 function core.register_abm(spec)
+	-- Named by the mod in the reports of slow server steps
+	spec.mod_origin = core.get_current_modname() or "??"
 	-- Add to core.registered_abms
 	core.registered_abms[#core.registered_abms+1] = spec
 end
@@ -375,20 +377,48 @@ end
 -- Callback registration
 --
 
+-- Mods and sources of the callbacks, for the callback statistics
+core.callback_origins = {}
+
+local function set_callback_origin(func)
+	local info = debug.getinfo(func, "S")
+	core.callback_origins[func] = {
+		mod = core.get_current_modname() or "??",
+		source = info and info.short_src..":"..info.linedefined,
+	}
+end
+
 local function make_registration()
 	local t = {}
-	local registerfunc = function(func) table.insert(t, func) end
+	local registerfunc = function(func)
+		table.insert(t, func)
+		set_callback_origin(func)
+	end
 	return t, registerfunc
 end
 
 local function make_registration_reverse()
 	local t = {}
-	local registerfunc = function(func) table.insert(t, 1, func) end
+	local registerfunc = function(func)
+		table.insert(t, 1, func)
+		set_callback_origin(func)
+	end
 	return t, registerfunc
 end
 
 core.registered_on_chat_messages, core.register_on_chat_message = make_registration()
-core.registered_globalsteps, core.register_globalstep = make_registration()
+core.registered_globalsteps = {}
+-- Run by the engine only when their interval has passed
+core.registered_interval_globalsteps = {}
+function core.register_globalstep(func, interval)
+	if interval and interval > 0 then
+		table.insert(core.registered_interval_globalsteps,
+				{func = func, interval = interval})
+	else
+		table.insert(core.registered_globalsteps, func)
+	end
+	set_callback_origin(func)
+end
 core.registered_playerevents, core.register_playerevent = make_registration()
 core.registered_on_mapgen_inits, core.register_on_mapgen_init = make_registration()
 core.registered_on_shutdown, core.register_on_shutdown = make_registration()
@@ -396,6 +426,7 @@ core.registered_on_punchnodes, core.register_on_punchnode = make_registration()
 core.registered_on_placenodes, core.register_on_placenode = make_registration()
 core.registered_on_dignodes, core.register_on_dignode = make_registration()
 core.registered_on_generateds, core.register_on_generated = make_registration()
+core.registered_mapgen_stages, core.register_mapgen_stage = make_registration()
 core.registered_on_newplayers, core.register_on_newplayer = make_registration()
 core.registered_on_dieplayers, core.register_on_dieplayer = make_registration()
 core.registered_on_respawnplayers, core.register_on_respawnplayer = make_registration()
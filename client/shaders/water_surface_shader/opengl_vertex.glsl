@@ -4,6 +4,7 @@ uniform mat4 mTransWorld;
 uniform mat4 mWorld;
 
 uniform float dayNightRatio;
+uniform float blendDayNight;
 uniform vec3 eyePosition;
 uniform float animationTimer;
 
@@ -28,6 +29,41 @@ float smoothTriangleWave( float x ) {
   return smoothCurve( triangleWave( x ) ) * 2.0 - 1.0;
 }
 
+// Like finalColorBlend() in mapblock_mesh.cpp, for the block meshes
+// that have the day light in red and the night light in green. The
+// divisions of the moonlight round down with floor(), where the integer
+// divisions there truncate; when the night light is brighter than the
+// day light, that is one level off.
+vec4 blendDayNightColor(vec4 color)
+{
+	float day = floor(color.r * 255.0 + 0.5);
+	float night = floor(color.g * 255.0 + 0.5);
+	float rg = floor(day * dayNightRatio + night * (1.0 - dayNightRatio));
+	float b = rg;
+
+	// Moonlight is blue
+	b += floor((day - night) / 13.0);
+	rg -= floor((day - night) / 23.0);
+
+	// Emphase blue a bit in darker places
+	float i = floor(b / 8.0);
+	if (i < 1.0)
+		b += 1.0;
+	else if (i < 2.0)
+		b += 4.0;
+	else if (i < 5.0)
+		b += 6.0;
+	else
+		b += max(10.0 - i, 0.0);
+	b = clamp(b, 0.0, 255.0);
+
+	// Artificial light is yellow-ish
+	rg += clamp((floor(night / 16.0) - 10.0) * 5.0, 0.0, 15.0);
+	rg = clamp(rg, 0.0, 255.0);
+
+	return vec4(rg / 255.0, rg / 255.0, b / 255.0, color.a);
+}
+
 void main(void)
 {
 	gl_TexCoord[0] = gl_MultiTexCoord0;
@@ -57,6 +93,16 @@ void main(void)
 	gl_Position = mWorldViewProj * gl_Vertex;
 #endif
 
+	// Tiles animated here have their whole texture with the frame count,
+	// the length of a frame in ms and the first frame in the third column
+	// of the texture matrix
+	float frameCount = gl_TextureMatrix[0][2][0];
+	if (frameCount > 1.0) {
+		float frame = mod(floor(animationTimer * 100000.0 / gl_TextureMatrix[0][2][1])
+				+ gl_TextureMatrix[0][2][2], frameCount);
+		gl_TexCoord[0].t = (gl_TexCoord[0].t + frame) / frameCount;
+	}
+
 	vPosition = gl_Position.xyz;
 	worldPosition = (mWorld * gl_Vertex).xyz;
 	vec3 sunPosition = vec3 (0.0, eyePosition.y * BS + 900.0, 0.0);
@@ -97,5 +143,8 @@ void main(void)
 	eyeVec = (gl_ModelViewMatrix * gl_Vertex).xyz;
 	tsEyeVec = eyeVec * tbnMatrix;
 
-	gl_FrontColor = gl_BackColor = gl_Color;
+	if (blendDayNight > 0.5)
+		gl_FrontColor = gl_BackColor = blendDayNightColor(gl_Color);
+	else
+		gl_FrontColor = gl_BackColor = gl_Color;
 }
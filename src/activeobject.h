@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irr_aabb3d.h"
 #include <string>
+#include <vector>
 
 #define ACTIVEOBJECT_TYPE_INVALID 0
 // Other types are defined in content_object.h
@@ -31,12 +32,102 @@ struct ActiveObjectMessage
 	ActiveObjectMessage(u16 id_, bool reliable_=true, std::string data_=""):
 		id(id_),
 		reliable(reliable_),
-		datastring(data_)
+		datastring(data_),
+		is_position(false)
 	{}
 
 	u16 id;
 	bool reliable;
 	std::string datastring;
+	// If not empty, sent instead of datastring to clients with protocol
+	// version 26 or later
+	std::string packed_datastring;
+	// Position updates replace the earlier ones of the object and are
+	// sent less often to clients that are far away
+	bool is_position;
+};
+
+/*
+	The messages that the active objects queued during a server step. The
+	payloads are appended to one buffer and the entries only keep their
+	offsets in it. Both keep their memory from step to step, so passing
+	a message on allocates nothing once they have grown.
+*/
+class ActiveObjectMessageBuffer
+{
+public:
+	struct Entry
+	{
+		u16 id;
+		bool reliable;
+		bool is_position;
+		u32 data_offset;
+		u32 data_size;
+		// packed_size is 0 if the message has no packed_datastring
+		u32 packed_offset;
+		u32 packed_size;
+	};
+
+	void add(const ActiveObjectMessage &aom)
+	{
+		Entry e;
+		e.id = aom.id;
+		e.reliable = aom.reliable;
+		e.is_position = aom.is_position;
+		e.data_offset = m_payloads.size();
+		e.data_size = aom.datastring.size();
+		m_payloads.append(aom.datastring);
+		e.packed_offset = m_payloads.size();
+		e.packed_size = aom.packed_datastring.size();
+		m_payloads.append(aom.packed_datastring);
+		m_entries.push_back(e);
+	}
+
+	u32 size() const
+	{
+		return m_entries.size();
+	}
+	bool empty() const
+	{
+		return m_entries.empty();
+	}
+	const Entry & operator[](u32 i) const
+	{
+		return m_entries[i];
+	}
+
+	// The payload of an entry for a client with the protocol version
+	const char * getPayload(const Entry &e, u16 net_proto_version,
+			u32 &size) const
+	{
+		if(e.packed_size != 0 && net_proto_version >= 26){
+			size = e.packed_size;
+			return m_payloads.data() + e.packed_offset;
+		}
+		size = e.data_size;
+		return m_payloads.data() + e.data_offset;
+	}
+
+	// A copy of an entry that can be kept after clear()
+	ActiveObjectMessage getMessage(const Entry &e) const
+	{
+		ActiveObjectMessage aom(e.id, e.reliable,
+				m_payloads.substr(e.data_offset, e.data_size));
+		aom.packed_datastring = m_payloads.substr(e.packed_offset,
+				e.packed_size);
+		aom.is_position = e.is_position;
+		return aom;
+	}
+
+	void clear()
+	{
+		m_payloads.clear();
+		m_entries.clear();
+	}
+
+private:
+	std::string m_payloads;
+	std::vector<Entry> m_entries;
 };
 
 /*
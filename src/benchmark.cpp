@@ -0,0 +1,586 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "benchmark.h"
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include "server.h"
+#include "environment.h"
+#include "emerge.h"
+#include "mapgen.h"
+#include "map.h"
+#include "mapblock.h"
+#include "voxel.h"
+#include "nodedef.h"
+#include "noise.h"
+#include "collision.h"
+#include "connection.h"
+#include "serialization.h"
+#include "subgame.h"
+#include "filesys.h"
+#include "porting.h"
+#include "version.h"
+#include "log.h"
+#include "json/json.h"
+#include "util/serialize.h"
+#include "util/numeric.h"
+#include "util/string.h"
+
+// Each benchmark is repeated with more iterations until a run takes this
+// long, then the best of BENCHMARK_RUNS runs of that length is taken
+#define BENCHMARK_MIN_TIME_US 200000
+#define BENCHMARK_MAX_ITERATIONS 10000000
+#define BENCHMARK_RUNS 3
+
+#define BENCHMARK_PROTOCOL_ID 0x4f457403
+#define BENCHMARK_PORT 30099
+#define BENCHMARK_PACKET_SIZE 1024
+#define BENCHMARK_SPLIT_PACKET_SIZE 16384
+
+/*
+	A pair of connections talking to each other on the loopback interface
+*/
+struct BenchmarkLoopback
+{
+	BenchmarkLoopback():
+		server(BENCHMARK_PROTOCOL_ID, 512, 30.0, false),
+		client(BENCHMARK_PROTOCOL_ID, 512, 30.0, false),
+		server_peer_id(0)
+	{}
+
+	// Returns false if the client can't connect
+	bool connect()
+	{
+		server.SetTimeoutMs(10);
+		client.SetTimeoutMs(10);
+		server.Serve(Address(0,0,0,0, BENCHMARK_PORT));
+		client.Connect(Address(127,0,0,1, BENCHMARK_PORT));
+
+		// The server only learns of the peer when it sends something
+		SharedBuffer<u8> hello(1);
+		hello[0] = 0;
+		for(u32 i = 0; i < 500 && !client.Connected(); i++){
+			try{
+				u16 peer_id;
+				SharedBuffer<u8> data;
+				client.Receive(peer_id, data);
+			}
+			catch(con::NoIncomingDataException &e){
+			}
+		}
+		if(!client.Connected())
+			return false;
+		client.Send(PEER_ID_SERVER, 0, hello, true);
+		for(u32 i = 0; i < 500 && server_peer_id == 0; i++){
+			try{
+				SharedBuffer<u8> data;
+				server.Receive(server_peer_id, data);
+			}
+			catch(con::NoIncomingDataException &e){
+			}
+		}
+		return server_peer_id != 0;
+	}
+
+	con::Connection server;
+	con::Connection client;
+	u16 server_peer_id;
+};
+
+/*
+	The state shared by the benchmarks
+*/
+struct BenchmarkContext
+{
+	Server *server;
+	ServerEnvironment *env;
+	ServerMap *map;
+	INodeDefManager *ndef;
+
+	// A block of the generated chunk with the surface going through
+	// it, and the highest walkable node of its column
+	v3s16 blockpos;
+	MapBlock *block;
+	v3f surface_pos;
+
+	BenchmarkLoopback *loopback;
+};
+
+class BenchmarkFailed : public BaseException {
+public:
+	BenchmarkFailed(const std::string &s):
+		BaseException(s)
+	{}
+};
+
+// Each benchmark does the given number of operations and returns the
+// time the operations took, without the preparations
+typedef u32 (*BenchmarkFunc)(BenchmarkContext &ctx, u32 iterations);
+
+/*
+	Voxel manipulators
+*/
+
+static u32 bench_voxelmanip_add_area(BenchmarkContext &ctx, u32 iterations)
+{
+	// Grows the area block by block like the lazy emerging of the
+	// voxel algorithms does
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		VoxelManipulator vm;
+		for(s16 z = -1; z <= 1; z++)
+		for(s16 y = -1; y <= 1; y++)
+		for(s16 x = -1; x <= 1; x++){
+			v3s16 p = (ctx.blockpos + v3s16(x,y,z)) * MAP_BLOCKSIZE;
+			vm.addArea(VoxelArea(p, p + v3s16(1,1,1) * (MAP_BLOCKSIZE - 1)));
+		}
+	}
+	return porting::getTimeUs() - t1;
+}
+
+static u32 bench_voxelmanip_initial_emerge(BenchmarkContext &ctx,
+		u32 iterations)
+{
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		ManualMapVoxelManipulator vm(ctx.map);
+		vm.initialEmerge(ctx.blockpos - v3s16(1,1,1),
+				ctx.blockpos + v3s16(1,1,1), false);
+	}
+	return porting::getTimeUs() - t1;
+}
+
+static u32 bench_voxelmanip_blit_back(BenchmarkContext &ctx, u32 iterations)
+{
+	ManualMapVoxelManipulator vm(ctx.map);
+	vm.initialEmerge(ctx.blockpos - v3s16(1,1,1),
+			ctx.blockpos + v3s16(1,1,1), false);
+
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		std::map<v3s16, MapBlock*> modified_blocks;
+		vm.blitBackAll(&modified_blocks);
+	}
+	return porting::getTimeUs() - t1;
+}
+
+/*
+	Map blocks
+*/
+
+static u32 bench_mapblock_serialize(BenchmarkContext &ctx, u32 iterations)
+{
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		std::ostringstream os(std::ios_base::binary);
+		ctx.block->serialize(os, SER_FMT_VER_HIGHEST_WRITE, true);
+	}
+	return porting::getTimeUs() - t1;
+}
+
+static u32 bench_mapblock_deserialize(BenchmarkContext &ctx, u32 iterations)
+{
+	std::ostringstream os(std::ios_base::binary);
+	ctx.block->serialize(os, SER_FMT_VER_HIGHEST_WRITE, true);
+	std::string data = os.str();
+
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		std::istringstream is(data, std::ios_base::binary);
+		MapBlock block(ctx.map, ctx.blockpos, ctx.server);
+		block.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, true);
+	}
+	return porting::getTimeUs() - t1;
+}
+
+/*
+	Compression, of the nodes of a block laid out like on disk
+*/
+
+static std::string get_block_nodes(MapBlock *block)
+{
+	u32 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+	std::string buf(nodecount * 4, 0);
+	u32 i = 0;
+	bool valid;
+	for(s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for(s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for(s16 x = 0; x < MAP_BLOCKSIZE; x++, i++){
+		MapNode n = block->getNodeNoCheck(x, y, z, &valid);
+		writeU16((u8 *)&buf[i * 2], n.getContent());
+		buf[nodecount * 2 + i] = n.param1;
+		buf[nodecount * 3 + i] = n.param2;
+	}
+	return buf;
+}
+
+static u32 bench_zlib_compress(BenchmarkContext &ctx, u32 iterations)
+{
+	std::string data = get_block_nodes(ctx.block);
+
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		std::ostringstream os(std::ios_base::binary);
+		compressZlib(data, os);
+	}
+	return porting::getTimeUs() - t1;
+}
+
+static u32 bench_zlib_decompress(BenchmarkContext &ctx, u32 iterations)
+{
+	std::ostringstream compressed(std::ios_base::binary);
+	compressZlib(get_block_nodes(ctx.block), compressed);
+	std::string data = compressed.str();
+
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		std::istringstream is(data, std::ios_base::binary);
+		std::ostringstream os(std::ios_base::binary);
+		decompressZlib(is, os);
+	}
+	return porting::getTimeUs() - t1;
+}
+
+/*
+	Noise maps of the size of a mapchunk
+*/
+
+static u32 bench_noise_perlin_map_2d(BenchmarkContext &ctx, u32 iterations)
+{
+	// Like the terrain base of mapgen v6
+	NoiseParams np(-4, 20.0, v3f(250.0, 250.0, 250.0), 82341, 5, 0.6);
+	Noise noise(&np, 1234, 80, 80);
+
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++)
+		noise.perlinMap2D(i * 80, 0);
+	return porting::getTimeUs() - t1;
+}
+
+static u32 bench_noise_perlin_map_3d(BenchmarkContext &ctx, u32 iterations)
+{
+	// Like the mountains of mapgen v7
+	NoiseParams np(-0.6, 1.0, v3f(250.0, 350.0, 250.0), 5333, 5, 0.68);
+	Noise noise(&np, 1234, 80, 80, 80);
+
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++)
+		noise.perlinMap3D(i * 80, 0, 0);
+	return porting::getTimeUs() - t1;
+}
+
+/*
+	Collision of a player sized object walking on the generated terrain
+*/
+
+static u32 bench_collision_move_simple(BenchmarkContext &ctx, u32 iterations)
+{
+	aabb3f box(-BS * 0.30, 0.0, -BS * 0.30, BS * 0.30, BS * 1.75, BS * 0.30);
+	v3f start_pos = ctx.surface_pos + v3f(0, BS * 0.5, 0);
+
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		v3f pos = start_pos;
+		v3f speed(BS * 4.0, -BS * 2.0, BS * 2.0);
+		v3f accel(0, -9.81 * BS, 0);
+		collisionMoveSimple(ctx.env, ctx.server, BS * 0.25, box,
+				BS * 0.6, 0.05, pos, speed, accel);
+	}
+	return porting::getTimeUs() - t1;
+}
+
+/*
+	ABMs of the game, as applied to a block activated after an hour
+*/
+
+static u32 bench_abm_activate_block(BenchmarkContext &ctx, u32 iterations)
+{
+	// The ABMs change the block, so the same one is restored for every
+	// iteration
+	std::ostringstream os(std::ios_base::binary);
+	ctx.block->serialize(os, SER_FMT_VER_HIGHEST_WRITE, true);
+	std::string data = os.str();
+
+	u32 time_us = 0;
+	for(u32 i = 0; i < iterations; i++){
+		std::istringstream is(data, std::ios_base::binary);
+		ctx.block->deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, true);
+
+		u32 t1 = porting::getTimeUs();
+		ctx.env->activateBlock(ctx.block, 3600);
+		time_us += porting::getTimeUs() - t1;
+	}
+	return time_us;
+}
+
+/*
+	Connection
+*/
+
+static u32 bench_con_reliable_buffer(BenchmarkContext &ctx, u32 iterations)
+{
+	// Reliable packets arriving in reverse order, in windows of 64, all
+	// of them after the one the receiver waits for, which isn't buffered
+	Address address(127,0,0,1, 10);
+	std::vector<con::BufferedPacket> packets;
+	for(u16 seqnum = 1; seqnum <= 64; seqnum++){
+		SharedBuffer<u8> data(BENCHMARK_PACKET_SIZE);
+		memset(*data, seqnum, BENCHMARK_PACKET_SIZE);
+		SharedBuffer<u8> reliable = con::makeReliablePacket(data, seqnum);
+		packets.push_back(con::makePacket(address, reliable,
+				BENCHMARK_PROTOCOL_ID, 2, 0));
+	}
+
+	con::ReliablePacketBuffer buffer;
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i += packets.size()){
+		u32 count = MYMIN(iterations - i, packets.size());
+		for(u32 j = count; j > 0; j--)
+			buffer.insert(packets[j - 1], 0);
+		for(u32 j = 0; j < count; j++)
+			buffer.popFirst();
+	}
+	return porting::getTimeUs() - t1;
+}
+
+static u32 bench_con_split_packet(BenchmarkContext &ctx, u32 iterations)
+{
+	Address address(127,0,0,1, 10);
+	SharedBuffer<u8> data(BENCHMARK_SPLIT_PACKET_SIZE);
+	for(u32 i = 0; i < BENCHMARK_SPLIT_PACKET_SIZE; i++)
+		data[i] = i & 0xff;
+
+	con::IncomingSplitBuffer buffer;
+	u32 t1 = porting::getTimeUs();
+	for(u32 i = 0; i < iterations; i++){
+		std::list<SharedBuffer<u8> > chunks =
+				con::makeSplitPacket(data, 500, i & 0xffff);
+		SharedBuffer<u8> whole;
+		for(std::list<SharedBuffer<u8> >::iterator
+				j = chunks.begin(); j != chunks.end(); ++j)
+		{
+			con::BufferedPacket p = con::makePacket(address, *j,
+					BENCHMARK_PROTOCOL_ID, 2, 0);
+			whole = buffer.insert(p, true);
+		}
+		if(whole.getSize() != BENCHMARK_SPLIT_PACKET_SIZE)
+			throw BenchmarkFailed("split packet was not put together");
+	}
+	return porting::getTimeUs() - t1;
+}
+
+static u32 bench_con_loopback(BenchmarkContext &ctx, u32 iterations)
+{
+	if(ctx.loopback == NULL){
+		ctx.loopback = new BenchmarkLoopback();
+		if(!ctx.loopback->connect())
+			throw BenchmarkFailed("can't connect to port "
+					+ itos(BENCHMARK_PORT));
+	}
+	BenchmarkLoopback *loopback = ctx.loopback;
+
+	SharedBuffer<u8> data(BENCHMARK_PACKET_SIZE);
+	memset(*data, 1, BENCHMARK_PACKET_SIZE);
+
+	// The packets are sent while the earlier ones are received, as the
+	// window of reliable packets is limited
+	u32 t1 = porting::getTimeUs();
+	u32 received = 0;
+	u32 idle = 0;
+	for(u32 sent = 0; received < iterations; ){
+		for(u32 i = 0; i < 64 && sent < iterations; i++, sent++)
+			loopback->client.Send(PEER_ID_SERVER, 0, data, true);
+		try{
+			for(;;){
+				u16 peer_id;
+				SharedBuffer<u8> packet;
+				loopback->server.Receive(peer_id, packet);
+				received++;
+				idle = 0;
+			}
+		}
+		catch(con::NoIncomingDataException &e){
+			if(++idle > 1000)
+				throw BenchmarkFailed("packets were lost");
+		}
+	}
+	return porting::getTimeUs() - t1;
+}
+
+static const struct {
+	const char *name;
+	BenchmarkFunc func;
+} benchmarks[] = {
+	{"voxelmanip_add_area",       bench_voxelmanip_add_area},
+	{"voxelmanip_initial_emerge", bench_voxelmanip_initial_emerge},
+	{"voxelmanip_blit_back",      bench_voxelmanip_blit_back},
+	{"mapblock_serialize",        bench_mapblock_serialize},
+	{"mapblock_deserialize",      bench_mapblock_deserialize},
+	{"zlib_compress",             bench_zlib_compress},
+	{"zlib_decompress",           bench_zlib_decompress},
+	{"noise_perlin_map_2d",       bench_noise_perlin_map_2d},
+	{"noise_perlin_map_3d",       bench_noise_perlin_map_3d},
+	{"collision_move_simple",     bench_collision_move_simple},
+	{"abm_activate_block",        bench_abm_activate_block},
+	{"con_reliable_buffer",       bench_con_reliable_buffer},
+	{"con_split_packet",          bench_con_split_packet},
+	{"con_loopback",              bench_con_loopback},
+};
+
+struct BenchmarkResult
+{
+	std::string name;
+	u32 iterations;
+	double ns_per_op;
+};
+
+static BenchmarkResult run_benchmark(BenchmarkContext &ctx,
+		const char *name, BenchmarkFunc func)
+{
+	BenchmarkResult result;
+	result.name = name;
+
+	u32 iterations = 1;
+	u32 time_us = func(ctx, iterations);
+	while(time_us < BENCHMARK_MIN_TIME_US &&
+			iterations < BENCHMARK_MAX_ITERATIONS){
+		// Aim a bit beyond the minimum, but don't trust the first short
+		// runs too much
+		float factor = time_us == 0 ? 100 :
+				BENCHMARK_MIN_TIME_US * 1.2 / time_us;
+		factor = rangelim(factor, 2, 100);
+		iterations = MYMIN(iterations * factor, BENCHMARK_MAX_ITERATIONS);
+		time_us = func(ctx, iterations);
+	}
+	for(u32 i = 1; i < BENCHMARK_RUNS; i++)
+		time_us = MYMIN(time_us, func(ctx, iterations));
+
+	result.iterations = iterations;
+	result.ns_per_op = time_us * 1000.0 / iterations;
+	return result;
+}
+
+// Finds a block the surface goes through in the column of the origin
+static bool find_surface(BenchmarkContext &ctx, s16 y_min, s16 y_max)
+{
+	for(s16 y = y_max; y >= y_min; y--){
+		v3s16 p(0, y, 0);
+		if(!ctx.ndef->get(ctx.map->getNodeNoEx(p)).walkable)
+			continue;
+		ctx.surface_pos = intToFloat(p, BS) + v3f(0, BS * 0.5, 0);
+		ctx.blockpos = getNodeBlockPos(p);
+		ctx.block = ctx.map->getBlockNoCreateNoEx(ctx.blockpos);
+		return ctx.block != NULL;
+	}
+	return false;
+}
+
+bool run_benchmarks(const SubgameSpec &gamespec,
+		const std::string &output_path, const std::string &filter)
+{
+	std::string world_path = fs::TempPath() + DIR_DELIM
+		+ "minetest-benchmark";
+	fs::RecursiveDelete(world_path);
+
+	bool success = true;
+	std::vector<BenchmarkResult> results;
+	std::string mg_name;
+	{
+		Server server(world_path, gamespec, false, false);
+		EmergeManager *emerge = server.getEmergeManager();
+
+		BenchmarkContext ctx;
+		ctx.server = &server;
+		ctx.env = &server.getEnv();
+		ctx.map = &ctx.env->getServerMap();
+		ctx.ndef = server.getNodeDefManager();
+		ctx.block = NULL;
+		ctx.loopback = NULL;
+		mg_name = emerge->params.mg_name;
+
+		// The chunk at the origin, generated like EmergeThread does
+		BlockMakeData data;
+		std::map<v3s16, MapBlock *> modified_blocks;
+		if(!ctx.map->initBlockMake(&data, v3s16(0,0,0))){
+			errorstream<<"Benchmark: can't generate the mapchunk at the"
+					" origin"<<std::endl;
+			success = false;
+		} else {
+			emerge->mapgen[0]->makeChunk(&data);
+			data.vmanip->getDayNightDiffs(data.nodedef,
+					data.daynight_diffs);
+			ctx.map->finishBlockMake(&data, modified_blocks);
+		}
+		if(success && !find_surface(ctx, data.blockpos_min.Y * MAP_BLOCKSIZE,
+				(data.blockpos_max.Y + 1) * MAP_BLOCKSIZE - 1)){
+			errorstream<<"Benchmark: the mapchunk at the origin of mapgen "
+					<<mg_name<<" has no surface"<<std::endl;
+			success = false;
+		}
+
+		dstream<<"Benchmark: mapgen "<<mg_name<<", block "
+				<<PP(ctx.blockpos)<<std::endl;
+		for(size_t i = 0; success && i != ARRLEN(benchmarks); i++){
+			if(!filter.empty() &&
+					std::string(benchmarks[i].name).find(filter) ==
+					std::string::npos)
+				continue;
+			try{
+				BenchmarkResult result = run_benchmark(ctx,
+						benchmarks[i].name, benchmarks[i].func);
+				dstream<<"  "<<padStringRight(result.name, 28)
+						<<std::setw(14)<<result.ns_per_op
+						<<" ns/op ("<<result.iterations
+						<<" iterations)"<<std::endl;
+				results.push_back(result);
+			}
+			catch(BaseException &e){
+				errorstream<<"Benchmark "<<benchmarks[i].name
+						<<" failed: "<<e.what()<<std::endl;
+				success = false;
+			}
+		}
+
+		delete ctx.loopback;
+	}
+	fs::RecursiveDelete(world_path);
+
+	if(output_path.empty())
+		return success;
+
+	std::ostringstream os(std::ios_base::binary);
+	os<<"{\"version\":"<<Json::valueToQuotedString(minetest_version_hash)
+			<<",\"mapgen\":"<<Json::valueToQuotedString(mg_name.c_str())
+			<<",\"benchmarks\":[";
+	for(u32 i = 0; i < results.size(); i++){
+		os<<(i == 0 ? "\n" : ",\n")
+				<<"{\"name\":"<<Json::valueToQuotedString(
+					results[i].name.c_str())
+				<<",\"iterations\":"<<results[i].iterations
+				<<",\"ns_per_op\":"<<results[i].ns_per_op<<"}";
+	}
+	os<<"\n]}\n";
+	if(!fs::safeWriteToFile(output_path, os.str())){
+		errorstream<<"Benchmark: failed to write "<<output_path<<std::endl;
+		return false;
+	}
+	dstream<<"Benchmark results written to "<<output_path<<std::endl;
+	return success;
+}
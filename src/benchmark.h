@@ -0,0 +1,40 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BENCHMARK_HEADER
+#define BENCHMARK_HEADER
+
+#include "irrlichttypes.h"
+#include <string>
+
+struct SubgameSpec;
+
+/*
+	Times the hot paths of the server (voxel manipulators, block
+	serialization, compression, noise, collision, ABMs and the connection)
+	on a mapchunk generated at the origin of a temporary world of the
+	given game.  A table is printed, and if output_path isn't empty the
+	results are written there as JSON, to be compared between versions.
+	Only the names of the benchmarks passing filter are run; an empty
+	filter runs them all.
+*/
+bool run_benchmarks(const SubgameSpec &gamespec,
+		const std::string &output_path, const std::string &filter);
+
+#endif
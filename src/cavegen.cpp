@@ -228,37 +228,50 @@ void CaveV6::carveRoute(v3f vec, float f, bool randomize_xz) {
 		d1 += ps->range(-1, 1);
 	}
 	
+	int full_ymin = node_min.Y - MAP_BLOCKSIZE;
+	int full_ymax = node_max.Y + MAP_BLOCKSIZE;
+	v3s16 em = vm->m_area.getExtent();
+
+	// The ranges of ps->range() in the loop conditions are random for
+	// every row, so the rows are walked as before; only the columns of
+	// each row are clipped and carved as one span
 	for (s16 z0 = d0; z0 <= d1; z0++) {
 		s16 si = rs / 2 - MYMAX(0, abs(z0) - rs / 7 - 1);
 		for (s16 x0 = -si - ps->range(0,1); x0 <= si - 1 + ps->range(0,1); x0++) {
 			s16 maxabsxz = MYMAX(abs(x0), abs(z0));
 			s16 si2 = rs / 2 - MYMAX(0, maxabsxz - rs / 7 - 1);
-			for (s16 y0 = -si2; y0 <= si2; y0++) {				
-				if (large_cave_is_flat) {
-					// Make large caves not so tall
-					if (rs > 7 && abs(y0) >= rs / 3)
-						continue;
-				}
 
-				v3s16 p(cp.X + x0, cp.Y + y0, cp.Z + z0);
-				p += of;
+			s16 y0_min = -si2;
+			s16 y0_max = si2;
+			if (large_cave_is_flat && rs > 7) {
+				// Make large caves not so tall
+				y0_min = MYMAX(y0_min, -(rs / 3 - 1));
+				y0_max = MYMIN(y0_max, rs / 3 - 1);
+			}
 
-				if (vm->m_area.contains(p) == false)
-					continue;
+			v3s16 p(cp.X + x0, cp.Y, cp.Z + z0);
+			p += of;
+
+			if (p.X < vm->m_area.MinEdge.X || p.X > vm->m_area.MaxEdge.X ||
+				p.Z < vm->m_area.MinEdge.Z || p.Z > vm->m_area.MaxEdge.Z)
+				continue;
 
-				u32 i = vm->m_area.index(p);
+			s16 y_min = MYMAX(p.Y + y0_min, vm->m_area.MinEdge.Y);
+			s16 y_max = MYMIN(p.Y + y0_max, vm->m_area.MaxEdge.Y);
+			if (y_min > y_max)
+				continue;
+
+			u32 i = vm->m_area.index(p.X, y_min, p.Z);
+			for (s16 y = y_min; y <= y_max; y++, vm->m_area.add_y(em, i, 1)) {
 				content_t c = vm->m_data[i].getContent();
 				if (!ndef->get(c).is_ground_content)
 					continue;
 
 				if (large_cave) {
-					int full_ymin = node_min.Y - MAP_BLOCKSIZE;
-					int full_ymax = node_max.Y + MAP_BLOCKSIZE;
-
 					if (flooded && full_ymin < water_level && full_ymax > water_level) {
-						vm->m_data[i] = (p.Y <= water_level) ? waternode : airnode;
+						vm->m_data[i] = (y <= water_level) ? waternode : airnode;
 					} else if (flooded && full_ymax < water_level) {
-						vm->m_data[i] = (p.Y < startp.Y - 2) ? lavanode : airnode;
+						vm->m_data[i] = (y < startp.Y - 2) ? lavanode : airnode;
 					} else {
 						vm->m_data[i] = airnode;
 					}
@@ -519,6 +532,11 @@ void CaveV7::carveRoute(v3f vec, float f, bool randomize_xz, bool is_ravine) {
 	bool flat_cave_floor = !large_cave && ps->range(0, 2) == 2;
 	bool should_make_cave_hole = ps->range(1, 10) == 1;
 	
+	int full_ymin = node_min.Y - MAP_BLOCKSIZE;
+	int full_ymax = node_max.Y + MAP_BLOCKSIZE;
+	v3s16 em = vm->m_area.getExtent();
+
+	// See CaveV6::carveRoute(); the columns are carved as spans
 	for (s16 z0 = d0; z0 <= d1; z0++) {
 		s16 si = rs / 2 - MYMAX(0, abs(z0) - rs / 7 - 1);
 		for (s16 x0 = -si - ps->range(0,1); x0 <= si - 1 + ps->range(0,1); x0++) {
@@ -526,34 +544,42 @@ void CaveV7::carveRoute(v3f vec, float f, bool randomize_xz, bool is_ravine) {
 	
 			s16 si2 = is_ravine ? MYMIN(ps->range(25, 26), ar.Y) :
 								 rs / 2 - MYMAX(0, maxabsxz - rs / 7 - 1);
-			
-			for (s16 y0 = -si2; y0 <= si2; y0++) {
-				// Make better floors in small caves
-				if(flat_cave_floor && y0 <= -rs/2 && rs<=7)
-					continue;
-				
-				if (large_cave_is_flat) {
-					// Make large caves not so tall
-					if (rs > 7 && abs(y0) >= rs / 3)
-						continue;
-				}
 
-				v3s16 p(cp.X + x0, cp.Y + y0, cp.Z + z0);
-				p += of;
-				
-				if (!is_ravine && mg->heightmap && should_make_cave_hole &&
-					p.X <= node_max.X && p.Z <= node_max.Z) {
-					int maplen = node_max.X - node_min.X + 1;
-					int idx = (p.Z - node_min.Z) * maplen + (p.X - node_min.X);
-					if (p.Y >= mg->heightmap[idx] - 2)
-						continue;
-				}
+			s16 y0_min = -si2;
+			s16 y0_max = si2;
+			// Make better floors in small caves
+			if (flat_cave_floor && rs <= 7)
+				y0_min = MYMAX(y0_min, -rs / 2 + 1);
+			if (large_cave_is_flat && rs > 7) {
+				// Make large caves not so tall
+				y0_min = MYMAX(y0_min, -(rs / 3 - 1));
+				y0_max = MYMIN(y0_max, rs / 3 - 1);
+			}
 
-				if (vm->m_area.contains(p) == false)
-					continue;
+			v3s16 p(cp.X + x0, cp.Y, cp.Z + z0);
+			p += of;
+
+			s16 y_min = p.Y + y0_min;
+			s16 y_max = p.Y + y0_max;
 
-				u32 i = vm->m_area.index(p);
-				
+			if (!is_ravine && mg->heightmap && should_make_cave_hole &&
+				p.X <= node_max.X && p.Z <= node_max.Z) {
+				int maplen = node_max.X - node_min.X + 1;
+				int idx = (p.Z - node_min.Z) * maplen + (p.X - node_min.X);
+				y_max = MYMIN(y_max, mg->heightmap[idx] - 3);
+			}
+
+			if (p.X < vm->m_area.MinEdge.X || p.X > vm->m_area.MaxEdge.X ||
+				p.Z < vm->m_area.MinEdge.Z || p.Z > vm->m_area.MaxEdge.Z)
+				continue;
+
+			y_min = MYMAX(y_min, vm->m_area.MinEdge.Y);
+			y_max = MYMIN(y_max, vm->m_area.MaxEdge.Y);
+			if (y_min > y_max)
+				continue;
+
+			u32 i = vm->m_area.index(p.X, y_min, p.Z);
+			for (s16 y = y_min; y <= y_max; y++, vm->m_area.add_y(em, i, 1)) {
 				// Don't replace air, water, lava, or ice
 				content_t c = vm->m_data[i].getContent();
 				if (!ndef->get(c).is_ground_content || c == CONTENT_AIR ||
@@ -561,13 +587,10 @@ void CaveV7::carveRoute(v3f vec, float f, bool randomize_xz, bool is_ravine) {
 					continue;
 					
 				if (large_cave) {
-					int full_ymin = node_min.Y - MAP_BLOCKSIZE;
-					int full_ymax = node_max.Y + MAP_BLOCKSIZE;
-
 					if (flooded && full_ymin < water_level && full_ymax > water_level)
-						vm->m_data[i] = (p.Y <= water_level) ? waternode : airnode;
+						vm->m_data[i] = (y <= water_level) ? waternode : airnode;
 					else if (flooded && full_ymax < water_level)
-						vm->m_data[i] = (p.Y < startp.Y - 4) ? liquidnode : airnode;
+						vm->m_data[i] = (y < startp.Y - 4) ? liquidnode : airnode;
 					else
 						vm->m_data[i] = airnode;
 				} else {
@@ -421,6 +421,9 @@ CGUITTFont::~CGUITTFont()
 
 void CGUITTFont::reset_images()
 {
+	// The layouts have the places of the glyphs on the pages.
+	clearTextLayouts();
+
 	// Delete the glyphs.
 	for (u32 i = 0; i != Glyphs.size(); ++i)
 		Glyphs[i].unload();
@@ -530,36 +533,62 @@ void CGUITTFont::draw(const core::stringw& text, const core::rect<s32>& position
 	if (!Driver)
 		return;
 
-	// Clear the glyph pages of their render information.
-	for (u32 i = 0; i < Glyph_Pages.size(); ++i)
-	{
-		Glyph_Pages[i]->render_positions.clear();
-		Glyph_Pages[i]->render_source_rects.clear();
-	}
+	const SGUITTTextLayout& layout = getTextLayout(text);
 
-	// Set up some variables.
-	core::dimension2d<s32> textDimension;
+	// Determine offset positions.
 	core::position2d<s32> offset = position.UpperLeftCorner;
+	if (hcenter)
+		offset.X = ((position.getWidth() - (s32)layout.dimension.Width) >> 1) + offset.X;
+	if (vcenter)
+		offset.Y = ((position.getHeight() - (s32)layout.dimension.Height) >> 1) + offset.Y;
 
-	// Determine offset positions.
-	if (hcenter || vcenter)
+	if (!use_transparency) color.color |= 0xff000000;
+
+	// Draw now, one batch for each page.
+	update_glyph_pages();
+	for (u32 i = 0; i < layout.pages.size(); ++i)
 	{
-		textDimension = getDimension(text.c_str());
+		const SGUITTLayoutPage& lpage = layout.pages[i];
+		CGUITTGlyphPage* page = Glyph_Pages[lpage.page];
 
-		if (hcenter)
-			offset.X = ((position.getWidth() - textDimension.Width) >> 1) + offset.X;
+		// The arrays of the page keep their memory from one string to the next.
+		page->render_positions.set_used(lpage.positions.size());
+		for (u32 j = 0; j < lpage.positions.size(); ++j)
+			page->render_positions[j] = lpage.positions[j] + offset;
 
-		if (vcenter)
-			offset.Y = ((position.getHeight() - textDimension.Height) >> 1) + offset.Y;
+		if (shadow_offset) {
+			for (u32 j = 0; j < page->render_positions.size(); ++j)
+				page->render_positions[j] += core::vector2di(shadow_offset, shadow_offset);
+			Driver->draw2DImageBatch(page->texture, page->render_positions, lpage.source_rects, clip, video::SColor(shadow_alpha,0,0,0), true);
+			for (u32 j = 0; j < page->render_positions.size(); ++j)
+				page->render_positions[j] -= core::vector2di(shadow_offset, shadow_offset);
+		}
+		Driver->draw2DImageBatch(page->texture, page->render_positions, lpage.source_rects, clip, color, true);
 	}
+}
+
+const CGUITTFont::SGUITTTextLayout& CGUITTFont::getTextLayout(const core::stringw& text)
+{
+	core::map<core::stringw, SGUITTTextLayout*>::Node* node = Text_Layouts.find(text);
+	if (node)
+		return *node->getValue();
+
+	// Chat and changing values make new strings all the time; when there
+	// are too many, start over with the ones drawn from then on.
+	if (Text_Layouts.size() >= 512)
+		clearTextLayouts();
+
+	SGUITTTextLayout* layout = new SGUITTTextLayout();
+	layout->dimension = getDimension(text.c_str());
 
 	// Convert to a unicode string.
 	core::ustring utext(text);
 
-	// Set up our render map.
-	core::map<u32, CGUITTGlyphPage*> Render_Map;
+	// The index in layout->pages of each glyph page, plus one.
+	core::array<u32> page_slots;
 
 	// Start parsing characters.
+	core::position2d<s32> offset(0, 0);
 	u32 n;
 	uchar32_t previousChar = 0;
 	core::ustring::const_iterator iter(utext);
@@ -584,10 +613,7 @@ void CGUITTFont::draw(const core::stringw& text, const core::rect<s32>& position
 		{
 			previousChar = 0;
 			offset.Y += font_metrics.height / 64;
-			offset.X = position.UpperLeftCorner.X;
-
-			if (hcenter)
-				offset.X += (position.getWidth() - textDimension.Width) >> 1;
+			offset.X = 0;
 			++iter;
 			continue;
 		}
@@ -605,10 +631,17 @@ void CGUITTFont::draw(const core::stringw& text, const core::rect<s32>& position
 
 			// Determine rendering information.
 			SGUITTGlyph& glyph = Glyphs[n-1];
-			CGUITTGlyphPage* const page = Glyph_Pages[glyph.glyph_page];
-			page->render_positions.push_back(core::position2di(offset.X + offx, offset.Y + offy));
-			page->render_source_rects.push_back(glyph.source_rect);
-			Render_Map.set(glyph.glyph_page, page);
+			while (page_slots.size() <= glyph.glyph_page)
+				page_slots.push_back(0);
+			if (page_slots[glyph.glyph_page] == 0)
+			{
+				layout->pages.push_back(SGUITTLayoutPage());
+				layout->pages.getLast().page = glyph.glyph_page;
+				page_slots[glyph.glyph_page] = layout->pages.size();
+			}
+			SGUITTLayoutPage& lpage = layout->pages[page_slots[glyph.glyph_page] - 1];
+			lpage.positions.push_back(core::position2di(offx, offy) + offset);
+			lpage.source_rects.push_back(glyph.source_rect);
 		}
 		offset.X += getWidthFromCharacter(currentChar);
 
@@ -616,28 +649,16 @@ void CGUITTFont::draw(const core::stringw& text, const core::rect<s32>& position
 		++iter;
 	}
 
-	// Draw now.
-	update_glyph_pages();
-	core::map<u32, CGUITTGlyphPage*>::Iterator j = Render_Map.getIterator();
-	while (!j.atEnd())
-	{
-		core::map<u32, CGUITTGlyphPage*>::Node* n = j.getNode();
-		j++;
-		if (n == 0) continue;
-
-		CGUITTGlyphPage* page = n->getValue();
-
-		if (!use_transparency) color.color |= 0xff000000;
+	Text_Layouts.insert(text, layout);
+	return *layout;
+}
 
-		if (shadow_offset) {
-			for (size_t i = 0; i < page->render_positions.size(); ++i)
-				page->render_positions[i] += core::vector2di(shadow_offset, shadow_offset);
-			Driver->draw2DImageBatch(page->texture, page->render_positions, page->render_source_rects, clip, video::SColor(shadow_alpha,0,0,0), true);
-			for (size_t i = 0; i < page->render_positions.size(); ++i)
-				page->render_positions[i] -= core::vector2di(shadow_offset, shadow_offset);
-		}
-		Driver->draw2DImageBatch(page->texture, page->render_positions, page->render_source_rects, clip, color, true);
-	}
+void CGUITTFont::clearTextLayouts()
+{
+	core::map<core::stringw, SGUITTTextLayout*>::Iterator i = Text_Layouts.getIterator();
+	for (; !i.atEnd(); i++)
+		delete i.getNode()->getValue();
+	Text_Layouts.clear();
 }
 
 core::dimension2d<u32> CGUITTFont::getCharDimension(const wchar_t ch) const
@@ -838,11 +859,13 @@ s32 CGUITTFont::getCharacterFromPos(const core::ustring& text, s32 pixel_x) cons
 
 void CGUITTFont::setKerningWidth(s32 kerning)
 {
+	clearTextLayouts();
 	GlobalKerningWidth = kerning;
 }
 
 void CGUITTFont::setKerningHeight(s32 kerning)
 {
+	clearTextLayouts();
 	GlobalKerningHeight = kerning;
 }
 
@@ -910,12 +933,14 @@ core::vector2di CGUITTFont::getKerning(const uchar32_t thisLetter, const uchar32
 
 void CGUITTFont::setInvisibleCharacters(const wchar_t *s)
 {
+	clearTextLayouts();
 	core::ustring us(s);
 	Invisible = us;
 }
 
 void CGUITTFont::setInvisibleCharacters(const core::ustring& s)
 {
+	clearTextLayouts();
 	Invisible = s;
 }
 
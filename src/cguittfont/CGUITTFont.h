@@ -355,6 +355,25 @@ namespace gui
 
 			void createSharedPlane();
 
+			//! The glyphs of a string on one page, relative to where the string starts.
+			struct SGUITTLayoutPage
+			{
+				u32 page;
+				core::array<core::position2di> positions;
+				core::array<core::recti> source_rects;
+			};
+
+			//! A string laid out into glyphs.  The layout doesn't depend on where
+			//! the string is drawn, so strings drawn every frame are laid out once.
+			struct SGUITTTextLayout
+			{
+				core::array<SGUITTLayoutPage> pages;
+				core::dimension2d<u32> dimension;
+			};
+
+			const SGUITTTextLayout& getTextLayout(const core::stringw& text);
+			void clearTextLayouts();
+
 			irr::IrrlichtDevice* Device;
 			gui::IGUIEnvironment* Environment;
 			video::IVideoDriver* Driver;
@@ -371,6 +390,8 @@ namespace gui
 			core::ustring Invisible;
 			u32 shadow_offset;
 			u32 shadow_alpha;
+
+			core::map<core::stringw, SGUITTTextLayout*> Text_Layouts;
 	};
 
 } // end namespace gui
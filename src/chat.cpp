@@ -232,7 +232,7 @@ void ChatBuffer::scrollTop()
 }
 
 u32 ChatBuffer::formatChatLine(const ChatLine& line, u32 cols,
-		std::vector<ChatFormattedLine>& destination) const
+		std::deque<ChatFormattedLine>& destination) const
 {
 	u32 num_added = 0;
 	std::vector<ChatFormattedFragment> next_frags;
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes.h"
 #include <string>
 #include <vector>
+#include <deque>
 #include <list>
 
 // Chat console related classes, only used by the client
@@ -112,7 +113,7 @@ class ChatBuffer
 	// Appends the formatted lines to the destination array and
 	// returns the number of formatted lines.
 	u32 formatChatLine(const ChatLine& line, u32 cols,
-			std::vector<ChatFormattedLine>& destination) const;
+			std::deque<ChatFormattedLine>& destination) const;
 
 protected:
 	s32 getTopScrollPos() const;
@@ -121,8 +122,9 @@ class ChatBuffer
 private:
 	// Scrollback size
 	u32 m_scrollback;
-	// Array of unformatted chat lines
-	std::vector<ChatLine> m_unformatted;
+	// Unformatted chat lines; a full buffer drops the oldest line for
+	// every new one, which a deque does without moving the others
+	std::deque<ChatLine> m_unformatted;
 	
 	// Number of character columns in console
 	u32 m_cols;
@@ -130,8 +132,8 @@ class ChatBuffer
 	u32 m_rows;
 	// Scroll position (console's top line index into m_formatted)
 	s32 m_scroll;
-	// Array of formatted lines
-	std::vector<ChatFormattedLine> m_formatted;
+	// Formatted lines, kept in step with m_unformatted
+	std::deque<ChatFormattedLine> m_formatted;
 	// Empty formatted line, for error returns
 	ChatFormattedLine m_empty_formatted_line;
 };
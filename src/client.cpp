@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include <algorithm>
 #include <sstream>
+#include <fstream>
 #include <IFileSystem.h>
 #include "jthread/jmutexautolock.h"
 #include "util/directiontables.h"
@@ -34,6 +35,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "porting.h"
 #include "mapsector.h"
 #include "mapblock_mesh.h"
+#include "clientblockcache.h"
 #include "mapblock.h"
 #include "settings.h"
 #include "profiler.h"
@@ -44,8 +46,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "itemdef.h"
 #include "shader.h"
 #include "base64.h"
+#include "sha1.h"
+#include "hex.h"
 #include "clientmap.h"
 #include "clientmedia.h"
+#include "filecache.h"
 #include "sound.h"
 #include "IMeshCache.h"
 #include "serialization.h"
@@ -56,6 +61,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "server.h"
 #include "database.h"
 #include "database-sqlite3.h"
+#include "workerpool.h"
 
 extern gui::IGUIEnvironment* guienv;
 
@@ -66,7 +72,10 @@ extern gui::IGUIEnvironment* guienv;
 QueuedMeshUpdate::QueuedMeshUpdate():
 	p(-1337,-1337,-1337),
 	data(NULL),
-	ack_block_to_server(false)
+	ack_block_to_server(false),
+	urgent(false),
+	seq(0),
+	key(0)
 {
 }
 
@@ -80,7 +89,10 @@ QueuedMeshUpdate::~QueuedMeshUpdate()
 	MeshUpdateQueue
 */
 	
-MeshUpdateQueue::MeshUpdateQueue()
+MeshUpdateQueue::MeshUpdateQueue():
+	m_camera_block(0,0,0),
+	m_drop_range(-1),
+	m_next_seq(0)
 {
 }
 
@@ -88,15 +100,35 @@ MeshUpdateQueue::~MeshUpdateQueue()
 {
 	JMutexAutoLock lock(m_mutex);
 
-	for(std::vector<QueuedMeshUpdate*>::iterator
+	for(std::map<u64, QueuedMeshUpdate*>::iterator
 			i = m_queue.begin();
 			i != m_queue.end(); i++)
 	{
-		QueuedMeshUpdate *q = *i;
+		QueuedMeshUpdate *q = i->second;
 		delete q;
 	}
 }
 
+u64 MeshUpdateQueue::makeKey(const QueuedMeshUpdate *q)
+{
+	// In s32; the squared distance of v3s16 is an s16 too
+	s32 dx = (s32)q->p.X - m_camera_block.X;
+	s32 dy = (s32)q->p.Y - m_camera_block.Y;
+	s32 dz = (s32)q->p.Z - m_camera_block.Z;
+	u64 d = MYMIN((u64)(dx*dx + dy*dy + dz*dz), (u64)0x7fffffff);
+	return ((u64)!q->urgent << 63) | (d << 32) | q->seq;
+}
+
+bool MeshUpdateQueue::isOutOfRange(v3s16 p)
+{
+	if(m_drop_range < 0)
+		return false;
+	s32 d = MYMAX(MYMAX(abs((s32)p.X - m_camera_block.X),
+			abs((s32)p.Y - m_camera_block.Y)),
+			abs((s32)p.Z - m_camera_block.Z));
+	return d > m_drop_range;
+}
+
 /*
 	peer_id=0 adds with nobody to send to
 */
@@ -108,37 +140,41 @@ void MeshUpdateQueue::addBlock(v3s16 p, MeshMakeData *data, bool ack_block_to_se
 
 	JMutexAutoLock lock(m_mutex);
 
-	if(urgent)
-		m_urgents.insert(p);
-
 	/*
 		Find if block is already in queue.
 		If it is, update the data and quit.
 	*/
-	for(std::vector<QueuedMeshUpdate*>::iterator
-			i = m_queue.begin();
-			i != m_queue.end(); i++)
-	{
-		QueuedMeshUpdate *q = *i;
-		if(q->p == p)
+	QueuedMeshUpdate *q = m_index.get(p);
+	if(q)
+	{
+		if(q->data)
+			delete q->data;
+		q->data = data;
+		if(ack_block_to_server)
+			q->ack_block_to_server = true;
+		if(urgent && !q->urgent)
 		{
-			if(q->data)
-				delete q->data;
-			q->data = data;
-			if(ack_block_to_server)
-				q->ack_block_to_server = true;
-			return;
+			m_queue.erase(q->key);
+			q->urgent = true;
+			q->key = makeKey(q);
+			m_queue[q->key] = q;
 		}
+		return;
 	}
 	
 	/*
 		Add the block
 	*/
-	QueuedMeshUpdate *q = new QueuedMeshUpdate;
+	m_dropped.erase(p);
+	q = new QueuedMeshUpdate;
 	q->p = p;
 	q->data = data;
 	q->ack_block_to_server = ack_block_to_server;
-	m_queue.push_back(q);
+	q->urgent = urgent;
+	q->seq = m_next_seq++;
+	q->key = makeKey(q);
+	m_queue[q->key] = q;
+	m_index.set(p, q);
 }
 
 // Returned pointer must be deleted
@@ -147,21 +183,81 @@ QueuedMeshUpdate * MeshUpdateQueue::pop()
 {
 	JMutexAutoLock lock(m_mutex);
 
-	bool must_be_urgent = !m_urgents.empty();
-	for(std::vector<QueuedMeshUpdate*>::iterator
+	/*
+		The first block in priority order.  Blocks that another thread is
+		making wait for it, so that an older mesh can't replace a newer one.
+	*/
+	for(std::map<u64, QueuedMeshUpdate*>::iterator
 			i = m_queue.begin();
 			i != m_queue.end(); i++)
 	{
-		QueuedMeshUpdate *q = *i;
-		if(must_be_urgent && m_urgents.count(q->p) == 0)
+		QueuedMeshUpdate *q = i->second;
+		if(m_inflight.count(q->p) != 0)
 			continue;
 		m_queue.erase(i);
-		m_urgents.erase(q->p);
+		m_index.remove(q->p);
+		m_inflight.insert(q->p);
 		return q;
 	}
 	return NULL;
 }
 
+void MeshUpdateQueue::done(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_inflight.erase(p);
+}
+
+void MeshUpdateQueue::forget(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_dropped.erase(p);
+}
+
+void MeshUpdateQueue::setCamera(v3s16 camera_block, s16 drop_range,
+		std::vector<v3s16> &back_in_range)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(camera_block == m_camera_block && drop_range == m_drop_range)
+		return;
+	m_camera_block = camera_block;
+	m_drop_range = drop_range;
+
+	for(std::set<v3s16>::iterator
+			i = m_dropped.begin();
+			i != m_dropped.end();)
+	{
+		if(isOutOfRange(*i)){
+			i++;
+			continue;
+		}
+		back_in_range.push_back(*i);
+		m_dropped.erase(i++);
+	}
+
+	/*
+		Sort by the new distances.  Blocks whose acknowledgement the server
+		is waiting for are kept, or it would stop sending blocks.
+	*/
+	std::map<u64, QueuedMeshUpdate*> queue;
+	for(std::map<u64, QueuedMeshUpdate*>::iterator
+			i = m_queue.begin();
+			i != m_queue.end(); i++)
+	{
+		QueuedMeshUpdate *q = i->second;
+		if(!q->urgent && !q->ack_block_to_server && isOutOfRange(q->p)){
+			m_index.remove(q->p);
+			m_dropped.insert(q->p);
+			delete q;
+			continue;
+		}
+		q->key = makeKey(q);
+		queue[q->key] = q;
+	}
+	m_queue.swap(queue);
+}
+
 /*
 	MeshUpdateThread
 */
@@ -180,7 +276,7 @@ void * MeshUpdateThread::Thread()
 
 	while(!StopRequested())
 	{
-		QueuedMeshUpdate *q = m_queue_in.pop();
+		QueuedMeshUpdate *q = m_manager->m_queue_in.pop();
 		if(q == NULL)
 		{
 			sleep_ms(3);
@@ -189,7 +285,8 @@ void * MeshUpdateThread::Thread()
 
 		ScopeProfiler sp(g_profiler, "Client: Mesh making");
 
-		MapBlockMesh *mesh_new = new MapBlockMesh(q->data, m_camera_offset);
+		MapBlockMesh *mesh_new = new MapBlockMesh(q->data,
+				m_manager->m_camera_offset);
 		if(mesh_new->getMesh()->getMeshBufferCount() == 0)
 		{
 			delete mesh_new;
@@ -201,7 +298,9 @@ void * MeshUpdateThread::Thread()
 		r.mesh = mesh_new;
 		r.ack_block_to_server = q->ack_block_to_server;
 
-		m_queue_out.push_back(r);
+		m_manager->m_queue_out.push_back(r);
+		// The next update of the block can be made now
+		m_manager->m_queue_in.done(q->p);
 
 		delete q;
 	}
@@ -211,6 +310,62 @@ void * MeshUpdateThread::Thread()
 	return NULL;
 }
 
+/*
+	MeshUpdateManager
+*/
+
+MeshUpdateManager::MeshUpdateManager(IGameDef *gamedef):
+	m_gamedef(gamedef)
+{
+}
+
+MeshUpdateManager::~MeshUpdateManager()
+{
+	stop();
+	wait();
+	for(u32 i = 0; i < m_threads.size(); i++)
+		delete m_threads[i];
+}
+
+void MeshUpdateManager::start()
+{
+	// If unspecified, leave a processor for the main thread and one for
+	// the server, at most 4 in all
+	s16 nthreads = 0;
+	if(!g_settings->getS16NoEx("num_mesh_update_threads", nthreads))
+		nthreads = MYMIN(porting::getNumberOfProcessors() - 2, 4);
+	if(nthreads < 1)
+		nthreads = 1;
+
+	infostream<<"Starting "<<nthreads<<" mesh update threads"<<std::endl;
+	for(s16 i = 0; i < nthreads; i++){
+		MeshUpdateThread *thread = new MeshUpdateThread(this);
+		thread->Start();
+		m_threads.push_back(thread);
+	}
+}
+
+void MeshUpdateManager::stop()
+{
+	for(u32 i = 0; i < m_threads.size(); i++)
+		m_threads[i]->Stop();
+}
+
+void MeshUpdateManager::wait()
+{
+	for(u32 i = 0; i < m_threads.size(); i++)
+		m_threads[i]->Wait();
+}
+
+bool MeshUpdateManager::isRunning()
+{
+	for(u32 i = 0; i < m_threads.size(); i++){
+		if(m_threads[i]->IsRunning())
+			return true;
+	}
+	return false;
+}
+
 /*
 	Client
 */
@@ -233,6 +388,8 @@ Client::Client(
 	m_connection_reinit_timer(0.1),
 	m_avg_rtt_timer(0.0),
 	m_playerpos_send_timer(0.0),
+	m_playerpos_sent_age(0.0),
+	m_playerpos_stop_resends(0),
 	m_ignore_damage_timer(0.0),
 	m_tsrc(tsrc),
 	m_shsrc(shsrc),
@@ -240,7 +397,7 @@ Client::Client(
 	m_nodedef(nodedef),
 	m_sound(sound),
 	m_event(event),
-	m_mesh_update_thread(this),
+	m_mesh_update_manager(this),
 	m_env(
 		new ClientMap(this, this, control,
 			device->getSceneManager()->getRootSceneNode(),
@@ -271,6 +428,10 @@ Client::Client(
 	m_time_of_day_update_timer(0),
 	m_recommended_send_interval(0.1),
 	m_removed_sounds_check_timer(0),
+	m_definitions_by_hash(false),
+	m_server_extrapolates(false),
+	m_block_cache(NULL),
+	m_block_cache_flush_timer(0),
 	m_state(LC_Created)
 {
 	/*
@@ -282,6 +443,20 @@ Client::Client(
 		m_env.addPlayer(player);
 	}
 
+	if (g_settings->getBool("enable_block_cache")
+			&& !is_simple_singleplayer_game) {
+		// One for each server
+		std::string path = porting::path_user + DIR_DELIM + "cache"
+				+ DIR_DELIM + "blocks" + DIR_DELIM + getServerCacheName()
+				+ ".sqlite";
+		try {
+			m_block_cache = new ClientBlockCache(path);
+		} catch (FileNotGoodException &e) {
+			errorstream << "Can't use the block cache: " << e.what()
+					<< std::endl;
+		}
+	}
+
 	if (g_settings->getBool("enable_local_map_saving")
 			&& !is_simple_singleplayer_game) {
 		const std::string world_path = porting::path_user + DIR_DELIM + "worlds"
@@ -314,7 +489,7 @@ Client::Client(
 void Client::Stop()
 {
 	//request all client managed threads to stop
-	m_mesh_update_thread.Stop();
+	m_mesh_update_manager.stop();
 	if (localdb != NULL) {
 		actionstream << "Local map saving ended" << std::endl;
 		localdb->endSave();
@@ -324,7 +499,7 @@ void Client::Stop()
 bool Client::isShutdown()
 {
 
-	if (!m_mesh_update_thread.IsRunning()) return true;
+	if (!m_mesh_update_manager.isRunning()) return true;
 
 	return false;
 }
@@ -333,16 +508,34 @@ Client::~Client()
 {
 	m_con.Disconnect();
 
-	m_mesh_update_thread.Stop();
-	m_mesh_update_thread.Wait();
-	while(!m_mesh_update_thread.m_queue_out.empty()) {
-		MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_frontNoEx();
+	m_mesh_update_manager.stop();
+	m_mesh_update_manager.wait();
+	while(!m_mesh_update_manager.m_queue_out.empty()) {
+		MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_frontNoEx();
 		delete r.mesh;
 	}
 
+	// The jobs use the device
+	for(std::deque<ImageDecodeJob*>::iterator i = m_image_decode_jobs.begin();
+			i != m_image_decode_jobs.end(); i++){
+		(*i)->done.Wait();
+		if((*i)->image)
+			(*i)->image->drop();
+		delete *i;
+	}
+
+	for(std::deque<BlockDecodeJob*>::iterator i = m_block_decode_jobs.begin();
+			i != m_block_decode_jobs.end(); i++){
+		(*i)->done.Wait();
+		delete (*i)->block;
+		delete *i;
+	}
+
 
 	delete m_inventory_from_server;
 
+	delete m_block_cache;
+
 	// Delete detached inventories
 	for(std::map<std::string, Inventory*>::iterator
 			i = m_detached_inventories.begin();
@@ -388,6 +581,21 @@ void Client::step(float dtime)
 
 	ReceiveAll();
 
+	finishBlockDecoding(false);
+
+	/*
+		Write the received blocks to the block cache now and then
+	*/
+	if(m_block_cache != NULL)
+	{
+		m_block_cache_flush_timer += dtime;
+		if(m_block_cache_flush_timer >= 10.0)
+		{
+			m_block_cache_flush_timer = 0.0;
+			m_block_cache->flush();
+		}
+	}
+
 	/*
 		Packet counter
 	*/
@@ -556,9 +764,20 @@ void Client::step(float dtime)
 	{
 		ScopeProfiler sp(g_profiler, "Client: map timer and unload");
 		std::list<v3s16> deleted_blocks;
+		u64 max_memory = (u64)MYMAX(
+				g_settings->getS32("client_map_memory_limit"), 0) * 1048576;
+		m_env.getClientMap().touchBlocksInRange();
 		m_env.getMap().timerUpdate(map_timer_and_unload_dtime,
 				g_settings->getFloat("client_unload_unused_data_timeout"),
-				&deleted_blocks);
+				&deleted_blocks, 0, max_memory);
+
+		for(std::list<v3s16>::iterator i = deleted_blocks.begin();
+				i != deleted_blocks.end(); ++i) {
+			m_env.getClientMap().invalidateSuperChunk(*i);
+			m_env.getClientMap().forgetMeshLodRequest(*i);
+			// Not to be added again when it comes back in range
+			m_mesh_update_manager.m_queue_in.forget(*i);
+		}
 				
 		/*if(deleted_blocks.size() > 0)
 			infostream<<"Client: Unloaded "<<deleted_blocks.size()
@@ -676,6 +895,7 @@ void Client::step(float dtime)
 	{
 		float &counter = m_playerpos_send_timer;
 		counter += dtime;
+		m_playerpos_sent_age += dtime;
 		if((m_state == LC_Ready) && (counter >= m_recommended_send_interval))
 		{
 			counter = 0.0;
@@ -683,15 +903,35 @@ void Client::step(float dtime)
 		}
 	}
 
+	/*
+		Tell the mesh update queue where the camera is, and queue again
+		the blocks that were dropped from it and are now in range
+	*/
+	{
+		ClientMap &map = m_env.getClientMap();
+		v3s16 camera_block = getNodeBlockPos(
+				floatToInt(map.getCameraPosition(), BS));
+		// Far enough that turning around doesn't show missing meshes
+		MapDrawControl &control = map.getControl();
+		s16 drop_range = control.range_all ? -1 :
+				control.wanted_range / MAP_BLOCKSIZE * 2 + 2;
+		std::vector<v3s16> back_in_range;
+		m_mesh_update_manager.m_queue_in.setCamera(camera_block, drop_range,
+				back_in_range);
+		for(std::vector<v3s16>::iterator i = back_in_range.begin();
+				i != back_in_range.end(); i++)
+			addUpdateMeshTask(*i);
+	}
+
 	/*
 		Replace updated meshes
 	*/
 	{
 		int num_processed_meshes = 0;
-		while(!m_mesh_update_thread.m_queue_out.empty())
+		while(!m_mesh_update_manager.m_queue_out.empty())
 		{
 			num_processed_meshes++;
-			MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_frontNoEx();
+			MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_frontNoEx();
 			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(r.p);
 			if(block)
 			{
@@ -705,6 +945,17 @@ void Client::step(float dtime)
 
 				// Replace with the new mesh
 				block->mesh = r.mesh;
+				m_env.getClientMap().invalidateDrawList();
+				m_env.getClientMap().invalidateSuperChunk(r.p);
+
+				// The overlays of the nodes in it may have changed too
+				if(m_crack_level >= 0 && getNodeBlockPos(m_crack_pos) == r.p)
+					m_env.getClientMap().setCrackOverlay(makeNodeOverlay(
+							m_crack_pos, m_crack_level, false));
+				if(m_show_highlighted &&
+						getNodeBlockPos(m_highlighted_pos) == r.p)
+					m_env.getClientMap().setHighlightOverlay(makeNodeOverlay(
+							m_highlighted_pos, -1, true));
 			} else {
 				delete r.mesh;
 			}
@@ -829,11 +1080,69 @@ void Client::step(float dtime)
 	}
 }
 
+/*
+	Decodes an image on a worker thread. Only the texture upload, which
+	happens for all the images at once in afterContentReceived(), needs
+	the main thread.
+*/
+class ImageDecodeJob : public WorkerJob
+{
+public:
+	ImageDecodeJob(IrrlichtDevice *device, const std::string &filename,
+			const std::string &data):
+		device(device),
+		filename(filename),
+		data(data),
+		image(NULL)
+	{
+	}
+
+	void run()
+	{
+		// Silly irrlicht's const-incorrectness
+		Buffer<char> data_rw(data.c_str(), data.size());
+
+		// Create an irrlicht memory file
+		io::IReadFile *rfile = device->getFileSystem()->createMemoryReadFile(
+				*data_rw, data_rw.getSize(), "_tempreadfile");
+		assert(rfile);
+		// Read image
+		image = device->getVideoDriver()->createImageFromFile(rfile);
+		rfile->drop();
+		data.clear();
+		done.Post();
+	}
+
+	IrrlichtDevice *device;
+	std::string filename;
+	std::string data;
+	video::IImage *image;
+	// Posted when image is ready
+	JSemaphore done;
+};
+
+void Client::finishMediaDecoding(bool wait)
+{
+	while(!m_image_decode_jobs.empty()){
+		ImageDecodeJob *job = m_image_decode_jobs.front();
+		if(wait)
+			job->done.Wait();
+		else if(!job->done.Wait(0))
+			return;
+		m_image_decode_jobs.pop_front();
+		if(job->image){
+			m_tsrc->insertSourceImage(job->filename, job->image);
+			job->image->drop();
+		} else {
+			errorstream<<"Client: Cannot create image from data of "
+					<<"file \""<<job->filename<<"\""<<std::endl;
+		}
+		delete job;
+	}
+}
+
 bool Client::loadMedia(const std::string &data, const std::string &filename)
 {
-	// Silly irrlicht's const-incorrectness
-	Buffer<char> data_rw(data.c_str(), data.size());
-	
 	std::string name;
 
 	const char *image_ext[] = {
@@ -847,27 +1156,13 @@ bool Client::loadMedia(const std::string &data, const std::string &filename)
 		verbosestream<<"Client: Attempting to load image "
 		<<"file \""<<filename<<"\""<<std::endl;
 
-		io::IFileSystem *irrfs = m_device->getFileSystem();
-		video::IVideoDriver *vdrv = m_device->getVideoDriver();
-
-		// Create an irrlicht memory file
-		io::IReadFile *rfile = irrfs->createMemoryReadFile(
-				*data_rw, data_rw.getSize(), "_tempreadfile");
-		assert(rfile);
-		// Read image
-		video::IImage *img = vdrv->createImageFromFile(rfile);
-		if(!img){
-			errorstream<<"Client: Cannot create image from data of "
-					<<"file \""<<filename<<"\""<<std::endl;
-			rfile->drop();
-			return false;
-		}
-		else {
-			m_tsrc->insertSourceImage(filename, img);
-			img->drop();
-			rfile->drop();
-			return true;
-		}
+		// The checksum was right, so a file that doesn't decode wouldn't
+		// do any better if fetched again; it is only logged.
+		ImageDecodeJob *job = new ImageDecodeJob(m_device, filename, data);
+		m_image_decode_jobs.push_back(job);
+		getWorkerPool()->submit(job);
+		finishMediaDecoding(false);
+		return true;
 	}
 
 	const char *sound_ext[] = {
@@ -1077,13 +1372,32 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 					<<m_recommended_send_interval<<std::endl;
 		}
 		
+		m_definitions_by_hash = datasize >= 2+1+6+8+4+1
+				&& (data[2+1+6+8+4] & 0x02);
+		m_server_extrapolates = datasize >= 2+1+6+8+4+1
+				&& (data[2+1+6+8+4] & 0x04);
+
 		// Reply to server
-		u32 replysize = 2;
+		u32 replysize = m_definitions_by_hash ? 2+20+20 : 2;
 		SharedBuffer<u8> reply(replysize);
 		writeU16(&reply[0], TOSERVER_INIT2);
+		if(m_definitions_by_hash){
+			// The server leaves out what we have
+			loadCachedDefinitions();
+			for(u32 i = 0; i < 2; i++){
+				std::string sha1 = m_cached_definitions_sha1[i];
+				sha1.resize(20, '\0');
+				memcpy(&reply[2+i*20], sha1.c_str(), 20);
+			}
+		}
 		// Send as reliable
 		m_con.Send(PEER_ID_SERVER, 1, reply, true);
 
+		// The server may send TOCLIENT_BLOCK_CACHED for these
+		if(m_block_cache != NULL && datasize >= 2+1+6+8+4+1
+				&& (data[2+1+6+8+4] & 0x01))
+			sendCachedBlocks();
+
 		m_state = LC_Init;
 
 		return;
@@ -1121,7 +1435,27 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 	Player *player = m_env.getLocalPlayer();
 	assert(player != NULL);
 
-	if(command == TOCLIENT_REMOVENODE)
+	if(command == TOCLIENT_BATCH)
+	{
+		if(datasize < 4)
+			return;
+		u16 count = readU16(&data[2]);
+		u32 pos = 4;
+		for(u16 i = 0; i < count; i++)
+		{
+			if(pos + 4 > datasize)
+				break;
+			u32 length = readU32(&data[pos]);
+			pos += 4;
+			if(length > datasize - pos)
+				break;
+			// A batch in a batch would only come from a broken server
+			if(length >= 2 && readU16(&data[pos]) != TOCLIENT_BATCH)
+				ProcessData(&data[pos], length, sender_peer_id);
+			pos += length;
+		}
+	}
+	else if(command == TOCLIENT_REMOVENODE)
 	{
 		if(datasize < 8)
 			return;
@@ -1129,6 +1463,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		p.X = readS16(&data[2]);
 		p.Y = readS16(&data[4]);
 		p.Z = readS16(&data[6]);
+		waitForBlockDecoding(getNodeBlockPos(p));
 		removeNode(p);
 	}
 	else if(command == TOCLIENT_ADDNODE)
@@ -1150,6 +1485,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 			remove_metadata = false;
 		}
 		
+		waitForBlockDecoding(getNodeBlockPos(p));
 		addNode(p, n, remove_metadata);
 	}
 	else if(command == TOCLIENT_BLOCKDATA)
@@ -1164,44 +1500,146 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		p.Z = readS16(&data[6]);
 		
 		std::string datastring((char*)&data[8], datasize-8);
-		std::istringstream istr(datastring, std::ios_base::binary);
-		
-		MapSector *sector;
-		MapBlock *block;
-		
-		v2s16 p2d(p.X, p.Z);
-		sector = m_env.getMap().emergeSector(p2d);
-		
-		assert(sector->getPos() == p2d);
-		
-		block = sector->getBlockNoCreateNoEx(p.Y);
-		if(block)
+
+		if(!queueBlockDecoding(p, datastring, false))
+			deSerializeBlock(p, datastring);
+
+		if(m_block_cache != NULL)
+			m_block_cache->save(p, datastring);
+	}
+	else if(command == TOCLIENT_BLOCK_CACHED)
+	{
+		if(datasize < 8)
+			return;
+
+		v3s16 p = readV3S16(&data[2]);
+
+		std::string datastring;
+		if(m_block_cache != NULL)
+			datastring = m_block_cache->load(p);
+		try{
+			if(!datastring.empty())
+			{
+				if(!queueBlockDecoding(p, datastring, true))
+					deSerializeBlock(p, datastring);
+				return;
+			}
+		}
+		catch(SerializationError &e)
 		{
-			/*
-				Update an existing block
-			*/
-			block->deSerialize(istr, ser_version, false);
-			block->deSerializeNetworkSpecific(istr);
+			errorstream<<"Client: The cached block "<<PP(p)
+					<<" can't be read: "<<e.what()<<std::endl;
 		}
-		else
+
+		// Have it sent instead
+		sendDeletedBlock(p);
+	}
+	else if(command == TOCLIENT_BLOCK_NODE_CHANGES)
+	{
+		if(datasize < 10)
+			return;
+
+		v3s16 p;
+		p.X = readS16(&data[2]);
+		p.Y = readS16(&data[4]);
+		p.Z = readS16(&data[6]);
+		u16 count = readU16(&data[8]);
+
+		u32 nodesize = MapNode::serializedLength(ser_version);
+		if(datasize < 10 + count * (3 + nodesize))
+			return;
+
+		waitForBlockDecoding(p);
+
+		// The block may have been deleted meanwhile; it'll be sent again
+		MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(p);
+		if(block == NULL || block->isDummy())
+			return;
+
+		u32 index = 10;
+		for(u16 i = 0; i < count; i++)
 		{
-			/*
-				Create a new block
-			*/
-			block = new MapBlock(&m_env.getMap(), p, this);
-			block->deSerialize(istr, ser_version, false);
-			block->deSerializeNetworkSpecific(istr);
-			sector->insertBlock(block);
+			u16 nodeindex = readU16(&data[index]);
+			u8 flags = readU8(&data[index + 2]);
+			MapNode n;
+			n.deSerialize(&data[index + 3], ser_version);
+			index += 3 + nodesize;
+
+			if(nodeindex >= MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE)
+				continue;
+			v3s16 relpos(nodeindex % MAP_BLOCKSIZE,
+					nodeindex / MAP_BLOCKSIZE % MAP_BLOCKSIZE,
+					nodeindex / (MAP_BLOCKSIZE * MAP_BLOCKSIZE));
+			block->setNodeNoCheck(relpos, n);
+			if(flags & 0x01)
+				block->getNodeMetadata().remove(relpos);
 		}
 
 		if (localdb != NULL) {
 			((ServerMap&) localserver->getMap()).saveBlock(block, localdb);
 		}
 
-		/*
-			Add it to mesh update queue and set it to be acknowledged after update.
-		*/
-		addUpdateMeshTaskWithEdge(p, true);
+		addUpdateMeshTaskWithEdge(p);
+	}
+	else if(command == TOCLIENT_NODEMETA_CHANGES)
+	{
+		if(datasize < 8)
+			return;
+
+		v3s16 p;
+		p.X = readS16(&data[2]);
+		p.Y = readS16(&data[4]);
+		p.Z = readS16(&data[6]);
+
+		waitForBlockDecoding(p);
+
+		// The block may have been deleted meanwhile; it'll be sent again
+		MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(p);
+		if(block == NULL || block->isDummy())
+			return;
+
+		std::string datastring((char*)&data[8], datasize - 8);
+		std::istringstream is(datastring, std::ios_base::binary);
+		std::ostringstream os(std::ios_base::binary);
+		try{
+			decompressZlib(is, os);
+			std::istringstream is2(os.str(), std::ios_base::binary);
+			u16 count = readU16(is2);
+			for(u16 i = 0; i < count; i++)
+			{
+				u16 nodeindex = readU16(is2);
+				bool has_meta = readU8(is2);
+				NodeMetadata *meta = NULL;
+				if(has_meta){
+					meta = new NodeMetadata(this);
+					try{
+						meta->deSerialize(is2);
+					}catch(SerializationError &e){
+						delete meta;
+						throw;
+					}
+				}
+				if(nodeindex >= MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE){
+					delete meta;
+					continue;
+				}
+				v3s16 relpos(nodeindex % MAP_BLOCKSIZE,
+						nodeindex / MAP_BLOCKSIZE % MAP_BLOCKSIZE,
+						nodeindex / (MAP_BLOCKSIZE * MAP_BLOCKSIZE));
+				if(meta != NULL)
+					block->getNodeMetadata().set(relpos, meta);
+				else
+					block->getNodeMetadata().remove(relpos);
+			}
+		}catch(SerializationError &e){
+			errorstream<<"Client: Invalid node metadata changes: "
+					<<e.what()<<std::endl;
+		}
+
+		// The mesh doesn't show metadata, so it's left as it is
+		if (localdb != NULL) {
+			((ServerMap&) localserver->getMap()).saveBlock(block, localdb);
+		}
 	}
 	else if(command == TOCLIENT_INVENTORY)
 	{
@@ -1220,6 +1658,27 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		m_inventory_from_server_age = 0.0;
 
 	}
+	else if(command == TOCLIENT_INVENTORY_CHANGES)
+	{
+		// The server sends the whole inventory first
+		if(m_inventory_from_server == NULL)
+			return;
+
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+
+		try{
+			m_inventory_from_server->deSerializeChanges(is);
+		}catch(SerializationError &e){
+			errorstream<<"Client: Invalid inventory changes: "
+					<<e.what()<<std::endl;
+		}
+
+		// Also drops the changes guessed locally, like a whole inventory
+		player->inventory = *m_inventory_from_server;
+		m_inventory_updated = true;
+		m_inventory_from_server_age = 0.0;
+	}
 	else if(command == TOCLIENT_TIME_OF_DAY)
 	{
 		if(datasize < 4)
@@ -1306,32 +1765,24 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 			}
 		*/
 
-		char buf[6];
 		// Get all data except the command number
-		std::string datastring((char*)&data[2], datasize-2);
-		// Throw them in an istringstream
-		std::istringstream is(datastring, std::ios_base::binary);
+		BufferReader reader(&data[2], datasize-2);
 
 		// Read removed objects
-		is.read(buf, 2);
-		u16 removed_count = readU16((u8*)buf);
+		u16 removed_count = reader.readU16();
 		for(unsigned int i=0; i<removed_count; i++)
 		{
-			is.read(buf, 2);
-			u16 id = readU16((u8*)buf);
+			u16 id = reader.readU16();
 			m_env.removeActiveObject(id);
 		}
 
 		// Read added objects
-		is.read(buf, 2);
-		u16 added_count = readU16((u8*)buf);
+		u16 added_count = reader.readU16();
 		for(unsigned int i=0; i<added_count; i++)
 		{
-			is.read(buf, 2);
-			u16 id = readU16((u8*)buf);
-			is.read(buf, 1);
-			u8 type = readU8((u8*)buf);
-			std::string data = deSerializeLongString(is);
+			u16 id = reader.readU16();
+			u8 type = reader.readU8();
+			std::string data = reader.readLongString();
 			// Add it
 			m_env.addActiveObject(id, type, data);
 		}
@@ -1347,29 +1798,23 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 				string message
 			}
 		*/
-		char buf[6];
 		// Get all data except the command number
-		std::string datastring((char*)&data[2], datasize-2);
-		// Throw them in an istringstream
-		std::istringstream is(datastring, std::ios_base::binary);
+		BufferReader reader(&data[2], datasize-2);
 
-		while(is.eof() == false)
+		try
 		{
-			is.read(buf, 2);
-			u16 id = readU16((u8*)buf);
-			if(is.eof())
-				break;
-			is.read(buf, 2);
-			size_t message_size = readU16((u8*)buf);
-			std::string message;
-			message.reserve(message_size);
-			for(unsigned int i=0; i<message_size; i++)
+			while(reader.getRemaining() > 0)
 			{
-				is.read(buf, 1);
-				message.append(buf, 1);
+				u16 id = reader.readU16();
+				std::string message = reader.readString();
+				// Pass on to the environment
+				m_env.processActiveObjectMessage(id, message);
 			}
-			// Pass on to the environment
-			m_env.processActiveObjectMessage(id, message);
+		}
+		catch(SerializationError &e)
+		{
+			errorstream<<"Client: Truncated active object message: "
+					<<e.what()<<std::endl;
 		}
 	}
 	else if(command == TOCLIENT_MOVEMENT)
@@ -1491,15 +1936,22 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
+		// The hash of the whole media, for the image cache
+		SHA1 media_sha1;
 		for(int i=0; i<num_files; i++)
 		{
 			std::string name = deSerializeString(is);
 			std::string sha1_base64 = deSerializeString(is);
 			std::string sha1_raw = base64_decode(sha1_base64);
 			m_media_downloader->addFile(name, sha1_raw);
+			media_sha1.addBytes(name.c_str(), name.size() + 1);
+			media_sha1.addBytes(sha1_raw.c_str(), sha1_raw.size());
 		}
+		unsigned char *digest = media_sha1.getDigest();
+		m_media_hash = hex_encode((char *)digest, 20);
+		free(digest);
 
 		std::vector<std::string> remote_media;
 		try {
@@ -1558,7 +2010,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		for(unsigned int i=0; i<num_files; i++){
 			std::string name = deSerializeString(is);
@@ -1578,12 +2030,12 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress node definitions
 		std::string datastring((char*)&data[2], datasize-2);
 		std::istringstream is(datastring, std::ios_base::binary);
-		std::istringstream tmp_is(deSerializeLongString(is), std::ios::binary);
+		std::istringstream tmp_is(readDefinitions(is, 1), std::ios::binary);
 		std::ostringstream tmp_os;
 		decompressZlib(tmp_is, tmp_os);
 
@@ -1603,12 +2055,12 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress item definitions
 		std::string datastring((char*)&data[2], datasize-2);
 		std::istringstream is(datastring, std::ios_base::binary);
-		std::istringstream tmp_is(deSerializeLongString(is), std::ios::binary);
+		std::istringstream tmp_is(readDefinitions(is, 0), std::ios::binary);
 		std::ostringstream tmp_os;
 		decompressZlib(tmp_is, tmp_os);
 
@@ -1709,6 +2161,23 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		}
 		inv->deSerialize(is);
 	}
+	else if(command == TOCLIENT_DETACHED_INVENTORY_CHANGES)
+	{
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+
+		std::string name = deSerializeString(is);
+
+		// The whole inventory is sent first
+		if(m_detached_inventories.count(name) == 0)
+			return;
+		try{
+			m_detached_inventories[name]->deSerializeChanges(is);
+		}catch(SerializationError &e){
+			errorstream<<"Client: Invalid changes of detached inventory \""
+					<<name<<"\": "<<e.what()<<std::endl;
+		}
+	}
 	else if(command == TOCLIENT_SHOW_FORMSPEC)
 	{
 		std::string datastring((char*)&data[2], datasize-2);
@@ -2002,6 +2471,289 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 	}
 }
 
+void Client::deSerializeBlock(v3s16 p, const std::string &datastring)
+{
+	u8 ser_version = m_server_ser_ver;
+	std::istringstream istr(datastring, std::ios_base::binary);
+	
+	MapSector *sector;
+	MapBlock *block;
+	
+	v2s16 p2d(p.X, p.Z);
+	sector = m_env.getMap().emergeSector(p2d);
+	
+	assert(sector->getPos() == p2d);
+	
+	block = sector->getBlockNoCreateNoEx(p.Y);
+	if(block)
+	{
+		/*
+			Update an existing block
+		*/
+		block->deSerialize(istr, ser_version, false);
+		block->deSerializeNetworkSpecific(istr);
+	}
+	else
+	{
+		/*
+			Create a new block
+		*/
+		block = new MapBlock(&m_env.getMap(), p, this);
+		try{
+			block->deSerialize(istr, ser_version, false);
+			block->deSerializeNetworkSpecific(istr);
+		}
+		catch(SerializationError &e)
+		{
+			delete block;
+			throw;
+		}
+		sector->insertBlock(block);
+	}
+
+	blockReceived(block);
+}
+
+void Client::blockReceived(MapBlock *block)
+{
+	if (localdb != NULL) {
+		((ServerMap&) localserver->getMap()).saveBlock(block, localdb);
+	}
+
+	/*
+		Add it to mesh update queue and set it to be acknowledged after update.
+	*/
+	addUpdateMeshTaskWithEdge(block->getPos(), true);
+}
+
+/*
+	Decompresses and reads a block on a worker thread. The block isn't in
+	the map yet, so nothing else uses it meanwhile.
+*/
+class BlockDecodeJob : public WorkerJob
+{
+public:
+	BlockDecodeJob(MapBlock *block, const std::string &data, u8 ser_version,
+			bool cached):
+		block(block),
+		data(data),
+		ser_version(ser_version),
+		cached(cached),
+		failed(false)
+	{
+	}
+
+	void run()
+	{
+		try{
+			std::istringstream istr(data, std::ios_base::binary);
+			block->deSerialize(istr, ser_version, false);
+			block->deSerializeNetworkSpecific(istr);
+		}
+		catch(BaseException &e)
+		{
+			failed = true;
+			error = e.what();
+		}
+		done.Post();
+	}
+
+	MapBlock *block;
+	std::string data;
+	u8 ser_version;
+	// From the block cache rather than sent by the server
+	bool cached;
+	bool failed;
+	std::string error;
+	// Posted when block is ready
+	JSemaphore done;
+};
+
+bool Client::queueBlockDecoding(v3s16 p, const std::string &datastring,
+		bool cached)
+{
+	waitForBlockDecoding(p);
+	if(m_env.getMap().getBlockNoCreateNoEx(p) != NULL)
+		return false;
+
+	BlockDecodeJob *job = new BlockDecodeJob(
+			new MapBlock(&m_env.getMap(), p, this), datastring,
+			m_server_ser_ver, cached);
+	m_block_decode_jobs.push_back(job);
+	m_block_decode_pending.insert(p);
+	getWorkerPool()->submit(job, WORKER_PRIORITY_HIGH);
+	return true;
+}
+
+bool Client::finishBlockDecodeJob(bool wait)
+{
+	if(m_block_decode_jobs.empty())
+		return false;
+	BlockDecodeJob *job = m_block_decode_jobs.front();
+	if(wait)
+		job->done.Wait();
+	else if(!job->done.Wait(0))
+		return false;
+	m_block_decode_jobs.pop_front();
+
+	MapBlock *block = job->block;
+	v3s16 p = block->getPos();
+	m_block_decode_pending.erase(p);
+
+	if(job->failed){
+		errorstream<<"Client: The "<<(job->cached ? "cached " : "")
+				<<"block "<<PP(p)<<" can't be read: "<<job->error
+				<<std::endl;
+		delete block;
+		if(job->cached)
+			sendDeletedBlock(p);
+		delete job;
+		return true;
+	}
+
+	MapSector *sector = m_env.getMap().emergeSector(v2s16(p.X, p.Z));
+	if(sector->getBlockNoCreateNoEx(p.Y) == NULL){
+		sector->insertBlock(block);
+		blockReceived(block);
+	} else {
+		// Nothing should have made it meanwhile, but updating it works
+		delete block;
+		deSerializeBlock(p, job->data);
+	}
+	delete job;
+	return true;
+}
+
+void Client::finishBlockDecoding(bool wait)
+{
+	while(finishBlockDecodeJob(wait));
+}
+
+void Client::waitForBlockDecoding(v3s16 p)
+{
+	// The jobs are finished in order, so the one of p is among the first
+	while(m_block_decode_pending.count(p) != 0 && finishBlockDecodeJob(true));
+}
+
+void Client::sendDeletedBlock(v3s16 p)
+{
+	SharedBuffer<u8> reply(2+1+6);
+	writeU16(&reply[0], TOSERVER_DELETEDBLOCKS);
+	reply[2] = 1;
+	writeV3S16(&reply[2+1], p);
+	m_con.Send(PEER_ID_SERVER, 2, reply, true);
+}
+
+std::string Client::getServerCacheName()
+{
+	std::string name = g_settings->get("address") + "_"
+			+ g_settings->get("remote_port");
+	for (u32 i = 0; i < name.size(); i++) {
+		if (!isalnum(name[i]) && name[i] != '.' && name[i] != '-')
+			name[i] = '_';
+	}
+	return name;
+}
+
+/*
+	The definitions are kept by SHA1 in cache/definitions, and
+	<server>.txt there has the hex SHA1s of the item and the node
+	definitions last received from the server.
+*/
+
+static std::string getDefinitionsCacheDir()
+{
+	return porting::path_user + DIR_DELIM + "cache" + DIR_DELIM
+			+ "definitions";
+}
+
+static std::string sha1_of(const std::string &data)
+{
+	SHA1 sha1;
+	sha1.addBytes(data.c_str(), data.size());
+	unsigned char *digest = sha1.getDigest();
+	std::string result((char*)digest, 20);
+	free(digest);
+	return result;
+}
+
+void Client::loadCachedDefinitions()
+{
+	FileCache cache(getDefinitionsCacheDir());
+	std::ifstream is((getDefinitionsCacheDir() + DIR_DELIM
+			+ getServerCacheName() + ".txt").c_str());
+	for(u32 i = 0; i < 2; i++){
+		std::string sha1_hex;
+		if(!std::getline(is, sha1_hex) || sha1_hex == "")
+			break;
+		std::ostringstream os(std::ios_base::binary);
+		if(!cache.load(sha1_hex, os))
+			continue;
+		// Only what is still intact is offered to the server
+		std::string sha1 = sha1_of(os.str());
+		if(hex_encode(sha1) != sha1_hex)
+			continue;
+		m_cached_definitions[i] = os.str();
+		m_cached_definitions_sha1[i] = sha1;
+	}
+}
+
+std::string Client::readDefinitions(std::istream &is, u8 type)
+{
+	if(!m_definitions_by_hash)
+		return deSerializeLongString(is);
+
+	char sha1_buf[20];
+	is.read(sha1_buf, 20);
+	std::string sha1(sha1_buf, 20);
+	std::string data = deSerializeLongString(is);
+	if(data.empty()){
+		if(sha1 != m_cached_definitions_sha1[type])
+			throw SerializationError("Definitions that are not cached "
+					"were left out");
+		infostream<<"Client: Using cached "<<(type == 0 ? "item" : "node")
+				<<" definitions "<<hex_encode(sha1)<<std::endl;
+		data = m_cached_definitions[type];
+	} else {
+		fs::CreateAllDirs(getDefinitionsCacheDir());
+		FileCache(getDefinitionsCacheDir()).update(hex_encode(sha1), data);
+	}
+	m_cached_definitions[type].clear();
+	m_cached_definitions_sha1[type] = sha1;
+
+	std::ofstream os((getDefinitionsCacheDir() + DIR_DELIM
+			+ getServerCacheName() + ".txt").c_str());
+	for(u32 i = 0; i < 2; i++)
+		os<<hex_encode(m_cached_definitions_sha1[i])<<"\n";
+	return data;
+}
+
+void Client::sendCachedBlocks()
+{
+	std::vector<v3s16> blockpos;
+	std::vector<u64> tokens;
+	m_block_cache->listTokens(CACHED_BLOCKS_MAX, blockpos, tokens);
+
+	infostream<<"Client: Telling the server of "<<blockpos.size()
+			<<" cached blocks"<<std::endl;
+
+	const u32 max_count = 1000;
+	for(u32 start = 0; start < blockpos.size(); start += max_count)
+	{
+		u16 count = MYMIN(max_count, blockpos.size() - start);
+		SharedBuffer<u8> data(2+2+count*14);
+		writeU16(&data[0], TOSERVER_CACHED_BLOCKS);
+		writeU16(&data[2], count);
+		for(u16 i = 0; i < count; i++)
+		{
+			writeV3S16(&data[2+2+i*14], blockpos[start + i]);
+			writeU64(&data[2+2+i*14+6], tokens[start + i]);
+		}
+		// After TOSERVER_INIT2
+		m_con.Send(PEER_ID_SERVER, 1, data, true);
+	}
+}
+
 void Client::Send(u16 channelnum, SharedBuffer<u8> data, bool reliable)
 {
 	//JMutexAutoLock lock(m_con_mutex); //bulk comment-out
@@ -2254,14 +3006,44 @@ void Client::sendPlayerPos()
 	if(myplayer == NULL)
 		return;
 
+	if(m_server_extrapolates){
+		// The server moves us on at the last sent speed; only tell it when
+		// we stray from that, turn or change the controls. A moving player
+		// is still sent now and then, as the server won't extrapolate for
+		// long and the packets are unreliable.
+		v3f predicted = myplayer->last_position +
+				myplayer->last_speed * m_playerpos_sent_age;
+		bool moving = myplayer->getSpeed() != v3f(0,0,0);
+		if((predicted - myplayer->getPosition()).getLength()
+					<= PLAYERPOS_MAX_DRIFT &&
+				(myplayer->last_speed - myplayer->getSpeed()).getLength()
+					<= PLAYERPOS_MAX_SPEED_CHANGE &&
+				fabs(wrapDegrees_180(myplayer->last_pitch
+					- myplayer->getPitch())) <= PLAYERPOS_MAX_TURN &&
+				fabs(wrapDegrees_180(myplayer->last_yaw
+					- myplayer->getYaw())) <= PLAYERPOS_MAX_TURN &&
+				myplayer->last_keyPressed == myplayer->keyPressed &&
+				!(moving && m_playerpos_sent_age >= PLAYERPOS_REFRESH_INTERVAL) &&
+				m_playerpos_stop_resends == 0)
+			return;
+	}
 	// Save bandwidth by only updating position when something changed
-	if(myplayer->last_position        == myplayer->getPosition() &&
+	else if(myplayer->last_position   == myplayer->getPosition() &&
 			myplayer->last_speed      == myplayer->getSpeed()    &&
 			myplayer->last_pitch      == myplayer->getPitch()    &&
 			myplayer->last_yaw        == myplayer->getYaw()      &&
 			myplayer->last_keyPressed == myplayer->keyPressed)
 		return;
 
+	m_playerpos_sent_age = 0.0;
+
+	if(myplayer->getSpeed() != v3f(0,0,0))
+		m_playerpos_stop_resends = 0;
+	else if(myplayer->last_speed != v3f(0,0,0))
+		m_playerpos_stop_resends = PLAYERPOS_STOP_RESENDS;
+	else if(m_playerpos_stop_resends > 0)
+		m_playerpos_stop_resends--;
+
 	myplayer->last_position   = myplayer->getPosition();
 	myplayer->last_speed      = myplayer->getSpeed();
 	myplayer->last_pitch      = myplayer->getPitch();
@@ -2519,10 +3301,9 @@ int Client::getCrackLevel()
 void Client::setHighlighted(v3s16 pos, bool show_highlighted)
 {
 	m_show_highlighted = show_highlighted;
-	v3s16 old_highlighted_pos = m_highlighted_pos;
 	m_highlighted_pos = pos;
-	addUpdateMeshTaskForNode(old_highlighted_pos, false, true);
-	addUpdateMeshTaskForNode(m_highlighted_pos, false, true);
+	m_env.getClientMap().setHighlightOverlay(
+			makeNodeOverlay(pos, -1, show_highlighted));
 }
 
 void Client::setCrack(int level, v3s16 pos)
@@ -2533,18 +3314,30 @@ void Client::setCrack(int level, v3s16 pos)
 	m_crack_level = level;
 	m_crack_pos = pos;
 
-	if(old_crack_level >= 0 && (level < 0 || pos != old_crack_pos))
-	{
-		// remove old crack
-		addUpdateMeshTaskForNode(old_crack_pos, false, true);
-	}
-	if(level >= 0 && (old_crack_level < 0 || pos != old_crack_pos))
+	// A new level only changes the texture, in MapBlockMesh::animate()
+	if((level >= 0) != (old_crack_level >= 0) || pos != old_crack_pos)
 	{
-		// add new crack
-		addUpdateMeshTaskForNode(pos, false, true);
+		m_env.getClientMap().setCrackOverlay(
+				makeNodeOverlay(pos, level, false));
 	}
 }
 
+MapBlockMesh* Client::makeNodeOverlay(v3s16 pos, int crack_level,
+		bool show_highlighted)
+{
+	if(crack_level < 0 && !show_highlighted)
+		return NULL;
+	if(m_env.getMap().getBlockNoCreateNoEx(getNodeBlockPos(pos)) == NULL)
+		return NULL;
+
+	MeshMakeData data(this);
+	data.fillNode(&m_env.getMap(), pos);
+	data.setCrack(crack_level, pos);
+	data.setHighlighted(pos, show_highlighted);
+	data.setSmoothLighting(g_settings->getBool("smooth_lighting"));
+	return new MapBlockMesh(&data, m_mesh_update_manager.m_camera_offset);
+}
+
 u16 Client::getHP()
 {
 	Player *player = m_env.getLocalPlayer();
@@ -2607,13 +3400,12 @@ void Client::addUpdateMeshTask(v3s16 p, bool ack_to_server, bool urgent)
 		// Release: ~0ms
 		// Debug: 1-6ms, avg=2ms
 		data->fill(b);
-		data->setCrack(m_crack_level, m_crack_pos);
-		data->setHighlighted(m_highlighted_pos, m_show_highlighted);
 		data->setSmoothLighting(g_settings->getBool("smooth_lighting"));
+		data->setLod(m_env.getClientMap().getMeshLod(p));
 	}
 
 	// Add task to queue
-	m_mesh_update_thread.m_queue_in.addBlock(p, data, ack_to_server, urgent);
+	m_mesh_update_manager.m_queue_in.addBlock(p, data, ack_to_server, urgent);
 }
 
 void Client::addUpdateMeshTaskWithEdge(v3s16 blockpos, bool ack_to_server, bool urgent)
@@ -2702,10 +3494,26 @@ float Client::mediaReceiveProgress()
 void Client::afterContentReceived(IrrlichtDevice *device, gui::IGUIFont* font)
 {
 	infostream<<"Client::afterContentReceived() started"<<std::endl;
+
+	finishMediaDecoding();
 	assert(m_itemdef_received);
 	assert(m_nodedef_received);
 	assert(mediaReceived());
 	
+	// Images made with modifiers are kept on disk for the next time.
+	// Textures of texture_path replace those of the server, and the
+	// builtin ones come with the version.
+	if(g_settings->getBool("enable_texture_cache") && m_media_hash != "")
+	{
+		std::string key = m_media_hash + g_settings->get("texture_path")
+				+ minetest_version_hash;
+		SHA1 sha1;
+		sha1.addBytes(key.c_str(), key.size());
+		unsigned char *digest = sha1.getDigest();
+		m_tsrc->enableImageCache(hex_encode((char *)digest, 20));
+		free(digest);
+	}
+
 	// Rebuild inherited images and recreate textures
 	infostream<<"- Rebuilding images and textures"<<std::endl;
 	m_tsrc->rebuildImagesAndTextures();
@@ -2745,9 +3553,9 @@ void Client::afterContentReceived(IrrlichtDevice *device, gui::IGUIFont* font)
 		delete[] text;
 	}
 
-	// Start mesh update thread after setting up content definitions
-	infostream<<"- Starting mesh update thread"<<std::endl;
-	m_mesh_update_thread.Start();
+	// Start mesh update threads after setting up content definitions
+	infostream<<"- Starting mesh update threads"<<std::endl;
+	m_mesh_update_manager.start();
 	
 	m_state = LC_Ready;
 	sendReady();
@@ -28,12 +28,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <map>
 #include <set>
 #include <vector>
+#include <deque>
 #include "clientobject.h"
 #include "gamedef.h"
 #include "inventorymanager.h"
 #include "localplayer.h"
 #include "hud.h"
 #include "particles.h"
+#include "util/container.h"
 
 struct MeshMakeData;
 class MapBlockMesh;
@@ -47,13 +49,20 @@ struct MapDrawControl;
 class MtEventManager;
 struct PointedThing;
 class Database;
+class ClientBlockCache;
 class Server;
+class ImageDecodeJob;
+class BlockDecodeJob;
 
 struct QueuedMeshUpdate
 {
 	v3s16 p;
 	MeshMakeData *data;
 	bool ack_block_to_server;
+	bool urgent;
+	// Order of adding, and the key in MeshUpdateQueue
+	u32 seq;
+	u64 key;
 
 	QueuedMeshUpdate();
 	~QueuedMeshUpdate();
@@ -82,8 +91,23 @@ class MeshUpdateQueue
 			bool ack_block_to_server, bool urgent);
 
 	// Returned pointer must be deleted
-	// Returns NULL if queue is empty
+	// Returns NULL if queue is empty, or if the queued blocks are being
+	// made by other threads; done() must be called when it's been made
 	QueuedMeshUpdate * pop();
+	void done(v3s16 p);
+	// Forgets a block that was removed from the map
+	void forget(v3s16 p);
+
+	/*
+		Blocks are popped urgent ones first, then nearest to camera_block
+		first.  The updates of blocks farther than drop_range blocks that
+		don't have to be acknowledged to the server are dropped, and the
+		blocks are put in back_in_range when they come within drop_range
+		again, so that they can be added again.  -1 drops nothing.
+		Only does something when the arguments change.
+	*/
+	void setCamera(v3s16 camera_block, s16 drop_range,
+			std::vector<v3s16> &back_in_range);
 
 	u32 size()
 	{
@@ -92,8 +116,21 @@ class MeshUpdateQueue
 	}
 	
 private:
-	std::vector<QueuedMeshUpdate*> m_queue;
-	std::set<v3s16> m_urgents;
+	// These require m_mutex to be locked
+	u64 makeKey(const QueuedMeshUpdate *q);
+	bool isOutOfRange(v3s16 p);
+
+	// By not urgent, squared distance to the camera and order of adding
+	std::map<u64, QueuedMeshUpdate*> m_queue;
+	V3s16PtrHashMap<QueuedMeshUpdate> m_index;
+	// Popped and not done yet
+	std::set<v3s16> m_inflight;
+	// Blocks whose updates were dropped for being out of range, until
+	// they are added again, come back within range or are unloaded
+	std::set<v3s16> m_dropped;
+	v3s16 m_camera_block;
+	s16 m_drop_range;
+	u32 m_next_seq;
 	JMutex m_mutex;
 };
 
@@ -111,17 +148,42 @@ struct MeshUpdateResult
 	}
 };
 
+class MeshUpdateManager;
+
 class MeshUpdateThread : public JThread
 {
 public:
 
-	MeshUpdateThread(IGameDef *gamedef):
-		m_gamedef(gamedef)
+	MeshUpdateThread(MeshUpdateManager *manager):
+		m_manager(manager)
 	{
 	}
 
 	void * Thread();
 
+private:
+	MeshUpdateManager *m_manager;
+};
+
+/*
+	Threads that make the meshes of the blocks in m_queue_in, urgent ones
+	first, and put them in m_queue_out.  The meshes of a block come out
+	in the order they were queued.
+*/
+class MeshUpdateManager
+{
+public:
+
+	MeshUpdateManager(IGameDef *gamedef);
+	~MeshUpdateManager();
+
+	// Starts num_mesh_update_threads threads
+	void start();
+	void stop();
+	void wait();
+	// True while any of the threads runs
+	bool isRunning();
+
 	MeshUpdateQueue m_queue_in;
 
 	MutexedQueue<MeshUpdateResult> m_queue_out;
@@ -129,6 +191,9 @@ class MeshUpdateThread : public JThread
 	IGameDef *m_gamedef;
 	
 	v3s16 m_camera_offset;
+
+private:
+	std::vector<MeshUpdateThread*> m_threads;
 };
 
 enum ClientEventType
@@ -418,7 +483,7 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	void addUpdateMeshTaskForNode(v3s16 nodepos, bool ack_to_server=false, bool urgent=false);
 	
 	void updateCameraOffset(v3s16 camera_offset)
-	{ m_mesh_update_thread.m_camera_offset = camera_offset; }
+	{ m_mesh_update_manager.m_camera_offset = camera_offset; }
 
 	// Get event from queue. CE_NONE is returned if queue is empty.
 	ClientEvent getClientEvent();
@@ -459,8 +524,12 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	virtual scene::IAnimatedMesh* getMesh(const std::string &filename);
 
 	// The following set of functions is used by ClientMediaDownloader
-	// Insert a media file appropriately into the appropriate manager
+	// Insert a media file appropriately into the appropriate manager.
+	// Images and sounds are decoded on the worker pool; they are all in
+	// their managers after finishMediaDecoding().
 	bool loadMedia(const std::string &data, const std::string &filename);
+	// Without wait, only takes the images decoded so far
+	void finishMediaDecoding(bool wait = true);
 	// Send a request for conventional media transfer
 	void request_media(const std::list<std::string> &file_requests);
 	// Send a notification that no conventional media transfer is needed
@@ -482,11 +551,52 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	void sendPlayerPos();
 	// Send the item number 'item' as player item to the server
 	void sendPlayerItem(u16 item);
+
+	// Puts the block of TOCLIENT_BLOCKDATA in the map and queues its mesh
+	void deSerializeBlock(v3s16 p, const std::string &datastring);
+	// Saves a block put in the map to localdb and queues its mesh
+	void blockReceived(MapBlock *block);
+	/*
+		A block that the client doesn't have is read on the worker pool and
+		put in the map by finishBlockDecoding(). Returns false if the client
+		has the block, after any block at p being read has been put in.
+	*/
+	bool queueBlockDecoding(v3s16 p, const std::string &datastring,
+			bool cached);
+	// Puts the next block being read in the map; false if there is none,
+	// or without wait, if it isn't read yet
+	bool finishBlockDecodeJob(bool wait);
+	// Puts the blocks read so far in the map, in order; with wait, all
+	void finishBlockDecoding(bool wait);
+	// Puts the block at p in the map if it is being read, before a change
+	// to it is applied
+	void waitForBlockDecoding(v3s16 p);
+	// Has the server send the block again
+	void sendDeletedBlock(v3s16 p);
+	// Sends TOSERVER_CACHED_BLOCKS with the newest blocks of m_block_cache
+	void sendCachedBlocks();
+
+	// A name for the cache files of the server
+	std::string getServerCacheName();
+	// Loads the definitions received from the server the last time
+	void loadCachedDefinitions();
+	// The compressed definitions of TOCLIENT_ITEMDEF (0) or
+	// TOCLIENT_NODEDEF (1), from the packet or from the cache
+	std::string readDefinitions(std::istream &is, u8 type);
+
+	// The mesh of the crack or the highlight of the node at pos, drawn
+	// over its block by ClientMap; NULL if there is nothing to draw
+	MapBlockMesh* makeNodeOverlay(v3s16 pos, int crack_level,
+			bool show_highlighted);
 	
 	float m_packetcounter_timer;
 	float m_connection_reinit_timer;
 	float m_avg_rtt_timer;
 	float m_playerpos_send_timer;
+	// Time since the position was last sent
+	float m_playerpos_sent_age;
+	// Times the stop is still to be sent again
+	u8 m_playerpos_stop_resends;
 	float m_ignore_damage_timer; // Used after server moves player
 	IntervalLimiter m_map_timer_and_unload_interval;
 
@@ -497,7 +607,7 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	ISoundManager *m_sound;
 	MtEventManager *m_event;
 
-	MeshUpdateThread m_mesh_update_thread;
+	MeshUpdateManager m_mesh_update_manager;
 	ClientEnvironment m_env;
 	con::Connection m_con;
 	IrrlichtDevice *m_device;
@@ -527,7 +637,17 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	Queue<ClientEvent> m_client_event_queue;
 	bool m_itemdef_received;
 	bool m_nodedef_received;
+	// The definitions come with their SHA1 and may be left out
+	bool m_definitions_by_hash;
+	// The server moves the player on at the last sent speed
+	bool m_server_extrapolates;
+	// The item and node definitions from the last session on the server,
+	// compressed, and their SHA1s; "" if there are none
+	std::string m_cached_definitions[2];
+	std::string m_cached_definitions_sha1[2];
 	ClientMediaDownloader *m_media_downloader;
+	// SHA1 of the names and hashes of the announced media, hex
+	std::string m_media_hash;
 
 	// time_of_day speed approximation for old protocol
 	bool m_time_of_day_set;
@@ -556,6 +676,16 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	// Storage for mesh data for creating multiple instances of the same mesh
 	std::map<std::string, std::string> m_mesh_data;
 
+	// Images being decoded, in the order they came
+	std::deque<ImageDecodeJob*> m_image_decode_jobs;
+	// Blocks being read, in the order they came, and their positions
+	std::deque<BlockDecodeJob*> m_block_decode_jobs;
+	std::set<v3s16> m_block_decode_pending;
+
+	// Blocks of this server from the earlier sessions, or NULL
+	ClientBlockCache *m_block_cache;
+	float m_block_cache_flush_timer;
+
 	// own state
 	LocalClientState m_state;
 
@@ -0,0 +1,174 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "clientblockcache.h"
+#include "mapblock.h"
+#include "exceptions.h"
+#include "filesys.h"
+#include "log.h"
+#include "util/string.h"
+#include <time.h>
+
+#ifndef PP
+	#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+#endif
+
+// Blocks kept over this are removed, the oldest first, when it is opened
+#define BLOCK_CACHE_MAX_BLOCKS 100000
+
+// The positions are kept as non-negative integers
+static s64 getBlockKey(v3s16 p)
+{
+	return ((s64)(p.Z + 32768) << 32) | ((s64)(p.Y + 32768) << 16)
+			| (s64)(p.X + 32768);
+}
+
+static v3s16 getKeyBlock(s64 key)
+{
+	return v3s16((key & 0xffff) - 32768, ((key >> 16) & 0xffff) - 32768,
+			((key >> 32) & 0xffff) - 32768);
+}
+
+ClientBlockCache::ClientBlockCache(const std::string &path):
+	m_database(NULL),
+	m_stmt_list(NULL),
+	m_stmt_read(NULL),
+	m_stmt_write(NULL),
+	m_in_transaction(false)
+{
+	fs::CreateAllDirs(fs::RemoveLastPathComponent(path));
+
+	if(sqlite3_open_v2(path.c_str(), &m_database,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+	{
+		errorstream<<"ClientBlockCache: Can't open "<<path<<": "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_close(m_database);
+		m_database = NULL;
+		throw FileNotGoodException("Cannot open block cache");
+	}
+
+	// Losing the last blocks in a crash only means getting them again
+	int d = sqlite3_exec(m_database,
+		"PRAGMA synchronous = 0;"
+		"CREATE TABLE IF NOT EXISTS `blocks` ("
+			"`pos` INT NOT NULL PRIMARY KEY,"
+			"`token` INT NOT NULL,"
+			"`time` INT NOT NULL,"
+			"`data` BLOB"
+		");"
+		"CREATE INDEX IF NOT EXISTS `blocks_time` ON `blocks` (`time`);"
+	, NULL, NULL, NULL);
+	if(d != SQLITE_OK)
+	{
+		errorstream<<"ClientBlockCache: Can't create the tables: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_close(m_database);
+		m_database = NULL;
+		throw FileNotGoodException("Cannot create block cache tables");
+	}
+
+	prepare(&m_stmt_list, "SELECT `pos`, `token` FROM `blocks` "
+			"ORDER BY `time` DESC LIMIT ?");
+	prepare(&m_stmt_read, "SELECT `data` FROM `blocks` WHERE `pos` = ?");
+	prepare(&m_stmt_write, "REPLACE INTO `blocks` VALUES(?, ?, ?, ?)");
+
+	std::string prune = "DELETE FROM `blocks` WHERE `pos` IN "
+			"(SELECT `pos` FROM `blocks` ORDER BY `time` DESC "
+			"LIMIT -1 OFFSET " + itos(BLOCK_CACHE_MAX_BLOCKS) + ")";
+	if(sqlite3_exec(m_database, prune.c_str(), NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"ClientBlockCache: Can't remove old blocks: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+}
+
+ClientBlockCache::~ClientBlockCache()
+{
+	flush();
+	sqlite3_finalize(m_stmt_list);
+	sqlite3_finalize(m_stmt_read);
+	sqlite3_finalize(m_stmt_write);
+	sqlite3_close(m_database);
+}
+
+void ClientBlockCache::prepare(sqlite3_stmt **stmt, const char *sql)
+{
+	if(sqlite3_prepare(m_database, sql, -1, stmt, NULL) != SQLITE_OK)
+	{
+		errorstream<<"ClientBlockCache: Can't prepare \""<<sql<<"\": "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare block cache statement");
+	}
+}
+
+void ClientBlockCache::listTokens(u32 max_count, std::vector<v3s16> &blockpos,
+		std::vector<u64> &tokens)
+{
+	sqlite3_bind_int64(m_stmt_list, 1, max_count);
+	while(sqlite3_step(m_stmt_list) == SQLITE_ROW)
+	{
+		blockpos.push_back(getKeyBlock(sqlite3_column_int64(m_stmt_list, 0)));
+		tokens.push_back((u64)sqlite3_column_int64(m_stmt_list, 1));
+	}
+	sqlite3_reset(m_stmt_list);
+}
+
+std::string ClientBlockCache::load(v3s16 blockpos)
+{
+	std::string data;
+	sqlite3_bind_int64(m_stmt_read, 1, getBlockKey(blockpos));
+	if(sqlite3_step(m_stmt_read) == SQLITE_ROW)
+	{
+		const char *blob = (const char *)sqlite3_column_blob(m_stmt_read, 0);
+		int size = sqlite3_column_bytes(m_stmt_read, 0);
+		if(blob != NULL)
+			data.assign(blob, size);
+	}
+	sqlite3_reset(m_stmt_read);
+	return data;
+}
+
+void ClientBlockCache::save(v3s16 blockpos, const std::string &data)
+{
+	if(!m_in_transaction)
+	{
+		if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) == SQLITE_OK)
+			m_in_transaction = true;
+	}
+
+	sqlite3_bind_int64(m_stmt_write, 1, getBlockKey(blockpos));
+	sqlite3_bind_int64(m_stmt_write, 2,
+			(s64)getNetworkSerializationToken(data));
+	sqlite3_bind_int64(m_stmt_write, 3, time(NULL));
+	sqlite3_bind_blob(m_stmt_write, 4, data.c_str(), data.size(), NULL);
+	if(sqlite3_step(m_stmt_write) != SQLITE_DONE)
+		infostream<<"ClientBlockCache: Can't save block "<<PP(blockpos)
+				<<": "<<sqlite3_errmsg(m_database)<<std::endl;
+	sqlite3_reset(m_stmt_write);
+}
+
+void ClientBlockCache::flush()
+{
+	if(!m_in_transaction)
+		return;
+	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+		errorstream<<"ClientBlockCache: Can't save the blocks: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+	m_in_transaction = false;
+}
+
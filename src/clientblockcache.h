@@ -0,0 +1,74 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef CLIENTBLOCKCACHE_HEADER
+#define CLIENTBLOCKCACHE_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <string>
+#include <vector>
+
+extern "C" {
+	#include "sqlite3.h"
+}
+
+/*
+	The blocks received from one server, kept on disk for the next
+	sessions. A block is kept as the data of the TOCLIENT_BLOCKDATA it came
+	in, with its getNetworkSerializationToken(); the server tells with
+	TOCLIENT_BLOCK_CACHED which of them are still current.
+
+	Structure of the database:
+	Tables:
+		blocks
+			(PK) INT pos
+			INT token
+			INT time (of receiving, for listing the newest first)
+			BLOB data
+*/
+class ClientBlockCache
+{
+public:
+	// Throws FileNotGoodException if the database can't be opened
+	ClientBlockCache(const std::string &path);
+	~ClientBlockCache();
+
+	// Newest first, up to max_count
+	void listTokens(u32 max_count, std::vector<v3s16> &blockpos,
+			std::vector<u64> &tokens);
+	// Returns "" if the block isn't kept
+	std::string load(v3s16 blockpos);
+	void save(v3s16 blockpos, const std::string &data);
+
+	// Writes what has been saved since the last time to the disk
+	void flush();
+
+private:
+	void prepare(sqlite3_stmt **stmt, const char *sql);
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_stmt_list;
+	sqlite3_stmt *m_stmt_read;
+	sqlite3_stmt *m_stmt_write;
+	// The saves are done in a transaction until flush()
+	bool m_in_transaction;
+};
+
+#endif
+
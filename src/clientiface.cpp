@@ -18,14 +18,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include <sstream>
+#include <algorithm>
 
 #include "clientiface.h"
 #include "util/numeric.h"
 #include "util/mathconstants.h"
+#include "util/serialize.h"
 #include "player.h"
 #include "settings.h"
 #include "mapblock.h"
 #include "connection.h"
+#include "clientserver.h"
 #include "environment.h"
 #include "map.h"
 #include "emerge.h"
@@ -81,8 +84,7 @@ void RemoteClient::GetNextBlocks(
 		return;
 
 	// Won't send anything if already sending
-	if(m_blocks_sending.size() >= g_settings->getU16
-			("max_simultaneous_block_sends_per_client"))
+	if(m_blocks_sending.size() >= getSendBudget())
 	{
 		//infostream<<"Not sending any blocks, Queue full."<<std::endl;
 		return;
@@ -131,13 +133,29 @@ void RemoteClient::GetNextBlocks(
 		//		<<server->getPlayerName(peer_id)<<std::endl;
 	}
 
+	// Only used by the server thread
+	static SettingHandle<s16> max_block_send_distance(g_settings,
+			"max_block_send_distance");
+	static SettingHandle<s16> max_block_generate_distance(g_settings,
+			"max_block_generate_distance");
+	static SettingHandle<float> min_time_from_building(g_settings,
+			"full_block_send_enable_min_time_from_building");
+
+	const s16 full_d_max = max_block_send_distance.get();
+
+	if(m_unsent_center != center || m_unsent_range != full_d_max)
+		rebuildUnsentShells(center, full_d_max);
+
+	// Emerge the blocks nearest to the player first, and forget the ones
+	// that went out of range
+	emerge->updatePeerPosition(peer_id, center, full_d_max);
+
 	//s16 last_nearest_unsent_d = m_nearest_unsent_d;
 	s16 d_start = m_nearest_unsent_d;
 
 	//infostream<<"d_start="<<d_start<<std::endl;
 
-	u16 max_simul_sends_setting = g_settings->getU16
-			("max_simultaneous_block_sends_per_client");
+	u16 max_simul_sends_setting = getSendBudget();
 	u16 max_simul_sends_usually = max_simul_sends_setting;
 
 	/*
@@ -146,8 +164,7 @@ void RemoteClient::GetNextBlocks(
 		Decrease send rate if player is building stuff.
 	*/
 	m_time_from_building += dtime;
-	if(m_time_from_building < g_settings->getFloat(
-				"full_block_send_enable_min_time_from_building"))
+	if(m_time_from_building < min_time_from_building.get())
 	{
 		max_simul_sends_usually
 			= LIMITED_MAX_SIMULTANEOUS_BLOCK_SENDS;
@@ -167,9 +184,8 @@ void RemoteClient::GetNextBlocks(
 	*/
 	s32 new_nearest_unsent_d = -1;
 
-	const s16 full_d_max = g_settings->getS16("max_block_send_distance");
 	s16 d_max = full_d_max;
-	s16 d_max_gen = g_settings->getS16("max_block_generate_distance");
+	s16 d_max_gen = max_block_generate_distance.get();
 
 	// Don't loop very much at a time
 	s16 max_d_increment_at_time = 2;
@@ -185,16 +201,37 @@ void RemoteClient::GetNextBlocks(
 	for(d = d_start; d <= d_max; d++)
 	{
 		/*
-			Get the border/face dot coordinates of a "d-radiused"
-			box
+			Go through the not yet sent blocks on the border of a
+			"d-radiused" box
+		*/
+		std::set<v3s16> &shell = m_unsent_shells[d];
+
+		/*
+			Don't generate or send if not in sight
+			FIXME This only works if the client uses a small enough
+			FOV setting. The default of 72 degrees is fine.
+
+			Blocks in sight are handled in order of priority, the ones
+			in front of the camera and in the moving direction first.
 		*/
-		std::list<v3s16> list;
-		getFacePositions(list, d);
+		float camera_fov = (72.0*M_PI/180) * 4./3.;
+		std::vector<std::pair<float, v3s16> > candidates;
+		for(std::set<v3s16>::iterator
+				li = shell.begin();
+				li != shell.end(); ++li)
+		{
+			if(isBlockInSight(*li, camera_pos, camera_dir, camera_fov,
+					10000*BS) == false)
+				continue;
+			candidates.push_back(std::make_pair(getBlockSendPriority(*li, d,
+					camera_pos, camera_dir, playerspeeddir), *li));
+		}
+		std::sort(candidates.begin(), candidates.end());
 
-		std::list<v3s16>::iterator li;
-		for(li=list.begin(); li!=list.end(); ++li)
+		for(u32 ci = 0; ci < candidates.size(); ci++)
 		{
-			v3s16 p = *li + center;
+			v3s16 p = candidates[ci].second;
+			float priority = candidates[ci].first;
 
 			/*
 				Send throttling
@@ -222,52 +259,9 @@ void RemoteClient::GetNextBlocks(
 			if(m_blocks_sending.find(p) != m_blocks_sending.end())
 				continue;
 
-			/*
-				Do not go over-limit
-			*/
-			if(p.X < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
-			|| p.X > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
-			|| p.Y < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
-			|| p.Y > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
-			|| p.Z < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
-			|| p.Z > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE)
-				continue;
-
 			// If this is true, inexistent block will be made from scratch
 			bool generate = d <= d_max_gen;
 
-			{
-				/*// Limit the generating area vertically to 2/3
-				if(abs(p.Y - center.Y) > d_max_gen - d_max_gen / 3)
-					generate = false;*/
-
-				// Limit the send area vertically to 1/2
-				if(abs(p.Y - center.Y) > full_d_max / 2)
-					continue;
-			}
-
-			/*
-				Don't generate or send if not in sight
-				FIXME This only works if the client uses a small enough
-				FOV setting. The default of 72 degrees is fine.
-			*/
-
-			float camera_fov = (72.0*M_PI/180) * 4./3.;
-			if(isBlockInSight(p, camera_pos, camera_dir, camera_fov, 10000*BS) == false)
-			{
-				continue;
-			}
-
-			/*
-				Don't send already sent blocks
-			*/
-			{
-				if(m_blocks_sent.find(p) != m_blocks_sent.end())
-				{
-					continue;
-				}
-			}
-
 			/*
 				Check if map has this block
 			*/
@@ -308,6 +302,28 @@ void RemoteClient::GetNextBlocks(
 					if(block->getDayNightDiff() == false)
 						continue;
 				}
+
+				/*
+					Close blocks that get no light at all are most likely
+					inside solid ground; send them after the others.
+				*/
+				if(d >= 1 && block->getIsUnderground() &&
+						block->getDayNightDiff() == false)
+					priority += BLOCK_SEND_UNDERGROUND_PENALTY;
+			}
+
+			/*
+				A block that isn't loaded and is surely deep inside the
+				ground wouldn't be sent from this far away once emerged,
+				as it gets no sunlight; don't emerge it at all.
+			*/
+			if(block == NULL && d >= 4)
+			{
+				s16 ground_min, ground_max;
+				if(emerge->getGroundLevelBounds(v2s16(p.X, p.Z),
+						&ground_min, &ground_max) &&
+						(p.Y + 2) * MAP_BLOCKSIZE <= ground_min)
+					continue;
 			}
 
 			/*
@@ -344,7 +360,7 @@ void RemoteClient::GetNextBlocks(
 			/*
 				Add block to send queue
 			*/
-			PrioritySortedBlockTransfer q((float)d, p, peer_id);
+			PrioritySortedBlockTransfer q(priority, p, peer_id);
 
 			dest.push_back(q);
 
@@ -360,7 +376,7 @@ void RemoteClient::GetNextBlocks(
 	} else if(nearest_emergefull_d != -1){
 		new_nearest_unsent_d = nearest_emergefull_d;
 	} else {
-		if(d > g_settings->getS16("max_block_send_distance")){
+		if(d > full_d_max){
 			new_nearest_unsent_d = 0;
 			m_nothing_to_send_pause_timer = 2.0;
 		} else {
@@ -375,15 +391,117 @@ void RemoteClient::GetNextBlocks(
 		m_nearest_unsent_d = new_nearest_unsent_d;
 }
 
+float RemoteClient::getBlockSendPriority(v3s16 p, s16 d, v3f camera_pos,
+		v3f camera_dir, v3f speed_dir)
+{
+	v3s16 blockpos_nodes = p * MAP_BLOCKSIZE;
+
+	// Block center position relative to camera
+	v3f blockpos_relative = v3f(
+			((float)blockpos_nodes.X + MAP_BLOCKSIZE/2) * BS,
+			((float)blockpos_nodes.Y + MAP_BLOCKSIZE/2) * BS,
+			((float)blockpos_nodes.Z + MAP_BLOCKSIZE/2) * BS) - camera_pos;
+
+	float length = blockpos_relative.getLength();
+	if(length < 0.001)
+		return d;
+	v3f block_dir = blockpos_relative / length;
+
+	/*
+		A block straight in front of the camera counts as one block
+		distance closer and one behind it as one further away; moving
+		towards a block brings it up to half a block distance closer.
+		speed_dir is zero when the player is not moving.
+	*/
+	return (float)d - block_dir.dotProduct(camera_dir)
+			- 0.5 * block_dir.dotProduct(speed_dir);
+}
+
+void RemoteClient::rebuildUnsentShells(v3s16 center, s16 range)
+{
+	m_unsent_center = center;
+	m_unsent_range = range;
+	m_unsent_shells.clear();
+	m_unsent_shells.resize(range + 1);
+
+	for(s16 z = -range; z <= range; z++)
+	for(s16 y = -range; y <= range; y++)
+	for(s16 x = -range; x <= range; x++)
+	{
+		v3s16 p = center + v3s16(x, y, z);
+		if(m_blocks_sent.find(p) != m_blocks_sent.end())
+			continue;
+		s16 d = getUnsentShell(p);
+		if(d != -1)
+			m_unsent_shells[d].insert(p);
+	}
+}
+
+s16 RemoteClient::getUnsentShell(v3s16 p)
+{
+	if(m_unsent_range < 0)
+		return -1;
+
+	/*
+		Do not go over-limit
+	*/
+	if(p.X < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
+	|| p.X > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
+	|| p.Y < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
+	|| p.Y > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
+	|| p.Z < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
+	|| p.Z > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE)
+		return -1;
+
+	v3s16 rel = p - m_unsent_center;
+
+	// Limit the send area vertically to 1/2
+	if(abs(rel.Y) > m_unsent_range / 2)
+		return -1;
+
+	s16 d = MYMAX(MYMAX(abs(rel.X), abs(rel.Y)), abs(rel.Z));
+	if(d > m_unsent_range)
+		return -1;
+	return d;
+}
+
+void RemoteClient::eraseSentBlock(v3s16 p)
+{
+	if(m_blocks_sent.erase(p) == 0)
+		return;
+	s16 d = getUnsentShell(p);
+	if(d != -1)
+		m_unsent_shells[d].insert(p);
+}
+
 void RemoteClient::GotBlock(v3s16 p)
 {
-	if(m_blocks_sending.find(p) != m_blocks_sending.end())
-		m_blocks_sending.erase(p);
+	std::map<v3s16, float>::iterator n = m_blocks_sending.find(p);
+	if(n != m_blocks_sending.end())
+	{
+		float rtt = n->second;
+		if(m_block_rtt_avg < 0){
+			m_block_rtt_avg = rtt;
+			m_block_rtt_min = rtt;
+		} else {
+			m_block_rtt_avg += (rtt - m_block_rtt_avg) * 0.1;
+			// Let the minimum follow slowly if the route changes
+			if(rtt < m_block_rtt_min)
+				m_block_rtt_min = rtt;
+			else
+				m_block_rtt_min += (rtt - m_block_rtt_min) * 0.01;
+		}
+		m_blocks_sending.erase(n);
+	}
 	else
 	{
 		m_excess_gotblocks++;
 	}
-	m_blocks_sent.insert(p);
+	if(m_blocks_sent.insert(p).second){
+		s16 d = getUnsentShell(p);
+		if(d != -1)
+			m_unsent_shells[d].erase(p);
+	}
 }
 
 void RemoteClient::SentBlock(v3s16 p)
@@ -395,14 +513,98 @@ void RemoteClient::SentBlock(v3s16 p)
 				" already in m_blocks_sending"<<std::endl;
 }
 
+void RemoteClient::updateSendBudget(float dtime, float rtt, float rate,
+		float loss, float rate_share)
+{
+	for(std::map<v3s16, float>::iterator
+			i = m_blocks_sending.begin();
+			i != m_blocks_sending.end(); ++i)
+		i->second += dtime;
+
+	// Only used by the server thread
+	static SettingHandle<u16> max_sends_per_client(g_settings,
+			"max_simultaneous_block_sends_per_client");
+	static SettingHandle<u16> max_block_send_budget(g_settings,
+			"max_block_send_budget");
+
+	u16 budget_initial = max_sends_per_client.get();
+	u16 budget_max = max_block_send_budget.get();
+
+	// Adapting is disabled
+	if(budget_max == 0){
+		m_send_budget = budget_initial;
+		return;
+	}
+
+	if(m_send_budget <= 0)
+		m_send_budget = budget_initial;
+
+	m_send_budget_timer += dtime;
+	m_send_budget_decrease_timer += dtime;
+
+	// Wait until the connection has been measured; change the budget
+	// at most once per round trip
+	if(rtt <= 0 || m_send_budget_timer < MYMAX(rtt, 0.1))
+		return;
+	m_send_budget_timer = 0;
+
+	// The rates are updated every 10 seconds; react to each update once
+	bool rates_updated = m_send_budget_decrease_timer >= 10.0;
+
+	if(rates_updated && rate > 0 && loss > rate * 0.05){
+		// Packets are being lost; the link is congested
+		m_send_budget *= 0.75;
+		m_send_budget_decrease_timer = 0;
+	} else if(rates_updated && rate_share > 0 && rate > rate_share){
+		// Using more than a fair share of the server's bandwidth
+		m_send_budget *= 0.9;
+		m_send_budget_decrease_timer = 0;
+	} else if(m_block_rtt_avg >= 0 &&
+			m_block_rtt_avg - m_block_rtt_min > MYMAX(2 * rtt, 0.5)){
+		// Blocks are queueing up on the way or in the client
+		m_send_budget -= 1;
+	} else if(m_blocks_sending.size() + 1 >= m_send_budget){
+		// The budget is what limits sending
+		m_send_budget += 1;
+	}
+
+	m_send_budget = rangelim(m_send_budget, 1,
+			MYMAX(budget_max, budget_initial));
+}
+
+u16 RemoteClient::getSendBudget()
+{
+	if(m_send_budget <= 0)
+		return g_settings->getU16("max_simultaneous_block_sends_per_client");
+	return m_send_budget;
+}
+
 void RemoteClient::SetBlockNotSent(v3s16 p)
 {
 	m_nearest_unsent_d = 0;
 
 	if(m_blocks_sending.find(p) != m_blocks_sending.end())
 		m_blocks_sending.erase(p);
-	if(m_blocks_sent.find(p) != m_blocks_sent.end())
-		m_blocks_sent.erase(p);
+	eraseSentBlock(p);
+}
+
+void RemoteClient::addClientCachedBlock(v3s16 p, u64 token)
+{
+	if(m_client_cached_blocks.size() >= CACHED_BLOCKS_MAX)
+		return;
+	m_client_cached_blocks[p] = token;
+}
+
+bool RemoteClient::takeClientCachedBlock(v3s16 p, u64 &token)
+{
+	if(m_client_cached_blocks.empty())
+		return false;
+	std::map<v3s16, u64>::iterator i = m_client_cached_blocks.find(p);
+	if(i == m_client_cached_blocks.end())
+		return false;
+	token = i->second;
+	m_client_cached_blocks.erase(i);
+	return true;
 }
 
 void RemoteClient::SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks)
@@ -417,8 +619,7 @@ void RemoteClient::SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks)
 
 		if(m_blocks_sending.find(p) != m_blocks_sending.end())
 			m_blocks_sending.erase(p);
-		if(m_blocks_sent.find(p) != m_blocks_sent.end())
-			m_blocks_sent.erase(p);
+		eraseSentBlock(p);
 	}
 }
 
@@ -536,6 +737,65 @@ u32 RemoteClient::uptime()
 	return getTime(PRECISION_SECONDS) - m_connection_time;
 }
 
+/*
+	ClientIDList
+*/
+
+JMutex ClientIDList::s_refcount_mutex;
+const std::vector<u16> ClientIDList::s_empty;
+
+ClientIDList::ClientIDList(Data *data):
+	m_data(data)
+{
+	JMutexAutoLock lock(s_refcount_mutex);
+	m_data->refcount++;
+}
+
+ClientIDList::ClientIDList(const ClientIDList &other):
+	m_data(other.m_data)
+{
+	if(m_data == NULL)
+		return;
+	JMutexAutoLock lock(s_refcount_mutex);
+	m_data->refcount++;
+}
+
+ClientIDList & ClientIDList::operator=(const ClientIDList &other)
+{
+	if(other.m_data == m_data)
+		return *this;
+	drop();
+	m_data = other.m_data;
+	if(m_data != NULL){
+		JMutexAutoLock lock(s_refcount_mutex);
+		m_data->refcount++;
+	}
+	return *this;
+}
+
+ClientIDList::~ClientIDList()
+{
+	drop();
+}
+
+void ClientIDList::drop()
+{
+	if(m_data == NULL)
+		return;
+	bool last;
+	{
+		JMutexAutoLock lock(s_refcount_mutex);
+		last = (--m_data->refcount == 0);
+	}
+	if(last)
+		delete m_data;
+	m_data = NULL;
+}
+
+/*
+	ClientInterface
+*/
+
 ClientInterface::ClientInterface(con::Connection* con)
 :
 	m_con(con),
@@ -579,6 +839,32 @@ std::list<u16> ClientInterface::getClientIDs(ClientState min_state)
 	return reply;
 }
 
+ClientIDList ClientInterface::getActiveClientIDs()
+{
+	JMutexAutoLock clientslock(m_clients_mutex);
+	return m_active_ids;
+}
+
+void ClientInterface::lockedUpdateActiveIDs()
+{
+	std::vector<u16> ids;
+	for(std::map<u16, RemoteClient*>::iterator
+		i = m_clients.begin();
+		i != m_clients.end(); ++i)
+	{
+		if (i->second->getState() >= CS_Active)
+			ids.push_back(i->second->peer_id);
+	}
+	if (m_active_ids.m_data != NULL ? ids == m_active_ids.m_data->ids :
+			ids.empty())
+		return;
+
+	ClientIDList::Data *data = new ClientIDList::Data;
+	data->ids.swap(ids);
+	data->refcount = 0;
+	m_active_ids = ClientIDList(data);
+}
+
 std::vector<std::string> ClientInterface::getPlayerNames()
 {
 	return m_clients_names;
@@ -599,13 +885,13 @@ void ClientInterface::UpdatePlayerList()
 {
 	if (m_env != NULL)
 		{
-		std::list<u16> clients = getClientIDs();
+		ClientIDList clients = getActiveClientIDs();
 		m_clients_names.clear();
 
 
 		if(clients.size() != 0)
 			infostream<<"Players:"<<std::endl;
-		for(std::list<u16>::iterator
+		for(ClientIDList::const_iterator
 			i = clients.begin();
 			i != clients.end(); ++i)
 		{
@@ -628,6 +914,9 @@ void ClientInterface::UpdatePlayerList()
 void ClientInterface::send(u16 peer_id,u8 channelnum,
 		SharedBuffer<u8> data, bool reliable)
 {
+	// The batched messages go before anything that comes after them
+	if (reliable && channelnum == 0)
+		flushBatch(peer_id);
 	m_con->Send(peer_id, channelnum, data, reliable);
 }
 
@@ -643,11 +932,97 @@ void ClientInterface::sendToAll(u16 channelnum,
 
 		if (client->net_proto_version != 0)
 		{
+			if (reliable && channelnum == 0)
+				flushBatch(client->peer_id);
 			m_con->Send(client->peer_id, channelnum, data, reliable);
 		}
 	}
 }
 
+/*
+	Messages bigger than this are sent on their own, and a batch is sent
+	early when it gets bigger than BATCH_SIZE_MAX
+*/
+#define BATCH_MESSAGE_SIZE_MAX 512
+#define BATCH_SIZE_MAX 1024
+
+void ClientInterface::sendBatched(u16 peer_id, SharedBuffer<u8> data)
+{
+	JMutexAutoLock clientslock(m_clients_mutex);
+	lockedSendBatched(peer_id, lockedGetClientNoEx(peer_id, CS_Created), data);
+}
+
+void ClientInterface::sendBatchedToAll(SharedBuffer<u8> data)
+{
+	JMutexAutoLock clientslock(m_clients_mutex);
+	for(std::map<u16, RemoteClient*>::iterator
+		i = m_clients.begin();
+		i != m_clients.end(); ++i)
+	{
+		RemoteClient *client = i->second;
+
+		if (client->net_proto_version != 0)
+			lockedSendBatched(client->peer_id, client, data);
+	}
+}
+
+void ClientInterface::lockedSendBatched(u16 peer_id, RemoteClient *client,
+		SharedBuffer<u8> data)
+{
+	if (client == NULL || client->net_proto_version < 32 ||
+			data.getSize() > BATCH_MESSAGE_SIZE_MAX) {
+		flushBatch(peer_id);
+		m_con->Send(peer_id, 0, data, true);
+		return;
+	}
+
+	JMutexAutoLock batchlock(m_batches_mutex);
+	Batch &batch = m_batches[peer_id];
+	batch.messages.push_back(std::string((char*)*data, data.getSize()));
+	batch.size += 4 + data.getSize();
+	if (batch.size >= BATCH_SIZE_MAX)
+		lockedFlushBatch(peer_id);
+}
+
+void ClientInterface::flushBatches()
+{
+	JMutexAutoLock batchlock(m_batches_mutex);
+	while (!m_batches.empty())
+		lockedFlushBatch(m_batches.begin()->first);
+}
+
+void ClientInterface::flushBatch(u16 peer_id)
+{
+	JMutexAutoLock batchlock(m_batches_mutex);
+	lockedFlushBatch(peer_id);
+}
+
+void ClientInterface::lockedFlushBatch(u16 peer_id)
+{
+	std::map<u16, Batch>::iterator n = m_batches.find(peer_id);
+	if (n == m_batches.end())
+		return;
+	std::vector<std::string> &messages = n->second.messages;
+
+	if (messages.size() == 1) {
+		const std::string &message = messages[0];
+		m_con->Send(peer_id, 0, SharedBuffer<u8>(
+				(u8*)message.c_str(), message.size()), true);
+	} else {
+		SharedBuffer<u8> data(2 + 2 + n->second.size);
+		writeU16(&data[0], TOCLIENT_BATCH);
+		writeU16(&data[2], messages.size());
+		u32 pos = 4;
+		for (u32 i = 0; i < messages.size(); i++) {
+			writeU32(&data[pos], messages[i].size());
+			memcpy(&data[pos + 4], messages[i].c_str(), messages[i].size());
+			pos += 4 + messages[i].size();
+		}
+		m_con->Send(peer_id, 0, data, true);
+	}
+	m_batches.erase(n);
+}
+
 RemoteClient* ClientInterface::getClientNoEx(u16 peer_id, ClientState state_min)
 {
 	JMutexAutoLock clientslock(m_clients_mutex);
@@ -721,7 +1096,7 @@ void ClientInterface::DeleteClient(u16 peer_id)
 	//TODO this should be done by client destructor!!!
 	RemoteClient *client = n->second;
 	// Handle objects
-	for(std::set<u16>::iterator
+	for(DenseIdSet::const_iterator
 			i = client->m_known_objects.begin();
 			i != client->m_known_objects.end(); ++i)
 	{
@@ -733,9 +1108,15 @@ void ClientInterface::DeleteClient(u16 peer_id)
 			obj->m_known_by_count--;
 	}
 
+	{
+		JMutexAutoLock batchlock(m_batches_mutex);
+		m_batches.erase(peer_id);
+	}
+
 	// Delete client
 	delete m_clients[peer_id];
 	m_clients.erase(peer_id);
+	lockedUpdateActiveIDs();
 }
 
 void ClientInterface::CreateClient(u16 peer_id)
@@ -767,6 +1148,7 @@ void ClientInterface::event(u16 peer_id, ClientStateEvent event)
 		if (n == m_clients.end())
 			return;
 		n->second->notifyEvent(event);
+		lockedUpdateActiveIDs();
 	}
 
 	if ((event == CSE_SetClientReady) ||
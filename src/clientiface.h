@@ -24,6 +24,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "constants.h"
 #include "serialization.h"             // for SER_FMT_VER_INVALID
 #include "jthread/jmutex.h"
+#include "activeobject.h"
+#include "util/container.h"
 
 #include <list>
 #include <vector>
@@ -205,10 +207,17 @@ class RemoteClient
 		serialization_version(SER_FMT_VER_INVALID),
 		net_proto_version(0),
 		m_time_from_building(9999),
+		m_object_send_step(0),
 		m_pending_serialization_version(SER_FMT_VER_INVALID),
 		m_state(CS_Created),
 		m_nearest_unsent_d(0),
 		m_nearest_unsent_reset_timer(0.0),
+		m_unsent_range(-1),
+		m_send_budget(0),
+		m_send_budget_timer(0.0),
+		m_send_budget_decrease_timer(0.0),
+		m_block_rtt_avg(-1),
+		m_block_rtt_min(-1),
 		m_excess_gotblocks(0),
 		m_nothing_to_send_pause_timer(0.0),
 		m_name(""),
@@ -246,11 +255,37 @@ class RemoteClient
 	 */
 	void ResendBlockIfOnWire(v3s16 p);
 
+	/*
+		Blocks the client has in its block cache, from
+		TOSERVER_CACHED_BLOCKS. Each token is only used the first time
+		the block is sent; after that the client has what was sent.
+	*/
+	void addClientCachedBlock(v3s16 p, u64 token);
+	// Returns false if the client didn't say it has the block
+	bool takeClientCachedBlock(v3s16 p, u64 &token);
+
+	// Returns true if the block has been sent, acknowledged or not
+	bool isBlockSent(v3s16 p)
+	{
+		return m_blocks_sent.find(p) != m_blocks_sent.end() ||
+				m_blocks_sending.find(p) != m_blocks_sending.end();
+	}
+
 	s32 SendingCount()
 	{
 		return m_blocks_sending.size();
 	}
 
+	/*
+		Adapts the number of blocks that may be in flight to the client.
+		rtt is the average round trip time of the connection, rate and
+		loss are the sent and resent data rates in KiB/s, and rate_share
+		is the fair share of block_send_bandwidth (0 = no limit).
+	*/
+	void updateSendBudget(float dtime, float rtt, float rate, float loss,
+			float rate_share);
+	u16 getSendBudget();
+
 	// Increments timeouts and removes timed-out blocks from list
 	// NOTE: This doesn't fix the server-not-sending-block bug
 	//       because it is related to emerging, not sending.
@@ -270,11 +305,16 @@ class RemoteClient
 	// Time from last placing or removing blocks
 	float m_time_from_building;
 
+	// Active objects that the client knows of
+	DenseIdSet m_known_objects;
+
 	/*
-		List of active objects that the client knows of.
-		Value is dummy.
+		Latest position updates of far away objects that have not been
+		sent yet, and the count of object message sends that chooses
+		whose turn it is.
 	*/
-	std::set<u16> m_known_objects;
+	std::map<u16, ActiveObjectMessage> m_deferred_object_positions;
+	u32 m_object_send_step;
 
 	ClientState getState()
 		{ return m_state; }
@@ -333,16 +373,47 @@ class RemoteClient
 	v3s16 m_last_center;
 	float m_nearest_unsent_reset_timer;
 
+	/*
+		Blocks within sending range of m_unsent_center that are not in
+		m_blocks_sent, indexed by their distance from the center.
+		GetNextBlocks() only has to look at these. Rebuilt when the center
+		or the range changes, kept up to date by the functions that
+		change m_blocks_sent.
+	*/
+	std::vector<std::set<v3s16> > m_unsent_shells;
+	v3s16 m_unsent_center;
+	s16 m_unsent_range;
+
+	// Lower is sent first; d adjusted by the camera and moving directions
+	float getBlockSendPriority(v3s16 p, s16 d, v3f camera_pos,
+			v3f camera_dir, v3f speed_dir);
+
+	void rebuildUnsentShells(v3s16 center, s16 range);
+	// Returns -1 if p is not in any shell
+	s16 getUnsentShell(v3s16 p);
+	void eraseSentBlock(v3s16 p);
+
 	/*
 		Blocks that are currently on the line.
 		This is used for throttling the sending of blocks.
 		- The size of this list is limited to some value
 		Block is added when it is sent with BLOCKDATA.
 		Block is removed when GOTBLOCKS is received.
-		Value is time from sending. (not used at the moment)
+		Value is time from sending.
 	*/
 	std::map<v3s16, float> m_blocks_sending;
 
+	/*
+		Adaptive limit of m_blocks_sending.size(), see updateSendBudget().
+		The round trip time of blocks is measured from sending the block
+		to receiving the GOTBLOCKS for it.
+	*/
+	float m_send_budget;
+	float m_send_budget_timer;
+	float m_send_budget_decrease_timer;
+	float m_block_rtt_avg;
+	float m_block_rtt_min;
+
 	/*
 		Count of excess GotBlocks().
 		There is an excess amount because the client sometimes
@@ -355,6 +426,9 @@ class RemoteClient
 	// CPU usage optimization
 	float m_nothing_to_send_pause_timer;
 
+	// Tokens of the blocks in the block cache of the client, by position
+	std::map<v3s16, u64> m_client_cached_blocks;
+
 	/*
 		name of player using this client
 	*/
@@ -375,6 +449,54 @@ class RemoteClient
 	const u32 m_connection_time;
 };
 
+/*
+	The ids of the active clients at some point. All copies share one
+	vector that never changes; ClientInterface makes a new one when a
+	client becomes active or goes away. Iterating needs neither the
+	clients mutex nor an allocation, only taking and dropping a
+	reference locks, briefly.
+*/
+class ClientIDList
+{
+public:
+	typedef std::vector<u16>::const_iterator const_iterator;
+
+	ClientIDList():
+		m_data(NULL)
+	{}
+	ClientIDList(const ClientIDList &other);
+	ClientIDList & operator=(const ClientIDList &other);
+	~ClientIDList();
+
+	const_iterator begin() const
+	{ return m_data ? m_data->ids.begin() : s_empty.begin(); }
+	const_iterator end() const
+	{ return m_data ? m_data->ids.end() : s_empty.end(); }
+	u32 size() const
+	{ return m_data ? m_data->ids.size() : 0; }
+	bool empty() const
+	{ return size() == 0; }
+
+private:
+	friend class ClientInterface;
+
+	struct Data
+	{
+		std::vector<u16> ids;
+		// Guarded by s_refcount_mutex
+		u32 refcount;
+	};
+
+	// Takes a reference on data
+	ClientIDList(Data *data);
+	void drop();
+
+	Data *m_data;
+
+	static JMutex s_refcount_mutex;
+	static const std::vector<u16> s_empty;
+};
+
 class ClientInterface {
 public:
 
@@ -389,6 +511,9 @@ class ClientInterface {
 	/* get list of active client id's */
 	std::list<u16> getClientIDs(ClientState min_state=CS_Active);
 
+	/* get the ids of the CS_Active clients, without copying them */
+	ClientIDList getActiveClientIDs();
+
 	/* get list of client player names */
 	std::vector<std::string> getPlayerNames();
 
@@ -398,6 +523,17 @@ class ClientInterface {
 	/* send to all clients */
 	void sendToAll(u16 channelnum, SharedBuffer<u8> data, bool reliable);
 
+	/* send a small reliable message to a client in the next TOCLIENT_BATCH
+	   of it; the order with the other reliable messages of channel 0
+	   is kept */
+	void sendBatched(u16 peer_id, SharedBuffer<u8> data);
+
+	/* send a small reliable message to all clients in their batches */
+	void sendBatchedToAll(SharedBuffer<u8> data);
+
+	/* send the batched messages of all clients, once per server step */
+	void flushBatches();
+
 	/* delete a client */
 	void DeleteClient(u16 peer_id);
 
@@ -445,12 +581,39 @@ class ClientInterface {
 	/* update internal player list */
 	void UpdatePlayerList();
 
+	/* make a new m_active_ids if a client became active or stopped being
+	   active; call with the clients mutex locked */
+	void lockedUpdateActiveIDs();
+
+	/* batch a message to a client, or send it if the client can't take
+	   batches; call with the clients mutex locked */
+	void lockedSendBatched(u16 peer_id, RemoteClient *client,
+			SharedBuffer<u8> data);
+
+	/* send the batched messages of a client */
+	void flushBatch(u16 peer_id);
+	/* the same, with the batches mutex locked */
+	void lockedFlushBatch(u16 peer_id);
+
 	// Connection
 	con::Connection* m_con;
 	JMutex m_clients_mutex;
 	// Connected clients (behind the con mutex)
 	std::map<u16, RemoteClient*> m_clients;
 	std::vector<std::string> m_clients_names; //for announcing masterserver
+	// Ids of the CS_Active clients (behind m_clients_mutex)
+	ClientIDList m_active_ids;
+
+	// Messages waiting for the TOCLIENT_BATCH of each client
+	struct Batch
+	{
+		std::vector<std::string> messages;
+		u32 size;
+
+		Batch(): size(0) {}
+	};
+	std::map<u16, Batch> m_batches;
+	JMutex m_batches_mutex;
 
 	// Environment
 	ServerEnvironment *m_env;
@@ -35,6 +35,48 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+/*
+	The box of a block made a bit bigger, so that the faces of the block
+	don't hide it.  The occlusion queries of the video driver are made
+	for scene nodes; these aren't in the scene.
+*/
+class BlockOcclusionQuery : public scene::ISceneNode
+{
+public:
+	BlockOcclusionQuery(scene::ISceneManager *mgr, v3s16 blockpos):
+		scene::ISceneNode(NULL, mgr),
+		occluded(false),
+		m_blockpos(blockpos)
+	{
+	}
+
+	virtual void render()
+	{
+	}
+
+	virtual const core::aabbox3d<f32>& getBoundingBox() const
+	{
+		return m_box;
+	}
+
+	// The query mesh is a unit cube around the origin
+	void place(v3s16 camera_offset)
+	{
+		v3s16 p = m_blockpos * MAP_BLOCKSIZE - camera_offset;
+		setPosition(intToFloat(p, BS)
+				+ v3f(1,1,1) * (MAP_BLOCKSIZE - 1) * BS / 2);
+		setScale(v3f(1,1,1) * (MAP_BLOCKSIZE + 0.5) * BS);
+		updateAbsolutePosition();
+	}
+
+	// No samples passed the last query that has a result
+	bool occluded;
+
+private:
+	v3s16 m_blockpos;
+	core::aabbox3d<f32> m_box;
+};
+
 ClientMap::ClientMap(
 		Client *client,
 		IGameDef *gamedef,
@@ -49,14 +91,60 @@ ClientMap::ClientMap(
 	m_control(control),
 	m_camera_position(0,0,0),
 	m_camera_direction(0,0,1),
-	m_camera_fov(M_PI)
+	m_camera_fov(M_PI),
+	m_drawlist_valid(false),
+	m_mesh_lod_distance(0),
+	m_occlusion_queries_enabled(false),
+	m_occlusion_query_mesh(NULL),
+	m_occlusion_queries_camera_offset(0,0,0),
+	m_crack_overlay(NULL),
+	m_highlight_overlay(NULL),
+	m_super_chunk_size(0),
+	m_frame(0)
 {
 	m_box = core::aabbox3d<f32>(-BS*1000000,-BS*1000000,-BS*1000000,
 			BS*1000000,BS*1000000,BS*1000000);
+
+	m_mesh_lod_distance = MYMAX(g_settings->getFloat("mesh_lod_distance"), 0);
+	m_super_chunk_size = MYMAX(g_settings->getS16("super_chunk_size"), 0);
+
+	if(g_settings->getBool("enable_occlusion_queries"))
+	{
+		if(mgr->getVideoDriver()->queryFeature(video::EVDF_OCCLUSION_QUERY))
+		{
+			m_occlusion_queries_enabled = true;
+			m_occlusion_query_mesh = mgr->getGeometryCreator()->
+					createCubeMesh(v3f(1,1,1));
+		}
+		else
+		{
+			infostream<<"ClientMap: The video driver can't do occlusion"
+					" queries"<<std::endl;
+		}
+	}
 }
 
 ClientMap::~ClientMap()
 {
+	delete m_crack_overlay;
+	delete m_highlight_overlay;
+
+	for(std::map<v3s16, SuperChunk*>::iterator
+			i = m_super_chunks.begin();
+			i != m_super_chunks.end(); ++i)
+		deleteSuperChunk(i->second);
+
+	if(m_occlusion_queries_enabled)
+	{
+		// Nothing else uses them
+		SceneManager->getVideoDriver()->removeAllOcclusionQueries();
+		for(std::map<v3s16, BlockOcclusionQuery*>::iterator
+				i = m_occlusion_queries.begin();
+				i != m_occlusion_queries.end(); ++i)
+			i->second->drop();
+		m_occlusion_query_mesh->drop();
+	}
+
 	/*JMutexAutoLock lock(mesh_mutex);
 
 	if(mesh != NULL)
@@ -156,6 +244,63 @@ static bool isOccluded(Map *map, v3s16 p0, v3s16 p1, float step, float stepfac,
 	return false;
 }
 
+static u8 getMeshLodAt(float distance, float lod_distance)
+{
+	return (lod_distance > 0 && distance > lod_distance * BS) ? 1 : 0;
+}
+
+void ClientMap::setCrackOverlay(MapBlockMesh *mesh)
+{
+	delete m_crack_overlay;
+	m_crack_overlay = mesh;
+}
+
+void ClientMap::setHighlightOverlay(MapBlockMesh *mesh)
+{
+	delete m_highlight_overlay;
+	m_highlight_overlay = mesh;
+}
+
+u32 ClientMap::getBlockMemoryUsage(MapBlock *block)
+{
+	u32 size = Map::getBlockMemoryUsage(block);
+	if(block->mesh)
+		size += block->mesh->getMemoryUsage();
+	return size;
+}
+
+void ClientMap::touchBlocksInRange()
+{
+	if(m_control.range_all)
+		return;
+
+	v3s16 cam_pos_blocks = getNodeBlockPos(
+			floatToInt(getCameraPosition(), BS));
+	s16 d = m_control.wanted_range / MAP_BLOCKSIZE + 1;
+	for(s16 x = cam_pos_blocks.X - d; x <= cam_pos_blocks.X + d; x++)
+	for(s16 z = cam_pos_blocks.Z - d; z <= cam_pos_blocks.Z + d; z++)
+	{
+		std::map<v2s16, MapSector*>::iterator
+				si = m_sectors.find(v2s16(x, z));
+		if(si == m_sectors.end())
+			continue;
+		for(s16 y = cam_pos_blocks.Y - d; y <= cam_pos_blocks.Y + d; y++)
+		{
+			MapBlock *block = si->second->getBlockNoCreateNoEx(y);
+			if(block)
+				block->resetUsageTimer();
+		}
+	}
+}
+
+u8 ClientMap::getMeshLod(v3s16 blockpos)
+{
+	v3f center = intToFloat(blockpos * MAP_BLOCKSIZE, BS)
+			+ v3f(1,1,1) * (MAP_BLOCKSIZE - 1) * BS / 2;
+	return getMeshLodAt(center.getDistanceFrom(getCameraPosition()),
+			m_mesh_lod_distance);
+}
+
 void ClientMap::updateDrawList(video::IVideoDriver* driver)
 {
 	ScopeProfiler sp(g_profiler, "CM::updateDrawList()", SPT_AVG);
@@ -163,15 +308,6 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	for(std::map<v3s16, MapBlock*>::iterator
-			i = m_drawlist.begin();
-			i != m_drawlist.end(); ++i)
-	{
-		MapBlock *block = i->second;
-		block->refDrop();
-	}
-	m_drawlist.clear();
-
 	m_camera_mutex.Lock();
 	v3f camera_position = m_camera_position;
 	v3f camera_direction = m_camera_direction;
@@ -185,6 +321,59 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 	camera_fov *= 1.2;
 
 	v3s16 cam_pos_nodes = floatToInt(camera_position, BS);
+
+	// No occlusion culling when free_move is on and camera is
+	// inside ground
+	bool occlusion_culling_enabled = true;
+	if(g_settings->getBool("free_move")){
+		MapNode n = getNodeNoEx(cam_pos_nodes);
+		if(n.getContent() == CONTENT_IGNORE ||
+				nodemgr->get(n).solidness == 2)
+			occlusion_culling_enabled = false;
+	}
+
+	/*
+		If the camera is where it was and no block has got a new mesh
+		since the list was made, it is still good.  The blocks are
+		checked against the camera again when they are drawn.
+	*/
+	if(m_drawlist_valid
+			&& cam_pos_nodes == m_drawlist_camera_pos
+			&& camera_direction.dotProduct(m_drawlist_camera_dir) > 0.9995
+			&& camera_fov == m_drawlist_camera_fov
+			&& camera_offset == m_drawlist_camera_offset
+			&& occlusion_culling_enabled == m_drawlist_occlusion_culling
+			&& m_control.range_all == m_drawlist_range_all
+			&& fabs(m_control.wanted_range - m_drawlist_range) < 1.0
+			&& m_control.wanted_max_blocks == m_drawlist_max_blocks)
+	{
+		// The blocks are still in range
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = m_drawlist.begin();
+				i != m_drawlist.end(); ++i)
+			i->second->resetUsageTimer();
+		g_profiler->add("CM::updateDrawList() kept", 1);
+		return;
+	}
+	m_drawlist_valid = true;
+	m_drawlist_camera_pos = cam_pos_nodes;
+	m_drawlist_camera_dir = camera_direction;
+	m_drawlist_camera_fov = camera_fov;
+	m_drawlist_camera_offset = camera_offset;
+	m_drawlist_occlusion_culling = occlusion_culling_enabled;
+	m_drawlist_range_all = m_control.range_all;
+	m_drawlist_range = m_control.wanted_range;
+	m_drawlist_max_blocks = m_control.wanted_max_blocks;
+
+	for(std::map<v3s16, MapBlock*>::iterator
+			i = m_drawlist.begin();
+			i != m_drawlist.end(); ++i)
+	{
+		MapBlock *block = i->second;
+		block->refDrop();
+	}
+	m_drawlist.clear();
+
 	v3s16 box_nodes_d = m_control.wanted_range * v3s16(1,1,1);
 	v3s16 p_nodes_min = cam_pos_nodes - box_nodes_d;
 	v3s16 p_nodes_max = cam_pos_nodes + box_nodes_d;
@@ -217,21 +406,66 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 	// Distance to farthest drawn block
 	float farthest_drawn = 0;
 
-	for(std::map<v2s16, MapSector*>::iterator
-			si = m_sectors.begin();
-			si != m_sectors.end(); ++si)
+	/*
+		Get the sectors in range.  With a lot of sectors loaded, looking
+		up the ones in range is faster than going through all of them.
+		Both are in the same order.
+	*/
+	std::vector<MapSector*> sectors;
+	s32 sectors_in_box = ((s32)p_blocks_max.X - p_blocks_min.X + 1)
+			* ((s32)p_blocks_max.Z - p_blocks_min.Z + 1);
+	if(m_control.range_all == false
+			&& sectors_in_box < (s32)m_sectors.size())
 	{
-		MapSector *sector = si->second;
-		v2s16 sp = sector->getPos();
-
-		if(m_control.range_all == false)
+		for(s16 x = p_blocks_min.X; x <= p_blocks_max.X; x++)
+		for(s16 z = p_blocks_min.Z; z <= p_blocks_max.Z; z++)
 		{
-			if(sp.X < p_blocks_min.X
-			|| sp.X > p_blocks_max.X
-			|| sp.Y < p_blocks_min.Z
-			|| sp.Y > p_blocks_max.Z)
-				continue;
+			std::map<v2s16, MapSector*>::iterator
+					si = m_sectors.find(v2s16(x, z));
+			if(si != m_sectors.end())
+				sectors.push_back(si->second);
 		}
+	}
+	else
+	{
+		for(std::map<v2s16, MapSector*>::iterator
+				si = m_sectors.begin();
+				si != m_sectors.end(); ++si)
+		{
+			v2s16 sp = si->first;
+			if(m_control.range_all == false)
+			{
+				if(sp.X < p_blocks_min.X
+				|| sp.X > p_blocks_max.X
+				|| sp.Y < p_blocks_min.Z
+				|| sp.Y > p_blocks_max.Z)
+					continue;
+			}
+			sectors.push_back(si->second);
+		}
+	}
+
+	float range = 100000 * BS;
+	if(m_control.range_all == false)
+		range = m_control.wanted_range * BS;
+
+	/*
+		The blocks of a sector are looked at in groups of group_size
+		blocks on top of each other.  If a sphere around all the blocks
+		of a group can't be seen, none of them is checked.
+	*/
+	const s16 group_size = 8;
+	// The farthest a block center is from the group center
+	const f32 group_offset = (group_size - 1) / 2.0 * MAP_BLOCKSIZE * BS;
+	const f32 group_radius = group_offset
+			+ 0.866025403784 * MAP_BLOCKSIZE * BS;
+
+	for(std::vector<MapSector*>::iterator
+			si = sectors.begin();
+			si != sectors.end(); ++si)
+	{
+		MapSector *sector = *si;
+		v2s16 sp = sector->getPos();
 
 		std::list< MapBlock * > sectorblocks;
 		sector->getBlocks(sectorblocks);
@@ -242,6 +476,11 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 
 		u32 sector_blocks_drawn = 0;
 
+		// The blocks are in order of y
+		bool group_tested = false;
+		s16 group = 0;
+		bool group_in_sight = false;
+
 		std::list< MapBlock * >::iterator i;
 		for(i=sectorblocks.begin(); i!=sectorblocks.end(); i++)
 		{
@@ -252,13 +491,26 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 				if not seen on display
 			*/
 
+			s16 block_group = getContainerPos(block->getPos().Y, group_size);
+			if(group_tested == false || block_group != group)
+			{
+				group_tested = true;
+				group = block_group;
+				v3f group_center(
+						((f32)sp.X * MAP_BLOCKSIZE + MAP_BLOCKSIZE / 2) * BS,
+						((f32)group * group_size * MAP_BLOCKSIZE
+							+ group_size * MAP_BLOCKSIZE / 2) * BS,
+						((f32)sp.Y * MAP_BLOCKSIZE + MAP_BLOCKSIZE / 2) * BS);
+				group_in_sight = isSphereInSight(group_center, group_radius,
+						camera_position, camera_direction, camera_fov,
+						range + group_offset);
+			}
+			if(group_in_sight == false)
+				continue;
+
 			if (block->mesh != NULL)
 				block->mesh->updateCameraOffset(m_camera_offset);
 
-			float range = 100000 * BS;
-			if(m_control.range_all == false)
-				range = m_control.wanted_range * BS;
-
 			float d = 0.0;
 			if(isBlockInSight(block->getPos(), camera_position,
 					camera_direction, camera_fov,
@@ -287,19 +539,33 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 			}
 
 			/*
-				Occlusion culling
+				Make the mesh again if it isn't of the level of detail
+				wanted at this distance.  The old one is drawn until then.
 			*/
-
-			// No occlusion culling when free_move is on and camera is
-			// inside ground
-			bool occlusion_culling_enabled = true;
-			if(g_settings->getBool("free_move")){
-				MapNode n = getNodeNoEx(cam_pos_nodes);
-				if(n.getContent() == CONTENT_IGNORE ||
-						nodemgr->get(n).solidness == 2)
-					occlusion_culling_enabled = false;
+			if(m_mesh_lod_distance > 0)
+			{
+				v3s16 p = block->getPos();
+				u8 lod = getMeshLodAt(d, m_mesh_lod_distance);
+				if(block->mesh->getLod() == lod)
+				{
+					m_mesh_lod_requests.erase(p);
+				}
+				else
+				{
+					std::map<v3s16, u8>::iterator
+							r = m_mesh_lod_requests.find(p);
+					if(r == m_mesh_lod_requests.end() || r->second != lod)
+					{
+						m_mesh_lod_requests[p] = lod;
+						m_client->addUpdateMeshTask(p);
+					}
+				}
 			}
 
+			/*
+				Occlusion culling
+			*/
+
 			v3s16 cpn = block->getPos() * MAP_BLOCKSIZE;
 			cpn += v3s16(MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2);
 			float step = BS*1;
@@ -364,6 +630,42 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 	m_control.blocks_drawn = blocks_drawn;
 	m_control.farthest_drawn = farthest_drawn;
 
+	/*
+		Make the occlusion queries the same set as the draw list
+	*/
+	if(m_occlusion_queries_enabled)
+	{
+		bool moved = (camera_offset != m_occlusion_queries_camera_offset);
+		m_occlusion_queries_camera_offset = camera_offset;
+		for(std::map<v3s16, BlockOcclusionQuery*>::iterator
+				i = m_occlusion_queries.begin();
+				i != m_occlusion_queries.end();)
+		{
+			BlockOcclusionQuery *query = i->second;
+			if(m_drawlist.find(i->first) != m_drawlist.end()){
+				if(moved)
+					query->place(camera_offset);
+				++i;
+				continue;
+			}
+			driver->removeOcclusionQuery(query);
+			query->drop();
+			m_occlusion_queries.erase(i++);
+		}
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = m_drawlist.begin();
+				i != m_drawlist.end(); ++i)
+		{
+			if(m_occlusion_queries.find(i->first) != m_occlusion_queries.end())
+				continue;
+			BlockOcclusionQuery *query =
+					new BlockOcclusionQuery(SceneManager, i->first);
+			query->place(camera_offset);
+			driver->addOcclusionQuery(query, m_occlusion_query_mesh);
+			m_occlusion_queries[i->first] = query;
+		}
+	}
+
 	g_profiler->avg("CM: blocks in range", blocks_in_range);
 	g_profiler->avg("CM: blocks occlusion culled", blocks_occlusion_culled);
 	if(blocks_in_range != 0)
@@ -413,6 +715,104 @@ struct MeshBufListList
 	}
 };
 
+void ClientMap::invalidateSuperChunk(v3s16 blockpos)
+{
+	if(m_super_chunk_size == 0)
+		return;
+	v3s16 chunkpos = getContainerPos(blockpos, m_super_chunk_size);
+	std::map<v3s16, SuperChunk*>::iterator i = m_super_chunks.find(chunkpos);
+	if(i != m_super_chunks.end())
+		i->second->dirty = true;
+}
+
+void ClientMap::deleteSuperChunk(SuperChunk *chunk)
+{
+	video::IVideoDriver *driver = SceneManager->getVideoDriver();
+	for(u32 i = 0; i < chunk->buffers.size(); i++)
+	{
+		driver->removeHardwareBuffer(chunk->buffers[i]);
+		chunk->buffers[i]->drop();
+	}
+	delete chunk;
+}
+
+void ClientMap::buildSuperChunk(v3s16 chunkpos, SuperChunk *chunk)
+{
+	ScopeProfiler sp(g_profiler, "CM: build super chunk", SPT_AVG);
+
+	video::IVideoDriver *driver = SceneManager->getVideoDriver();
+	for(u32 i = 0; i < chunk->buffers.size(); i++)
+	{
+		driver->removeHardwareBuffer(chunk->buffers[i]);
+		chunk->buffers[i]->drop();
+	}
+	chunk->buffers.clear();
+
+	// Buffers that can still be added to, by material
+	std::vector<scene::SMeshBuffer*> open;
+
+	v3s16 p0 = chunkpos * m_super_chunk_size;
+	for(s16 z = 0; z < m_super_chunk_size; z++)
+	for(s16 y = 0; y < m_super_chunk_size; y++)
+	for(s16 x = 0; x < m_super_chunk_size; x++)
+	{
+		MapBlock *block = getBlockNoCreateNoEx(p0 + v3s16(x, y, z));
+		if(block == NULL || block->mesh == NULL)
+			continue;
+		MapBlockMesh *mapBlockMesh = block->mesh;
+		mapBlockMesh->updateCameraOffset(m_camera_offset);
+		scene::SMesh *mesh = mapBlockMesh->getMesh();
+		for(u32 i = 0; i < mesh->getMeshBufferCount(); i++)
+		{
+			if(!mapBlockMesh->isStaticBuffer(i))
+				continue;
+			// All of them are S3DVertex with 16-bit indices
+			scene::SMeshBuffer *src =
+					(scene::SMeshBuffer*)mesh->getMeshBuffer(i);
+
+			// The indices are 16-bit, so a buffer is closed when full
+			scene::SMeshBuffer *dst = NULL;
+			for(u32 j = 0; j < open.size(); j++)
+			{
+				if(open[j]->Material != src->Material)
+					continue;
+				if(open[j]->Vertices.size() + src->Vertices.size() > 65535)
+				{
+					open.erase(open.begin() + j);
+					break;
+				}
+				dst = open[j];
+				break;
+			}
+			if(dst == NULL)
+			{
+				dst = new scene::SMeshBuffer();
+				dst->Material = src->Material;
+				chunk->buffers.push_back(dst);
+				open.push_back(dst);
+			}
+
+			u32 base = dst->Vertices.size();
+			for(u32 j = 0; j < src->Vertices.size(); j++)
+				dst->Vertices.push_back(src->Vertices[j]);
+			for(u32 j = 0; j < src->Indices.size(); j++)
+				dst->Indices.push_back(base + src->Indices[j]);
+		}
+	}
+
+	bool enable_vbo = g_settings->getBool("enable_vbo");
+	for(u32 i = 0; i < chunk->buffers.size(); i++)
+	{
+		scene::IMeshBuffer *buf = chunk->buffers[i];
+		buf->recalculateBoundingBox();
+		if(enable_vbo)
+			buf->setHardwareMappingHint(scene::EHM_STATIC);
+	}
+
+	chunk->camera_offset = m_camera_offset;
+	chunk->dirty = false;
+}
+
 void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -431,6 +831,7 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 	if(pass == scene::ESNRP_SOLID)
 	{
 		m_last_drawn_sectors.clear();
+		m_frame++;
 	}
 
 	bool use_trilinear_filter = g_settings->getBool("trilinear_filter");
@@ -493,6 +894,26 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 	u32 blocks_had_pass_meshbuf = 0;
 	// Blocks from which stuff was actually drawn
 	u32 blocks_without_stuff = 0;
+	// Blocks not drawn because of their occlusion queries
+	u32 blocks_occlusion_queried = 0;
+
+	/*
+		Get the results of the occlusion queries of the last frame that
+		are ready, without waiting for the rest
+	*/
+	if(m_occlusion_queries_enabled && pass == scene::ESNRP_SOLID)
+	{
+		ScopeProfiler sp(g_profiler, "CM: occlusion query results", SPT_AVG);
+		driver->updateAllOcclusionQueries(false);
+		for(std::map<v3s16, BlockOcclusionQuery*>::iterator
+				i = m_occlusion_queries.begin();
+				i != m_occlusion_queries.end(); ++i)
+		{
+			BlockOcclusionQuery *query = i->second;
+			// ~0 is no result yet
+			query->occluded = (driver->getOcclusionQueryResult(query) == 0);
+		}
+	}
 
 	/*
 		Draw the selected MapBlocks
@@ -503,6 +924,10 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 
 	MeshBufListList drawbufs;
 
+	// Super chunks with a block to draw; their static buffers are drawn
+	// for all of their blocks
+	std::set<v3s16> chunks;
+
 	for(std::map<v3s16, MapBlock*>::iterator
 			i = m_drawlist.begin();
 			i != m_drawlist.end(); ++i)
@@ -521,6 +946,19 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 			continue;
 		}
 
+		// The box of a block near the camera can be cut by the near
+		// plane or have the camera inside, so it isn't trusted
+		if(m_occlusion_queries_enabled && d > BS * MAP_BLOCKSIZE * 2)
+		{
+			std::map<v3s16, BlockOcclusionQuery*>::iterator
+					q = m_occlusion_queries.find(i->first);
+			if(q != m_occlusion_queries.end() && q->second->occluded)
+			{
+				blocks_occlusion_queried++;
+				continue;
+			}
+		}
+
 		// Mesh animation
 		{
 			//JMutexAutoLock lock(block->mesh_mutex);
@@ -561,9 +999,17 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 			scene::SMesh *mesh = mapBlockMesh->getMesh();
 			assert(mesh);
 
+			if(m_super_chunk_size != 0)
+				chunks.insert(getContainerPos(block->getPos(),
+						m_super_chunk_size));
+
 			u32 c = mesh->getMeshBufferCount();
 			for(u32 i=0; i<c; i++)
 			{
+				if(m_super_chunk_size != 0 &&
+						mapBlockMesh->isStaticBuffer(i))
+					continue;
+
 				scene::IMeshBuffer *buf = mesh->getMeshBuffer(i);
 
 				buf->getMaterial().setFlag(video::EMF_TRILINEAR_FILTER, use_trilinear_filter);
@@ -585,6 +1031,55 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 		}
 	}
 
+	for(std::set<v3s16>::iterator i = chunks.begin(); i != chunks.end(); ++i)
+	{
+		SuperChunk *&chunk = m_super_chunks[*i];
+		if(chunk == NULL)
+		{
+			chunk = new SuperChunk;
+			chunk->dirty = true;
+		}
+		if(chunk->dirty || chunk->camera_offset != m_camera_offset)
+			buildSuperChunk(*i, chunk);
+		chunk->last_drawn = m_frame;
+
+		for(u32 j = 0; j < chunk->buffers.size(); j++)
+		{
+			scene::IMeshBuffer *buf = chunk->buffers[j];
+
+			buf->getMaterial().setFlag(video::EMF_TRILINEAR_FILTER, use_trilinear_filter);
+			buf->getMaterial().setFlag(video::EMF_BILINEAR_FILTER, use_bilinear_filter);
+			buf->getMaterial().setFlag(video::EMF_ANISOTROPIC_FILTER, use_anisotropic_filter);
+
+			const video::SMaterial& material = buf->getMaterial();
+			video::IMaterialRenderer* rnd =
+					driver->getMaterialRenderer(material.MaterialType);
+			bool transparent = (rnd && rnd->isTransparent());
+			if(transparent == is_transparent_pass)
+				drawbufs.add(buf);
+		}
+	}
+
+	// The ones that haven't been drawn for a while are made again if
+	// they are needed
+	if(pass == scene::ESNRP_SOLID && m_frame % 100 == 0)
+	{
+		for(std::map<v3s16, SuperChunk*>::iterator
+				i = m_super_chunks.begin();
+				i != m_super_chunks.end();)
+		{
+			if(m_frame - i->second->last_drawn > 1000)
+			{
+				deleteSuperChunk(i->second);
+				m_super_chunks.erase(i++);
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+
 	std::list<MeshBufList> &lists = drawbufs.lists;
 
 	int timecheck_counter = 0;
@@ -666,12 +1161,65 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 		}
 #endif
 	}
+
+	/*
+		Draw the overlays of the pointed node over the blocks
+	*/
+	MapBlockMesh *overlays[2] = {m_crack_overlay, m_highlight_overlay};
+	for(u32 k = 0; k < 2; k++)
+	{
+		MapBlockMesh *overlay = overlays[k];
+		if(overlay == NULL)
+			continue;
+
+		// Once a frame
+		if(pass == scene::ESNRP_SOLID)
+		{
+			overlay->updateCameraOffset(m_camera_offset);
+			overlay->animate(false, animation_time, crack, daynight_ratio);
+		}
+
+		scene::SMesh *mesh = overlay->getMesh();
+		for(u32 i = 0; i < mesh->getMeshBufferCount(); i++)
+		{
+			scene::IMeshBuffer *buf = mesh->getMeshBuffer(i);
+
+			buf->getMaterial().setFlag(video::EMF_TRILINEAR_FILTER, use_trilinear_filter);
+			buf->getMaterial().setFlag(video::EMF_BILINEAR_FILTER, use_bilinear_filter);
+			buf->getMaterial().setFlag(video::EMF_ANISOTROPIC_FILTER, use_anisotropic_filter);
+
+			const video::SMaterial& material = buf->getMaterial();
+			video::IMaterialRenderer* rnd =
+					driver->getMaterialRenderer(material.MaterialType);
+			bool transparent = (rnd && rnd->isTransparent());
+			if(transparent != is_transparent_pass)
+				continue;
+
+			driver->setMaterial(material);
+			driver->drawMeshBuffer(buf);
+			vertex_count += buf->getVertexCount();
+			meshbuffer_count++;
+		}
+	}
 	} // ScopeProfiler
 
+	/*
+		Test the boxes of the blocks against the depth of the solid
+		geometry.  Drawing them writes nothing.
+	*/
+	if(m_occlusion_queries_enabled && pass == scene::ESNRP_SOLID)
+	{
+		ScopeProfiler sp(g_profiler, "CM: occlusion queries", SPT_AVG);
+		driver->runAllOcclusionQueries(false);
+	}
+
 	// Log only on solid pass because values are the same
 	if(pass == scene::ESNRP_SOLID){
 		g_profiler->avg("CM: animated meshes", mesh_animate_count);
 		g_profiler->avg("CM: animated meshes (far)", mesh_animate_count_far);
+		if(m_occlusion_queries_enabled)
+			g_profiler->avg("CM: blocks occluded by queries",
+					blocks_occlusion_queried);
 	}
 
 	g_profiler->avg(prefix+"vertices drawn", vertex_count);
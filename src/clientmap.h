@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "camera.h"
 #include <set>
 #include <map>
+#include <vector>
 
 struct MapDrawControl
 {
@@ -56,6 +57,24 @@ struct MapDrawControl
 
 class Client;
 class ITextureSource;
+class BlockOcclusionQuery;
+class MapBlockMesh;
+
+/*
+	The static mesh buffers of the blocks of a cube of super_chunk_size^3
+	blocks, merged by material so that they take a draw call per material
+	instead of one per block and material
+*/
+struct SuperChunk
+{
+	std::vector<scene::IMeshBuffer*> buffers;
+	// What the buffers were made with
+	v3s16 camera_offset;
+	// Set when a block in it has got a new mesh or has been deleted
+	bool dirty;
+	// The last frame it was drawn on
+	u32 last_drawn;
+};
 
 /*
 	ClientMap
@@ -96,6 +115,31 @@ class ClientMap : public Map, public scene::ISceneNode
 		m_camera_offset = offset;
 	}
 
+	v3f getCameraPosition()
+	{
+		JMutexAutoLock lock(m_camera_mutex);
+		return m_camera_position;
+	}
+
+	MapDrawControl & getControl()
+	{
+		return m_control;
+	}
+
+	// The level of detail wanted for the mesh of a block, as in
+	// MeshMakeData::m_lod
+	u8 getMeshLod(v3s16 blockpos);
+
+	// Counts the mesh too
+	virtual u32 getBlockMemoryUsage(MapBlock *block);
+
+	/*
+		Marks the blocks within the viewing range as used, also the ones
+		behind the camera or hidden by others, so that the memory limit of
+		timerUpdate() unloads the blocks left farthest behind first
+	*/
+	void touchBlocksInRange();
+
 	/*
 		Forcefully get a sector from somewhere
 	*/
@@ -132,6 +176,32 @@ class ClientMap : public Map, public scene::ISceneNode
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
 	
+	// Makes the next updateDrawList() check the blocks again even if the
+	// camera hasn't moved; called when a block gets a new mesh
+	void invalidateDrawList()
+	{
+		m_drawlist_valid = false;
+	}
+
+	// When a block gets a new mesh or is deleted, its super chunk is made
+	// again before it is drawn
+	void invalidateSuperChunk(v3s16 blockpos);
+
+	// Called for the blocks deleted from the map
+	void forgetMeshLodRequest(v3s16 blockpos)
+	{
+		m_mesh_lod_requests.erase(blockpos);
+	}
+
+	/*
+		Meshes of MeshMakeData::fillNode() drawn over the blocks, so that
+		the crack and the highlight of the pointed node don't need the
+		mesh of its block to be remade.  The map deletes them; NULL draws
+		nothing.
+	*/
+	void setCrackOverlay(MapBlockMesh *mesh);
+	void setHighlightOverlay(MapBlockMesh *mesh);
+
 	// Check if sector was drawn on last render()
 	bool sectorWasDrawn(v2s16 p)
 	{
@@ -152,6 +222,43 @@ class ClientMap : public Map, public scene::ISceneNode
 	JMutex m_camera_mutex;
 
 	std::map<v3s16, MapBlock*> m_drawlist;
+
+	// Distance in nodes from where blocks get low detail meshes, or 0
+	float m_mesh_lod_distance;
+	// Blocks that were queued to get a mesh of another level of detail
+	std::map<v3s16, u8> m_mesh_lod_requests;
+	// What m_drawlist was made with
+	bool m_drawlist_valid;
+	v3s16 m_drawlist_camera_pos;
+	v3f m_drawlist_camera_dir;
+	f32 m_drawlist_camera_fov;
+	v3s16 m_drawlist_camera_offset;
+	bool m_drawlist_occlusion_culling;
+	bool m_drawlist_range_all;
+	float m_drawlist_range;
+	u32 m_drawlist_max_blocks;
+
+	/*
+		Occlusion queries of the boxes of the blocks in m_drawlist, run
+		after the solid pass; the results are used on the next frame
+	*/
+	bool m_occlusion_queries_enabled;
+	scene::IMesh *m_occlusion_query_mesh;
+	std::map<v3s16, BlockOcclusionQuery*> m_occlusion_queries;
+	v3s16 m_occlusion_queries_camera_offset;
+
+	MapBlockMesh *m_crack_overlay;
+	MapBlockMesh *m_highlight_overlay;
+
+	// Merges the static buffers of the blocks in the super chunk
+	void buildSuperChunk(v3s16 chunkpos, SuperChunk *chunk);
+	void deleteSuperChunk(SuperChunk *chunk);
+
+	// Blocks along each side of a super chunk, 0 if they aren't used
+	s16 m_super_chunk_size;
+	std::map<v3s16, SuperChunk*> m_super_chunks;
+	// Counts the solid passes, for SuperChunk::last_drawn
+	u32 m_frame;
 	
 	std::set<v2s16> m_last_drawn_sectors;
 };
@@ -43,6 +43,7 @@ static std::string getMediaCacheDir()
 */
 
 ClientMediaDownloader::ClientMediaDownloader():
+	m_media_pack(getMediaCacheDir()),
 	m_media_cache(getMediaCacheDir())
 {
 	m_initial_step_done = false;
@@ -183,16 +184,30 @@ void ClientMediaDownloader::initialStep(Client *client)
 		FileStatus *filestatus = it->second;
 		const std::string &sha1 = filestatus->sha1;
 
-		std::ostringstream tmp_os(std::ios_base::binary);
-		bool found_in_cache = m_media_cache.load(hex_encode(sha1), tmp_os);
+		std::string sha1_hex = hex_encode(sha1);
+		std::string data;
+		bool checked = false;
+		bool found_in_cache = m_media_pack.load(sha1_hex, data, checked);
+		bool found_in_pack = found_in_cache;
+		if (!found_in_cache) {
+			std::ostringstream tmp_os(std::ios_base::binary);
+			found_in_cache = m_media_cache.load(sha1_hex, tmp_os);
+			data = tmp_os.str();
+		}
 
 		// If found in cache, try to load it from there
 		if (found_in_cache) {
 			bool success = checkAndLoad(name, sha1,
-					tmp_os.str(), true, client);
+					data, true, client, checked);
 			if (success) {
 				filestatus->received = true;
 				m_uncached_count--;
+				// Files of the old cache move to the pack
+				if (!found_in_pack &&
+						m_media_pack.update(sha1_hex, data))
+					m_media_cache.remove(sha1_hex);
+				else if (!checked)
+					m_media_pack.setChecked(sha1_hex);
 			}
 		}
 	}
@@ -540,15 +555,16 @@ void ClientMediaDownloader::conventionalTransferDone(
 
 bool ClientMediaDownloader::checkAndLoad(
 		const std::string &name, const std::string &sha1,
-		const std::string &data, bool is_from_cache, Client *client)
+		const std::string &data, bool is_from_cache, Client *client,
+		bool is_checked)
 {
 	const char *cached_or_received = is_from_cache ? "cached" : "received";
 	const char *cached_or_received_uc = is_from_cache ? "Cached" : "Received";
 	std::string sha1_hex = hex_encode(sha1);
 
 	// Compute actual checksum of data
-	std::string data_sha1;
-	{
+	std::string data_sha1 = sha1;
+	if (!is_checked) {
 		SHA1 data_sha1_calculator;
 		data_sha1_calculator.addBytes(data.c_str(), data.size());
 		unsigned char *data_tmpdigest = data_sha1_calculator.getDigest();
@@ -584,7 +600,7 @@ bool ClientMediaDownloader::checkAndLoad(
 
 	// Update cache (unless we just loaded the file from the cache)
 	if (!is_from_cache)
-		m_media_cache.update(sha1_hex, data);
+		m_media_pack.update(sha1_hex, data);
 
 	return true;
 }
@@ -103,9 +103,10 @@ class ClientMediaDownloader
 	void startRemoteMediaTransfers();
 	void startConventionalTransfers(Client *client);
 
+	// With is_checked, the data is known to be good and isn't hashed again
 	bool checkAndLoad(const std::string &name, const std::string &sha1,
 			const std::string &data, bool is_from_cache,
-			Client *client);
+			Client *client, bool is_checked = false);
 
 	std::string serializeRequiredHashSet();
 	static void deSerializeHashSet(const std::string &data,
@@ -117,7 +118,11 @@ class ClientMediaDownloader
 	// Array of remote media servers
 	std::vector<RemoteServerStatus*> m_remotes;
 
-	// Filesystem-based media cache
+	// Media cache with the files in one pack
+	PackedFileCache m_media_pack;
+
+	// The file per item media cache of older versions; its files are
+	// moved to the pack when they are found there
 	FileCache m_media_cache;
 
 	// Has an attempt been made to load media files from the file cache?
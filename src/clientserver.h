@@ -108,9 +108,31 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	PROTOCOL_VERSION 24:
 		ContentFeatures version 7
 		ContentFeatures: change number of special tiles to 6 (CF_SPECIAL_COUNT)
+	PROTOCOL_VERSION 25:
+		TOCLIENT_BLOCK_NODE_CHANGES
+	PROTOCOL_VERSION 26:
+		GENERIC_CMD_UPDATE_POSITION_PACKED
+	PROTOCOL_VERSION 27:
+		TOCLIENT_INVENTORY_CHANGES
+		TOCLIENT_DETACHED_INVENTORY_CHANGES
+	PROTOCOL_VERSION 28:
+		TOCLIENT_INIT flags
+		TOSERVER_CACHED_BLOCKS
+		TOCLIENT_BLOCK_CACHED
+	PROTOCOL_VERSION 29:
+		SHA1 of the definitions in TOCLIENT_ITEMDEF and TOCLIENT_NODEDEF,
+		which leave out what the client has cached
+		Cached definitions in TOSERVER_INIT2
+	PROTOCOL_VERSION 30:
+		The server extrapolates player positions, and TOSERVER_PLAYERPOS
+		is only sent when the player strays from the extrapolation
+	PROTOCOL_VERSION 31:
+		TOCLIENT_NODEMETA_CHANGES
+	PROTOCOL_VERSION 32:
+		TOCLIENT_BATCH
 */
 
-#define LATEST_PROTOCOL_VERSION 24
+#define LATEST_PROTOCOL_VERSION 32
 
 // Server's supported network protocol range
 #define SERVER_PROTOCOL_VERSION_MIN 13
@@ -126,6 +148,22 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define PASSWORD_SIZE 28       // Maximum password length. Allows for
                                // base64-encoded SHA-1 (27+\0).
 
+// Most blocks of TOSERVER_CACHED_BLOCKS the server keeps for a client
+#define CACHED_BLOCKS_MAX 20000
+
+// TOSERVER_PLAYERPOS is sent when the player is this far from where the
+// server extrapolates it, its speed changed this much or it turned this
+// many degrees; and every PLAYERPOS_REFRESH_INTERVAL seconds while moving.
+// The server extrapolates for PLAYERPOS_EXTRAPOLATION_MAX seconds at most.
+// Stopping is sent PLAYERPOS_STOP_RESENDS more times at the normal rate,
+// as a lost stop would have the server move the player on.
+#define PLAYERPOS_MAX_DRIFT (0.2*BS)
+#define PLAYERPOS_MAX_SPEED_CHANGE (0.1*BS)
+#define PLAYERPOS_MAX_TURN 1.0
+#define PLAYERPOS_REFRESH_INTERVAL 1.0
+#define PLAYERPOS_EXTRAPOLATION_MAX 1.5
+#define PLAYERPOS_STOP_RESENDS 3
+
 #define FORMSPEC_API_VERSION 1
 #define FORMSPEC_VERSION_STRING "formspec_version[" TOSTRING(FORMSPEC_API_VERSION) "]"
 
@@ -141,8 +179,13 @@ enum ToClientCommand
 		[0] u16 TOSERVER_INIT
 		[2] u8 deployed version
 		[3] v3s16 player's position + v3f(0,BS/2,0) floatToInt'd
-		[12] u64 map seed (new as of 2011-02-27)
-		[20] f1000 recommended send interval (in seconds) (new as of 14)
+		[9] u64 map seed (new as of 2011-02-27)
+		[17] f1000 recommended send interval (in seconds) (new as of 14)
+		[21] u8 flags (new as of 28)
+			0x01: TOSERVER_CACHED_BLOCKS is taken
+			0x02: the definitions are sent by hash (new as of 29)
+			0x04: the server extrapolates the player's position from the
+			      last TOSERVER_PLAYERPOS (new as of 30)
 
 		NOTE: The position in here is deprecated; position is
 		      explicitly sent afterwards
@@ -321,8 +364,10 @@ enum ToClientCommand
 	TOCLIENT_NODEDEF = 0x3a,
 	/*
 		u16 command
+		u8[20] SHA1 of the compressed definitions (new as of 29)
 		u32 length of the next item
-		serialized NodeDefManager
+		zlib-compressed serialized NodeDefManager; empty if it is the one
+		the client has cached (new as of 29)
 	*/
 
 	TOCLIENT_CRAFTITEMDEF = 0x3b,
@@ -348,8 +393,10 @@ enum ToClientCommand
 	TOCLIENT_ITEMDEF = 0x3d,
 	/*
 		u16 command
+		u8[20] SHA1 of the compressed definitions (new as of 29)
 		u32 length of next item
-		serialized ItemDefManager
+		zlib-compressed serialized ItemDefManager; empty if it is the one
+		the client has cached (new as of 29)
 	*/
 
 	TOCLIENT_PLAY_SOUND = 0x3f,
@@ -556,6 +603,84 @@ enum ToClientCommand
 		v3f1000 first
 		v3f1000 third
 	*/
+
+	TOCLIENT_BLOCK_NODE_CHANGES = 0x53,
+	/*
+		Sent instead of TOCLIENT_BLOCKDATA, TOCLIENT_ADDNODE and
+		TOCLIENT_REMOVENODE when only a few nodes of a block the client
+		already has were changed. All changes of a server step to one block
+		go in one packet. Uses the same channel as TOCLIENT_BLOCKDATA so
+		that it is never applied to an older block.
+
+		u16 command
+		v3s16 blockpos
+		u16 count
+		for each count:
+			u16 index of node in block
+			u8 flags (0x01: remove node metadata)
+			serialized mapnode
+	*/
+
+	TOCLIENT_INVENTORY_CHANGES = 0x54,
+	/*
+		Sent instead of TOCLIENT_INVENTORY when only some slots of the
+		inventory the client already has were changed.
+
+		u16 command
+		serialized inventory changes (Inventory::serializeChanges())
+	*/
+
+	TOCLIENT_DETACHED_INVENTORY_CHANGES = 0x55,
+	/*
+		Sent instead of TOCLIENT_DETACHED_INVENTORY when only some slots
+		of a detached inventory were changed.
+
+		u16 command
+		u16 len
+		u8[len] name
+		serialized inventory changes (Inventory::serializeChanges())
+	*/
+
+	TOCLIENT_BLOCK_CACHED = 0x56,
+	/*
+		Sent instead of TOCLIENT_BLOCKDATA when the block the client has
+		in its block cache is the current one. The client loads it from
+		there as if it was received. Uses the same channel as
+		TOCLIENT_BLOCKDATA.
+
+		u16 command
+		v3s16 blockpos
+	*/
+
+	TOCLIENT_NODEMETA_CHANGES = 0x57,
+	/*
+		Sent instead of TOCLIENT_BLOCKDATA when only the metadata of some
+		nodes of a block the client already has was changed. Uses the same
+		channel as TOCLIENT_BLOCKDATA.
+
+		u16 command
+		v3s16 blockpos
+		zlib-compressed:
+			u16 count
+			for each count:
+				u16 index of node in block
+				u8 1 if the node has metadata, 0 if it was removed
+				if it has:
+					serialized node metadata (NodeMetadata::serialize())
+	*/
+
+	TOCLIENT_BATCH = 0x58,
+	/*
+		Small reliable messages to one client, collected during a server
+		step and sent together (chat messages and HUD changes). The client
+		handles them in order as if they had come one by one.
+
+		u16 command
+		u16 count
+		for each count:
+			u32 length
+			u8[length] message, starting with its own command
+	*/
 };
 
 enum ToServerCommand
@@ -578,6 +703,10 @@ enum ToServerCommand
 		After this, the server can send data.
 
 		[0] u16 TOSERVER_INIT2
+		If TOCLIENT_INIT has the flag for definitions by hash:
+		[2] u8[20] SHA1 of the item definitions the client has cached
+		[22] u8[20] SHA1 of the node definitions the client has cached
+		(all zeros if it has none)
 	*/
 
 	TOSERVER_GETBLOCK=0x20, // Obsolete
@@ -592,6 +721,10 @@ enum ToServerCommand
 		[2+12+12] s32 pitch*100
 		[2+12+12+4] s32 yaw*100
 		[2+12+12+4+4] u32 keyPressed
+
+		If the server extrapolates (TOCLIENT_INIT flag 0x04), it moves the
+		player on at the sent speed until the next one, so this is only
+		sent when the player strays from that or turns.
 	*/
 
 	TOSERVER_GOTBLOCKS = 0x24,
@@ -795,6 +928,22 @@ enum ToServerCommand
 		u16 len
 		u8[len] full_version_string
 	*/
+
+	TOSERVER_CACHED_BLOCKS = 0x44,
+	/*
+		The blocks the client has in its block cache from an earlier
+		session. Sent after TOSERVER_INIT2 if TOCLIENT_INIT has the flag for
+		it, in as many packets as needed, up to CACHED_BLOCKS_MAX blocks.
+		The server sends TOCLIENT_BLOCK_CACHED the first time it would send
+		one of them if its data hasn't changed.
+
+		u16 command
+		u16 count
+		for each count:
+			v3s16 blockpos
+			u64 token (getNetworkSerializationToken() of the data of the
+			           TOCLIENT_BLOCKDATA it came in)
+	*/
 };
 
 #endif
@@ -36,7 +36,11 @@ Clouds::Clouds(
 	m_seed(seed),
 	m_camera_pos(0,0),
 	m_time(0),
-	m_camera_offset(0,0,0)
+	m_camera_offset(0,0,0),
+	m_meshbuffer(new scene::SMeshBuffer()),
+	m_mesh_center(0,0),
+	m_mesh_valid(false),
+	m_mesh_3d(false)
 {
 	m_material.setFlag(video::EMF_LIGHTING, false);
 	//m_material.setFlag(video::EMF_BACK_FACE_CULLING, false);
@@ -53,10 +57,15 @@ Clouds::Clouds(
 	m_box = core::aabbox3d<f32>(-BS*1000000,m_cloud_y-BS,-BS*1000000,
 			BS*1000000,m_cloud_y+BS,BS*1000000);
 
+	// The mesh is kept on the GPU until it is made again
+	if(g_settings->getBool("enable_vbo"))
+		m_meshbuffer->setHardwareMappingHint(scene::EHM_STATIC);
 }
 
 Clouds::~Clouds()
 {
+	SceneManager->getVideoDriver()->removeHardwareBuffer(m_meshbuffer);
+	m_meshbuffer->drop();
 }
 
 void Clouds::OnRegisterSceneNode()
@@ -72,6 +81,13 @@ void Clouds::OnRegisterSceneNode()
 
 #define MYROUND(x) (x > 0.0 ? (int)x : (int)x - 1)
 
+/*
+	Clouds move from X+ towards X-
+*/
+static const s16 cloud_radius_i = 12;
+static const float cloud_size = BS*64;
+static const v2f cloud_speed(0, -BS*2);
+
 void Clouds::render()
 {
 	video::IVideoDriver* driver = SceneManager->getVideoDriver();
@@ -83,21 +99,9 @@ void Clouds::render()
 	ScopeProfiler sp(g_profiler, "Rendering of clouds, avg", SPT_AVG);
 	
 	bool enable_3d = g_settings->getBool("enable_3d_clouds");
-	int num_faces_to_draw = enable_3d ? 6 : 1;
 	
 	m_material.setFlag(video::EMF_BACK_FACE_CULLING, enable_3d);
 
-	driver->setTransform(video::ETS_WORLD, AbsoluteTransformation);
-	driver->setMaterial(m_material);
-	
-	/*
-		Clouds move from X+ towards X-
-	*/
-
-	const s16 cloud_radius_i = 12;
-	const float cloud_size = BS*64;
-	const v2f cloud_speed(0, -BS*2);
-	
 	const float cloud_full_radius = cloud_size * cloud_radius_i;
 	
 	// Position of cloud noise origin in world coordinates
@@ -117,6 +121,57 @@ void Clouds::render()
 		center_of_drawing_in_noise_i.Y * cloud_size
 	) + world_cloud_origin_pos_f;
 
+	/*
+		The mesh is made around the center cell and only made again when
+		the center moves to another cell or the colors change; the motion
+		within a cell is done by the transformation
+	*/
+	video::SColorf c_top_f(m_color);
+	c_top_f.a = 0.9;
+	video::SColor c_top = c_top_f.toSColor();
+	if(!m_mesh_valid || center_of_drawing_in_noise_i != m_mesh_center
+			|| enable_3d != m_mesh_3d || c_top != m_mesh_color)
+		updateMesh(center_of_drawing_in_noise_i, enable_3d);
+
+	// Get fog parameters for setting them back later
+	video::SColor fog_color(0,0,0,0);
+	video::E_FOG_TYPE fog_type = video::EFT_FOG_LINEAR;
+	f32 fog_start = 0;
+	f32 fog_end = 0;
+	f32 fog_density = 0;
+	bool fog_pixelfog = false;
+	bool fog_rangefog = false;
+	driver->getFog(fog_color, fog_type, fog_start, fog_end, fog_density,
+			fog_pixelfog, fog_rangefog);
+	
+	// Set our own fog
+	driver->setFog(fog_color, fog_type, cloud_full_radius * 0.5,
+			cloud_full_radius*1.2, fog_density, fog_pixelfog, fog_rangefog);
+
+	v3f pos(world_center_of_drawing_in_noise_f.X, m_cloud_y,
+			world_center_of_drawing_in_noise_f.Y);
+	pos -= intToFloat(m_camera_offset, BS);
+	core::matrix4 transform = AbsoluteTransformation;
+	transform.setTranslation(transform.getTranslation() + pos);
+
+	driver->setTransform(video::ETS_WORLD, transform);
+	driver->setMaterial(m_material);
+	if(m_meshbuffer->getIndexCount() != 0)
+		driver->drawMeshBuffer(m_meshbuffer);
+
+	// Restore fog settings
+	driver->setFog(fog_color, fog_type, fog_start, fog_end, fog_density,
+			fog_pixelfog, fog_rangefog);
+}
+
+void Clouds::updateMesh(v2s16 center_of_drawing_in_noise_i, bool enable_3d)
+{
+	m_mesh_valid = true;
+	m_mesh_center = center_of_drawing_in_noise_i;
+	m_mesh_3d = enable_3d;
+
+	int num_faces_to_draw = enable_3d ? 6 : 1;
+
 	/*video::SColor c_top(128,b*240,b*240,b*255);
 	video::SColor c_side_1(128,b*230,b*230,b*255);
 	video::SColor c_side_2(128,b*220,b*220,b*245);
@@ -142,21 +197,7 @@ void Clouds::render()
 	video::SColor c_side_1 = c_side_1_f.toSColor();
 	video::SColor c_side_2 = c_side_2_f.toSColor();
 	video::SColor c_bottom = c_bottom_f.toSColor();
-
-	// Get fog parameters for setting them back later
-	video::SColor fog_color(0,0,0,0);
-	video::E_FOG_TYPE fog_type = video::EFT_FOG_LINEAR;
-	f32 fog_start = 0;
-	f32 fog_end = 0;
-	f32 fog_density = 0;
-	bool fog_pixelfog = false;
-	bool fog_rangefog = false;
-	driver->getFog(fog_color, fog_type, fog_start, fog_end, fog_density,
-			fog_pixelfog, fog_rangefog);
-	
-	// Set our own fog
-	driver->setFog(fog_color, fog_type, cloud_full_radius * 0.5,
-			cloud_full_radius*1.2, fog_density, fog_pixelfog, fog_rangefog);
+	m_mesh_color = c_top;
 
 	// Read noise
 
@@ -192,6 +233,11 @@ void Clouds::render()
 #define INAREA(x, z, radius) \
 	((x) >= -(radius) && (x) < (radius) && (z) >= -(radius) && (z) < (radius))
 
+	core::array<video::S3DVertex> &vertices = m_meshbuffer->Vertices;
+	core::array<u16> &indices = m_meshbuffer->Indices;
+	vertices.set_used(0);
+	indices.set_used(0);
+
 	for(s16 zi0=-cloud_radius_i; zi0<cloud_radius_i; zi0++)
 	for(s16 xi0=-cloud_radius_i; xi0<cloud_radius_i; xi0++)
 	{
@@ -213,7 +259,8 @@ void Clouds::render()
 		if(grid[i] == false)
 			continue;
 
-		v2f p0 = v2f(xi,zi)*cloud_size + world_center_of_drawing_in_noise_f;
+		// Relative to the center cell
+		v2f p0 = v2f(xi,zi)*cloud_size;
 
 		video::S3DVertex v[4] = {
 			video::S3DVertex(0,0,0, 0,0,0, c_top, 0, 1),
@@ -222,13 +269,6 @@ void Clouds::render()
 			video::S3DVertex(0,0,0, 0,0,0, c_top, 0, 0)
 		};
 
-		/*if(zi <= 0 && xi <= 0){
-			v[0].Color.setBlue(255);
-			v[1].Color.setBlue(255);
-			v[2].Color.setBlue(255);
-			v[3].Color.setBlue(255);
-		}*/
-
 		f32 rx = cloud_size/2;
 		f32 ry = 8*BS;
 		f32 rz = cloud_size/2;
@@ -318,22 +358,23 @@ void Clouds::render()
 				break;
 			}
 
-			v3f pos(p0.X, m_cloud_y, p0.Y);
-			pos -= intToFloat(m_camera_offset, BS);
-
+			u16 base = vertices.size();
 			for(u16 i=0; i<4; i++)
-				v[i].Pos += pos;
-			u16 indices[] = {0,1,2,2,3,0};
-			driver->drawVertexPrimitiveList(v, 4, indices, 2,
-					video::EVT_STANDARD, scene::EPT_TRIANGLES, video::EIT_16BIT);
+			{
+				video::S3DVertex vertex = v[i];
+				vertex.Pos += v3f(p0.X, 0, p0.Y);
+				vertices.push_back(vertex);
+			}
+			u16 face_indices[] = {0,1,2,2,3,0};
+			for(u16 i=0; i<6; i++)
+				indices.push_back(base + face_indices[i]);
 		}
 	}
 
 	delete[] grid;
-	
-	// Restore fog settings
-	driver->setFog(fog_color, fog_type, fog_start, fog_end, fog_density,
-			fog_pixelfog, fog_rangefog);
+
+	m_meshbuffer->recalculateBoundingBox();
+	m_meshbuffer->setDirty();
 }
 
 void Clouds::step(float dtime)
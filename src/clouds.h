@@ -84,6 +84,16 @@ class Clouds : public scene::ISceneNode
 	v2f m_camera_pos;
 	float m_time;
 	v3s16 m_camera_offset;
+
+	// Makes the mesh around the cell of the noise at the center of drawing
+	void updateMesh(v2s16 center_of_drawing_in_noise_i, bool enable_3d);
+
+	scene::SMeshBuffer *m_meshbuffer;
+	// What the mesh was made for
+	v2s16 m_mesh_center;
+	bool m_mesh_valid;
+	bool m_mesh_3d;
+	video::SColor m_mesh_color;
 };
 
 
@@ -246,6 +246,18 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	s16 max_y = MYMAX(oldpos_i.Y, newpos_i.Y) + (box_0.MaxEdge.Y / BS) + 1;
 	s16 max_z = MYMAX(oldpos_i.Z, newpos_i.Z) + (box_0.MaxEdge.Z / BS) + 1;
 
+	// Most of the range is usually air, but reserve for a floor layer
+	size_t reserve_count = (max_x - min_x + 1) * (max_z - min_z + 1) * 2;
+	cboxes.reserve(reserve_count);
+	is_unloaded.reserve(reserve_count);
+	is_step_up.reserve(reserve_count);
+	is_object.reserve(reserve_count);
+	bouncy_values.reserve(reserve_count);
+	node_positions.reserve(reserve_count);
+
+	INodeDefManager *ndef = gamedef->getNodeDefManager();
+	std::vector<aabb3f> dynamic_boxes;
+
 	for(s16 x = min_x; x <= max_x; x++)
 	for(s16 y = min_y; y <= max_y; y++)
 	for(s16 z = min_z; z <= max_z; z++)
@@ -258,15 +270,21 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		if (is_position_valid) {
 			// Object collides into walkable nodes
 
-			const ContentFeatures &f = gamedef->getNodeDefManager()->get(n);
+			const ContentFeatures &f = ndef->get(n);
 			if(f.walkable == false)
 				continue;
 			int n_bouncy_value = itemgroup_get(f.groups, "bouncy");
 
-			std::vector<aabb3f> nodeboxes = n.getCollisionBoxes(gamedef->ndef());
-			for(std::vector<aabb3f>::iterator
-					i = nodeboxes.begin();
-					i != nodeboxes.end(); i++)
+			// The boxes of all but leveled nodes are cached
+			const std::vector<aabb3f> *nodeboxes =
+					f.getCachedCollisionBoxes(n.getParam2());
+			if (nodeboxes == NULL) {
+				dynamic_boxes = n.getCollisionBoxes(gamedef->ndef());
+				nodeboxes = &dynamic_boxes;
+			}
+			for(std::vector<aabb3f>::const_iterator
+					i = nodeboxes->begin();
+					i != nodeboxes->end(); i++)
 			{
 				aabb3f box = *i;
 				box.MinEdge += v3f(x, y, z)*BS;
@@ -37,6 +37,8 @@
 #endif
 
 #define HAVE_ENDIAN_H 0
+#define HAVE_SENDMMSG 0
+#define HAVE_RECVMMSG 0
 
 #ifdef USE_CMAKE_CONFIG_H
 	#include "cmake_config.h"
@@ -76,6 +78,10 @@
 	#define VERSION_EXTRA_STRING CMAKE_VERSION_EXTRA_STRING
 	#undef HAVE_ENDIAN_H
 	#define HAVE_ENDIAN_H CMAKE_HAVE_ENDIAN_H
+	#undef HAVE_SENDMMSG
+	#define HAVE_SENDMMSG CMAKE_HAVE_SENDMMSG
+	#undef HAVE_RECVMMSG
+	#define HAVE_RECVMMSG CMAKE_HAVE_RECVMMSG
 #endif
 
 #ifdef __ANDROID__
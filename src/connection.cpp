@@ -202,30 +202,70 @@ SharedBuffer<u8> makeReliablePacket(
 	return b;
 }
 
+BufferedPacket makeReliablePacket(Address &address, SharedBuffer<u8> &data,
+		u16 seqnum, u32 protocol_id, u16 sender_peer_id, u8 channel)
+{
+	u32 header_size = BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE;
+	BufferedPacket p(data.getSize() + header_size);
+	p.address = address;
+
+	writeU32(&p.data[0], protocol_id);
+	writeU16(&p.data[4], sender_peer_id);
+	writeU8(&p.data[6], channel);
+	writeU8(&p.data[BASE_HEADER_SIZE], TYPE_RELIABLE);
+	writeU16(&p.data[BASE_HEADER_SIZE + 1], seqnum);
+
+	memcpy(&p.data[header_size], *data, data.getSize());
+
+	return p;
+}
+
+void writeSplitSeqnum(BufferedPacket &p, u32 offset, u16 split_seqnum)
+{
+	if(readU8(&p.data[offset]) == TYPE_SPLIT)
+		writeU16(&p.data[offset + 1], split_seqnum);
+}
+
 /*
 	ReliablePacketBuffer
 */
 
-ReliablePacketBuffer::ReliablePacketBuffer(): m_list_size(0) {}
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_first(0),
+	m_span(0),
+	m_list_size(0),
+	m_data_size(0),
+	m_time(0)
+{
+}
+
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	for(std::vector<Slot*>::iterator i = m_ring.begin();
+		i != m_ring.end(); ++i)
+	{
+		delete *i;
+	}
+}
 
 void ReliablePacketBuffer::print()
 {
 	JMutexAutoLock listlock(m_list_mutex);
 	LOG(dout_con<<"Dump of ReliablePacketBuffer:" << std::endl);
 	unsigned int index = 0;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end();
-		++i)
+	for(u32 offset = 0; offset < m_span; offset++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		LOG(dout_con<<index<< ":" << s << std::endl);
+		Slot *slot = findSlot(m_first + offset);
+		if(slot == NULL)
+			continue;
+		LOG(dout_con<<index<< ":" << slot->seqnum << std::endl);
 		index++;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	return m_list.empty();
+	return m_list_size == 0;
 }
 
 u32 ReliablePacketBuffer::size()
@@ -233,82 +273,111 @@ u32 ReliablePacketBuffer::size()
 	return m_list_size;
 }
 
+u32 ReliablePacketBuffer::dataSize()
+{
+	JMutexAutoLock listlock(m_list_mutex);
+	return m_data_size;
+}
+
 bool ReliablePacketBuffer::containsPacket(u16 seqnum)
 {
-	return !(findPacket(seqnum) == m_list.end());
+	JMutexAutoLock listlock(m_list_mutex);
+	return findSlot(seqnum) != NULL;
 }
 
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+ReliablePacketBuffer::Slot* ReliablePacketBuffer::findSlot(u16 seqnum)
 {
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
-			break;
+	if(m_list_size == 0)
+		return NULL;
+	if((u16)(seqnum - m_first) >= m_span)
+		return NULL;
+	Slot *slot = m_ring[seqnum & (m_ring.size() - 1)];
+	if(slot == NULL || slot->seqnum != seqnum)
+		return NULL;
+	return slot;
+}
+
+BufferedPacket ReliablePacketBuffer::removeSlot(Slot *slot)
+{
+	u16 seqnum = slot->seqnum;
+	u32 mask = m_ring.size() - 1;
+
+	BufferedPacket p = slot->packet;
+	p.time = m_time - slot->sent_at;
+	p.totaltime = m_time - slot->buffered_at;
+
+	m_resend_queue.erase(slot->resend_pos);
+	m_ring[seqnum & mask] = NULL;
+	m_data_size -= slot->packet.data.getSize();
+	delete slot;
+	--m_list_size;
+
+	if(m_list_size == 0) {
+		m_first = 0;
+		m_span = 0;
+		m_time = 0;
+		return p;
+	}
+
+	// Close the gaps at both ends of the ring
+	if(seqnum == m_first) {
+		do {
+			++m_first;
+			--m_span;
+		} while(m_ring[m_first & mask] == NULL);
 	}
-	return i;
+	while(m_ring[(u16)(m_first + m_span - 1) & mask] == NULL)
+		--m_span;
+
+	return p;
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+
+void ReliablePacketBuffer::growRing(u32 span)
 {
-	return m_list.end();
+	if(span <= m_ring.size())
+		return;
+
+	u32 capacity = m_ring.empty() ? 64 : m_ring.size();
+	while(capacity < span)
+		capacity *= 2;
+	assert(capacity <= SEQNUM_MAX+1);
+
+	std::vector<Slot*> ring(capacity, (Slot*)NULL);
+	for(std::vector<Slot*>::iterator i = m_ring.begin();
+		i != m_ring.end(); ++i)
+	{
+		if(*i != NULL)
+			ring[(*i)->seqnum & (capacity - 1)] = *i;
+	}
+	m_ring.swap(ring);
 }
+
 bool ReliablePacketBuffer::getFirstSeqnum(u16& result)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	if(m_list.empty())
+	if(m_list_size == 0)
 		return false;
-	BufferedPacket p = *m_list.begin();
-	result = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	result = m_first;
 	return true;
 }
 
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	if(m_list.empty())
+	if(m_list_size == 0)
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
-
-	if (m_list_size == 0) {
-		m_oldest_non_answered_ack = 0;
-	} else {
-		m_oldest_non_answered_ack =
-				readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
-	}
-	return p;
+	return removeSlot(findSlot(m_first));
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	Slot *slot = findSlot(seqnum);
+	if(slot == NULL){
 		LOG(dout_con<<"Sequence number: " << seqnum
 				<< " not found in reliable buffer"<<std::endl);
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-
-
-	RPBSearchResult next = r;
-	next++;
-	if (next != notFound()) {
-		u16 s = readU16(&(next->data[BASE_HEADER_SIZE+1]));
-		m_oldest_non_answered_ack = s;
-	}
-
-	m_list.erase(r);
-	--m_list_size;
-
-	if (m_list_size == 0)
-	{ m_oldest_non_answered_ack = 0; }
-	else
-	{ m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);	}
-	return p;
+	return removeSlot(slot);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 {
@@ -321,48 +390,11 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 	assert(seqnum_in_window(seqnum,next_expected,MAX_RELIABLE_WINDOW_SIZE));
 	assert(seqnum != next_expected);
 
-	++m_list_size;
-	assert(m_list_size <= SEQNUM_MAX+1);
-
-	// Find the right place for the packet and insert it there
-	// If list is empty, just add it
-	if(m_list.empty())
-	{
-		m_list.push_back(p);
-		m_oldest_non_answered_ack = seqnum;
-		// Done.
-		return;
-	}
-
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-
-	/* case seqnum is smaller then next_expected seqnum */
-	/* this is true e.g. on wrap around */
-	if (seqnum < next_expected) {
-		while(((s < seqnum) || (s >= next_expected)) && (i != m_list.end())) {
-			i++;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-	/* non wrap around case (at least for incoming and next_expected */
-	else
-	{
-		while(((s < seqnum) && (s >= next_expected)) && (i != m_list.end())) {
-			i++;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-
-	if (s == seqnum) {
+	Slot *old = findSlot(seqnum);
+	if (old != NULL) {
 		if (
-			(readU16(&(i->data[BASE_HEADER_SIZE+1])) != seqnum) ||
-			(i->data.getSize() != p.data.getSize()) ||
-			(i->address != p.address)
+			(old->packet.data.getSize() != p.data.getSize()) ||
+			(old->packet.address != p.address)
 			)
 		{
 			/* if this happens your maximum transfer window may be to big */
@@ -370,43 +402,56 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 					"Duplicated seqnum %d non matching packet detected:\n",
 					seqnum);
 			fprintf(stderr, "Old: seqnum: %05d size: %04d, address: %s\n",
-					readU16(&(i->data[BASE_HEADER_SIZE+1])),i->data.getSize(),
-					i->address.serializeString().c_str());
+					old->seqnum, old->packet.data.getSize(),
+					old->packet.address.serializeString().c_str());
 			fprintf(stderr, "New: seqnum: %05d size: %04d, address: %s\n",
 					readU16(&(p.data[BASE_HEADER_SIZE+1])),p.data.getSize(),
 					p.address.serializeString().c_str());
 			throw IncomingDataCorruption("duplicated packet isn't same as original one");
 		}
 
-		assert(readU16(&(i->data[BASE_HEADER_SIZE+1])) == seqnum);
-		assert(i->data.getSize() == p.data.getSize());
-		assert(i->address == p.address);
-
 		/* nothing to do this seems to be a resent packet */
 		/* for paranoia reason data should be compared */
-		--m_list_size;
-	}
-	/* insert or push back */
-	else if (i != m_list.end()) {
-		m_list.insert(i, p);
+		return;
 	}
-	else {
-		m_list.push_back(p);
+
+	/*
+		All buffered seqnums are within one window of less than half the
+		seqnum space, so the 16 bit distance tells which side the new
+		packet is on.
+	*/
+	u16 first = m_first;
+	u32 span = m_span;
+	if (m_list_size == 0) {
+		first = seqnum;
+		span = 1;
+	} else if ((u16)(seqnum - m_first) < MAX_RELIABLE_WINDOW_SIZE) {
+		span = MYMAX(span, (u32)(u16)(seqnum - m_first) + 1);
+	} else {
+		first = seqnum;
+		span += (u16)(m_first - seqnum);
 	}
 
-	/* update last packet number */
-	m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
+	growRing(span);
+	m_first = first;
+	m_span = span;
+
+	Slot *slot = new Slot(p, seqnum);
+	slot->sent_at = m_time - p.time;
+	slot->buffered_at = m_time - p.totaltime;
+	slot->resend_pos = m_resend_queue.insert(m_resend_queue.end(), seqnum);
+	m_ring[seqnum & (m_ring.size() - 1)] = slot;
+
+	++m_list_size;
+	m_data_size += p.data.getSize();
+	assert(m_list_size <= SEQNUM_MAX+1);
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
-	{
-		i->time += dtime;
-		i->totaltime += dtime;
-	}
+	if (m_list_size != 0)
+		m_time += dtime;
 }
 
 std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
@@ -414,17 +459,28 @@ std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
 {
 	JMutexAutoLock listlock(m_list_mutex);
 	std::list<BufferedPacket> timed_outs;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+
+	// Each packet is looked at once at most, even if it times out again
+	// right after being moved to the back of the queue
+	u32 remaining = m_resend_queue.size();
+	while (remaining > 0 && timed_outs.size() < max_packets)
 	{
-		if(i->time >= timeout) {
-			timed_outs.push_back(*i);
+		remaining--;
+		std::list<u16>::iterator i = m_resend_queue.begin();
+		Slot *slot = findSlot(*i);
+		assert(slot != NULL);
 
-			//this packet will be sent right afterwards reset timeout here
-			i->time = 0.0;
-			if (timed_outs.size() >= max_packets)
-				break;
-		}
+		if (m_time - slot->sent_at < timeout)
+			break;
+
+		BufferedPacket p = slot->packet;
+		p.time = m_time - slot->sent_at;
+		p.totaltime = m_time - slot->buffered_at;
+		timed_outs.push_back(p);
+
+		//this packet will be sent right afterwards reset timeout here
+		slot->sent_at = m_time;
+		m_resend_queue.splice(m_resend_queue.end(), m_resend_queue, i);
 	}
 	return timed_outs;
 }
@@ -442,6 +498,33 @@ IncomingSplitBuffer::~IncomingSplitBuffer()
 		delete i->second;
 	}
 }
+u32 IncomingSplitBuffer::dataSize()
+{
+	JMutexAutoLock listlock(m_map_mutex);
+	u32 size = 0;
+	for(std::map<u16, IncomingSplitPacket*>::iterator i = m_buf.begin();
+		i != m_buf.end(); ++i)
+	{
+		IncomingSplitPacket *sp = i->second;
+		size += sp->data_capacity + sp->last_chunk.capacity();
+	}
+	return size;
+}
+// Makes room for size bytes of the chunks before the last one
+static void grow_split_data(IncomingSplitPacket *sp, u32 size)
+{
+	if(size <= sp->data_capacity)
+		return;
+	u32 full = sp->chunk_count * sp->chunk_size;
+	u32 capacity = MYMAX(size, MYMIN(sp->data_capacity * 2, full));
+	u8 *data = new u8[capacity];
+	if(sp->data_capacity != 0)
+		memcpy(data, sp->data, sp->data_capacity);
+	delete[] sp->data;
+	sp->data = data;
+	sp->data_capacity = capacity;
+}
+
 /*
 	This will throw a GotSplitPacketException when a full
 	split packet is constructed.
@@ -458,15 +541,18 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	u16 chunk_num = readU16(&p.data[BASE_HEADER_SIZE+5]);
 
 	// Add if doesn't exist
-	if(m_buf.find(seqnum) == m_buf.end())
-	{
-		IncomingSplitPacket *sp = new IncomingSplitPacket();
-		sp->chunk_count = chunk_count;
-		sp->reliable = reliable;
-		m_buf[seqnum] = sp;
+	std::map<u16, IncomingSplitPacket*>::iterator i = m_buf.find(seqnum);
+	if(i == m_buf.end()){
+		if(m_buf.size() >= MAX_INCOMPLETE_SPLIT_PACKETS){
+			LOG(derr_con<<"Connection: WARNING: too many incomplete split"
+					<<" packets, dropping seqnum="<<seqnum<<std::endl);
+			return SharedBuffer<u8>();
+		}
+		i = m_buf.insert(std::make_pair(seqnum,
+				new IncomingSplitPacket(chunk_count, reliable))).first;
 	}
 
-	IncomingSplitPacket *sp = m_buf[seqnum];
+	IncomingSplitPacket *sp = i->second;
 
 	// TODO: These errors should be thrown or something? Dunno.
 	if(chunk_count != sp->chunk_count)
@@ -477,53 +563,93 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 		LOG(derr_con<<"Connection: WARNING: reliable="<<reliable
 				<<" != sp->reliable="<<sp->reliable
 				<<std::endl);
+	if(chunk_num >= sp->chunk_count){
+		LOG(derr_con<<"Connection: WARNING: chunk_num="<<chunk_num
+				<<" >= sp->chunk_count="<<sp->chunk_count
+				<<std::endl);
+		return SharedBuffer<u8>();
+	}
 
 	// If chunk already exists, ignore it.
 	// Sometimes two identical packets may arrive when there is network
 	// lag and the server re-sends stuff.
-	if(sp->chunks.find(chunk_num) != sp->chunks.end())
+	if(sp->received[chunk_num])
 		return SharedBuffer<u8>();
 
-	// Cut chunk data out of packet
 	u32 chunkdatasize = p.data.getSize() - headersize;
-	SharedBuffer<u8> chunkdata(chunkdatasize);
-	memcpy(*chunkdata, &(p.data[headersize]), chunkdatasize);
-
-	// Set chunk data in buffer
-	sp->chunks[chunk_num] = chunkdata;
+	const u8 *chunkdata = &p.data[headersize];
+	u32 last_num = sp->chunk_count - 1;
+
+	if(chunk_num != last_num){
+		if(sp->chunk_size == 0){
+			// The first full chunk tells where everything goes
+			if(sp->received[last_num] &&
+					sp->last_chunk_size > chunkdatasize){
+				LOG(derr_con<<"Connection: WARNING: the last chunk is"
+						<<" larger than the others"<<std::endl);
+				return SharedBuffer<u8>();
+			}
+			sp->chunk_size = chunkdatasize;
+		}
+		else if(chunkdatasize != sp->chunk_size){
+			LOG(derr_con<<"Connection: WARNING: chunk size="<<chunkdatasize
+					<<" != sp->chunk_size="<<sp->chunk_size
+					<<std::endl);
+			return SharedBuffer<u8>();
+		}
+		// The buffer grows with the chunks that come, not with what the
+		// sender claims chunk_count to be
+		u32 end = (chunk_num + 1) * sp->chunk_size;
+		if(end > (sp->chunks_received + 1) * sp->chunk_size * 2
+				+ SPLIT_BUFFER_AHEAD){
+			LOG(derr_con<<"Connection: WARNING: chunk_num="<<chunk_num
+					<<" is too far ahead of the "<<sp->chunks_received
+					<<" chunks received"<<std::endl);
+			return SharedBuffer<u8>();
+		}
+		grow_split_data(sp, end);
+		memcpy(&sp->data[chunk_num * sp->chunk_size], chunkdata,
+				chunkdatasize);
+	}
+	else{
+		if(sp->chunk_size != 0 && chunkdatasize > sp->chunk_size){
+			LOG(derr_con<<"Connection: WARNING: the last chunk is"
+					<<" larger than the others"<<std::endl);
+			return SharedBuffer<u8>();
+		}
+		sp->last_chunk.assign(chunkdata, chunkdata + chunkdatasize);
+		sp->last_chunk_size = chunkdatasize;
+	}
+	sp->received[chunk_num] = true;
+	sp->chunks_received++;
+	sp->time = 0.0;
 
 	// If not all chunks are received, return empty buffer
 	if(sp->allReceived() == false)
 		return SharedBuffer<u8>();
 
-	// Calculate total size
-	u32 totalsize = 0;
-	for(std::map<u16, SharedBuffer<u8> >::iterator i = sp->chunks.begin();
-		i != sp->chunks.end(); ++i)
-	{
-		totalsize += i->second.getSize();
+	u32 totalsize = last_num * sp->chunk_size + sp->last_chunk_size;
+	u8 *fulldata;
+	if(last_num == 0){
+		// Only the one chunk, which is the last
+		fulldata = new u8[totalsize];
 	}
-
-	SharedBuffer<u8> fulldata(totalsize);
-
-	// Copy chunks to data buffer
-	u32 start = 0;
-	for(u32 chunk_i=0; chunk_i<sp->chunk_count;
-			chunk_i++)
-	{
-		SharedBuffer<u8> buf = sp->chunks[chunk_i];
-		u16 chunkdatasize = buf.getSize();
-		memcpy(&fulldata[start], *buf, chunkdatasize);
-		start += chunkdatasize;;
+	else{
+		grow_split_data(sp, totalsize);
+		fulldata = sp->data;
+		sp->data = NULL;
 	}
+	if(sp->last_chunk_size != 0)
+		memcpy(&fulldata[last_num * sp->chunk_size], &sp->last_chunk[0],
+				sp->last_chunk_size);
 
 	// Remove sp from buffer
-	m_buf.erase(seqnum);
+	m_buf.erase(i);
 	delete sp;
 
-	return fulldata;
+	return SharedBuffer<u8>::adopt(fulldata, totalsize);
 }
-void IncomingSplitBuffer::removeUnreliableTimedOuts(float dtime, float timeout)
+void IncomingSplitBuffer::removeTimedOuts(float dtime, float timeout)
 {
 	std::list<u16> remove_queue;
 	{
@@ -532,9 +658,6 @@ void IncomingSplitBuffer::removeUnreliableTimedOuts(float dtime, float timeout)
 			i != m_buf.end(); ++i)
 		{
 			IncomingSplitPacket *p = i->second;
-			// Reliable ones are not removed by timeout
-			if(p->reliable == true)
-				continue;
 			p->time += dtime;
 			if(p->time >= timeout)
 				remove_queue.push_back(i->first);
@@ -544,7 +667,7 @@ void IncomingSplitBuffer::removeUnreliableTimedOuts(float dtime, float timeout)
 		j != remove_queue.end(); ++j)
 	{
 		JMutexAutoLock listlock(m_map_mutex);
-		LOG(dout_con<<"NOTE: Removing timed out unreliable split packet"<<std::endl);
+		LOG(dout_con<<"NOTE: Removing timed out split packet"<<std::endl);
 		delete m_buf[*j];
 		m_buf.erase(*j);
 	}
@@ -1093,11 +1216,17 @@ bool UDPPeer::processReliableSendCommand(
 
 	std::list<SharedBuffer<u8> > originals;
 	u16 split_sequence_number = channels[c.channelnum].readNextSplitSeqNum();
+	bool shared_chunks = !c.raw && !c.chunks.empty();
 
 	if (c.raw)
 	{
 		originals.push_back(c.data);
 	}
+	else if (shared_chunks) {
+		originals = c.chunks;
+		if (originals.size() > 1)
+			channels[c.channelnum].setNextSplitSeqNum(split_sequence_number + 1);
+	}
 	else {
 		originals = makeAutoSplitPacket(c.data, chunksize_max,split_sequence_number);
 		channels[c.channelnum].setNextSplitSeqNum(split_sequence_number);
@@ -1123,12 +1252,12 @@ bool UDPPeer::processReliableSendCommand(
 			have_initial_sequence_number = true;
 		}
 
-		SharedBuffer<u8> reliable = makeReliablePacket(*i, seqnum);
-
-		// Add base headers and make a packet
-		BufferedPacket p = con::makePacket(address, reliable,
+		BufferedPacket p = con::makeReliablePacket(address, *i, seqnum,
 				m_connection->GetProtocolID(), m_connection->GetPeerID(),
 				c.channelnum);
+		if (shared_chunks)
+			writeSplitSeqnum(p, BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE,
+					split_sequence_number);
 
 		toadd.push_back(p);
 	}
@@ -1244,7 +1373,8 @@ ConnectionSendThread::ConnectionSendThread(Connection* parent,
 	m_timeout(timeout),
 	m_max_commands_per_iteration(1),
 	m_max_data_packets_per_iteration(g_settings->getU16("max_packets_per_iteration")),
-	m_max_packets_requeued(256)
+	m_max_packets_requeued(256),
+	m_bulk_share(rangelim(g_settings->getFloat("bulk_packet_share"), 0, 1))
 {
 }
 
@@ -1300,9 +1430,14 @@ void * ConnectionSendThread::Thread()
 		/* send non reliable packets */
 		sendPackets(dtime);
 
+		/* hand everything collected in this iteration to the socket */
+		flushSendBatch();
+
 		END_DEBUG_EXCEPTION_HANDLER(errorstream);
 	}
 
+	flushSendBatch();
+
 	PROFILE(g_profiler->remove(ThreadIdentifier.str()));
 	return NULL;
 }
@@ -1393,8 +1528,8 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			if (dynamic_cast<UDPPeer*>(&peer)->getLegacyPeer())
 				channel->setWindowSize(g_settings->getU16("workaround_window_size"));
 
-			// Remove timed out incomplete unreliable split packets
-			channel->incoming_splits.removeUnreliableTimedOuts(dtime, m_timeout);
+			// Remove timed out incomplete split packets
+			channel->incoming_splits.removeTimedOuts(dtime, m_timeout);
 
 			// Increment reliable packet times
 			channel->outgoing_reliables_sent.incrementTimeouts(dtime);
@@ -1471,17 +1606,36 @@ void ConnectionSendThread::runTimeouts(float dtime)
 
 void ConnectionSendThread::rawSend(const BufferedPacket &packet)
 {
-	try{
-		m_connection->m_udpSocket.Send(packet.address, *packet.data,
-				packet.data.getSize());
-		LOG(dout_con <<m_connection->getDesc()
-				<< " rawSend: " << packet.data.getSize()
-				<< " bytes sent" << std::endl);
-	} catch(SendFailedException &e){
+	// Packets are sent in batches, see flushSendBatch()
+	m_send_batch.push_back(packet);
+	if(m_send_batch.size() >= UDP_SEND_BATCH_MAX)
+		flushSendBatch();
+}
+
+void ConnectionSendThread::flushSendBatch()
+{
+	if(m_send_batch.empty())
+		return;
+
+	UDPDatagram datagrams[UDP_SEND_BATCH_MAX];
+	u32 count = m_send_batch.size();
+	for(u32 i = 0; i < count; i++) {
+		datagrams[i].destination = m_send_batch[i].address;
+		datagrams[i].data = *m_send_batch[i].data;
+		datagrams[i].size = m_send_batch[i].data.getSize();
+	}
+
+	u32 failed = m_connection->m_udpSocket.SendBatch(datagrams, count);
+	LOG(dout_con <<m_connection->getDesc()
+			<< " rawSend: " << count - failed
+			<< " packets sent" << std::endl);
+	if(failed != 0) {
 		LOG(derr_con<<m_connection->getDesc()
-				<<"Connection::rawSend(): SendFailedException: "
-				<<packet.address.serializeString()<<std::endl);
+				<<"Connection::rawSend(): failed to send "
+				<<failed<<" of "<<count<<" packets"<<std::endl);
 	}
+
+	m_send_batch.clear();
 }
 
 void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* channel)
@@ -1506,7 +1660,7 @@ void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* chan
 }
 
 bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		SharedBuffer<u8> data, bool reliable, s32 split_seqnum)
 {
 	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 	if(!peer) {
@@ -1527,14 +1681,15 @@ bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
 		if (!have_sequence_number_for_raw_packet)
 			return false;
 
-		SharedBuffer<u8> reliable = makeReliablePacket(data, seqnum);
 		Address peer_address;
 		peer->getAddress(MTP_MINETEST_RELIABLE_UDP, peer_address);
 
-		// Add base headers and make a packet
-		BufferedPacket p = con::makePacket(peer_address, reliable,
+		BufferedPacket p = con::makeReliablePacket(peer_address, data, seqnum,
 				m_connection->GetProtocolID(), m_connection->GetPeerID(),
 				channelnum);
+		if (split_seqnum >= 0)
+			writeSplitSeqnum(p, BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE,
+					split_seqnum);
 
 		// first check if our send window is already maxed out
 		if (channel->outgoing_reliables_sent.size()
@@ -1565,6 +1720,8 @@ bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
 			BufferedPacket p = con::makePacket(peer_address, data,
 					m_connection->GetProtocolID(), m_connection->GetPeerID(),
 					channelnum);
+			if (split_seqnum >= 0)
+				writeSplitSeqnum(p, BASE_HEADER_SIZE, split_seqnum);
 
 			// Send the packet
 			rawSend(p);
@@ -1821,15 +1978,43 @@ void ConnectionSendThread::sendReliable(ConnectionCommand &c)
 	peer->PutReliableSendCommand(c,m_max_packet_size);
 }
 
+void ConnectionSendThread::sendChunks(u16 peer_id, u8 channelnum,
+		std::list<SharedBuffer<u8> > &chunks)
+{
+	assert(channelnum < CHANNEL_COUNT);
+
+	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
+	if(!peer)
+		return;
+
+	s32 split_sequence_number = -1;
+	if (chunks.size() > 1) {
+		split_sequence_number = peer->getNextSplitSequenceNumber(channelnum);
+		peer->setNextSplitSequenceNumber(channelnum,
+				split_sequence_number + 1);
+	}
+
+	for(std::list<SharedBuffer<u8> >::iterator i = chunks.begin();
+		i != chunks.end(); ++i)
+	{
+		sendAsPacket(peer_id, channelnum, *i, false, split_sequence_number);
+	}
+}
+
 void ConnectionSendThread::sendToAll(u8 channelnum, SharedBuffer<u8> data)
 {
 	std::list<u16> peerids = m_connection->getPeerIDs();
 
+	// Split once, the split sequence numbers are written per peer
+	u16 split_sequence_number = 0;
+	std::list<SharedBuffer<u8> > chunks = makeAutoSplitPacket(data,
+			m_max_packet_size - BASE_HEADER_SIZE, split_sequence_number);
+
 	for (std::list<u16>::iterator i = peerids.begin();
 			i != peerids.end();
 			i++)
 	{
-		send(*i, channelnum, data);
+		sendChunks(*i, channelnum, chunks);
 	}
 }
 
@@ -1837,6 +2022,11 @@ void ConnectionSendThread::sendToAllReliable(ConnectionCommand &c)
 {
 	std::list<u16> peerids = m_connection->getPeerIDs();
 
+	// Split once, the split sequence numbers are written per peer
+	u16 split_sequence_number = 0;
+	c.chunks = makeAutoSplitPacket(c.data, m_max_packet_size
+			- BASE_HEADER_SIZE - RELIABLE_HEADER_SIZE, split_sequence_number);
+
 	for (std::list<u16>::iterator i = peerids.begin();
 			i != peerids.end();
 			i++)
@@ -1914,22 +2104,17 @@ void ConnectionSendThread::sendPackets(float dtime)
 						<< dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_commands.size()
 						<< std::endl);
 
-			while ((dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.size() > 0) &&
-					(dynamic_cast<UDPPeer*>(&peer)->channels[i].outgoing_reliables_sent.size()
-							< dynamic_cast<UDPPeer*>(&peer)->channels[i].getWindowSize())&&
-							(peer->m_increment_packets_remaining > 0))
-			{
-				BufferedPacket p = dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.pop_front();
-				Channel* channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[i]);
-				LOG(dout_con<<m_connection->getDesc()
-						<<" INFO: sending a queued reliable packet "
-						<<" channel: " << i
-						<<", seqnum: " << readU16(&p.data[BASE_HEADER_SIZE+1])
-						<< std::endl);
-				sendAsPacketReliable(p,channel);
-				peer->m_increment_packets_remaining--;
-			}
+			if (i != CHANNEL_BULK)
+				sendQueuedReliables(dynamic_cast<UDPPeer*>(&peer), i,
+						peer->m_increment_packets_remaining);
 		}
+
+		// Bulk data gets its share now, so that it isn't starved, and
+		// whatever the unreliable packets leave afterwards
+		unsigned int bulk_share = MYMAX(1,
+				(unsigned int)(peer->m_increment_packets_remaining * m_bulk_share));
+		sendQueuedReliables(dynamic_cast<UDPPeer*>(&peer), CHANNEL_BULK,
+				bulk_share);
 	}
 
 	if (m_outgoing_queue.size())
@@ -1968,7 +2153,7 @@ void ConnectionSendThread::sendPackets(float dtime)
 			( peer->m_increment_packets_remaining > 0) ||
 			(StopRequested())){
 			rawSendAsPacket(packet.peer_id, packet.channelnum,
-					packet.data, packet.reliable);
+					packet.data, packet.reliable, packet.split_seqnum);
 			peer->m_increment_packets_remaining--;
 		}
 		else {
@@ -1977,6 +2162,17 @@ void ConnectionSendThread::sendPackets(float dtime)
 		}
 	}
 
+	for(std::list<u16>::iterator
+			j = peerIds.begin();
+			j != peerIds.end(); ++j)
+	{
+		PeerHelper peer = m_connection->getPeerNoEx(*j);
+		if (!peer || dynamic_cast<UDPPeer*>(&peer) == 0)
+			continue;
+		sendQueuedReliables(dynamic_cast<UDPPeer*>(&peer), CHANNEL_BULK,
+				peer->m_increment_packets_remaining);
+	}
+
 	for(std::list<u16>::iterator
 				k = pendingDisconnect.begin();
 				k != pendingDisconnect.end(); ++k)
@@ -1988,17 +2184,45 @@ void ConnectionSendThread::sendPackets(float dtime)
 	}
 }
 
+void ConnectionSendThread::sendQueuedReliables(UDPPeer *peer, u8 channelnum,
+		unsigned int max_packets)
+{
+	Channel* channel = &peer->channels[channelnum];
+	while ((channel->queued_reliables.size() > 0) &&
+			(channel->outgoing_reliables_sent.size()
+					< channel->getWindowSize()) &&
+			(peer->m_increment_packets_remaining > 0) &&
+			(max_packets > 0))
+	{
+		BufferedPacket p = channel->queued_reliables.pop_front();
+		LOG(dout_con<<m_connection->getDesc()
+				<<" INFO: sending a queued reliable packet "
+				<<" channel: " << (int)channelnum
+				<<", seqnum: " << readU16(&p.data[BASE_HEADER_SIZE+1])
+				<< std::endl);
+		sendAsPacketReliable(p,channel);
+		peer->m_increment_packets_remaining--;
+		max_packets--;
+	}
+}
+
 void ConnectionSendThread::sendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool ack)
+		SharedBuffer<u8> data, bool ack, s32 split_seqnum)
 {
-	OutgoingPacket packet(peer_id, channelnum, data, false, ack);
+	OutgoingPacket packet(peer_id, channelnum, data, false, ack, split_seqnum);
 	m_outgoing_queue.push_back(packet);
 }
 
 ConnectionReceiveThread::ConnectionReceiveThread(Connection* parent,
 		unsigned int max_packet_size) :
-	m_connection(parent)
+	m_connection(parent),
+	m_receive_buffer(UDP_RECEIVE_BATCH_MAX * RECEIVE_BUFFER_SIZE)
 {
+	for (u32 i = 0; i < UDP_RECEIVE_BATCH_MAX; i++) {
+		m_receive_slots[i].data = &m_receive_buffer[i * RECEIVE_BUFFER_SIZE];
+		m_receive_slots[i].capacity = RECEIVE_BUFFER_SIZE;
+		m_receive_slots[i].size = 0;
+	}
 }
 
 void * ConnectionReceiveThread::Thread()
@@ -2094,12 +2318,6 @@ void * ConnectionReceiveThread::Thread()
 // Receive packets from the network and buffers and create ConnectionEvents
 void ConnectionReceiveThread::receive()
 {
-	// use IPv6 minimum allowed MTU as receive buffer size as this is
-	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
-	// infrastructure
-	unsigned int packet_maxsize = 1500;
-	SharedBuffer<u8> packetdata(packet_maxsize);
-
 	bool packet_queued = true;
 
 	unsigned int loop_count = 0;
@@ -2110,150 +2328,171 @@ void ConnectionReceiveThread::receive()
 			(m_connection->m_udpSocket.WaitData(50)))
 	{
 		loop_count++;
-	try{
-		if (packet_queued)
-		{
-			bool no_data_left = false;
-			u16 peer_id;
-			SharedBuffer<u8> resultdata;
-			while(!no_data_left)
+		try{
+			if (packet_queued)
 			{
-				try {
-					no_data_left = !getFromBuffers(peer_id, resultdata);
-					if (!no_data_left) {
-						ConnectionEvent e;
-						e.dataReceived(peer_id, resultdata);
-						m_connection->putEvent(e);
+				bool no_data_left = false;
+				u16 peer_id;
+				SharedBuffer<u8> resultdata;
+				while(!no_data_left)
+				{
+					try {
+						no_data_left = !getFromBuffers(peer_id, resultdata);
+						if (!no_data_left) {
+							ConnectionEvent e;
+							e.dataReceived(peer_id, resultdata);
+							m_connection->putEvent(e);
+						}
+					}
+					catch(ProcessedSilentlyException &e) {
+						/* try reading again */
 					}
 				}
-				catch(ProcessedSilentlyException &e) {
-					/* try reading again */
-				}
+				packet_queued = false;
 			}
-			packet_queued = false;
+		}catch(InvalidIncomingDataException &e){
+			continue;
 		}
-
-		Address sender;
-		s32 received_size = m_connection->m_udpSocket.Receive(sender, *packetdata, packet_maxsize);
-
-		if ((received_size < 0) ||
-			(received_size < BASE_HEADER_SIZE) ||
-			(readU32(&packetdata[0]) != m_connection->GetProtocolID()))
-		{
-			LOG(derr_con<<m_connection->getDesc()
-					<<"Receive(): Invalid incoming packet, "
-					<<"size: " << received_size
-					<<", protocol: "
-					<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
-					<< std::endl);
+		catch(ProcessedSilentlyException &e){
 			continue;
 		}
 
-		u16 peer_id          = readPeerId(*packetdata);
-		u8 channelnum        = readChannel(*packetdata);
+		// Take everything already queued on the socket in one go; the
+		// slots are reused for every batch
+		u32 count = m_connection->m_udpSocket.ReceiveBatch(
+				m_receive_slots, UDP_RECEIVE_BATCH_MAX);
 
-		if(channelnum > CHANNEL_COUNT-1){
-			LOG(derr_con<<m_connection->getDesc()
-					<<"Receive(): Invalid channel "<<channelnum<<std::endl);
-			throw InvalidIncomingDataException("Channel doesn't exist");
+		for (u32 i = 0; i < count; i++) {
+			UDPReceiveSlot &slot = m_receive_slots[i];
+			try {
+				if (processDatagram(slot.sender, (u8*) slot.data, slot.size))
+					packet_queued = true;
+			}
+			catch(InvalidIncomingDataException &e) {
+			}
+			catch(ProcessedSilentlyException &e) {
+			}
 		}
+	}
+}
 
-		/* preserve original peer_id for later usage */
-		u16 packet_peer_id   = peer_id;
+bool ConnectionReceiveThread::processDatagram(Address &sender,
+		u8 *packetdata, s32 received_size)
+{
+	if ((received_size < 0) ||
+		(received_size < BASE_HEADER_SIZE) ||
+		(readU32(&packetdata[0]) != m_connection->GetProtocolID()))
+	{
+		LOG(derr_con<<m_connection->getDesc()
+				<<"Receive(): Invalid incoming packet, "
+				<<"size: " << received_size
+				<<", protocol: "
+				<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
+				<< std::endl);
+		return false;
+	}
 
-		/* Try to identify peer by sender address (may happen on join) */
-		if(peer_id == PEER_ID_INEXISTENT)
-		{
-			peer_id = m_connection->lookupPeer(sender);
-		}
+	u16 peer_id          = readPeerId(packetdata);
+	u8 channelnum        = readChannel(packetdata);
 
-		/* The peer was not found in our lists. Add it. */
-		if(peer_id == PEER_ID_INEXISTENT)
-		{
-			peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
-		}
+	if(channelnum > CHANNEL_COUNT-1){
+		LOG(derr_con<<m_connection->getDesc()
+				<<"Receive(): Invalid channel "<<channelnum<<std::endl);
+		throw InvalidIncomingDataException("Channel doesn't exist");
+	}
 
-		PeerHelper peer = m_connection->getPeerNoEx(peer_id);
+	/* preserve original peer_id for later usage */
+	u16 packet_peer_id   = peer_id;
 
-		if (!peer) {
-			LOG(dout_con<<m_connection->getDesc()
-					<<" got packet from unknown peer_id: "
-					<<peer_id<<" Ignoring."<<std::endl);
-			continue;
-		}
+	/* Try to identify peer by sender address (may happen on join) */
+	if(peer_id == PEER_ID_INEXISTENT)
+	{
+		peer_id = m_connection->lookupPeer(sender);
+	}
 
-		// Validate peer address
+	/* The peer was not found in our lists. Add it. */
+	if(peer_id == PEER_ID_INEXISTENT)
+	{
+		peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
+	}
 
-		Address peer_address;
+	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 
-		if (peer->getAddress(MTP_UDP, peer_address)) {
-			if (peer_address != sender) {
-				LOG(derr_con<<m_connection->getDesc()
-						<<m_connection->getDesc()
-						<<" Peer "<<peer_id<<" sending from different address."
-						" Ignoring."<<std::endl);
-				continue;
-			}
+	if (!peer) {
+		LOG(dout_con<<m_connection->getDesc()
+				<<" got packet from unknown peer_id: "
+				<<peer_id<<" Ignoring."<<std::endl);
+		return false;
+	}
+
+	// Validate peer address
+
+	Address peer_address;
+
+	if (peer->getAddress(MTP_UDP, peer_address)) {
+		if (peer_address != sender) {
+			LOG(derr_con<<m_connection->getDesc()
+					<<m_connection->getDesc()
+					<<" Peer "<<peer_id<<" sending from different address."
+					" Ignoring."<<std::endl);
+			return false;
 		}
-		else {
+	}
+	else {
 
-			bool invalid_address = true;
-			if (invalid_address) {
-				LOG(derr_con<<m_connection->getDesc()
-						<<m_connection->getDesc()
-						<<" Peer "<<peer_id<<" unknown."
-						" Ignoring."<<std::endl);
-				continue;
-			}
+		bool invalid_address = true;
+		if (invalid_address) {
+			LOG(derr_con<<m_connection->getDesc()
+					<<m_connection->getDesc()
+					<<" Peer "<<peer_id<<" unknown."
+					" Ignoring."<<std::endl);
+			return false;
 		}
+	}
 
 
-		/* mark peer as seen with id */
-		if (!(packet_peer_id == PEER_ID_INEXISTENT))
-			peer->setSentWithID();
+	/* mark peer as seen with id */
+	if (!(packet_peer_id == PEER_ID_INEXISTENT))
+		peer->setSentWithID();
 
-		peer->ResetTimeout();
+	peer->ResetTimeout();
 
-		Channel *channel = 0;
+	Channel *channel = 0;
 
-		if (dynamic_cast<UDPPeer*>(&peer) != 0)
-		{
-			channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[channelnum]);
-		}
+	if (dynamic_cast<UDPPeer*>(&peer) != 0)
+	{
+		channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[channelnum]);
+	}
 
-		if (channel != 0) {
-			channel->UpdateBytesReceived(received_size);
-		}
+	if (channel != 0) {
+		channel->UpdateBytesReceived(received_size);
+	}
 
-		// Throw the received packet to channel->processPacket()
+	// Throw the received packet to channel->processPacket()
 
-		// Make a new SharedBuffer from the data without the base headers
-		SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-		memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-				strippeddata.getSize());
+	// Make a new SharedBuffer from the data without the base headers.
+	// This is the only copy; the receive buffer is reused right away.
+	SharedBuffer<u8> strippeddata(&packetdata[BASE_HEADER_SIZE],
+			received_size - BASE_HEADER_SIZE);
 
-		try{
-			// Process it (the result is some data with no headers made by us)
-			SharedBuffer<u8> resultdata = processPacket
-					(channel, strippeddata, peer_id, channelnum, false);
+	try{
+		// Process it (the result is some data with no headers made by us)
+		SharedBuffer<u8> resultdata = processPacket
+				(channel, strippeddata, peer_id, channelnum, false);
 
-			LOG(dout_con<<m_connection->getDesc()
-					<<" ProcessPacket from peer_id: " << peer_id
-					<< ",channel: " << (channelnum & 0xFF) << ", returned "
-					<< resultdata.getSize() << " bytes" <<std::endl);
+		LOG(dout_con<<m_connection->getDesc()
+				<<" ProcessPacket from peer_id: " << peer_id
+				<< ",channel: " << (channelnum & 0xFF) << ", returned "
+				<< resultdata.getSize() << " bytes" <<std::endl);
 
-			ConnectionEvent e;
-			e.dataReceived(peer_id, resultdata);
-			m_connection->putEvent(e);
-		}catch(ProcessedSilentlyException &e){
-		}catch(ProcessedQueued &e){
-			packet_queued = true;
-		}
-	}catch(InvalidIncomingDataException &e){
-	}
-	catch(ProcessedSilentlyException &e){
-	}
+		ConnectionEvent e;
+		e.dataReceived(peer_id, resultdata);
+		m_connection->putEvent(e);
+	}catch(ProcessedSilentlyException &e){
+	}catch(ProcessedQueued &e){
+		return true;
 	}
+	return false;
 }
 
 bool ConnectionReceiveThread::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst)
@@ -2657,6 +2896,7 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_event_queue(),
 	m_peer_id(0),
 	m_protocol_id(protocol_id),
+	m_max_packet_size(max_packet_size),
 	m_sendThread(this, max_packet_size, timeout),
 	m_receiveThread(this, max_packet_size),
 	m_info_mutex(),
@@ -2678,6 +2918,7 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_event_queue(),
 	m_peer_id(0),
 	m_protocol_id(protocol_id),
+	m_max_packet_size(max_packet_size),
 	m_sendThread(this, max_packet_size, timeout),
 	m_receiveThread(this, max_packet_size),
 	m_info_mutex(),
@@ -2890,9 +3131,15 @@ void Connection::Disconnect()
 }
 
 u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
+{
+	return Receive(peer_id, data, m_bc_receive_timeout);
+}
+
+u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data,
+		u32 timeout_ms)
 {
 	for(;;){
-		ConnectionEvent e = waitEvent(m_bc_receive_timeout);
+		ConnectionEvent e = waitEvent(timeout_ms);
 		if(e.type != CONNEVENT_NONE)
 			LOG(dout_con<<getDesc()<<": Receive: got event: "
 					<<e.describe()<<std::endl);
@@ -2960,12 +3207,22 @@ float Connection::getPeerStat(u16 peer_id, rtt_stat_type type)
 
 float Connection::getLocalStat(rate_stat_type type)
 {
-	PeerHelper peer = getPeerNoEx(PEER_ID_SERVER);
+	float retval = getPeerRate(PEER_ID_SERVER, type);
 
-	if (!peer) {
+	if (retval < 0) {
 		assert("Connection::getLocalStat we couldn't get our own peer? are you serious???" == 0);
 	}
 
+	return retval;
+}
+
+float Connection::getPeerRate(u16 peer_id, rate_stat_type type)
+{
+	PeerHelper peer = getPeerNoEx(peer_id);
+
+	if (!peer || dynamic_cast<UDPPeer*>(&peer) == 0)
+		return -1;
+
 	float retval = 0.0;
 
 	for (u16 j=0; j<CHANNEL_COUNT; j++) {
@@ -2989,12 +3246,31 @@ float Connection::getLocalStat(rate_stat_type type)
 				retval += dynamic_cast<UDPPeer*>(&peer)->channels[j].getCurrentLossRateKB();
 				break;
 		default:
-			assert("Connection::getLocalStat Invalid stat type" == 0);
+			assert("Connection::getPeerRate Invalid stat type" == 0);
 		}
 	}
 	return retval;
 }
 
+u32 Connection::getPeerBufferedBytes(u16 peer_id)
+{
+	PeerHelper peer = getPeerNoEx(peer_id);
+	UDPPeer *udp_peer = !peer ? NULL : dynamic_cast<UDPPeer*>(&peer);
+	if (udp_peer == NULL)
+		return 0;
+
+	// The queued reliables are counted as full packets
+	u32 size = 0;
+	for (u16 j=0; j<CHANNEL_COUNT; j++) {
+		Channel &channel = udp_peer->channels[j];
+		size += channel.incoming_reliables.dataSize();
+		size += channel.outgoing_reliables_sent.dataSize();
+		size += channel.incoming_splits.dataSize();
+		size += channel.queued_reliables.size() * m_max_packet_size;
+	}
+	return size;
+}
+
 u16 Connection::createPeer(Address& sender, MTProtocols protocol, int fd)
 {
 	// Somebody wants to make a new connection
@@ -31,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include <fstream>
 #include <list>
+#include <vector>
 #include <map>
 
 namespace con
@@ -205,22 +206,63 @@ SharedBuffer<u8> makeReliablePacket(
 		SharedBuffer<u8> data,
 		u16 seqnum);
 
+// Add the base and TYPE_RELIABLE headers to the data and make a packet,
+// copying the data only once
+BufferedPacket makeReliablePacket(Address &address, SharedBuffer<u8> &data,
+		u16 seqnum, u32 protocol_id, u16 sender_peer_id, u8 channel);
+
+// The chunks of a broadcast are split once and shared by all the peers,
+// with a placeholder split sequence number. This writes the number of the
+// peer into its copy of a chunk in a packet, at the offset of the chunk.
+void writeSplitSeqnum(BufferedPacket &p, u32 offset, u16 split_seqnum);
+
+// The buffer of a split packet is only grown this many bytes past twice
+// the chunks that have come; chunk_count alone could make it 32 MB
+#define SPLIT_BUFFER_AHEAD 16384
+// Incomplete split packets kept for a channel at once
+#define MAX_INCOMPLETE_SPLIT_PACKETS 32
+
+/*
+	A split packet being put together. makeSplitPacket() makes every
+	chunk but the last as large as it can, so the chunks are written
+	right into the whole packet at chunk_num * chunk_size once the size
+	of one of them is known.
+*/
 struct IncomingSplitPacket
 {
-	IncomingSplitPacket()
+	IncomingSplitPacket(u32 chunk_count_, bool reliable_):
+		chunk_count(chunk_count_),
+		chunks_received(0),
+		chunk_size(0),
+		data(NULL),
+		data_capacity(0),
+		last_chunk_size(0),
+		received(chunk_count_, false),
+		time(0.0),
+		reliable(reliable_)
+	{}
+	~IncomingSplitPacket()
 	{
-		time = 0.0;
-		reliable = false;
+		delete[] data;
 	}
-	// Key is chunk number, value is data without headers
-	std::map<u16, SharedBuffer<u8> > chunks;
 	u32 chunk_count;
-	float time; // Seconds from adding
-	bool reliable; // If true, isn't deleted on timeout
+	u32 chunks_received;
+	// Data size of every chunk but the last; 0 until one is received
+	u32 chunk_size;
+	// The chunks before the last at chunk_num * chunk_size; grown as they
+	// come, up to chunk_count * chunk_size bytes
+	u8 *data;
+	u32 data_capacity;
+	// The last chunk is kept here until all the others have come
+	std::vector<u8> last_chunk;
+	u32 last_chunk_size;
+	std::vector<bool> received;
+	float time; // Seconds since the last new chunk
+	bool reliable;
 
 	bool allReceived()
 	{
-		return (chunks.size() == chunk_count);
+		return (chunks_received == chunk_count);
 	}
 };
 
@@ -244,6 +286,17 @@ TODO: Should we have a receiver_peer_id also?
 */
 #define BASE_HEADER_SIZE 7
 #define CHANNEL_COUNT 3
+/*
+	Map blocks and media are sent on this channel. Its queued reliables
+	only get bulk_packet_share of each peer's packets for an iteration
+	before the unreliable packets are sent, and the rest after them.
+*/
+#define CHANNEL_BULK 2
+/*
+	Size of a datagram receive buffer. The IPv6 minimum MTU is the theoretical
+	reliable upper boundary of a udp packet for all IPv6 enabled infrastructure.
+*/
+#define RECEIVE_BUFFER_SIZE 1500
 /*
 Packet types:
 
@@ -312,14 +365,18 @@ with a buffer in the receiving and transmitting end.
 /*
 	A buffer which stores reliable packets and sorts them internally
 	for fast access to the smallest one.
-*/
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
+	Packets are kept in a ring indexed by seqnum, so lookups by seqnum are
+	O(1). The ring grows to fit the span between the smallest and the
+	largest buffered seqnum. A queue ordered by the time of the last send
+	makes getTimedOuts() proportional to the number of timed out packets.
+*/
 
 class ReliablePacketBuffer
 {
 public:
 	ReliablePacketBuffer();
+	~ReliablePacketBuffer();
 
 	bool getFirstSeqnum(u16& result);
 
@@ -334,17 +391,41 @@ class ReliablePacketBuffer
 	void print();
 	bool empty();
 	bool containsPacket(u16 seqnum);
-	RPBSearchResult notFound();
 	u32 size();
+	// Bytes of the buffered packets
+	u32 dataSize();
 
 
 private:
-	RPBSearchResult findPacket(u16 seqnum);
-
-	std::list<BufferedPacket> m_list;
+	struct Slot
+	{
+		Slot(const BufferedPacket &a_packet, u16 a_seqnum):
+			packet(a_packet), seqnum(a_seqnum), sent_at(0), buffered_at(0)
+		{}
+		BufferedPacket packet;
+		u16 seqnum;
+		double sent_at; // Buffer time of buffering or last re-send
+		double buffered_at; // Buffer time of buffering
+		std::list<u16>::iterator resend_pos;
+	};
+
+	Slot *findSlot(u16 seqnum);
+	BufferedPacket removeSlot(Slot *slot);
+	void growRing(u32 span);
+
+	// Ring of packets, indexed by seqnum & (m_ring.size() - 1)
+	std::vector<Slot*> m_ring;
+	// Seqnum of the first buffered packet
+	u16 m_first;
+	// Distance from m_first to the last buffered packet, plus one
+	u32 m_span;
 	u32 m_list_size;
+	u32 m_data_size;
 
-	u16 m_oldest_non_answered_ack;
+	// Seqnums in order of their last send, oldest first
+	std::list<u16> m_resend_queue;
+	// Accumulated dtime of incrementTimeouts()
+	double m_time;
 
 	JMutex m_list_mutex;
 };
@@ -363,7 +444,13 @@ class IncomingSplitBuffer
 	*/
 	SharedBuffer<u8> insert(BufferedPacket &p, bool reliable);
 	
-	void removeUnreliableTimedOuts(float dtime, float timeout);
+	// Removes the packets that got no new chunk for timeout seconds.
+	// The chunks of a reliable one come in order, after each other, so
+	// one that stalls that long is never going to be finished either.
+	void removeTimedOuts(float dtime, float timeout);
+
+	// Bytes taken by the packets being reconstructed
+	u32 dataSize();
 	
 private:
 	// Key is seqnum
@@ -379,14 +466,17 @@ struct OutgoingPacket
 	SharedBuffer<u8> data;
 	bool reliable;
 	bool ack;
+	// Split sequence number to write into a shared chunk, or -1
+	s32 split_seqnum;
 
 	OutgoingPacket(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_,
-			bool reliable_,bool ack_=false):
+			bool reliable_,bool ack_=false, s32 split_seqnum_=-1):
 		peer_id(peer_id_),
 		channelnum(channelnum_),
 		data(data_),
 		reliable(reliable_),
-		ack(ack_)
+		ack(ack_),
+		split_seqnum(split_seqnum_)
 	{
 	}
 };
@@ -411,6 +501,10 @@ struct ConnectionCommand
 	u16 peer_id;
 	u8 channelnum;
 	Buffer<u8> data;
+	// Chunks of a broadcast, split once for all the peers by the send
+	// thread. Not shared with other threads, the reference counts of
+	// SharedBuffer are not atomic.
+	std::list<SharedBuffer<u8> > chunks;
 	bool reliable;
 	bool raw;
 
@@ -931,8 +1025,10 @@ class ConnectionSendThread : public JThread {
 private:
 	void runTimeouts    (float dtime);
 	void rawSend        (const BufferedPacket &packet);
+	void flushSendBatch ();
 	bool rawSendAsPacket(u16 peer_id, u8 channelnum,
-							SharedBuffer<u8> data, bool reliable);
+							SharedBuffer<u8> data, bool reliable,
+							s32 split_seqnum=-1);
 
 	void processReliableCommand (ConnectionCommand &c);
 	void processNonReliableCommand (ConnectionCommand &c);
@@ -942,15 +1038,23 @@ class ConnectionSendThread : public JThread {
 	void disconnect_peer(u16 peer_id);
 	void send           (u16 peer_id, u8 channelnum,
 							SharedBuffer<u8> data);
+	// Sends chunks split for all the peers to one of them
+	void sendChunks     (u16 peer_id, u8 channelnum,
+							std::list<SharedBuffer<u8> > &chunks);
 	void sendReliable   (ConnectionCommand &c);
 	void sendToAll      (u8 channelnum,
 							SharedBuffer<u8> data);
 	void sendToAllReliable(ConnectionCommand &c);
 
 	void sendPackets    (float dtime);
+	// Sends the queued reliables of a channel that fit in its window, at
+	// most max_packets of them and the peer's packets for the iteration
+	void sendQueuedReliables(UDPPeer *peer, u8 channelnum,
+							unsigned int max_packets);
 
 	void sendAsPacket   (u16 peer_id, u8 channelnum,
-							SharedBuffer<u8> data,bool ack=false);
+							SharedBuffer<u8> data,bool ack=false,
+							s32 split_seqnum=-1);
 
 	void sendAsPacketReliable(BufferedPacket& p, Channel* channel);
 
@@ -961,11 +1065,14 @@ class ConnectionSendThread : public JThread {
 	float                 m_timeout;
 	Queue<OutgoingPacket> m_outgoing_queue;
 	JSemaphore            m_send_sleep_semaphore;
+	// Packets collected by rawSend() until the next flushSendBatch()
+	std::vector<BufferedPacket> m_send_batch;
 
 	unsigned int          m_iteration_packets_avaialble;
 	unsigned int          m_max_commands_per_iteration;
 	unsigned int          m_max_data_packets_per_iteration;
 	unsigned int          m_max_packets_requeued;
+	float                 m_bulk_share;
 };
 
 class ConnectionReceiveThread : public JThread {
@@ -998,8 +1105,20 @@ class ConnectionReceiveThread : public JThread {
 							SharedBuffer<u8> packetdata, u16 peer_id,
 							u8 channelnum, bool reliable);
 
+	/*
+		Handles one datagram as read from the socket, including the base
+		header. Returns true if a reliable packet was queued for later
+		delivery.
+	*/
+	bool processDatagram(Address &sender, u8 *packetdata,
+							s32 received_size);
+
 
 	Connection*           m_connection;
+
+	// Receive buffers, owned by this thread and reused for every batch
+	Buffer<u8>            m_receive_buffer;
+	UDPReceiveSlot        m_receive_slots[UDP_RECEIVE_BATCH_MAX];
 };
 
 class Connection
@@ -1024,11 +1143,17 @@ class Connection
 	bool Connected();
 	void Disconnect();
 	u32 Receive(u16 &peer_id, SharedBuffer<u8> &data);
+	// The same, waiting timeout_ms instead of the one of SetTimeoutMs()
+	u32 Receive(u16 &peer_id, SharedBuffer<u8> &data, u32 timeout_ms);
 	void SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void Send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	u16 GetPeerID(){ return m_peer_id; }
 	Address GetPeerAddress(u16 peer_id);
 	float getPeerStat(u16 peer_id, rtt_stat_type type);
+	// Rates in KiB/s summed over all channels of the peer, -1 if not found
+	float getPeerRate(u16 peer_id, rate_stat_type type);
+	// Bytes in the packet buffers and queues of the peer, 0 if not found
+	u32 getPeerBufferedBytes(u16 peer_id);
 	float getLocalStat(rate_stat_type type);
 	const u32 GetProtocolID() const { return m_protocol_id; };
 	const std::string getDesc();
@@ -1066,6 +1191,7 @@ class Connection
 
 	u16 m_peer_id;
 	u32 m_protocol_id;
+	u32 m_max_packet_size;
 	
 	std::map<u16, Peer*> m_peers;
 	JMutex m_peers_mutex;
@@ -57,6 +57,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // Override for the previous one when distance of block is very low
 #define BLOCK_SEND_DISABLE_LIMITS_MAX_D 1
 
+// Lua entities that have not moved for this long (in seconds) sleep
+#define ENTITY_SLEEP_DELAY 1.0
+
+// Added to the send priority of unlit blocks close to the player, which
+// are most likely inside solid ground (in block distances)
+#define BLOCK_SEND_UNDERGROUND_PENALTY 2
+
 /*
     Map-related things
 */
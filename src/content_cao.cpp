@@ -53,6 +53,26 @@ struct ToolCapabilities;
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+/*
+	Levels of detail of the animated meshes, which are skinned on the CPU
+	every frame the animation moves on, also when they are off-screen
+*/
+enum AnimationLod
+{
+	// As the server wants it
+	ANIM_LOD_FULL,
+	// Beyond object_animation_lod_range: the frame is moved on only every
+	// ANIM_LOD_REDUCED_INTERVAL seconds
+	ANIM_LOD_REDUCED,
+	// Off-screen or beyond object_static_range: the frame is kept and the
+	// bone positions aren't applied.  Far away, the first frame of the
+	// animation is shown, the same for all the objects with the mesh, so
+	// that the shared mesh is only skinned once for them
+	ANIM_LOD_STATIC
+};
+
+#define ANIM_LOD_REDUCED_INTERVAL 0.25
+
 std::map<u16, ClientActiveObject::Factory> ClientActiveObject::m_types;
 
 SmoothTranslator::SmoothTranslator():
@@ -580,7 +600,11 @@ GenericCAO::GenericCAO(IGameDef *gamedef, ClientEnvironment *env):
 		m_visuals_expired(false),
 		m_step_distance_counter(0),
 		m_last_light(255),
-		m_is_visible(false)
+		m_is_visible(false),
+		m_anim_lod(ANIM_LOD_FULL),
+		m_anim_lod_timer(0),
+		m_anim_lod_range(0),
+		m_anim_static_range(0)
 {
 	if(gamedef == NULL)
 		ClientActiveObject::registerType(getType(), create);
@@ -930,6 +954,10 @@ void GenericCAO::addToScene(scene::ISceneManager *smgr, ITextureSource *tsrc,
 			m_animated_meshnode->setMaterialFlag(video::EMF_BILINEAR_FILTER, false);
 			m_animated_meshnode->setMaterialType(video::EMT_TRANSPARENT_ALPHA_CHANNEL_REF);
 			m_animated_meshnode->setMaterialFlag(video::EMF_FOG_ENABLE, true);
+
+			m_anim_lod = ANIM_LOD_FULL;
+			m_anim_lod_range = g_settings->getFloat("object_animation_lod_range");
+			m_anim_static_range = g_settings->getFloat("object_static_range");
 		}
 		else
 			errorstream<<"GenericCAO::addToScene(): Could not load mesh "<<m_prop.mesh<<std::endl;
@@ -1200,6 +1228,8 @@ void GenericCAO::step(float dtime, ClientEnvironment *env)
 		}
 	}
 
+	updateAnimationLod(dtime);
+
 	m_anim_timer += dtime;
 	if(m_anim_timer >= m_anim_framelength)
 	{
@@ -1462,14 +1492,15 @@ void GenericCAO::updateAnimation()
 	if(m_animated_meshnode == NULL)
 		return;
 	m_animated_meshnode->setFrameLoop(m_animation_range.X, m_animation_range.Y);
-	m_animated_meshnode->setAnimationSpeed(m_animation_speed);
-	m_animated_meshnode->setTransitionTime(m_animation_blend);
+	applyAnimationLod();
 }
 
 void GenericCAO::updateBonePosition()
 {
 	if(!m_bone_position.size() || m_animated_meshnode == NULL)
 		return;
+	if(m_anim_lod == ANIM_LOD_STATIC)
+		return;
 
 	m_animated_meshnode->setJointMode(irr::scene::EJUOR_CONTROL); // To write positions to the mesh on render
 	for(std::map<std::string,
@@ -1488,6 +1519,68 @@ void GenericCAO::updateBonePosition()
 	}
 }
 	
+void GenericCAO::updateAnimationLod(float dtime)
+{
+	if(m_animated_meshnode == NULL)
+		return;
+
+	// Bones that things are attached to must move
+	u8 lod = ANIM_LOD_FULL;
+	bool far_away = false;
+	if(!m_is_local_player && m_children.empty())
+	{
+		f32 d = m_env->getLocalPlayer()->getEyePosition()
+				.getDistanceFrom(getPosition()) / BS;
+		far_away = d > m_anim_static_range;
+		if(far_away || !m_is_visible || m_smgr->isCulled(m_animated_meshnode))
+			lod = ANIM_LOD_STATIC;
+		else if(d > m_anim_lod_range)
+			lod = ANIM_LOD_REDUCED;
+	}
+
+	if(lod != m_anim_lod)
+	{
+		m_anim_lod = lod;
+		m_anim_lod_timer = 0;
+		applyAnimationLod();
+		if(far_away)
+			m_animated_meshnode->setCurrentFrame(m_animation_range.X);
+	}
+
+	if(m_anim_lod != ANIM_LOD_REDUCED)
+		return;
+	m_anim_lod_timer += dtime;
+	if(m_anim_lod_timer < ANIM_LOD_REDUCED_INTERVAL)
+		return;
+	f32 start = m_animation_range.X;
+	f32 end = m_animation_range.Y;
+	f32 frame = m_animated_meshnode->getFrameNr()
+			+ m_anim_lod_timer * m_animation_speed;
+	if(end > start && frame > end)
+		frame = start + fmod(frame - start, end - start);
+	m_animated_meshnode->setCurrentFrame(frame);
+	m_anim_lod_timer = 0;
+}
+
+void GenericCAO::applyAnimationLod()
+{
+	if(m_anim_lod == ANIM_LOD_FULL)
+		m_animated_meshnode->setAnimationSpeed(m_animation_speed);
+	else
+		m_animated_meshnode->setAnimationSpeed(0);
+
+	if(m_anim_lod == ANIM_LOD_STATIC)
+	{
+		m_animated_meshnode->setTransitionTime(0);
+		m_animated_meshnode->setJointMode(scene::EJUOR_NONE);
+	}
+	else
+	{
+		m_animated_meshnode->setTransitionTime(m_animation_blend);
+		updateBonePosition();
+	}
+}
+
 void GenericCAO::updateAttachments()
 {
 
@@ -1563,20 +1656,41 @@ void GenericCAO::processMessage(const std::string &data)
 
 		expireVisuals();
 	}
-	else if(cmd == GENERIC_CMD_UPDATE_POSITION)
+	else if(cmd == GENERIC_CMD_UPDATE_POSITION ||
+			cmd == GENERIC_CMD_UPDATE_POSITION_PACKED)
 	{
 		// Not sent by the server if this object is an attachment.
 		// We might however get here if the server notices the object being detached before the client.
-		m_position = readV3F1000(is);
-		m_velocity = readV3F1000(is);
-		m_acceleration = readV3F1000(is);
+		bool do_interpolate;
+		bool is_end_position;
+		float update_interval;
+		float yaw;
+		if(cmd == GENERIC_CMD_UPDATE_POSITION){
+			m_position = readV3F1000(is);
+			m_velocity = readV3F1000(is);
+			m_acceleration = readV3F1000(is);
+			yaw = readF1000(is);
+			do_interpolate = readU8(is);
+			is_end_position = readU8(is);
+			update_interval = readF1000(is);
+		} else {
+			u8 flags = readU8(is);
+			m_position = readV3F1000(is);
+			m_velocity = v3f(0,0,0);
+			m_acceleration = v3f(0,0,0);
+			if(flags & GENERIC_POSITION_HAS_VELOCITY)
+				m_velocity = intToFloat(readV3S16(is),
+						1.0 / GENERIC_POSITION_MOTION_SCALE);
+			if(flags & GENERIC_POSITION_HAS_ACCELERATION)
+				m_acceleration = intToFloat(readV3S16(is),
+						1.0 / GENERIC_POSITION_MOTION_SCALE);
+			yaw = readU16(is) * 360.0 / 65536.0;
+			do_interpolate = flags & GENERIC_POSITION_INTERPOLATE;
+			is_end_position = flags & GENERIC_POSITION_MOVEMENT_END;
+			update_interval = readU8(is) / 100.0;
+		}
 		if(fabs(m_prop.automatic_rotate) < 0.001)
-			m_yaw = readF1000(is);
-		else
-			readF1000(is);
-		bool do_interpolate = readU8(is);
-		bool is_end_position = readU8(is);
-		float update_interval = readF1000(is);
+			m_yaw = yaw;
 
 		// Place us a bit higher if we're physical, to not sink into
 		// the ground due to sucky collision detection...
@@ -102,6 +102,12 @@ class GenericCAO : public ClientActiveObject
 	float m_step_distance_counter;
 	u8 m_last_light;
 	bool m_is_visible;
+	// Level of detail of the animated mesh; see updateAnimationLod()
+	u8 m_anim_lod;
+	// Time the frame hasn't been advanced for, in ANIM_LOD_REDUCED
+	float m_anim_lod_timer;
+	f32 m_anim_lod_range;
+	f32 m_anim_static_range;
 
 	std::vector<u16> m_children;
 
@@ -190,6 +196,10 @@ class GenericCAO : public ClientActiveObject
 
 	void updateBonePosition();
 
+	void updateAnimationLod(float dtime);
+
+	void applyAnimationLod();
+
 	void updateAttachments();
 
 	void processMessage(const std::string &data);
@@ -245,6 +245,10 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 	{
 		v3s16 p(x,y,z);
 
+		// An overlay has only the cracked node
+		if(data->m_node_overlay && p != data->m_crack_pos_relative)
+			continue;
+
 		MapNode n = data->m_vmanip.getNodeNoEx(blockpos_nodes + p);
 		const ContentFeatures &f = nodedef->get(n);
 
@@ -1662,63 +1666,39 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 
 			v3f pos = intToFloat(p, BS);
 
-			std::vector<aabb3f> boxes = n.getNodeBoxes(nodedef);
-			for(std::vector<aabb3f>::iterator
-					i = boxes.begin();
-					i != boxes.end(); i++)
-			{
 			for(int j = 0; j < 6; j++)
-				{
+			{
 				// Handles facedir rotation for textures
 				tiles[j] = getNodeTile(n, p, tile_dirs[j], data);
-				}
-				aabb3f box = *i;
+			}
+
+			// The boxes are made for every rotation once, except for leveled
+			// node boxes
+			std::vector<NodeBoxTemplate> leveled;
+			const std::vector<NodeBoxTemplate> *templates = &leveled;
+			if(!f.nodebox_templates.empty()){
+				u8 rotation = 0;
+				if(f.param_type_2 == CPT2_FACEDIR)
+					rotation = n.getParam2() & 0x1f;
+				else if(f.param_type_2 == CPT2_WALLMOUNTED)
+					rotation = n.getParam2() & 0x07;
+				templates = &f.nodebox_templates[rotation];
+			} else {
+				std::vector<aabb3f> boxes = n.getNodeBoxes(nodedef);
+				for(std::vector<aabb3f>::iterator
+						i = boxes.begin();
+						i != boxes.end(); i++)
+					leveled.push_back(NodeBoxTemplate(*i));
+			}
+
+			for(std::vector<NodeBoxTemplate>::const_iterator
+					i = templates->begin();
+					i != templates->end(); i++)
+			{
+				aabb3f box = i->box;
 				box.MinEdge += pos;
 				box.MaxEdge += pos;
-				
-				f32 temp;
-				if (box.MinEdge.X > box.MaxEdge.X)
-				{
-					temp=box.MinEdge.X;
-					box.MinEdge.X=box.MaxEdge.X;
-					box.MaxEdge.X=temp;
-				}
-				if (box.MinEdge.Y > box.MaxEdge.Y)
-				{
-					temp=box.MinEdge.Y;
-					box.MinEdge.Y=box.MaxEdge.Y;
-					box.MaxEdge.Y=temp;
-				}
-				if (box.MinEdge.Z > box.MaxEdge.Z)
-				{
-					temp=box.MinEdge.Z;
-					box.MinEdge.Z=box.MaxEdge.Z;
-					box.MaxEdge.Z=temp;
-				}
-
-				//
-				// Compute texture coords
-				f32 tx1 = (box.MinEdge.X/BS)+0.5;
-				f32 ty1 = (box.MinEdge.Y/BS)+0.5;
-				f32 tz1 = (box.MinEdge.Z/BS)+0.5;
-				f32 tx2 = (box.MaxEdge.X/BS)+0.5;
-				f32 ty2 = (box.MaxEdge.Y/BS)+0.5;
-				f32 tz2 = (box.MaxEdge.Z/BS)+0.5;
-				f32 txc[24] = {
-					// up
-					tx1, 1-tz2, tx2, 1-tz1,
-					// down
-					tx1, tz1, tx2, tz2,
-					// right
-					tz1, 1-ty2, tz2, 1-ty1,
-					// left
-					1-tz2, 1-ty2, 1-tz1, 1-ty1,
-					// back
-					1-tx2, 1-ty2, 1-tx1, 1-ty1,
-					// front
-					tx1, 1-ty2, tx2, 1-ty1,
-				};
-				makeCuboid(&collector, box, tiles, 6, c, txc);
+				makeCuboid(&collector, box, tiles, 6, c, i->txc);
 			}
 		break;}
 		case NDT_MESH:
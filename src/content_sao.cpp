@@ -31,7 +31,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "player.h"
 #include "scripting_game.h"
 #include "genericobject.h"
+#include "map.h"
+#include "nodedef.h"
 #include "log.h"
+#include "clientserver.h" // For PLAYERPOS_EXTRAPOLATION_MAX
 
 std::map<u16, ServerActiveObject::Factory> ServerActiveObject::m_types;
 
@@ -369,6 +372,16 @@ LuaEntitySAO::LuaEntitySAO(ServerEnvironment *env, v3f pos,
 	m_init_name(name),
 	m_init_state(state),
 	m_registered(false),
+	m_has_on_step(true),
+	m_idle_step_interval(0),
+	m_sleeping(false),
+	m_idle_timer(0),
+	m_sleep_dtime(0),
+	m_on_step_pending(false),
+	m_on_step_dtime(0),
+	m_step_dtime(0),
+	m_step_awake(false),
+	m_step_send_recommended(false),
 	m_hp(-1),
 	m_velocity(0,0,0),
 	m_acceleration(0,0,0),
@@ -377,6 +390,7 @@ LuaEntitySAO::LuaEntitySAO(ServerEnvironment *env, v3f pos,
 	m_last_sent_yaw(0),
 	m_last_sent_position(0,0,0),
 	m_last_sent_velocity(0,0,0),
+	m_last_sent_acceleration(0,0,0),
 	m_last_sent_position_timer(0),
 	m_last_sent_move_precision(0),
 	m_armor_groups_sent(false),
@@ -416,6 +430,8 @@ void LuaEntitySAO::addedToEnvironment(u32 dtime_s)
 		// Get properties
 		m_env->getScriptIface()->
 			luaentity_GetProperties(m_id, &m_prop);
+		m_idle_step_interval = m_env->getScriptIface()->
+			luaentity_GetIdleStepInterval(m_id);
 		// Initialize HP from properties
 		m_hp = m_prop.hp_max;
 		// Activate entity, supplying serialized state
@@ -493,6 +509,30 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 
 	m_last_sent_position_timer += dtime;
 
+	m_step_dtime = dtime;
+	m_step_send_recommended = send_recommended;
+	m_step_awake = false;
+	m_on_step_pending = false;
+
+	/*
+		Sleeping entities only run on_step now and then, if at all
+	*/
+	float step_dtime = dtime;
+	if(m_sleeping)
+	{
+		m_sleep_dtime += dtime;
+		if(!m_has_on_step || m_sleep_dtime < m_idle_step_interval)
+			return;
+		step_dtime = m_sleep_dtime;
+		m_sleep_dtime = 0;
+		m_on_step_pending = m_registered;
+		m_on_step_dtime = step_dtime;
+		return;
+	}
+	// Time slept before being woken up
+	step_dtime += m_sleep_dtime;
+	m_sleep_dtime = 0;
+
 	// Each frame, parent position is copied if the object is attached, otherwise it's calculated normally
 	// If the object gets detached this comes into effect automatically from the last known origin
 	if(isAttached())
@@ -534,12 +574,43 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 		}
 	}
 
-	if(m_registered){
-		m_env->getScriptIface()->luaentity_Step(m_id, dtime);
+	m_step_awake = true;
+	m_on_step_pending = m_registered;
+	m_on_step_dtime = step_dtime;
+}
+
+bool LuaEntitySAO::getPendingOnStep(float &dtime)
+{
+	dtime = m_on_step_dtime;
+	return m_on_step_pending;
+}
+
+void LuaEntitySAO::onStepDone(bool has_on_step)
+{
+	m_on_step_pending = false;
+	m_has_on_step = has_on_step;
+}
+
+void LuaEntitySAO::finishStep()
+{
+	if(m_step_awake)
+	{
+		m_step_awake = false;
+		if(isIdle() && (!m_has_on_step || m_idle_step_interval > 0))
+		{
+			m_idle_timer += m_step_dtime;
+			if(m_idle_timer >= ENTITY_SLEEP_DELAY)
+				m_sleeping = true;
+		}
+		else
+		{
+			m_idle_timer = 0;
+		}
 	}
 
-	if(send_recommended == false)
+	if(m_step_send_recommended == false)
 		return;
+	m_step_send_recommended = false;
 
 	if(!isAttached())
 	{
@@ -550,9 +621,19 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 		} else if(m_last_sent_position_timer > 0.2){
 			minchange = 0.05*BS;
 		}
-		float move_d = m_base_position.getDistanceFrom(m_last_sent_position);
+		/*
+			Compare to where clients have moved the object on their own
+			since the last update
+		*/
+		float t = m_last_sent_position_timer;
+		v3f predicted_position = m_last_sent_position
+				+ t * m_last_sent_velocity
+				+ 0.5 * t * t * m_last_sent_acceleration;
+		v3f predicted_velocity = m_last_sent_velocity
+				+ t * m_last_sent_acceleration;
+		float move_d = m_base_position.getDistanceFrom(predicted_position);
 		move_d += m_last_sent_move_precision;
-		float vel_d = m_velocity.getDistanceFrom(m_last_sent_velocity);
+		float vel_d = m_velocity.getDistanceFrom(predicted_velocity);
 		if(move_d > minchange || vel_d > minchange ||
 				fabs(m_yaw - m_last_sent_yaw) > 1.0){
 			sendPosition(true, false);
@@ -674,6 +755,8 @@ int LuaEntitySAO::punch(v3f dir,
 	// It's best that attachments cannot be punched 
 	if(isAttached())
 		return 0;
+
+	wakeUp();
 	
 	ItemStack *punchitem = NULL;
 	ItemStack punchitem_static;
@@ -719,6 +802,30 @@ int LuaEntitySAO::punch(v3f dir,
 	return result.wear;
 }
 
+void LuaEntitySAO::wakeUp()
+{
+	m_sleeping = false;
+	m_idle_timer = 0;
+}
+
+bool LuaEntitySAO::isIdle()
+{
+	if(isAttached() || m_velocity != v3f(0,0,0))
+		return false;
+	if(m_acceleration == v3f(0,0,0))
+		return true;
+	if(!m_prop.physical)
+		return false;
+
+	// Physical entities can rest on walkable ground against gravity
+	if(m_acceleration.X != 0 || m_acceleration.Z != 0 || m_acceleration.Y > 0)
+		return false;
+	v3f below = m_base_position
+			+ v3f(0, m_prop.collisionbox.MinEdge.Y * BS - 0.1 * BS, 0);
+	MapNode n = m_env->getMap().getNodeNoEx(floatToInt(below, BS));
+	return m_env->getGameDef()->ndef()->get(n).walkable;
+}
+
 void LuaEntitySAO::rightClick(ServerActiveObject *clicker)
 {
 	if(!m_registered)
@@ -726,6 +833,7 @@ void LuaEntitySAO::rightClick(ServerActiveObject *clicker)
 	// It's best that attachments cannot be clicked
 	if(isAttached())
 		return;
+	wakeUp();
 	m_env->getScriptIface()->luaentity_Rightclick(m_id, clicker);
 }
 
@@ -733,7 +841,8 @@ void LuaEntitySAO::setPos(v3f pos)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	setBasePosition(pos);
+	wakeUp();
 	sendPosition(false, true);
 }
 
@@ -741,7 +850,8 @@ void LuaEntitySAO::moveTo(v3f pos, bool continuous)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	setBasePosition(pos);
+	wakeUp();
 	if(!continuous)
 		sendPosition(true, true);
 }
@@ -762,6 +872,14 @@ std::string LuaEntitySAO::getDescription()
 	return os.str();
 }
 
+u32 LuaEntitySAO::getMemoryUsage()
+{
+	// The Lua side of the entity is in the Lua heap
+	return ServerActiveObject::getMemoryUsage() -
+			sizeof(ServerActiveObject) + sizeof(LuaEntitySAO) +
+			m_init_name.size() + m_init_state.size();
+}
+
 void LuaEntitySAO::setHP(s16 hp)
 {
 	if(hp < 0) hp = 0;
@@ -808,6 +926,7 @@ void LuaEntitySAO::setAttachment(int parent_id, std::string bone, v3f position,
 	m_attachment_position = position;
 	m_attachment_rotation = rotation;
 	m_attachment_sent = false;
+	wakeUp();
 }
 
 ObjectProperties* LuaEntitySAO::accessObjectProperties()
@@ -818,10 +937,13 @@ ObjectProperties* LuaEntitySAO::accessObjectProperties()
 void LuaEntitySAO::notifyObjectPropertiesModified()
 {
 	m_properties_sent = false;
+	// The entity may have become physical
+	wakeUp();
 }
 
 void LuaEntitySAO::setVelocity(v3f velocity)
 {
+	wakeUp();
 	m_velocity = velocity;
 }
 
@@ -832,6 +954,7 @@ v3f LuaEntitySAO::getVelocity()
 
 void LuaEntitySAO::setAcceleration(v3f acceleration)
 {
+	wakeUp();
 	m_acceleration = acceleration;
 }
 
@@ -894,7 +1017,7 @@ void LuaEntitySAO::sendPosition(bool do_interpolate, bool is_movement_end)
 	m_last_sent_yaw = m_yaw;
 	m_last_sent_position = m_base_position;
 	m_last_sent_velocity = m_velocity;
-	//m_last_sent_acceleration = m_acceleration;
+	m_last_sent_acceleration = m_acceleration;
 
 	float update_interval = m_env->getSendRecommendedInterval();
 
@@ -909,6 +1032,16 @@ void LuaEntitySAO::sendPosition(bool do_interpolate, bool is_movement_end)
 	);
 	// create message and add to list
 	ActiveObjectMessage aom(getId(), false, str);
+	aom.packed_datastring = gob_cmd_update_position_packed(
+		m_base_position,
+		m_velocity,
+		m_acceleration,
+		m_yaw,
+		do_interpolate,
+		is_movement_end,
+		update_interval
+	);
+	aom.is_position = true;
 	m_messages_out.push_back(aom);
 }
 
@@ -949,6 +1082,10 @@ PlayerSAO::PlayerSAO(ServerEnvironment *env_, Player *player_, u16 peer_id_,
 	m_time_from_last_punch(0),
 	m_nocheat_dig_pos(32767, 32767, 32767),
 	m_nocheat_dig_time(0),
+	m_extrapolating(false),
+	m_report_position(0,0,0),
+	m_report_speed(0,0,0),
+	m_report_age(0),
 	m_wield_index(0),
 	m_position_not_sent(false),
 	m_armor_groups_sent(false),
@@ -967,6 +1104,7 @@ PlayerSAO::PlayerSAO(ServerEnvironment *env_, Player *player_, u16 peer_id_,
 	m_hp_not_sent(false),
 	m_breath_not_sent(false),
 	m_wielded_item_not_sent(false),
+	m_craft_preview_valid(false),
 	m_physics_override_speed(1),
 	m_physics_override_jump(1),
 	m_physics_override_gravity(1),
@@ -1010,6 +1148,12 @@ std::string PlayerSAO::getDescription()
 	return std::string("player ") + m_player->getName();
 }
 
+u32 PlayerSAO::getMemoryUsage()
+{
+	return ServerActiveObject::getMemoryUsage() -
+			sizeof(ServerActiveObject) + sizeof(PlayerSAO);
+}
+
 // Called after id has been set and has been inserted in environment
 void PlayerSAO::addedToEnvironment(u32 dtime_s)
 {
@@ -1117,6 +1261,7 @@ void PlayerSAO::step(float dtime, bool send_recommended)
 		m_attachment_position = v3f(0,0,0);
 		m_attachment_rotation = v3f(0,0,0);
 		m_player->setPosition(m_last_good_position);
+		m_extrapolating = false;
 		m_moved = true;
 	}
 
@@ -1144,6 +1289,25 @@ void PlayerSAO::step(float dtime, bool send_recommended)
 		m_last_good_position = pos;
 		m_player->setPosition(pos);
 	}
+	// Move on as the client does until it tells otherwise. This isn't
+	// checked for cheating; the next report is, against the last one.
+	else if(m_extrapolating && m_report_age < PLAYERPOS_EXTRAPOLATION_MAX)
+	{
+		m_report_age = MYMIN(m_report_age + dtime,
+				PLAYERPOS_EXTRAPOLATION_MAX);
+		v3f pos = m_report_position + m_report_speed * m_report_age;
+		// The client would have collided; stop in front of a walkable
+		// node rather than go on through it
+		INodeDefManager *ndef = m_env->getGameDef()->ndef();
+		Map &map = m_env->getMap();
+		if(ndef->get(map.getNodeNoEx(floatToInt(
+					pos + v3f(0, 0.1 * BS, 0), BS))).walkable ||
+				ndef->get(map.getNodeNoEx(floatToInt(
+					pos + v3f(0, 1.5 * BS, 0), BS))).walkable)
+			m_extrapolating = false;
+		else
+			m_player->setPosition(pos);
+	}
 
 	if(send_recommended == false)
 		return;
@@ -1169,6 +1333,16 @@ void PlayerSAO::step(float dtime, bool send_recommended)
 		);
 		// create message and add to list
 		ActiveObjectMessage aom(getId(), false, str);
+		aom.packed_datastring = gob_cmd_update_position_packed(
+			pos,
+			v3f(0,0,0),
+			v3f(0,0,0),
+			m_player->getYaw(),
+			true,
+			false,
+			update_interval
+		);
+		aom.is_position = true;
 		m_messages_out.push_back(aom);
 	}
 
@@ -1238,6 +1412,7 @@ void PlayerSAO::setPos(v3f pos)
 	m_player->setPosition(pos);
 	// Movement caused by this command is always valid
 	m_last_good_position = pos;
+	m_extrapolating = false;
 	// Force position change on client
 	m_moved = true;
 }
@@ -1249,6 +1424,7 @@ void PlayerSAO::moveTo(v3f pos, bool continuous)
 	m_player->setPosition(pos);
 	// Movement caused by this command is always valid
 	m_last_good_position = pos;
+	m_extrapolating = false;
 	// Force position change on client
 	m_moved = true;
 }
@@ -1516,6 +1692,7 @@ bool PlayerSAO::checkMovementCheat()
 					<<" moved too fast; resetting position"
 					<<std::endl;
 			m_player->setPosition(m_last_good_position);
+			m_extrapolating = false;
 			m_moved = true;
 			cheated = true;
 		}
@@ -1523,6 +1700,19 @@ bool PlayerSAO::checkMovementCheat()
 	return cheated;
 }
 
+void PlayerSAO::setMovementReport(v3f position, v3f speed)
+{
+	// Nobody can be trusted to move faster than this
+	float max_speed = m_player->movement_speed_fast *
+			m_physics_override_speed * 2;
+	if(speed.getLength() > max_speed)
+		speed = speed.normalize() * max_speed;
+	m_extrapolating = speed != v3f(0,0,0);
+	m_report_position = position;
+	m_report_speed = speed;
+	m_report_age = 0;
+}
+
 bool PlayerSAO::getCollisionBox(aabb3f *toset) {
 	//update collision box
 	*toset = m_player->getCollisionbox();
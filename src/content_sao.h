@@ -48,6 +48,12 @@ class LuaEntitySAO : public ServerActiveObject
 			const std::string &data);
 	bool isAttached();
 	void step(float dtime, bool send_recommended);
+	void finishStep();
+	// The on_step to run between step() and finishStep(), if any; they
+	// are run by ServerEnvironment::stepEntityCallbacks()
+	bool getPendingOnStep(float &dtime);
+	void onStepDone(bool has_on_step);
+	void wakeUp();
 	std::string getClientInitializationData(u16 protocol_version);
 	std::string getStaticData();
 	int punch(v3f dir,
@@ -59,6 +65,7 @@ class LuaEntitySAO : public ServerActiveObject
 	void moveTo(v3f pos, bool continuous);
 	float getMinimumSavedMovement();
 	std::string getDescription();
+	u32 getMemoryUsage();
 	void setHP(s16 hp);
 	s16 getHP() const;
 	void setArmorGroups(const ItemGroupList &armor_groups);
@@ -83,11 +90,31 @@ class LuaEntitySAO : public ServerActiveObject
 private:
 	std::string getPropertyPacket();
 	void sendPosition(bool do_interpolate, bool is_movement_end);
+	// Not moving and not going to move on its own
+	bool isIdle();
 
 	std::string m_init_name;
 	std::string m_init_state;
 	bool m_registered;
 	struct ObjectProperties m_prop;
+
+	/*
+		Sleeping entities skip physics. Their on_step is not called, or
+		only every m_idle_step_interval seconds with the time slept if
+		the entity definition sets idle_step_interval.
+	*/
+	bool m_has_on_step;
+	float m_idle_step_interval;
+	bool m_sleeping;
+	float m_idle_timer;
+	float m_sleep_dtime;
+
+	// Kept from step() for finishStep()
+	bool m_on_step_pending;
+	float m_on_step_dtime;
+	float m_step_dtime;
+	bool m_step_awake;
+	bool m_step_send_recommended;
 	
 	s16 m_hp;
 	v3f m_velocity;
@@ -99,6 +126,7 @@ class LuaEntitySAO : public ServerActiveObject
 	float m_last_sent_yaw;
 	v3f m_last_sent_position;
 	v3f m_last_sent_velocity;
+	v3f m_last_sent_acceleration;
 	float m_last_sent_position_timer;
 	float m_last_sent_move_precision;
 	bool m_armor_groups_sent;
@@ -163,6 +191,7 @@ class PlayerSAO : public ServerActiveObject
 	u8 getSendType() const
 	{ return ACTIVEOBJECT_TYPE_GENERIC; }
 	std::string getDescription();
+	u32 getMemoryUsage();
 
 	/*
 		Active object <-> environment interface
@@ -264,6 +293,9 @@ class PlayerSAO : public ServerActiveObject
 	}
 	// Returns true if cheated
 	bool checkMovementCheat();
+	// The position and speed the client sent, to move the player on from
+	// until the next ones; see TOSERVER_PLAYERPOS
+	void setMovementReport(v3f position, v3f speed);
 
 	// Other
 
@@ -293,6 +325,12 @@ class PlayerSAO : public ServerActiveObject
 	v3s16 m_nocheat_dig_pos;
 	float m_nocheat_dig_time;
 
+	// Extrapolation of the position between the client's reports
+	bool m_extrapolating;
+	v3f m_report_position;
+	v3f m_report_speed;
+	float m_report_age;
+
 	int m_wield_index;
 	bool m_position_not_sent;
 	ItemGroupList m_armor_groups;
@@ -325,6 +363,10 @@ class PlayerSAO : public ServerActiveObject
 	bool m_hp_not_sent;
 	bool m_breath_not_sent;
 	bool m_wielded_item_not_sent;
+	// The craft grid of the last craft preview and the preview
+	bool m_craft_preview_valid;
+	std::string m_craft_preview_grid;
+	ItemStack m_craft_preview;
 
 	float m_physics_override_speed;
 	float m_physics_override_jump;
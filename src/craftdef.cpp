@@ -23,7 +23,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "log.h"
 #include <sstream>
 #include <set>
+#include <map>
 #include <algorithm>
+#include <functional>
 #include "gamedef.h"
 #include "inventory.h"
 #include "util/serialize.h"
@@ -151,6 +153,117 @@ static bool craftGetBounds(const std::vector<std::string> &items, unsigned int w
 	return success;
 }
 
+/*
+	Keys of the crafting index.  Recipes of plain item names are found
+	by their exact items; the ones with groups, like the tool repair, are
+	in buckets that are tried for every input of the same method and
+	number of items, or of the same size for shaped recipes.
+*/
+
+static bool craftIsGroupName(const std::string &name)
+{
+	return name.substr(0,6) == "group:";
+}
+
+// The size and item names of the bounding rectangle, and the key of
+// the recipes with groups of that size
+// Returns false if width is 0 or every item is ""
+static bool craftShapedHashKeys(std::vector<std::string> names,
+		unsigned int width, std::string &key, std::string &group_key,
+		bool &has_groups)
+{
+	if(width == 0)
+		return false;
+	while(names.size() % width != 0)
+		names.push_back("");
+
+	unsigned int min_x=0, max_x=0, min_y=0, max_y=0;
+	if(!craftGetBounds(names, width, min_x, max_x, min_y, max_y))
+		return false;
+
+	std::ostringstream os(std::ios::binary);
+	os<<(max_x - min_x + 1)<<" "<<(max_y - min_y + 1);
+	std::string size = os.str();
+	group_key = "group shaped " + size;
+
+	has_groups = false;
+	os.str("");
+	os<<"shaped "<<size;
+	for(unsigned int y=min_y; y<=max_y; y++)
+	for(unsigned int x=min_x; x<=max_x; x++)
+	{
+		const std::string &name = names[y * width + x];
+		if(craftIsGroupName(name))
+			has_groups = true;
+		os<<"\n"<<name;
+	}
+	key = os.str();
+	return true;
+}
+
+// Item names in any order
+static std::string craftShapelessHashKey(std::vector<std::string> names)
+{
+	std::sort(names.begin(), names.end());
+	std::ostringstream os(std::ios::binary);
+	os<<"shapeless";
+	for(std::vector<std::string>::const_iterator
+			i = names.begin();
+			i != names.end(); i++)
+		os<<"\n"<<(*i);
+	return os.str();
+}
+
+static std::string craftSingleHashKey(CraftMethod method,
+		const std::string &name)
+{
+	std::ostringstream os(std::ios::binary);
+	os<<"single "<<(int)method<<"\n"<<name;
+	return os.str();
+}
+
+static std::string craftGroupHashKey(CraftMethod method, int count)
+{
+	std::ostringstream os(std::ios::binary);
+	os<<"group "<<(int)method<<" "<<count;
+	return os.str();
+}
+
+// All keys under which recipes matching the input may be
+static std::vector<std::string> craftGetInputHashKeys(const CraftInput &input)
+{
+	std::vector<std::string> names;
+	std::vector<std::string> names_filtered;
+	for(std::vector<ItemStack>::const_iterator
+			i = input.items.begin();
+			i != input.items.end(); i++)
+	{
+		names.push_back(i->name);
+		if(i->name != "")
+			names_filtered.push_back(i->name);
+	}
+
+	std::vector<std::string> keys;
+	if(input.method == CRAFT_METHOD_NORMAL)
+	{
+		std::string key, group_key;
+		bool has_groups;
+		if(craftShapedHashKeys(names, input.width, key, group_key,
+				has_groups))
+		{
+			keys.push_back(key);
+			keys.push_back(group_key);
+		}
+		keys.push_back(craftShapelessHashKey(names_filtered));
+	}
+	else if(names_filtered.size() == 1)
+	{
+		keys.push_back(craftSingleHashKey(input.method, names_filtered[0]));
+	}
+	keys.push_back(craftGroupHashKey(input.method, names_filtered.size()));
+	return keys;
+}
+
 // Removes 1 from each item stack
 static void craftDecrementInput(CraftInput &input, IGameDef *gamedef)
 {
@@ -460,6 +573,16 @@ void CraftDefinitionShaped::decrementInput(CraftInput &input, IGameDef *gamedef)
 	craftDecrementOrReplaceInput(input, replacements, gamedef);
 }
 
+std::string CraftDefinitionShaped::getHashKey(IGameDef *gamedef) const
+{
+	std::string key, group_key;
+	bool has_groups;
+	if(!craftShapedHashKeys(craftGetItemNames(recipe, gamedef), width,
+			key, group_key, has_groups))
+		return "";
+	return has_groups ? group_key : key;
+}
+
 std::string CraftDefinitionShaped::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -564,6 +687,21 @@ void CraftDefinitionShapeless::decrementInput(CraftInput &input, IGameDef *gamed
 	craftDecrementOrReplaceInput(input, replacements, gamedef);
 }
 
+std::string CraftDefinitionShapeless::getHashKey(IGameDef *gamedef) const
+{
+	if(recipe.empty())
+		return "";
+	std::vector<std::string> names = craftGetItemNames(recipe, gamedef);
+	for(std::vector<std::string>::const_iterator
+			i = names.begin();
+			i != names.end(); i++)
+	{
+		if(craftIsGroupName(*i))
+			return craftGroupHashKey(CRAFT_METHOD_NORMAL, names.size());
+	}
+	return craftShapelessHashKey(names);
+}
+
 std::string CraftDefinitionShapeless::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -689,6 +827,12 @@ void CraftDefinitionToolRepair::decrementInput(CraftInput &input, IGameDef *game
 	craftDecrementInput(input, gamedef);
 }
 
+std::string CraftDefinitionToolRepair::getHashKey(IGameDef *gamedef) const
+{
+	// Any two tools of the same kind
+	return craftGroupHashKey(CRAFT_METHOD_NORMAL, 2);
+}
+
 std::string CraftDefinitionToolRepair::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -761,6 +905,14 @@ void CraftDefinitionCooking::decrementInput(CraftInput &input, IGameDef *gamedef
 	craftDecrementOrReplaceInput(input, replacements, gamedef);
 }
 
+std::string CraftDefinitionCooking::getHashKey(IGameDef *gamedef) const
+{
+	std::string name = craftGetItemName(recipe, gamedef);
+	if(craftIsGroupName(name))
+		return craftGroupHashKey(CRAFT_METHOD_COOKING, 1);
+	return craftSingleHashKey(CRAFT_METHOD_COOKING, name);
+}
+
 std::string CraftDefinitionCooking::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -842,6 +994,14 @@ void CraftDefinitionFuel::decrementInput(CraftInput &input, IGameDef *gamedef) c
 	craftDecrementOrReplaceInput(input, replacements, gamedef);
 }
 
+std::string CraftDefinitionFuel::getHashKey(IGameDef *gamedef) const
+{
+	std::string name = craftGetItemName(recipe, gamedef);
+	if(craftIsGroupName(name))
+		return craftGroupHashKey(CRAFT_METHOD_FUEL, 1);
+	return craftSingleHashKey(CRAFT_METHOD_FUEL, name);
+}
+
 std::string CraftDefinitionFuel::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -874,6 +1034,9 @@ void CraftDefinitionFuel::deSerializeBody(std::istream &is, int version)
 class CCraftDefManager: public IWritableCraftDefManager
 {
 public:
+	CCraftDefManager():
+		m_gamedef(NULL)
+	{}
 	virtual ~CCraftDefManager()
 	{
 		clear();
@@ -901,11 +1064,13 @@ class CCraftDefManager: public IWritableCraftDefManager
 
 		// Walk crafting definitions from back to front, so that later
 		// definitions can override earlier ones.
-		for(std::vector<CraftDefinition*>::const_reverse_iterator
-				i = m_craft_definitions.rbegin();
-				i != m_craft_definitions.rend(); i++)
+		std::vector<u32> candidates;
+		getCandidates(input, candidates);
+		for(std::vector<u32>::const_iterator
+				i = candidates.begin();
+				i != candidates.end(); i++)
 		{
-			CraftDefinition *def = *i;
+			CraftDefinition *def = m_craft_definitions[*i];
 
 			/*infostream<<"Checking "<<input.dump()<<std::endl
 					<<" against "<<def->dump()<<std::endl;*/
@@ -1025,6 +1190,8 @@ class CCraftDefManager: public IWritableCraftDefManager
 		verbosestream<<"registerCraft: registering craft definition: "
 				<<def->dump()<<std::endl;
 		m_craft_definitions.push_back(def);
+		if(m_gamedef)
+			indexCraft(m_craft_definitions.size() - 1);
 	}
 	virtual void clear()
 	{
@@ -1034,6 +1201,19 @@ class CCraftDefManager: public IWritableCraftDefManager
 			delete *i;
 		}
 		m_craft_definitions.clear();
+		m_craft_index.clear();
+		m_craft_unindexed.clear();
+	}
+	virtual void initHashes(IGameDef *gamedef)
+	{
+		m_gamedef = gamedef;
+		m_craft_index.clear();
+		m_craft_unindexed.clear();
+		for(u32 i=0; i<m_craft_definitions.size(); i++)
+			indexCraft(i);
+		infostream<<"CraftDefManager: indexed "<<m_craft_definitions.size()
+				<<" craft definitions under "<<m_craft_index.size()
+				<<" keys"<<std::endl;
 	}
 	virtual void serialize(std::ostream &os) const
 	{
@@ -1068,7 +1248,57 @@ class CCraftDefManager: public IWritableCraftDefManager
 		}
 	}
 private:
+	void indexCraft(u32 i)
+	{
+		CraftDefinition *def = m_craft_definitions[i];
+		std::string key;
+		try {
+			key = def->getHashKey(m_gamedef);
+		}
+		catch(SerializationError &e)
+		{
+			// Tried every time, like before there was an index
+			m_craft_unindexed.push_back(i);
+			return;
+		}
+		if(key != "")
+			m_craft_index[key].push_back(i);
+	}
+	// Indices of the definitions that may match, from the last one
+	void getCandidates(const CraftInput &input,
+			std::vector<u32> &candidates) const
+	{
+		if(m_gamedef == NULL)
+		{
+			for(u32 i=m_craft_definitions.size(); i>0; i--)
+				candidates.push_back(i - 1);
+			return;
+		}
+
+		candidates = m_craft_unindexed;
+		std::vector<std::string> keys = craftGetInputHashKeys(input);
+		for(std::vector<std::string>::const_iterator
+				i = keys.begin();
+				i != keys.end(); i++)
+		{
+			std::map<std::string, std::vector<u32> >::const_iterator
+					n = m_craft_index.find(*i);
+			if(n != m_craft_index.end())
+				candidates.insert(candidates.end(),
+						n->second.begin(), n->second.end());
+		}
+		std::sort(candidates.begin(), candidates.end(), std::greater<u32>());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()),
+				candidates.end());
+	}
+
 	std::vector<CraftDefinition*> m_craft_definitions;
+	// Set by initHashes(), for indexing the definitions
+	IGameDef *m_gamedef;
+	// Definitions by getHashKey(), as indices to m_craft_definitions
+	std::map<std::string, std::vector<u32> > m_craft_index;
+	// Definitions whose key could not be made
+	std::vector<u32> m_craft_unindexed;
 };
 
 IWritableCraftDefManager* createCraftDefManager()
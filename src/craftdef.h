@@ -135,6 +135,11 @@ class CraftDefinition
 	// Decreases count of every input item
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const=0;
 
+	// Key of the recipe in the index of the definition manager; every
+	// input that check() accepts is looked up with it, among others.
+	// Returns "" if no input can match.
+	virtual std::string getHashKey(IGameDef *gamedef) const=0;
+
 	virtual std::string dump() const=0;
 
 protected:
@@ -169,6 +174,8 @@ class CraftDefinitionShaped: public CraftDefinition
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
 
+	virtual std::string getHashKey(IGameDef *gamedef) const;
+
 	virtual std::string dump() const;
 
 protected:
@@ -211,6 +218,8 @@ class CraftDefinitionShapeless: public CraftDefinition
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
 
+	virtual std::string getHashKey(IGameDef *gamedef) const;
+
 	virtual std::string dump() const;
 
 protected:
@@ -249,6 +258,8 @@ class CraftDefinitionToolRepair: public CraftDefinition
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
 
+	virtual std::string getHashKey(IGameDef *gamedef) const;
+
 	virtual std::string dump() const;
 
 protected:
@@ -289,6 +300,8 @@ class CraftDefinitionCooking: public CraftDefinition
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
 
+	virtual std::string getHashKey(IGameDef *gamedef) const;
+
 	virtual std::string dump() const;
 
 protected:
@@ -329,6 +342,8 @@ class CraftDefinitionFuel: public CraftDefinition
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
 
+	virtual std::string getHashKey(IGameDef *gamedef) const;
+
 	virtual std::string dump() const;
 
 protected:
@@ -389,6 +404,9 @@ class IWritableCraftDefManager : public ICraftDefManager
 	virtual void registerCraft(CraftDefinition *def)=0;
 	// Delete all crafting definitions
 	virtual void clear()=0;
+	// Index the crafting definitions for getCraftResult(); until this is
+	// called, every definition is tried.  Called after loading the mods.
+	virtual void initHashes(IGameDef *gamedef)=0;
 
 	virtual void serialize(std::ostream &os) const=0;
 	virtual void deSerialize(std::istream &is)=0;
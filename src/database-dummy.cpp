@@ -59,14 +59,18 @@ std::string Database_Dummy::loadBlock(v3s16 blockpos)
 		return "";
 }
 
-void Database_Dummy::listAllLoadableBlocks(std::list<v3s16> &dst)
+bool Database_Dummy::listLoadableBlocks(std::string &cursor, u32 max_count,
+		std::vector<v3s16> &dst)
 {
-	for(std::map<u64, std::string>::iterator x = m_database.begin(); x != m_database.end(); ++x)
-	{
-		v3s16 p = getIntegerAsBlock(x->first);
-		//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
-		dst.push_back(p);
+	dst.clear();
+
+	std::map<u64, std::string>::iterator x = cursor.empty() ?
+			m_database.begin() : m_database.upper_bound(stoi64(cursor));
+	for (; x != m_database.end() && dst.size() < max_count; ++x) {
+		dst.push_back(getIntegerAsBlock(x->first));
+		cursor = i64tos(x->first);
 	}
+	return !dst.empty();
 }
 
 Database_Dummy::~Database_Dummy()
@@ -35,7 +35,8 @@ class Database_Dummy : public Database
 	virtual void endSave();
 	virtual bool saveBlock(v3s16 blockpos, std::string &data);
 	virtual std::string loadBlock(v3s16 blockpos);
-	virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
+	virtual bool listLoadableBlocks(std::string &cursor, u32 max_count,
+			std::vector<v3s16> &dst);
 	virtual int Initialized(void);
 	~Database_Dummy();
 private:
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "database-leveldb.h"
 #include "leveldb/db.h"
+#include "leveldb/cache.h"
 
 #include "map.h"
 #include "mapsector.h"
@@ -38,10 +39,21 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		throw FileNotGoodException(std::string("LevelDB error: ") + (s).ToString()); \
 	}
 
+// Block keys are decimal numbers, so players keyed with this prefix sort
+// after all of them
+#define PLAYER_KEY_PREFIX "player:"
+
 Database_LevelDB::Database_LevelDB(ServerMap *map, std::string savedir)
 {
 	leveldb::Options options;
 	options.create_if_missing = true;
+	// Sizes are given in MiB
+	m_block_cache = leveldb::NewLRUCache(
+			(size_t)g_settings->getU16("leveldb_cache_size") * 1024 * 1024);
+	options.block_cache = m_block_cache;
+	options.write_buffer_size =
+			(size_t)g_settings->getU16("leveldb_write_buffer_size") * 1024 * 1024;
+	m_in_batch = false;
 	leveldb::Status status = leveldb::DB::Open(options, savedir + DIR_DELIM + "map.db", &m_database);
 	ENSURE_STATUS_OK(status);
 	srvmap = map;
@@ -52,11 +64,28 @@ int Database_LevelDB::Initialized(void)
 	return 1;
 }
 
-void Database_LevelDB::beginSave() {}
-void Database_LevelDB::endSave() {}
+void Database_LevelDB::beginSave()
+{
+	m_batch.Clear();
+	m_in_batch = true;
+}
+
+void Database_LevelDB::endSave()
+{
+	m_in_batch = false;
+	leveldb::Status status = m_database->Write(leveldb::WriteOptions(),
+			&m_batch);
+	m_batch.Clear();
+	ENSURE_STATUS_OK(status);
+}
 
 bool Database_LevelDB::saveBlock(v3s16 blockpos, std::string &data)
 {
+	if (m_in_batch) {
+		m_batch.Put(i64tos(getBlockAsInteger(blockpos)), data);
+		return true;
+	}
+
 	leveldb::Status status = m_database->Put(leveldb::WriteOptions(),
 			i64tos(getBlockAsInteger(blockpos)), data);
 	if (!status.ok()) {
@@ -80,18 +109,102 @@ std::string Database_LevelDB::loadBlock(v3s16 blockpos)
 		return "";
 }
 
-void Database_LevelDB::listAllLoadableBlocks(std::list<v3s16> &dst)
+void Database_LevelDB::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::vector<std::string> &data)
+{
+	// Read all blocks from the same snapshot
+	leveldb::ReadOptions options;
+	options.snapshot = m_database->GetSnapshot();
+
+	data.resize(blockpos.size());
+	for (size_t i = 0; i < blockpos.size(); i++) {
+		leveldb::Status status = m_database->Get(options,
+			i64tos(getBlockAsInteger(blockpos[i])), &data[i]);
+		if (!status.ok())
+			data[i] = "";
+	}
+
+	m_database->ReleaseSnapshot(options.snapshot);
+}
+
+bool Database_LevelDB::listLoadableBlocks(std::string &cursor, u32 max_count,
+		std::vector<v3s16> &dst)
 {
+	dst.clear();
+
+	// The cursor is the last listed key
 	leveldb::Iterator* it = m_database->NewIterator(leveldb::ReadOptions());
-	for (it->SeekToFirst(); it->Valid(); it->Next()) {
-		dst.push_back(getIntegerAsBlock(stoi64(it->key().ToString())));
+	if (cursor.empty()) {
+		it->SeekToFirst();
+	} else {
+		it->Seek(cursor);
+		if (it->Valid() && it->key().ToString() == cursor)
+			it->Next();
 	}
-	ENSURE_STATUS_OK(it->status());  // Check for any errors found during the scan
+	for (; it->Valid() && dst.size() < max_count; it->Next()) {
+		if (it->key().starts_with(PLAYER_KEY_PREFIX))
+			break;
+		cursor = it->key().ToString();
+		dst.push_back(getIntegerAsBlock(stoi64(cursor)));
+	}
+	leveldb::Status status = it->status();
 	delete it;
+	ENSURE_STATUS_OK(status);  // Check for any errors found during the scan
+	return !dst.empty();
+}
+
+bool Database_LevelDB::supportsPlayers()
+{
+	return true;
+}
+
+bool Database_LevelDB::savePlayer(const std::string &name,
+		const std::string &data)
+{
+	if (m_in_batch) {
+		m_batch.Put(PLAYER_KEY_PREFIX + name, data);
+		return true;
+	}
+
+	leveldb::Status status = m_database->Put(leveldb::WriteOptions(),
+			PLAYER_KEY_PREFIX + name, data);
+	if (!status.ok()) {
+		errorstream << "WARNING: savePlayer: LevelDB error saving player "
+			<< name << ": " << status.ToString() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+std::string Database_LevelDB::loadPlayer(const std::string &name)
+{
+	std::string datastr;
+	leveldb::Status status = m_database->Get(leveldb::ReadOptions(),
+		PLAYER_KEY_PREFIX + name, &datastr);
+
+	if(status.ok())
+		return datastr;
+	else
+		return "";
+}
+
+void Database_LevelDB::listPlayers(std::vector<std::string> &dst)
+{
+	leveldb::Iterator* it = m_database->NewIterator(leveldb::ReadOptions());
+	for (it->Seek(PLAYER_KEY_PREFIX);
+			it->Valid() && it->key().starts_with(PLAYER_KEY_PREFIX);
+			it->Next())
+		dst.push_back(it->key().ToString().substr(
+				sizeof(PLAYER_KEY_PREFIX) - 1));
+	leveldb::Status status = it->status();
+	delete it;
+	ENSURE_STATUS_OK(status);
 }
 
 Database_LevelDB::~Database_LevelDB()
 {
 	delete m_database;
+	delete m_block_cache;
 }
 #endif
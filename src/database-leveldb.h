@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "database.h"
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include <string>
 
 class ServerMap;
@@ -38,12 +39,25 @@ class Database_LevelDB : public Database
 	virtual void endSave();
 	virtual bool saveBlock(v3s16 blockpos, std::string &data);
 	virtual std::string loadBlock(v3s16 blockpos);
-	virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
+	virtual void loadBlocks(const std::vector<v3s16> &blockpos,
+			std::vector<std::string> &data);
+	virtual bool listLoadableBlocks(std::string &cursor, u32 max_count,
+			std::vector<v3s16> &dst);
+	virtual bool supportsPlayers();
+	virtual bool savePlayer(const std::string &name, const std::string &data);
+	virtual std::string loadPlayer(const std::string &name);
+	virtual void listPlayers(std::vector<std::string> &dst);
 	virtual int Initialized(void);
 	~Database_LevelDB();
 private:
 	ServerMap *srvmap;
 	leveldb::DB* m_database;
+	leveldb::Cache* m_block_cache;
+
+	// Puts between beginSave() and endSave() are collected here and
+	// written at once
+	leveldb::WriteBatch m_batch;
+	bool m_in_batch;
 };
 #endif
 #endif
@@ -59,7 +59,11 @@ Database_Redis::Database_Redis(ServerMap *map, std::string savedir)
 		redisFree(ctx);
 		throw FileNotGoodException(err);
 	}
+	// Players are kept apart so that listing blocks doesn't meet them
+	player_hash = hash + ":players";
 	srvmap = map;
+	m_pipelining = false;
+	m_pending_replies = 0;
 }
 
 int Database_Redis::Initialized(void)
@@ -68,25 +72,61 @@ int Database_Redis::Initialized(void)
 }
 
 void Database_Redis::beginSave() {
-	redisReply *reply;
-	reply = (redisReply*) redisCommand(ctx, "MULTI");
-	if(!reply)
+	if (redisAppendCommand(ctx, "MULTI") != REDIS_OK)
 		throw FileNotGoodException(std::string("redis command 'MULTI' failed: ") + ctx->errstr);
-	freeReplyObject(reply);
+	m_pipelining = true;
+	m_pending_replies = 1;
 }
 
 void Database_Redis::endSave() {
-	redisReply *reply;
-	reply = (redisReply*) redisCommand(ctx, "EXEC");
-	if(!reply)
+	if (redisAppendCommand(ctx, "EXEC") != REDIS_OK)
 		throw FileNotGoodException(std::string("redis command 'EXEC' failed: ") + ctx->errstr);
+	m_pipelining = false;
+	m_pending_replies++;
+
+	// Collect the replies to everything sent since beginSave(); the last
+	// one is the reply to EXEC
+	u32 errors = 0;
+	redisReply *reply = NULL;
+	for (; m_pending_replies > 0; m_pending_replies--) {
+		if (reply)
+			freeReplyObject(reply);
+		reply = NULL;
+		if (redisGetReply(ctx, (void **) &reply) != REDIS_OK || !reply) {
+			m_pending_replies = 0;
+			throw FileNotGoodException(std::string("redis pipeline failed: ") + ctx->errstr);
+		}
+		if (reply->type == REDIS_REPLY_ERROR)
+			errors++;
+	}
+	if (reply->type == REDIS_REPLY_ARRAY) {
+		for (size_t i = 0; i < reply->elements; i++)
+			if (reply->element[i]->type == REDIS_REPLY_ERROR)
+				errors++;
+	}
 	freeReplyObject(reply);
+
+	if (errors != 0)
+		errorstream << "WARNING: endSave: " << errors << " redis commands"
+			" failed, map might not have saved" << std::endl;
 }
 
 bool Database_Redis::saveBlock(v3s16 blockpos, std::string &data)
 {
 	std::string tmp = i64tos(getBlockAsInteger(blockpos));
 
+	if (m_pipelining) {
+		// The reply is read in endSave()
+		if (redisAppendCommand(ctx, "HSET %s %s %b", hash.c_str(),
+				tmp.c_str(), data.c_str(), data.size()) != REDIS_OK) {
+			errorstream << "WARNING: saveBlock: redis command 'HSET' failed on "
+				"block " << PP(blockpos) << ": " << ctx->errstr << std::endl;
+			return false;
+		}
+		m_pending_replies++;
+		return true;
+	}
+
 	redisReply *reply = (redisReply *)redisCommand(ctx, "HSET %s %s %b",
 			hash.c_str(), tmp.c_str(), data.c_str(), data.size());
 	if (!reply) {
@@ -123,18 +163,151 @@ std::string Database_Redis::loadBlock(v3s16 blockpos)
 	return str;
 }
 
-void Database_Redis::listAllLoadableBlocks(std::list<v3s16> &dst)
+void Database_Redis::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::vector<std::string> &data)
 {
-	redisReply *reply;
-	reply = (redisReply*) redisCommand(ctx, "HKEYS %s", hash.c_str());
+	data.clear();
+	data.resize(blockpos.size());
+	if (blockpos.empty())
+		return;
+
+	// HMGET <hash> <pos>... fetches all of them in one round trip
+	std::vector<std::string> args;
+	args.push_back("HMGET");
+	args.push_back(hash);
+	for (size_t i = 0; i < blockpos.size(); i++)
+		args.push_back(i64tos(getBlockAsInteger(blockpos[i])));
+
+	std::vector<const char *> argv;
+	std::vector<size_t> argvlen;
+	for (size_t i = 0; i < args.size(); i++) {
+		argv.push_back(args[i].c_str());
+		argvlen.push_back(args[i].size());
+	}
+
+	redisReply *reply = (redisReply*) redisCommandArgv(ctx, argv.size(),
+			&argv[0], &argvlen[0]);
+	if(!reply)
+		throw FileNotGoodException(std::string("redis command 'HMGET %s' failed: ") + ctx->errstr);
+	if(reply->type != REDIS_REPLY_ARRAY || reply->elements != blockpos.size()) {
+		freeReplyObject(reply);
+		throw FileNotGoodException("Failed to get blocks from database");
+	}
+	for(size_t i = 0; i < reply->elements; i++) {
+		redisReply *r = reply->element[i];
+		if(r->type == REDIS_REPLY_STRING)
+			data[i] = std::string(r->str, r->len);
+	}
+	freeReplyObject(reply);
+}
+
+bool Database_Redis::listLoadableBlocks(std::string &cursor, u32 max_count,
+		std::vector<v3s16> &dst)
+{
+	dst.clear();
+
+	// The cursor is the one of HSCAN, "end" once it has wrapped around.
+	// Note that HSCAN returns the block data along with the keys.
+	if (cursor == "end")
+		return false;
+	if (cursor.empty())
+		cursor = "0";
+
+	// HSCAN may return nothing even though there are more keys
+	while (dst.empty()) {
+		redisReply *reply;
+		reply = (redisReply*) redisCommand(ctx, "HSCAN %s %s COUNT %d",
+				hash.c_str(), cursor.c_str(), (int)max_count);
+		if(!reply)
+			throw FileNotGoodException(std::string("redis command 'HSCAN %s' failed: ") + ctx->errstr);
+		if(reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+				reply->element[0]->type != REDIS_REPLY_STRING ||
+				reply->element[1]->type != REDIS_REPLY_ARRAY) {
+			freeReplyObject(reply);
+			throw FileNotGoodException("Failed to get keys from database");
+		}
+		cursor = std::string(reply->element[0]->str, reply->element[0]->len);
+		redisReply *entries = reply->element[1];
+		// Field-value pairs
+		for(size_t i = 0; i + 1 < entries->elements; i += 2)
+		{
+			assert(entries->element[i]->type == REDIS_REPLY_STRING);
+			dst.push_back(getIntegerAsBlock(stoi64(entries->element[i]->str)));
+		}
+		freeReplyObject(reply);
+
+		if (cursor == "0") {
+			cursor = "end";
+			break;
+		}
+	}
+	return !dst.empty();
+}
+
+bool Database_Redis::supportsPlayers()
+{
+	return true;
+}
+
+bool Database_Redis::savePlayer(const std::string &name,
+		const std::string &data)
+{
+	if (m_pipelining) {
+		// The reply is read in endSave()
+		if (redisAppendCommand(ctx, "HSET %s %b %b", player_hash.c_str(),
+				name.c_str(), name.size(), data.c_str(), data.size()) != REDIS_OK) {
+			errorstream << "WARNING: savePlayer: redis command 'HSET' failed on "
+				"player " << name << ": " << ctx->errstr << std::endl;
+			return false;
+		}
+		m_pending_replies++;
+		return true;
+	}
+
+	redisReply *reply = (redisReply *)redisCommand(ctx, "HSET %s %b %b",
+			player_hash.c_str(), name.c_str(), name.size(),
+			data.c_str(), data.size());
+	if (!reply) {
+		errorstream << "WARNING: savePlayer: redis command 'HSET' failed on "
+			"player " << name << ": " << ctx->errstr << std::endl;
+		return false;
+	}
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		errorstream << "WARNING: savePlayer: saving player " << name
+			<< " failed" << std::endl;
+		freeReplyObject(reply);
+		return false;
+	}
+
+	freeReplyObject(reply);
+	return true;
+}
+
+std::string Database_Redis::loadPlayer(const std::string &name)
+{
+	redisReply *reply = (redisReply*) redisCommand(ctx, "HGET %s %b",
+			player_hash.c_str(), name.c_str(), name.size());
+
+	if(!reply)
+		throw FileNotGoodException(std::string("redis command 'HGET %s' failed: ") + ctx->errstr);
+	std::string str;
+	if(reply->type == REDIS_REPLY_STRING)
+		str = std::string(reply->str, reply->len);
+	freeReplyObject(reply);
+	return str;
+}
+
+void Database_Redis::listPlayers(std::vector<std::string> &dst)
+{
+	redisReply *reply = (redisReply*) redisCommand(ctx, "HKEYS %s",
+			player_hash.c_str());
 	if(!reply)
 		throw FileNotGoodException(std::string("redis command 'HKEYS %s' failed: ") + ctx->errstr);
-	if(reply->type != REDIS_REPLY_ARRAY)
-		throw FileNotGoodException("Failed to get keys from database");
-	for(size_t i = 0; i < reply->elements; i++)
-	{
-		assert(reply->element[i]->type == REDIS_REPLY_STRING);
-		dst.push_back(getIntegerAsBlock(stoi64(reply->element[i]->str)));
+	if(reply->type == REDIS_REPLY_ARRAY) {
+		for(size_t i = 0; i < reply->elements; i++)
+			dst.push_back(std::string(reply->element[i]->str,
+					reply->element[i]->len));
 	}
 	freeReplyObject(reply);
 }
@@ -38,13 +38,27 @@ class Database_Redis : public Database
 	virtual void endSave();
 	virtual bool saveBlock(v3s16 blockpos, std::string &data);
 	virtual std::string loadBlock(v3s16 blockpos);
-	virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
+	virtual void loadBlocks(const std::vector<v3s16> &blockpos,
+			std::vector<std::string> &data);
+	virtual bool listLoadableBlocks(std::string &cursor, u32 max_count,
+			std::vector<v3s16> &dst);
+	virtual bool supportsPlayers();
+	virtual bool savePlayer(const std::string &name, const std::string &data);
+	virtual std::string loadPlayer(const std::string &name);
+	virtual void listPlayers(std::vector<std::string> &dst);
 	virtual int Initialized(void);
 	~Database_Redis();
 private:
 	ServerMap *srvmap;
 	redisContext *ctx;
 	std::string hash;
+	std::string player_hash;
+
+	// Between beginSave() and endSave() commands are pipelined and their
+	// replies are only read in endSave(), so nothing may be loaded
+	// in between
+	bool m_pipelining;
+	u32 m_pending_replies;
 };
 #endif
 #endif
@@ -0,0 +1,485 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+	Region file format:
+	- Each file holds the blocks of a 16x16x16 block cube, named
+	  r.<X>.<Y>.<Z>.mtr after its position in regions
+	- [0] 4 bytes magic "MTRG", u8 version, padding up to 16 bytes
+	- [16] offset table of 4096 entries, indexed by
+	  x + 16 * y + 256 * z of the block inside the region:
+	    u32 offset (0 = block not stored), u32 length, u32 capacity
+	- After the table: block data, each at its offset. A saved block
+	  never overwrites the data that the table on disk points to: it
+	  goes to a free slot or the end of the file, and the table entries
+	  are only written once that data is synced. The old slots are
+	  reused after that.
+
+	Reads go through a read-only memory map of the file where available.
+*/
+
+#include "database-region.h"
+
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <set>
+#include <vector>
+#ifdef _WIN32
+	#include <io.h>
+#else
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "map.h"
+#include "exceptions.h"
+#include "filesys.h"
+#include "log.h"
+#include "util/numeric.h"
+#include "util/serialize.h"
+#include "util/string.h"
+
+#define REGION_SIZE 16
+#define REGION_BLOCKS (REGION_SIZE * REGION_SIZE * REGION_SIZE)
+#define REGION_VERSION 1
+#define REGION_HEADER_SIZE 16
+#define REGION_ENTRY_SIZE 12
+#define REGION_DATA_START (REGION_HEADER_SIZE + REGION_BLOCKS * REGION_ENTRY_SIZE)
+// Capacity granularity, so that slightly grown blocks stay in place
+#define REGION_ALIGN 256
+#define REGION_MAX_OPEN 64
+
+static const char region_magic[4] = {'M', 'T', 'R', 'G'};
+
+struct Database_Region::Region
+{
+	struct Entry
+	{
+		u32 offset;
+		u32 length;
+		u32 capacity;
+	};
+
+	v3s16 pos;
+	FILE *file;
+	// Where a block goes when no free slot is big enough
+	u32 data_end;
+	Entry entries[REGION_BLOCKS];
+	// Unused slots, offset -> capacity
+	std::map<u32, u32> free_slots;
+	// Entries changed since the table was last written, and the slots
+	// they pointed to there, which can't be reused before that
+	std::set<u32> dirty_entries;
+	std::vector<std::pair<u32, u32> > freed_on_sync;
+	// Written to since the last fflush()/fsync()
+	bool unflushed;
+	bool unsynced;
+	u32 last_used;
+#ifndef _WIN32
+	const char *map;
+	size_t map_size;
+#endif
+};
+
+static void free_region_slot(std::map<u32, u32> &free_slots,
+		u32 offset, u32 capacity)
+{
+	// Merge with the neighbouring free slots
+	std::map<u32, u32>::iterator next = free_slots.lower_bound(offset);
+	if (next != free_slots.end() && offset + capacity == next->first) {
+		capacity += next->second;
+		free_slots.erase(next++);
+	}
+	if (next != free_slots.begin()) {
+		std::map<u32, u32>::iterator prev = next;
+		--prev;
+		if (prev->first + prev->second == offset) {
+			prev->second += capacity;
+			return;
+		}
+	}
+	free_slots[offset] = capacity;
+}
+
+static u32 get_region_index(v3s16 blockpos)
+{
+	v3s16 rel = blockpos - getContainerPos(blockpos, REGION_SIZE) * REGION_SIZE;
+	return rel.X + REGION_SIZE * rel.Y + REGION_SIZE * REGION_SIZE * rel.Z;
+}
+
+Database_Region::Database_Region(ServerMap *map, std::string savedir)
+{
+	srvmap = map;
+	m_dir = savedir + DIR_DELIM + "regions";
+	m_use_counter = 0;
+	if (!fs::CreateAllDirs(m_dir))
+		throw FileNotGoodException("Cannot create region directory");
+}
+
+int Database_Region::Initialized(void)
+{
+	return 1;
+}
+
+std::string Database_Region::getRegionPath(v3s16 regionpos)
+{
+	std::ostringstream os(std::ios_base::binary);
+	os << m_dir << DIR_DELIM << "r." << regionpos.X << "." << regionpos.Y
+		<< "." << regionpos.Z << ".mtr";
+	return os.str();
+}
+
+Database_Region::Region *Database_Region::getRegion(v3s16 regionpos,
+		bool create)
+{
+	std::map<v3s16, Region*>::iterator i = m_regions.find(regionpos);
+	if (i != m_regions.end()) {
+		i->second->last_used = ++m_use_counter;
+		return i->second;
+	}
+
+	Region *r = openRegion(regionpos, getRegionPath(regionpos), create);
+	if (!r)
+		return NULL;
+
+	// Close the least recently used file if too many are open
+	if (m_regions.size() >= REGION_MAX_OPEN) {
+		std::map<v3s16, Region*>::iterator oldest = m_regions.begin();
+		for (i = m_regions.begin(); i != m_regions.end(); ++i)
+			if (i->second->last_used < oldest->second->last_used)
+				oldest = i;
+		closeRegion(oldest->second);
+		m_regions.erase(oldest);
+	}
+
+	r->last_used = ++m_use_counter;
+	m_regions[regionpos] = r;
+	return r;
+}
+
+Database_Region::Region *Database_Region::openRegion(v3s16 regionpos,
+		const std::string &path, bool create)
+{
+	FILE *file = fopen(path.c_str(), "r+b");
+	if (!file) {
+		if (!create)
+			return NULL;
+		file = fopen(path.c_str(), "w+b");
+		if (!file) {
+			errorstream << "Database_Region: Cannot create " << path
+				<< std::endl;
+			throw FileNotGoodException("Cannot create region file");
+		}
+		// Header and an empty offset table
+		std::string header(REGION_DATA_START, '\0');
+		memcpy(&header[0], region_magic, 4);
+		header[4] = REGION_VERSION;
+		if (fwrite(header.c_str(), 1, header.size(), file) != header.size()) {
+			fclose(file);
+			throw FileNotGoodException("Cannot write region file header");
+		}
+	}
+
+	u8 header[REGION_DATA_START];
+	if (fseek(file, 0, SEEK_SET) != 0 ||
+			fread(header, 1, REGION_DATA_START, file) != REGION_DATA_START ||
+			memcmp(header, region_magic, 4) != 0 ||
+			header[4] != REGION_VERSION) {
+		fclose(file);
+		errorstream << "Database_Region: Invalid region file " << path
+			<< std::endl;
+		throw FileNotGoodException("Invalid region file");
+	}
+
+	Region *r = new Region;
+	r->pos = regionpos;
+	r->file = file;
+	r->data_end = REGION_DATA_START;
+	r->unflushed = false;
+	r->unsynced = false;
+	r->last_used = 0;
+#ifndef _WIN32
+	r->map = NULL;
+	r->map_size = 0;
+#endif
+	std::map<u32, u32> used;
+	for (u32 k = 0; k < REGION_BLOCKS; k++) {
+		const u8 *e = &header[REGION_HEADER_SIZE + k * REGION_ENTRY_SIZE];
+		r->entries[k].offset = readU32(&e[0]);
+		r->entries[k].length = readU32(&e[4]);
+		r->entries[k].capacity = readU32(&e[8]);
+		if (r->entries[k].offset != 0) {
+			used[r->entries[k].offset] = r->entries[k].capacity;
+			r->data_end = MYMAX(r->data_end,
+					r->entries[k].offset + r->entries[k].capacity);
+		}
+	}
+
+	// The gaps between the used slots are free
+	u32 end = REGION_DATA_START;
+	for (std::map<u32, u32>::iterator i = used.begin(); i != used.end(); ++i) {
+		if (i->first > end)
+			free_region_slot(r->free_slots, end, i->first - end);
+		end = MYMAX(end, i->first + i->second);
+	}
+	return r;
+}
+
+void Database_Region::flushRegion(Region *r)
+{
+	if (r->unflushed) {
+		fflush(r->file);
+		r->unflushed = false;
+	}
+	if (r->unsynced) {
+#ifdef _WIN32
+		_commit(_fileno(r->file));
+#else
+		fsync(fileno(r->file));
+#endif
+		r->unsynced = false;
+	}
+}
+
+void Database_Region::syncRegion(Region *r)
+{
+	// The new data has to be on disk before the table points to it
+	flushRegion(r);
+	if (r->dirty_entries.empty())
+		return;
+
+	bool written = true;
+	for (std::set<u32>::iterator i = r->dirty_entries.begin();
+			i != r->dirty_entries.end(); ++i) {
+		const Region::Entry &e = r->entries[*i];
+		u8 entry[REGION_ENTRY_SIZE];
+		writeU32(&entry[0], e.offset);
+		writeU32(&entry[4], e.length);
+		writeU32(&entry[8], e.capacity);
+		r->unflushed = r->unsynced = true;
+		if (fseek(r->file, REGION_HEADER_SIZE + *i * REGION_ENTRY_SIZE,
+					SEEK_SET) != 0 ||
+				fwrite(entry, 1, REGION_ENTRY_SIZE, r->file) !=
+					REGION_ENTRY_SIZE) {
+			written = false;
+			break;
+		}
+	}
+	flushRegion(r);
+	if (!written) {
+		// Keep the old slots, a part of the table may still point to them
+		errorstream << "Database_Region: Writing the table of region "
+			<< PP(r->pos) << " failed" << std::endl;
+		return;
+	}
+	r->dirty_entries.clear();
+
+	// Nothing on disk points to the old slots anymore
+	for (std::vector<std::pair<u32, u32> >::iterator
+			i = r->freed_on_sync.begin(); i != r->freed_on_sync.end(); ++i)
+		free_region_slot(r->free_slots, i->first, i->second);
+	r->freed_on_sync.clear();
+}
+
+void Database_Region::closeRegion(Region *r)
+{
+	syncRegion(r);
+#ifndef _WIN32
+	if (r->map)
+		munmap((void *) r->map, r->map_size);
+#endif
+	fclose(r->file);
+	delete r;
+}
+
+void Database_Region::beginSave() {}
+
+void Database_Region::endSave()
+{
+	// Make the batch durable
+	for (std::map<v3s16, Region*>::iterator i = m_regions.begin();
+			i != m_regions.end(); ++i)
+		syncRegion(i->second);
+}
+
+bool Database_Region::saveBlock(v3s16 blockpos, std::string &data)
+{
+	Region *r = getRegion(getContainerPos(blockpos, REGION_SIZE), true);
+	u32 index = get_region_index(blockpos);
+	Region::Entry e;
+	e.length = data.size();
+	e.capacity = MYMAX(1, (e.length + REGION_ALIGN - 1) / REGION_ALIGN)
+			* REGION_ALIGN;
+
+	// Never over the current data: take the first free slot that fits,
+	// or the end of the file
+	e.offset = 0;
+	for (std::map<u32, u32>::iterator i = r->free_slots.begin();
+			i != r->free_slots.end(); ++i) {
+		if (i->second < e.capacity)
+			continue;
+		e.offset = i->first;
+		if (i->second > e.capacity)
+			r->free_slots[i->first + e.capacity] = i->second - e.capacity;
+		r->free_slots.erase(i);
+		break;
+	}
+	if (e.offset == 0) {
+		e.offset = r->data_end;
+		r->data_end += e.capacity;
+	}
+
+	r->unflushed = r->unsynced = true;
+	if (fseek(r->file, e.offset, SEEK_SET) != 0 ||
+			fwrite(data.c_str(), 1, data.size(), r->file) != data.size()) {
+		errorstream << "WARNING: saveBlock: Writing block " << PP(blockpos)
+			<< " to its region file failed" << std::endl;
+		free_region_slot(r->free_slots, e.offset, e.capacity);
+		return false;
+	}
+
+	// The table on disk still points to the old slot until the next sync.
+	// A slot written since then isn't on disk, so it is free already.
+	const Region::Entry &old = r->entries[index];
+	if (old.offset != 0) {
+		if (r->dirty_entries.count(index))
+			free_region_slot(r->free_slots, old.offset, old.capacity);
+		else
+			r->freed_on_sync.push_back(
+					std::make_pair(old.offset, old.capacity));
+	}
+	r->entries[index] = e;
+	r->dirty_entries.insert(index);
+	return true;
+}
+
+std::string Database_Region::loadBlock(v3s16 blockpos)
+{
+	Region *r = getRegion(getContainerPos(blockpos, REGION_SIZE), false);
+	if (!r)
+		return "";
+	const Region::Entry &e = r->entries[get_region_index(blockpos)];
+	if (e.offset == 0)
+		return "";
+
+	if (r->unflushed) {
+		fflush(r->file);
+		r->unflushed = false;
+	}
+
+#ifndef _WIN32
+	// The file grows when blocks are moved to its end; map it again then
+	if (e.offset + e.length > r->map_size) {
+		if (r->map) {
+			munmap((void *) r->map, r->map_size);
+			r->map = NULL;
+			r->map_size = 0;
+		}
+		struct stat st;
+		if (fstat(fileno(r->file), &st) == 0 && st.st_size > 0) {
+			void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+					fileno(r->file), 0);
+			if (m != MAP_FAILED) {
+				r->map = (const char *) m;
+				r->map_size = st.st_size;
+			}
+		}
+		if (e.offset + e.length > r->map_size) {
+			errorstream << "Database_Region: Block " << PP(blockpos)
+				<< " is outside of its region file" << std::endl;
+			return "";
+		}
+	}
+	return std::string(r->map + e.offset, e.length);
+#else
+	std::string data(e.length, '\0');
+	if (fseek(r->file, e.offset, SEEK_SET) != 0 || (e.length != 0 &&
+			fread(&data[0], 1, e.length, r->file) != e.length)) {
+		errorstream << "Database_Region: Reading block " << PP(blockpos)
+			<< " failed" << std::endl;
+		return "";
+	}
+	return data;
+#endif
+}
+
+bool Database_Region::listLoadableBlocks(std::string &cursor, u32 max_count,
+		std::vector<v3s16> &dst)
+{
+	dst.clear();
+
+	// The cursor is "<region file name>:<next index>"
+	if (cursor == "end")
+		return false;
+	std::string start_name;
+	u32 start_index = 0;
+	if (!cursor.empty()) {
+		size_t colon = cursor.rfind(':');
+		start_name = cursor.substr(0, colon);
+		start_index = stoi(cursor.substr(colon + 1));
+	}
+
+	std::vector<std::string> names;
+	std::vector<fs::DirListNode> listing = fs::GetDirListing(m_dir);
+	for (std::vector<fs::DirListNode>::iterator i = listing.begin();
+			i != listing.end(); ++i)
+		if (!i->dir && i->name >= start_name)
+			names.push_back(i->name);
+	std::sort(names.begin(), names.end());
+
+	for (std::vector<std::string>::iterator i = names.begin();
+			i != names.end(); ++i) {
+		v3s16 rp;
+		int x, y, z;
+		char end;
+		if (sscanf(i->c_str(), "r.%d.%d.%d.mt%c", &x, &y, &z, &end) != 4 ||
+				end != 'r')
+			continue;
+		rp = v3s16(x, y, z);
+		Region *r = getRegion(rp, false);
+		if (!r)
+			continue;
+
+		u32 k = (*i == start_name) ? start_index : 0;
+		for (; k < REGION_BLOCKS; k++) {
+			if (r->entries[k].offset == 0)
+				continue;
+			if (dst.size() == max_count) {
+				cursor = *i + ":" + itos(k);
+				return true;
+			}
+			v3s16 rel(k % REGION_SIZE, (k / REGION_SIZE) % REGION_SIZE,
+					k / (REGION_SIZE * REGION_SIZE));
+			dst.push_back(rp * REGION_SIZE + rel);
+		}
+	}
+
+	cursor = "end";
+	return !dst.empty();
+}
+
+Database_Region::~Database_Region()
+{
+	for (std::map<v3s16, Region*>::iterator i = m_regions.begin();
+			i != m_regions.end(); ++i)
+		closeRegion(i->second);
+	m_regions.clear();
+}
@@ -0,0 +1,66 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DATABASE_REGION_HEADER
+#define DATABASE_REGION_HEADER
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include "database.h"
+#include "irrlichttypes.h"
+
+class ServerMap;
+
+/*
+	Stores blocks in region files of 16x16x16 blocks each, in the
+	"regions" directory of the world. See database-region.cpp for the
+	file format.
+*/
+class Database_Region : public Database
+{
+public:
+	Database_Region(ServerMap *map, std::string savedir);
+	virtual void beginSave();
+	virtual void endSave();
+	virtual bool saveBlock(v3s16 blockpos, std::string &data);
+	virtual std::string loadBlock(v3s16 blockpos);
+	virtual bool listLoadableBlocks(std::string &cursor, u32 max_count,
+			std::vector<v3s16> &dst);
+	virtual int Initialized(void);
+	~Database_Region();
+private:
+	struct Region;
+
+	Region *getRegion(v3s16 regionpos, bool create);
+	Region *openRegion(v3s16 regionpos, const std::string &path, bool create);
+	void closeRegion(Region *r);
+	void flushRegion(Region *r);
+	void syncRegion(Region *r);
+	std::string getRegionPath(v3s16 regionpos);
+
+	ServerMap *srvmap;
+	std::string m_dir;
+	// Open region files, at most REGION_MAX_OPEN
+	std::map<v3s16, Region*> m_regions;
+	u32 m_use_counter;
+};
+
+#endif
+
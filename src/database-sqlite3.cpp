@@ -32,11 +32,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		blocks
 			(PK) INT pos
 			BLOB data
+		players
+			(PK) TEXT name
+			BLOB data
 */
 
 
 #include "database-sqlite3.h"
 
+#include <climits>
+
 #include "map.h"
 #include "mapsector.h"
 #include "mapblock.h"
@@ -52,8 +57,21 @@ Database_SQLite3::Database_SQLite3(ServerMap *map, std::string savedir)
 	m_database_read = NULL;
 	m_database_write = NULL;
 	m_database_list = NULL;
+	m_database_player_read = NULL;
+	m_database_player_write = NULL;
+	m_database_reader = NULL;
 	m_savedir = savedir;
 	srvmap = map;
+
+#ifdef __ANDROID__
+	// saveBlock() needs to see its own uncommitted writes there
+	m_use_read_connection = false;
+#else
+	m_use_read_connection = g_settings->getBool("sqlite_wal");
+#endif
+	// Open it right away, as it is used from several threads then
+	if (m_use_read_connection)
+		verifyDatabase();
 }
 
 int Database_SQLite3::Initialized(void)
@@ -61,6 +79,11 @@ int Database_SQLite3::Initialized(void)
 	return m_database ? 1 : 0;
 }
 
+bool Database_SQLite3::canLoadWhileSaving()
+{
+	return m_use_read_connection;
+}
+
 void Database_SQLite3::beginSave() {
 	verifyDatabase();
 	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
@@ -83,6 +106,27 @@ void Database_SQLite3::createDirs(std::string path)
 	}
 }
 
+void Database_SQLite3::setPragmas(sqlite3 *db)
+{
+	std::string querystr = std::string("PRAGMA synchronous = ")
+			 + itos(g_settings->getU16("sqlite_synchronous"));
+	// Negative values are in KiB
+	u16 cache_size = g_settings->getU16("sqlite_cache_size");
+	if (cache_size != 0)
+		querystr += "; PRAGMA cache_size = -" + itos(cache_size);
+	// Ignored by SQLite versions older than 3.7.17
+	u16 mmap_size = g_settings->getU16("sqlite_mmap_size");
+	if (mmap_size != 0)
+		querystr += "; PRAGMA mmap_size = " + i64tos((s64)mmap_size * 1024 * 1024);
+
+	int d = sqlite3_exec(db, querystr.c_str(), NULL, NULL, NULL);
+	if(d != SQLITE_OK) {
+		errorstream<<"Database pragma set failed: "
+				<<sqlite3_errmsg(db)<<std::endl;
+		throw FileNotGoodException("Cannot set pragma");
+	}
+}
+
 void Database_SQLite3::verifyDatabase() {
 	if(m_database)
 		return;
@@ -107,18 +151,47 @@ void Database_SQLite3::verifyDatabase() {
 	if(needs_create)
 		createDatabase();
 
-	std::string querystr = std::string("PRAGMA synchronous = ")
-			 + itos(g_settings->getU16("sqlite_synchronous"));
-	d = sqlite3_exec(m_database, querystr.c_str(), NULL, NULL, NULL);
+	if (g_settings->getBool("sqlite_wal")) {
+		d = sqlite3_exec(m_database, "PRAGMA journal_mode = WAL",
+				NULL, NULL, NULL);
+		if(d != SQLITE_OK) {
+			errorstream<<"Database pragma set failed: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot set pragma");
+		}
+	}
+	setPragmas(m_database);
+
+	// Worlds created before players were stored here lack the table
+	d = sqlite3_exec(m_database,
+		"CREATE TABLE IF NOT EXISTS `players` ("
+			"`name` TEXT NOT NULL PRIMARY KEY,"
+			"`data` BLOB"
+		");"
+	, NULL, NULL, NULL);
 	if(d != SQLITE_OK) {
-		errorstream<<"Database pragma set failed: "
+		errorstream<<"SQLite3 players table failed to create: "
 				<<sqlite3_errmsg(m_database)<<std::endl;
-		throw FileNotGoodException("Cannot set pragma");
+		throw FileNotGoodException("Cannot create players table");
 	}
 
-	d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
+	m_database_reader = m_database;
+	if (m_use_read_connection) {
+		d = sqlite3_open_v2(dbp.c_str(), &m_database_reader,
+				SQLITE_OPEN_READWRITE, NULL);
+		if(d != SQLITE_OK) {
+			errorstream<<"SQLite3 database failed to open: "
+					<<sqlite3_errmsg(m_database_reader)<<std::endl;
+			throw FileNotGoodException("Cannot open database file");
+		}
+		// Checkpoints can lock out readers for a moment
+		sqlite3_busy_timeout(m_database_reader, 5000);
+		setPragmas(m_database_reader);
+	}
+
+	d = sqlite3_prepare(m_database_reader, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
 	if(d != SQLITE_OK) {
-		errorstream<<"SQLite3 read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		errorstream<<"SQLite3 read statment failed to prepare: "<<sqlite3_errmsg(m_database_reader)<<std::endl;
 		throw FileNotGoodException("Cannot prepare read statement");
 	}
 #ifdef __ANDROID__
@@ -139,12 +212,24 @@ void Database_SQLite3::verifyDatabase() {
 	}
 #endif
 
-	d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
+	d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks` WHERE `pos` > ? ORDER BY `pos` LIMIT ?", -1, &m_database_list, NULL);
 	if(d != SQLITE_OK) {
 		infostream<<"SQLite3 list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
 		throw FileNotGoodException("Cannot prepare read statement");
 	}
 
+	d = sqlite3_prepare(m_database_reader, "SELECT `data` FROM `players` WHERE `name`=? LIMIT 1", -1, &m_database_player_read, NULL);
+	if(d != SQLITE_OK) {
+		errorstream<<"SQLite3 player read statment failed to prepare: "<<sqlite3_errmsg(m_database_reader)<<std::endl;
+		throw FileNotGoodException("Cannot prepare player read statement");
+	}
+
+	d = sqlite3_prepare(m_database, "REPLACE INTO `players` VALUES(?, ?);", -1, &m_database_player_write, NULL);
+	if(d != SQLITE_OK) {
+		errorstream<<"SQLite3 player write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare player write statement");
+	}
+
 	infostream<<"ServerMap: SQLite3 database opened"<<std::endl;
 }
 
@@ -210,7 +295,7 @@ std::string Database_SQLite3::loadBlock(v3s16 blockpos)
 
 	if (sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK) {
 		errorstream << "Could not bind block position for load: "
-			<< sqlite3_errmsg(m_database)<<std::endl;
+			<< sqlite3_errmsg(m_database_reader)<<std::endl;
 	}
 
 	if (sqlite3_step(m_database_read) == SQLITE_ROW) {
@@ -232,6 +317,95 @@ std::string Database_SQLite3::loadBlock(v3s16 blockpos)
 	return "";
 }
 
+void Database_SQLite3::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::vector<std::string> &data)
+{
+	verifyDatabase();
+
+	// Read all of them in one transaction so that the database is only
+	// locked once
+	bool in_transaction = sqlite3_get_autocommit(m_database_reader) != 0 &&
+			sqlite3_exec(m_database_reader, "BEGIN;", NULL, NULL, NULL) == SQLITE_OK;
+
+	data.resize(blockpos.size());
+	for (size_t i = 0; i < blockpos.size(); i++)
+		data[i] = loadBlock(blockpos[i]);
+
+	if (in_transaction)
+		sqlite3_exec(m_database_reader, "COMMIT;", NULL, NULL, NULL);
+}
+
+bool Database_SQLite3::supportsPlayers()
+{
+	return true;
+}
+
+bool Database_SQLite3::savePlayer(const std::string &name,
+		const std::string &data)
+{
+	verifyDatabase();
+
+	if (sqlite3_bind_text(m_database_player_write, 1, name.c_str(), name.size(), NULL) != SQLITE_OK ||
+			sqlite3_bind_blob(m_database_player_write, 2, (void *) data.c_str(), data.size(), NULL) != SQLITE_OK) {
+		errorstream << "WARNING: savePlayer: Player failed to bind: "
+			<< name << ": " << sqlite3_errmsg(m_database) << std::endl;
+		sqlite3_reset(m_database_player_write);
+		return false;
+	}
+
+	if (sqlite3_step(m_database_player_write) != SQLITE_DONE) {
+		errorstream << "WARNING: savePlayer: Player failed to save "
+			<< name << ": " << sqlite3_errmsg(m_database) << std::endl;
+		sqlite3_reset(m_database_player_write);
+		return false;
+	}
+
+	sqlite3_reset(m_database_player_write);
+	return true;
+}
+
+void Database_SQLite3::listPlayers(std::vector<std::string> &dst)
+{
+	verifyDatabase();
+
+	// Only used when migrating, so not kept prepared
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare(m_database, "SELECT `name` FROM `players`", -1,
+			&stmt, NULL) != SQLITE_OK) {
+		errorstream << "SQLite3 player list statement failed to prepare: "
+			<< sqlite3_errmsg(m_database) << std::endl;
+		throw FileNotGoodException("Cannot prepare player list statement");
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *name = (const char *) sqlite3_column_text(stmt, 0);
+		if (name)
+			dst.push_back(name);
+	}
+	sqlite3_finalize(stmt);
+}
+
+std::string Database_SQLite3::loadPlayer(const std::string &name)
+{
+	verifyDatabase();
+
+	if (sqlite3_bind_text(m_database_player_read, 1, name.c_str(), name.size(), NULL) != SQLITE_OK) {
+		errorstream << "Could not bind player name for load: "
+			<< sqlite3_errmsg(m_database_reader)<<std::endl;
+		sqlite3_reset(m_database_player_read);
+		return "";
+	}
+
+	std::string s = "";
+	if (sqlite3_step(m_database_player_read) == SQLITE_ROW) {
+		const char *data = (const char *) sqlite3_column_blob(m_database_player_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_player_read, 0);
+		if(data)
+			s = std::string(data, len);
+	}
+	sqlite3_reset(m_database_player_read);
+	return s;
+}
+
 void Database_SQLite3::createDatabase()
 {
 	int e;
@@ -249,17 +423,33 @@ void Database_SQLite3::createDatabase()
 
 }
 
-void Database_SQLite3::listAllLoadableBlocks(std::list<v3s16> &dst)
+bool Database_SQLite3::listLoadableBlocks(std::string &cursor, u32 max_count,
+		std::vector<v3s16> &dst)
 {
 	verifyDatabase();
 
+	dst.clear();
+
+	// The cursor is the last listed position; `pos` is the primary key
+	sqlite3_int64 after = cursor.empty() ? LLONG_MIN : stoi64(cursor);
+	if (sqlite3_bind_int64(m_database_list, 1, after) != SQLITE_OK ||
+			sqlite3_bind_int(m_database_list, 2, max_count) != SQLITE_OK) {
+		errorstream << "Could not bind parameters for listing blocks: "
+			<< sqlite3_errmsg(m_database) << std::endl;
+		sqlite3_reset(m_database_list);
+		return false;
+	}
+
+	sqlite3_int64 block_i = after;
 	while(sqlite3_step(m_database_list) == SQLITE_ROW)
 	{
-		sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
-		v3s16 p = getIntegerAsBlock(block_i);
-		//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
-		dst.push_back(p);
+		block_i = sqlite3_column_int64(m_database_list, 0);
+		dst.push_back(getIntegerAsBlock(block_i));
 	}
+	sqlite3_reset(m_database_list);
+
+	cursor = i64tos(block_i);
+	return !dst.empty();
 }
 
 
@@ -277,7 +467,15 @@ Database_SQLite3::~Database_SQLite3()
 	FINALIZE_STATEMENT(m_database_read)
 	FINALIZE_STATEMENT(m_database_write)
 	FINALIZE_STATEMENT(m_database_list)
-
+	FINALIZE_STATEMENT(m_database_player_read)
+	FINALIZE_STATEMENT(m_database_player_write)
+
+	if(m_database_reader && m_database_reader != m_database) {
+		rc = sqlite3_close(m_database_reader);
+		if (rc != SQLITE_OK)
+			errorstream << "Database_SQLite3::~Database_SQLite3(): "
+					<< "Failed to close read connection: rc=" << rc << std::endl;
+	}
 	if(m_database)
 		rc = sqlite3_close(m_database);
 
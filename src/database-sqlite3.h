@@ -38,24 +38,39 @@ class Database_SQLite3 : public Database
 
 	virtual bool saveBlock(v3s16 blockpos, std::string &data);
 	virtual std::string loadBlock(v3s16 blockpos);
-	virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
+	virtual void loadBlocks(const std::vector<v3s16> &blockpos,
+			std::vector<std::string> &data);
+	virtual bool listLoadableBlocks(std::string &cursor, u32 max_count,
+			std::vector<v3s16> &dst);
+	virtual bool supportsPlayers();
+	virtual bool savePlayer(const std::string &name, const std::string &data);
+	virtual std::string loadPlayer(const std::string &name);
+	virtual void listPlayers(std::vector<std::string> &dst);
 	virtual int Initialized(void);
+	virtual bool canLoadWhileSaving();
 	~Database_SQLite3();
 private:
 	ServerMap *srvmap;
 	std::string m_savedir;
 	sqlite3 *m_database;
+	// In WAL mode blocks are read through a connection of their own, so
+	// that loads don't wait for saves; otherwise this is m_database
+	bool m_use_read_connection;
+	sqlite3 *m_database_reader;
 	sqlite3_stmt *m_database_read;
 	sqlite3_stmt *m_database_write;
 #ifdef __ANDROID__
 	sqlite3_stmt *m_database_delete;
 #endif
 	sqlite3_stmt *m_database_list;
+	sqlite3_stmt *m_database_player_read;
+	sqlite3_stmt *m_database_player_write;
 
 	// Create the database structure
 	void createDatabase();
 	// Verify we can read/write to the database
 	void verifyDatabase();
+	void setPragmas(sqlite3 *db);
 	void createDirs(std::string path);
 };
 
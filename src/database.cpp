@@ -67,3 +67,21 @@ v3s16 Database::getIntegerAsBlock(s64 i) const
 	return pos;
 }
 
+
+void Database::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::vector<std::string> &data)
+{
+	data.resize(blockpos.size());
+	for (size_t i = 0; i < blockpos.size(); i++)
+		data[i] = loadBlock(blockpos[i]);
+}
+
+
+void Database::listAllLoadableBlocks(std::list<v3s16> &dst)
+{
+	std::string cursor;
+	std::vector<v3s16> chunk;
+	while (listLoadableBlocks(cursor, 1000, chunk))
+		dst.insert(dst.end(), chunk.begin(), chunk.end());
+}
+
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <list>
 #include <string>
+#include <vector>
 #include "irr_v3d.h"
 #include "irrlichttypes.h"
 
@@ -37,10 +38,37 @@ class Database
 
 	virtual bool saveBlock(v3s16 blockpos, std::string &data) = 0;
 	virtual std::string loadBlock(v3s16 blockpos) = 0;
+	// Loads several blocks at once; data[i] is set to the data of
+	// blockpos[i] or to "" if it isn't found
+	virtual void loadBlocks(const std::vector<v3s16> &blockpos,
+			std::vector<std::string> &data);
 	s64 getBlockAsInteger(const v3s16 pos) const;
 	v3s16 getIntegerAsBlock(s64 i) const;
-	virtual void listAllLoadableBlocks(std::list<v3s16> &dst) = 0;
+	/*
+		Lists the stored blocks a chunk at a time. cursor is empty at the
+		start and is updated by each call; dst is replaced by up to
+		max_count positions. Returns false once all blocks have been
+		listed. Blocks saved in between may or may not be listed.
+	*/
+	virtual bool listLoadableBlocks(std::string &cursor, u32 max_count,
+			std::vector<v3s16> &dst) = 0;
+	// Lists all blocks at once; avoid on big worlds
+	void listAllLoadableBlocks(std::list<v3s16> &dst);
+
+	/*
+		Player data, keyed by player name. Only used if supportsPlayers()
+		returns true; players are stored in files otherwise.
+		loadPlayer() returns "" if the player isn't stored.
+	*/
+	virtual bool supportsPlayers() { return false; }
+	virtual bool savePlayer(const std::string &name, const std::string &data)
+			{ return false; }
+	virtual std::string loadPlayer(const std::string &name) { return ""; }
+	virtual void listPlayers(std::vector<std::string> &dst) {}
 	virtual int Initialized(void)=0;
+	// Returns true if loadBlock() and loadBlocks() may be called from
+	// another thread while a save or listing is in progress
+	virtual bool canLoadWhileSaving() { return false; }
 	virtual ~Database() {};
 };
 #endif
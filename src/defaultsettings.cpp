@@ -101,6 +101,9 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("address", "");
 	settings->setDefault("random_input", "false");
 	settings->setDefault("client_unload_unused_data_timeout", "600");
+	settings->setDefault("client_map_memory_limit", "0");
+	settings->setDefault("object_animation_lod_range", "32");
+	settings->setDefault("object_static_range", "80");
 	settings->setDefault("enable_fog", "true");
 	settings->setDefault("fov", "72");
 	settings->setDefault("view_bobbing", "true");
@@ -134,16 +137,21 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("mouse_sensitivity", "0.2");
 	settings->setDefault("enable_sound", "true");
 	settings->setDefault("sound_volume", "0.8");
+	settings->setDefault("sound_stream_min_length", "10");
+	settings->setDefault("sound_buffer_cache_size", "64");
 	settings->setDefault("desynchronize_mapblock_texture_animation", "true");
+	settings->setDefault("shader_texture_animation", "false");
 	settings->setDefault("selectionbox_width","2");
 	settings->setDefault("hud_hotbar_max_width","1.0");
 	settings->setDefault("enable_local_map_saving", "false");
+	settings->setDefault("enable_block_cache", "false");
 
 	settings->setDefault("mip_map", "false");
 	settings->setDefault("anisotropic_filter", "false");
 	settings->setDefault("bilinear_filter", "false");
 	settings->setDefault("trilinear_filter", "false");
 	settings->setDefault("preload_item_visuals", "false");
+	settings->setDefault("enable_texture_cache", "true");
 	settings->setDefault("enable_bumpmapping", "false");
 	settings->setDefault("enable_parallax_occlusion", "false");
 	settings->setDefault("generate_normalmaps", "false");
@@ -161,6 +169,12 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("repeat_rightclick_time", "0.25");
 	settings->setDefault("enable_particles", "true");
 	settings->setDefault("enable_mesh_cache", "true");
+	settings->setDefault("merge_faces", "true");
+	settings->setDefault("enable_occlusion_queries", "false");
+	settings->setDefault("mesh_lod_distance", "0");
+	settings->setDefault("super_chunk_size", "0");
+	settings->setDefault("enable_vbo", "true");
+	settings->setDefault("enable_texture_atlas", "false");
 
 	settings->setDefault("curl_timeout", "5000");
 	settings->setDefault("curl_parallel_limit", "8");
@@ -210,6 +224,7 @@ void set_default_settings(Settings *settings)
 	// "map-dir" doesn't exist by default.
 	settings->setDefault("workaround_window_size","5");
 	settings->setDefault("max_packets_per_iteration","1024");
+	settings->setDefault("bulk_packet_share", "0.5");
 	settings->setDefault("port", "30000");
 	settings->setDefault("bind_address", "");
 	settings->setDefault("default_game", "minetest");
@@ -227,30 +242,56 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("disallow_empty_password", "false");
 	settings->setDefault("disable_anticheat", "false");
 	settings->setDefault("enable_rollback_recording", "false");
+	settings->setDefault("rollback_max_age_days", "0");
 #ifdef NDEBUG
 	settings->setDefault("deprecated_lua_api_handling", "legacy");
 #else
 	settings->setDefault("deprecated_lua_api_handling", "log");
 #endif
+	settings->setDefault("script_bytecode_cache", "false");
 
 	settings->setDefault("profiler_print_interval", "0");
+	settings->setDefault("profiler_trace", "false");
+	settings->setDefault("profiler_trace_events_per_thread", "100000");
+	settings->setDefault("slow_step_threshold", "0");
 	settings->setDefault("enable_mapgen_debug_info", "false");
 	settings->setDefault("active_object_send_range_blocks", "3");
 	settings->setDefault("active_block_range", "2");
+	settings->setDefault("abm_time_budget", "0");
+	settings->setDefault("object_activation_time_budget", "10");
 	//settings->setDefault("max_simultaneous_block_sends_per_client", "1");
 	// This causes frametime jitter on client side, or does it?
 	settings->setDefault("max_simultaneous_block_sends_per_client", "10");
 	settings->setDefault("max_simultaneous_block_sends_server_total", "40");
+	settings->setDefault("max_block_send_budget", "40");
+	settings->setDefault("block_send_bandwidth", "0");
 	settings->setDefault("max_block_send_distance", "9");
 	settings->setDefault("max_block_generate_distance", "7");
 	settings->setDefault("max_clearobjects_extra_loaded_blocks", "4096");
+	settings->setDefault("max_forceloaded_lite_blocks", "256");
+	settings->setDefault("max_forceloaded_blocks_per_mod", "0");
+	settings->setDefault("clearobjects_time_budget", "20");
 	settings->setDefault("time_send_interval", "5");
 	settings->setDefault("time_speed", "72");
 	settings->setDefault("year_days", "30");
 	settings->setDefault("server_unload_unused_data_timeout", "29");
+	settings->setDefault("max_loaded_blocks", "0");
+	settings->setDefault("map_compression_level_disk", "-1");
+	settings->setDefault("map_compression_level_net", "-1");
 	settings->setDefault("max_objects_per_block", "49");
 	settings->setDefault("server_map_save_interval", "5.3");
+	settings->setDefault("metrics_interval", "0");
+	settings->setDefault("memory_stats_interval", "0");
+	settings->setDefault("lua_gc_step_budget", "0");
+	settings->setDefault("lua_gc_memory_limit", "256");
+	settings->setDefault("packet_trace_path", "");
 	settings->setDefault("sqlite_synchronous", "2");
+	settings->setDefault("sqlite_wal", "false");
+	settings->setDefault("sqlite_cache_size", "0");
+	settings->setDefault("sqlite_mmap_size", "0");
+	settings->setDefault("serialized_block_cache_size", "32");
+	settings->setDefault("leveldb_cache_size", "8");
+	settings->setDefault("leveldb_write_buffer_size", "4");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.1");
 	settings->setDefault("ignore_world_load_errors", "false");
@@ -260,6 +301,13 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("emergequeue_limit_diskonly", "32");
 	settings->setDefault("emergequeue_limit_generate", "32");
 	settings->setDefault("num_emerge_threads", "1");
+	settings->setDefault("worker_thread_affinity", "false");
+	settings->setDefault("server_async_threads", "2");
+	settings->setDefault("pregen_chunks_per_second", "4");
+	settings->setDefault("pregen_chunks_per_second_with_players", "0");
+	settings->setDefault("pregen_unload_timeout", "5");
+	settings->setDefault("pathfinder_cache_ttl", "5");
+	settings->setDefault("pathfinder_hierarchical_distance", "48");
 
 	// physics stuff
 	settings->setDefault("movement_acceleration_default", "3");
@@ -277,6 +325,7 @@ void set_default_settings(Settings *settings)
 
 	//liquid stuff
 	settings->setDefault("liquid_loop_max", "10000");
+	settings->setDefault("liquid_step_max_time", "0.05");
 	settings->setDefault("liquid_update", "1.0");
 
 	//mapgen stuff
@@ -315,6 +364,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("emergequeue_limit_diskonly", "8");
 	settings->setDefault("emergequeue_limit_generate", "8");
 	settings->setDefault("preload_item_visuals", "false");
+	settings->setDefault("client_map_memory_limit", "256");
 
 	settings->setDefault("viewing_range_nodes_max", "50");
 	settings->setDefault("viewing_range_nodes_min", "20");
@@ -69,6 +69,7 @@ DungeonGen::DungeonGen(Mapgen *mapgen, DungeonParams *dparams) {
 
 
 void DungeonGen::generate(u32 bseed, v3s16 nmin, v3s16 nmax) {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen dungeons", SPT_AVG);
 	//TimeTaker t("gen dungeons");
 	int approx_groundlevel = 10 + mg->water_level;
 
@@ -327,35 +328,33 @@ void DungeonGen::makeRoom(v3s16 roomsize, v3s16 roomplace)
 	}
 
 	// Fill with air
-	for (s16 z = 1; z < roomsize.Z - 1; z++)
-	for (s16 y = 1; y < roomsize.Y - 1; y++)
-	for (s16 x = 1; x < roomsize.X - 1; x++)
-	{
-		v3s16 p = roomplace + v3s16(x, y, z);
-		if (vm->m_area.contains(p) == false)
-			continue;
-		u32 vi = vm->m_area.index(p);
-		vm->m_flags[vi] |= VMANIP_FLAG_DUNGEON_UNTOUCHABLE;
-		vm->m_data[vi]   = n_air;
-	}
+	makeFill(roomplace + v3s16(1, 1, 1), roomsize - v3s16(2, 2, 2), 0,
+		n_air, VMANIP_FLAG_DUNGEON_UNTOUCHABLE);
 }
 
 
 void DungeonGen::makeFill(v3s16 place, v3s16 size,
 		u8 avoid_flags, MapNode n, u8 or_flags)
 {
-	for (s16 z = 0; z < size.Z; z++)
-	for (s16 y = 0; y < size.Y; y++)
-	for (s16 x = 0; x < size.X; x++)
-	{
-		v3s16 p = place + v3s16(x, y, z);
-		if (vm->m_area.contains(p) == false)
-			continue;
-		u32 vi = vm->m_area.index(p);
-		if (vm->m_flags[vi] & avoid_flags)
-			continue;
-		vm->m_flags[vi] |= or_flags;
-		vm->m_data[vi]   = n;
+	// Clip the box to the area once and fill it a row at a time
+	v3s16 pmin = place;
+	v3s16 pmax = place + size - v3s16(1, 1, 1);
+	pmin.X = MYMAX(pmin.X, vm->m_area.MinEdge.X);
+	pmin.Y = MYMAX(pmin.Y, vm->m_area.MinEdge.Y);
+	pmin.Z = MYMAX(pmin.Z, vm->m_area.MinEdge.Z);
+	pmax.X = MYMIN(pmax.X, vm->m_area.MaxEdge.X);
+	pmax.Y = MYMIN(pmax.Y, vm->m_area.MaxEdge.Y);
+	pmax.Z = MYMIN(pmax.Z, vm->m_area.MaxEdge.Z);
+
+	for (s16 z = pmin.Z; z <= pmax.Z; z++)
+	for (s16 y = pmin.Y; y <= pmax.Y; y++) {
+		u32 vi = vm->m_area.index(pmin.X, y, z);
+		for (s16 x = pmin.X; x <= pmax.X; x++, vi++) {
+			if (vm->m_flags[vi] & avoid_flags)
+				continue;
+			vm->m_flags[vi] |= or_flags;
+			vm->m_data[vi]   = n;
+		}
 	}
 }
 
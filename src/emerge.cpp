@@ -23,6 +23,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "server.h"
 #include <iostream>
 #include <queue>
+#include <deque>
+#include <set>
+#include <cstring>
 #include "jthread/jevent.h"
 #include "map.h"
 #include "environment.h"
@@ -39,6 +42,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "profiler.h"
 #include "log.h"
 #include "nodedef.h"
+#include "noise.h"
 #include "mg_biome.h"
 #include "mg_ore.h"
 #include "mg_decoration.h"
@@ -48,6 +52,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapgen_v7.h"
 #include "mapgen_singlenode.h"
 
+// Number of queued emerges whose blocks are loaded with one database query
+#define EMERGE_LOAD_BATCH_SIZE 16
+
+// Number of 2D noise maps kept in the noise map cache; one map of an
+// 80x80 mapchunk takes 25 KiB
+#define NOISE_MAP_CACHE_SIZE 256
+
+// Number of block columns whose ground level bounds are remembered
+#define GROUND_BOUNDS_CACHE_SIZE 4096
+
 
 class EmergeThread : public JThread
 {
@@ -59,8 +73,22 @@ class EmergeThread : public JThread
 	bool enable_mapgen_debug_info;
 	int id;
 
+	struct QueuedEmerge
+	{
+		v3s16 pos;
+		// Set if the block has been looked up on disk and wasn't found
+		bool disk_checked;
+	};
+
 	Event qevent;
-	std::queue<v3s16> blockqueue;
+	// Taken from the front by this thread and from the back by idle
+	// threads that steal work; protected by EmergeManager::queuemutex
+	std::deque<QueuedEmerge> blockqueue;
+	// Set while the thread waits for work; protected by queuemutex
+	bool idle;
+	// Bytes taken by the VoxelManipulator of the chunk being generated;
+	// protected by queuemutex
+	u32 vmanip_bytes;
 
 	EmergeThread(Server *server, int ethreadid):
 		JThread(),
@@ -69,17 +97,163 @@ class EmergeThread : public JThread
 		emerge(NULL),
 		mapgen(NULL),
 		enable_mapgen_debug_info(false),
-		id(ethreadid)
+		id(ethreadid),
+		idle(false),
+		vmanip_bytes(0)
 	{
 	}
 
+	struct BatchedEmerge
+	{
+		v3s16 pos;
+		u8 flags;
+		u16 peer_requested;
+		// Set if the block has been looked up on disk and wasn't found
+		bool disk_checked;
+	};
+
 	void *Thread();
-	bool popBlockEmerge(v3s16 *pos, u8 *flags);
+	void setVManipBytes(u32 bytes)
+	{
+		JMutexAutoLock queuelock(emerge->queuemutex);
+		vmanip_bytes = bytes;
+	}
+	bool popBlockEmerge(BatchedEmerge *e);
+	void stealBlockEmerges();
+	void popBlockEmerges(std::deque<BatchedEmerge> &batch, u32 max_count);
+	void returnBlockEmerges(std::deque<BatchedEmerge> &batch);
+	void findBlocksToLoad(std::deque<BatchedEmerge> &batch,
+			std::vector<v3s16> &to_load,
+			std::vector<BatchedEmerge *> &loading);
+	void loadBatchFromDisk(std::deque<BatchedEmerge> &batch);
 	bool getBlockOrStartGen(v3s16 p, MapBlock **b,
-			BlockMakeData *data, bool allow_generate);
+			BlockMakeData *data, bool allow_generate, bool disk_checked);
+	void runMapgenStages(BlockMakeData *data);
 };
 
 
+/////////////////////////////// Noise Map Cache ///////////////////////////////
+
+NoiseMapCache::Key::Key(Noise *noise, float x_, float y_) {
+	spread  = noise->np->spread;
+	seed    = noise->seed + noise->np->seed;
+	octaves = noise->np->octaves;
+	persist = noise->np->persist;
+	sx      = noise->sx;
+	sy      = noise->sy;
+	x       = x_;
+	y       = y_;
+}
+
+
+bool NoiseMapCache::Key::operator<(const Key &other) const {
+	if (x != other.x)
+		return x < other.x;
+	if (y != other.y)
+		return y < other.y;
+	if (seed != other.seed)
+		return seed < other.seed;
+	if (sx != other.sx)
+		return sx < other.sx;
+	if (sy != other.sy)
+		return sy < other.sy;
+	if (octaves != other.octaves)
+		return octaves < other.octaves;
+	if (persist != other.persist)
+		return persist < other.persist;
+	if (spread.X != other.spread.X)
+		return spread.X < other.spread.X;
+	if (spread.Y != other.spread.Y)
+		return spread.Y < other.spread.Y;
+	return spread.Z < other.spread.Z;
+}
+
+
+NoiseMapCache::NoiseMapCache(u32 max_maps) {
+	m_max_maps    = max_maps;
+	m_use_counter = 0;
+}
+
+
+NoiseMapCache::~NoiseMapCache() {
+	std::map<Key, Entry>::iterator it;
+	for (it = m_maps.begin(); it != m_maps.end(); ++it)
+		delete[] it->second.data;
+}
+
+
+float *NoiseMapCache::perlinMap2D(Noise *noise, float x, float y) {
+	Key key(noise, x, y);
+	size_t bufsize = noise->sx * noise->sy;
+
+	{
+		JMutexAutoLock lock(m_mutex);
+		std::map<Key, Entry>::iterator it = m_maps.find(key);
+		if (it != m_maps.end()) {
+			it->second.last_used = ++m_use_counter;
+			memcpy(noise->result, it->second.data, sizeof(float) * bufsize);
+			return noise->result;
+		}
+	}
+
+	// Another thread might be making the same map meanwhile; that only
+	// costs the time it would have taken without the cache
+	noise->perlinMap2D(x, y);
+
+	float *data = new float[bufsize];
+	memcpy(data, noise->result, sizeof(float) * bufsize);
+
+	JMutexAutoLock lock(m_mutex);
+	std::pair<std::map<Key, Entry>::iterator, bool> ins =
+		m_maps.insert(std::make_pair(key, Entry()));
+	if (!ins.second) {
+		delete[] data;
+		return noise->result;
+	}
+	ins.first->second.data      = data;
+	ins.first->second.size      = bufsize;
+	ins.first->second.last_used = ++m_use_counter;
+
+	if (m_maps.size() > m_max_maps) {
+		std::map<Key, Entry>::iterator it, oldest = m_maps.begin();
+		for (it = m_maps.begin(); it != m_maps.end(); ++it) {
+			if (it->second.last_used < oldest->second.last_used)
+				oldest = it;
+		}
+		delete[] oldest->second.data;
+		m_maps.erase(oldest);
+	}
+
+	return noise->result;
+}
+
+
+bool NoiseMapCache::getPoint(Noise *noise, float x, float y, int i, int j,
+		float *value) {
+	if (i < 0 || i >= noise->sx || j < 0 || j >= noise->sy)
+		return false;
+
+	JMutexAutoLock lock(m_mutex);
+	std::map<Key, Entry>::iterator it = m_maps.find(Key(noise, x, y));
+	if (it == m_maps.end())
+		return false;
+
+	it->second.last_used = ++m_use_counter;
+	*value = it->second.data[j * noise->sx + i];
+	return true;
+}
+
+
+u64 NoiseMapCache::getMemoryUsage() {
+	JMutexAutoLock lock(m_mutex);
+	u64 size = 0;
+	std::map<Key, Entry>::iterator it;
+	for (it = m_maps.begin(); it != m_maps.end(); ++it)
+		size += sizeof(Key) + sizeof(Entry) + sizeof(float) * it->second.size;
+	return size;
+}
+
+
 /////////////////////////////// Emerge Manager ////////////////////////////////
 
 EmergeManager::EmergeManager(IGameDef *gamedef) {
@@ -94,6 +268,7 @@ EmergeManager::EmergeManager(IGameDef *gamedef) {
 	this->oremgr    = new OreManager(gamedef);
 	this->decomgr   = new DecorationManager(gamedef);
 	this->schemmgr  = new SchematicManager(gamedef);
+	this->noisecache = new NoiseMapCache(NOISE_MAP_CACHE_SIZE);
 	this->gennotify = 0;
 
 	// Note that accesses to this variable are not synchronized.
@@ -154,6 +329,7 @@ EmergeManager::~EmergeManager() {
 	delete oremgr;
 	delete decomgr;
 	delete schemmgr;
+	delete noisecache;
 
 	if (params.sparams) {
 		delete params.sparams;
@@ -188,6 +364,9 @@ void EmergeManager::initMapgens() {
 		params.sparams->readParams(g_settings);
 	}
 
+	// Biomes are registered by now
+	biomemgr->updateLookup();
+
 	// Create the mapgens
 	for (size_t i = 0; i != emergethread.size(); i++) {
 		Mapgen *mg = createMapgen(params.mg_name, i, &params);
@@ -272,17 +451,24 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 
 		peer_queue_count[peer_id] = count + 1;
 
-		// insert into the EmergeThread queue with the least items
+		// insert into the queue of an idle EmergeThread, or else the one
+		// with the least items; idle threads steal the rest later
 		int lowestitems = emergethread[0]->blockqueue.size();
 		for (unsigned int i = 1; i != emergethread.size(); i++) {
+			if (emergethread[idx]->idle)
+				break;
 			int nitems = emergethread[i]->blockqueue.size();
-			if (nitems < lowestitems) {
+			if (emergethread[i]->idle || nitems < lowestitems) {
 				idx = i;
 				lowestitems = nitems;
 			}
 		}
 
-		emergethread[idx]->blockqueue.push(p);
+		EmergeThread::QueuedEmerge q;
+		q.pos = p;
+		q.disk_checked = false;
+		emergethread[idx]->blockqueue.push_back(q);
+		emergethread[idx]->idle = false;
 	}
 	emergethread[idx]->qevent.signal();
 
@@ -290,6 +476,108 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 }
 
 
+void EmergeManager::updatePeerPosition(u16 peer_id, v3s16 blockpos,
+		s16 max_d) {
+	JMutexAutoLock queuelock(queuemutex);
+	// This is called for every block send step; the requests only go out
+	// of range when the peer moves to another block
+	std::map<u16, v3s16>::iterator i = peer_positions.find(peer_id);
+	if (i != peer_positions.end() && i->second == blockpos)
+		return;
+	peer_positions[peer_id] = blockpos;
+	cancelEmerges(peer_id, false, blockpos, max_d);
+}
+
+
+void EmergeManager::cancelPeerEmerges(u16 peer_id) {
+	JMutexAutoLock queuelock(queuemutex);
+	cancelEmerges(peer_id, true, v3s16(0,0,0), 0);
+	peer_positions.erase(peer_id);
+	peer_queue_count.erase(peer_id);
+}
+
+
+u16 EmergeManager::getPeerQueueCount(u16 peer_id) {
+	JMutexAutoLock queuelock(queuemutex);
+	std::map<u16, u16>::const_iterator i = peer_queue_count.find(peer_id);
+	return i == peer_queue_count.end() ? 0 : i->second;
+}
+
+
+void EmergeManager::getQueueLengths(std::vector<u32> &lengths) {
+	JMutexAutoLock queuelock(queuemutex);
+	lengths.clear();
+	for (u32 i = 0; i != emergethread.size(); i++)
+		lengths.push_back(emergethread[i]->blockqueue.size());
+}
+
+
+u64 EmergeManager::getVManipMemoryUsage() {
+	JMutexAutoLock queuelock(queuemutex);
+	u64 size = 0;
+	for (u32 i = 0; i != emergethread.size(); i++)
+		size += emergethread[i]->vmanip_bytes;
+	return size;
+}
+
+
+u64 EmergeManager::getCacheMemoryUsage() {
+	u64 size = noisecache->getMemoryUsage();
+	JMutexAutoLock lock(ground_bounds_mutex);
+	return size + ground_bounds.size() *
+		(sizeof(v2s16) + sizeof(std::pair<s16, s16>));
+}
+
+
+s32 EmergeManager::getEmergeDistance(v3s16 p, u16 peer_id) {
+	std::map<u16, v3s16>::const_iterator i = peer_positions.find(peer_id);
+	// Requests not made for a player, like those of the server itself,
+	// go first
+	if (i == peer_positions.end())
+		return 0;
+	v3s16 d = p - i->second;
+	return MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z));
+}
+
+
+void EmergeManager::cancelEmerges(u16 peer_id, bool all, v3s16 blockpos,
+		s16 max_d) {
+	std::set<v3s16> cancelled;
+	for (std::map<v3s16, BlockEmergeData *>::iterator
+			i = blocks_enqueued.begin(); i != blocks_enqueued.end();) {
+		BlockEmergeData *bedata = i->second;
+		v3s16 d = i->first - blockpos;
+		if (bedata->peer_requested != peer_id || !(all ||
+				MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z)) > max_d)) {
+			++i;
+			continue;
+		}
+		cancelled.insert(i->first);
+		peer_queue_count[peer_id]--;
+		delete bedata;
+		blocks_enqueued.erase(i++);
+	}
+
+	if (cancelled.empty())
+		return;
+
+	for (size_t t = 0; t != emergethread.size(); t++) {
+		std::deque<EmergeThread::QueuedEmerge> &q = emergethread[t]->blockqueue;
+		for (std::deque<EmergeThread::QueuedEmerge>::iterator i = q.begin();
+				i != q.end();) {
+			if (cancelled.count(i->pos))
+				i = q.erase(i);
+			else
+				++i;
+		}
+	}
+
+	if (mapgen_debug_info)
+		infostream << "EmergeManager: cancelled " << cancelled.size()
+			<< " requests of peer " << peer_id << std::endl;
+}
+
+
 int EmergeManager::getGroundLevelAtPoint(v2s16 p) {
 	if (mapgen.size() == 0 || !mapgen[0]) {
 		errorstream << "EmergeManager: getGroundLevelAtPoint() called"
@@ -301,17 +589,43 @@ int EmergeManager::getGroundLevelAtPoint(v2s16 p) {
 }
 
 
-bool EmergeManager::isBlockUnderground(v3s16 blockpos) {
-	/*
-	v2s16 p = v2s16((blockpos.X * MAP_BLOCKSIZE) + MAP_BLOCKSIZE / 2,
-					(blockpos.Y * MAP_BLOCKSIZE) + MAP_BLOCKSIZE / 2);
-	int ground_level = getGroundLevelAtPoint(p);
-	return blockpos.Y * (MAP_BLOCKSIZE + 1) <= min(water_level, ground_level);
-	*/
+bool EmergeManager::getGroundLevelBounds(v2s16 blockpos_2d,
+		s16 *min_y, s16 *max_y) {
+	if (mapgen.size() == 0 || !mapgen[0])
+		return false;
+
+	{
+		JMutexAutoLock lock(ground_bounds_mutex);
+		std::map<v2s16, std::pair<s16, s16> >::iterator it =
+			ground_bounds.find(blockpos_2d);
+		if (it != ground_bounds.end()) {
+			*min_y = it->second.first;
+			*max_y = it->second.second;
+			return true;
+		}
+	}
+
+	if (!mapgen[0]->getGroundLevelBounds(blockpos_2d, min_y, max_y))
+		return false;
+
+	JMutexAutoLock lock(ground_bounds_mutex);
+	if (ground_bounds.size() >= GROUND_BOUNDS_CACHE_SIZE)
+		ground_bounds.clear();
+	ground_bounds[blockpos_2d] = std::make_pair(*min_y, *max_y);
+	return true;
+}
 
-	//yuck, but then again, should i bother being accurate?
-	//the height of the nodes in a single block is quite variable
-	return blockpos.Y * (MAP_BLOCKSIZE + 1) <= params.water_level;
+
+bool EmergeManager::isBlockUnderground(v3s16 blockpos) {
+	s16 top_y = blockpos.Y * MAP_BLOCKSIZE + MAP_BLOCKSIZE - 1;
+	if (top_y <= params.water_level)
+		return true;
+
+	// Below the lowest stone surface of the column there's only ground,
+	// whatever the shape of the terrain above
+	s16 ground_min, ground_max;
+	return getGroundLevelBounds(v2s16(blockpos.X, blockpos.Z),
+		&ground_min, &ground_max) && top_y < ground_min;
 }
 
 
@@ -323,6 +637,31 @@ u32 EmergeManager::getBlockSeed(v3s16 p) {
 }
 
 
+v2s16 EmergeManager::getChunkNodeMin(v2s16 p) {
+	s16 chunksize = params.chunksize;
+	s16 coffset   = -chunksize / 2;
+	v2s16 blockpos = getContainerPos(p, MAP_BLOCKSIZE);
+	v2s16 chunkpos = getContainerPos(blockpos - v2s16(coffset, coffset),
+		chunksize);
+	return (chunkpos * chunksize + v2s16(coffset, coffset)) * MAP_BLOCKSIZE;
+}
+
+
+float EmergeManager::getNoise2DAtPoint(Noise *noise, v2s16 p,
+		double xoff, double zoff) {
+	v2s16 nmin = getChunkNodeMin(p);
+	float value;
+	if (noisecache->getPoint(noise,
+			nmin.X + xoff * noise->np->spread.X,
+			nmin.Y + zoff * noise->np->spread.Z,
+			p.X - nmin.X, p.Y - nmin.Y, &value))
+		return value;
+
+	return NoisePerlin2DNoTxfmPosOffset(noise->np,
+		p.X, xoff, p.Y, zoff, noise->seed);
+}
+
+
 Mapgen *EmergeManager::createMapgen(std::string mgname, int mgid,
 									 MapgenParams *mgparams) {
 	std::map<std::string, MapgenFactory *>::const_iterator iter;
@@ -391,23 +730,45 @@ void EmergeManager::registerMapgen(std::string mgname, MapgenFactory *mgfactory)
 
 ////////////////////////////// Emerge Thread //////////////////////////////////
 
-bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
+bool EmergeThread::popBlockEmerge(BatchedEmerge *e) {
 	std::map<v3s16, BlockEmergeData *>::iterator iter;
 	JMutexAutoLock queuelock(emerge->queuemutex);
 
 	if (blockqueue.empty())
 		return false;
-	v3s16 p = blockqueue.front();
-	blockqueue.pop();
-
-	*pos = p;
 
-	iter = emerge->blocks_enqueued.find(p);
-	if (iter == emerge->blocks_enqueued.end())
+	/*
+		Take the block nearest to the player that requested it, as it
+		is now; of equally near ones the oldest request
+	*/
+	std::deque<QueuedEmerge>::iterator best = blockqueue.end();
+	s32 best_d = 0;
+	for (std::deque<QueuedEmerge>::iterator i = blockqueue.begin();
+			i != blockqueue.end(); ++i) {
+		iter = emerge->blocks_enqueued.find(i->pos);
+		if (iter == emerge->blocks_enqueued.end())
+			continue;
+		s32 d = emerge->getEmergeDistance(i->pos,
+				iter->second->peer_requested);
+		if (best == blockqueue.end() || d < best_d) {
+			best = i;
+			best_d = d;
+		}
+	}
+	if (best == blockqueue.end()) {
+		blockqueue.clear();
 		return false; //uh oh, queue and map out of sync!!
+	}
+
+	v3s16 p = best->pos;
+	e->pos = p;
+	e->disk_checked = best->disk_checked;
+	blockqueue.erase(best);
 
+	iter = emerge->blocks_enqueued.find(p);
 	BlockEmergeData *bedata = iter->second;
-	*flags = bedata->flags;
+	e->flags = bedata->flags;
+	e->peer_requested = bedata->peer_requested;
 
 	emerge->peer_queue_count[bedata->peer_requested]--;
 
@@ -418,11 +779,186 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
 }
 
 
+/*
+	Moves half of the longest queue of the other threads to this one's.
+	The owner keeps working from the front, so the oldest requests stay
+	with it.
+*/
+void EmergeThread::stealBlockEmerges() {
+	JMutexAutoLock queuelock(emerge->queuemutex);
+
+	if (!blockqueue.empty())
+		return;
+
+	EmergeThread *victim = NULL;
+	for (size_t i = 0; i != emerge->emergethread.size(); i++) {
+		EmergeThread *t = emerge->emergethread[i];
+		if (t != this && t->blockqueue.size() > 0 &&
+				(!victim || t->blockqueue.size() > victim->blockqueue.size()))
+			victim = t;
+	}
+	if (!victim)
+		return;
+
+	size_t nsteal = (victim->blockqueue.size() + 1) / 2;
+	blockqueue.insert(blockqueue.end(),
+			victim->blockqueue.end() - nsteal, victim->blockqueue.end());
+	victim->blockqueue.erase(victim->blockqueue.end() - nsteal,
+			victim->blockqueue.end());
+
+	EMERGE_DBG_OUT("stole " << nsteal << " blocks from thread " << victim->id);
+}
+
+
+void EmergeThread::popBlockEmerges(std::deque<BatchedEmerge> &batch,
+		u32 max_count) {
+	stealBlockEmerges();
+
+	BatchedEmerge e;
+	while (batch.size() < max_count && popBlockEmerge(&e))
+		batch.push_back(e);
+
+	JMutexAutoLock queuelock(emerge->queuemutex);
+	// Anything queued to this thread meanwhile has signaled qevent
+	idle = batch.empty();
+}
+
+
+/*
+	Puts requests taken by popBlockEmerges() back to the front of the
+	queue, where idle threads can take them, and wakes those up.
+*/
+void EmergeThread::returnBlockEmerges(std::deque<BatchedEmerge> &batch) {
+	if (batch.empty())
+		return;
+
+	std::vector<EmergeThread *> wake;
+	{
+		JMutexAutoLock queuelock(emerge->queuemutex);
+
+		for (std::deque<BatchedEmerge>::reverse_iterator i = batch.rbegin();
+				i != batch.rend(); ++i) {
+			std::map<v3s16, BlockEmergeData *>::iterator iter =
+					emerge->blocks_enqueued.find(i->pos);
+			if (iter != emerge->blocks_enqueued.end()) {
+				// Requested again meanwhile and queued somewhere
+				iter->second->flags |= i->flags;
+				continue;
+			}
+			// The peer has left and its requests are cancelled
+			if (i->peer_requested != PEER_ID_INEXISTENT &&
+					i->peer_requested != EMERGE_PEER_PREGEN &&
+					emerge->peer_positions.find(i->peer_requested) ==
+					emerge->peer_positions.end())
+				continue;
+
+			BlockEmergeData *bedata = new BlockEmergeData;
+			bedata->flags = i->flags;
+			bedata->peer_requested = i->peer_requested;
+			emerge->blocks_enqueued.insert(std::make_pair(i->pos, bedata));
+			emerge->peer_queue_count[i->peer_requested]++;
+
+			QueuedEmerge q;
+			q.pos = i->pos;
+			q.disk_checked = i->disk_checked;
+			blockqueue.push_front(q);
+		}
+
+		for (size_t i = 0; i != emerge->emergethread.size(); i++) {
+			EmergeThread *t = emerge->emergethread[i];
+			if (t != this && t->idle) {
+				t->idle = false;
+				wake.push_back(t);
+			}
+		}
+	}
+	batch.clear();
+
+	for (size_t i = 0; i != wake.size(); i++)
+		wake[i]->qevent.signal();
+}
+
+
+// Finds the blocks of batch that aren't usable from memory
+void EmergeThread::findBlocksToLoad(std::deque<BatchedEmerge> &batch,
+		std::vector<v3s16> &to_load, std::vector<BatchedEmerge *> &loading) {
+	to_load.clear();
+	loading.clear();
+	for (std::deque<BatchedEmerge>::iterator i = batch.begin();
+			i != batch.end(); ++i) {
+		if (blockpos_over_limit(i->pos))
+			continue;
+		MapBlock *block = map->getBlockNoCreateNoEx(i->pos);
+		if (!block || block->isDummy() || !block->isGenerated()) {
+			to_load.push_back(i->pos);
+			loading.push_back(&(*i));
+		}
+	}
+}
+
+
+void EmergeThread::loadBatchFromDisk(std::deque<BatchedEmerge> &batch) {
+	std::vector<v3s16> to_load;
+	std::vector<BatchedEmerge *> loading;
+
+	// Often everything is in memory, which doesn't need the write lock
+	{
+		RWMutexReadLock envlock(m_server->m_env_mutex);
+		findBlocksToLoad(batch, to_load, loading);
+	}
+	if (to_load.empty())
+		return;
+
+	// Read the database without blocking the server; loads of the same
+	// blocks by the server thread meanwhile wait for this read
+	map->prefetchBlocks(to_load);
+
+	//envlock: usually takes <=1ms, sometimes 90ms or ~400ms to acquire
+	RWMutexWriteLock envlock(m_server->m_env_mutex);
+	ScopeProfiler sp(g_profiler, "EmergeThread: load batch (envlock)", SPT_AVG);
+
+	// Another thread may have loaded some meanwhile
+	findBlocksToLoad(batch, to_load, loading);
+	if (to_load.empty())
+		return;
+
+	for (std::vector<v3s16>::iterator i = to_load.begin();
+			i != to_load.end(); ++i) {
+		v2s16 p2d(i->X, i->Z);
+		if (map->getSectorNoGenerateNoEx(p2d) == NULL)
+			map->loadSectorMeta(p2d);
+	}
+
+	std::vector<MapBlock *> blocks;
+	map->loadBlocks(to_load, blocks);
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (blocks[i] && blocks[i]->isGenerated()) {
+			map->prepareBlock(blocks[i]);
+		} else {
+			// Only skip the lookup for blocks that weren't found; loaded
+			// ones are looked up again if they get unloaded meanwhile
+			loading[i]->disk_checked = true;
+		}
+	}
+}
+
+
 bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
-									BlockMakeData *data, bool allow_gen) {
+		BlockMakeData *data, bool allow_gen, bool disk_checked) {
 	v2s16 p2d(p.X, p.Z);
+
+	// Blocks in memory are only looked at
+	{
+		RWMutexReadLock envlock(m_server->m_env_mutex);
+		MapBlock *block = map->getBlockNoCreateNoEx(p);
+		if (block && !block->isDummy() && block->isGenerated()) {
+			*b = block;
+			return false;
+		}
+	}
+
 	//envlock: usually takes <=1ms, sometimes 90ms or ~400ms to acquire
-	JMutexAutoLock envlock(m_server->m_env_mutex);
+	RWMutexWriteLock envlock(m_server->m_env_mutex);
 
 	// Load sector if it isn't loaded
 	if (map->getSectorNoGenerateNoEx(p2d) == NULL)
@@ -430,7 +966,7 @@ bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 
 	// Attempt to load block
 	MapBlock *block = map->getBlockNoCreateNoEx(p);
-	if (!block || block->isDummy() || !block->isGenerated()) {
+	if (!disk_checked && (!block || block->isDummy() || !block->isGenerated())) {
 		EMERGE_DBG_OUT("not in memory, attempting to load from disk");
 		block = map->loadBlock(p);
 		if (block && block->isGenerated())
@@ -450,6 +986,42 @@ bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 }
 
 
+void EmergeThread::runMapgenStages(BlockMakeData *data) {
+	v3s16 minp = data->blockpos_min * MAP_BLOCKSIZE;
+	v3s16 maxp = data->blockpos_max * MAP_BLOCKSIZE +
+				 v3s16(1,1,1) * (MAP_BLOCKSIZE - 1);
+
+	bool changed = false;
+	{
+		RWMutexWriteLock envlock(m_server->m_env_mutex);
+		ScopeProfiler sp(g_profiler, "EmergeThread: Lua mapgen stages", SPT_AVG);
+		try {
+			changed = m_server->getScriptIface()->environment_OnMapgenStage(
+					data->vmanip, minp, maxp, emerge->getBlockSeed(minp));
+		} catch(LuaError &e) {
+			m_server->setAsyncFatalError(e.what());
+		}
+	}
+	if (!changed)
+		return;
+
+	// Whatever the stages did, the chunk is lit and its liquids are
+	// queued once, like the mapgens do at the end of makeChunk(). The
+	// queue of the mapgen may have liquids the stages have removed, and
+	// the scan below finds the rest again.
+	ManualMapVoxelManipulator *vm = data->vmanip;
+	data->transforming_liquid = UniqueQueue<v3s16>();
+	mapgen->updateLiquid(&data->transforming_liquid,
+		vm->m_area.MinEdge, vm->m_area.MaxEdge);
+	if (emerge->params.flags & MG_LIGHT)
+		mapgen->calcLighting(minp - v3s16(1, 1, 1) * MAP_BLOCKSIZE,
+			maxp + v3s16(1, 0, 1) * MAP_BLOCKSIZE);
+
+	data->daynight_diffs.clear();
+	vm->getDayNightDiffs(data->nodedef, data->daynight_diffs);
+}
+
+
 void *EmergeThread::Thread() {
 	ThreadStarted();
 	log_register_thread("EmergeThread" + itos(id));
@@ -459,6 +1031,8 @@ void *EmergeThread::Thread() {
 	v3s16 last_tried_pos(-32768,-32768,-32768); // For error output
 	v3s16 p;
 	u8 flags = 0;
+	bool disk_checked = false;
+	std::deque<BatchedEmerge> batch;
 
 	map    = (ServerMap *)&(m_server->m_env->getMap());
 	emerge = m_server->m_emerge;
@@ -469,10 +1043,22 @@ void *EmergeThread::Thread() {
 
 	while (!StopRequested())
 	try {
-		if (!popBlockEmerge(&p, &flags)) {
-			qevent.wait();
-			continue;
+		/*
+			Take several requests at once and load the blocks of all of
+			them from disk in one go
+		*/
+		if (batch.empty()) {
+			popBlockEmerges(batch, EMERGE_LOAD_BATCH_SIZE);
+			if (batch.empty()) {
+				qevent.wait();
+				continue;
+			}
+			loadBatchFromDisk(batch);
 		}
+		p            = batch.front().pos;
+		flags        = batch.front().flags;
+		disk_checked = batch.front().disk_checked;
+		batch.pop_front();
 
 		last_tried_pos = p;
 		if (blockpos_over_limit(p))
@@ -489,20 +1075,31 @@ void *EmergeThread::Thread() {
 		MapBlock *block = NULL;
 		std::map<v3s16, MapBlock *> modified_blocks;
 
-		if (getBlockOrStartGen(p, &block, &data, allow_generate) && mapgen) {
+		if (getBlockOrStartGen(p, &block, &data, allow_generate, disk_checked) &&
+				mapgen) {
+			// Generating takes long; let idle threads have the rest of
+			// the batch meanwhile
+			returnBlockEmerges(batch);
+			setVManipBytes(data.vmanip->m_area.getVolume() *
+					(sizeof(MapNode) + sizeof(u8)));
+
 			{
 				ScopeProfiler sp(g_profiler, "EmergeThread: Mapgen::makeChunk", SPT_AVG);
 				TimeTaker t("mapgen::make_block()");
 
 				mapgen->makeChunk(&data);
+				data.vmanip->getDayNightDiffs(data.nodedef,
+						data.daynight_diffs);
 
 				if (enable_mapgen_debug_info == false)
 					t.stop(true); // Hide output
 			}
 
+			runMapgenStages(&data);
+
 			{
 				//envlock: usually 0ms, but can take either 30 or 400ms to acquire
-				JMutexAutoLock envlock(m_server->m_env_mutex);
+				RWMutexWriteLock envlock(m_server->m_env_mutex);
 				ScopeProfiler sp(g_profiler, "EmergeThread: after "
 						"Mapgen::makeChunk (envlock)", SPT_AVG);
 
@@ -534,6 +1131,7 @@ void *EmergeThread::Thread() {
 					m_server->m_env->activateBlock(block, 0);
 				}
 			}
+			setVManipBytes(0);
 		}
 
 		/*
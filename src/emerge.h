@@ -25,6 +25,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/container.h"
 #include "mapgen.h" // for MapgenParams
 #include "map.h"
+#include "jthread/jmutex.h"
+#include "constants.h" // for PEER_ID_SERVER
 
 #define MGPARAMS_SET_MGNAME      1
 #define MGPARAMS_SET_SEED        2
@@ -33,6 +35,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define BLOCK_EMERGE_ALLOWGEN (1<<0)
 
+// Requester of the emerges of the map pregenerator, so that they are
+// counted apart from the other ones of the server (PEER_ID_INEXISTENT);
+// no client gets the peer id of the server
+#define EMERGE_PEER_PREGEN PEER_ID_SERVER
+
 #define EMERGE_DBG_OUT(x) \
 	do {                                                   \
 		if (enable_mapgen_debug_info)                      \
@@ -41,6 +48,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 class EmergeThread;
 class INodeDefManager;
+class Noise;
 class Settings;
 
 class BiomeManager;
@@ -56,6 +64,9 @@ struct BlockMakeData {
 	v3s16 blockpos_requested;
 	UniqueQueue<v3s16> transforming_liquid;
 	INodeDefManager *nodedef;
+	// Day/night difference flags of the blocks in vmanip, computed
+	// before finishBlockMake() so that it doesn't have to
+	std::map<v3s16, bool> daynight_diffs;
 
 	BlockMakeData():
 		vmanip(NULL),
@@ -71,6 +82,58 @@ struct BlockEmergeData {
 	u8 flags;
 };
 
+/*
+	Cache of the 2D noise maps computed by the mapgens, shared by all
+	emerge threads.  Mapchunks stacked on top of each other use the same
+	2D noise, and point queries like getGroundLevelAtPoint() can be
+	answered from a map that has already been made.
+
+	Maps are stored as returned by Noise::perlinMap2D(), before
+	transformNoiseMap(), and identified by the parameters they depend
+	on, their seed, their size and the position they were made at.
+*/
+class NoiseMapCache {
+public:
+	NoiseMapCache(u32 max_maps);
+	~NoiseMapCache();
+
+	// Fills noise->result with the map at (x, y), computing it if it
+	// isn't cached yet
+	float *perlinMap2D(Noise *noise, float x, float y);
+	// Gets the value at index (i, j) of the map noise would have at
+	// (x, y) if that map is cached
+	bool getPoint(Noise *noise, float x, float y, int i, int j,
+		float *value);
+	// Bytes taken by the cached maps
+	u64 getMemoryUsage();
+
+private:
+	struct Key {
+		v3f spread;
+		s32 seed;
+		u16 octaves;
+		float persist;
+		int sx;
+		int sy;
+		float x;
+		float y;
+
+		Key(Noise *noise, float x_, float y_);
+		bool operator<(const Key &other) const;
+	};
+
+	struct Entry {
+		float *data;
+		u32 size;
+		u32 last_used;
+	};
+
+	JMutex m_mutex;
+	std::map<Key, Entry> m_maps;
+	u32 m_max_maps;
+	u32 m_use_counter;
+};
+
 class EmergeManager {
 public:
 	INodeDefManager *ndef;
@@ -95,6 +158,9 @@ class EmergeManager {
 	JMutex queuemutex;
 	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
 	std::map<u16, u16> peer_queue_count;
+	// Last known block position of each peer; queued blocks are emerged
+	// nearest to their requesting peer first
+	std::map<u16, v3s16> peer_positions;
 
 	//// Managers of map generation-related components
 	BiomeManager *biomemgr;
@@ -102,6 +168,8 @@ class EmergeManager {
 	DecorationManager *decomgr;
 	SchematicManager *schemmgr;
 
+	NoiseMapCache *noisecache;
+
 	//// Methods
 	EmergeManager(IGameDef *gamedef);
 	~EmergeManager();
@@ -115,6 +183,23 @@ class EmergeManager {
 	void startThreads();
 	void stopThreads();
 	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate);
+	// Updates the position used for prioritizing the requests of
+	// peer_id, and cancels those farther than max_d blocks from it when
+	// the position has changed
+	void updatePeerPosition(u16 peer_id, v3s16 blockpos, s16 max_d);
+	// Cancels all queued requests of peer_id
+	void cancelPeerEmerges(u16 peer_id);
+	// Number of requests of peer_id still in the queue
+	u16 getPeerQueueCount(u16 peer_id);
+	// Number of queued blocks of each emerge thread
+	void getQueueLengths(std::vector<u32> &lengths);
+	// Bytes taken by the VoxelManipulators of the chunks being generated
+	u64 getVManipMemoryUsage();
+	// Bytes taken by noisecache and the ground level bounds cache
+	u64 getCacheMemoryUsage();
+	// Emerge priority of a queued block; lower is sooner.
+	// queuemutex must be locked.
+	s32 getEmergeDistance(v3s16 p, u16 peer_id);
 
 	void registerMapgen(std::string name, MapgenFactory *mgfactory);
 	void loadParamsFromSettings(Settings *settings);
@@ -123,8 +208,23 @@ class EmergeManager {
 	//mapgen helper methods
 	Biome *getBiomeAtPoint(v3s16 p);
 	int getGroundLevelAtPoint(v2s16 p);
+	// Cached Mapgen::getGroundLevelBounds()
+	bool getGroundLevelBounds(v2s16 blockpos_2d, s16 *min_y, s16 *max_y);
 	bool isBlockUnderground(v3s16 blockpos);
 	u32 getBlockSeed(v3s16 p);
+	// X and Z node position of the mapchunk containing node column p
+	v2s16 getChunkNodeMin(v2s16 p);
+	// Untransformed value of 2D noise at node column p, taken from the
+	// noise map of its mapchunk if that is cached.  The map is assumed
+	// to be made offset by (xoff, zoff) times the noise spread.
+	float getNoise2DAtPoint(Noise *noise, v2s16 p,
+		double xoff=0, double zoff=0);
+
+private:
+	JMutex ground_bounds_mutex;
+	std::map<v2s16, std::pair<s16, s16> > ground_bounds;
+
+	void cancelEmerges(u16 peer_id, bool all, v3s16 blockpos, s16 max_d);
 };
 
 #endif
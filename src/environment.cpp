@@ -33,6 +33,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodemetadata.h"
 #include "main.h" // For g_settings, g_profiler
 #include "gamedef.h"
+#include "pathfinder.h"
+#include "raycast.h"
 #ifndef SERVER
 #include "clientmap.h"
 #include "localplayer.h"
@@ -44,6 +46,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "emerge.h"
 #include "util/serialize.h"
 #include "jthread/jmutexautolock.h"
+#include <algorithm>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -82,6 +85,23 @@ void Environment::addPlayer(Player *player)
 	assert(getPlayer(player->getName()) == NULL);
 	// Add.
 	m_players.push_back(player);
+	m_players_by_name[player->getName()] = player;
+	if(player->peer_id != 0)
+		m_players_by_peer_id[player->peer_id] = player;
+}
+
+void Environment::unindexPlayer(Player *player)
+{
+	m_players_by_name.erase(player->getName());
+	// The player may be under an old peer id
+	for(std::map<u16, Player*>::iterator i = m_players_by_peer_id.begin();
+			i != m_players_by_peer_id.end();)
+	{
+		if(i->second == player)
+			m_players_by_peer_id.erase(i++);
+		else
+			++i;
+	}
 }
 
 void Environment::removePlayer(u16 peer_id)
@@ -93,6 +113,7 @@ void Environment::removePlayer(u16 peer_id)
 	{
 		Player *player = *i;
 		if(player->peer_id == peer_id) {
+			unindexPlayer(player);
 			delete player;
 			i = m_players.erase(i);
 		} else {
@@ -106,6 +127,7 @@ void Environment::removePlayer(const char *name)
 	for (std::list<Player*>::iterator it = m_players.begin();
 			it != m_players.end(); ++it) {
 		if (strcmp((*it)->getName(), name) == 0) {
+			unindexPlayer(*it);
 			delete *it;
 			m_players.erase(it);
 			return;
@@ -115,26 +137,35 @@ void Environment::removePlayer(const char *name)
 
 Player * Environment::getPlayer(u16 peer_id)
 {
+	// Many players can have peer id 0; the first one is returned
+	if(peer_id != 0){
+		std::map<u16, Player*>::iterator n = m_players_by_peer_id.find(peer_id);
+		if(n != m_players_by_peer_id.end()){
+			if(n->second->peer_id == peer_id)
+				return n->second;
+			m_players_by_peer_id.erase(n);
+		}
+	}
+
 	for(std::list<Player*>::iterator i = m_players.begin();
 			i != m_players.end(); ++i)
 	{
 		Player *player = *i;
-		if(player->peer_id == peer_id)
+		if(player->peer_id == peer_id){
+			if(peer_id != 0)
+				m_players_by_peer_id[peer_id] = player;
 			return player;
+		}
 	}
 	return NULL;
 }
 
 Player * Environment::getPlayer(const char *name)
 {
-	for(std::list<Player*>::iterator i = m_players.begin();
-			i != m_players.end(); ++i)
-	{
-		Player *player = *i;
-		if(strcmp(player->getName(), name) == 0)
-			return player;
-	}
-	return NULL;
+	std::map<std::string, Player*>::iterator n = m_players_by_name.find(name);
+	if(n == m_players_by_name.end())
+		return NULL;
+	return n->second;
 }
 
 Player * Environment::getRandomConnectedPlayer()
@@ -158,15 +189,17 @@ Player * Environment::getRandomConnectedPlayer()
 
 Player * Environment::getNearestConnectedPlayer(v3f pos)
 {
-	std::list<Player*> connected_players = getPlayers(true);
 	f32 nearest_d = 0;
 	Player *nearest_player = NULL;
 	for(std::list<Player*>::iterator
-			i = connected_players.begin();
-			i != connected_players.end(); ++i)
+			i = m_players.begin();
+			i != m_players.end(); ++i)
 	{
 		Player *player = *i;
-		f32 d = player->getPosition().getDistanceFrom(pos);
+		// Ignore disconnected players
+		if(player->peer_id == 0)
+			continue;
+		f32 d = player->getPosition().getDistanceFromSQ(pos);
 		if(d < nearest_d || nearest_player == NULL)
 		{
 			nearest_d = d;
@@ -275,68 +308,230 @@ ABMWithState::ABMWithState(ActiveBlockModifier *abm_):
 	ActiveBlockList
 */
 
-void fillRadiusBlock(v3s16 p0, s16 r, std::set<v3s16> &list)
+static inline bool areaContains(v3s16 center, s16 r, v3s16 p)
+{
+	return p.X >= center.X - r && p.X <= center.X + r &&
+			p.Y >= center.Y - r && p.Y <= center.Y + r &&
+			p.Z >= center.Z - r && p.Z <= center.Z + r;
+}
+
+void ActiveBlockList::acquireBlock(v3s16 p,
+		std::set<v3s16> &blocks_removed,
+		std::set<v3s16> &blocks_added)
+{
+	if(++m_refs[p] != 1)
+		return;
+	// Released and wanted again in the same update
+	if(m_list.find(p) != m_list.end())
+		blocks_removed.erase(p);
+	else
+		blocks_added.insert(p);
+}
+
+void ActiveBlockList::releaseBlock(v3s16 p,
+		std::set<v3s16> &blocks_removed,
+		std::set<v3s16> &blocks_added)
+{
+	std::map<v3s16, u16>::iterator i = m_refs.find(p);
+	if(i == m_refs.end() || --i->second != 0)
+		return;
+	m_refs.erase(i);
+	if(m_list.find(p) != m_list.end())
+		blocks_removed.insert(p);
+	else
+		blocks_added.erase(p);
+	m_retry.erase(p);
+}
+
+void ActiveBlockList::acquire(const Area &b, const Area *a,
+		std::set<v3s16> &blocks_removed,
+		std::set<v3s16> &blocks_added)
 {
+	v3s16 p0 = b.center;
+	s16 r = b.radius;
 	v3s16 p;
 	for(p.X=p0.X-r; p.X<=p0.X+r; p.X++)
 	for(p.Y=p0.Y-r; p.Y<=p0.Y+r; p.Y++)
 	for(p.Z=p0.Z-r; p.Z<=p0.Z+r; p.Z++)
 	{
-		// Set in list
-		list.insert(p);
+		if(a && areaContains(a->center, a->radius, p))
+			continue;
+		acquireBlock(p, blocks_removed, blocks_added);
 	}
 }
 
-void ActiveBlockList::update(std::list<v3s16> &active_positions,
+void ActiveBlockList::release(const Area &a, const Area *b,
+		std::set<v3s16> &blocks_removed,
+		std::set<v3s16> &blocks_added)
+{
+	v3s16 p0 = a.center;
+	s16 r = a.radius;
+	v3s16 p;
+	for(p.X=p0.X-r; p.X<=p0.X+r; p.X++)
+	for(p.Y=p0.Y-r; p.Y<=p0.Y+r; p.Y++)
+	for(p.Z=p0.Z-r; p.Z<=p0.Z+r; p.Z++)
+	{
+		if(b && areaContains(b->center, b->radius, p))
+			continue;
+		releaseBlock(p, blocks_removed, blocks_added);
+	}
+}
+
+void ActiveBlockList::update(std::map<u16, v3s16> &active_positions,
 		s16 radius,
 		std::set<v3s16> &blocks_removed,
 		std::set<v3s16> &blocks_added)
 {
 	/*
-		Create the new list
+		Players that left
 	*/
-	std::set<v3s16> newlist = m_forceloaded_list;
-	for(std::list<v3s16>::iterator i = active_positions.begin();
+	for(std::map<u16, Area>::iterator i = m_players.begin();
+			i != m_players.end();)
+	{
+		if(active_positions.find(i->first) != active_positions.end()){
+			++i;
+			continue;
+		}
+		release(i->second, NULL, blocks_removed, blocks_added);
+		m_players.erase(i++);
+	}
+
+	/*
+		Players that came or moved to another block; only the blocks
+		that are in one of the old and the new area change
+	*/
+	for(std::map<u16, v3s16>::iterator i = active_positions.begin();
 			i != active_positions.end(); ++i)
 	{
-		fillRadiusBlock(*i, radius, newlist);
+		Area area;
+		area.center = i->second;
+		area.radius = radius;
+
+		std::map<u16, Area>::iterator old = m_players.find(i->first);
+		if(old == m_players.end()){
+			acquire(area, NULL, blocks_removed, blocks_added);
+			m_players[i->first] = area;
+			continue;
+		}
+		if(old->second.center == area.center &&
+				old->second.radius == area.radius)
+			continue;
+		acquire(area, &old->second, blocks_removed, blocks_added);
+		release(old->second, &area, blocks_removed, blocks_added);
+		old->second = area;
 	}
 
 	/*
-		Find out which blocks on the old list are not on the new list
+		Forceloaded blocks, changed by the scripts in between
 	*/
-	// Go through old list
-	for(std::set<v3s16>::iterator i = m_list.begin();
-			i != m_list.end(); ++i)
+	for(std::set<v3s16>::iterator i = m_forceloaded_refs.begin();
+			i != m_forceloaded_refs.end();)
 	{
-		v3s16 p = *i;
-		// If not on new list, it's been removed
-		if(newlist.find(p) == newlist.end())
-			blocks_removed.insert(p);
+		if(m_forceloaded_list.find(*i) != m_forceloaded_list.end()){
+			++i;
+			continue;
+		}
+		releaseBlock(*i, blocks_removed, blocks_added);
+		m_forceloaded_refs.erase(i++);
+	}
+	for(std::set<v3s16>::iterator i = m_forceloaded_list.begin();
+			i != m_forceloaded_list.end(); ++i)
+	{
+		if(m_forceloaded_refs.insert(*i).second)
+			acquireBlock(*i, blocks_removed, blocks_added);
 	}
 
 	/*
-		Find out which blocks on the new list are not on the old list
+		Blocks that couldn't be activated last time, if still wanted
 	*/
-	// Go through new list
-	for(std::set<v3s16>::iterator i = newlist.begin();
-			i != newlist.end(); ++i)
+	for(std::set<v3s16>::iterator i = m_retry.begin();
+			i != m_retry.end(); ++i)
 	{
-		v3s16 p = *i;
-		// If not on old list, it's been added
-		if(m_list.find(p) == m_list.end())
-			blocks_added.insert(p);
+		if(m_refs.find(*i) != m_refs.end())
+			blocks_added.insert(*i);
 	}
+	m_retry.clear();
 
 	/*
 		Update m_list
 	*/
-	m_list.clear();
-	for(std::set<v3s16>::iterator i = newlist.begin();
-			i != newlist.end(); ++i)
+	for(std::set<v3s16>::iterator i = blocks_removed.begin();
+			i != blocks_removed.end(); ++i)
+		m_list.erase(*i);
+	m_list.insert(blocks_added.begin(), blocks_added.end());
+}
+
+/*
+	ActiveObjectBlockIndex
+*/
+
+void ActiveObjectBlockIndex::insert(u16 id, v3s16 blockpos)
+{
+	remove(id);
+	m_blocks[blockpos].insert(id);
+	m_object_blocks[id] = blockpos;
+}
+
+void ActiveObjectBlockIndex::remove(u16 id)
+{
+	std::map<u16, v3s16>::iterator n = m_object_blocks.find(id);
+	if(n == m_object_blocks.end())
+		return;
+	std::map<v3s16, std::set<u16> >::iterator b = m_blocks.find(n->second);
+	if(b != m_blocks.end()){
+		b->second.erase(id);
+		if(b->second.empty())
+			m_blocks.erase(b);
+	}
+	m_object_blocks.erase(n);
+}
+
+void ActiveObjectBlockIndex::update(u16 id, v3s16 blockpos)
+{
+	std::map<u16, v3s16>::iterator n = m_object_blocks.find(id);
+	if(n == m_object_blocks.end() || n->second == blockpos)
+		return;
+	std::map<v3s16, std::set<u16> >::iterator b = m_blocks.find(n->second);
+	if(b != m_blocks.end()){
+		b->second.erase(id);
+		if(b->second.empty())
+			m_blocks.erase(b);
+	}
+	m_blocks[blockpos].insert(id);
+	n->second = blockpos;
+}
+
+void ActiveObjectBlockIndex::getObjectsInBlocks(v3s16 minp, v3s16 maxp,
+		std::vector<u16> &objects) const
+{
+	u64 volume = (u64)(maxp.X - minp.X + 1) * (u64)(maxp.Y - minp.Y + 1)
+			* (u64)(maxp.Z - minp.Z + 1);
+
+	// For large areas, walking the occupied blocks is cheaper than
+	// looking up every block in the area
+	if(volume > m_blocks.size()){
+		for(std::map<v3s16, std::set<u16> >::const_iterator
+				i = m_blocks.begin(); i != m_blocks.end(); ++i)
+		{
+			const v3s16 &p = i->first;
+			if(p.X < minp.X || p.X > maxp.X ||
+					p.Y < minp.Y || p.Y > maxp.Y ||
+					p.Z < minp.Z || p.Z > maxp.Z)
+				continue;
+			objects.insert(objects.end(), i->second.begin(), i->second.end());
+		}
+		return;
+	}
+
+	v3s16 p;
+	for(p.Z = minp.Z; p.Z <= maxp.Z; p.Z++)
+	for(p.Y = minp.Y; p.Y <= maxp.Y; p.Y++)
+	for(p.X = minp.X; p.X <= maxp.X; p.X++)
 	{
-		v3s16 p = *i;
-		m_list.insert(p);
+		std::map<v3s16, std::set<u16> >::const_iterator i = m_blocks.find(p);
+		if(i == m_blocks.end())
+			continue;
+		objects.insert(objects.end(), i->second.begin(), i->second.end());
 	}
 }
 
@@ -351,8 +546,14 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_script(scriptIface),
 	m_gamedef(gamedef),
 	m_path_world(path_world),
+	m_path_cache(new path_cache()),
 	m_send_recommended_timer(0),
 	m_active_block_interval_overload_skip(0),
+	m_abm_handler(NULL),
+	m_abm_pass_dtime(0),
+	m_abm_pass_next_block(0),
+	m_far_objects_left(false),
+	m_clear_objects_next_block(0),
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
 	m_recommended_send_interval(0.1),
@@ -369,9 +570,14 @@ ServerEnvironment::~ServerEnvironment()
 	// Convert all objects to static and delete the active objects
 	deactivateFarObjects(true);
 
+	// Drop any unfinished ABM pass
+	finishABMPass();
+
 	// Drop/delete map
 	m_map->drop();
 
+	delete m_path_cache;
+
 	// Delete ActiveBlockModifiers
 	for(std::list<ABMWithState>::iterator
 			i = m_abms.begin(); i != m_abms.end(); ++i){
@@ -391,29 +597,9 @@ ServerMap & ServerEnvironment::getServerMap()
 
 bool ServerEnvironment::line_of_sight(v3f pos1, v3f pos2, float stepsize, v3s16 *p)
 {
-	float distance = pos1.getDistanceFrom(pos2);
-
-	//calculate normalized direction vector
-	v3f normalized_vector = v3f((pos2.X - pos1.X)/distance,
-								(pos2.Y - pos1.Y)/distance,
-								(pos2.Z - pos1.Z)/distance);
-
-	//find out if there's a node on path between pos1 and pos2
-	for (float i = 1; i < distance; i += stepsize) {
-		v3s16 pos = floatToInt(v3f(normalized_vector.X * i,
-				normalized_vector.Y * i,
-				normalized_vector.Z * i) +pos1,BS);
-
-		MapNode n = getMap().getNodeNoEx(pos);
-
-		if(n.param0 != CONTENT_AIR) {
-			if (p) {
-				*p = pos;
-			}
-			return false;
-		}
-	}
-	return true;
+	// Every node on the line is looked at, the step size isn't needed
+	return !raycastFirstNode(m_map, m_gamedef->ndef(), pos1, pos2,
+			RAYCAST_NOT_AIR, p);
 }
 
 void ServerEnvironment::saveLoadedPlayers()
@@ -426,7 +612,7 @@ void ServerEnvironment::saveLoadedPlayers()
 			++it) {
 		RemotePlayer *player = static_cast<RemotePlayer*>(*it);
 		if (player->checkModified()) {
-			player->save(players_path);
+			savePlayer(player, players_path);
 		}
 	}
 }
@@ -438,8 +624,21 @@ void ServerEnvironment::savePlayer(const std::string &playername)
 
 	RemotePlayer *player = static_cast<RemotePlayer*>(getPlayer(playername.c_str()));
 	if (player) {
-		player->save(players_path);
+		savePlayer(player, players_path);
+	}
+}
+
+void ServerEnvironment::savePlayer(RemotePlayer *player,
+		const std::string &players_path)
+{
+	// Prefer the map database; the write happens in the save thread
+	std::ostringstream os(std::ios_base::binary);
+	player->serialize(os);
+	if (m_map->savePlayer(player->getName(), os.str())) {
+		player->setModified(false);
+		return;
 	}
+	player->save(players_path);
 }
 
 Player *ServerEnvironment::loadPlayer(const std::string &playername)
@@ -449,24 +648,37 @@ Player *ServerEnvironment::loadPlayer(const std::string &playername)
 	RemotePlayer *player = static_cast<RemotePlayer*>(getPlayer(playername.c_str()));
 	bool newplayer = false;
 	bool found = false;
+	bool from_files = false;
 	if (!player) {
 		player = new RemotePlayer(m_gamedef, playername.c_str());
 		newplayer = true;
 	}
 
 	RemotePlayer testplayer(m_gamedef, "");
+	std::string data;
+	if (m_map->loadPlayer(playername, data)) {
+		std::istringstream is(data, std::ios_base::binary);
+		testplayer.deSerialize(is, playername);
+		if (testplayer.getName() == playername) {
+			*player = testplayer;
+			found = true;
+		}
+	}
+
+	// Players saved before the database stored them are in files
 	std::string path = players_path + playername;
-	for (u32 i = 0; i < PLAYER_FILE_ALTERNATE_TRIES; i++) {
+	for (u32 i = 0; !found && i < PLAYER_FILE_ALTERNATE_TRIES; i++) {
 		// Open file and deserialize
 		std::ifstream is(path.c_str(), std::ios_base::binary);
 		if (!is.good()) {
-			return NULL;
+			break;
 		}
 		testplayer.deSerialize(is, path);
 		is.close();
 		if (testplayer.getName() == playername) {
 			*player = testplayer;
 			found = true;
+			from_files = true;
 			break;
 		}
 		path = players_path + playername + itos(i);
@@ -474,12 +686,16 @@ Player *ServerEnvironment::loadPlayer(const std::string &playername)
 	if (!found) {
 		infostream << "Player file for player " << playername
 				<< " not found" << std::endl;
+		if (newplayer)
+			delete player;
 		return NULL;
 	}
 	if (newplayer) {
 		addPlayer(player);
 	}
-	player->setModified(false);
+	// Players read from files are moved into the database on the next
+	// save, if it can store them
+	player->setModified(from_files);
 	return player;
 }
 
@@ -493,6 +709,22 @@ void ServerEnvironment::saveMeta()
 	Settings args;
 	args.setU64("game_time", m_game_time);
 	args.setU64("time_of_day", getTimeOfDay());
+	if(m_clear_objects.active){
+		args.set("clear_objects_cursor", m_clear_objects_cursor);
+		args.setU64("clear_objects_blocks_checked",
+				m_clear_objects.blocks_checked);
+		args.setU64("clear_objects_blocks_cleared",
+				m_clear_objects.blocks_cleared);
+		args.setU64("clear_objects_objects_cleared",
+				m_clear_objects.objects_cleared);
+		// The blocks cleared at the start may have got new objects since
+		std::ostringstream skip(std::ios_base::binary);
+		for(std::set<v3s16>::iterator i = m_clear_objects_skip.begin();
+				i != m_clear_objects_skip.end(); ++i)
+			skip<<(i == m_clear_objects_skip.begin() ? "" : " ")
+					<<i->X<<","<<i->Y<<","<<i->Z;
+		args.set("clear_objects_skip", skip.str());
+	}
 	args.writeLines(ss);
 	ss<<"EnvArgsEnd\n";
 
@@ -536,25 +768,133 @@ void ServerEnvironment::loadMeta()
 		// This is not as important
 		m_time_of_day = 9000;
 	}
+
+	// Resume an unfinished clearAllObjects()
+	if(args.exists("clear_objects_cursor")){
+		m_clear_objects.active = true;
+		m_clear_objects_cursor = args.get("clear_objects_cursor");
+		m_clear_objects_next_cursor = m_clear_objects_cursor;
+		try {
+			m_clear_objects.blocks_checked =
+					args.getU64("clear_objects_blocks_checked");
+			m_clear_objects.blocks_cleared =
+					args.getU64("clear_objects_blocks_cleared");
+			m_clear_objects.objects_cleared =
+					args.getU64("clear_objects_objects_cleared");
+		} catch (SettingNotFoundException &e) {
+			// Only the progress shown is off
+		}
+		if(args.exists("clear_objects_skip")){
+			std::istringstream skip(args.get("clear_objects_skip"),
+					std::ios_base::binary);
+			s16 x, y, z;
+			char comma1, comma2;
+			while(skip>>x>>comma1>>y>>comma2>>z)
+				m_clear_objects_skip.insert(v3s16(x, y, z));
+		}
+		actionstream<<"Resuming clearing all objects"<<std::endl;
+	}
 }
 
 struct ActiveABM
 {
 	ActiveBlockModifier *abm;
+	// For the slow step watchdog
+	std::string name;
 	int chance;
-	std::set<content_t> required_neighbors;
+	// Required neighbor membership, indexed by content id
+	std::vector<bool> required_neighbors;
+	bool check_required_neighbors;
 };
 
 class ABMHandler
 {
 private:
 	ServerEnvironment *m_env;
-	std::map<content_t, std::list<ActiveABM> > m_aabms;
+	// ABMs triggered by each content, indexed by content id
+	std::vector<std::vector<ActiveABM*> *> m_aabms;
+	// Owns the ActiveABMs referenced by m_aabms
+	std::list<ActiveABM> m_aabm_storage;
+	// Contents of the nodes surrounding the block being applied to,
+	// indexed by the block relative position offset by one. Filled once
+	// per block, so changes made by triggers to neighboring blocks are
+	// only seen on the next pass.
+	content_t m_border[(MAP_BLOCKSIZE + 2) * (MAP_BLOCKSIZE + 2)
+			* (MAP_BLOCKSIZE + 2)];
+	bool m_border_valid;
+
+	static inline u32 borderIndex(s16 x, s16 y, s16 z)
+	{
+		const s16 w = MAP_BLOCKSIZE + 2;
+		return (z + 1) * w * w + (y + 1) * w + (x + 1);
+	}
+
+	/*
+		Fill m_border with the nodes of the 26 blocks around block that
+		touch it. Unloaded neighbors read as CONTENT_IGNORE, like
+		Map::getNodeNoEx would return.
+	*/
+	void fillBorder(MapBlock *block, ServerMap *map)
+	{
+		MapBlock *neighbors[3][3][3];
+		v3s16 bp = block->getPos();
+		for(s16 z = -1; z <= 1; z++)
+		for(s16 y = -1; y <= 1; y++)
+		for(s16 x = -1; x <= 1; x++)
+		{
+			MapBlock *b = NULL;
+			if(x != 0 || y != 0 || z != 0)
+				b = map->getBlockNoCreateNoEx(bp + v3s16(x, y, z));
+			if(b != NULL && b->isDummy())
+				b = NULL;
+			neighbors[z + 1][y + 1][x + 1] = b;
+		}
+
+		bool valid;
+		for(s16 z = -1; z <= MAP_BLOCKSIZE; z++)
+		for(s16 y = -1; y <= MAP_BLOCKSIZE; y++)
+		for(s16 x = -1; x <= MAP_BLOCKSIZE; x++)
+		{
+			s16 ox = x < 0 ? -1 : (x >= MAP_BLOCKSIZE ? 1 : 0);
+			s16 oy = y < 0 ? -1 : (y >= MAP_BLOCKSIZE ? 1 : 0);
+			s16 oz = z < 0 ? -1 : (z >= MAP_BLOCKSIZE ? 1 : 0);
+			if(ox == 0 && oy == 0 && oz == 0){
+				// Interior is read from the block itself; skip to the
+				// far side of this row
+				x = MAP_BLOCKSIZE - 1;
+				continue;
+			}
+			MapBlock *b = neighbors[oz + 1][oy + 1][ox + 1];
+			content_t c = CONTENT_IGNORE;
+			if(b != NULL)
+				c = b->getNodeNoCheck(x - ox * MAP_BLOCKSIZE,
+						y - oy * MAP_BLOCKSIZE, z - oz * MAP_BLOCKSIZE,
+						&valid).getContent();
+			m_border[borderIndex(x, y, z)] = c;
+		}
+		m_border_valid = true;
+	}
+
+	// Get the content at a block relative position in [-1, MAP_BLOCKSIZE]
+	inline content_t getNeighborContent(MapBlock *block, ServerMap *map,
+			s16 x, s16 y, s16 z)
+	{
+		if(x >= 0 && x < MAP_BLOCKSIZE && y >= 0 && y < MAP_BLOCKSIZE
+				&& z >= 0 && z < MAP_BLOCKSIZE){
+			bool valid;
+			return block->getNodeNoCheck(x, y, z, &valid).getContent();
+		}
+		if(!m_border_valid)
+			fillBorder(block, map);
+		return m_border[borderIndex(x, y, z)];
+	}
+
 public:
 	ABMHandler(std::list<ABMWithState> &abms,
 			float dtime_s, ServerEnvironment *env,
 			bool use_timers):
-		m_env(env)
+		m_env(env),
+		m_border_valid(false)
 	{
 		if(dtime_s < 0.001)
 			return;
@@ -570,8 +910,11 @@ class ABMHandler
 				i->timer += dtime_s;
 				if(i->timer < trigger_interval)
 					continue;
-				i->timer -= trigger_interval;
-				actual_interval = trigger_interval;
+				// Trigger once for all intervals that have passed,
+				// compensating in the chance
+				float passed = floor(i->timer / trigger_interval);
+				i->timer -= passed * trigger_interval;
+				actual_interval = passed * trigger_interval;
 			}
 			float intervals = actual_interval / trigger_interval;
 			if(intervals == 0)
@@ -579,19 +922,31 @@ class ABMHandler
 			float chance = abm->getTriggerChance();
 			if(chance == 0)
 				chance = 1;
-			ActiveABM aabm;
+			m_aabm_storage.push_back(ActiveABM());
+			ActiveABM &aabm = m_aabm_storage.back();
 			aabm.abm = abm;
+			aabm.name = abm->getName();
 			aabm.chance = chance / intervals;
 			if(aabm.chance == 0)
 				aabm.chance = 1;
 			// Trigger neighbors
 			std::set<std::string> required_neighbors_s
 					= abm->getRequiredNeighbors();
+			aabm.check_required_neighbors = !required_neighbors_s.empty();
 			for(std::set<std::string>::iterator
 					i = required_neighbors_s.begin();
 					i != required_neighbors_s.end(); i++)
 			{
-				ndef->getIds(*i, aabm.required_neighbors);
+				std::set<content_t> ids;
+				ndef->getIds(*i, ids);
+				for(std::set<content_t>::const_iterator k = ids.begin();
+						k != ids.end(); k++)
+				{
+					content_t c = *k;
+					if(c >= aabm.required_neighbors.size())
+						aabm.required_neighbors.resize(c + 1, false);
+					aabm.required_neighbors[c] = true;
+				}
 			}
 			// Trigger contents
 			std::set<std::string> contents_s = abm->getTriggerContents();
@@ -604,18 +959,20 @@ class ABMHandler
 						k != ids.end(); k++)
 				{
 					content_t c = *k;
-					std::map<content_t, std::list<ActiveABM> >::iterator j;
-					j = m_aabms.find(c);
-					if(j == m_aabms.end()){
-						std::list<ActiveABM> aabmlist;
-						m_aabms[c] = aabmlist;
-						j = m_aabms.find(c);
-					}
-					j->second.push_back(aabm);
+					if(c >= m_aabms.size())
+						m_aabms.resize(c + 1, NULL);
+					if(m_aabms[c] == NULL)
+						m_aabms[c] = new std::vector<ActiveABM*>;
+					m_aabms[c]->push_back(&aabm);
 				}
 			}
 		}
 	}
+	~ABMHandler()
+	{
+		for(size_t i = 0; i < m_aabms.size(); i++)
+			delete m_aabms[i];
+	}
 	// Find out how many objects the given block and its neighbours contain.
 	// Returns the number of objects in the block, and also in 'wider' the
 	// number of objects in the block and all its neighbours. The latter
@@ -646,52 +1003,70 @@ class ABMHandler
 	}
 	void apply(MapBlock *block)
 	{
-		if(m_aabms.empty())
+		if(m_aabms.empty() || block->isDummy())
 			return;
 
+		// Skip blocks that contain none of the trigger contents
+		const std::vector<content_t> *contents = block->getContentSummary();
+		if(contents != NULL){
+			bool found = false;
+			for(std::vector<content_t>::const_iterator
+					i = contents->begin(); i != contents->end(); ++i)
+			{
+				if(*i < m_aabms.size() && m_aabms[*i] != NULL){
+					found = true;
+					break;
+				}
+			}
+			if(!found)
+				return;
+		}
+
 		ServerMap *map = &m_env->getServerMap();
 
 		u32 active_object_count_wider;
 		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
 		m_env->m_added_objects = 0;
 
+		// The border is filled on demand by the first neighbor check
+		m_border_valid = false;
+
 		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
 		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
 		{
-			MapNode n = block->getNodeNoEx(p0);
+			bool valid;
+			MapNode n = block->getNodeNoCheck(p0, &valid);
 			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
-
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
+			if(c >= m_aabms.size() || m_aabms[c] == NULL)
 				continue;
 
-			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
+			v3s16 p = p0 + block->getPosRelative();
+			std::vector<ActiveABM*> &aabms = *m_aabms[c];
+			for(std::vector<ActiveABM*>::iterator
+					i = aabms.begin(); i != aabms.end(); i++)
 			{
-				if(myrand() % i->chance != 0)
+				ActiveABM *aabm = *i;
+				if(myrand() % aabm->chance != 0)
 					continue;
 
 				// Check neighbors
-				if(!i->required_neighbors.empty())
+				if(aabm->check_required_neighbors)
 				{
+					const std::vector<bool> &required =
+							aabm->required_neighbors;
 					v3s16 p1;
-					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
-					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
-					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
+					for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
+					for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
+					for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
 					{
-						if(p1 == p)
+						if(p1 == p0)
 							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
+						content_t c = getNeighborContent(block, map,
+								p1.X, p1.Y, p1.Z);
+						if(c < required.size() && required[c])
 							goto neighbor_found;
-						}
 					}
 					// No required neighbor found
 					continue;
@@ -699,8 +1074,9 @@ class ABMHandler
 neighbor_found:
 
 				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
+				StepWatchdogCulprit wc("ABM", aabm->name);
+				aabm->abm->trigger(m_env, p, n);
+				aabm->abm->trigger(m_env, p, n,
 						active_object_count, active_object_count_wider);
 
 				// Count surrounding objects again if the abms added any
@@ -713,6 +1089,110 @@ class ABMHandler
 	}
 };
 
+void ServerEnvironment::stepActiveBlockModifiers(float dtime)
+{
+	const float abm_interval = 1.0;
+	static SettingHandle<s32> abm_time_budget(g_settings, "abm_time_budget");
+	u32 time_budget_ms = MYMAX(abm_time_budget.get(), 0);
+
+	if(time_budget_ms == 0 && m_abm_handler == NULL){
+		// Handle all active blocks at once every interval
+		if(!m_active_block_modifier_interval.step(dtime, abm_interval))
+			return;
+		if(m_active_block_interval_overload_skip > 0){
+			ScopeProfiler sp(g_profiler, "SEnv: ABM overload skips");
+			m_active_block_interval_overload_skip--;
+			return;
+		}
+		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
+		TimeTaker timer("modify in active blocks");
+
+		// Initialize handling of ActiveBlockModifiers
+		ABMHandler abmhandler(m_abms, abm_interval, this, true);
+
+		for(std::set<v3s16>::iterator
+				i = m_active_blocks.m_list.begin();
+				i != m_active_blocks.m_list.end(); ++i)
+		{
+			v3s16 p = *i;
+
+			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+			if(block==NULL)
+				continue;
+
+			// Set current time as timestamp
+			block->setTimestampNoChangedFlag(m_game_time);
+
+			/* Handle ActiveBlockModifiers */
+			abmhandler.apply(block);
+		}
+
+		u32 time_ms = timer.stop(true);
+		u32 max_time_ms = 200;
+		if(time_ms > max_time_ms){
+			infostream<<"WARNING: active block modifiers took "
+					<<time_ms<<"ms (longer than "
+					<<max_time_ms<<"ms)"<<std::endl;
+			m_active_block_interval_overload_skip = (time_ms / max_time_ms) + 1;
+		}
+		return;
+	}
+
+	/*
+		Time-sliced: a pass over the active blocks is started every
+		interval and handled over as many steps as the budget requires.
+		A new pass covers all the time since the previous one started,
+		so ABM chances are compensated for passes taking long.
+	*/
+	m_abm_pass_dtime += dtime;
+	if(m_abm_handler == NULL){
+		if(m_abm_pass_dtime < abm_interval)
+			return;
+		m_abm_handler = new ABMHandler(m_abms, m_abm_pass_dtime, this, true);
+		m_abm_pass_dtime = 0;
+		m_abm_pass_blocks.assign(m_active_blocks.m_list.begin(),
+				m_active_blocks.m_list.end());
+		m_abm_pass_next_block = 0;
+	}
+
+	ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg", SPT_AVG);
+	u32 time_start = getTimeMs();
+	u32 blocks_handled = 0;
+	while(m_abm_pass_next_block < m_abm_pass_blocks.size()){
+		v3s16 p = m_abm_pass_blocks[m_abm_pass_next_block++];
+
+		// The block may have become inactive since the pass started
+		if(!m_active_blocks.contains(p))
+			continue;
+		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+		if(block==NULL)
+			continue;
+
+		// Set current time as timestamp
+		block->setTimestampNoChangedFlag(m_game_time);
+
+		m_abm_handler->apply(block);
+		blocks_handled++;
+
+		// Unlimited budget is only used to finish a pass after the
+		// setting was turned off
+		if(time_budget_ms != 0 && getTimeMs() - time_start >= time_budget_ms)
+			break;
+	}
+	g_profiler->avg("SEnv: ABM blocks handled per step", blocks_handled);
+
+	if(m_abm_pass_next_block >= m_abm_pass_blocks.size())
+		finishABMPass();
+}
+
+void ServerEnvironment::finishABMPass()
+{
+	delete m_abm_handler;
+	m_abm_handler = NULL;
+	m_abm_pass_blocks.clear();
+	m_abm_pass_next_block = 0;
+}
+
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
 	// Reset usage timer immediately, otherwise a block that becomes active
@@ -736,30 +1216,101 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	// Set current time as timestamp
 	block->setTimestampNoChangedFlag(m_game_time);
 
-	/*infostream<<"ServerEnvironment::activateBlock(): block is "
-			<<dtime_s<<" seconds old."<<std::endl;*/
-	
-	// Activate stored objects
-	activateObjects(block, dtime_s);
+	/*infostream<<"ServerEnvironment::activateBlock(): block is "
+			<<dtime_s<<" seconds old."<<std::endl;*/
+	
+	// Objects being deactivated are kept
+	for(std::map<u16, StaticObject>::iterator
+			i = block->m_static_objects.m_active.begin();
+			i != block->m_static_objects.m_active.end(); ++i)
+	{
+		ServerActiveObject *object = getActiveObject(i->first);
+		assert(object);
+		object->m_pending_deactivation = false;
+	}
+
+	// Activate stored objects, now or within the time budget of the next
+	// steps when many blocks become active at once
+	if(!block->m_static_objects.m_stored.empty()){
+		if(g_settings->getS32("object_activation_time_budget") <= 0)
+			activateObjects(block, dtime_s);
+		else
+			m_objects_to_activate.push_back(
+					std::make_pair(block->getPos(), dtime_s));
+	}
+
+	// Run node timers
+	runNodeTimers(block, dtime_s);
+
+	/* Handle ActiveBlockModifiers */
+	ABMHandler abmhandler(m_abms, dtime_s, this, false);
+	abmhandler.apply(block);
+}
+
+void ServerEnvironment::runNodeTimers(MapBlock *block, float dtime)
+{
+	std::map<v3s16, NodeTimer> elapsed_timers =
+		block->m_node_timers.step(dtime);
+	if(elapsed_timers.empty())
+		return;
+	MapNode n;
+	for(std::map<v3s16, NodeTimer>::iterator
+			i = elapsed_timers.begin();
+			i != elapsed_timers.end(); i++){
+		n = block->getNodeNoEx(i->first);
+		v3s16 p = i->first + block->getPosRelative();
+		StepWatchdogCulprit wc("node timer",
+				m_gamedef->ndef()->get(n).name);
+		if(m_script->node_on_timer(p,n,i->second.elapsed))
+			block->setNodeTimer(i->first,NodeTimer(i->second.timeout,0));
+	}
+}
+
+void ServerEnvironment::stepForceloadedLiteBlocks(float dtime)
+{
+	// Forget the blocks that were freed or became active; the latter
+	// are handled with the active blocks
+	for(std::set<v3s16>::iterator i = m_forceloaded_lite_loaded.begin();
+			i != m_forceloaded_lite_loaded.end();)
+	{
+		if(m_forceloaded_lite_list.count(*i) == 0 ||
+				m_active_blocks.contains(*i))
+			m_forceloaded_lite_loaded.erase(i++);
+		else
+			++i;
+	}
+
+	for(std::set<v3s16>::iterator i = m_forceloaded_lite_list.begin();
+			i != m_forceloaded_lite_list.end(); ++i)
+	{
+		v3s16 p = *i;
+		if(m_active_blocks.contains(p))
+			continue;
+		MapBlock *block = m_map->getBlockOrEmerge(p);
+		if(block == NULL)
+			continue;
+
+		block->resetUsageTimer();
 
-	// Run node timers
-	std::map<v3s16, NodeTimer> elapsed_timers =
-		block->m_node_timers.step((float)dtime_s);
-	if(!elapsed_timers.empty()){
-		MapNode n;
-		for(std::map<v3s16, NodeTimer>::iterator
-				i = elapsed_timers.begin();
-				i != elapsed_timers.end(); i++){
-			n = block->getNodeNoEx(i->first);
-			v3s16 p = i->first + block->getPosRelative();
-			if(m_script->node_on_timer(p,n,i->second.elapsed))
-				block->setNodeTimer(i->first,NodeTimer(i->second.timeout,0));
+		// The time the block wasn't loaded for is caught up with once,
+		// like when a block becomes active
+		float timer_dtime = dtime;
+		if(m_forceloaded_lite_loaded.insert(p).second){
+			u32 stamp = block->getTimestamp();
+			timer_dtime = 0;
+			if(m_game_time > stamp && stamp != BLOCK_TIMESTAMP_UNDEFINED)
+				timer_dtime = m_game_time - stamp;
 		}
-	}
 
-	/* Handle ActiveBlockModifiers */
-	ABMHandler abmhandler(m_abms, dtime_s, this, false);
-	abmhandler.apply(block);
+		block->setTimestampNoChangedFlag(m_game_time);
+		if(block->getTimestamp() > block->getDiskTimestamp() + 60)
+			block->raiseModified(MOD_STATE_WRITE_AT_UNLOAD,
+					"Timestamp older than 60s (step)");
+
+		runNodeTimers(block, timer_dtime);
+	}
+	g_profiler->avg("SEnv: lite forceloaded blocks",
+			m_forceloaded_lite_list.size());
 }
 
 void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
@@ -794,6 +1345,48 @@ bool ServerEnvironment::setNode(v3s16 p, const MapNode &n)
 	return true;
 }
 
+bool ServerEnvironment::setNodes(const std::vector<v3s16> &positions,
+		const std::vector<MapNode> &nodes)
+{
+	INodeDefManager *ndef = m_gamedef->ndef();
+	std::vector<MapNode> old_nodes(positions.size());
+	for (u32 i = 0; i < positions.size(); i++) {
+		old_nodes[i] = m_map->getNodeNoEx(positions[i]);
+		// Call destructor
+		if (ndef->get(old_nodes[i]).has_on_destruct)
+			m_script->node_on_destruct(positions[i], old_nodes[i]);
+	}
+
+	// The map leaves out the nodes of blocks that aren't loaded
+	std::vector<bool> loaded(positions.size());
+	for (u32 i = 0; i < positions.size(); i++) {
+		MapBlock *block = m_map->getBlockNoCreateNoEx(
+				getNodeBlockPos(positions[i]));
+		loaded[i] = block != NULL && !block->isDummy();
+	}
+
+	// Replace nodes
+	bool succeeded = m_map->addNodesWithEvent(positions, nodes);
+
+	for (u32 i = 0; i < positions.size(); i++) {
+		if (!loaded[i])
+			continue;
+
+		// Update active VoxelManipulator if a mapgen thread
+		m_map->updateVManip(positions[i]);
+
+		// Call post-destructor
+		if (ndef->get(old_nodes[i]).has_after_destruct)
+			m_script->node_after_destruct(positions[i], old_nodes[i]);
+
+		// Call constructor
+		if (ndef->get(nodes[i]).has_on_construct)
+			m_script->node_on_construct(positions[i], nodes[i]);
+	}
+
+	return succeeded;
+}
+
 bool ServerEnvironment::removeNode(v3s16 p)
 {
 	INodeDefManager *ndef = m_gamedef->ndef();
@@ -830,15 +1423,36 @@ bool ServerEnvironment::swapNode(v3s16 p, const MapNode &n)
 	return true;
 }
 
+void ServerEnvironment::getObjectCandidatesInsideRadius(v3f pos, f32 radius,
+		std::vector<u16> &objects)
+{
+	// Clamp so that huge radii don't overflow the block coordinates
+	const f32 limit = 32767 * BS;
+	v3f minpos(rangelim(pos.X - radius, -limit, limit),
+			rangelim(pos.Y - radius, -limit, limit),
+			rangelim(pos.Z - radius, -limit, limit));
+	v3f maxpos(rangelim(pos.X + radius, -limit, limit),
+			rangelim(pos.Y + radius, -limit, limit),
+			rangelim(pos.Z + radius, -limit, limit));
+	m_active_object_index.getObjectsInBlocks(
+			getNodeBlockPos(floatToInt(minpos, BS)),
+			getNodeBlockPos(floatToInt(maxpos, BS)),
+			objects);
+}
+
 std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 {
 	std::set<u16> objects;
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	std::vector<u16> candidates;
+	getObjectCandidatesInsideRadius(pos, radius, candidates);
+	for(std::vector<u16>::iterator
+			i = candidates.begin();
+			i != candidates.end(); ++i)
 	{
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
+		u16 id = *i;
+		ServerActiveObject* obj = getActiveObject(id);
+		if(obj == NULL)
+			continue;
 		v3f objectpos = obj->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
@@ -847,12 +1461,45 @@ std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 	return objects;
 }
 
+void ServerEnvironment::wakeObjectsInBlocks(const std::set<v3s16> &blocks)
+{
+	std::vector<u16> ids;
+	for(std::set<v3s16>::const_iterator
+			i = blocks.begin();
+			i != blocks.end(); ++i)
+	{
+		// The block above is woken up for each block only once
+		if(blocks.find(*i + v3s16(0,1,0)) != blocks.end())
+			m_active_object_index.getObjectsInBlocks(*i, *i, ids);
+		else
+			m_active_object_index.getObjectsInBlocks(*i, *i + v3s16(0,1,0), ids);
+	}
+	for(std::vector<u16>::iterator
+			i = ids.begin();
+			i != ids.end(); ++i)
+	{
+		ServerActiveObject *obj = getActiveObject(*i);
+		if(obj)
+			obj->wakeUp();
+	}
+}
+
+u64 ServerEnvironment::getActiveObjectMemoryUsage()
+{
+	u64 size = 0;
+	for(ServerActiveObjectMap::iterator
+			i = m_active_objects.begin();
+			i != m_active_objects.end(); ++i)
+		size += i->second->getMemoryUsage();
+	return size;
+}
+
 void ServerEnvironment::clearAllObjects()
 {
 	infostream<<"ServerEnvironment::clearAllObjects(): "
 			<<"Removing all active objects"<<std::endl;
 	std::list<u16> objects_to_remove;
-	for(std::map<u16, ServerActiveObject*>::iterator
+	for(ServerActiveObjectMap::iterator
 			i = m_active_objects.begin();
 			i != m_active_objects.end(); ++i)
 	{
@@ -893,94 +1540,160 @@ void ServerEnvironment::clearAllObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 
-	// Get list of loaded blocks
+	// Start over if already running
+	m_clear_objects = ClearObjectsProgress();
+	m_clear_objects.active = true;
+	m_clear_objects_cursor = "";
+	m_clear_objects_next_cursor = "";
+	m_clear_objects_batch.clear();
+	m_clear_objects_next_block = 0;
+	m_clear_objects_skip.clear();
+	m_clear_objects_loaded.clear();
+
+	// The loaded blocks are cleared now, and skipped by the job so that
+	// objects added to them later are kept
 	std::list<v3s16> loaded_blocks;
-	infostream<<"ServerEnvironment::clearAllObjects(): "
-			<<"Listing all loaded blocks"<<std::endl;
 	m_map->listAllLoadedBlocks(loaded_blocks);
-	infostream<<"ServerEnvironment::clearAllObjects(): "
-			<<"Done listing all loaded blocks: "
-			<<loaded_blocks.size()<<std::endl;
-
-	// Get list of loadable blocks
-	std::list<v3s16> loadable_blocks;
-	infostream<<"ServerEnvironment::clearAllObjects(): "
-			<<"Listing all loadable blocks"<<std::endl;
-	m_map->listAllLoadableBlocks(loadable_blocks);
-	infostream<<"ServerEnvironment::clearAllObjects(): "
-			<<"Done listing all loadable blocks: "
-			<<loadable_blocks.size()
-			<<", now clearing"<<std::endl;
-
-	// Grab a reference on each loaded block to avoid unloading it
 	for(std::list<v3s16>::iterator i = loaded_blocks.begin();
 			i != loaded_blocks.end(); ++i)
 	{
-		v3s16 p = *i;
-		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+		MapBlock *block = m_map->getBlockNoCreateNoEx(*i);
 		assert(block);
-		block->refGrab();
+		u32 num_objs = clearBlockObjects(block);
+		if(num_objs != 0){
+			m_clear_objects.objects_cleared += num_objs;
+			m_clear_objects.blocks_cleared++;
+		}
+		m_clear_objects.blocks_checked++;
+		m_clear_objects_skip.insert(*i);
 	}
 
-	// Remove objects in all loadable blocks
-	u32 unload_interval = g_settings->getS32("max_clearobjects_extra_loaded_blocks");
-	unload_interval = MYMAX(unload_interval, 1);
-	u32 report_interval = loadable_blocks.size() / 10;
-	u32 num_blocks_checked = 0;
-	u32 num_blocks_cleared = 0;
-	u32 num_objs_cleared = 0;
-	for(std::list<v3s16>::iterator i = loadable_blocks.begin();
-			i != loadable_blocks.end(); ++i)
+	actionstream<<"Clearing all objects: cleared "
+			<<m_clear_objects.objects_cleared<<" objects in "
+			<<loaded_blocks.size()<<" loaded blocks, the rest of the world "
+			<<"is done in the background"<<std::endl;
+}
+
+bool ServerEnvironment::getClearObjectsProgress(ClearObjectsProgress &progress)
+{
+	progress = m_clear_objects;
+	return m_clear_objects.active;
+}
+
+u32 ServerEnvironment::clearBlockObjects(MapBlock *block)
+{
+	StaticObjectList &list = block->m_static_objects;
+	u32 num_objs = list.m_stored.size() + list.m_active.size();
+	if(num_objs == 0)
+		return 0;
+
+	// Objects activated from the block are removed by
+	// removeRemovedObjects(), which also tells the clients
+	for(std::map<u16, StaticObject>::iterator i = list.m_active.begin();
+			i != list.m_active.end(); ++i)
 	{
-		v3s16 p = *i;
+		ServerActiveObject *obj = getActiveObject(i->first);
+		if(obj == NULL || obj->getType() == ACTIVEOBJECT_TYPE_PLAYER)
+			continue;
+		obj->m_static_exists = false;
+		obj->m_removed = true;
+	}
+
+	list.m_stored.clear();
+	list.m_active.clear();
+	block->raiseModified(MOD_STATE_WRITE_NEEDED, "clearAllObjects");
+	return num_objs;
+}
+
+void ServerEnvironment::stepClearObjects()
+{
+	if(!m_clear_objects.active)
+		return;
+
+	static SettingHandle<s32> time_budget_setting(g_settings,
+			"clearobjects_time_budget");
+	static SettingHandle<s32> max_loaded_setting(g_settings,
+			"max_clearobjects_extra_loaded_blocks");
+	u32 time_budget_ms = MYMAX(time_budget_setting.get(), 1);
+	u32 max_loaded = MYMAX(max_loaded_setting.get(), 1);
+
+	u32 time_start = getTimeMs();
+	while(getTimeMs() - time_start < time_budget_ms)
+	{
+		if(m_clear_objects_next_block >= m_clear_objects_batch.size()){
+			m_clear_objects_cursor = m_clear_objects_next_cursor;
+			m_clear_objects_next_block = 0;
+			if(!m_map->listLoadableBlocks(m_clear_objects_next_cursor,
+					1000, m_clear_objects_batch)){
+				finishClearObjects();
+				return;
+			}
+			infostream<<"ServerEnvironment::clearAllObjects(): "
+					<<"Cleared "<<m_clear_objects.objects_cleared<<" objects"
+					<<" in "<<m_clear_objects.blocks_cleared<<" blocks ("
+					<<m_clear_objects.blocks_checked<<" blocks checked)"
+					<<std::endl;
+			continue;
+		}
+
+		v3s16 p = m_clear_objects_batch[m_clear_objects_next_block++];
+		if(m_clear_objects_skip.count(p) != 0)
+			continue;
+
+		bool was_loaded = (m_map->getBlockNoCreateNoEx(p) != NULL);
 		MapBlock *block = m_map->emergeBlock(p, false);
 		if(!block){
 			errorstream<<"ServerEnvironment::clearAllObjects(): "
 					<<"Failed to emerge block "<<PP(p)<<std::endl;
 			continue;
 		}
-		u32 num_stored = block->m_static_objects.m_stored.size();
-		u32 num_active = block->m_static_objects.m_active.size();
-		if(num_stored != 0 || num_active != 0){
-			block->m_static_objects.m_stored.clear();
-			block->m_static_objects.m_active.clear();
-			block->raiseModified(MOD_STATE_WRITE_NEEDED,
-					"clearAllObjects");
-			num_objs_cleared += num_stored + num_active;
-			num_blocks_cleared++;
+		u32 num_objs = clearBlockObjects(block);
+		if(num_objs != 0){
+			m_clear_objects.objects_cleared += num_objs;
+			m_clear_objects.blocks_cleared++;
 		}
-		num_blocks_checked++;
+		m_clear_objects.blocks_checked++;
 
-		if(report_interval != 0 &&
-				num_blocks_checked % report_interval == 0){
-			float percent = 100.0 * (float)num_blocks_checked /
-					loadable_blocks.size();
-			infostream<<"ServerEnvironment::clearAllObjects(): "
-					<<"Cleared "<<num_objs_cleared<<" objects"
-					<<" in "<<num_blocks_cleared<<" blocks ("
-					<<percent<<"%)"<<std::endl;
-		}
-		if(num_blocks_checked % unload_interval == 0){
-			m_map->unloadUnreferencedBlocks();
-		}
+		if(!was_loaded)
+			m_clear_objects_loaded.push_back(p);
+		if(m_clear_objects_loaded.size() >= max_loaded)
+			unloadClearObjectsBlocks();
 	}
-	m_map->unloadUnreferencedBlocks();
+}
 
-	// Drop references that were added above
-	for(std::list<v3s16>::iterator i = loaded_blocks.begin();
-			i != loaded_blocks.end(); ++i)
+void ServerEnvironment::unloadClearObjectsBlocks()
+{
+	// Players may have come to some of them in the meantime
+	std::vector<v3s16> blocks;
+	for(std::vector<v3s16>::iterator i = m_clear_objects_loaded.begin();
+			i != m_clear_objects_loaded.end(); ++i)
 	{
-		v3s16 p = *i;
-		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-		assert(block);
-		block->refDrop();
+		if(!m_active_blocks.contains(*i))
+			blocks.push_back(*i);
 	}
+	m_map->unloadBlocks(blocks);
+	m_clear_objects_loaded.clear();
+}
 
-	infostream<<"ServerEnvironment::clearAllObjects(): "
-			<<"Finished: Cleared "<<num_objs_cleared<<" objects"
-			<<" in "<<num_blocks_cleared<<" blocks"<<std::endl;
+void ServerEnvironment::finishClearObjects()
+{
+	unloadClearObjectsBlocks();
+
+	actionstream<<"Finished clearing all objects: cleared "
+			<<m_clear_objects.objects_cleared<<" objects in "
+			<<m_clear_objects.blocks_cleared<<" blocks ("
+			<<m_clear_objects.blocks_checked<<" blocks checked)"<<std::endl;
+
+	m_clear_objects.active = false;
+	m_clear_objects_cursor = "";
+	m_clear_objects_next_cursor = "";
+	m_clear_objects_batch.clear();
+	m_clear_objects_next_block = 0;
+	m_clear_objects_skip.clear();
+	m_clear_objects_loaded.clear();
 }
 
 void ServerEnvironment::step(float dtime)
@@ -1012,6 +1725,7 @@ void ServerEnvironment::step(float dtime)
 	*/
 	{
 		ScopeProfiler sp(g_profiler, "SEnv: handle players avg", SPT_AVG);
+		StepWatchdogPhase wp("player movement");
 		for(std::list<Player*>::iterator i = m_players.begin();
 				i != m_players.end(); ++i)
 		{
@@ -1032,10 +1746,11 @@ void ServerEnvironment::step(float dtime)
 	if(m_active_blocks_management_interval.step(dtime, 2.0))
 	{
 		ScopeProfiler sp(g_profiler, "SEnv: manage act. block list avg /2s", SPT_AVG);
+		StepWatchdogPhase wp("active blocks");
 		/*
 			Get player block positions
 		*/
-		std::list<v3s16> players_blockpos;
+		std::map<u16, v3s16> players_blockpos;
 		for(std::list<Player*>::iterator
 				i = m_players.begin();
 				i != m_players.end(); ++i)
@@ -1046,13 +1761,15 @@ void ServerEnvironment::step(float dtime)
 				continue;
 			v3s16 blockpos = getNodeBlockPos(
 					floatToInt(player->getPosition(), BS));
-			players_blockpos.push_back(blockpos);
+			players_blockpos[player->peer_id] = blockpos;
 		}
 		
 		/*
 			Update list of active blocks, collecting changes
 		*/
-		const s16 active_block_range = g_settings->getS16("active_block_range");
+		static SettingHandle<s16> active_block_range_setting(g_settings,
+				"active_block_range");
+		const s16 active_block_range = active_block_range_setting.get();
 		std::set<v3s16> blocks_removed;
 		std::set<v3s16> blocks_added;
 		m_active_blocks.update(players_blockpos, active_block_range,
@@ -1062,8 +1779,9 @@ void ServerEnvironment::step(float dtime)
 			Handle removed blocks
 		*/
 
-		// Convert active objects that are no more in active blocks to static
-		deactivateFarObjects(false);
+		// Convert active objects that are no more in active blocks to
+		// static, below
+		m_far_objects_left = true;
 		
 		for(std::set<v3s16>::iterator
 				i = blocks_removed.begin();
@@ -1094,7 +1812,7 @@ void ServerEnvironment::step(float dtime)
 
 			MapBlock *block = m_map->getBlockOrEmerge(p);
 			if(block==NULL){
-				m_active_blocks.m_list.erase(p);
+				m_active_blocks.retryLater(p);
 				continue;
 			}
 
@@ -1104,12 +1822,25 @@ void ServerEnvironment::step(float dtime)
 		}
 	}
 
+	/*
+		Convert objects between active and static, within the time budget
+	*/
+	if(m_far_objects_left || !m_objects_to_activate.empty())
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: (de)activate objects avg", SPT_AVG);
+		StepWatchdogPhase wp("object activation");
+		if(m_far_objects_left)
+			deactivateFarObjects(false);
+		activateQueuedObjects();
+	}
+
 	/*
 		Mess around in active blocks
 	*/
 	if(m_active_blocks_nodemetadata_interval.step(dtime, 1.0))
 	{
 		ScopeProfiler sp(g_profiler, "SEnv: mess in act. blocks avg /1s", SPT_AVG);
+		StepWatchdogPhase wp("node timers");
 		
 		float dtime = 1.0;
 
@@ -1138,76 +1869,44 @@ void ServerEnvironment::step(float dtime)
 						"Timestamp older than 60s (step)");
 
 			// Run node timers
-			std::map<v3s16, NodeTimer> elapsed_timers =
-				block->m_node_timers.step((float)dtime);
-			if(!elapsed_timers.empty()){
-				MapNode n;
-				for(std::map<v3s16, NodeTimer>::iterator
-						i = elapsed_timers.begin();
-						i != elapsed_timers.end(); i++){
-					n = block->getNodeNoEx(i->first);
-					p = i->first + block->getPosRelative();
-					if(m_script->node_on_timer(p,n,i->second.elapsed))
-						block->setNodeTimer(i->first,NodeTimer(i->second.timeout,0));
-				}
-			}
+			runNodeTimers(block, dtime);
 		}
+
+		stepForceloadedLiteBlocks(dtime);
 	}
 	
-	const float abm_interval = 1.0;
-	if(m_active_block_modifier_interval.step(dtime, abm_interval))
-	do{ // breakable
-		if(m_active_block_interval_overload_skip > 0){
-			ScopeProfiler sp(g_profiler, "SEnv: ABM overload skips");
-			m_active_block_interval_overload_skip--;
-			break;
-		}
-		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
-		TimeTaker timer("modify in active blocks");
-		
-		// Initialize handling of ActiveBlockModifiers
-		ABMHandler abmhandler(m_abms, abm_interval, this, true);
-
-		for(std::set<v3s16>::iterator
-				i = m_active_blocks.m_list.begin();
-				i != m_active_blocks.m_list.end(); ++i)
-		{
-			v3s16 p = *i;
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block==NULL)
-				continue;
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
+	/*
+		Run ActiveBlockModifiers
+	*/
+	{
+		StepWatchdogPhase wp("ABMs");
+		stepActiveBlockModifiers(dtime);
+	}
 
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
-		}
+	/*
+		Go on clearing objects
+	*/
+	if(m_clear_objects.active)
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: clear objects avg", SPT_AVG);
+		StepWatchdogPhase wp("clear objects");
+		stepClearObjects();
+	}
 
-		u32 time_ms = timer.stop(true);
-		u32 max_time_ms = 200;
-		if(time_ms > max_time_ms){
-			infostream<<"WARNING: active block modifiers took "
-					<<time_ms<<"ms (longer than "
-					<<max_time_ms<<"ms)"<<std::endl;
-			m_active_block_interval_overload_skip = (time_ms / max_time_ms) + 1;
-		}
-	}while(0);
-	
 	/*
 		Step script environment (run global on_step())
 	*/
-	m_script->environment_Step(dtime);
+	{
+		StepWatchdogPhase wp("globalsteps");
+		m_script->environment_Step(dtime);
+	}
 
 	/*
 		Step active objects
 	*/
 	{
 		ScopeProfiler sp(g_profiler, "SEnv: step act. objs avg", SPT_AVG);
+		StepWatchdogPhase wp("objects");
 		//TimeTaker timer("Step active objects");
 
 		g_profiler->avg("SEnv: num of objects", m_active_objects.size());
@@ -1221,7 +1920,9 @@ void ServerEnvironment::step(float dtime)
 			send_recommended = true;
 		}
 
-		for(std::map<u16, ServerActiveObject*>::iterator
+		std::vector<ServerActiveObject*> stepped;
+		stepped.reserve(m_active_objects.size());
+		for(ServerActiveObjectMap::iterator
 				i = m_active_objects.begin();
 				i != m_active_objects.end(); ++i)
 		{
@@ -1231,12 +1932,26 @@ void ServerEnvironment::step(float dtime)
 				continue;
 			// Step object
 			obj->step(dtime, send_recommended);
+			stepped.push_back(obj);
+		}
+
+		stepEntityCallbacks(stepped);
+
+		// Objects can't be deleted before removeRemovedObjects()
+		for(std::vector<ServerActiveObject*>::iterator
+				i = stepped.begin();
+				i != stepped.end(); ++i)
+		{
+			ServerActiveObject* obj = *i;
+			obj->finishStep();
+			// Objects may move their base position directly while stepping
+			updateActiveObjectBlock(obj);
 			// Read messages from object
-			while(!obj->m_messages_out.empty())
-			{
-				m_active_object_messages.push_back(
-						obj->m_messages_out.pop_front());
-			}
+			for(std::vector<ActiveObjectMessage>::iterator
+					j = obj->m_messages_out.begin();
+					j != obj->m_messages_out.end(); ++j)
+				m_active_object_messages.add(*j);
+			obj->m_messages_out.clear();
 		}
 	}
 	
@@ -1246,6 +1961,7 @@ void ServerEnvironment::step(float dtime)
 	if(m_object_management_interval.step(dtime, 0.5))
 	{
 		ScopeProfiler sp(g_profiler, "SEnv: remove removed objs avg /.5s", SPT_AVG);
+		StepWatchdogPhase wp("object removal");
 		/*
 			Remove objects that satisfy (m_removed && m_known_by_count==0)
 		*/
@@ -1253,17 +1969,60 @@ void ServerEnvironment::step(float dtime)
 	}
 }
 
+void ServerEnvironment::stepEntityCallbacks(
+		const std::vector<ServerActiveObject*> &objects)
+{
+	std::map<std::string, std::vector<LuaEntitySAO*> > kinds;
+	for(std::vector<ServerActiveObject*>::const_iterator
+			i = objects.begin();
+			i != objects.end(); ++i)
+	{
+		if((*i)->getType() != ACTIVEOBJECT_TYPE_LUAENTITY)
+			continue;
+		LuaEntitySAO *entity = (LuaEntitySAO*)*i;
+		float dtime;
+		if(entity->getPendingOnStep(dtime))
+			kinds[entity->getName()].push_back(entity);
+	}
+
+	std::vector<u16> ids;
+	std::vector<float> dtimes;
+	std::vector<bool> has_on_step;
+	for(std::map<std::string, std::vector<LuaEntitySAO*> >::iterator
+			i = kinds.begin();
+			i != kinds.end(); ++i)
+	{
+		std::vector<LuaEntitySAO*> &entities = i->second;
+		ids.resize(entities.size());
+		dtimes.resize(entities.size());
+		for(u32 j = 0; j < entities.size(); j++){
+			ids[j] = entities[j]->getId();
+			entities[j]->getPendingOnStep(dtimes[j]);
+		}
+		StepWatchdogCulprit wc("entity", i->first);
+		m_script->luaentity_StepBatch(i->first, ids, dtimes, has_on_step);
+		for(u32 j = 0; j < entities.size(); j++)
+			entities[j]->onStepDone(has_on_step[j]);
+	}
+}
+
 ServerActiveObject* ServerEnvironment::getActiveObject(u16 id)
 {
-	std::map<u16, ServerActiveObject*>::iterator n;
+	ServerActiveObjectMap::iterator n;
 	n = m_active_objects.find(id);
 	if(n == m_active_objects.end())
 		return NULL;
 	return n->second;
 }
 
+void ServerEnvironment::updateActiveObjectBlock(ServerActiveObject *object)
+{
+	m_active_object_index.update(object->getId(),
+			getNodeBlockPos(floatToInt(object->getBasePosition(), BS)));
+}
+
 bool isFreeServerActiveObjectId(u16 id,
-		std::map<u16, ServerActiveObject*> &objects)
+		ServerActiveObjectMap &objects)
 {
 	if(id == 0)
 		return false;
@@ -1272,7 +2031,7 @@ bool isFreeServerActiveObjectId(u16 id,
 }
 
 u16 getFreeServerActiveObjectId(
-		std::map<u16, ServerActiveObject*> &objects)
+		ServerActiveObjectMap &objects)
 {
 	//try to reuse id's as late as possible
 	static u16 last_used_id = 0;
@@ -1347,8 +2106,8 @@ bool ServerEnvironment::addActiveObjectAsStatic(ServerActiveObject *obj)
 */
 void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 		s16 player_radius,
-		std::set<u16> &current_objects,
-		std::set<u16> &added_objects)
+		const DenseIdSet &current_objects,
+		std::vector<u16> &added_objects)
 {
 	v3f pos_f = intToFloat(pos, BS);
 	f32 radius_f = radius * BS;
@@ -1358,19 +2117,41 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 		player_radius_f = 0;
 
 	/*
-		Go through the object list,
+		Collect candidates from the blocks around pos. With an unlimited
+		player radius, players are added from the player list instead.
+	*/
+	std::vector<u16> candidates;
+	getObjectCandidatesInsideRadius(pos_f,
+			player_radius_f != 0 ? MYMAX(radius_f, player_radius_f) : radius_f,
+			candidates);
+	if (player_radius_f == 0) {
+		for(std::list<Player*>::iterator i = m_players.begin();
+				i != m_players.end(); ++i)
+		{
+			PlayerSAO *playersao = (*i)->getPlayerSAO();
+			if(playersao != NULL)
+				candidates.push_back(playersao->getId());
+		}
+		// Players in the blocks around pos are in both
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()),
+				candidates.end());
+	}
+
+	/*
+		Go through the candidates,
 		- discard m_removed objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	for(std::vector<u16>::iterator
+			i = candidates.begin();
+			i != candidates.end(); ++i)
 	{
-		u16 id = i->first;
+		u16 id = *i;
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if(object == NULL)
 			continue;
 		// Discard if removed or deactivating
@@ -1386,12 +2167,10 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 			continue;
 
 		// Discard if already on current_objects
-		std::set<u16>::iterator n;
-		n = current_objects.find(id);
-		if(n != current_objects.end())
+		if(current_objects.count(id) != 0)
 			continue;
 		// Add to added_objects
-		added_objects.insert(id);
+		added_objects.push_back(id);
 	}
 }
 
@@ -1401,8 +2180,8 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 */
 void ServerEnvironment::getRemovedActiveObjects(v3s16 pos, s16 radius,
 		s16 player_radius,
-		std::set<u16> &current_objects,
-		std::set<u16> &removed_objects)
+		const DenseIdSet &current_objects,
+		std::vector<u16> &removed_objects)
 {
 	v3f pos_f = intToFloat(pos, BS);
 	f32 radius_f = radius * BS;
@@ -1419,7 +2198,7 @@ void ServerEnvironment::getRemovedActiveObjects(v3s16 pos, s16 radius,
 		- object has m_removed=true, or
 		- object is too far away
 	*/
-	for(std::set<u16>::iterator
+	for(DenseIdSet::const_iterator
 			i = current_objects.begin();
 			i != current_objects.end(); ++i)
 	{
@@ -1429,13 +2208,13 @@ void ServerEnvironment::getRemovedActiveObjects(v3s16 pos, s16 radius,
 		if(object == NULL){
 			infostream<<"ServerEnvironment::getRemovedActiveObjects():"
 					<<" object in current_objects is NULL"<<std::endl;
-			removed_objects.insert(id);
+			removed_objects.push_back(id);
 			continue;
 		}
 
 		if(object->m_removed || object->m_pending_deactivation)
 		{
-			removed_objects.insert(id);
+			removed_objects.push_back(id);
 			continue;
 		}
 		
@@ -1447,20 +2226,10 @@ void ServerEnvironment::getRemovedActiveObjects(v3s16 pos, s16 radius,
 			continue;
 
 		// Object is no longer visible
-		removed_objects.insert(id);
+		removed_objects.push_back(id);
 	}
 }
 
-ActiveObjectMessage ServerEnvironment::getActiveObjectMessage()
-{
-	if(m_active_object_messages.empty())
-		return ActiveObjectMessage(0);
-	
-	ActiveObjectMessage message = m_active_object_messages.front();
-	m_active_object_messages.pop_front();
-	return message;
-}
-
 /*
 	************ Private methods *************
 */
@@ -1497,6 +2266,8 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 			
 	m_active_objects[object->getId()] = object;
+	m_active_object_index.insert(object->getId(),
+			getNodeBlockPos(floatToInt(object->getBasePosition(), BS)));
   
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1543,7 +2314,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 void ServerEnvironment::removeRemovedObjects()
 {
 	std::list<u16> objects_to_remove;
-	for(std::map<u16, ServerActiveObject*>::iterator
+	for(ServerActiveObjectMap::iterator
 			i = m_active_objects.begin();
 			i != m_active_objects.end(); ++i)
 	{
@@ -1624,6 +2395,7 @@ void ServerEnvironment::removeRemovedObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
@@ -1730,18 +2502,6 @@ void ServerEnvironment::activateObjects(MapBlock *block, u32 dtime_s)
 		block->m_static_objects.m_stored.push_back(s_obj);
 	}
 
-	// Turn the active counterparts of activated objects not pending for
-	// deactivation
-	for(std::map<u16, StaticObject>::iterator
-			i = block->m_static_objects.m_active.begin();
-			i != block->m_static_objects.m_active.end(); ++i)
-	{
-		u16 id = i->first;
-		ServerActiveObject *object = getActiveObject(id);
-		assert(object);
-		object->m_pending_deactivation = false;
-	}
-
 	/*
 		Note: Block hasn't really been modified here.
 		The objects have just been activated and moved from the stored
@@ -1752,6 +2512,33 @@ void ServerEnvironment::activateObjects(MapBlock *block, u32 dtime_s)
 	*/
 }
 
+void ServerEnvironment::activateQueuedObjects()
+{
+	static SettingHandle<s32> time_budget_setting(g_settings,
+			"object_activation_time_budget");
+	s32 time_budget_ms = time_budget_setting.get();
+	u32 time_start = getTimeMs();
+	while(!m_objects_to_activate.empty())
+	{
+		if(time_budget_ms > 0 &&
+				getTimeMs() - time_start >= (u32)time_budget_ms)
+			break;
+		v3s16 p = m_objects_to_activate.front().first;
+		u32 dtime_s = m_objects_to_activate.front().second;
+		m_objects_to_activate.pop_front();
+
+		// The stored objects stay in blocks that became inactive again
+		if(!m_active_blocks.contains(p))
+			continue;
+		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+		if(block == NULL)
+			continue;
+		activateObjects(block, dtime_s);
+	}
+	g_profiler->avg("SEnv: blocks left to activate objects in",
+			m_objects_to_activate.size());
+}
+
 /*
 	Convert objects that are not standing inside active blocks to static.
 
@@ -1765,8 +2552,9 @@ void ServerEnvironment::activateObjects(MapBlock *block, u32 dtime_s)
 */
 void ServerEnvironment::deactivateFarObjects(bool force_delete)
 {
-	std::list<u16> objects_to_remove;
-	for(std::map<u16, ServerActiveObject*>::iterator
+	// Objects to convert by the block they are in
+	std::map<v3s16, std::vector<u16> > far_objects;
+	for(ServerActiveObjectMap::iterator
 			i = m_active_objects.begin();
 			i != m_active_objects.end(); ++i)
 	{
@@ -1832,12 +2620,70 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 		if(!force_delete && m_active_blocks.contains(blockpos_o))
 			continue;
 
-		verbosestream<<"ServerEnvironment::deactivateFarObjects(): "
-				<<"deactivating object id="<<id<<" on inactive block "
-				<<PP(blockpos_o)<<std::endl;
+		far_objects[blockpos_o].push_back(id);
+	}
+
+	// The blocks left for the next steps are found again then
+	m_far_objects_left = false;
+	static SettingHandle<s32> time_budget_setting(g_settings,
+			"object_activation_time_budget");
+	s32 time_budget_ms = force_delete ? 0 : time_budget_setting.get();
+	u32 time_start = getTimeMs();
+	std::list<u16> objects_to_remove;
+	for(std::map<v3s16, std::vector<u16> >::iterator
+			i = far_objects.begin();
+			i != far_objects.end(); ++i)
+	{
+		if(time_budget_ms > 0 &&
+				getTimeMs() - time_start >= (u32)time_budget_ms){
+			m_far_objects_left = true;
+			break;
+		}
+		deactivateBlockObjects(i->first, i->second, force_delete,
+				objects_to_remove);
+	}
+
+	// Remove references from m_active_objects
+	for(std::list<u16>::iterator i = objects_to_remove.begin();
+			i != objects_to_remove.end(); ++i)
+	{
+		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
+	}
+}
+
+void ServerEnvironment::deactivateBlockObjects(v3s16 blockpos,
+		const std::vector<u16> &ids, bool force_delete,
+		std::list<u16> &objects_to_remove)
+{
+	verbosestream<<"ServerEnvironment::deactivateFarObjects(): "
+			<<"deactivating "<<ids.size()<<" objects on inactive block "
+			<<PP(blockpos)<<std::endl;
+
+	// Get or generate the block
+	MapBlock *block = NULL;
+	try{
+		block = m_map->emergeBlock(blockpos);
+	} catch(InvalidPositionException &e){
+		// Handled via NULL pointer
+		// NOTE: emergeBlock's failure is usually determined by it
+		//       actually returning NULL
+	}
+	// Marked once for all the objects
+	bool block_modified = false;
+	u16 max_objects = g_settings->getU16("max_objects_per_block");
+
+	for(std::vector<u16>::const_iterator i = ids.begin();
+			i != ids.end(); ++i)
+	{
+		u16 id = *i;
+		ServerActiveObject *obj = getActiveObject(id);
+		assert(obj);
+		v3f objectpos = obj->getBasePosition();
 
 		// If known by some client, don't immediately delete.
 		bool pending_delete = (obj->m_known_by_count > 0 && !force_delete);
+		bool delete_obj = force_delete;
 
 		/*
 			Update the static data
@@ -1852,15 +2698,19 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 			bool stays_in_same_block = false;
 			bool data_changed = true;
 
+			// Block the old static data is in
+			MapBlock *old_block = NULL;
 			if(obj->m_static_exists){
-				if(obj->m_static_block == blockpos_o)
+				if(obj->m_static_block == blockpos)
 					stays_in_same_block = true;
 
-				MapBlock *block = m_map->emergeBlock(obj->m_static_block, false);
-				
+				old_block = stays_in_same_block ? block :
+						m_map->emergeBlock(obj->m_static_block, false);
+			}
+			if(old_block){
 				std::map<u16, StaticObject>::iterator n =
-						block->m_static_objects.m_active.find(id);
-				if(n != block->m_static_objects.m_active.end()){
+						old_block->m_static_objects.m_active.find(id);
+				if(n != old_block->m_static_objects.m_active.end()){
 					StaticObject static_old = n->second;
 
 					float save_movem = obj->getMinimumSavedMovement();
@@ -1879,43 +2729,30 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 			bool shall_be_written = (!stays_in_same_block || data_changed);
 			
 			// Delete old static object
-			if(obj->m_static_exists)
+			if(old_block)
 			{
-				MapBlock *block = m_map->emergeBlock(obj->m_static_block, false);
-				if(block)
-				{
-					block->m_static_objects.remove(id);
-					obj->m_static_exists = false;
-					// Only mark block as modified if data changed considerably
-					if(shall_be_written)
-						block->raiseModified(MOD_STATE_WRITE_NEEDED,
-								"deactivateFarObjects: Static data "
-								"changed considerably");
-				}
+				old_block->m_static_objects.remove(id);
+				obj->m_static_exists = false;
+				// Only mark block as modified if data changed considerably
+				if(shall_be_written && old_block == block)
+					block_modified = true;
+				else if(shall_be_written)
+					old_block->raiseModified(MOD_STATE_WRITE_NEEDED,
+							"deactivateFarObjects: Static data "
+							"changed considerably");
 			}
 
 			// Add to the block where the object is located in
-			v3s16 blockpos = getNodeBlockPos(floatToInt(objectpos, BS));
-			// Get or generate the block
-			MapBlock *block = NULL;
-			try{
-				block = m_map->emergeBlock(blockpos);
-			} catch(InvalidPositionException &e){
-				// Handled via NULL pointer
-				// NOTE: emergeBlock's failure is usually determined by it
-				//       actually returning NULL
-			}
-
 			if(block)
 			{
-				if(block->m_static_objects.m_stored.size() >= g_settings->getU16("max_objects_per_block")){
+				if(block->m_static_objects.m_stored.size() >= max_objects){
 					errorstream<<"ServerEnv: Trying to store id="<<obj->getId()
 							<<" statically but block "<<PP(blockpos)
 							<<" already contains "
 							<<block->m_static_objects.m_stored.size()
 							<<" objects."
 							<<" Forcing delete."<<std::endl;
-					force_delete = true;
+					delete_obj = true;
 				} else {
 					// If static counterpart already exists in target block,
 					// remove it first.
@@ -1935,16 +2772,14 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 					
 					// Only mark block as modified if data changed considerably
 					if(shall_be_written)
-						block->raiseModified(MOD_STATE_WRITE_NEEDED,
-								"deactivateFarObjects: Static data "
-								"changed considerably");
+						block_modified = true;
 					
 					obj->m_static_exists = true;
 					obj->m_static_block = block->getPos();
 				}
 			}
 			else{
-				if(!force_delete){
+				if(!delete_obj){
 					v3s16 p = floatToInt(objectpos, BS);
 					errorstream<<"ServerEnv: Could not find or generate "
 							<<"a block for storing id="<<obj->getId()
@@ -1959,7 +2794,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 			Otherwise delete it immediately.
 		*/
 
-		if(pending_delete && !force_delete)
+		if(pending_delete && !delete_obj)
 		{
 			verbosestream<<"ServerEnvironment::deactivateFarObjects(): "
 					<<"object id="<<id<<" is known by clients"
@@ -1985,15 +2820,11 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 		objects_to_remove.push_back(id);
 	}
 
-	// Remove references from m_active_objects
-	for(std::list<u16>::iterator i = objects_to_remove.begin();
-			i != objects_to_remove.end(); ++i)
-	{
-		m_active_objects.erase(*i);
-	}
+	if(block_modified)
+		block->raiseModified(MOD_STATE_WRITE_NEEDED,
+				"deactivateFarObjects: Static data changed considerably");
 }
 
-
 #ifndef SERVER
 
 #include "clientsimpleobject.h"
@@ -33,15 +33,19 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <list>
 #include <map>
+#include <vector>
+#include <deque>
 #include "irr_v3d.h"
 #include "activeobject.h"
 #include "util/numeric.h"
+#include "util/container.h"
 #include "mapnode.h"
 #include "mapblock.h"
 #include "jthread/jmutex.h"
 
 class ServerEnvironment;
 class ActiveBlockModifier;
+class ABMHandler;
 class ServerActiveObject;
 class ITextureSource;
 class IGameDef;
@@ -50,6 +54,8 @@ class ServerMap;
 class ClientMap;
 class GameScripting;
 class Player;
+class RemotePlayer;
+class path_cache;
 
 class Environment
 {
@@ -109,8 +115,16 @@ class Environment
 	u32 m_added_objects;
 
 protected:
+	// Drops the player from the indexes before it is deleted
+	void unindexPlayer(Player *player);
+
 	// peer_ids in here should be unique, except that there may be many 0s
 	std::list<Player*> m_players;
+	// Indexes of m_players. Player::peer_id is set directly in many
+	// places, so the entries by peer id are checked when used and found
+	// again in m_players when wrong or missing.
+	std::map<std::string, Player*> m_players_by_name;
+	std::map<u16, Player*> m_players_by_peer_id;
 	// Time of day in milli-hours (0-23999); determines day and night
 	u32 m_time_of_day;
 	// Time of day in 0...1
@@ -139,7 +153,10 @@ class ActiveBlockModifier
 public:
 	ActiveBlockModifier(){};
 	virtual ~ActiveBlockModifier(){};
-	
+
+	// Names the ABM in the reports of slow steps
+	virtual std::string getName()
+	{ return "(unnamed)"; }
 	// Set of contents to trigger on
 	virtual std::set<std::string> getTriggerContents()=0;
 	// Set of required neighbors (trigger doesn't happen if none are found)
@@ -168,10 +185,16 @@ struct ABMWithState
 	List of active blocks, used by ServerEnvironment
 */
 
+/*
+	The blocks around the players and the forceloaded ones. Each block
+	counts the players and forceloads wanting it, so that an update only
+	goes through the players that moved to another block.
+*/
 class ActiveBlockList
 {
 public:
-	void update(std::list<v3s16> &active_positions,
+	// active_positions: block position of each player, by peer id
+	void update(std::map<u16, v3s16> &active_positions,
 			s16 radius,
 			std::set<v3s16> &blocks_removed,
 			std::set<v3s16> &blocks_added);
@@ -180,22 +203,107 @@ class ActiveBlockList
 		return (m_list.find(p) != m_list.end());
 	}
 
+	// The block couldn't be activated; it is added again on the next
+	// update if it is still wanted then
+	void retryLater(v3s16 p){
+		if(m_list.erase(p) != 0)
+			m_retry.insert(p);
+	}
+
 	void clear(){
 		m_list.clear();
+		m_refs.clear();
+		m_players.clear();
+		m_forceloaded_refs.clear();
+		m_retry.clear();
 	}
 
 	std::set<v3s16> m_list;
 	std::set<v3s16> m_forceloaded_list;
 
 private:
+	struct Area
+	{
+		v3s16 center;
+		s16 radius;
+	};
+
+	// Counts the blocks of area b that aren't in area a (if not NULL)
+	void acquire(const Area &b, const Area *a,
+			std::set<v3s16> &blocks_removed,
+			std::set<v3s16> &blocks_added);
+	// Releases the blocks of area a that aren't in area b (if not NULL)
+	void release(const Area &a, const Area *b,
+			std::set<v3s16> &blocks_removed,
+			std::set<v3s16> &blocks_added);
+	void acquireBlock(v3s16 p,
+			std::set<v3s16> &blocks_removed,
+			std::set<v3s16> &blocks_added);
+	void releaseBlock(v3s16 p,
+			std::set<v3s16> &blocks_removed,
+			std::set<v3s16> &blocks_added);
+
+	// Number of players and forceloads wanting each block
+	std::map<v3s16, u16> m_refs;
+	// Area counted for each player
+	std::map<u16, Area> m_players;
+	// Forceloaded blocks counted
+	std::set<v3s16> m_forceloaded_refs;
+	std::set<v3s16> m_retry;
 };
 
+/*
+	Spatial index of active objects by the MapBlock their base position
+	is in, used by ServerEnvironment to answer area queries without
+	walking every active object.
+*/
+
+class ActiveObjectBlockIndex
+{
+public:
+	void insert(u16 id, v3s16 blockpos);
+	void remove(u16 id);
+	// Moves the object to blockpos if it changed block
+	void update(u16 id, v3s16 blockpos);
+	// Appends the ids of all objects in blocks within [minp, maxp]
+	void getObjectsInBlocks(v3s16 minp, v3s16 maxp,
+			std::vector<u16> &objects) const;
+
+	void clear()
+	{
+		m_blocks.clear();
+		m_object_blocks.clear();
+	}
+
+private:
+	std::map<v3s16, std::set<u16> > m_blocks;
+	std::map<u16, v3s16> m_object_blocks;
+};
+
+// Active objects by id; the ids are the ones sent to clients
+typedef DenseIdMap<ServerActiveObject*> ServerActiveObjectMap;
+
 /*
 	The server-side environment.
 
 	This is not thread-safe. Server uses an environment mutex.
 */
 
+struct ClearObjectsProgress
+{
+	ClearObjectsProgress():
+		active(false),
+		blocks_checked(0),
+		blocks_cleared(0),
+		objects_cleared(0)
+	{}
+
+	bool active;
+	u32 blocks_checked;
+	u32 blocks_cleared;
+	u32 objects_cleared;
+};
+
 class ServerEnvironment : public Environment
 {
 public:
@@ -214,6 +322,10 @@ class ServerEnvironment : public Environment
 	IGameDef *getGameDef()
 		{ return m_gamedef; }
 
+	// Paths and block navigation kept for minetest.find_path()
+	path_cache* getPathCache()
+		{ return m_path_cache; }
+
 	float getSendRecommendedInterval()
 		{ return m_recommended_send_interval; }
 
@@ -234,6 +346,19 @@ class ServerEnvironment : public Environment
 	*/
 
 	ServerActiveObject* getActiveObject(u16 id);
+	u32 getActiveObjectCount()
+		{ return m_active_objects.size(); }
+	// Estimate of the bytes taken by the active objects
+	u64 getActiveObjectMemoryUsage();
+	u32 getActiveBlockCount()
+		{ return m_active_blocks.m_list.size(); }
+
+	/*
+		Update the spatial index entry of an object after its base
+		position has changed. Does nothing for objects that are not
+		in the environment.
+	*/
+	void updateActiveObjectBlock(ServerActiveObject *object);
 
 	/*
 		Add an active object to the environment.
@@ -260,8 +385,8 @@ class ServerEnvironment : public Environment
 	*/
 	void getAddedActiveObjects(v3s16 pos, s16 radius,
 			s16 player_radius,
-			std::set<u16> &current_objects,
-			std::set<u16> &added_objects);
+			const DenseIdSet &current_objects,
+			std::vector<u16> &added_objects);
 
 	/*
 		Find out what new objects have been removed from
@@ -269,14 +394,18 @@ class ServerEnvironment : public Environment
 	*/
 	void getRemovedActiveObjects(v3s16 pos, s16 radius,
 			s16 player_radius,
-			std::set<u16> &current_objects,
-			std::set<u16> &removed_objects);
+			const DenseIdSet &current_objects,
+			std::vector<u16> &removed_objects);
 	
 	/*
-		Get the next message emitted by some active object.
-		Returns a message with id=0 if no messages are available.
+		The messages emitted by the active objects since the buffer was
+		last cleared, in the order each object emitted them. The server
+		clears the buffer once it has sent them.
 	*/
-	ActiveObjectMessage getActiveObjectMessage();
+	ActiveObjectMessageBuffer & getActiveObjectMessages()
+	{
+		return m_active_object_messages;
+	}
 
 	/*
 		Activate objects and dynamically modify for the dtime determined
@@ -298,19 +427,34 @@ class ServerEnvironment : public Environment
 
 	// Script-aware node setters
 	bool setNode(v3s16 p, const MapNode &n);
+	// setNode() for many nodes, with Map::addNodesWithEvent()
+	bool setNodes(const std::vector<v3s16> &positions,
+			const std::vector<MapNode> &nodes);
 	bool removeNode(v3s16 p);
 	bool swapNode(v3s16 p, const MapNode &n);
 	
 	// Find all active objects inside a radius around a point
 	std::set<u16> getObjectsInsideRadius(v3f pos, float radius);
+
+	// Wakes up the objects in the blocks and the blocks above them, which
+	// may have been resting on the changed nodes
+	void wakeObjectsInBlocks(const std::set<v3s16> &blocks);
 	
-	// Clear all objects, loading and going through every MapBlock
+	/*
+		Clear all objects. The active objects and the objects of the loaded
+		blocks are removed at once; the rest of the world is gone through
+		in the background by step(), a batch of blocks at a time within
+		clearobjects_time_budget. Calling it again starts over.
+	*/
 	void clearAllObjects();
+	// False if clearAllObjects() isn't running
+	bool getClearObjectsProgress(ClearObjectsProgress &progress);
 	
 	// This makes stuff happen
 	void step(f32 dtime);
 	
-	//check if there's a line of sight between two positions
+	// Check if there's a line of sight between two positions; every node on
+	// the line is looked at, stepsize is only kept for the callers
 	bool line_of_sight(v3f pos1, v3f pos2, float stepsize=1.0, v3s16 *p=NULL);
 
 	u32 getGameTime() { return m_game_time; }
@@ -319,9 +463,29 @@ class ServerEnvironment : public Environment
 	float getMaxLagEstimate() { return m_max_lag_estimate; }
 	
 	std::set<v3s16>* getForceloadedBlocks() { return &m_active_blocks.m_forceloaded_list; };
+	// Blocks kept loaded and running node timers, without being active
+	std::set<v3s16>* getForceloadedLiteBlocks() { return &m_forceloaded_lite_list; };
 	
 private:
 
+	// Runs the node timers of the block that are due after dtime
+	void runNodeTimers(MapBlock *block, float dtime);
+	// Keeps the lite forceloaded blocks loaded and runs their node timers
+	void stepForceloadedLiteBlocks(float dtime);
+
+	// Part of clearAllObjects() done by step()
+	void stepClearObjects();
+	void finishClearObjects();
+	// Unloads the blocks the job loaded, unless they have become active
+	void unloadClearObjectsBlocks();
+	// Removes the objects of a block and the active objects loaded from
+	// it; returns how many there were
+	u32 clearBlockObjects(MapBlock *block);
+
+	// Saves into the map database, or into players_path if that can't
+	// store players
+	void savePlayer(RemotePlayer *player, const std::string &players_path);
+
 	/*
 		Internal ActiveObject interface
 		-------------------------------------------
@@ -339,6 +503,12 @@ class ServerEnvironment : public Environment
 	*/
 	u16 addActiveObjectRaw(ServerActiveObject *object, bool set_changed, u32 dtime_s);
 	
+	/*
+		Runs the pending on_step callbacks of the entities in objects with
+		one call to Lua for each kind of entity
+	*/
+	void stepEntityCallbacks(const std::vector<ServerActiveObject*> &objects);
+
 	/*
 		Remove all objects that satisfy (m_removed && m_known_by_count==0)
 	*/
@@ -348,9 +518,14 @@ class ServerEnvironment : public Environment
 		Convert stored objects from block to active
 	*/
 	void activateObjects(MapBlock *block, u32 dtime_s);
+	// Activates the objects of queued blocks within
+	// object_activation_time_budget
+	void activateQueuedObjects();
 	
 	/*
-		Convert objects that are not in active blocks to static.
+		Convert objects that are not in active blocks to static, a block
+		at a time. The blocks left when object_activation_time_budget runs
+		out are done by the next steps.
 
 		If m_known_by_count != 0, active object is not deleted, but static
 		data is still updated.
@@ -359,6 +534,26 @@ class ServerEnvironment : public Environment
 		shall only be set so in the destructor of the environment.
 	*/
 	void deactivateFarObjects(bool force_delete);
+	// Converts the objects located in blockpos; ids of deleted objects
+	// are added to objects_to_remove
+	void deactivateBlockObjects(v3s16 blockpos, const std::vector<u16> &ids,
+			bool force_delete, std::list<u16> &objects_to_remove);
+
+	/*
+		Run ActiveBlockModifiers on the active blocks. Without a time
+		budget all blocks are handled at once every interval, otherwise
+		the pass is spread over steps.
+	*/
+	void stepActiveBlockModifiers(float dtime);
+	// Drop the ABM pass in progress, if any
+	void finishABMPass();
+
+	/*
+		Get the ids of the objects that may be within radius of pos,
+		using the block index. Callers still have to check the distance.
+	*/
+	void getObjectCandidatesInsideRadius(v3f pos, f32 radius,
+			std::vector<u16> &objects);
 
 	/*
 		Member variables
@@ -372,10 +567,14 @@ class ServerEnvironment : public Environment
 	IGameDef *m_gamedef;
 	// World path
 	const std::string m_path_world;
+	// Pathfinder caches
+	path_cache *m_path_cache;
 	// Active object list
-	std::map<u16, ServerActiveObject*> m_active_objects;
+	ServerActiveObjectMap m_active_objects;
+	// Active objects by the block they are in
+	ActiveObjectBlockIndex m_active_object_index;
 	// Outgoing network message buffer for active objects
-	std::list<ActiveObjectMessage> m_active_object_messages;
+	ActiveObjectMessageBuffer m_active_object_messages;
 	// Some timers
 	float m_send_recommended_timer;
 	IntervalLimiter m_object_management_interval;
@@ -385,6 +584,34 @@ class ServerEnvironment : public Environment
 	IntervalLimiter m_active_block_modifier_interval;
 	IntervalLimiter m_active_blocks_nodemetadata_interval;
 	int m_active_block_interval_overload_skip;
+	// Time-sliced ABM pass in progress, NULL if none
+	ABMHandler *m_abm_handler;
+	// Time since the last ABM pass was started
+	float m_abm_pass_dtime;
+	// Blocks of the ABM pass in progress and the next one to handle
+	std::vector<v3s16> m_abm_pass_blocks;
+	u32 m_abm_pass_next_block;
+	// Forceloaded blocks without the objects and ABMs of active blocks
+	std::set<v3s16> m_forceloaded_lite_list;
+	// Lite forceloaded blocks whose node timers have caught up with the
+	// time they were unloaded for
+	std::set<v3s16> m_forceloaded_lite_loaded;
+	// Active blocks whose stored objects are still to be activated, with
+	// the time they were inactive for
+	std::deque<std::pair<v3s16, u32> > m_objects_to_activate;
+	// deactivateFarObjects() ran out of time
+	bool m_far_objects_left;
+	// clearAllObjects() job. The cursor is the one the current batch was
+	// listed from, so that the batch is done again after a restart.
+	ClearObjectsProgress m_clear_objects;
+	std::string m_clear_objects_cursor;
+	std::string m_clear_objects_next_cursor;
+	std::vector<v3s16> m_clear_objects_batch;
+	u32 m_clear_objects_next_block;
+	// Blocks cleared when the job was started
+	std::set<v3s16> m_clear_objects_skip;
+	// Blocks the job loaded, unloaded again when there are too many
+	std::vector<v3s16> m_clear_objects_loaded;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
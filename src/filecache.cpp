@@ -23,10 +23,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "clientserver.h"
 #include "log.h"
 #include "filesys.h"
+#include "util/serialize.h"
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstring>
 #include <stdlib.h>
+#ifndef _WIN32
+	#include <sys/mman.h>
+#endif
 
 bool FileCache::loadByPath(const std::string &path, std::ostream &os)
 {
@@ -87,3 +93,222 @@ bool FileCache::load(const std::string &name, std::ostream &os)
 	std::string path = m_dir + DIR_DELIM + name;
 	return loadByPath(path, os);
 }
+bool FileCache::remove(const std::string &name)
+{
+	std::string path = m_dir + DIR_DELIM + name;
+	return fs::DeleteSingleFileOrEmptyDirectory(path);
+}
+
+/*
+	PackedFileCache
+
+	media.pack has the files one after another. media.idx is
+		"MTPI", u16 version
+		u32 size of the pack when the index was saved
+		u32 modification time of the pack then, in seconds
+		u32 count, then for each file
+			u16 name length, name
+			u32 offset in the pack, u32 size
+			u8 checked
+*/
+
+#define PACKED_FILE_CACHE_VERSION 1
+
+PackedFileCache::PackedFileCache(const std::string &dir):
+	m_pack_path(dir + DIR_DELIM + "media.pack"),
+	m_index_path(dir + DIR_DELIM + "media.idx"),
+	m_index_changed(false),
+	m_pack_write(NULL),
+	m_pack_size(0),
+	m_map(NULL),
+	m_map_size(0)
+{
+	loadIndex();
+	mapPack();
+}
+
+PackedFileCache::~PackedFileCache()
+{
+	if (m_index_changed)
+		saveIndex();
+	unmapPack();
+	if (m_pack_write)
+		fclose(m_pack_write);
+}
+
+void PackedFileCache::loadIndex()
+{
+	u32 pack_mtime = 0;
+	if (!fs::GetFileStat(m_pack_path, m_pack_size, pack_mtime)) {
+		m_pack_size = 0;
+		return;
+	}
+
+	std::ifstream is(m_index_path.c_str(), std::ios_base::binary);
+	char magic[4] = {0};
+	is.read(magic, 4);
+	if (!is.good() || memcmp(magic, "MTPI", 4) != 0 ||
+			readU16(is) != PACKED_FILE_CACHE_VERSION)
+		return;
+	bool pack_unchanged = readU32(is) == m_pack_size;
+	pack_unchanged = readU32(is) == pack_mtime && pack_unchanged;
+	u32 count = readU32(is);
+	for (u32 i = 0; i < count && is.good(); i++) {
+		std::string name = deSerializeString(is);
+		Entry e;
+		e.offset = readU32(is);
+		e.size = readU32(is);
+		e.checked = readU8(is) && pack_unchanged;
+		if (!is.good())
+			break;
+		// The index of an older pack
+		if (e.offset > m_pack_size || e.size > m_pack_size - e.offset)
+			continue;
+		m_entries[name] = e;
+	}
+	verbosestream << "PackedFileCache: " << m_entries.size()
+			<< " files in " << m_pack_path
+			<< (pack_unchanged ? "" : ", changed since the index was saved")
+			<< std::endl;
+}
+
+bool PackedFileCache::saveIndex()
+{
+	if (m_pack_write)
+		fflush(m_pack_write);
+	u32 pack_size = 0;
+	u32 pack_mtime = 0;
+	if (!fs::GetFileStat(m_pack_path, pack_size, pack_mtime))
+		return false;
+	// Something else added to the pack; don't vouch for it
+	if (pack_size != m_pack_size)
+		pack_size = pack_mtime = 0;
+
+	std::ostringstream os(std::ios_base::binary);
+	os.write("MTPI", 4);
+	writeU16(os, PACKED_FILE_CACHE_VERSION);
+	writeU32(os, pack_size);
+	writeU32(os, pack_mtime);
+	writeU32(os, m_entries.size());
+	for (std::map<std::string, Entry>::const_iterator
+			i = m_entries.begin(); i != m_entries.end(); ++i) {
+		os << serializeString(i->first);
+		writeU32(os, i->second.offset);
+		writeU32(os, i->second.size);
+		writeU8(os, i->second.checked);
+	}
+	if (!fs::safeWriteToFile(m_index_path, os.str())) {
+		errorstream << "PackedFileCache: Can't write the index "
+				<< m_index_path << std::endl;
+		return false;
+	}
+	m_index_changed = false;
+	return true;
+}
+
+void PackedFileCache::mapPack()
+{
+#ifndef _WIN32
+	unmapPack();
+	if (m_pack_size == 0)
+		return;
+	FILE *f = fopen(m_pack_path.c_str(), "rb");
+	if (!f)
+		return;
+	void *m = mmap(NULL, m_pack_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	// The mapping stays after the file is closed
+	fclose(f);
+	if (m == MAP_FAILED)
+		return;
+	m_map = (const char *) m;
+	m_map_size = m_pack_size;
+#endif
+}
+
+void PackedFileCache::unmapPack()
+{
+#ifndef _WIN32
+	if (m_map)
+		munmap((void *) m_map, m_map_size);
+#endif
+	m_map = NULL;
+	m_map_size = 0;
+}
+
+bool PackedFileCache::update(const std::string &name, const std::string &data)
+{
+	if (!m_pack_write) {
+		m_pack_write = fopen(m_pack_path.c_str(), "ab");
+		if (!m_pack_write) {
+			errorstream << "PackedFileCache: Can't write to "
+					<< m_pack_path << std::endl;
+			return false;
+		}
+	}
+	// Appending always goes to the end, even if it has moved
+	fseek(m_pack_write, 0, SEEK_END);
+	long offset = ftell(m_pack_write);
+	// The offsets and sizes of the index are 32-bit
+	if (offset >= 0 && (u64)offset + data.size() > 0xffffffffULL) {
+		errorstream << "PackedFileCache: " << m_pack_path
+				<< " is full, not adding "" << name << """ << std::endl;
+		return false;
+	}
+	if (offset < 0 || fwrite(data.c_str(), 1, data.size(), m_pack_write)
+			!= data.size()) {
+		errorstream << "PackedFileCache: Can't write to "
+				<< m_pack_path << std::endl;
+		return false;
+	}
+	Entry e;
+	e.offset = offset;
+	e.size = data.size();
+	e.checked = true;
+	m_entries[name] = e;
+	m_pack_size = e.offset + e.size;
+	m_index_changed = true;
+	return true;
+}
+
+bool PackedFileCache::load(const std::string &name, std::string &data,
+		bool &checked)
+{
+	std::map<std::string, Entry>::const_iterator i = m_entries.find(name);
+	if (i == m_entries.end())
+		return false;
+	const Entry &e = i->second;
+	checked = e.checked;
+
+	if (m_pack_write)
+		fflush(m_pack_write);
+	// Added since it was mapped
+	if ((u64)e.offset + e.size > m_map_size)
+		mapPack();
+	if ((u64)e.offset + e.size <= m_map_size) {
+		data.assign(m_map + e.offset, e.size);
+		return true;
+	}
+
+	FILE *f = fopen(m_pack_path.c_str(), "rb");
+	if (!f)
+		return false;
+	data.resize(e.size);
+	bool ok = fseek(f, e.offset, SEEK_SET) == 0 && (e.size == 0 ||
+			fread(&data[0], 1, e.size, f) == e.size);
+	fclose(f);
+	if (!ok) {
+		errorstream << "PackedFileCache: Failed to read \"" << name
+				<< "\" from " << m_pack_path << std::endl;
+		data.clear();
+	}
+	return ok;
+}
+
+void PackedFileCache::setChecked(const std::string &name)
+{
+	std::map<std::string, Entry>::iterator i = m_entries.find(name);
+	if (i == m_entries.end() || i->second.checked)
+		return;
+	i->second.checked = true;
+	m_index_changed = true;
+}
@@ -21,8 +21,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef FILECACHE_HEADER
 #define FILECACHE_HEADER
 
+#include "irrlichttypes.h"
 #include <string>
 #include <iostream>
+#include <cstdio>
+#include <map>
 
 class FileCache
 {
@@ -37,6 +40,7 @@ class FileCache
 	
 	bool update(const std::string &name, const std::string &data);
 	bool load(const std::string &name, std::ostream &os);
+	bool remove(const std::string &name);
 private:
 	std::string m_dir;
 
@@ -44,4 +48,62 @@ class FileCache
 	bool updateByPath(const std::string &path, const std::string &data);
 };
 
+/*
+	The files of a cache in one pack file that is only appended to, with
+	an index that says where each of them is. The pack is memory mapped
+	where that is possible.
+
+	The index also has the size and the modification time of the pack
+	when it was written, and for each file whether the user has checked
+	it. If the pack has been touched since, by something else or by a
+	session that didn't save its index, none of the files count as
+	checked. An older copy of a file is left in the pack when a newer one
+	is added. The offsets are 32-bit, so files that would make the pack
+	larger than 4 GiB are not added. See filecache.cpp for the format.
+*/
+class PackedFileCache
+{
+public:
+	// The pack and the index are made in dir, which must exist before
+	// update() is called
+	PackedFileCache(const std::string &dir);
+	// Saves the index if it was changed
+	~PackedFileCache();
+
+	bool update(const std::string &name, const std::string &data);
+	// If false is returned, the file is not in the cache. checked is set
+	// to whether the file has been checked since it was written.
+	bool load(const std::string &name, std::string &data, bool &checked);
+	// Remember that the file that was loaded is good
+	void setChecked(const std::string &name);
+
+	bool saveIndex();
+
+private:
+	struct Entry
+	{
+		u32 offset;
+		u32 size;
+		bool checked;
+	};
+
+	void loadIndex();
+	void mapPack();
+	void unmapPack();
+
+	std::string m_pack_path;
+	std::string m_index_path;
+	std::map<std::string, Entry> m_entries;
+	bool m_index_changed;
+
+	// Opened for the first update()
+	FILE *m_pack_write;
+	// Size of the pack, as far as it is known here
+	u32 m_pack_size;
+
+	// The mapped part of the pack
+	const char *m_map;
+	u32 m_map_size;
+};
+
 #endif
@@ -24,6 +24,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string.h>
 #include <errno.h>
 #include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "log.h"
 #include "config.h"
 
@@ -716,5 +718,15 @@ bool safeWriteToFile(const std::string &path, const std::string &content)
 	}
 }
 
+bool GetFileStat(const std::string &path, u32 &size, u32 &mtime)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return false;
+	size = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
+
 } // namespace fs
 
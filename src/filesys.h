@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string>
 #include <vector>
 #include "exceptions.h"
+#include "irrlichttypes.h"
 
 #ifdef _WIN32 // WINDOWS
 #define DIR_DELIM "\\"
@@ -100,6 +101,9 @@ std::string RemoveRelativePathComponents(std::string path);
 
 bool safeWriteToFile(const std::string &path, const std::string &content);
 
+// Size and modification time in seconds of a file; false if it doesn't exist
+bool GetFileStat(const std::string &path, u32 &size, u32 &mtime);
+
 }//fs
 
 #endif
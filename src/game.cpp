@@ -71,6 +71,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "drawscene.h"
 #include "content_cao.h"
 #include "fontengine.h"
+#include "raycast.h"
 
 #ifdef HAVE_TOUCHSCREENGUI
 #include "touchscreengui.h"
@@ -334,104 +335,100 @@ PointedThing getPointedThing(Client *client, v3f player_position,
 	// That didn't work, try to find a pointed at node
 
 
-	v3s16 pos_i = floatToInt(player_position, BS);
+	// The nodes along the line, and the ones next to them for selection
+	// boxes reaching out of their node
+	CachedNodeReader reader(&map);
+	std::set<v3s16> looked_at;
+	VoxelLineIterator line(shootline.start, shootline.end);
+	for (;;) {
+		v3s16 current = line.getCurrent();
 
-	/*infostream<<"pos_i=("<<pos_i.X<<","<<pos_i.Y<<","<<pos_i.Z<<")"
-			<<std::endl;*/
-
-	s16 a = d;
-	s16 ystart = pos_i.Y + 0 - (camera_direction.Y < 0 ? a : 1);
-	s16 zstart = pos_i.Z - (camera_direction.Z < 0 ? a : 1);
-	s16 xstart = pos_i.X - (camera_direction.X < 0 ? a : 1);
-	s16 yend = pos_i.Y + 1 + (camera_direction.Y > 0 ? a : 1);
-	s16 zend = pos_i.Z + (camera_direction.Z > 0 ? a : 1);
-	s16 xend = pos_i.X + (camera_direction.X > 0 ? a : 1);
-
-	// Prevent signed number overflow
-	if (yend == 32767)
-		yend = 32766;
-
-	if (zend == 32767)
-		zend = 32766;
-
-	if (xend == 32767)
-		xend = 32766;
+		// Nothing from here on can be closer than what has been found
+		if ((intToFloat(current, BS) - camera_position).getLength() >
+				mindistance + 4 * BS)
+			break;
 
-	for (s16 y = ystart; y <= yend; y++)
-		for (s16 z = zstart; z <= zend; z++)
-			for (s16 x = xstart; x <= xend; x++) {
-				MapNode n;
-				bool is_valid_position;
+		for (s16 y = -1; y <= 1; y++)
+		for (s16 z = -1; z <= 1; z++)
+		for (s16 x = -1; x <= 1; x++) {
+			v3s16 np = current + v3s16(x, y, z);
+			if (!looked_at.insert(np).second)
+				continue;
 
-				n = map.getNodeNoEx(v3s16(x, y, z), &is_valid_position);
-				if (!is_valid_position)
-					continue;
+			bool is_valid_position;
+			MapNode n = reader.getNode(np, &is_valid_position);
+			if (!is_valid_position)
+				continue;
 
-				if (!isPointableNode(n, client, liquids_pointable))
-					continue;
+			if (!isPointableNode(n, client, liquids_pointable))
+				continue;
 
-				std::vector<aabb3f> boxes = n.getSelectionBoxes(nodedef);
-
-				v3s16 np(x, y, z);
-				v3f npf = intToFloat(np, BS);
-
-				for (std::vector<aabb3f>::const_iterator
-						i = boxes.begin();
-						i != boxes.end(); i++) {
-					aabb3f box = *i;
-					box.MinEdge += npf;
-					box.MaxEdge += npf;
-
-					for (u16 j = 0; j < 6; j++) {
-						v3s16 facedir = g_6dirs[j];
-						aabb3f facebox = box;
-
-						f32 d = 0.001 * BS;
-
-						if (facedir.X > 0)
-							facebox.MinEdge.X = facebox.MaxEdge.X - d;
-						else if (facedir.X < 0)
-							facebox.MaxEdge.X = facebox.MinEdge.X + d;
-						else if (facedir.Y > 0)
-							facebox.MinEdge.Y = facebox.MaxEdge.Y - d;
-						else if (facedir.Y < 0)
-							facebox.MaxEdge.Y = facebox.MinEdge.Y + d;
-						else if (facedir.Z > 0)
-							facebox.MinEdge.Z = facebox.MaxEdge.Z - d;
-						else if (facedir.Z < 0)
-							facebox.MaxEdge.Z = facebox.MinEdge.Z + d;
-
-						v3f centerpoint = facebox.getCenter();
-						f32 distance = (centerpoint - camera_position).getLength();
-
-						if (distance >= mindistance)
-							continue;
-
-						if (!facebox.intersectsWithLine(shootline))
-							continue;
-
-						v3s16 np_above = np + facedir;
-
-						result.type = POINTEDTHING_NODE;
-						result.node_undersurface = np;
-						result.node_abovesurface = np_above;
-						mindistance = distance;
-
-						hilightboxes.clear();
-
-						if (!g_settings->getBool("enable_node_highlighting")) {
-							for (std::vector<aabb3f>::const_iterator
-									i2 = boxes.begin();
-									i2 != boxes.end(); i2++) {
-								aabb3f box = *i2;
-								box.MinEdge += npf + v3f(-d, -d, -d) - intToFloat(camera_offset, BS);
-								box.MaxEdge += npf + v3f(d, d, d) - intToFloat(camera_offset, BS);
-								hilightboxes.push_back(box);
-							}
+			std::vector<aabb3f> boxes = n.getSelectionBoxes(nodedef);
+
+			v3f npf = intToFloat(np, BS);
+
+			for (std::vector<aabb3f>::const_iterator
+					i = boxes.begin();
+					i != boxes.end(); i++) {
+				aabb3f box = *i;
+				box.MinEdge += npf;
+				box.MaxEdge += npf;
+
+				for (u16 j = 0; j < 6; j++) {
+					v3s16 facedir = g_6dirs[j];
+					aabb3f facebox = box;
+
+					f32 d = 0.001 * BS;
+
+					if (facedir.X > 0)
+						facebox.MinEdge.X = facebox.MaxEdge.X - d;
+					else if (facedir.X < 0)
+						facebox.MaxEdge.X = facebox.MinEdge.X + d;
+					else if (facedir.Y > 0)
+						facebox.MinEdge.Y = facebox.MaxEdge.Y - d;
+					else if (facedir.Y < 0)
+						facebox.MaxEdge.Y = facebox.MinEdge.Y + d;
+					else if (facedir.Z > 0)
+						facebox.MinEdge.Z = facebox.MaxEdge.Z - d;
+					else if (facedir.Z < 0)
+						facebox.MaxEdge.Z = facebox.MinEdge.Z + d;
+
+					v3f centerpoint = facebox.getCenter();
+					f32 distance = (centerpoint - camera_position).getLength();
+
+					if (distance >= mindistance)
+						continue;
+
+					if (!facebox.intersectsWithLine(shootline))
+						continue;
+
+					v3s16 np_above = np + facedir;
+
+					result.type = POINTEDTHING_NODE;
+					result.node_undersurface = np;
+					result.node_abovesurface = np_above;
+					mindistance = distance;
+
+					hilightboxes.clear();
+
+					if (!g_settings->getBool("enable_node_highlighting")) {
+						for (std::vector<aabb3f>::const_iterator
+								i2 = boxes.begin();
+								i2 != boxes.end(); i2++) {
+							aabb3f box = *i2;
+							box.MinEdge += npf + v3f(-d, -d, -d) - intToFloat(camera_offset, BS);
+							box.MaxEdge += npf + v3f(d, d, d) - intToFloat(camera_offset, BS);
+							hilightboxes.push_back(box);
 						}
 					}
 				}
-			} // for coords
+			}
+		}
+
+		if (!line.hasNext())
+			break;
+		line.next();
+	}
 
 	return result;
 }
@@ -798,6 +795,14 @@ class GameGlobalShaderConstantSetter : public IShaderConstantSetter
 	bool *m_force_fog_off;
 	f32 *m_fog_range;
 	Client *m_client;
+	SettingHandle<bool> m_fog_enabled;
+
+	// The values are the same for everything drawn in a frame
+	float m_bgcolor[4];
+	float m_fog_distance;
+	float m_daynight_ratio;
+	float m_animation_timer;
+	v3f m_eye_position;
 
 public:
 	GameGlobalShaderConstantSetter(Sky *sky, bool *force_fog_off,
@@ -805,49 +810,55 @@ class GameGlobalShaderConstantSetter : public IShaderConstantSetter
 		m_sky(sky),
 		m_force_fog_off(force_fog_off),
 		m_fog_range(fog_range),
-		m_client(client)
-	{}
+		m_client(client),
+		m_fog_enabled(g_settings, "enable_fog")
+	{
+		onNewFrame();
+	}
 	~GameGlobalShaderConstantSetter() {}
 
-	virtual void onSetConstants(video::IMaterialRendererServices *services,
-			bool is_highlevel)
+	virtual void onNewFrame()
 	{
-		if (!is_highlevel)
-			return;
-
 		// Background color
-		video::SColor bgcolor = m_sky->getBgColor();
-		video::SColorf bgcolorf(bgcolor);
-		float bgcolorfa[4] = {
-			bgcolorf.r,
-			bgcolorf.g,
-			bgcolorf.b,
-			bgcolorf.a,
-		};
-		services->setPixelShaderConstant("skyBgColor", bgcolorfa, 4);
+		video::SColorf bgcolorf(m_sky->getBgColor());
+		m_bgcolor[0] = bgcolorf.r;
+		m_bgcolor[1] = bgcolorf.g;
+		m_bgcolor[2] = bgcolorf.b;
+		m_bgcolor[3] = bgcolorf.a;
 
 		// Fog distance
-		float fog_distance = 10000 * BS;
-
-		if (g_settings->getBool("enable_fog") && !*m_force_fog_off)
-			fog_distance = *m_fog_range;
-
-		services->setPixelShaderConstant("fogDistance", &fog_distance, 1);
+		m_fog_distance = 10000 * BS;
+		if (m_fog_enabled.get() && !*m_force_fog_off)
+			m_fog_distance = *m_fog_range;
 
 		// Day-night ratio
 		u32 daynight_ratio = m_client->getEnv().getDayNightRatio();
-		float daynight_ratio_f = (float)daynight_ratio / 1000.0;
-		services->setPixelShaderConstant("dayNightRatio", &daynight_ratio_f, 1);
+		m_daynight_ratio = (float)daynight_ratio / 1000.0;
 
 		u32 animation_timer = porting::getTimeMs() % 100000;
-		float animation_timer_f = (float)animation_timer / 100000.0;
-		services->setPixelShaderConstant("animationTimer", &animation_timer_f, 1);
-		services->setVertexShaderConstant("animationTimer", &animation_timer_f, 1);
+		m_animation_timer = (float)animation_timer / 100000.0;
 
 		LocalPlayer *player = m_client->getEnv().getLocalPlayer();
-		v3f eye_position = player->getEyePosition();
-		services->setPixelShaderConstant("eyePosition", (irr::f32 *)&eye_position, 3);
-		services->setVertexShaderConstant("eyePosition", (irr::f32 *)&eye_position, 3);
+		m_eye_position = player->getEyePosition();
+	}
+
+	virtual void onSetConstants(ShaderConstants &constants,
+			bool is_highlevel)
+	{
+		if (!is_highlevel)
+			return;
+
+		constants.setPixelShaderConstant("skyBgColor", m_bgcolor, 4);
+		constants.setPixelShaderConstant("fogDistance", &m_fog_distance, 1);
+
+		constants.setPixelShaderConstant("dayNightRatio", &m_daynight_ratio, 1);
+		constants.setVertexShaderConstant("dayNightRatio", &m_daynight_ratio, 1);
+
+		constants.setPixelShaderConstant("animationTimer", &m_animation_timer, 1);
+		constants.setVertexShaderConstant("animationTimer", &m_animation_timer, 1);
+
+		constants.setPixelShaderConstant("eyePosition", (irr::f32 *)&m_eye_position, 3);
+		constants.setVertexShaderConstant("eyePosition", (irr::f32 *)&m_eye_position, 3);
 
 		// Uniform sampler layers
 		int layer0 = 0;
@@ -855,13 +866,13 @@ class GameGlobalShaderConstantSetter : public IShaderConstantSetter
 		int layer2 = 2;
 		// before 1.8 there isn't a "integer interface", only float
 #if (IRRLICHT_VERSION_MAJOR == 1 && IRRLICHT_VERSION_MINOR < 8)
-		services->setPixelShaderConstant("baseTexture" , (irr::f32 *)&layer0, 1);
-		services->setPixelShaderConstant("normalTexture" , (irr::f32 *)&layer1, 1);
-		services->setPixelShaderConstant("useNormalmap" , (irr::f32 *)&layer2, 1);
+		constants.setPixelShaderConstant("baseTexture" , (irr::f32 *)&layer0, 1);
+		constants.setPixelShaderConstant("normalTexture" , (irr::f32 *)&layer1, 1);
+		constants.setPixelShaderConstant("useNormalmap" , (irr::f32 *)&layer2, 1);
 #else
-		services->setPixelShaderConstant("baseTexture" , (irr::s32 *)&layer0, 1);
-		services->setPixelShaderConstant("normalTexture" , (irr::s32 *)&layer1, 1);
-		services->setPixelShaderConstant("useNormalmap" , (irr::s32 *)&layer2, 1);
+		constants.setPixelShaderConstant("baseTexture" , (irr::s32 *)&layer0, 1);
+		constants.setPixelShaderConstant("normalTexture" , (irr::s32 *)&layer1, 1);
+		constants.setPixelShaderConstant("useNormalmap" , (irr::s32 *)&layer2, 1);
 #endif
 	}
 };
@@ -2988,7 +2999,7 @@ void Game::processClientEvents(CameraOrientation *cam, float *damage_flash)
 			video::ITexture *texture =
 				gamedef->tsrc()->getTexture(*(event.spawn_particle.texture));
 
-			new Particle(gamedef, smgr, player, client->getEnv(),
+			addParticle(gamedef, smgr, player, client->getEnv(),
 					*event.spawn_particle.pos,
 					*event.spawn_particle.vel,
 					*event.spawn_particle.acc,
@@ -3248,6 +3259,7 @@ void Game::updateSound(f32 dtime)
 			      camera->getDirection(),
 			      camera->getCameraNode()->getUpVector());
 	sound->setListenerGain(g_settings->getFloat("sound_volume"));
+	sound->step(dtime);
 
 
 	//	Update sound maker
@@ -3865,6 +3877,9 @@ void Game::updateFrame(std::vector<aabb3f> &highlight_boxes,
 		stats->beginscenetime = timer.stop(true);
 	}
 
+	// The global shader constants are the same for the whole frame
+	shader_src->onNewFrame();
+
 	draw_scene(driver, smgr, *camera, *client, player, *hud, guienv,
 			highlight_boxes, screensize, skycolor, flags.show_hud);
 
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "genericobject.h"
 #include <sstream>
 #include "util/serialize.h"
+#include "util/numeric.h"
 
 std::string gob_cmd_set_properties(const ObjectProperties &prop)
 {
@@ -65,6 +66,54 @@ std::string gob_cmd_update_position(
 	return os.str();
 }
 
+static v3s16 quantizeMotion(v3f v)
+{
+	v *= GENERIC_POSITION_MOTION_SCALE;
+	return v3s16(
+			rangelim(myround(v.X), -32767, 32767),
+			rangelim(myround(v.Y), -32767, 32767),
+			rangelim(myround(v.Z), -32767, 32767));
+}
+
+std::string gob_cmd_update_position_packed(
+	v3f position,
+	v3f velocity,
+	v3f acceleration,
+	f32 yaw,
+	bool do_interpolate,
+	bool is_movement_end,
+	f32 update_interval
+){
+	v3s16 velocity_q = quantizeMotion(velocity);
+	v3s16 acceleration_q = quantizeMotion(acceleration);
+
+	u8 flags = 0;
+	if(do_interpolate)
+		flags |= GENERIC_POSITION_INTERPOLATE;
+	if(is_movement_end)
+		flags |= GENERIC_POSITION_MOVEMENT_END;
+	if(velocity_q != v3s16(0,0,0))
+		flags |= GENERIC_POSITION_HAS_VELOCITY;
+	if(acceleration_q != v3s16(0,0,0))
+		flags |= GENERIC_POSITION_HAS_ACCELERATION;
+
+	std::ostringstream os(std::ios::binary);
+	// command
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION_PACKED);
+	writeU8(os, flags);
+	// pos
+	writeV3F1000(os, position);
+	if(flags & GENERIC_POSITION_HAS_VELOCITY)
+		writeV3S16(os, velocity_q);
+	if(flags & GENERIC_POSITION_HAS_ACCELERATION)
+		writeV3S16(os, acceleration_q);
+	// yaw
+	writeU16(os, (u16)myround(wrapDegrees_0_360(yaw) * 65536.0 / 360.0));
+	// update_interval
+	writeU8(os, rangelim(myround(update_interval * 100), 0, 255));
+	return os.str();
+}
+
 std::string gob_cmd_set_texture_mod(const std::string &mod)
 {
 	std::ostringstream os(std::ios::binary);
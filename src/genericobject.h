@@ -34,6 +34,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define GENERIC_CMD_SET_BONE_POSITION 7
 #define GENERIC_CMD_SET_ATTACHMENT 8
 #define GENERIC_CMD_SET_PHYSICS_OVERRIDE 9
+#define GENERIC_CMD_UPDATE_POSITION_PACKED 10
+
+// Flags of GENERIC_CMD_UPDATE_POSITION_PACKED
+#define GENERIC_POSITION_INTERPOLATE 0x01
+#define GENERIC_POSITION_MOVEMENT_END 0x02
+#define GENERIC_POSITION_HAS_VELOCITY 0x04
+#define GENERIC_POSITION_HAS_ACCELERATION 0x08
+// Velocity and acceleration are sent as s16 in these units per BS unit
+#define GENERIC_POSITION_MOTION_SCALE 10.0
 
 #include "object_properties.h"
 std::string gob_cmd_set_properties(const ObjectProperties &prop);
@@ -49,6 +58,22 @@ std::string gob_cmd_update_position(
 	f32 update_interval
 );
 
+/*
+	The same as gob_cmd_update_position(), but with velocity and
+	acceleration quantized and left out when zero, yaw in 1/65536ths of a
+	turn and update_interval in 1/100ths of a second. About half the size.
+	Only for clients with protocol version 26 or later.
+*/
+std::string gob_cmd_update_position_packed(
+	v3f position,
+	v3f velocity,
+	v3f acceleration,
+	f32 yaw,
+	bool do_interpolate,
+	bool is_movement_end,
+	f32 update_interval
+);
+
 std::string gob_cmd_set_texture_mod(const std::string &mod);
 
 std::string gob_cmd_set_sprite(
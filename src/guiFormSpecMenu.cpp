@@ -162,6 +162,8 @@ GUIFormSpecMenu::GUIFormSpecMenu(irr::IrrlichtDevice* dev,
 	m_doubleclickdetect[0].pos = v2s32(0, 0);
 	m_doubleclickdetect[1].pos = v2s32(0, 0);
 
+	m_formspec_explicit_size = false;
+
 	m_tooltip_show_delay = (u32)g_settings->getS32("tooltip_show_delay");
 }
 
@@ -1812,6 +1814,8 @@ void GUIFormSpecMenu::parseElement(parserData* data, std::string element)
 
 void GUIFormSpecMenu::regenerateGui(v2u32 screensize)
 {
+	m_formspec_elements.clear();
+
 	/* useless to regenerate without a screensize */
 	if ((screensize.X <= 0) || (screensize.Y <= 0)) {
 		return;
@@ -2067,6 +2071,61 @@ void GUIFormSpecMenu::regenerateGui(v2u32 screensize)
 		setInitialFocus();
 
 	skin->setFont(old_font);
+
+	m_formspec_elements = elements;
+	m_formspec_explicit_size = mydata.explicit_size;
+}
+
+/*
+	Elements that only add to what drawMenu() draws, without Irrlicht
+	elements.  Mods change these the most, like the fire and the arrow of
+	a furnace, and parsing them again keeps the fields, their focus and
+	the scroll positions as they are.
+*/
+static bool is_drawn_formspec_element(const std::string &element)
+{
+	std::string type = trim(element.substr(0, element.find('[')));
+	return type == "list" || type == "image" || type == "item_image"
+			|| type == "background" || type == "box";
+}
+
+bool GUIFormSpecMenu::updateDrawnElements()
+{
+	if (m_formspec_elements.empty())
+		return false;
+
+	std::vector<std::string> elements = split(m_formspec_string,']');
+	if (elements.size() != m_formspec_elements.size())
+		return false;
+
+	bool changed = false;
+	for (u32 i = 0; i < elements.size(); i++) {
+		if (elements[i] == m_formspec_elements[i])
+			continue;
+		if (!is_drawn_formspec_element(elements[i]) ||
+				!is_drawn_formspec_element(m_formspec_elements[i]))
+			return false;
+		changed = true;
+	}
+	if (!changed)
+		return true;
+
+	m_inventorylists.clear();
+	m_images.clear();
+	m_backgrounds.clear();
+	m_itemimages.clear();
+	m_boxes.clear();
+	m_clipbackground = false;
+
+	parserData mydata;
+	mydata.explicit_size = m_formspec_explicit_size;
+	for (u32 i = 0; i < elements.size(); i++) {
+		if (is_drawn_formspec_element(elements[i]))
+			parseElement(&mydata, elements[i]);
+	}
+
+	m_formspec_elements.swap(elements);
+	return true;
 }
 
 #ifdef __ANDROID__
@@ -2271,7 +2330,8 @@ void GUIFormSpecMenu::drawMenu()
 		std::string newform = m_form_src->getForm();
 		if(newform != m_formspec_string){
 			m_formspec_string = newform;
-			regenerateGui(m_screensize_old);
+			if (!updateDrawnElements())
+				regenerateGui(m_screensize_old);
 		}
 	}
 
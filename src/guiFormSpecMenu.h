@@ -218,9 +218,12 @@ class GUIFormSpecMenu : public GUIModalMenu
 	void setFormSpec(const std::string &formspec_string,
 			InventoryLocation current_inventory_location)
 	{
+		bool same_location =
+				current_inventory_location == m_current_inventory_location;
 		m_formspec_string = formspec_string;
 		m_current_inventory_location = current_inventory_location;
-		regenerateGui(m_screensize_old);
+		if (!same_location || !updateDrawnElements())
+			regenerateGui(m_screensize_old);
 	}
 
 	// form_src is deleted by this GUIFormSpecMenu
@@ -257,6 +260,12 @@ class GUIFormSpecMenu : public GUIModalMenu
 		Remove and re-add (or reposition) stuff
 	*/
 	void regenerateGui(v2u32 screensize);
+	/*
+		Parses the elements drawn by drawMenu() again if they are the
+		only ones of m_formspec_string that changed, and keeps the rest.
+		Returns false if the GUI has to be regenerated.
+	*/
+	bool updateDrawnElements();
 
 	ItemSpec getItemAtPos(v2s32 p) const;
 	void drawList(const ListDrawSpec &s, int phase);
@@ -296,6 +305,10 @@ class GUIFormSpecMenu : public GUIModalMenu
 
 	std::string m_formspec_string;
 	InventoryLocation m_current_inventory_location;
+	// The elements of the formspec the GUI was last regenerated for,
+	// with the changes updateDrawnElements() made since
+	std::vector<std::string> m_formspec_elements;
+	bool m_formspec_explicit_size;
 
 
 	std::vector<ListDrawSpec> m_inventorylists;
@@ -104,9 +104,6 @@ GUITable::GUITable(gui::IGUIEnvironment *env,
 
 GUITable::~GUITable()
 {
-	for (size_t i = 0; i < m_rows.size(); ++i)
-		delete[] m_rows[i].cells;
-
 	if (m_font)
 		m_font->drop();
 	
@@ -138,9 +135,10 @@ void GUITable::setTextList(const std::vector<std::string> &content,
 	s32 empty_string_index = allocString("");
 
 	m_rows.resize(content.size());
+	m_cells.resize(content.size());
 	for (s32 i = 0; i < (s32) content.size(); ++i) {
 		Row *row = &m_rows[i];
-		row->cells = new Cell[1];
+		row->cells = &m_cells[i];
 		row->cellcount = 1;
 		row->indent = 0;
 		row->visible_index = i;
@@ -250,15 +248,35 @@ void GUITable::setTable(const TableOptions &options,
 		s32 content_index;
 		// Next cell: Width in pixels
 		s32 content_width;
-		// Vector of completed cells in this row
-		std::vector<Cell> cells;
+		// Completed cells in this row, in m_cells
+		Cell *cells;
+		s32 cellcount;
 		// Stores colors and how long they last (maximum column index)
 		std::vector<std::pair<video::SColor, s32> > colors;
 
-		TempRow(): x(0), indent(0), content_index(0), content_width(0) {}
+		TempRow(): x(0), indent(0), content_index(0), content_width(0),
+			cells(NULL), cellcount(0) {}
 	};
 	TempRow *rows = new TempRow[rowcount];
 
+	// Every column but the color ones adds a cell to each row, so the
+	// cells of all the rows fit in one array. The last of those columns
+	// is found too: if it is left aligned text, the widths of its texts
+	// are not needed because nothing is to the right of it.
+	s32 cells_per_row = 0;
+	s32 last_cell_column = -1;
+	for (s32 j = 0; j < colcount; ++j) {
+		if (columns[j].type != "color") {
+			cells_per_row++;
+			last_cell_column = j;
+		}
+	}
+	if (cells_per_row != 0) {
+		m_cells.resize(rowcount * cells_per_row);
+		for (s32 i = 0; i < rowcount; ++i)
+			rows[i].cells = &m_cells[i * cells_per_row];
+	}
+
 	// Get em width. Pedantically speaking, the width of "M" is not
 	// necessarily the same as the em width, but whatever, close enough.
 	s32 em = 6;
@@ -353,14 +371,15 @@ void GUITable::setTable(const TableOptions &options,
 		newcell.reported_column = j+1;
 
 		if (columntype == COLUMN_TYPE_TEXT) {
+			bool measure = j != last_cell_column || align != 0;
 			// Find right edge of column
-			s32 xmax = 0;
+			s32 xmax = measure ? 0 : 0x7fff;  // something large enough
 			for (s32 i = 0; i < rowcount; ++i) {
 				TempRow *row = &rows[i];
 				row->content_index = allocString(content[i * colcount + j]);
-				const core::stringw &text = m_strings[row->content_index];
-				row->content_width = m_font ?
-					m_font->getDimension(text.c_str()).Width : 0;
+				if (!measure)
+					continue;
+				row->content_width = getStringWidth(row->content_index);
 				row->content_width = MYMAX(row->content_width, width);
 				s32 row_xmax = row->x + padding + row->content_width;
 				xmax = MYMAX(xmax, row_xmax);
@@ -373,7 +392,7 @@ void GUITable::setTable(const TableOptions &options,
 				newcell.color_defined = !rows[i].colors.empty();
 				if (newcell.color_defined)
 					newcell.color = rows[i].colors.back().first;
-				rows[i].cells.push_back(newcell);
+				rows[i].cells[rows[i].cellcount++] = newcell;
 				rows[i].x = newcell.xmax;
 			}
 		}
@@ -408,7 +427,7 @@ void GUITable::setTable(const TableOptions &options,
 				newcell.xmin = rows[i].x + padding;
 				alignContent(&newcell, xmax, rows[i].content_width, align);
 				newcell.content_index = rows[i].content_index;
-				rows[i].cells.push_back(newcell);
+				rows[i].cells[rows[i].cellcount++] = newcell;
 				rows[i].x = newcell.xmax;
 			}
 			active_image_indices.clear();
@@ -445,7 +464,7 @@ void GUITable::setTable(const TableOptions &options,
 				newcell.color_defined = !rows[i].colors.empty();
 				if (newcell.color_defined)
 					newcell.color = rows[i].colors.back().first;
-				row->cells.push_back(newcell);
+				row->cells[row->cellcount++] = newcell;
 				row->x = newcell.xmax;
 			}
 		}
@@ -456,10 +475,8 @@ void GUITable::setTable(const TableOptions &options,
 		m_rows.resize(rowcount);
 		for (s32 i = 0; i < rowcount; ++i) {
 			Row *row = &m_rows[i];
-			row->cellcount = rows[i].cells.size();
-			row->cells = new Cell[row->cellcount];
-			memcpy((void*) row->cells, (void*) &rows[i].cells[0],
-					row->cellcount * sizeof(Cell));
+			row->cellcount = rows[i].cellcount;
+			row->cells = rows[i].cells;
 			row->indent = rows[i].indent;
 			row->visible_index = i;
 			m_visible_rows.push_back(i);
@@ -494,9 +511,8 @@ void GUITable::setTable(const TableOptions &options,
 void GUITable::clear()
 {
 	// Clean up cells and rows
-	for (size_t i = 0; i < m_rows.size(); ++i)
-		delete[] m_rows[i].cells;
 	m_rows.clear();
+	m_cells.clear();
 	m_visible_rows.clear();
 
 	// Get colors from skin
@@ -516,6 +532,7 @@ void GUITable::clear()
 	m_keynav_buffer = L"";
 	m_border = true;
 	m_strings.clear();
+	m_string_widths.clear();
 	m_images.clear();
 	m_alloc_strings.clear();
 	m_alloc_images.clear();
@@ -922,6 +939,7 @@ s32 GUITable::allocString(const std::string &text)
 		s32 id = m_strings.size();
 		std::wstring wtext = narrow_to_wide(text);
 		m_strings.push_back(core::stringw(wtext.c_str()));
+		m_string_widths.push_back(-1);
 		m_alloc_strings.insert(std::make_pair(text, id));
 		return id;
 	}
@@ -930,6 +948,15 @@ s32 GUITable::allocString(const std::string &text)
 	}
 }
 
+s32 GUITable::getStringWidth(s32 index)
+{
+	// Measured once for each different string
+	if (m_string_widths[index] < 0)
+		m_string_widths[index] = m_font ?
+			m_font->getDimension(m_strings[index].c_str()).Width : 0;
+	return m_string_widths[index];
+}
+
 s32 GUITable::allocImage(const std::string &imagename)
 {
 	std::map<std::string, s32>::iterator it = m_alloc_images.find(imagename);
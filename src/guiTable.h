@@ -172,6 +172,7 @@ class GUITable : public gui::IGUIElement
 	};
 
 	struct Row {
+		// In m_cells
 		Cell *cells;
 		s32 cellcount;
 		s32 indent;
@@ -186,6 +187,8 @@ class GUITable : public gui::IGUIElement
 
 	// Table content (including hidden rows)
 	std::vector<Row> m_rows;
+	// The cells of all the rows, in order
+	std::vector<Cell> m_cells;
 	// Table content (only visible; indices into m_rows)
 	std::vector<s32> m_visible_rows;
 	bool m_is_textlist;
@@ -212,11 +215,14 @@ class GUITable : public gui::IGUIElement
 
 	// Allocated strings and images
 	std::vector<core::stringw> m_strings;
+	// Width of each string in pixels, or -1 if it hasn't been measured
+	std::vector<s32> m_string_widths;
 	std::vector<video::ITexture*> m_images;
 	std::map<std::string, s32> m_alloc_strings;
 	std::map<std::string, s32> m_alloc_images;
 
 	s32 allocString(const std::string &text);
+	s32 getStringWidth(s32 index);
 	s32 allocImage(const std::string &imagename);
 	void allocationComplete();
 
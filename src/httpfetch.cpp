@@ -317,6 +317,16 @@ HTTPFetchOngoing::HTTPFetchOngoing(HTTPFetchRequest request_, CurlHandlePool *po
 	if (!g_settings->getBool("curl_verify_cert")) {
 		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, false);
 	}
+
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	// Ask for HTTP/2 where TLS can negotiate it (curl 7.47.0)
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	// Rather wait for a connection to the host that is being made and
+	// share it than open another one (curl 7.43.0)
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
 }
 
 CURLcode HTTPFetchOngoing::start(CURLM *multi_)
@@ -634,6 +644,13 @@ class CurlFetchThread : public JThread
 			return NULL;
 		}
 
+		// The multi handle keeps the connections of finished transfers
+		// and gives them to the next ones to the same host. The fetches
+		// to a host that speaks HTTP/2 all go over one connection.
+#if LIBCURL_VERSION_NUM >= 0x072b00
+		curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
 		assert(m_all_ongoing.empty());
 
 		while (!StopRequested()) {
@@ -439,7 +439,6 @@ InventoryList::InventoryList(std::string name, u32 size, IItemDefManager *itemde
 	m_width = 0;
 	m_itemdef = itemdef;
 	clearItems();
-	//m_dirty = false;
 }
 
 InventoryList::~InventoryList()
@@ -455,23 +454,31 @@ void InventoryList::clearItems()
 		m_items.push_back(ItemStack());
 	}
 
-	//setDirty(true);
+	m_changed_slots.clear();
+	m_layout_changed = true;
 }
 
 void InventoryList::setSize(u32 newsize)
 {
 	if(newsize != m_items.size())
+	{
 		m_items.resize(newsize);
+		m_layout_changed = true;
+	}
 	m_size = newsize;
 }
 
 void InventoryList::setWidth(u32 newwidth)
 {
+	if(newwidth != m_width)
+		m_layout_changed = true;
 	m_width = newwidth;
 }
 
 void InventoryList::setName(const std::string &name)
 {
+	if(name != m_name)
+		m_layout_changed = true;
 	m_name = name;
 }
 
@@ -562,7 +569,8 @@ InventoryList & InventoryList::operator = (const InventoryList &other)
 	m_width = other.m_width;
 	m_name = other.m_name;
 	m_itemdef = other.m_itemdef;
-	//setDirty(true);
+	m_changed_slots.clear();
+	m_layout_changed = true;
 
 	return *this;
 }
@@ -627,6 +635,7 @@ const ItemStack& InventoryList::getItem(u32 i) const
 ItemStack& InventoryList::getItem(u32 i)
 {
 	assert(i < m_size);
+	setSlotChanged(i);
 	return m_items[i];
 }
 
@@ -637,7 +646,7 @@ ItemStack InventoryList::changeItem(u32 i, const ItemStack &newitem)
 
 	ItemStack olditem = m_items[i];
 	m_items[i] = newitem;
-	//setDirty(true);
+	setSlotChanged(i);
 	return olditem;
 }
 
@@ -645,6 +654,7 @@ void InventoryList::deleteItem(u32 i)
 {
 	assert(i < m_items.size());
 	m_items[i].clear();
+	setSlotChanged(i);
 }
 
 ItemStack InventoryList::addItem(const ItemStack &newitem_)
@@ -692,8 +702,8 @@ ItemStack InventoryList::addItem(u32 i, const ItemStack &newitem)
 		return newitem;
 
 	ItemStack leftover = m_items[i].addItem(newitem, m_itemdef);
-	//if(leftover != newitem)
-	//	setDirty(true);
+	if(leftover.count != newitem.count)
+		setSlotChanged(i);
 	return leftover;
 }
 
@@ -755,6 +765,7 @@ ItemStack InventoryList::removeItem(const ItemStack &item)
 		if(i->name == item.name)
 		{
 			u32 still_to_remove = item.count - removed.count;
+			setSlotChanged(m_items.rend() - i - 1);
 			removed.addItem(i->takeItem(still_to_remove), m_itemdef);
 			if(removed.count == item.count)
 				break;
@@ -769,8 +780,8 @@ ItemStack InventoryList::takeItem(u32 i, u32 takecount)
 		return ItemStack();
 
 	ItemStack taken = m_items[i].takeItem(takecount);
-	//if(!taken.empty())
-	//	setDirty(true);
+	if(!taken.empty())
+		setSlotChanged(i);
 	return taken;
 }
 
@@ -837,6 +848,7 @@ Inventory::~Inventory()
 void Inventory::clear()
 {
 	m_dirty = true;
+	m_lists_changed = true;
 	for(u32 i=0; i<m_lists.size(); i++)
 	{
 		delete m_lists[i];
@@ -860,6 +872,7 @@ void Inventory::clearContents()
 Inventory::Inventory(IItemDefManager *itemdef)
 {
 	m_dirty = false;
+	m_lists_changed = true;
 	m_itemdef = itemdef;
 }
 
@@ -953,6 +966,85 @@ void Inventory::deSerialize(std::istream &is)
 	}
 }
 
+/*
+	u16 number of lists with changes
+	for each list:
+		u16 len, u8[len] list name
+		u16 number of changed slots
+		for each slot:
+			u16 index
+			u32 len, u8[len] item string, empty for an empty slot
+*/
+bool Inventory::serializeChanges(std::ostream &os) const
+{
+	if(m_lists_changed)
+		return false;
+
+	u32 changed_lists = 0;
+	for(u32 i=0; i<m_lists.size(); i++)
+	{
+		InventoryList *list = m_lists[i];
+		if(list->isLayoutChanged() || list->getSize() > 65535)
+			return false;
+		if(!list->getChangedSlots().empty())
+			changed_lists++;
+	}
+	if(changed_lists == 0)
+		return false;
+
+	writeU16(os, changed_lists);
+	for(u32 i=0; i<m_lists.size(); i++)
+	{
+		const InventoryList *list = m_lists[i];
+		const std::set<u32> &slots = list->getChangedSlots();
+		if(slots.empty())
+			continue;
+		os<<serializeString(list->getName());
+		writeU16(os, slots.size());
+		for(std::set<u32>::const_iterator
+				j = slots.begin(); j != slots.end(); ++j)
+		{
+			const ItemStack &item = list->getItem(*j);
+			writeU16(os, *j);
+			os<<serializeLongString(item.empty() ? "" : item.getItemString());
+		}
+	}
+	return true;
+}
+
+void Inventory::deSerializeChanges(std::istream &is)
+{
+	u16 changed_lists = readU16(is);
+	for(u16 i=0; i<changed_lists; i++)
+	{
+		std::string listname = deSerializeString(is);
+		InventoryList *list = getList(listname);
+		if(list == NULL)
+			throw SerializationError("changes of unknown inventory list "
+					+ listname);
+		u16 count = readU16(is);
+		for(u16 j=0; j<count; j++)
+		{
+			u16 index = readU16(is);
+			std::string itemstring = deSerializeLongString(is);
+			if(index >= list->getSize())
+				throw SerializationError("changed slot out of range");
+			ItemStack item;
+			if(!itemstring.empty())
+				item.deSerialize(itemstring, m_itemdef);
+			list->changeItem(index, item);
+		}
+	}
+	m_dirty = true;
+}
+
+void Inventory::clearChanges()
+{
+	m_lists_changed = false;
+	for(u32 i=0; i<m_lists.size(); i++)
+		m_lists[i]->clearChanges();
+}
+
 InventoryList * Inventory::addList(const std::string &name, u32 size)
 {
 	m_dirty = true;
@@ -963,6 +1055,7 @@ InventoryList * Inventory::addList(const std::string &name, u32 size)
 		{
 			delete m_lists[i];
 			m_lists[i] = new InventoryList(name, size, m_itemdef);
+			m_lists_changed = true;
 		}
 		return m_lists[i];
 	}
@@ -973,6 +1066,7 @@ InventoryList * Inventory::addList(const std::string &name, u32 size)
 
 		InventoryList *list = new InventoryList(name, size, m_itemdef);
 		m_lists.push_back(list);
+		m_lists_changed = true;
 		return list;
 	}
 }
@@ -996,12 +1090,22 @@ std::vector<const InventoryList*> Inventory::getLists()
 	return lists;
 }
 
+u32 Inventory::getMemoryUsage() const
+{
+	u32 size = sizeof(Inventory);
+	for(u32 i=0; i<m_lists.size(); i++)
+		size += sizeof(InventoryList) + m_lists[i]->getName().size() +
+				m_lists[i]->getSize() * sizeof(ItemStack);
+	return size;
+}
+
 bool Inventory::deleteList(const std::string &name)
 {
 	s32 i = getListIndex(name);
 	if(i == -1)
 		return false;
 	m_dirty = true;
+	m_lists_changed = true;
 	delete m_lists[i];
 	m_lists.erase(m_lists.begin() + i);
 	return true;
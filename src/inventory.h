@@ -27,6 +27,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <ostream>
 #include <string>
 #include <vector>
+#include <set>
 
 struct ToolCapabilities;
 
@@ -246,11 +247,38 @@ class InventoryList
 	// count is the maximum number of items to move (0 for everything)
 	void moveItem(u32 i, InventoryList *dest, u32 dest_i, u32 count = 0);
 
+	/*
+		Changes since the last clearChanges(), for sending only the
+		changed slots to clients.  Handing out a non-const reference to
+		an item counts as changing it.  Changes of the size, width or
+		name are not tracked per slot; they need the whole list.
+	*/
+	const std::set<u32> &getChangedSlots() const
+	{
+		return m_changed_slots;
+	}
+	bool isLayoutChanged() const
+	{
+		return m_layout_changed;
+	}
+	void clearChanges()
+	{
+		m_changed_slots.clear();
+		m_layout_changed = false;
+	}
+
 private:
+	void setSlotChanged(u32 i)
+	{
+		m_changed_slots.insert(i);
+	}
+
 	std::vector<ItemStack> m_items;
 	u32 m_size, m_width;
 	std::string m_name;
 	IItemDefManager *m_itemdef;
+	std::set<u32> m_changed_slots;
+	bool m_layout_changed;
 };
 
 class Inventory
@@ -278,6 +306,8 @@ class Inventory
 	const InventoryList * getList(const std::string &name) const;
 	std::vector<const InventoryList*> getLists();
 	bool deleteList(const std::string &name);
+	// Estimate of the bytes taken by the inventory and its lists
+	u32 getMemoryUsage() const;
 	// A shorthand for adding items. Returns leftover item (possibly empty).
 	ItemStack addItem(const std::string &listname, const ItemStack &newitem)
 	{
@@ -298,6 +328,18 @@ class Inventory
 		m_dirty = x;
 	}
 
+	/*
+		Writes the slots changed since the last clearChanges(), in a
+		binary format read by deSerializeChanges().  Returns false
+		without writing anything if the whole inventory has to be sent
+		instead: when lists were added, removed or resized, or when no
+		slot was changed, in which case the send is meant to undo the
+		client's own guesses.
+	*/
+	bool serializeChanges(std::ostream &os) const;
+	void deSerializeChanges(std::istream &is);
+	void clearChanges();
+
 private:
 	// -1 if not found
 	const s32 getListIndex(const std::string &name) const;
@@ -305,6 +347,7 @@ class Inventory
 	std::vector<InventoryList*> m_lists;
 	IItemDefManager *m_itemdef;
 	bool m_dirty;
+	bool m_lists_changed;
 };
 
 #endif
@@ -36,7 +36,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/serialize.h"
 #include "util/container.h"
 #include "util/thread.h"
+#include "clientserver.h" // LATEST_PROTOCOL_VERSION
 #include <map>
+#include <sstream>
 #include <set>
 
 #ifdef __ANDROID__
@@ -414,6 +416,11 @@ class CItemDefManager: public IWritableItemDefManager
 				params.light_position.set(10, 100, -50);
 				params.light_color.set(1.0, 0.5, 0.5, 0.5);
 				params.light_radius = 1000;
+				// The image only depends on the definition of the node
+				// and on the media, which the image cache knows of
+				std::ostringstream os(std::ios::binary);
+				f.serialize(os, LATEST_PROTOCOL_VERSION);
+				params.cache_name = "INVENTORY_" + def.name + "_" + os.str();
 
 #ifdef __ANDROID__
 				params.camera_position.set(0, -1.0, -1.5);
@@ -468,7 +475,8 @@ class CItemDefManager: public IWritableItemDefManager
 		else
 		{
 			// We're gonna ask the result to be put into here
-			static ResultQueue<std::string, ClientCached*, u8, u8> result_queue;
+			ResultQueue<std::string, ClientCached*, u8, u8> &result_queue =
+					*m_get_clientcached_results.get();
 
 			// Throw a request in
 			m_get_clientcached_queue.add(name, 0, 0, &result_queue);
@@ -653,6 +661,8 @@ class CItemDefManager: public IWritableItemDefManager
 	mutable MutexedMap<std::string, ClientCached*> m_clientcached;
 	// Queued clientcached fetches (to be processed by the main thread)
 	mutable RequestQueue<std::string, ClientCached*, u8, u8> m_get_clientcached_queue;
+	mutable ThreadResultQueues<std::string, ClientCached*, u8, u8>
+			m_get_clientcached_results;
 #endif
 };
 
@@ -0,0 +1,525 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "loadtest.h"
+#include <sstream>
+#include <cmath>
+#include <vector>
+#include "connection.h"
+#include "clientserver.h"
+#include "constants.h"
+#include "serialization.h"
+#include "player.h"
+#include "porting.h"
+#include "version.h"
+#include "config.h"
+#include "log.h"
+#include "exceptions.h"
+#include "util/pointedthing.h"
+#include "util/serialize.h"
+#include "util/numeric.h"
+#include "util/string.h"
+
+// Bots connecting per second, like players joining
+#define LOADTEST_JOIN_RATE 20
+// Seconds between the reports
+#define LOADTEST_REPORT_INTERVAL 5.0
+// Nodes the bots walk away from their spawn point at most
+#define LOADTEST_WALK_RADIUS 48
+// Begins the chat messages of the bots, followed by the send time
+#define LOADTEST_CHAT_MARKER "loadtest "
+
+struct LoadTestStats
+{
+	LoadTestStats():
+		packets(0),
+		bytes(0),
+		chat_count(0),
+		chat_latency_sum(0),
+		chat_latency_max(0)
+	{}
+
+	void add(const LoadTestStats &other)
+	{
+		packets += other.packets;
+		bytes += other.bytes;
+		chat_count += other.chat_count;
+		chat_latency_sum += other.chat_latency_sum;
+		chat_latency_max = MYMAX(chat_latency_max, other.chat_latency_max);
+	}
+
+	u32 packets;
+	u32 bytes;
+	// Delays of the chat messages of the bots, in milliseconds
+	u32 chat_count;
+	u32 chat_latency_sum;
+	u32 chat_latency_max;
+};
+
+/*
+	A player without a map; only the packets that are needed to stay in
+	the game are handled.
+*/
+class LoadTestBot : public con::PeerHandler
+{
+public:
+	LoadTestBot(const std::string &name, const Address &address,
+			LoadTestStats *stats);
+	~LoadTestBot();
+
+	void step(float dtime);
+
+	bool isReady()
+	{
+		return m_state == STATE_READY;
+	}
+	bool isGone()
+	{
+		return m_state == STATE_GONE;
+	}
+	// Average round trip time to the server, -1 if not connected
+	float getRTT()
+	{
+		return m_con.getPeerStat(PEER_ID_SERVER, con::AVG_RTT);
+	}
+
+	// con::PeerHandler
+	void peerAdded(con::Peer *peer)
+	{
+	}
+	void deletingPeer(con::Peer *peer, bool timeout)
+	{
+		m_state = STATE_GONE;
+	}
+
+private:
+	enum State
+	{
+		// Sending TOSERVER_INIT until the server answers
+		STATE_CONNECTING,
+		// Receiving the definitions
+		STATE_INIT,
+		STATE_READY,
+		STATE_GONE,
+	};
+
+	void receive();
+	void processData(u8 *data, u32 datasize);
+	void send(u8 channelnum, const std::string &s, bool reliable);
+
+	void sendInit();
+	void sendReady();
+	void sendPlayerPos();
+	void sendInteract(u8 action, v3s16 under, v3s16 above);
+	void sendChatMessage(const std::string &message);
+
+	void walk(float dtime);
+
+	con::Connection m_con;
+	std::string m_name;
+	LoadTestStats *m_stats;
+	State m_state;
+	float m_init_timer;
+
+	v3f m_spawn;
+	v3f m_position;
+	v3f m_speed;
+	f32 m_yaw;
+	float m_send_interval;
+	float m_send_timer;
+	float m_turn_timer;
+
+	// Dig the node below, then place it back
+	float m_dig_timer;
+	bool m_digging;
+	v3s16 m_dig_p;
+
+	float m_chat_timer;
+};
+
+LoadTestBot::LoadTestBot(const std::string &name, const Address &address,
+		LoadTestStats *stats):
+	m_con(PROTOCOL_ID, 512, CONNECTION_TIMEOUT, address.isIPv6(), this),
+	m_name(name),
+	m_stats(stats),
+	m_state(STATE_CONNECTING),
+	m_init_timer(0.0),
+	m_spawn(0, 0, 0),
+	m_position(0, 0, 0),
+	m_speed(0, 0, 0),
+	m_yaw(0),
+	m_send_interval(0.1),
+	m_send_timer(0.0),
+	m_turn_timer(0.0),
+	m_dig_timer(myrand_range(2, 10)),
+	m_digging(false),
+	m_dig_p(0, 0, 0),
+	m_chat_timer(myrand_range(10, 40))
+{
+	m_con.SetTimeoutMs(0);
+	m_con.Connect(address);
+}
+
+LoadTestBot::~LoadTestBot()
+{
+	m_con.Disconnect();
+}
+
+void LoadTestBot::step(float dtime)
+{
+	receive();
+
+	if(m_state == STATE_CONNECTING){
+		m_init_timer -= dtime;
+		if(m_init_timer <= 0.0){
+			m_init_timer = 2.0;
+			sendInit();
+		}
+		return;
+	}
+	if(m_state != STATE_READY)
+		return;
+
+	walk(dtime);
+
+	m_send_timer += dtime;
+	if(m_send_timer >= m_send_interval){
+		m_send_timer = 0.0;
+		sendPlayerPos();
+	}
+
+	m_dig_timer -= dtime;
+	if(m_dig_timer <= 0.0){
+		if(!m_digging){
+			m_dig_p = floatToInt(m_position, BS) - v3s16(0, 1, 0);
+			sendInteract(0, m_dig_p, m_dig_p + v3s16(0, 1, 0));
+			m_digging = true;
+			m_dig_timer = 1.0;
+		} else {
+			sendInteract(2, m_dig_p, m_dig_p + v3s16(0, 1, 0));
+			sendInteract(3, m_dig_p - v3s16(0, 1, 0), m_dig_p);
+			m_digging = false;
+			m_dig_timer = myrand_range(5, 15);
+		}
+	}
+
+	m_chat_timer -= dtime;
+	if(m_chat_timer <= 0.0){
+		m_chat_timer = myrand_range(20, 40);
+		sendChatMessage(LOADTEST_CHAT_MARKER + itos(porting::getTimeMs()));
+	}
+}
+
+void LoadTestBot::walk(float dtime)
+{
+	m_turn_timer -= dtime;
+	v3f offset = m_position - m_spawn;
+	offset.Y = 0;
+	if(m_turn_timer <= 0.0 || offset.getLength() > LOADTEST_WALK_RADIUS * BS){
+		m_turn_timer = myrand_range(2, 6);
+		if(offset.getLength() > LOADTEST_WALK_RADIUS * BS)
+			// Back towards the spawn point
+			m_yaw = atan2(offset.X, -offset.Z) * core::RADTODEG;
+		else
+			m_yaw = myrand_range(0, 359);
+		// At walking speed
+		m_speed = v3f(-sin(m_yaw * core::DEGTORAD), 0,
+				cos(m_yaw * core::DEGTORAD)) * 4 * BS;
+	}
+	m_position += m_speed * dtime;
+}
+
+void LoadTestBot::receive()
+{
+	for(;;){
+		u16 peer_id;
+		SharedBuffer<u8> data;
+		u32 datasize;
+		try{
+			datasize = m_con.Receive(peer_id, data);
+		}
+		catch(con::NoIncomingDataException &e){
+			return;
+		}
+		catch(con::InvalidIncomingDataException &e){
+			continue;
+		}
+		m_stats->packets++;
+		m_stats->bytes += datasize;
+		try{
+			processData(*data, datasize);
+		}
+		catch(SerializationError &e){
+			infostream<<m_name<<": invalid packet: "<<e.what()<<std::endl;
+		}
+	}
+}
+
+void LoadTestBot::processData(u8 *data, u32 datasize)
+{
+	if(datasize < 2)
+		return;
+	ToClientCommand command = (ToClientCommand)readU16(&data[0]);
+
+	if(command == TOCLIENT_INIT){
+		if(datasize < 2+1+6 || m_state != STATE_CONNECTING)
+			return;
+		m_spawn = intToFloat(readV3S16(&data[2+1]), BS) - v3f(0, BS/2, 0);
+		m_position = m_spawn;
+		if(datasize >= 2+1+6+8+4)
+			m_send_interval = readF1000(&data[2+1+6+8]);
+
+		SharedBuffer<u8> reply(2);
+		writeU16(&reply[0], TOSERVER_INIT2);
+		m_con.Send(PEER_ID_SERVER, 1, reply, true);
+		m_state = STATE_INIT;
+	}
+	else if(command == TOCLIENT_ACCESS_DENIED){
+		std::wstring reason = L"Unknown";
+		if(datasize >= 4){
+			std::string datastring((char*)&data[2], datasize-2);
+			std::istringstream is(datastring, std::ios_base::binary);
+			reason = deSerializeWideString(is);
+		}
+		errorstream<<"Load test: "<<m_name<<" was denied access: "
+				<<wide_to_narrow(reason)<<std::endl;
+		m_state = STATE_GONE;
+	}
+	else if(command == TOCLIENT_ANNOUNCE_MEDIA){
+		// Sent after the definitions; the bots need no media
+		if(m_state == STATE_INIT){
+			sendReady();
+			m_state = STATE_READY;
+		}
+	}
+	else if(command == TOCLIENT_BLOCKDATA){
+		if(datasize < 8)
+			return;
+		// Acknowledge the block, or the server stops sending
+		SharedBuffer<u8> reply(2+1+6);
+		writeU16(&reply[0], TOSERVER_GOTBLOCKS);
+		reply[2] = 1;
+		memcpy(&reply[3], &data[2], 6);
+		m_con.Send(PEER_ID_SERVER, 2, reply, true);
+	}
+	else if(command == TOCLIENT_MOVE_PLAYER){
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+		m_position = readV3F1000(is);
+	}
+	else if(command == TOCLIENT_DEATHSCREEN){
+		SharedBuffer<u8> reply(2);
+		writeU16(&reply[0], TOSERVER_RESPAWN);
+		m_con.Send(PEER_ID_SERVER, 0, reply, true);
+	}
+	else if(command == TOCLIENT_CHAT_MESSAGE){
+		if(datasize < 4)
+			return;
+		u16 len = readU16(&data[2]);
+		if(datasize < 4 + (u32)len * 2)
+			return;
+		std::string message;
+		for(u16 i = 0; i < len; i++)
+			message += (char)readU16(&data[4 + i * 2]);
+
+		// Messages of the bots are "<name> loadtest <send time>"
+		size_t pos = message.find(std::string("> ") + LOADTEST_CHAT_MARKER);
+		if(pos == std::string::npos)
+			return;
+		u32 sent = stoi(message.substr(pos + 2 + strlen(LOADTEST_CHAT_MARKER)));
+		u32 latency = porting::getTimeMs() - sent;
+		m_stats->chat_count++;
+		m_stats->chat_latency_sum += latency;
+		m_stats->chat_latency_max = MYMAX(m_stats->chat_latency_max, latency);
+	}
+}
+
+void LoadTestBot::send(u8 channelnum, const std::string &s, bool reliable)
+{
+	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+	m_con.Send(PEER_ID_SERVER, channelnum, data, reliable);
+}
+
+void LoadTestBot::sendInit()
+{
+	// [0] u16 TOSERVER_INIT
+	// [2] u8 SER_FMT_VER_HIGHEST_READ
+	// [3] u8[20] player_name
+	// [23] u8[28] password
+	// [51] u16 minimum supported network protocol version
+	// [53] u16 maximum supported network protocol version
+	SharedBuffer<u8> data(2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2+2);
+	writeU16(&data[0], TOSERVER_INIT);
+	writeU8(&data[2], SER_FMT_VER_HIGHEST_READ);
+	memset((char*)&data[3], 0, PLAYERNAME_SIZE);
+	snprintf((char*)&data[3], PLAYERNAME_SIZE, "%s", m_name.c_str());
+	memset((char*)&data[23], 0, PASSWORD_SIZE);
+	writeU16(&data[51], CLIENT_PROTOCOL_VERSION_MIN);
+	writeU16(&data[53], CLIENT_PROTOCOL_VERSION_MAX);
+	// Send as unreliable, like the client
+	m_con.Send(PEER_ID_SERVER, 1, data, false);
+}
+
+void LoadTestBot::sendReady()
+{
+	std::ostringstream os(std::ios_base::binary);
+	writeU16(os, TOSERVER_CLIENT_READY);
+	writeU8(os, VERSION_MAJOR);
+	writeU8(os, VERSION_MINOR);
+	writeU8(os, VERSION_PATCH_ORIG);
+	writeU8(os, 0);
+	writeU16(os, strlen(minetest_version_hash));
+	os.write(minetest_version_hash, strlen(minetest_version_hash));
+	send(0, os.str(), true);
+}
+
+void LoadTestBot::sendPlayerPos()
+{
+	SharedBuffer<u8> data(2+12+12+4+4+4);
+	writeU16(&data[0], TOSERVER_PLAYERPOS);
+	writeV3S32(&data[2], v3s32(m_position.X*100, m_position.Y*100,
+			m_position.Z*100));
+	writeV3S32(&data[2+12], v3s32(m_speed.X*100, m_speed.Y*100,
+			m_speed.Z*100));
+	writeS32(&data[2+12+12], 0);
+	writeS32(&data[2+12+12+4], m_yaw*100);
+	// Walking forward
+	writeU32(&data[2+12+12+4+4], 1);
+	m_con.Send(PEER_ID_SERVER, 0, data, false);
+}
+
+void LoadTestBot::sendInteract(u8 action, v3s16 under, v3s16 above)
+{
+	PointedThing pointed;
+	pointed.type = POINTEDTHING_NODE;
+	pointed.node_undersurface = under;
+	pointed.node_abovesurface = above;
+
+	std::ostringstream os(std::ios_base::binary);
+	writeU16(os, TOSERVER_INTERACT);
+	writeU8(os, action);
+	writeU16(os, 0);
+	std::ostringstream tmp_os(std::ios::binary);
+	pointed.serialize(tmp_os);
+	os<<serializeLongString(tmp_os.str());
+	send(0, os.str(), true);
+}
+
+void LoadTestBot::sendChatMessage(const std::string &message)
+{
+	std::ostringstream os(std::ios_base::binary);
+	writeU16(os, TOSERVER_CHAT_MESSAGE);
+	writeU16(os, message.size());
+	for(u32 i = 0; i < message.size(); i++)
+		writeU16(os, message[i]);
+	send(0, os.str(), true);
+}
+
+/*
+	run_load_test
+*/
+
+static void print_load_test_report(const char *what, float time,
+		u32 ready, u32 count, const LoadTestStats &stats, float rtt)
+{
+	dstream<<"Load test: "<<what<<": "<<ready<<"/"<<count<<" bots in game, "
+		<<(stats.bytes / 1024.0 / time)<<" KiB/s and "
+		<<(stats.packets / time)<<" packets/s received by all bots, ";
+	if(rtt >= 0)
+		dstream<<"RTT "<<(rtt * 1000)<<" ms, ";
+	if(stats.chat_count > 0)
+		dstream<<"chat delay avg "
+			<<(stats.chat_latency_sum / stats.chat_count)<<" ms max "
+			<<stats.chat_latency_max<<" ms ("<<stats.chat_count<<" messages)";
+	else
+		dstream<<"no chat messages";
+	dstream<<std::endl;
+}
+
+bool run_load_test(const Address &address, u32 count, float duration)
+{
+	bool &kill = *porting::signal_handler_killstatus();
+
+	dstream<<"Load test: connecting "<<count<<" bots to "
+		<<address.serializeString()<<":"<<address.getPort()
+		<<" for "<<duration<<"s"<<std::endl;
+
+	std::vector<LoadTestBot*> bots;
+	LoadTestStats total;
+	LoadTestStats interval;
+	u32 max_ready = 0;
+
+	u32 start_ms = porting::getTimeMs();
+	u32 last_ms = start_ms;
+	float report_timer = 0.0;
+	float join_timer = 0.0;
+	float time = 0.0;
+	while(time < duration && !kill){
+		sleep_ms(20);
+		u32 now_ms = porting::getTimeMs();
+		float dtime = (now_ms - last_ms) / 1000.0;
+		last_ms = now_ms;
+		time = (now_ms - start_ms) / 1000.0;
+
+		join_timer += dtime * LOADTEST_JOIN_RATE;
+		while(join_timer >= 1.0 && bots.size() < count){
+			join_timer -= 1.0;
+			bots.push_back(new LoadTestBot(
+					"loadtest" + itos(bots.size() + 1),
+					address, &interval));
+		}
+
+		for(u32 i = 0; i < bots.size(); i++)
+			bots[i]->step(dtime);
+
+		report_timer += dtime;
+		if(report_timer < LOADTEST_REPORT_INTERVAL)
+			continue;
+
+		u32 ready = 0;
+		u32 gone = 0;
+		float rtt_sum = 0;
+		for(u32 i = 0; i < bots.size(); i++){
+			if(bots[i]->isGone())
+				gone++;
+			if(!bots[i]->isReady())
+				continue;
+			ready++;
+			rtt_sum += MYMAX(bots[i]->getRTT(), 0);
+		}
+		print_load_test_report("last interval", report_timer, ready, count,
+				interval, ready > 0 ? rtt_sum / ready : -1);
+		if(gone > 0)
+			dstream<<"Load test: "<<gone<<" bots were disconnected"<<std::endl;
+		max_ready = MYMAX(max_ready, ready);
+
+		total.add(interval);
+		interval = LoadTestStats();
+		report_timer = 0.0;
+	}
+
+	total.add(interval);
+	if(time > 0)
+		print_load_test_report("total", time, max_ready, count, total, -1);
+
+	for(u32 i = 0; i < bots.size(); i++)
+		delete bots[i];
+
+	return max_ready > 0;
+}
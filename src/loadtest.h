@@ -0,0 +1,39 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef LOADTEST_HEADER
+#define LOADTEST_HEADER
+
+#include "irrlichttypes.h"
+
+class Address;
+
+/*
+	Connects count headless bots to the server at address for duration
+	seconds.  The bots speak the network protocol without a map, meshes
+	or media: they log in without a password as loadtest1, loadtest2,
+	..., walk around the spawn point randomly, dig and place below
+	themselves and chat.  Every few seconds the number of bots in the
+	game, the received data and the round trip times are printed; the
+	chat messages of the bots carry their send time, so the delay of
+	chat through the server is measured too.
+*/
+bool run_load_test(const Address &address, u32 count, float duration);
+
+#endif
@@ -76,6 +76,18 @@ void log_deregister_thread()
 	log_threadnamemutex.Unlock();
 }
 
+std::string log_get_thread_name()
+{
+	std::string threadname = "(unknown thread)";
+	log_threadnamemutex.Lock();
+	std::map<threadid_t, std::string>::const_iterator i =
+			log_threadnames.find(get_current_thread_id());
+	if(i != log_threadnames.end())
+		threadname = i->second;
+	log_threadnamemutex.Unlock();
+	return threadname;
+}
+
 static std::string get_lev_string(enum LogMessageLevel lev)
 {
 	switch(lev){
@@ -54,6 +54,8 @@ void log_remove_output(ILogOutput *out);
 
 void log_register_thread(const std::string &name);
 void log_deregister_thread();
+// The name registered for the current thread
+std::string log_get_thread_name();
 
 void log_printline(enum LogMessageLevel lev, const std::string &text);
 
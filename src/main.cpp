@@ -50,6 +50,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes_extrabloated.h"
 #include "debug.h"
 #include "test.h"
+#include "mapgen_benchmark.h"
+#include "benchmark.h"
+#include "packettrace.h"
+#include "loadtest.h"
 #include "clouds.h"
 #include "server.h"
 #include "constants.h"
@@ -74,12 +78,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "quicktune.h"
 #include "serverlist.h"
 #include "httpfetch.h"
+#include "workerpool.h"
 #include "guiEngine.h"
 #include "mapsector.h"
 #include "player.h"
 #include "fontengine.h"
 
 #include "database-sqlite3.h"
+#include "database-region.h"
 #ifdef USE_LEVELDB
 #include "database-leveldb.h"
 #endif
@@ -176,6 +182,7 @@ static bool determine_subgame(GameParams *game_params);
 static bool run_dedicated_server(const GameParams &game_params, const Settings &cmd_args);
 static bool migrate_database(const GameParams &game_params, const Settings &cmd_args,
 		Server *server);
+static bool run_load_test_from_cmdline(const Settings &cmd_args);
 
 #ifndef SERVER
 static bool print_video_modes();
@@ -832,6 +839,9 @@ int main(int argc, char *argv[])
 	if (!init_common(&game_params.log_level, cmd_args, argc, argv))
 		return 1;
 
+	// The worker threads are started by the first one to use them
+	atexit(shutdownWorkerPool);
+
 #ifndef __ANDROID__
 	// Run unit tests
 	if ((ENABLE_TESTS && cmd_args.getFlag("disable-unittests") == false)
@@ -840,6 +850,10 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	// Load test of a running server, no world is needed
+	if (cmd_args.exists("loadtest"))
+		return run_load_test_from_cmdline(cmd_args) ? 0 : 1;
+
 #ifdef SERVER
 	game_params.is_dedicated_server = true;
 #else
@@ -931,6 +945,20 @@ static void set_allowed_options(OptionList *allowed_options)
 			_("Set gameid (\"--gameid list\" prints available ones)"))));
 	allowed_options->insert(std::make_pair("migrate", ValueSpec(VALUETYPE_STRING,
 			_("Migrate from current map backend to another (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("mapgen-benchmark", ValueSpec(VALUETYPE_STRING,
+			_("Generate the given number of mapchunks in a temporary world and print the speed of the mapgen (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("benchmark", ValueSpec(VALUETYPE_STRING,
+			_("Time the core data paths in a temporary world and write the results as JSON to the given file ('' = only print them) (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("benchmark-filter", ValueSpec(VALUETYPE_STRING,
+			_("Only run the benchmarks with names containing this"))));
+	allowed_options->insert(std::make_pair("replay", ValueSpec(VALUETYPE_STRING,
+			_("Replay a packet trace recorded with packet_trace_path in a copy of the world and print the time it took (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("loadtest", ValueSpec(VALUETYPE_STRING,
+			_("Connect the given number of headless bots to a server and print its latency and throughput"))));
+	allowed_options->insert(std::make_pair("loadtest-address", ValueSpec(VALUETYPE_STRING,
+			_("Address of the server for --loadtest (default: localhost; the port is set with --port)"))));
+	allowed_options->insert(std::make_pair("loadtest-duration", ValueSpec(VALUETYPE_STRING,
+			_("Seconds to run --loadtest for (default: 60)"))));
 #ifndef SERVER
 	allowed_options->insert(std::make_pair("videomodes", ValueSpec(VALUETYPE_FLAG,
 			_("Show available video modes"))));
@@ -1105,6 +1133,10 @@ static bool init_common(int *log_level, const Settings &cmd_args, int argc, char
 	// Initialize HTTP fetcher
 	httpfetch_init(g_settings->getS32("curl_parallel_limit"));
 
+	if (g_settings->getBool("profiler_trace"))
+		profiler_trace_init(MYMAX(g_settings->getS32(
+				"profiler_trace_events_per_thread"), 1));
+
 #ifdef _MSC_VER
 	init_gettext((porting::path_share + DIR_DELIM + "locale").c_str(),
 		g_settings->get("language"), argc, argv);
@@ -1458,6 +1490,22 @@ static bool run_dedicated_server(const GameParams &game_params, const Settings &
 		return false;
 	}
 
+	// Mapgen benchmark, in a world of its own
+	if (cmd_args.exists("mapgen-benchmark"))
+		return run_mapgen_benchmark(game_params.game_spec,
+				mystoi(cmd_args.get("mapgen-benchmark"), 0, 1000000));
+
+	// Packet trace replay, in a copy of the world
+	if (cmd_args.exists("replay"))
+		return run_packet_replay(game_params.game_spec,
+				game_params.world_path, cmd_args.get("replay"));
+
+	// Benchmarks of the core data paths, likewise
+	if (cmd_args.exists("benchmark"))
+		return run_benchmarks(game_params.game_spec, cmd_args.get("benchmark"),
+				cmd_args.exists("benchmark-filter") ?
+				cmd_args.get("benchmark-filter") : "");
+
 	// Create server
 	Server server(game_params.world_path,
 			game_params.game_spec, false, bind_addr.isIPv6());
@@ -1506,6 +1554,9 @@ static bool migrate_database(const GameParams &game_params, const Settings &cmd_
 	if (migrate_to == "sqlite3")
 		new_db = new Database_SQLite3(&(ServerMap&)server->getMap(),
 				game_params.world_path);
+	else if (migrate_to == "region")
+		new_db = new Database_Region(&(ServerMap&)server->getMap(),
+				game_params.world_path);
 #if USE_LEVELDB
 	else if (migrate_to == "leveldb")
 		new_db = new Database_LevelDB(&(ServerMap&)server->getMap(),
@@ -1522,29 +1573,61 @@ static bool migrate_database(const GameParams &game_params, const Settings &cmd_
 		return false;
 	}
 
-	std::list<v3s16> blocks;
+	// Go through the blocks a chunk at a time so that memory use stays
+	// bounded on big worlds
 	ServerMap &old_map = ((ServerMap&)server->getMap());
-	old_map.listAllLoadableBlocks(blocks);
+	std::string cursor;
+	std::vector<v3s16> blocks;
+	std::vector<MapBlock *> loaded;
 	int count = 0;
+	while (old_map.listLoadableBlocks(cursor, 1000, blocks)) {
+		old_map.loadBlocks(blocks, loaded);
+		new_db->beginSave();
+		for (size_t i = 0; i < blocks.size(); i++) {
+			MapBlock *block = loaded[i];
+			if (!block) {
+				errorstream << "Failed to load block " << PP(blocks[i]) << ", skipping it.";
+			} else {
+				old_map.saveBlock(block, new_db);
+				MapSector *sector = old_map.getSectorNoGenerate(
+						v2s16(blocks[i].X, blocks[i].Z));
+				sector->deleteBlock(block);
+			}
+			++count;
+		}
+		new_db->endSave();
+		actionstream << "Migrated " << count << " blocks" << std::endl;
+	}
+
+	// Players stored in the old database go to the new one, or to files if
+	// it doesn't store players; files left from before would be stale
+	std::vector<std::string> players;
+	old_map.listPlayers(players);
+	std::string players_path = game_params.world_path + DIR_DELIM "players";
+	if (!players.empty() && !new_db->supportsPlayers())
+		fs::CreateAllDirs(players_path);
 	new_db->beginSave();
-	for (std::list<v3s16>::iterator i = blocks.begin(); i != blocks.end(); i++) {
-		MapBlock *block = old_map.loadBlock(*i);
-		if (!block) {
-			errorstream << "Failed to load block " << PP(*i) << ", skipping it.";
+	for (size_t i = 0; i < players.size(); i++) {
+		std::string data;
+		if (!old_map.loadPlayer(players[i], data)) {
+			errorstream << "Failed to load player " << players[i]
+			            << ", skipping it." << std::endl;
+			continue;
+		}
+		if (new_db->supportsPlayers()) {
+			new_db->savePlayer(players[i], data);
 		} else {
-			old_map.saveBlock(block, new_db);
-			MapSector *sector = old_map.getSectorNoGenerate(v2s16(i->X, i->Z));
-			sector->deleteBlock(block);
+			RemotePlayer player(server, "");
+			std::istringstream is(data, std::ios_base::binary);
+			player.deSerialize(is, players[i]);
+			player.save(players_path);
 		}
-		++count;
-		if (count % 500 == 0)
-		   actionstream << "Migrated " << count << " blocks "
-			   << (100.0 * count / blocks.size()) << "% completed" << std::endl;
 	}
 	new_db->endSave();
 	delete new_db;
 
-	actionstream << "Successfully migrated " << count << " blocks" << std::endl;
+	actionstream << "Successfully migrated " << count << " blocks and "
+	             << players.size() << " players" << std::endl;
 	world_mt.set("backend", migrate_to);
 	if (!world_mt.updateConfigFile(
 				(game_params.world_path+ DIR_DELIM + "world.mt").c_str()))
@@ -1555,6 +1638,34 @@ static bool migrate_database(const GameParams &game_params, const Settings &cmd_
 	return true;
 }
 
+static bool run_load_test_from_cmdline(const Settings &cmd_args)
+{
+	std::string address_str = "localhost";
+	if (cmd_args.exists("loadtest-address"))
+		address_str = cmd_args.get("loadtest-address");
+
+	Address address(0, 0, 0, 0, 0);
+	try {
+		address.Resolve(address_str.c_str());
+	} catch (ResolveError &e) {
+		errorstream << "Couldn't resolve " << address_str << ": "
+		            << e.what() << std::endl;
+		return false;
+	}
+
+	u16 port = DEFAULT_SERVER_PORT;
+	if (cmd_args.exists("port"))
+		port = cmd_args.getU16("port");
+	address.setPort(port);
+
+	float duration = 60;
+	if (cmd_args.exists("loadtest-duration"))
+		duration = cmd_args.getFloat("loadtest-duration");
+
+	return run_load_test(address,
+			mystoi(cmd_args.get("loadtest"), 1, 10000), duration);
+}
+
 
 /*****************************************************************************
  * Client
@@ -43,6 +43,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "database.h"
 #include "database-dummy.h"
 #include "database-sqlite3.h"
+#include "database-region.h"
+#include "mapsaver.h"
+#include "jthread/jmutexautolock.h"
 #if USE_LEVELDB
 #include "database-leveldb.h"
 #endif
@@ -52,6 +55,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+// Seconds a block is unused before its nodes are packed
+#define MAP_BLOCK_PACK_TIMEOUT 5.0
+
 /*
 	SQLite format specification:
 	- Initially only replaces sectors/ and sectors2/
@@ -69,15 +81,85 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 			BLOB data
 */
 
+/*
+	LiquidQueue
+*/
+
+// Nodes of a block taken before the turn goes to the next block
+#define LIQUID_QUEUE_TURN_LENGTH 64
+
+bool LiquidQueue::push_back(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	std::map<v3s16, UniqueQueue<v3s16> >::iterator i = m_blocks.find(blockpos);
+	if(i == m_blocks.end())
+	{
+		i = m_blocks.insert(std::make_pair(blockpos,
+				UniqueQueue<v3s16>())).first;
+		m_turns.push_back(blockpos);
+	}
+	if(!i->second.push_back(p))
+		return false;
+	m_size++;
+	return true;
+}
+
+v3s16 LiquidQueue::pop_front()
+{
+	assert(m_size != 0);
+
+	if(m_turn_left == 0)
+		m_turn_left = LIQUID_QUEUE_TURN_LENGTH;
+
+	v3s16 blockpos = m_turns.front();
+	std::map<v3s16, UniqueQueue<v3s16> >::iterator i = m_blocks.find(blockpos);
+	v3s16 p = i->second.pop_front();
+	m_size--;
+	m_turn_left--;
+
+	if(i->second.size() == 0)
+	{
+		m_blocks.erase(i);
+		m_turns.pop_front();
+		m_turn_left = 0;
+	}
+	else if(m_turn_left == 0)
+	{
+		m_turns.pop_front();
+		m_turns.push_back(blockpos);
+	}
+	return p;
+}
+
 /*
 	Map
 */
 
+// The last block looked up by each thread, see Map::m_id
+struct MapBlockCache
+{
+	u32 map_id;
+	u32 generation;
+	MapBlock *block;
+};
+static THREAD_LOCAL MapBlockCache t_block_cache = {0, 0, NULL};
+
+// Ids of the maps start from 1, so that no map matches an empty cache
+static u32 g_next_map_id = 1;
+static JMutex g_next_map_id_mutex;
+
 Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
-	m_sector_cache(NULL)
+	m_sector_cache(NULL),
+	m_blocks_generation(0),
+	m_usage_clock(0),
+	m_usage_oldest(NULL),
+	m_usage_newest(NULL),
+	m_usage_pack_next(NULL)
 {
+	JMutexAutoLock lock(g_next_map_id_mutex);
+	m_id = g_next_map_id++;
 }
 
 Map::~Map()
@@ -114,10 +196,9 @@ void Map::dispatchEvent(MapEditEvent *event)
 
 MapSector * Map::getSectorNoGenerateNoExNoLock(v2s16 p)
 {
-	if(m_sector_cache != NULL && p == m_sector_cache_p){
-		MapSector * sector = m_sector_cache;
-		return sector;
-	}
+	MapSector *cached = m_sector_cache;
+	if(cached != NULL && cached->getPos() == p)
+		return cached;
 
 	std::map<v2s16, MapSector*>::iterator n = m_sectors.find(p);
 
@@ -127,7 +208,6 @@ MapSector * Map::getSectorNoGenerateNoExNoLock(v2s16 p)
 	MapSector *sector = n->second;
 
 	// Cache the last result
-	m_sector_cache_p = p;
 	m_sector_cache = sector;
 
 	return sector;
@@ -149,14 +229,87 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
+	MapBlockCache &cache = t_block_cache;
+	if(cache.block != NULL && cache.map_id == m_id &&
+			cache.generation == m_blocks_generation &&
+			cache.block->getPos() == p3d)
+		return cache.block;
+
+	MapBlock *block = m_blocks.get(p3d);
+
+	// Cache the last block found
+	if(block != NULL) {
+		cache.map_id = m_id;
+		cache.generation = m_blocks_generation;
+		cache.block = block;
+	}
 	return block;
 }
 
+void Map::indexBlock(MapBlock *block)
+{
+	m_blocks.set(block->getPos(), block);
+	linkBlockUsage(block);
+}
+
+void Map::unindexBlock(MapBlock *block)
+{
+	// Drops the cached block of every thread
+	m_blocks_generation++;
+	m_blocks.remove(block->getPos());
+	unlinkBlockUsage(block);
+}
+
+void Map::touchBlock(MapBlock *block)
+{
+	// Blocks not yet given to a sector are linked when they are
+	if(!block->m_usage_listed)
+		return;
+	if(block == m_usage_newest)
+	{
+		block->m_usage_stamp = m_usage_clock;
+		return;
+	}
+	unlinkBlockUsage(block);
+	linkBlockUsage(block);
+}
+
+void Map::linkBlockUsage(MapBlock *block)
+{
+	if(block->m_usage_listed)
+		return;
+	block->m_usage_stamp = m_usage_clock;
+	block->m_usage_prev = m_usage_newest;
+	block->m_usage_next = NULL;
+	if(m_usage_newest)
+		m_usage_newest->m_usage_next = block;
+	else
+		m_usage_oldest = block;
+	m_usage_newest = block;
+	block->m_usage_listed = true;
+	if(m_usage_pack_next == NULL)
+		m_usage_pack_next = block;
+}
+
+void Map::unlinkBlockUsage(MapBlock *block)
+{
+	if(!block->m_usage_listed)
+		return;
+	if(m_usage_pack_next == block)
+		m_usage_pack_next = block->m_usage_next;
+	if(block->m_usage_prev)
+		block->m_usage_prev->m_usage_next = block->m_usage_next;
+	else
+		m_usage_oldest = block->m_usage_next;
+	if(block->m_usage_next)
+		block->m_usage_next->m_usage_prev = block->m_usage_prev;
+	else
+		m_usage_newest = block->m_usage_prev;
+	block->m_usage_prev = NULL;
+	block->m_usage_next = NULL;
+	block->m_usage_listed = false;
+}
+
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
 {
 	MapBlock *block = getBlockNoCreateNoEx(p3d);
@@ -244,7 +397,7 @@ void Map::setNode(v3s16 p, MapNode & n)
 
 
 /*
-	Goes recursively through the neighbours of the node.
+	Goes through the neighbours of the nodes, breadth first.
 
 	Alters only transparent nodes.
 
@@ -263,7 +416,8 @@ void Map::setNode(v3s16 p, MapNode & n)
 void Map::unspreadLight(enum LightBank bank,
 		std::map<v3s16, u8> & from_nodes,
 		std::set<v3s16> & light_sources,
-		std::map<v3s16, MapBlock*>  & modified_blocks)
+		std::map<v3s16, MapBlock*>  & modified_blocks,
+		std::map<v3s16, u8> *light_was)
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
@@ -279,9 +433,12 @@ void Map::unspreadLight(enum LightBank bank,
 	if(from_nodes.size() == 0)
 		return;
 
-	u32 blockchangecount = 0;
-
-	std::map<v3s16, u8> unlighted_nodes;
+	/*
+		The nodes that were set to 0 and the light they had.  A node is
+		queued only when it is set to 0, so it is queued only once.
+	*/
+	std::vector<std::pair<v3s16, u8> > queue(from_nodes.begin(),
+			from_nodes.end());
 
 	/*
 		Initialize block cache
@@ -291,38 +448,22 @@ void Map::unspreadLight(enum LightBank bank,
 	// Cache this a bit, too
 	bool block_checked_in_modified = false;
 
-	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
+	for(size_t j = 0; j != queue.size(); j++)
 	{
-		v3s16 pos = j->first;
+		v3s16 pos = queue[j].first;
+		u8 oldlight = queue[j].second;
 		v3s16 blockpos = getNodeBlockPos(pos);
 
 		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		if(block == NULL || blockpos != blockpos_last){
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
+			block_checked_in_modified = false;
 		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
-
-		if(block->isDummy())
+		if(block == NULL || block->isDummy())
 			continue;
 
-		// Calculate relative position in block
-		//v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		//MapNode n = block->getNode(relpos);
-
-		u8 oldlight = j->second;
-
 		// Loop through 6 neighbors
 		for(u16 i=0; i<6; i++)
 		{
@@ -333,18 +474,14 @@ void Map::unspreadLight(enum LightBank bank,
 			v3s16 blockpos = getNodeBlockPos(n2pos);
 
 			// Only fetch a new block if the block position has changed
-			try {
-				if(block == NULL || blockpos != blockpos_last){
-					block = getBlockNoCreate(blockpos);
-					blockpos_last = blockpos;
+			if(block == NULL || blockpos != blockpos_last){
+				block = getBlockNoCreateNoEx(blockpos);
+				blockpos_last = blockpos;
 
-					block_checked_in_modified = false;
-					blockchangecount++;
-				}
+				block_checked_in_modified = false;
 			}
-			catch(InvalidPositionException &e) {
+			if(block == NULL)
 				continue;
-			}
 
 			// Calculate relative position in block
 			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
@@ -354,54 +491,34 @@ void Map::unspreadLight(enum LightBank bank,
 			if (!is_valid_position)
 				continue;
 
-			bool changed = false;
-
-			//TODO: Optimize output by optimizing light_sources?
-
 			/*
 				If the neighbor is dimmer than what was specified
 				as oldlight (the light of the previous node)
 			*/
-			if(n2.getLight(bank, nodemgr) < oldlight)
+			u8 light2 = n2.getLight(bank, nodemgr);
+			if(light2 >= oldlight)
 			{
-				/*
-					And the neighbor is transparent and it has some light
-				*/
-				if(nodemgr->get(n2).light_propagates
-						&& n2.getLight(bank, nodemgr) != 0)
-				{
-					/*
-						Set light to 0 and add to queue
-					*/
-
-					u8 current_light = n2.getLight(bank, nodemgr);
-					n2.setLight(bank, 0, nodemgr);
-					block->setNode(relpos, n2);
-
-					unlighted_nodes[n2pos] = current_light;
-					changed = true;
-
-					/*
-						Remove from light_sources if it is there
-						NOTE: This doesn't happen nearly at all
-					*/
-					/*if(light_sources.find(n2pos))
-					{
-						infostream<<"Removed from light_sources"<<std::endl;
-						light_sources.remove(n2pos);
-					}*/
-				}
-
-				/*// DEBUG
-				if(light_sources.find(n2pos) != NULL)
-					light_sources.remove(n2pos);*/
-			}
-			else{
 				light_sources.insert(n2pos);
+				continue;
 			}
 
+			/*
+				And the neighbor is transparent and it has some light
+			*/
+			if(light2 == 0 || !nodemgr->get(n2).light_propagates)
+				continue;
+
+			/*
+				Set light to 0 and add to queue
+			*/
+			n2.setLight(bank, 0, nodemgr);
+			block->setNode(relpos, n2);
+			queue.push_back(std::make_pair(n2pos, light2));
+			if(light_was)
+				light_was->insert(std::make_pair(n2pos, light2));
+
 			// Add to modified_blocks
-			if(changed == true && block_checked_in_modified == false)
+			if(block_checked_in_modified == false)
 			{
 				// If the block is not found in modified_blocks, add.
 				if(modified_blocks.find(blockpos) == modified_blocks.end())
@@ -412,14 +529,6 @@ void Map::unspreadLight(enum LightBank bank,
 			}
 		}
 	}
-
-	/*infostream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
 }
 
 /*
@@ -437,12 +546,17 @@ void Map::unLightNeighbors(enum LightBank bank,
 }
 
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	Lights neighbors of from_nodes and goes on with the lighted ones.
+
+	The nodes to go on with are kept in a queue for each light level,
+	and the brightest ones are taken first.  This way the nodes have
+	mostly got their final light when they are taken, and few of them
+	have to be gone through twice.
 */
 void Map::spreadLight(enum LightBank bank,
 		std::set<v3s16> & from_nodes,
-		std::map<v3s16, MapBlock*> & modified_blocks)
+		std::map<v3s16, MapBlock*> & modified_blocks,
+		std::map<v3s16, u8> *light_was)
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
@@ -458,9 +572,10 @@ void Map::spreadLight(enum LightBank bank,
 	if(from_nodes.size() == 0)
 		return;
 
-	u32 blockchangecount = 0;
-
-	std::set<v3s16> lighted_nodes;
+	// The queues, indexed by the light the nodes had when queued
+	std::vector<v3s16> queues[LIGHT_SUN + 1];
+	// Brighter neighbors found on the way; these are queued only once
+	std::set<v3s16> found_sources;
 
 	/*
 		Initialize block cache
@@ -476,21 +591,43 @@ void Map::spreadLight(enum LightBank bank,
 		v3s16 pos = *j;
 		v3s16 blockpos = getNodeBlockPos(pos);
 
-		// Only fetch a new block if the block position has changed
-		try {
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		if(block == NULL || blockpos != blockpos_last){
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
+			block_checked_in_modified = false;
 		}
-		catch(InvalidPositionException &e) {
+		if(block == NULL || block->isDummy())
+			continue;
+
+		bool is_valid_position;
+		MapNode n = block->getNode(pos - blockpos * MAP_BLOCKSIZE,
+				&is_valid_position);
+		u8 light = is_valid_position ? n.getLight(bank, nodemgr) : 0;
+		queues[light].push_back(pos);
+	}
+
+	s16 level = LIGHT_SUN;
+	while(level >= 0)
+	{
+		if(queues[level].empty())
+		{
+			level--;
 			continue;
 		}
 
-		if(block->isDummy())
+		v3s16 pos = queues[level].back();
+		queues[level].pop_back();
+		v3s16 blockpos = getNodeBlockPos(pos);
+
+		// Only fetch a new block if the block position has changed
+		if(block == NULL || blockpos != blockpos_last){
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
+
+			block_checked_in_modified = false;
+		}
+		if(block == NULL || block->isDummy())
 			continue;
 
 		// Calculate relative position in block
@@ -501,6 +638,9 @@ void Map::spreadLight(enum LightBank bank,
 		MapNode n = block->getNode(relpos, &is_valid_position);
 
 		u8 oldlight = is_valid_position ? n.getLight(bank, nodemgr) : 0;
+		// Got brighter after it was queued; it is queued again for that
+		if(oldlight > level)
+			continue;
 		u8 newlight = diminish_light(oldlight);
 
 		// Loop through 6 neighbors
@@ -512,18 +652,14 @@ void Map::spreadLight(enum LightBank bank,
 			v3s16 blockpos = getNodeBlockPos(n2pos);
 
 			// Only fetch a new block if the block position has changed
-			try {
-				if(block == NULL || blockpos != blockpos_last){
-					block = getBlockNoCreate(blockpos);
-					blockpos_last = blockpos;
+			if(block == NULL || blockpos != blockpos_last){
+				block = getBlockNoCreateNoEx(blockpos);
+				blockpos_last = blockpos;
 
-					block_checked_in_modified = false;
-					blockchangecount++;
-				}
+				block_checked_in_modified = false;
 			}
-			catch(InvalidPositionException &e) {
+			if(block == NULL)
 				continue;
-			}
 
 			// Calculate relative position in block
 			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
@@ -533,26 +669,33 @@ void Map::spreadLight(enum LightBank bank,
 				continue;
 
 			bool changed = false;
+			u8 light2 = n2.getLight(bank, nodemgr);
 			/*
 				If the neighbor is brighter than the current node,
-				add to list (it will light up this node on its turn)
+				add to queue (it will light up this node on its turn)
 			*/
-			if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
+			if(light2 > undiminish_light(oldlight))
 			{
-				lighted_nodes.insert(n2pos);
-				changed = true;
+				if(from_nodes.find(n2pos) == from_nodes.end() &&
+						found_sources.insert(n2pos).second)
+				{
+					queues[light2].push_back(n2pos);
+					level = MYMAX(level, light2);
+				}
 			}
 			/*
 				If the neighbor is dimmer than how much light this node
-				would spread on it, add to list
+				would spread on it, add to queue
 			*/
-			if(n2.getLight(bank, nodemgr) < newlight)
+			if(light2 < newlight)
 			{
 				if(nodemgr->get(n2).light_propagates)
 				{
 					n2.setLight(bank, newlight, nodemgr);
 					block->setNode(relpos, n2);
-					lighted_nodes.insert(n2pos);
+					queues[newlight].push_back(n2pos);
+					if(light_was)
+						light_was->insert(std::make_pair(n2pos, light2));
 					changed = true;
 				}
 			}
@@ -569,14 +712,6 @@ void Map::spreadLight(enum LightBank bank,
 			}
 		}
 	}
-
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, modified_blocks);
 }
 
 /*
@@ -640,7 +775,8 @@ v3s16 Map::getBrightestNeighbour(enum LightBank bank, v3s16 p)
 	Mud is turned into grass in where the sunlight stops.
 */
 s16 Map::propagateSunlight(v3s16 start,
-		std::map<v3s16, MapBlock*> & modified_blocks)
+		std::map<v3s16, MapBlock*> & modified_blocks,
+		std::map<v3s16, u8> *light_was)
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
@@ -667,6 +803,9 @@ s16 Map::propagateSunlight(v3s16 start,
 
 		if(nodemgr->get(n).sunlight_propagates)
 		{
+			if(light_was)
+				light_was->insert(std::make_pair(pos,
+						n.getLight(LIGHTBANK_DAY, nodemgr)));
 			n.setLight(LIGHTBANK_DAY, LIGHT_SUN, nodemgr);
 			block->setNode(relpos, n);
 
@@ -681,6 +820,37 @@ s16 Map::propagateSunlight(v3s16 start,
 	return y + 1;
 }
 
+void Map::addLightChangedBlocks(enum LightBank bank,
+		std::map<v3s16, u8> & light_was,
+		std::map<v3s16, MapBlock*> & modified_blocks)
+{
+	INodeDefManager *nodemgr = m_gamedef->ndef();
+
+	v3s16 blockpos_last;
+	MapBlock *block = NULL;
+
+	for(std::map<v3s16, u8>::iterator i = light_was.begin();
+			i != light_was.end(); ++i)
+	{
+		v3s16 blockpos = getNodeBlockPos(i->first);
+		if(block == NULL || blockpos != blockpos_last){
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
+		}
+		if(block == NULL)
+			continue;
+		// Nothing to see again in a block that is in already
+		if(modified_blocks.find(blockpos) != modified_blocks.end())
+			continue;
+
+		bool is_valid_position;
+		MapNode n = block->getNode(i->first - blockpos * MAP_BLOCKSIZE,
+				&is_valid_position);
+		if(is_valid_position && n.getLight(bank, nodemgr) != i->second)
+			modified_blocks[blockpos] = block;
+	}
+}
+
 void Map::updateLighting(enum LightBank bank,
 		std::map<v3s16, MapBlock*> & a_blocks,
 		std::map<v3s16, MapBlock*> & modified_blocks)
@@ -959,6 +1129,14 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	bool node_under_sunlight = true;
 	std::set<v3s16> light_sources;
 
+	/*
+		The blocks that the lighting updates go through; only those in
+		which the light of some node ends up different are reported in
+		modified_blocks.
+	*/
+	std::map<v3s16, MapBlock*> light_blocks;
+	std::map<v3s16, u8> light_was[2];
+
 	/*
 		Collect old node for rollback
 	*/
@@ -1005,7 +1183,10 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		// to 0.
 		// This also collects the nodes at the border which will spread
 		// light again into this.
-		unLightNeighbors(bank, p, lightwas, light_sources, modified_blocks);
+		std::map<v3s16, u8> from_nodes;
+		from_nodes[p] = lightwas;
+		unspreadLight(bank, from_nodes, light_sources, light_blocks,
+				&light_was[i]);
 
 		n.setLight(bank, 0, ndef);
 	}
@@ -1035,12 +1216,11 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	/*
 		If node is under sunlight and doesn't let sunlight through,
 		take all sunlighted nodes under it and clear light from them
-		and from where the light has been spread.
-		TODO: This could be optimized by mass-unlighting instead
-			  of looping
+		and from where the light has been spread, all at once.
 	*/
 	if(node_under_sunlight && !ndef->get(n).sunlight_propagates)
 	{
+		std::map<v3s16, u8> from_nodes;
 		s16 y = p.Y - 1;
 		for(;; y--){
 			//m_dout<<DTIME<<"y="<<y<<std::endl;
@@ -1054,15 +1234,16 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 
 			if(n2.getLight(LIGHTBANK_DAY, ndef) == LIGHT_SUN)
 			{
-				unLightNeighbors(LIGHTBANK_DAY,
-						n2pos, n2.getLight(LIGHTBANK_DAY, ndef),
-						light_sources, modified_blocks);
+				from_nodes[n2pos] = LIGHT_SUN;
+				light_was[0].insert(std::make_pair(n2pos, LIGHT_SUN));
 				n2.setLight(LIGHTBANK_DAY, 0, ndef);
 				setNode(n2pos, n2);
 			}
 			else
 				break;
 		}
+		unspreadLight(LIGHTBANK_DAY, from_nodes, light_sources,
+				light_blocks, &light_was[0]);
 	}
 
 	for(s32 i=0; i<2; i++)
@@ -1072,7 +1253,9 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		/*
 			Spread light from all nodes that might be capable of doing so
 		*/
-		spreadLight(bank, light_sources, modified_blocks);
+		spreadLight(bank, light_sources, light_blocks, &light_was[i]);
+
+		addLightChangedBlocks(bank, light_was[i], modified_blocks);
 	}
 
 	/*
@@ -1157,6 +1340,14 @@ void Map::removeNodeAndUpdate(v3s16 p,
 
 	std::set<v3s16> light_sources;
 
+	/*
+		The blocks that the lighting updates go through; only those in
+		which the light of some node ends up different are reported in
+		modified_blocks.
+	*/
+	std::map<v3s16, MapBlock*> light_blocks;
+	std::map<v3s16, u8> light_was[2];
+
 	enum LightBank banks[] =
 	{
 		LIGHTBANK_DAY,
@@ -1169,9 +1360,10 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		/*
 			Unlight neighbors (in case the node is a light source)
 		*/
-		unLightNeighbors(bank, p,
-				getNodeNoEx(p).getLight(bank, ndef),
-				light_sources, modified_blocks);
+		std::map<v3s16, u8> from_nodes;
+		from_nodes[p] = getNodeNoEx(p).getLight(bank, ndef);
+		unspreadLight(bank, from_nodes, light_sources, light_blocks,
+				&light_was[i]);
 	}
 
 	/*
@@ -1196,7 +1388,7 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		/*
 			Recalculate lighting
 		*/
-		spreadLight(bank, light_sources, modified_blocks);
+		spreadLight(bank, light_sources, light_blocks, &light_was[i]);
 	}
 
 	// Add the block of the removed node to modified_blocks
@@ -1212,19 +1404,14 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	*/
 	if(node_under_sunlight)
 	{
-		s16 ybottom = propagateSunlight(p, modified_blocks);
+		s16 ybottom = propagateSunlight(p, light_blocks, &light_was[0]);
 		/*m_dout<<DTIME<<"Node was under sunlight. "
 				"Propagating sunlight";
 		m_dout<<DTIME<<" -> ybottom="<<ybottom<<std::endl;*/
-		s16 y = p.Y;
-		for(; y >= ybottom; y--)
-		{
-			v3s16 p2(p.X, y, p.Z);
-			/*m_dout<<DTIME<<"lighting neighbors of node ("
-					<<p2.X<<","<<p2.Y<<","<<p2.Z<<")"
-					<<std::endl;*/
-			lightNeighbors(LIGHTBANK_DAY, p2, modified_blocks);
-		}
+		std::set<v3s16> from_nodes;
+		for(s16 y = p.Y; y >= ybottom; y--)
+			from_nodes.insert(v3s16(p.X, y, p.Z));
+		spreadLight(LIGHTBANK_DAY, from_nodes, light_blocks, &light_was[0]);
 	}
 	else
 	{
@@ -1247,11 +1434,15 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		v3s16 n2p = getBrightestNeighbour(bank, p);
 		try{
 			//MapNode n2 = getNode(n2p);
-			lightNeighbors(bank, n2p, modified_blocks);
+			std::set<v3s16> from_nodes;
+			from_nodes.insert(n2p);
+			spreadLight(bank, from_nodes, light_blocks, &light_was[i]);
 		}
 		catch(InvalidPositionException &e)
 		{
 		}
+
+		addLightChangedBlocks(bank, light_was[i], modified_blocks);
 	}
 
 	/*
@@ -1331,6 +1522,74 @@ bool Map::addNodeWithEvent(v3s16 p, MapNode n, bool remove_metadata)
 	return succeeded;
 }
 
+bool Map::addNodesWithEvent(const std::vector<v3s16> &positions,
+		const std::vector<MapNode> &nodes)
+{
+	INodeDefManager *ndef = m_gamedef->ndef();
+	assert(positions.size() == nodes.size());
+
+	bool succeeded = true;
+	std::map<v3s16, MapBlock*> blocks;
+	std::set<v3s16> liquid_check;
+	for(u32 i = 0; i < positions.size(); i++){
+		v3s16 p = positions[i];
+		v3s16 blockpos = getNodeBlockPos(p);
+		MapBlock *block = getBlockNoCreateNoEx(blockpos);
+		if(block == NULL || block->isDummy()){
+			succeeded = false;
+			continue;
+		}
+		v3s16 relpos = p - blockpos * MAP_BLOCKSIZE;
+
+		RollbackNode rollback_oldnode(this, p, m_gamedef);
+
+		// The light is made again for the whole blocks below
+		MapNode n = nodes[i];
+		n.setLight(LIGHTBANK_DAY, 0, ndef);
+		n.setLight(LIGHTBANK_NIGHT, 0, ndef);
+		removeNodeMetadata(p);
+		block->setNodeNoCheck(relpos, n);
+		blocks[blockpos] = block;
+
+		if(m_gamedef->rollback()){
+			RollbackNode rollback_newnode(this, p, m_gamedef);
+			RollbackAction action;
+			action.setSetNode(p, rollback_oldnode, rollback_newnode);
+			m_gamedef->rollback()->reportAction(action);
+		}
+
+		// The node and its neighbours, as in addNodeAndUpdate()
+		liquid_check.insert(p);
+		for(u16 j = 0; j < 6; j++)
+			liquid_check.insert(p + g_6dirs[j]);
+	}
+
+	std::map<v3s16, MapBlock*> modified_blocks;
+	if(!blocks.empty())
+		updateLighting(blocks, modified_blocks);
+
+	for(std::set<v3s16>::iterator i = liquid_check.begin();
+			i != liquid_check.end(); ++i){
+		bool is_valid_position;
+		MapNode n2 = getNodeNoEx(*i, &is_valid_position);
+		if(is_valid_position
+				&& (ndef->get(n2).isLiquid() || n2.getContent() == CONTENT_AIR))
+			m_transforming_liquid.push_back(*i);
+	}
+
+	MapEditEvent event;
+	event.type = MEET_OTHER;
+	for(std::map<v3s16, MapBlock*>::iterator
+			i = modified_blocks.begin();
+			i != modified_blocks.end(); ++i)
+	{
+		event.modified_blocks.insert(i->first);
+	}
+	dispatchEvent(&event);
+
+	return succeeded;
+}
+
 bool Map::removeNodeWithEvent(v3s16 p)
 {
 	MapEditEvent event;
@@ -1420,73 +1679,95 @@ bool Map::getDayNightDiff(v3s16 blockpos)
 	Updates usage timers
 */
 void Map::timerUpdate(float dtime, float unload_timeout,
-		std::list<v3s16> *unloaded_blocks)
+		std::list<v3s16> *unloaded_blocks, u32 max_loaded_blocks,
+		u64 max_memory)
 {
 	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
 
 	// Profile modified reasons
 	Profiler modprofiler;
 
-	std::list<v2s16> sector_deletion_queue;
 	u32 deleted_blocks_count = 0;
 	u32 saved_blocks_count = 0;
-	u32 block_count_all = 0;
+
+	// Blocks used since the previous call have this or a later stamp
+	double used_stamp = m_usage_clock;
+	m_usage_clock += dtime;
+
+	u64 memory = 0;
+	if(max_memory != 0)
+	{
+		for(MapBlock *block = m_usage_oldest; block != NULL;
+				block = block->m_usage_next)
+			memory += getBlockMemoryUsage(block);
+	}
 
 	beginSave();
-	for(std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
-		si != m_sectors.end(); ++si)
+	MapBlock *next = m_usage_oldest;
+	while(next != NULL)
 	{
-		MapSector *sector = si->second;
+		MapBlock *block = next;
+		next = block->m_usage_next;
+
+		bool over_limit = ((max_loaded_blocks != 0
+					&& m_blocks.size() > max_loaded_blocks)
+				|| (max_memory != 0 && memory > max_memory))
+				&& block->m_usage_stamp < used_stamp;
+		// The rest of the blocks are used more recently
+		if(!over_limit && block->getUsageTimer() <= unload_timeout)
+			break;
 
-		bool all_blocks_deleted = true;
+		if(block->refGet() != 0)
+			continue;
 
-		std::list<MapBlock*> blocks;
-		sector->getBlocks(blocks);
+		v3s16 p = block->getPos();
 
-		for(std::list<MapBlock*>::iterator i = blocks.begin();
-				i != blocks.end(); ++i)
+		// Save if modified
+		if (block->getModified() != MOD_STATE_CLEAN && save_before_unloading)
 		{
-			MapBlock *block = (*i);
-
-			block->incrementUsageTimer(dtime);
-
-			if(block->refGet() == 0 && block->getUsageTimer() > unload_timeout)
-			{
-				v3s16 p = block->getPos();
-
-				// Save if modified
-				if (block->getModified() != MOD_STATE_CLEAN && save_before_unloading)
-				{
-					modprofiler.add(block->getModifiedReason(), 1);
-					if (!saveBlock(block))
-						continue;
-					saved_blocks_count++;
-				}
-
-				// Delete from memory
-				sector->deleteBlock(block);
-
-				if(unloaded_blocks)
-					unloaded_blocks->push_back(p);
-
-				deleted_blocks_count++;
-			}
-			else
-			{
-				all_blocks_deleted = false;
-				block_count_all++;
-			}
+			modprofiler.add(block->getModifiedReason(), 1);
+			if (!saveBlock(block))
+				continue;
+			saved_blocks_count++;
 		}
 
-		if(all_blocks_deleted)
+		if(max_memory != 0)
+			memory -= getBlockMemoryUsage(block);
+
+		// Delete from memory, with the sector if it was the last block
+		MapSector *sector = getSectorNoGenerateNoEx(v2s16(p.X, p.Z));
+		sector->deleteBlock(block);
+		if(sector->empty())
 		{
-			sector_deletion_queue.push_back(si->first);
+			std::list<v2s16> sector_deletion_queue;
+			sector_deletion_queue.push_back(sector->getPos());
+			deleteSectors(sector_deletion_queue);
 		}
+
+		if(unloaded_blocks)
+			unloaded_blocks->push_back(p);
+
+		deleted_blocks_count++;
 	}
 	endSave();
 
-	// Finally delete the empty sectors
-	deleteSectors(sector_deletion_queue);
+	// Blocks that have not been used for a while are kept packed; each
+	// block is packed once after it was last used
+	while(m_usage_pack_next != NULL &&
+			m_usage_pack_next->getUsageTimer() > MAP_BLOCK_PACK_TIMEOUT)
+	{
+		m_usage_pack_next->pack();
+		m_usage_pack_next = m_usage_pack_next->m_usage_next;
+	}
+
+	MapBlockPoolStats pool_stats;
+	getMapBlockPoolStats(pool_stats);
+	g_profiler->avg("Map: blocks in memory", m_blocks.size());
+	if(max_memory != 0)
+		g_profiler->avg("Map: block memory (MB)", memory / 1048576.0);
+	g_profiler->avg("Map: node arrays in use", pool_stats.nodes_used);
+	g_profiler->avg("Map: pooled blocks+node arrays",
+			pool_stats.blocks_free + pool_stats.nodes_free);
 
 	if(deleted_blocks_count != 0)
 	{
@@ -1495,7 +1776,9 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 				<<" blocks from memory";
 		if(save_before_unloading)
 			infostream<<", of which "<<saved_blocks_count<<" were written";
-		infostream<<", "<<block_count_all<<" blocks in memory";
+		infostream<<", "<<m_blocks.size()<<" blocks in memory";
+		infostream<<", "<<pool_stats.blocks_free<<" blocks and "
+				<<pool_stats.nodes_free<<" node arrays pooled";
 		infostream<<"."<<std::endl;
 		if(saved_blocks_count != 0){
 			PrintInfo(infostream); // ServerMap/ClientMap:
@@ -1505,9 +1788,74 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	}
 }
 
+u32 Map::getBlockMemoryUsage(MapBlock *block)
+{
+	return sizeof(MapBlock) + block->getNodeMemoryUsage();
+}
+
+void Map::getMemoryStats(MemoryStats &stats)
+{
+	for(MapBlock *block = m_usage_oldest; block != NULL;
+			block = block->m_usage_next)
+	{
+		stats.blocks += getBlockMemoryUsage(block);
+		stats.metadata += block->getMetadataMemoryUsage();
+		stats.static_objects += block->getStaticObjectMemoryUsage();
+		stats.caches += block->getCacheMemoryUsage();
+	}
+}
+
 void Map::unloadUnreferencedBlocks(std::list<v3s16> *unloaded_blocks)
 {
 	timerUpdate(0.0, -1.0, unloaded_blocks);
+
+	// Sectors that never got a block are only deleted here
+	std::list<v2s16> sector_deletion_queue;
+	for(std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
+		si != m_sectors.end(); ++si)
+	{
+		if(si->second->empty())
+			sector_deletion_queue.push_back(si->first);
+	}
+	deleteSectors(sector_deletion_queue);
+}
+
+void Map::unloadBlocks(const std::vector<v3s16> &blocks)
+{
+	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
+	u32 deleted_blocks_count = 0;
+
+	beginSave();
+	for(std::vector<v3s16>::const_iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+	{
+		MapBlock *block = getBlockNoCreateNoEx(*i);
+		if(block == NULL || block->refGet() != 0)
+			continue;
+
+		if(block->getModified() != MOD_STATE_CLEAN && save_before_unloading
+				&& !saveBlock(block))
+			continue;
+
+		MapSector *sector = getSectorNoGenerateNoEx(v2s16(i->X, i->Z));
+		sector->deleteBlock(block);
+		if(sector->empty())
+		{
+			std::list<v2s16> sector_deletion_queue;
+			sector_deletion_queue.push_back(sector->getPos());
+			deleteSectors(sector_deletion_queue);
+		}
+		deleted_blocks_count++;
+	}
+	endSave();
+
+	if(deleted_blocks_count != 0)
+	{
+		PrintInfo(infostream); // ServerMap/ClientMap:
+		infostream<<"Unloaded "<<deleted_blocks_count
+				<<" blocks from memory, "<<m_blocks.size()
+				<<" blocks in memory."<<std::endl;
+	}
 }
 
 void Map::deleteSectors(std::list<v2s16> &list)
@@ -1629,12 +1977,19 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 	std::map<v3s16, MapBlock*> lighting_modified_blocks;
 
 	u16 loop_max = g_settings->getU16("liquid_loop_max");
+	u32 time_max_us = g_settings->getFloat("liquid_step_max_time") * 1000000;
+	u32 time_start_us = porting::getTimeUs();
 
 	while(m_transforming_liquid.size() != 0)
 	{
 		// This should be done here so that it is done when continue is used
 		if(loopcount >= initial_size || loopcount >= loop_max)
 			break;
+		// The clock is looked at only now and then, it is slow on some
+		// systems
+		if(time_max_us != 0 && loopcount % 64 == 63 &&
+				porting::getTimeUs() - time_start_us >= time_max_us)
+			break;
 		loopcount++;
 
 		/*
@@ -1901,7 +2256,7 @@ NodeMetadata *Map::getNodeMetadata(v3s16 p)
 				<<std::endl;
 		return NULL;
 	}
-	NodeMetadata *meta = block->m_node_metadata.get(p_rel);
+	NodeMetadata *meta = block->getNodeMetadata().get(p_rel);
 	return meta;
 }
 
@@ -1920,7 +2275,8 @@ bool Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 				<<std::endl;
 		return false;
 	}
-	block->m_node_metadata.set(p_rel, meta);
+	block->getNodeMetadata().set(p_rel, meta);
+	block->expireNetworkSerialization();
 	return true;
 }
 
@@ -1935,7 +2291,8 @@ void Map::removeNodeMetadata(v3s16 p)
 				<<std::endl;
 		return;
 	}
-	block->m_node_metadata.remove(p_rel);
+	block->getNodeMetadata().remove(p_rel);
+	block->expireNetworkSerialization();
 }
 
 NodeTimer Map::getNodeTimer(v3s16 p)
@@ -2017,6 +2374,8 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 			dbase = new Database_Dummy(this);
 		else if (backend == "sqlite3")
 			dbase = new Database_SQLite3(this, savedir);
+		else if (backend == "region")
+			dbase = new Database_Region(this, savedir);
 		#if USE_LEVELDB
 		else if (backend == "leveldb")
 			dbase = new Database_LevelDB(this, savedir);
@@ -2029,6 +2388,11 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 			throw BaseException("Unknown map backend");
 	}
 
+	// All further database access goes through the save thread
+	m_save_thread = new MapSaveThread(dbase,
+			(size_t)g_settings->getU16("serialized_block_cache_size") * 1024 * 1024);
+	m_save_thread->Start();
+
 	m_savedir = savedir;
 	m_map_saving_enabled = false;
 
@@ -2118,8 +2482,10 @@ ServerMap::~ServerMap()
 	}
 
 	/*
-		Close database if it was opened
+		Write everything that is still queued and close database
 	*/
+	m_save_thread->stopAndDrain();
+	delete m_save_thread;
 	delete dbase;
 
 #if 0
@@ -2372,9 +2738,14 @@ void ServerMap::finishBlockMake(BlockMakeData *data,
 		if (!block)
 			continue;
 		/*
-			Update day/night difference cache of the MapBlocks
+			Update day/night difference cache of the MapBlocks; the
+			emerge thread has usually computed it already
 		*/
-		block->expireDayNightDiff();
+		std::map<v3s16, bool>::iterator diff = data->daynight_diffs.find(i->first);
+		if (diff != data->daynight_diffs.end())
+			block->setDayNightDiff(diff->second);
+		else
+			block->expireDayNightDiff();
 		/*
 			Set block as modified
 		*/
@@ -2805,8 +3176,14 @@ s16 ServerMap::findGroundLevel(v2s16 p2d)
 	//return (s16)level;
 }
 
+bool ServerMap::getGroundLevelBounds(v2s16 blockpos_2d,
+		s16 *min_y, s16 *max_y)
+{
+	return m_emerge->getGroundLevelBounds(blockpos_2d, min_y, max_y);
+}
+
 bool ServerMap::loadFromFolders() {
-	if(!dbase->Initialized() && !fs::PathExists(m_savedir + DIR_DELIM + "map.sqlite")) // ?
+	if(!m_save_thread->databaseInitialized() && !fs::PathExists(m_savedir + DIR_DELIM + "map.sqlite")) // ?
 		return true;
 	return false;
 }
@@ -2912,6 +3289,9 @@ void ServerMap::save(ModifiedState save_level)
 		saveMapMeta();
 	}
 
+	// Mark blocks written since the last save as clean
+	processWrittenBlocks();
+
 	// Profile modified reasons
 	Profiler modprofiler;
 
@@ -2919,9 +3299,6 @@ void ServerMap::save(ModifiedState save_level)
 	u32 block_count = 0;
 	u32 block_count_all = 0; // Number of blocks in memory
 
-	// Don't do anything with sqlite unless something is really saved
-	bool save_started = false;
-
 	for(std::map<v2s16, MapSector*>::iterator i = m_sectors.begin();
 		i != m_sectors.end(); ++i)
 	{
@@ -2945,11 +3322,12 @@ void ServerMap::save(ModifiedState save_level)
 
 			if(block->getModified() >= (u32)save_level)
 			{
-				// Lazy beginSave()
-				if(!save_started){
-					beginSave();
-					save_started = true;
-				}
+				// Skip if this data is already on its way to the disk
+				std::map<v3s16, std::pair<u32, u32> >::iterator k =
+						m_blocks_being_saved.find(block->getPos());
+				if(k != m_blocks_being_saved.end() &&
+						k->second.second == block->getModifiedSerial())
+					continue;
 
 				modprofiler.add(block->getModifiedReason(), 1);
 
@@ -2964,8 +3342,12 @@ void ServerMap::save(ModifiedState save_level)
 			}
 		}
 	}
-	if(save_started)
-		endSave();
+	if(save_level == MOD_STATE_CLEAN)
+	{
+		// Saving the whole map is expected to be done when this returns
+		m_save_thread->flush();
+		processWrittenBlocks();
+	}
 
 	/*
 		Only print if something happened or saved whole map
@@ -2984,13 +3366,35 @@ void ServerMap::save(ModifiedState save_level)
 	}
 }
 
-void ServerMap::listAllLoadableBlocks(std::list<v3s16> &dst)
+bool ServerMap::listLoadableBlocks(std::string &cursor, u32 max_count,
+		std::vector<v3s16> &dst)
 {
-	if(loadFromFolders()){
-		errorstream<<"Map::listAllLoadableBlocks(): Result will be missing "
+	if(cursor.empty() && loadFromFolders()){
+		errorstream<<"Map::listLoadableBlocks(): Result will be missing "
 				<<"all blocks that are stored in flat files"<<std::endl;
 	}
-	dbase->listAllLoadableBlocks(dst);
+	return m_save_thread->listLoadableBlocks(cursor, max_count, dst);
+}
+
+bool ServerMap::savePlayer(const std::string &name, const std::string &data)
+{
+	if(!m_save_thread->supportsPlayers())
+		return false;
+	m_save_thread->queuePlayer(name, data);
+	return true;
+}
+
+void ServerMap::listPlayers(std::vector<std::string> &dst)
+{
+	if(m_save_thread->supportsPlayers())
+		m_save_thread->listPlayers(dst);
+}
+
+bool ServerMap::loadPlayer(const std::string &name, std::string &data)
+{
+	if(!m_save_thread->supportsPlayers())
+		return false;
+	return m_save_thread->loadPlayer(name, data);
 }
 
 void ServerMap::listAllLoadedBlocks(std::list<v3s16> &dst)
@@ -3247,20 +3651,30 @@ bool ServerMap::loadSectorFull(v2s16 p2d)
 
 void ServerMap::beginSave()
 {
-	dbase->beginSave();
+	// Writes are batched by the save thread
 }
 
 void ServerMap::endSave()
 {
-	dbase->endSave();
 }
 
-bool ServerMap::saveBlock(MapBlock *block)
+std::string ServerMap::serializeBlockForSaving(MapBlock *block)
 {
-	return saveBlock(block, dbase);
+	// Format used for writing
+	u8 version = SER_FMT_VER_HIGHEST_WRITE;
+
+	/*
+		[0] u8 serialization version
+		[1] data
+	*/
+	std::ostringstream o(std::ios_base::binary);
+	o.write((char*) &version, 1);
+	block->serialize(o, version, true, rangelim(
+			g_settings->getS16("map_compression_level_disk"), -1, 9));
+	return o.str();
 }
 
-bool ServerMap::saveBlock(MapBlock *block, Database *db)
+bool ServerMap::saveBlock(MapBlock *block)
 {
 	v3s16 p3d = block->getPos();
 
@@ -3271,18 +3685,52 @@ bool ServerMap::saveBlock(MapBlock *block, Database *db)
 		return true;
 	}
 
-	// Format used for writing
-	u8 version = SER_FMT_VER_HIGHEST_WRITE;
+	// Already queued and not modified since
+	std::map<v3s16, std::pair<u32, u32> >::iterator k =
+			m_blocks_being_saved.find(p3d);
+	if(k != m_blocks_being_saved.end() &&
+			k->second.second == block->getModifiedSerial())
+		return true;
 
-	/*
-		[0] u8 serialization version
-		[1] data
-	*/
-	std::ostringstream o(std::ios_base::binary);
-	o.write((char*) &version, 1);
-	block->serialize(o, version, true);
+	u32 ticket = m_save_thread->queueBlock(p3d, serializeBlockForSaving(block));
+	// The modified flag is reset by processWrittenBlocks() once written
+	m_blocks_being_saved[p3d] = std::make_pair(ticket,
+			block->getModifiedSerial());
+	return true;
+}
+
+void ServerMap::processWrittenBlocks()
+{
+	std::list<std::pair<v3s16, u32> > written;
+	m_save_thread->getWrittenBlocks(written);
+
+	for(std::list<std::pair<v3s16, u32> >::iterator
+			i = written.begin(); i != written.end(); ++i)
+	{
+		std::map<v3s16, std::pair<u32, u32> >::iterator k =
+				m_blocks_being_saved.find(i->first);
+		// Superseded by a newer save or the block was reloaded
+		if(k == m_blocks_being_saved.end() || k->second.first != i->second)
+			continue;
+		MapBlock *block = getBlockNoCreateNoEx(i->first);
+		if(block && block->getModifiedSerial() == k->second.second)
+			block->resetModified();
+		m_blocks_being_saved.erase(k);
+	}
+}
+
+bool ServerMap::saveBlock(MapBlock *block, Database *db)
+{
+	v3s16 p3d = block->getPos();
 
-	std::string data = o.str();
+	// Dummy blocks are not written
+	if (block->isDummy()) {
+		errorstream << "WARNING: saveBlock: Not writing dummy block "
+			<< PP(p3d) << std::endl;
+		return true;
+	}
+
+	std::string data = serializeBlockForSaving(block);
 	bool ret = db->saveBlock(p3d, data);
 	if(ret) {
 		// We just wrote it to the disk so clear modified flag
@@ -3334,6 +3782,9 @@ void ServerMap::loadBlock(std::string sectordir, std::string blockfile,
 		// Read basic data
 		block->deSerialize(is, version, true);
 
+		// Writes queued for an earlier copy of the block don't apply
+		m_blocks_being_saved.erase(p3d);
+
 		// If it's a new block, insert it to the map
 		if(created_new)
 			sector->insertBlock(block);
@@ -3345,6 +3796,8 @@ void ServerMap::loadBlock(std::string sectordir, std::string blockfile,
 		if(version < SER_FMT_VER_HIGHEST_WRITE || save_after_load)
 		{
 			saveBlock(block);
+			// Make sure it is in the database before deleting the file
+			m_save_thread->flush();
 
 			// Should be in database now, so delete the old file
 			fs::RecursiveDelete(fullpath);
@@ -3401,6 +3854,9 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 		// Read basic data
 		block->deSerialize(is, version, true);
 
+		// Writes queued for an earlier copy of the block don't apply
+		m_blocks_being_saved.erase(p3d);
+
 		// If it's a new block, insert it to the map
 		if(created_new)
 			sector->insertBlock(block);
@@ -3445,12 +3901,46 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 	std::string ret;
 
-	ret = dbase->loadBlock(blockpos);
+	ret = m_save_thread->loadBlock(blockpos);
 	if (ret != "") {
 		loadBlock(&ret, blockpos, createSector(p2d), false);
 		return getBlockNoCreateNoEx(blockpos);
 	}
 	// Not found in database, try the files
+	return loadBlockFromFiles(blockpos);
+}
+
+void ServerMap::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::vector<MapBlock*> &blocks)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::vector<std::string> data;
+	m_save_thread->loadBlocks(blockpos, data);
+
+	blocks.clear();
+	blocks.resize(blockpos.size(), NULL);
+	for(size_t i = 0; i < blockpos.size(); i++)
+	{
+		v3s16 p = blockpos[i];
+		if(data[i] != "") {
+			loadBlock(&data[i], p, createSector(v2s16(p.X, p.Z)), false);
+			blocks[i] = getBlockNoCreateNoEx(p);
+		} else {
+			blocks[i] = loadBlockFromFiles(p);
+		}
+	}
+}
+
+void ServerMap::prefetchBlocks(const std::vector<v3s16> &blockpos)
+{
+	m_save_thread->prefetchBlocks(blockpos);
+}
+
+MapBlock* ServerMap::loadBlockFromFiles(v3s16 blockpos)
+{
+	v2s16 p2d(blockpos.X, blockpos.Z);
+
 
 	// The directory layout we're going to load from.
 	//  1 - original sectors/xxxxzzzz/
@@ -3642,4 +4132,40 @@ void ManualMapVoxelManipulator::blitBackAll(
 	}
 }
 
+void ManualMapVoxelManipulator::getDayNightDiffs(INodeDefManager *ndef,
+		std::map<v3s16, bool> &dst)
+{
+	for(std::map<v3s16, u8>::iterator
+			i = m_loaded_blocks.begin();
+			i != m_loaded_blocks.end(); ++i)
+	{
+		if(i->second & VMANIP_BLOCK_DATA_INEXIST)
+			continue;
+
+		v3s16 minp = i->first * MAP_BLOCKSIZE;
+		v3s16 maxp = minp + v3s16(1,1,1) * (MAP_BLOCKSIZE - 1);
+		if(!m_area.contains(minp) || !m_area.contains(maxp))
+			continue;
+
+		// Same as MapBlock::actuallyUpdateDayNightDiff()
+		bool differs = false;
+		bool only_air = true;
+		for(s16 z = minp.Z; z <= maxp.Z; z++)
+		for(s16 y = minp.Y; y <= maxp.Y; y++)
+		{
+			u32 vi = m_area.index(minp.X, y, z);
+			for(s16 x = minp.X; x <= maxp.X; x++, vi++)
+			{
+				MapNode &n = m_data[vi];
+				if(n.getContent() != CONTENT_AIR)
+					only_air = false;
+				if(!differs && n.getLight(LIGHTBANK_DAY, ndef) !=
+						n.getLight(LIGHTBANK_NIGHT, ndef))
+					differs = true;
+			}
+		}
+		dst[i->first] = differs && !only_air;
+	}
+}
+
 //END
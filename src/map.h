@@ -39,6 +39,7 @@ class ClientMap;
 class MapSector;
 class ServerMapSector;
 class MapBlock;
+class MapSaveThread;
 class NodeMetadata;
 class IGameDef;
 class IRollbackManager;
@@ -66,6 +67,8 @@ enum MapEditEventType{
 	// Node metadata of block changed (not knowing which node exactly)
 	// p stores block coordinate
 	MEET_BLOCK_NODE_METADATA_CHANGED,
+	// Node metadata of the node at p changed
+	MEET_NODE_METADATA_CHANGED,
 	// Anything else (modified_blocks are set unsent)
 	MEET_OTHER
 };
@@ -103,6 +106,8 @@ struct MapEditEvent
 			return VoxelArea(p);
 		case MEET_SWAPNODE:
 			return VoxelArea(p);
+		case MEET_NODE_METADATA_CHANGED:
+			return VoxelArea(p);
 		case MEET_BLOCK_NODE_METADATA_CHANGED:
 		{
 			v3s16 np1 = p*MAP_BLOCKSIZE;
@@ -129,6 +134,34 @@ struct MapEditEvent
 	}
 };
 
+/*
+	Queue of the liquid nodes to transform, kept in a queue of its own
+	for each MapBlock.  A position is queued only once.  pop_front() takes
+	the nodes of the blocks in turns, so that a flood in one place
+	doesn't hold back the liquids everywhere else.
+*/
+class LiquidQueue
+{
+public:
+	LiquidQueue():
+		m_size(0),
+		m_turn_left(0)
+	{}
+
+	// Does nothing and returns false if p is already queued
+	bool push_back(v3s16 p);
+	v3s16 pop_front();
+	u32 size() { return m_size; }
+
+private:
+	std::map<v3s16, UniqueQueue<v3s16> > m_blocks;
+	// Blocks with queued nodes, in the order of their turns
+	std::list<v3s16> m_turns;
+	u32 m_size;
+	// Nodes left in the turn of the block at the front of m_turns
+	u16 m_turn_left;
+};
+
 class MapEventReceiver
 {
 public:
@@ -188,6 +221,18 @@ class Map /*: public NodeContainer*/
 	// Returns NULL if not found
 	MapBlock * getBlockNoCreateNoEx(v3s16 p);
 
+	// Called by MapSector when it gets and gives away blocks
+	void indexBlock(MapBlock *block);
+	void unindexBlock(MapBlock *block);
+
+	// Called by MapBlock::resetUsageTimer()
+	void touchBlock(MapBlock *block);
+	// Seconds counted by timerUpdate(), for the usage stamps of blocks
+	double getUsageClock()
+	{
+		return m_usage_clock;
+	}
+
 	/* Server overrides */
 	virtual MapBlock * emergeBlock(v3s16 p, bool allow_generate=true)
 	{ return getBlockNoCreateNoEx(p); }
@@ -205,10 +250,15 @@ class Map /*: public NodeContainer*/
 	// position is valid, otherwise false
 	MapNode getNodeNoEx(v3s16 p, bool *is_valid_position = NULL);
 
+	/*
+		If light_was is not NULL, the functions below that change light
+		save in it the light each node had before they first changed it.
+	*/
 	void unspreadLight(enum LightBank bank,
 			std::map<v3s16, u8> & from_nodes,
 			std::set<v3s16> & light_sources,
-			std::map<v3s16, MapBlock*> & modified_blocks);
+			std::map<v3s16, MapBlock*> & modified_blocks,
+			std::map<v3s16, u8> *light_was = NULL);
 
 	void unLightNeighbors(enum LightBank bank,
 			v3s16 pos, u8 lightwas,
@@ -217,7 +267,8 @@ class Map /*: public NodeContainer*/
 
 	void spreadLight(enum LightBank bank,
 			std::set<v3s16> & from_nodes,
-			std::map<v3s16, MapBlock*> & modified_blocks);
+			std::map<v3s16, MapBlock*> & modified_blocks,
+			std::map<v3s16, u8> *light_was = NULL);
 
 	void lightNeighbors(enum LightBank bank,
 			v3s16 pos,
@@ -226,6 +277,13 @@ class Map /*: public NodeContainer*/
 	v3s16 getBrightestNeighbour(enum LightBank bank, v3s16 p);
 
 	s16 propagateSunlight(v3s16 start,
+			std::map<v3s16, MapBlock*> & modified_blocks,
+			std::map<v3s16, u8> *light_was = NULL);
+
+	// Adds the blocks of the nodes of light_was whose light is not what
+	// it was to modified_blocks
+	void addLightChangedBlocks(enum LightBank bank,
+			std::map<v3s16, u8> & light_was,
 			std::map<v3s16, MapBlock*> & modified_blocks);
 
 	void updateLighting(enum LightBank bank,
@@ -251,6 +309,15 @@ class Map /*: public NodeContainer*/
 	*/
 	bool addNodeWithEvent(v3s16 p, MapNode n, bool remove_metadata = true);
 	bool removeNodeWithEvent(v3s16 p);
+	/*
+		Sets nodes[i] at positions[i], like addNodeWithEvent() each, but
+		with the lighting of all the blocks touched updated at once and
+		one MEET_OTHER event for them. Cheaper than one by one from some
+		tens of nodes up. Returns false if some of the nodes were in
+		blocks that aren't loaded; those are left out.
+	*/
+	bool addNodesWithEvent(const std::vector<v3s16> &positions,
+			const std::vector<MapNode> &nodes);
 
 	/*
 		Takes the blocks at the edges into account
@@ -272,11 +339,33 @@ class Map /*: public NodeContainer*/
 	virtual bool saveBlock(MapBlock *block) { return false; };
 
 	/*
-		Updates usage timers and unloads unused blocks and sectors.
+		Updates usage timers and unloads unused blocks and sectors, the
+		least recently used first, until the rest are used within
+		unload_timeout, there are no more than max_loaded_blocks of
+		them and they take no more than max_memory bytes (0 for no
+		limit), as counted by getBlockMemoryUsage().  Blocks used since
+		the previous call are never unloaded because of the limits.
 		Saves modified blocks before unloading on MAPTYPE_SERVER.
 	*/
 	void timerUpdate(float dtime, float unload_timeout,
-			std::list<v3s16> *unloaded_blocks=NULL);
+			std::list<v3s16> *unloaded_blocks=NULL,
+			u32 max_loaded_blocks=0, u64 max_memory=0);
+
+	// Bytes taken by a block and what is kept for it, for timerUpdate()
+	virtual u32 getBlockMemoryUsage(MapBlock *block);
+
+	// Estimates of the bytes taken by the loaded blocks
+	struct MemoryStats
+	{
+		u64 blocks;
+		u64 metadata;
+		u64 static_objects;
+		u64 caches;
+
+		MemoryStats(): blocks(0), metadata(0), static_objects(0), caches(0)
+		{}
+	};
+	void getMemoryStats(MemoryStats &stats);
 
 	/*
 		Unloads all blocks with a zero refCount().
@@ -284,6 +373,10 @@ class Map /*: public NodeContainer*/
 	*/
 	void unloadUnreferencedBlocks(std::list<v3s16> *unloaded_blocks=NULL);
 
+	// Unloads the given blocks that are loaded and have a zero refCount(),
+	// saving them like unloadUnreferencedBlocks() does
+	void unloadBlocks(const std::vector<v3s16> &blocks);
+
 	// Deletes sectors and their blocks from memory
 	// Takes cache into account
 	// If deleted sector is in sector cache, clears cache
@@ -341,6 +434,7 @@ class Map /*: public NodeContainer*/
 		Misc.
 	*/
 	std::map<v2s16, MapSector*> *getSectorsPtr(){return &m_sectors;}
+	u32 getBlockCount(){return m_blocks.size();}
 
 	/*
 		Variables
@@ -360,12 +454,41 @@ class Map /*: public NodeContainer*/
 
 	std::map<v2s16, MapSector*> m_sectors;
 
-	// Be sure to set this to NULL when the cached sector is deleted
+	/*
+		Be sure to set this to NULL when the cached sector is deleted.
+		It is checked by the position of the sector, so that the readers
+		of Server::m_env_mutex can only see a whole entry.
+	*/
 	MapSector *m_sector_cache;
-	v2s16 m_sector_cache_p;
+
+	// All the blocks of the sectors, for lookups without going through
+	// the sectors
+	V3s16PtrHashMap<MapBlock> m_blocks;
+	/*
+		Each thread keeps the last block it looked up, as several threads
+		look up blocks under the shared envlock.  The cache of a thread
+		is only valid for the map with m_id, and until unindexBlock()
+		changes m_blocks_generation, which only happens under the
+		exclusive envlock.
+	*/
+	u32 m_id;
+	u32 m_blocks_generation;
+
+	/*
+		The blocks from the least to the most recently used one, linked
+		through the blocks; see MapBlock::m_usage_stamp.  The blocks
+		before m_usage_pack_next have been packed since they were last
+		used.
+	*/
+	double m_usage_clock;
+	MapBlock *m_usage_oldest;
+	MapBlock *m_usage_newest;
+	MapBlock *m_usage_pack_next;
+	void linkBlockUsage(MapBlock *block);
+	void unlinkBlockUsage(MapBlock *block);
 
 	// Queued transforming water nodes
-	UniqueQueue<v3s16> m_transforming_liquid;
+	LiquidQueue m_transforming_liquid;
 };
 
 /*
@@ -432,6 +555,9 @@ class ServerMap : public Map
 
 	// Helper for placing objects on ground level
 	s16 findGroundLevel(v2s16 p2d);
+	// Conservative bounds of findGroundLevel() in the column of the block
+	// column blockpos_2d, see Mapgen::getGroundLevelBounds()
+	bool getGroundLevelBounds(v2s16 blockpos_2d, s16 *min_y, s16 *max_y);
 
 	/*
 		Misc. helper functions for fiddling with directory and file
@@ -459,8 +585,20 @@ class ServerMap : public Map
 	void endSave();
 
 	void save(ModifiedState save_level);
-	void listAllLoadableBlocks(std::list<v3s16> &dst);
+	// See Database::listLoadableBlocks()
+	bool listLoadableBlocks(std::string &cursor, u32 max_count,
+			std::vector<v3s16> &dst);
 	void listAllLoadedBlocks(std::list<v3s16> &dst);
+
+	/*
+		Player data in the map database. If the backend doesn't support
+		it, these return false and players are kept in files.
+		Saves are written by the save thread.
+	*/
+	bool savePlayer(const std::string &name, const std::string &data);
+	bool loadPlayer(const std::string &name, std::string &data);
+	void listPlayers(std::vector<std::string> &dst);
+
 	// Saves map seed and possibly other stuff
 	void saveMapMeta();
 	void loadMapMeta();
@@ -489,6 +627,14 @@ class ServerMap : public Map
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
+	// Loads several blocks with one database query; blocks[i] is set to
+	// the loaded block at blockpos[i] or NULL
+	void loadBlocks(const std::vector<v3s16> &blockpos,
+			std::vector<MapBlock*> &blocks);
+	// Reads the blocks from the database into the block cache of the save
+	// thread, so that loading them takes no database access. Doesn't touch
+	// the map, so it can be called without the environment lock.
+	void prefetchBlocks(const std::vector<v3s16> &blockpos);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
@@ -523,6 +669,19 @@ class ServerMap : public Map
 	*/
 	bool m_map_metadata_changed;
 	Database *dbase;
+
+	/*
+		Blocks are written by this thread. Blocks in
+		m_blocks_being_saved have been queued for writing and are marked
+		as clean once written, unless they have been modified meanwhile.
+	*/
+	MapSaveThread *m_save_thread;
+	// Position -> (save ticket, modified serial at queueing time)
+	std::map<v3s16, std::pair<u32, u32> > m_blocks_being_saved;
+
+	void processWrittenBlocks();
+	MapBlock* loadBlockFromFiles(v3s16 blockpos);
+	std::string serializeBlockForSaving(MapBlock *block);
 };
 
 
@@ -551,6 +710,14 @@ class ManualMapVoxelManipulator : public VoxelManipulator
 	void blitBackAll(std::map<v3s16, MapBlock*> * modified_blocks,
 			bool overwrite_generated = true);
 
+	/*
+		Computes what MapBlock::actuallyUpdateDayNightDiff() would for
+		each block that blitBackAll() writes, so that it can be done
+		without holding the map.
+	*/
+	void getDayNightDiffs(INodeDefManager *ndef,
+			std::map<v3s16, bool> &dst);
+
 	bool m_is_dirty;
 
 protected:
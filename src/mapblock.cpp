@@ -30,14 +30,133 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h" // For legacy name-id mapping
 #include "content_nodemeta.h" // For legacy deserialization
 #include "serialization.h"
+#include "sha1.h"
 #ifndef SERVER
 #include "mapblock_mesh.h"
 #endif
 #include "util/string.h"
 #include "util/serialize.h"
+#include "jthread/jmutex.h"
+#include "jthread/jmutexautolock.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+/*
+	MapBlock pools
+*/
+
+static JMutex g_mapblock_pool_mutex;
+static std::vector<MapNode*> g_mapblock_nodes_pool;
+static std::vector<void*> g_mapblock_pool;
+static MapBlockPoolStats g_mapblock_pool_stats;
+
+MapNode *allocMapBlockNodes()
+{
+	{
+		JMutexAutoLock lock(g_mapblock_pool_mutex);
+		g_mapblock_pool_stats.nodes_used++;
+		if(!g_mapblock_nodes_pool.empty()){
+			MapNode *nodes = g_mapblock_nodes_pool.back();
+			g_mapblock_nodes_pool.pop_back();
+			g_mapblock_pool_stats.reused++;
+			return nodes;
+		}
+		g_mapblock_pool_stats.allocated++;
+	}
+	return (MapNode*)::operator new(
+			MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE * sizeof(MapNode));
+}
+
+void freeMapBlockNodes(MapNode *nodes)
+{
+	{
+		JMutexAutoLock lock(g_mapblock_pool_mutex);
+		g_mapblock_pool_stats.nodes_used--;
+		if(g_mapblock_nodes_pool.size() < MAPBLOCK_POOL_MAX){
+			g_mapblock_nodes_pool.push_back(nodes);
+			return;
+		}
+	}
+	::operator delete(nodes);
+}
+
+/*
+	MapBlockNodeSnapshot
+*/
+
+MapBlockNodeSnapshot::MapBlockNodeSnapshot(v3s16 pos, MapNode *nodes):
+	m_pos(pos),
+	m_nodes(nodes),
+	m_refcount(1)
+{
+}
+
+MapBlockNodeSnapshot::~MapBlockNodeSnapshot()
+{
+	if(m_nodes != NULL)
+		freeMapBlockNodes(m_nodes);
+}
+
+void MapBlockNodeSnapshot::drop()
+{
+	{
+		JMutexAutoLock lock(m_mutex);
+		assert(m_refcount > 0);
+		if(--m_refcount != 0)
+			return;
+	}
+	delete this;
+}
+
+bool MapBlockNodeSnapshot::takeNodes()
+{
+	JMutexAutoLock lock(m_mutex);
+	if(m_refcount != 1)
+		return false;
+	m_nodes = NULL;
+	return true;
+}
+
+void *MapBlock::operator new(size_t size)
+{
+	assert(size == sizeof(MapBlock));
+	{
+		JMutexAutoLock lock(g_mapblock_pool_mutex);
+		g_mapblock_pool_stats.blocks_used++;
+		if(!g_mapblock_pool.empty()){
+			void *p = g_mapblock_pool.back();
+			g_mapblock_pool.pop_back();
+			g_mapblock_pool_stats.reused++;
+			return p;
+		}
+		g_mapblock_pool_stats.allocated++;
+	}
+	return ::operator new(size);
+}
+
+void MapBlock::operator delete(void *p)
+{
+	if(p == NULL)
+		return;
+	{
+		JMutexAutoLock lock(g_mapblock_pool_mutex);
+		g_mapblock_pool_stats.blocks_used--;
+		if(g_mapblock_pool.size() < MAPBLOCK_POOL_MAX){
+			g_mapblock_pool.push_back(p);
+			return;
+		}
+	}
+	::operator delete(p);
+}
+
+void getMapBlockPoolStats(MapBlockPoolStats &stats)
+{
+	JMutexAutoLock lock(g_mapblock_pool_mutex);
+	stats = g_mapblock_pool_stats;
+	stats.nodes_free = g_mapblock_nodes_pool.size();
+	stats.blocks_free = g_mapblock_pool.size();
+}
+
 /*
 	MapBlock
 */
@@ -49,17 +168,30 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_modified(MOD_STATE_WRITE_NEEDED),
 		m_modified_reason("initial"),
 		m_modified_reason_too_long(false),
+		m_modified_serial(0),
 		is_underground(false),
 		m_lighting_expired(true),
 		m_day_night_differs(false),
 		m_day_night_differs_expired(true),
+		m_content_summary_overflow(false),
+		m_content_summary_expired(true),
+		m_change_log_overflow(false),
+		m_network_serialization_serial(0),
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
-		m_usage_timer(0),
+		m_usage_stamp(0),
+		m_usage_prev(NULL),
+		m_usage_next(NULL),
+		m_usage_listed(false),
 		m_refcount(0)
 {
 	data = NULL;
+	m_indices = NULL;
+	m_packed_writes = 0;
+	m_pack_serial = 0;
+	m_pack_serial_valid = false;
+	m_node_snapshot = NULL;
 	if(dummy == false)
 		reallocate();
 	
@@ -82,8 +214,10 @@ MapBlock::~MapBlock()
 	}
 #endif
 
+	dropNodeSnapshot();
 	if(data)
-		delete[] data;
+		freeMapBlockNodes(data);
+	clearPacked();
 }
 
 bool MapBlock::isValidPositionParent(v3s16 p)
@@ -102,14 +236,206 @@ MapNode MapBlock::getNodeParent(v3s16 p, bool *is_valid_position)
 	if (isValidPosition(p) == false)
 		return m_parent->getNodeNoEx(getPosRelative() + p, is_valid_position);
 
-	if (data == NULL) {
+	if (isDummy()) {
 		if (is_valid_position)
 			*is_valid_position = false;
 		return MapNode(CONTENT_IGNORE);
 	}
 	if (is_valid_position)
 		*is_valid_position = true;
-	return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+	return getNodeAt(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X);
+}
+
+void MapBlock::setPackedNode(u32 i, const MapNode &n)
+{
+	if(m_indices != NULL && m_packed_writes < MAPBLOCK_PACKED_WRITES_MAX)
+	{
+		for(u32 j = 0; j < m_palette.size(); j++)
+		{
+			if(!(m_palette[j] == n))
+				continue;
+			if(m_palette.size() <= 16){
+				u8 shift = (i & 1) << 2;
+				m_indices[i >> 1] = (m_indices[i >> 1] & ~(0x0f << shift))
+						| (j << shift);
+			} else {
+				m_indices[i] = j;
+			}
+			m_packed_writes++;
+			return;
+		}
+	}
+
+	// A new kind of node, or a lot of writes
+	actuallyUnpack();
+	data[i] = n;
+}
+
+void MapBlock::getNodes(MapNode *dst)
+{
+	u32 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+	if(data != NULL){
+		memcpy(dst, data, nodecount * sizeof(MapNode));
+	} else if(m_indices == NULL){
+		for(u32 i = 0; i < nodecount; i++)
+			dst[i] = m_palette[0];
+	} else if(m_palette.size() <= 16){
+		for(u32 i = 0; i < nodecount; i += 2){
+			u8 b = m_indices[i >> 1];
+			dst[i] = m_palette[b & 0x0f];
+			dst[i + 1] = m_palette[b >> 4];
+		}
+	} else {
+		for(u32 i = 0; i < nodecount; i++)
+			dst[i] = m_palette[m_indices[i]];
+	}
+}
+
+void MapBlock::actuallyUnpack()
+{
+	MapNode *nodes = allocMapBlockNodes();
+	getNodes(nodes);
+	data = nodes;
+	clearPacked();
+	m_pack_serial_valid = false;
+}
+
+void MapBlock::clearPacked()
+{
+	delete[] m_indices;
+	m_indices = NULL;
+	std::vector<MapNode>().swap(m_palette);
+	m_packed_writes = 0;
+}
+
+void MapBlock::pack()
+{
+	if(data == NULL)
+		return;
+	if(m_pack_serial_valid && m_pack_serial == m_modified_serial)
+		return;
+	m_pack_serial = m_modified_serial;
+	m_pack_serial_valid = true;
+
+	u32 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+	std::vector<MapNode> palette;
+	u8 *indices = new u8[nodecount];
+	u8 last = 0;
+	palette.push_back(data[0]);
+	indices[0] = 0;
+	for(u32 i = 1; i < nodecount; i++)
+	{
+		const MapNode &n = data[i];
+		// Runs of the same node are the common case
+		if(!(palette[last] == n))
+		{
+			u32 j = 0;
+			while(j < palette.size() && !(palette[j] == n))
+				j++;
+			if(j == palette.size())
+			{
+				if(palette.size() == MAPBLOCK_PALETTE_MAX){
+					delete[] indices;
+					return;
+				}
+				palette.push_back(n);
+			}
+			last = j;
+		}
+		indices[i] = last;
+	}
+
+	m_palette.swap(palette);
+	if(m_palette.size() == 1){
+		m_indices = NULL;
+	} else if(m_palette.size() <= 16){
+		m_indices = new u8[nodecount / 2];
+		for(u32 i = 0; i < nodecount; i += 2)
+			m_indices[i >> 1] = indices[i] | (indices[i + 1] << 4);
+	} else {
+		m_indices = indices;
+		indices = NULL;
+	}
+	delete[] indices;
+	m_packed_writes = 0;
+
+	// A snapshot in use keeps the array and stays equal to the nodes
+	if(m_node_snapshot != NULL && m_node_snapshot->getNodes() == data &&
+			m_node_snapshot->takeNodes()){
+		m_node_snapshot->drop();
+		m_node_snapshot = NULL;
+	}
+	if(m_node_snapshot == NULL || m_node_snapshot->getNodes() != data)
+		freeMapBlockNodes(data);
+	data = NULL;
+}
+
+void MapBlock::actuallyDetachNodeSnapshot(bool keep_data)
+{
+	if(data != NULL && m_node_snapshot->getNodes() == data &&
+			!m_node_snapshot->takeNodes()){
+		if(keep_data){
+			MapNode *nodes = allocMapBlockNodes();
+			memcpy(nodes, data,
+					MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE*sizeof(MapNode));
+			data = nodes;
+		} else {
+			data = NULL;
+		}
+	}
+	m_node_snapshot->drop();
+	m_node_snapshot = NULL;
+}
+
+MapBlockNodeSnapshot *MapBlock::getNodeSnapshot()
+{
+	if(isDummy())
+		return NULL;
+	if(m_node_snapshot == NULL){
+		if(data != NULL){
+			m_node_snapshot = new MapBlockNodeSnapshot(getPos(), data);
+		} else {
+			// Packed blocks stay packed; the snapshot has its own copy
+			MapNode *nodes = allocMapBlockNodes();
+			getNodes(nodes);
+			m_node_snapshot = new MapBlockNodeSnapshot(getPos(), nodes);
+		}
+	}
+	m_node_snapshot->grab();
+	return m_node_snapshot;
+}
+
+u32 MapBlock::getNodeMemoryUsage()
+{
+	u32 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+	if(data != NULL)
+		return nodecount * sizeof(MapNode);
+	u32 size = m_palette.capacity() * sizeof(MapNode);
+	if(m_indices != NULL)
+		size += m_palette.size() <= 16 ? nodecount / 2 : nodecount;
+	return size;
+}
+
+u32 MapBlock::getMetadataMemoryUsage()
+{
+	return m_node_metadata_raw.size() + m_node_metadata.getMemoryUsage() +
+			m_node_timers.size() * sizeof(NodeTimer);
+}
+
+u32 MapBlock::getStaticObjectMemoryUsage()
+{
+	return m_static_objects.getMemoryUsage();
+}
+
+u32 MapBlock::getCacheMemoryUsage()
+{
+	u32 size = m_content_summary.capacity() * sizeof(content_t) +
+			m_change_log.capacity() * sizeof(u16);
+	for(std::map<u32, std::string>::const_iterator
+			i = m_network_serialization.begin();
+			i != m_network_serialization.end(); ++i)
+		size += i->second.size();
+	return size;
 }
 
 /*
@@ -136,6 +462,9 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
+	// Light is changed in place below
+	expireNetworkSerialization();
+
 	// Whether the sunlight at the top of the bottom block is valid
 	bool block_below_is_valid = true;
 	
@@ -251,6 +580,9 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 				if(current_light > old_light || remove_light)
 				{
 					n.setLight(LIGHTBANK_DAY, current_light, nodemgr);
+					if(current_light != old_light)
+						logNodeChange(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+								+ y*MAP_BLOCKSIZE + x);
 				}
 				
 				if(diminish_light(current_light) != 0)
@@ -308,23 +640,81 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 
 
 void MapBlock::copyTo(VoxelManipulator &dst)
+{
+	v3s16 relpos = getPosRelative();
+	copyTo(dst, VoxelArea(relpos,
+			relpos + v3s16(1,1,1) * (MAP_BLOCKSIZE - 1)));
+}
+
+void MapBlock::copyTo(VoxelManipulator &dst, const VoxelArea &area)
 {
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
-	
+
+	// The part of area in the block, relative to the block
+	v3s16 relpos = getPosRelative();
+	v3s16 from_pos(
+			MYMAX(area.MinEdge.X - relpos.X, 0),
+			MYMAX(area.MinEdge.Y - relpos.Y, 0),
+			MYMAX(area.MinEdge.Z - relpos.Z, 0));
+	v3s16 to_pos(
+			MYMIN(area.MaxEdge.X - relpos.X, MAP_BLOCKSIZE - 1),
+			MYMIN(area.MaxEdge.Y - relpos.Y, MAP_BLOCKSIZE - 1),
+			MYMIN(area.MaxEdge.Z - relpos.Z, MAP_BLOCKSIZE - 1));
+	if(from_pos.X > to_pos.X || from_pos.Y > to_pos.Y
+			|| from_pos.Z > to_pos.Z)
+		return;
+	v3s16 size = to_pos - from_pos + v3s16(1,1,1);
+
 	// Copy from data to VoxelManipulator
-	dst.copyFrom(data, data_area, v3s16(0,0,0),
-			getPosRelative(), data_size);
+	if(data != NULL){
+		dst.copyFrom(data, data_area, from_pos,
+				relpos + from_pos, size);
+		return;
+	}
+
+	// Packed blocks are decoded into a temporary, the block stays packed
+	MapNode nodes[MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE];
+	getNodes(nodes);
+	dst.copyFrom(nodes, data_area, from_pos,
+			relpos + from_pos, size);
 }
 
 void MapBlock::copyFrom(VoxelManipulator &dst)
 {
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+
+	unpack();
+	detachNodeSnapshot();
 	
+	// Log the nodes that are going to change; copyTo() skips ignore.
+	// A block being generated has been sent to nobody yet.
+	v3s16 p0 = getPosRelative();
+	bool log = isGenerated();
+	for(s16 z=0; z<MAP_BLOCKSIZE && log && !m_change_log_overflow; z++)
+	for(s16 y=0; y<MAP_BLOCKSIZE && log && !m_change_log_overflow; y++)
+	{
+		u32 i = z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE;
+		s32 vi = dst.m_area.index(p0.X, p0.Y+y, p0.Z+z);
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++, i++, vi++)
+		{
+			const MapNode &n = dst.m_data[vi];
+			if(n.getContent() != CONTENT_IGNORE && !(data[i] == n))
+				logNodeChange(i);
+		}
+	}
+
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	expireContentSummary();
+	expireNetworkSerialization();
+
+	// Mostly done for whole generated blocks, which are packed right away
+	m_pack_serial_valid = false;
+	pack();
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -333,56 +723,117 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
 
-	if(data == NULL)
+	if(isDummy())
 	{
 		m_day_night_differs = false;
 		return;
 	}
 
-	bool differs = false;
-
-	/*
-		Check if any lighting value differs
-	*/
-	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	// Every node of a packed block is one of its palette
+	const MapNode *nodes = data;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(nodes == NULL)
 	{
-		MapNode &n = data[i];
-		if(n.getLight(LIGHTBANK_DAY, nodemgr) != n.getLight(LIGHTBANK_NIGHT, nodemgr))
-		{
-			differs = true;
-			break;
-		}
+		nodes = &m_palette[0];
+		nodecount = m_palette.size();
 	}
 
 	/*
-		If some lighting values differ, check if the whole thing is
-		just air. If it is, differ = false
+		Check if any lighting value differs, and if the whole thing is
+		just air, in which case it doesn't count; both in one pass
 	*/
-	if(differs)
+	bool differs = false;
+	bool only_air = true;
+	for(u32 i=0; i<nodecount; i++)
 	{
-		bool only_air = true;
-		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+		const MapNode &n = nodes[i];
+		if(n.getContent() != CONTENT_AIR)
+			only_air = false;
+		// A node with the same light in both banks can't differ, whatever
+		// its definition, so the definition is only looked up for the few
+		// that have different ones
+		if(!differs && (n.param1 & 0x0f) != (n.param1 >> 4))
 		{
-			MapNode &n = data[i];
-			if(n.getContent() != CONTENT_AIR)
-			{
-				only_air = false;
-				break;
-			}
+			u8 day, night;
+			n.getLightBanks(day, night, nodemgr);
+			differs = day != night;
 		}
-		if(only_air)
-			differs = false;
+		if(differs && !only_air)
+			break;
 	}
+	if(only_air)
+		differs = false;
 
 	// Set member variable
 	m_day_night_differs = differs;
 }
 
+void MapBlock::actuallyUpdateContentSummary()
+{
+	// Running this function un-expires the summary
+	m_content_summary_expired = false;
+	m_content_summary_overflow = false;
+	m_content_summary.clear();
+
+	if(isDummy())
+		return;
+
+	// Every node of a packed block is one of its palette
+	if(data == NULL)
+	{
+		for(u32 i=0; i<m_palette.size() && !m_content_summary_overflow; i++)
+			noteContent(m_palette[i].getContent());
+		if(m_content_summary_overflow)
+			m_content_summary.clear();
+		return;
+	}
+
+	content_t last = data[0].getContent();
+	noteContent(last);
+	for(u32 i=1; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	{
+		content_t c = data[i].getContent();
+		// Runs of the same content are the common case
+		if(c == last)
+			continue;
+		last = c;
+		noteContent(c);
+		if(m_content_summary_overflow){
+			m_content_summary.clear();
+			return;
+		}
+	}
+}
+
+bool MapBlock::mayContainAny(const std::set<content_t> &contents)
+{
+	const std::vector<content_t> *summary = getContentSummary();
+	if(summary == NULL)
+		return true;
+	for(std::vector<content_t>::const_iterator i = summary->begin();
+			i != summary->end(); ++i)
+	{
+		if(contents.count(*i) != 0)
+			return true;
+	}
+	return false;
+}
+
+bool MapBlock::takeNodeChangeLog(std::vector<u16> &indices)
+{
+	bool complete = !m_change_log_overflow;
+	if(complete)
+		indices.insert(indices.end(), m_change_log.begin(), m_change_log.end());
+	m_change_log.clear();
+	m_change_log_overflow = false;
+	return complete;
+}
+
 void MapBlock::expireDayNightDiff()
 {
 	//INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL){
+	if(isDummy()){
 		m_day_night_differs = false;
 		m_day_night_differs_expired = false;
 		return;
@@ -391,6 +842,39 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+void MapBlock::parseNodeMetadata()
+{
+	std::string raw;
+	raw.swap(m_node_metadata_raw);
+	// Ignore errors, like when reading the block
+	try{
+		std::istringstream is(raw, std::ios_base::binary);
+		std::ostringstream oss(std::ios_base::binary);
+		decompressZlib(is, oss);
+		std::istringstream iss(oss.str(), std::ios_base::binary);
+		m_node_metadata.deSerialize(iss, m_gamedef);
+	}
+	catch(SerializationError &e)
+	{
+		errorstream<<"WARNING: MapBlock::parseNodeMetadata(): Ignoring an"
+				<<" error while deserializing node metadata at ("
+				<<PP(getPos())<<": "<<e.what()<<std::endl;
+	}
+}
+
+void MapBlock::resetUsageTimer()
+{
+	if(m_parent)
+		m_parent->touchBlock(this);
+}
+
+float MapBlock::getUsageTimer()
+{
+	if(m_parent == NULL)
+		return 0;
+	return m_parent->getUsageClock() - m_usage_stamp;
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -400,7 +884,8 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNodeAt(p2d.Y*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+					+ y*MAP_BLOCKSIZE + p2d.X);
 			if(m_gamedef->ndef()->get(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -426,21 +911,37 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 // sure we can handle all content ids. But it's absolutely worth it as it's
 // a speedup of 4 for one of the major time consuming functions on storing
 // mapblocks.
-static content_t getBlockNodeIdMapping_mapping[USHRT_MAX];
+// The table is kept all 0xFFFF between calls, so that only the entries of
+// the ids used by a block have to be reset instead of the whole table.
+static content_t getBlockNodeIdMapping_mapping[USHRT_MAX + 1];
+static bool getBlockNodeIdMapping_initialized = false;
+static JMutex getBlockNodeIdMapping_mutex;
 static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 		INodeDefManager *nodedef)
 {
-	memset(getBlockNodeIdMapping_mapping, 0xFF, USHRT_MAX * sizeof(content_t));
+	JMutexAutoLock lock(getBlockNodeIdMapping_mutex);
+	if(!getBlockNodeIdMapping_initialized){
+		memset(getBlockNodeIdMapping_mapping, 0xFF,
+				sizeof(getBlockNodeIdMapping_mapping));
+		getBlockNodeIdMapping_initialized = true;
+	}
 
+	std::vector<content_t> used_ids;
 	std::set<content_t> unknown_contents;
 	content_t id_counter = 0;
+	// Runs of the same node are the common case
+	content_t last_global_id = CONTENT_IGNORE;
+	content_t last_id = 0xFFFF;
 	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
 	{
 		content_t global_id = nodes[i].getContent();
 		content_t id = CONTENT_IGNORE;
 
 		// Try to find an existing mapping
-		if (getBlockNodeIdMapping_mapping[global_id] != 0xFFFF) {
+		if (global_id == last_global_id && last_id != 0xFFFF) {
+			id = last_id;
+		}
+		else if (getBlockNodeIdMapping_mapping[global_id] != 0xFFFF) {
 			id = getBlockNodeIdMapping_mapping[global_id];
 		}
 		else
@@ -448,6 +949,7 @@ static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 			// We have to assign a new mapping
 			id = id_counter++;
 			getBlockNodeIdMapping_mapping[global_id] = id;
+			used_ids.push_back(global_id);
 
 			const ContentFeatures &f = nodedef->get(global_id);
 			const std::string &name = f.name;
@@ -459,7 +961,13 @@ static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 
 		// Update the MapNode
 		nodes[i].setContent(id);
+		last_global_id = global_id;
+		last_id = id;
 	}
+	for(std::vector<content_t>::const_iterator
+			i = used_ids.begin();
+			i != used_ids.end(); ++i)
+		getBlockNodeIdMapping_mapping[*i] = 0xFFFF;
 	for(std::set<content_t>::const_iterator
 			i = unknown_contents.begin();
 			i != unknown_contents.end(); i++){
@@ -480,24 +988,40 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	// correct ids.
 	std::set<content_t> unnamed_contents;
 	std::set<std::string> unallocatable_contents;
+	// Global ids of the local ids, looked up by name once per block.
+	// Local ids are numbered from 0 by getBlockNodeIdMapping() so the
+	// table stays small.
+	const content_t unresolved = 0xFFFF;
+	const content_t unknown = 0xFFFE;
+	std::vector<content_t> global_ids;
 	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
 	{
 		content_t local_id = nodes[i].getContent();
-		std::string name;
-		bool found = nimap->getName(local_id, name);
-		if(!found){
-			unnamed_contents.insert(local_id);
-			continue;
-		}
-		content_t global_id;
-		found = nodedef->getId(name, global_id);
-		if(!found){
-			global_id = gamedef->allocateUnknownNodeId(name);
-			if(global_id == CONTENT_IGNORE){
-				unallocatable_contents.insert(name);
+		if(local_id >= global_ids.size())
+			global_ids.resize(local_id + 1, unresolved);
+		content_t &global_id = global_ids[local_id];
+		if(global_id == unresolved)
+		{
+			global_id = unknown;
+			std::string name;
+			bool found = nimap->getName(local_id, name);
+			if(!found){
+				unnamed_contents.insert(local_id);
 				continue;
 			}
+			content_t id;
+			found = nodedef->getId(name, id);
+			if(!found){
+				id = gamedef->allocateUnknownNodeId(name);
+				if(id == CONTENT_IGNORE){
+					unallocatable_contents.insert(name);
+					continue;
+				}
+			}
+			global_id = id;
 		}
+		if(global_id == unknown)
+			continue;
 		nodes[i].setContent(global_id);
 	}
 	for(std::set<content_t>::const_iterator
@@ -516,12 +1040,13 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	}
 }
 
-void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+void MapBlock::serialize(std::ostream &os, u8 version, bool disk,
+		int compression_level)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -533,16 +1058,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 				"version < 24 not possible");
 		
 	// First byte
-	u8 flags = 0;
-	if(is_underground)
-		flags |= 0x01;
-	if(getDayNightDiff())
-		flags |= 0x02;
-	if(m_lighting_expired)
-		flags |= 0x04;
-	if(m_generated == false)
-		flags |= 0x08;
-	writeU8(os, flags);
+	writeU8(os, getSerializationFlags());
 	
 	/*
 		Bulk node data
@@ -551,9 +1067,8 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 	if(disk)
 	{
-		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
+		MapNode *tmp_nodes = allocMapBlockNodes();
+		getNodes(tmp_nodes);
 		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
 
 		u8 content_width = 2;
@@ -561,8 +1076,8 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		writeU8(os, content_width);
 		writeU8(os, params_width);
 		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
-				content_width, params_width, true);
-		delete[] tmp_nodes;
+				content_width, params_width, true, compression_level);
+		freeMapBlockNodes(tmp_nodes);
 	}
 	else
 	{
@@ -570,16 +1085,33 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		u8 params_width = 2;
 		writeU8(os, content_width);
 		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
-				content_width, params_width, true);
+		if(data != NULL){
+			MapNode::serializeBulk(os, version, data, nodecount,
+					content_width, params_width, true,
+					compression_level);
+		} else {
+			MapNode *tmp_nodes = allocMapBlockNodes();
+			getNodes(tmp_nodes);
+			MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
+					content_width, params_width, true,
+					compression_level);
+			freeMapBlockNodes(tmp_nodes);
+		}
 	}
 	
 	/*
 		Node metadata
 	*/
-	std::ostringstream oss(std::ios_base::binary);
-	m_node_metadata.serialize(oss);
-	compressZlib(oss.str(), os);
+	if(!m_node_metadata_raw.empty())
+	{
+		os<<m_node_metadata_raw;
+	}
+	else
+	{
+		std::ostringstream oss(std::ios_base::binary);
+		m_node_metadata.serialize(oss);
+		compressZlib(oss.str(), os, compression_level);
+	}
 
 	/*
 		Data that goes to disk, but not the network
@@ -607,13 +1139,9 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	}
 }
 
-void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
+static void serializeNetworkSpecificData(std::ostream &os,
+		u16 net_proto_version)
 {
-	if(data == NULL)
-	{
-		throw SerializationError("ERROR: Not writing dummy block.");
-	}
-
 	if(net_proto_version >= 21){
 		int version = 1;
 		writeU8(os, version);
@@ -622,6 +1150,81 @@ void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 	}
 }
 
+void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
+{
+	if(isDummy())
+	{
+		throw SerializationError("ERROR: Not writing dummy block.");
+	}
+
+	serializeNetworkSpecificData(os, net_proto_version);
+}
+
+u8 MapBlock::getSerializationFlags()
+{
+	u8 flags = 0;
+	if(is_underground)
+		flags |= 0x01;
+	if(getDayNightDiff())
+		flags |= 0x02;
+	if(m_lighting_expired)
+		flags |= 0x04;
+	if(m_generated == false)
+		flags |= 0x08;
+	return flags;
+}
+
+void MapBlock::makeNetworkSnapshot(MapBlockNetworkSnapshot *snapshot)
+{
+	if(isDummy())
+	{
+		throw SerializationError("ERROR: Not writing dummy block.");
+	}
+
+	snapshot->pos = getPos();
+	snapshot->flags = getSerializationFlags();
+	if(snapshot->nodes != NULL)
+		snapshot->nodes->drop();
+	snapshot->nodes = getNodeSnapshot();
+	if(!m_node_metadata_raw.empty())
+	{
+		snapshot->node_metadata = m_node_metadata_raw;
+		snapshot->node_metadata_compressed = true;
+	}
+	else
+	{
+		std::ostringstream oss(std::ios_base::binary);
+		m_node_metadata.serialize(oss);
+		snapshot->node_metadata = oss.str();
+		snapshot->node_metadata_compressed = false;
+	}
+	snapshot->serial = m_network_serialization_serial;
+}
+
+void MapBlockNetworkSnapshot::serialize(std::ostream &os, u8 version,
+		u16 net_proto_version, int compression_level)
+{
+	if(!ser_ver_supported(version) || version < 24)
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+
+	writeU8(os, flags);
+
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	MapNode::serializeBulk(os, version, nodes->getNodes(),
+			MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE,
+			content_width, params_width, true, compression_level);
+
+	if(node_metadata_compressed)
+		os<<node_metadata;
+	else
+		compressZlib(node_metadata, os, compression_level);
+
+	serializeNetworkSpecificData(os, net_proto_version);
+}
+
 void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 {
 	if(!ser_ver_supported(version))
@@ -630,10 +1233,19 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
 
 	m_day_night_differs_expired = false;
+	// Node contents are replaced wholesale
+	expireContentSummary();
+	unpack();
+	detachNodeSnapshot();
+	m_pack_serial_valid = false;
+	m_node_metadata_raw.clear();
 
 	if(version <= 21)
 	{
 		deSerialize_pre22(is, version, disk);
+		m_change_log.clear();
+		m_change_log_overflow = true;
+		pack();
 		return;
 	}
 
@@ -657,6 +1269,9 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		throw SerializationError("MapBlock::deSerialize(): invalid params_width");
 	MapNode::deSerializeBulk(is, version, data, nodecount,
 			content_width, params_width, true);
+	// Nothing tells what clients have of the nodes that were replaced
+	m_change_log.clear();
+	m_change_log_overflow = true;
 
 	/*
 		NodeMetadata
@@ -665,15 +1280,30 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 			<<": Node metadata"<<std::endl);
 	// Ignore errors
 	try{
+		std::streampos start = is.tellg();
 		std::ostringstream oss(std::ios_base::binary);
 		decompressZlib(is, oss);
-		std::istringstream iss(oss.str(), std::ios_base::binary);
-		if(version >= 23)
-			m_node_metadata.deSerialize(iss, m_gamedef);
+		std::streampos end = is.tellg();
+		std::string s = oss.str();
+		if(version >= 23 && s.size() > 1 && start != (std::streampos)-1
+				&& end != (std::streampos)-1)
+		{
+			// Keep it compressed until it is used; see getNodeMetadata()
+			m_node_metadata.clear();
+			m_node_metadata_raw.resize(end - start);
+			is.seekg(start);
+			is.read(&m_node_metadata_raw[0], m_node_metadata_raw.size());
+		}
 		else
-			content_nodemeta_deserialize_legacy(iss,
-					&m_node_metadata, &m_node_timers,
-					m_gamedef);
+		{
+			std::istringstream iss(s, std::ios_base::binary);
+			if(version >= 23)
+				m_node_metadata.deSerialize(iss, m_gamedef);
+			else
+				content_nodemeta_deserialize_legacy(iss,
+						&m_node_metadata, &m_node_timers,
+						m_gamedef);
+		}
 	}
 	catch(SerializationError &e)
 	{
@@ -723,6 +1353,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		}
 	}
 		
+	pack();
+
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 			<<": Done."<<std::endl);
 }
@@ -980,6 +1612,16 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 
 }
 
+u64 getNetworkSerializationToken(const std::string &data)
+{
+	SHA1 sha1;
+	sha1.addBytes(data.c_str(), data.size());
+	unsigned char *digest = sha1.getDigest();
+	u64 token = readU64(digest);
+	free(digest);
+	return token;
+}
+
 /*
 	Get a quick string to describe what a block actually contains
 */
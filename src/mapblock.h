@@ -21,6 +21,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MAPBLOCK_HEADER
 
 #include <set>
+#include <map>
+#include <vector>
+#include <algorithm>
 #include "debug.h"
 #include "irr_v3d.h"
 #include "mapnode.h"
@@ -30,6 +33,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodemetadata.h"
 #include "nodetimer.h"
 #include "modifiedstate.h"
+#include "jthread/jmutex.h"
+#include "jthread/jmutexautolock.h"
 #include "util/numeric.h" // getContainerPos
 
 class Map;
@@ -37,9 +42,134 @@ class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
 class VoxelManipulator;
+class VoxelArea;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
+// Blocks with more different contents than this don't keep a summary
+#define MAPBLOCK_CONTENT_SUMMARY_MAX 64
+// Changed nodes tracked before a block has to be sent as a whole
+#define MAPBLOCK_CHANGE_LOG_MAX 128
+// Blocks with more different nodes than this are not packed
+#define MAPBLOCK_PALETTE_MAX 256
+// Writes to a packed block before it is unpacked for good
+#define MAPBLOCK_PACKED_WRITES_MAX 64
+// Free node arrays and MapBlock objects kept for reuse
+#define MAPBLOCK_POOL_MAX 1024
+
+/*
+	Node arrays of blocks, and MapBlock objects, are taken from pools that
+	keep the freed ones for the next blocks instead of giving them back to
+	the heap, so that loading and unloading blocks all the time doesn't
+	fragment the heap.  Thread-safe.
+*/
+struct MapBlockPoolStats
+{
+	// Node arrays and blocks in use
+	u32 nodes_used;
+	u32 blocks_used;
+	// Freed ones waiting in the pools
+	u32 nodes_free;
+	u32 blocks_free;
+	// Allocations served from the pools and from the heap
+	u64 reused;
+	u64 allocated;
+};
+
+// Array of MAP_BLOCKSIZE^3 nodes, not initialized
+MapNode *allocMapBlockNodes();
+void freeMapBlockNodes(MapNode *nodes);
+void getMapBlockPoolStats(MapBlockPoolStats &stats);
+
+/*
+	Read-only nodes of a block at one point in time, for threads that
+	work on them without holding the environment lock.  Reference counted
+	with grab() and drop(), which are thread-safe; the other methods can
+	be called by whoever holds a reference.
+
+	MapBlock::getNodeSnapshot() shares the node array of the block with
+	the snapshot instead of copying it, and the block copies the nodes
+	only when it is next written while the snapshot is still in use.
+*/
+class MapBlockNodeSnapshot
+{
+public:
+	// Takes nodes, from allocMapBlockNodes(); the reference count is 1
+	MapBlockNodeSnapshot(v3s16 pos, MapNode *nodes);
+
+	void grab()
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_refcount++;
+	}
+	void drop();
+
+	v3s16 getPos() const
+	{
+		return m_pos;
+	}
+	// MAP_BLOCKSIZE^3 nodes in the same order as in MapBlock
+	const MapNode *getNodes() const
+	{
+		return m_nodes;
+	}
+	MapNode getNodeNoCheck(s16 x, s16 y, s16 z) const
+	{
+		return m_nodes[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+	}
+
+private:
+	friend class MapBlock;
+	~MapBlockNodeSnapshot();
+
+	// Gives the nodes back to the block if nobody else has a reference;
+	// the snapshot is then dropped without freeing them
+	bool takeNodes();
+
+	v3s16 m_pos;
+	MapNode *m_nodes;
+	u32 m_refcount;
+	JMutex m_mutex;
+};
+
+/*
+	Copy of the parts of a MapBlock that are sent to clients. Made while
+	holding the environment lock so that the expensive compression can be
+	done without it. serial is MapBlock::getNetworkSerializationSerial()
+	at the time of copying.
+*/
+struct MapBlockNetworkSnapshot
+{
+	v3s16 pos;
+	u8 flags;
+	// Dropped by the destructor
+	MapBlockNodeSnapshot *nodes;
+	// Uncompressed, or compressed if node_metadata_compressed
+	std::string node_metadata;
+	bool node_metadata_compressed;
+	u32 serial;
+
+	// Same output as MapBlock::serialize(os, version, false) followed by
+	// MapBlock::serializeNetworkSpecific(os, net_proto_version)
+	void serialize(std::ostream &os, u8 version, u16 net_proto_version,
+			int compression_level = -1);
+
+	MapBlockNetworkSnapshot():
+		nodes(NULL)
+	{
+	}
+	~MapBlockNetworkSnapshot()
+	{
+		if(nodes != NULL)
+			nodes->drop();
+	}
+
+private:
+	// Not copyable
+	MapBlockNetworkSnapshot(const MapBlockNetworkSnapshot &);
+	MapBlockNetworkSnapshot &operator=(const MapBlockNetworkSnapshot &);
+};
+
 /*// Named by looking towards z+
 enum{
 	FACE_BACK=0,
@@ -106,6 +236,10 @@ class MapBlock /*: public NodeContainer*/
 public:
 	MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy=false);
 	~MapBlock();
+
+	// See MapBlockPoolStats
+	static void *operator new(size_t size);
+	static void operator delete(void *p);
 	
 	/*virtual u16 nodeContainerId() const
 	{
@@ -119,14 +253,17 @@ class MapBlock /*: public NodeContainer*/
 
 	void reallocate()
 	{
+		dropNodeSnapshot();
 		if(data != NULL)
-			delete[] data;
+			freeMapBlockNodes(data);
+		clearPacked();
 		u32 l = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
-		data = new MapNode[l];
+		data = allocMapBlockNodes();
 		for(u32 i=0; i<l; i++){
 			//data[i] = MapNode();
 			data[i] = MapNode(CONTENT_IGNORE);
 		}
+		expireContentSummary();
 		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
 	}
 
@@ -136,7 +273,7 @@ class MapBlock /*: public NodeContainer*/
 
 	bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && m_palette.empty());
 	}
 	void unDummify()
 	{
@@ -147,6 +284,8 @@ class MapBlock /*: public NodeContainer*/
 	// m_modified methods
 	void raiseModified(u32 mod, const std::string &reason="unknown")
 	{
+		expireNetworkSerialization();
+		m_modified_serial++;
 		if(mod > m_modified){
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -174,6 +313,12 @@ class MapBlock /*: public NodeContainer*/
 	{
 		return m_modified_reason;
 	}
+	// Changes on every raiseModified(); used for telling whether the block
+	// has been modified after it was queued for saving
+	u32 getModifiedSerial()
+	{
+		return m_modified_serial;
+	}
 	void resetModified()
 	{
 		m_modified = MOD_STATE_CLEAN;
@@ -220,7 +365,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -253,7 +398,7 @@ class MapBlock /*: public NodeContainer*/
 	
 	bool isValidPosition(s16 x, s16 y, s16 z)
 	{
-		return data != NULL
+		return !isDummy()
 				&& x >= 0 && x < MAP_BLOCKSIZE
 				&& y >= 0 && y < MAP_BLOCKSIZE
 				&& z >= 0 && z < MAP_BLOCKSIZE;
@@ -271,7 +416,7 @@ class MapBlock /*: public NodeContainer*/
 		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
 
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return getNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 	
 	MapNode getNode(v3s16 p, bool *valid_position)
@@ -288,12 +433,14 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		setNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
+		noteContent(n.getContent());
+		logNodeChange(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -308,11 +455,11 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNodeNoCheck(s16 x, s16 y, s16 z, bool *valid_position)
 	{
-		*valid_position = data != NULL;
-		if(!valid_position)
+		*valid_position = !isDummy();
+		if(!*valid_position)
 			return MapNode(CONTENT_IGNORE);
 
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return getNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 	
 	MapNode getNodeNoCheck(v3s16 p, bool *valid_position)
@@ -322,9 +469,11 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		setNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
+		noteContent(n.getContent());
+		logNodeChange(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -353,8 +502,28 @@ class MapBlock /*: public NodeContainer*/
 	bool propagateSunlight(std::set<v3s16> & light_sources,
 			bool remove_light=false, bool *black_air_left=NULL);
 	
+	/*
+		Packs the nodes to a smaller representation if there are few
+		different ones; see data.  Does nothing if the block was not
+		changed since it was packed or last found unpackable.
+	*/
+	void pack();
+	bool isPacked()
+	{
+		return data == NULL && !m_palette.empty();
+	}
+	// Bytes taken by the nodes
+	u32 getNodeMemoryUsage();
+	// Estimates of the bytes taken by the node metadata and timers, by
+	// the static objects and by the cached network serializations
+	u32 getMetadataMemoryUsage();
+	u32 getStaticObjectMemoryUsage();
+	u32 getCacheMemoryUsage();
+
 	// Copies data to VoxelManipulator to getPosRelative()
 	void copyTo(VoxelManipulator &dst);
+	// Copies the nodes of the block in area, in map node coordinates
+	void copyTo(VoxelManipulator &dst, const VoxelArea &area);
 	// Copies data from VoxelManipulator getPosRelative()
 	void copyFrom(VoxelManipulator &dst);
 
@@ -369,6 +538,12 @@ class MapBlock /*: public NodeContainer*/
 		when the value is actually needed.
 	*/
 	void expireDayNightDiff();
+	// For when the flag has been computed from the same data elsewhere
+	void setDayNightDiff(bool differs)
+	{
+		m_day_night_differs = differs;
+		m_day_night_differs_expired = false;
+	}
 
 	bool getDayNightDiff()
 	{
@@ -377,6 +552,43 @@ class MapBlock /*: public NodeContainer*/
 		return m_day_night_differs;
 	}
 
+	/*
+		Content presence summary: a sorted list of the content ids that
+		may occur in the block. Setting nodes only adds to it, so it can
+		contain contents that are no longer there, but never misses one.
+	*/
+	void actuallyUpdateContentSummary();
+	/*
+		Call this after changing many nodes at once; the summary is then
+		rebuilt when it is needed.
+	*/
+	void expireContentSummary()
+	{
+		m_content_summary_expired = true;
+	}
+	/*
+		Returns NULL if the block has too many different contents for a
+		summary to be kept; any content may be present then.
+	*/
+	const std::vector<content_t> *getContentSummary()
+	{
+		if(m_content_summary_expired)
+			actuallyUpdateContentSummary();
+		if(m_content_summary_overflow)
+			return NULL;
+		return &m_content_summary;
+	}
+	// Returns false only if none of contents can be in the block
+	bool mayContainAny(const std::set<content_t> &contents);
+
+	/*
+		Log of nodes changed since the log was last taken, used for
+		sending small changes to clients instead of the whole block.
+		Returns false if more nodes changed than the log can hold.
+		Either way the log is empty afterwards.
+	*/
+	bool takeNodeChangeLog(std::vector<u16> &indices);
+
 	/*
 		Miscellaneous stuff
 	*/
@@ -414,20 +626,11 @@ class MapBlock /*: public NodeContainer*/
 	}
 	
 	/*
-		See m_usage_timer
+		See m_usage_stamp
 	*/
-	void resetUsageTimer()
-	{
-		m_usage_timer = 0;
-	}
-	void incrementUsageTimer(float dtime)
-	{
-		m_usage_timer += dtime;
-	}
-	u32 getUsageTimer()
-	{
-		return m_usage_timer;
-	}
+	void resetUsageTimer();
+	// Seconds since the block was last accessed
+	float getUsageTimer();
 
 	/*
 		See m_refcount
@@ -471,7 +674,9 @@ class MapBlock /*: public NodeContainer*/
 	
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
-	void serialize(std::ostream &os, u8 version, bool disk);
+	// compression_level is the zlib level, -1 for the default of zlib
+	void serialize(std::ostream &os, u8 version, bool disk,
+			int compression_level = -1);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
 	void deSerialize(std::istream &is, u8 version, bool disk);
@@ -479,6 +684,49 @@ class MapBlock /*: public NodeContainer*/
 	void serializeNetworkSpecific(std::ostream &os, u16 net_proto_version);
 	void deSerializeNetworkSpecific(std::istream &is);
 
+	/*
+		Cache of the over-the-network serialization, shared by all clients
+		that use the same versions. Anything that changes the block drops it.
+	*/
+	// Returns NULL if nothing is cached for the versions
+	const std::string *getCachedNetworkSerialization(u8 version,
+			u16 net_proto_version)
+	{
+		std::map<u32, std::string>::const_iterator i =
+				m_network_serialization.find(
+				networkSerializationKey(version, net_proto_version));
+		if(i == m_network_serialization.end())
+			return NULL;
+		return &i->second;
+	}
+	void setCachedNetworkSerialization(u8 version, u16 net_proto_version,
+			const std::string &s)
+	{
+		m_network_serialization[
+				networkSerializationKey(version, net_proto_version)] = s;
+	}
+	void expireNetworkSerialization()
+	{
+		m_network_serialization_serial++;
+		if(!m_network_serialization.empty())
+			m_network_serialization.clear();
+	}
+	// Changes whenever the cache is expired
+	u32 getNetworkSerializationSerial()
+	{
+		return m_network_serialization_serial;
+	}
+
+	void makeNetworkSnapshot(MapBlockNetworkSnapshot *snapshot);
+
+	/*
+		The nodes as they are now, with a reference for the caller to
+		drop.  Until the block is written, every call returns the same
+		snapshot, which shares the node array of the block.  NULL for
+		dummy blocks.
+	*/
+	MapBlockNodeSnapshot *getNodeSnapshot();
+
 private:
 	/*
 		Private methods
@@ -486,17 +734,57 @@ class MapBlock /*: public NodeContainer*/
 
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
 
+	// The first byte of the serialization
+	u8 getSerializationFlags();
+
+	void logNodeChange(u16 i)
+	{
+		if(m_change_log_overflow)
+			return;
+		if(std::find(m_change_log.begin(), m_change_log.end(), i) !=
+				m_change_log.end())
+			return;
+		if(m_change_log.size() >= MAPBLOCK_CHANGE_LOG_MAX){
+			m_change_log_overflow = true;
+			m_change_log.clear();
+			return;
+		}
+		m_change_log.push_back(i);
+	}
+
+	static u32 networkSerializationKey(u8 version, u16 net_proto_version)
+	{
+		return ((u32)version << 16) | net_proto_version;
+	}
+
+	void noteContent(content_t c)
+	{
+		if(m_content_summary_expired || m_content_summary_overflow)
+			return;
+		std::vector<content_t>::iterator i = std::lower_bound(
+				m_content_summary.begin(), m_content_summary.end(), c);
+		if(i != m_content_summary.end() && *i == c)
+			return;
+		if(m_content_summary.size() >= MAPBLOCK_CONTENT_SUMMARY_MAX){
+			m_content_summary_overflow = true;
+			return;
+		}
+		m_content_summary.insert(i, c);
+	}
+
 	/*
 		Used only internally, because changes can't be tracked
 	*/
 
 	MapNode & getNodeRef(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
+		unpack();
+		detachNodeSnapshot();
 		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
 	}
 	MapNode & getNodeRef(v3s16 &p)
@@ -504,6 +792,57 @@ class MapBlock /*: public NodeContainer*/
 		return getNodeRef(p.X, p.Y, p.Z);
 	}
 
+	/*
+		Node access by index in any representation; the block must not
+		be a dummy
+	*/
+	MapNode getNodeAt(u32 i)
+	{
+		if(data != NULL)
+			return data[i];
+		if(m_indices == NULL)
+			return m_palette[0];
+		if(m_palette.size() <= 16)
+			return m_palette[(m_indices[i >> 1] >> ((i & 1) << 2)) & 0x0f];
+		return m_palette[m_indices[i]];
+	}
+	void setNodeAt(u32 i, const MapNode &n)
+	{
+		detachNodeSnapshot();
+		if(data == NULL)
+			setPackedNode(i, n);
+		else
+			data[i] = n;
+	}
+	void setPackedNode(u32 i, const MapNode &n);
+	// Copies all the nodes to dst, which has room for a whole block
+	void getNodes(MapNode *dst);
+
+	// Makes the nodes be in data, if they are packed
+	void unpack()
+	{
+		if(data == NULL && !m_palette.empty())
+			actuallyUnpack();
+	}
+	void actuallyUnpack();
+	void clearPacked();
+
+	// To be called before the nodes are written: the snapshot is let go
+	// and data copied if the snapshot shares it and is still in use
+	void detachNodeSnapshot()
+	{
+		if(m_node_snapshot != NULL)
+			actuallyDetachNodeSnapshot(true);
+	}
+	// The same, before data is freed; data is NULL afterwards if the
+	// snapshot kept it
+	void dropNodeSnapshot()
+	{
+		if(m_node_snapshot != NULL)
+			actuallyDetachNodeSnapshot(false);
+	}
+	void actuallyDetachNodeSnapshot(bool keep_data);
+
 public:
 	/*
 		Public member variables
@@ -513,15 +852,32 @@ class MapBlock /*: public NodeContainer*/
 	MapBlockMesh *mesh;
 #endif
 	
-	NodeMetadataList m_node_metadata;
 	NodeTimerList m_node_timers;
 	StaticObjectList m_static_objects;
 
+	/*
+		Node metadata of a loaded block is kept as it was read, until it
+		is used, so that blocks that are only sent or saved again don't
+		have to parse it
+	*/
+	NodeMetadataList & getNodeMetadata()
+	{
+		if(!m_node_metadata_raw.empty())
+			parseNodeMetadata();
+		return m_node_metadata;
+	}
+
 private:
+	void parseNodeMetadata();
+
 	/*
 		Private member variables
 	*/
 
+	NodeMetadataList m_node_metadata;
+	// Compressed serialized node metadata that is not parsed yet
+	std::string m_node_metadata_raw;
+
 	// NOTE: Lots of things rely on this being the Map
 	Map *m_parent;
 	// Position in blocks on parent
@@ -530,10 +886,29 @@ class MapBlock /*: public NodeContainer*/
 	IGameDef *m_gamedef;
 	
 	/*
-		If NULL, block is a dummy block.
+		The nodes, if they are not packed.
+
+		Packed blocks have data NULL and the different nodes in
+		m_palette.  If m_indices is NULL, every node is m_palette[0].
+		Otherwise m_indices has the index of each node in m_palette, in
+		4 bits if the palette has at most 16 nodes and in 8 bits if not.
+		Writes of nodes that are in the palette are done in place; the
+		block is unpacked on other writes, or when there have been
+		MAPBLOCK_PACKED_WRITES_MAX of them.
+
+		If data is NULL and m_palette is empty, block is a dummy block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode * data;
+	std::vector<MapNode> m_palette;
+	u8 *m_indices;
+	u16 m_packed_writes;
+	// m_modified_serial when pack() last ran
+	u32 m_pack_serial;
+	bool m_pack_serial_valid;
+	// Equal to the nodes while not NULL; holds a reference, and can share
+	// data.  Packing a shared data leaves the array to the snapshot.
+	MapBlockNodeSnapshot *m_node_snapshot;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -543,6 +918,7 @@ class MapBlock /*: public NodeContainer*/
 	u32 m_modified;
 	std::string m_modified_reason;
 	bool m_modified_reason_too_long;
+	u32 m_modified_serial;
 
 	/*
 		When propagating sunlight and the above block doesn't exist,
@@ -567,6 +943,20 @@ class MapBlock /*: public NodeContainer*/
 	bool m_day_night_differs;
 	bool m_day_night_differs_expired;
 
+	// Contents that may be present, see getContentSummary()
+	std::vector<content_t> m_content_summary;
+	bool m_content_summary_overflow;
+	bool m_content_summary_expired;
+
+	// Indices of changed nodes, see takeNodeChangeLog()
+	std::vector<u16> m_change_log;
+	bool m_change_log_overflow;
+
+	// Network serializations keyed by the versions, see
+	// getCachedNetworkSerialization()
+	std::map<u32, std::string> m_network_serialization;
+	u32 m_network_serialization_serial;
+
 	bool m_generated;
 	
 	/*
@@ -578,10 +968,17 @@ class MapBlock /*: public NodeContainer*/
 	u32 m_disk_timestamp;
 
 	/*
-		When the block is accessed, this is set to 0.
-		Map will unload the block when this reaches a timeout.
+		When the block is accessed, this is set to the usage clock of the
+		parent Map and the block is moved to the recently used end of the
+		parent's usage list, in which m_usage_prev and m_usage_next link
+		the blocks.  Map unloads blocks from the other end of the list
+		when they reach a timeout or when there are too many of them.
 	*/
-	float m_usage_timer;
+	double m_usage_stamp;
+	MapBlock *m_usage_prev;
+	MapBlock *m_usage_next;
+	bool m_usage_listed;
+	friend class Map;
 
 	/*
 		Reference count; currently used for determining if this block is in
@@ -624,5 +1021,11 @@ inline s16 getNodeBlockY(s16 y)
 */
 std::string analyze_block(MapBlock *block);
 
+/*
+	Token of a network serialization of a block, by which the server can
+	tell that the copy in the block cache of a client is the same
+*/
+u64 getNetworkSerializationToken(const std::string &data);
+
 #endif
 
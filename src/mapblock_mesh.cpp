@@ -31,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "shader.h"
 #include "settings.h"
 #include "util/directiontables.h"
+#include <algorithm>
 
 static void applyFacesShading(video::SColor& color, float factor)
 {
@@ -48,6 +49,9 @@ MeshMakeData::MeshMakeData(IGameDef *gamedef):
 	m_crack_pos_relative(-1337, -1337, -1337),
 	m_highlighted_pos_relative(-1337, -1337, -1337),
 	m_smooth_lighting(false),
+	m_lod(0),
+	m_use_atlas(false),
+	m_node_overlay(false),
 	m_show_hud(false),
 	m_highlight_mesh_color(255, 255, 255, 255),
 	m_gamedef(gamedef)
@@ -56,6 +60,8 @@ MeshMakeData::MeshMakeData(IGameDef *gamedef):
 void MeshMakeData::fill(MapBlock *block)
 {
 	m_blockpos = block->getPos();
+	m_smooth_lights.clear();
+	m_use_atlas = true;
 
 	v3s16 blockpos_nodes = m_blockpos*MAP_BLOCKSIZE;
 
@@ -63,10 +69,13 @@ void MeshMakeData::fill(MapBlock *block)
 		Copy data
 	*/
 
-	// Allocate this block + neighbors
+	/*
+		Allocate this block + the nodes next to it.  Nothing making the
+		mesh looks farther than one node out of the block.
+	*/
 	m_vmanip.clear();
-	VoxelArea voxel_area(blockpos_nodes - v3s16(1,1,1) * MAP_BLOCKSIZE,
-			blockpos_nodes + v3s16(1,1,1) * MAP_BLOCKSIZE*2-v3s16(1,1,1));
+	VoxelArea voxel_area(blockpos_nodes - v3s16(1,1,1),
+			blockpos_nodes + v3s16(1,1,1) * MAP_BLOCKSIZE);
 	m_vmanip.addArea(voxel_area);
 
 	{
@@ -81,8 +90,9 @@ void MeshMakeData::fill(MapBlock *block)
 		// 0ms
 
 		/*
-			Copy neighbors. This is lightning fast.
-			Copying only the borders would be *very* slow.
+			Copy the layer of the neighbors next to the block.  The
+			rows are copied directly from the block data, so this is
+			faster than copying the whole neighbors.
 		*/
 
 		// Get map
@@ -94,7 +104,7 @@ void MeshMakeData::fill(MapBlock *block)
 			v3s16 bp = m_blockpos + dir;
 			MapBlock *b = map->getBlockNoCreateNoEx(bp);
 			if(b)
-				b->copyTo(m_vmanip);
+				b->copyTo(m_vmanip, voxel_area);
 		}
 	}
 }
@@ -102,10 +112,12 @@ void MeshMakeData::fill(MapBlock *block)
 void MeshMakeData::fillSingleNode(MapNode *node)
 {
 	m_blockpos = v3s16(0,0,0);
+	m_smooth_lights.clear();
+	m_use_atlas = false;
 
 	v3s16 blockpos_nodes = v3s16(0,0,0);
-	VoxelArea area(blockpos_nodes-v3s16(1,1,1)*MAP_BLOCKSIZE,
-			blockpos_nodes+v3s16(1,1,1)*MAP_BLOCKSIZE*2-v3s16(1,1,1));
+	VoxelArea area(blockpos_nodes - v3s16(1,1,1),
+			blockpos_nodes + v3s16(1,1,1) * MAP_BLOCKSIZE);
 	s32 volume = area.getVolume();
 	s32 our_node_index = area.index(1,1,1);
 
@@ -130,6 +142,28 @@ void MeshMakeData::fillSingleNode(MapNode *node)
 	delete[] data;
 }
 
+void MeshMakeData::fillNode(Map *map, v3s16 p)
+{
+	m_blockpos = getNodeBlockPos(p);
+	m_smooth_lights.clear();
+	m_use_atlas = false;
+	m_node_overlay = true;
+
+	/*
+		The faces and the light of the node don't need anything farther
+		than the nodes next to it
+	*/
+	m_vmanip.clear();
+	m_vmanip.addArea(VoxelArea(p - v3s16(1,1,1), p + v3s16(1,1,1)));
+	for(s16 z = -1; z <= 1; z++)
+	for(s16 y = -1; y <= 1; y++)
+	for(s16 x = -1; x <= 1; x++)
+	{
+		v3s16 p1 = p + v3s16(x,y,z);
+		m_vmanip.setNode(p1, map->getNodeNoEx(p1));
+	}
+}
+
 void MeshMakeData::setCrack(int crack_level, v3s16 crack_pos)
 {
 	if(crack_level >= 0)
@@ -147,6 +181,11 @@ void MeshMakeData::setSmoothLighting(bool smooth_lighting)
 	m_smooth_lighting = smooth_lighting;
 }
 
+void MeshMakeData::setLod(u8 lod)
+{
+	m_lod = lod;
+}
+
 /*
 	Light and vertex color functions
 */
@@ -307,6 +346,9 @@ static u16 getSmoothLightCombined(v3s16 p, MeshMakeData *data)
 /*
 	Calculate smooth lighting at the given corner of p.
 	Both light banks.
+
+	The corners are shared by up to 8 nodes and the faces of them, so
+	those in the block are kept in data->m_smooth_lights.
 */
 u16 getSmoothLight(v3s16 p, v3s16 corner, MeshMakeData *data)
 {
@@ -317,7 +359,19 @@ u16 getSmoothLight(v3s16 p, v3s16 corner, MeshMakeData *data)
 	if(corner.Z == 1) p.Z += 1;
 	// else corner.Z == -1
 
-	return getSmoothLightCombined(p, data);
+	const s16 size = MAP_BLOCKSIZE + 1;
+	v3s16 rel = p - data->m_blockpos * MAP_BLOCKSIZE;
+	if(rel.X < 0 || rel.X >= size || rel.Y < 0 || rel.Y >= size
+			|| rel.Z < 0 || rel.Z >= size)
+		return getSmoothLightCombined(p, data);
+
+	std::vector<u32> &lights = data->m_smooth_lights;
+	if(lights.empty())
+		lights.resize(size * size * size, 0xffffffff);
+	u32 &light = lights[(rel.Z * size + rel.Y) * size + rel.X];
+	if(light == 0xffffffff)
+		light = getSmoothLightCombined(p, data);
+	return light;
 }
 
 /*
@@ -574,10 +628,14 @@ static void makeFastFace(TileSpec tile, u16 li0, u16 li1, u16 li2, u16 li3,
 		vertex_pos[i] += pos;
 	}
 
-	f32 abs_scale = 1.0;
-	if     (scale.X < 0.999 || scale.X > 1.001) abs_scale = scale.X;
-	else if(scale.Y < 0.999 || scale.Y > 1.001) abs_scale = scale.Y;
-	else if(scale.Z < 0.999 || scale.Z > 1.001) abs_scale = scale.Z;
+	/*
+		The texture is repeated over merged faces.  u goes from corner 1
+		to corner 0 and v from corner 2 to corner 1.
+	*/
+	v3s16 u_dir = vertex_dirs[0] - vertex_dirs[1];
+	v3s16 v_dir = vertex_dirs[1] - vertex_dirs[2];
+	f32 u_scale = u_dir.X != 0 ? scale.X : u_dir.Y != 0 ? scale.Y : scale.Z;
+	f32 v_scale = v_dir.X != 0 ? scale.X : v_dir.Y != 0 ? scale.Y : scale.Z;
 
 	v3f normal(dir.X, dir.Y, dir.Z);
 
@@ -585,16 +643,16 @@ static void makeFastFace(TileSpec tile, u16 li0, u16 li1, u16 li2, u16 li3,
 
 	face.vertices[0] = video::S3DVertex(vertex_pos[0], normal,
 			MapBlock_LightColor(alpha, li0, light_source),
-			core::vector2d<f32>(x0+w*abs_scale, y0+h));
+			core::vector2d<f32>(x0+w*u_scale, y0+h*v_scale));
 	face.vertices[1] = video::S3DVertex(vertex_pos[1], normal,
 			MapBlock_LightColor(alpha, li1, light_source),
-			core::vector2d<f32>(x0, y0+h));
+			core::vector2d<f32>(x0, y0+h*v_scale));
 	face.vertices[2] = video::S3DVertex(vertex_pos[2], normal,
 			MapBlock_LightColor(alpha, li2, light_source),
 			core::vector2d<f32>(x0, y0));
 	face.vertices[3] = video::S3DVertex(vertex_pos[3], normal,
 			MapBlock_LightColor(alpha, li3, light_source),
-			core::vector2d<f32>(x0+w*abs_scale, y0));
+			core::vector2d<f32>(x0+w*u_scale, y0));
 
 	face.tile = tile;
 	dest.push_back(face);
@@ -877,6 +935,7 @@ static void updateFastFaceRow(
 					&& next_lights[3] == lights[3]
 					&& next_tile == tile
 					&& tile.rotation == 0
+					&& !(tile.material_flags & MATERIAL_FLAG_IN_ATLAS)
 					&& next_light_source == light_source)
 			{
 				next_is_different = false;
@@ -960,6 +1019,174 @@ static void updateFastFaceRow(
 	}
 }
 
+/*
+	The faces of the cracked node of an overlay of MeshMakeData::fillNode(),
+	the same as updateAllFastFaceRows() makes for it in the block
+*/
+static void updateNodeOverlayFaces(MeshMakeData *data,
+		std::vector<FastFace> &dest)
+{
+	v3s16 p = data->m_crack_pos_relative;
+	if(p.X < 0 || p.X >= MAP_BLOCKSIZE ||
+			p.Y < 0 || p.Y >= MAP_BLOCKSIZE ||
+			p.Z < 0 || p.Z >= MAP_BLOCKSIZE)
+		return;
+
+	static const v3s16 face_dirs[3] = {
+		v3s16(1,0,0),
+		v3s16(0,1,0),
+		v3s16(0,0,1)
+	};
+	for(u16 i = 0; i < 6; i++)
+	{
+		// The rows go in the positive directions; the faces toward the
+		// negative ones come from the node before
+		v3s16 face_dir = face_dirs[i / 2];
+		v3s16 p0 = (i % 2 == 0) ? p : p - face_dir;
+
+		bool makes_face = false;
+		v3s16 p_corrected;
+		v3s16 face_dir_corrected;
+		u16 lights[4] = {0,0,0,0};
+		TileSpec tile;
+		u8 light_source = 0;
+		getTileInfo(data, p0, face_dir,
+				makes_face, p_corrected, face_dir_corrected,
+				lights, tile, light_source);
+		if(!makes_face || p_corrected != p)
+			continue;
+
+		makeFastFace(tile, lights[0], lights[1], lights[2], lights[3],
+				v3f(p.X, p.Y, p.Z), face_dir_corrected, v3f(1,1,1),
+				light_source, dest);
+	}
+}
+
+struct FastFaceInfo
+{
+	bool makes_face;
+	v3s16 p_corrected;
+	v3s16 face_dir_corrected;
+	u16 lights[4];
+	TileSpec tile;
+	u8 light_source;
+	bool merged;
+};
+
+/*
+	Whether face b, offset from face a, can be drawn as a part of it
+*/
+static bool canMergeFaces(const FastFaceInfo &a, const FastFaceInfo &b,
+		v3s16 offset)
+{
+	return (b.makes_face && !b.merged
+			&& b.p_corrected == a.p_corrected + offset
+			&& b.face_dir_corrected == a.face_dir_corrected
+			&& b.lights[0] == a.lights[0]
+			&& b.lights[1] == a.lights[1]
+			&& b.lights[2] == a.lights[2]
+			&& b.lights[3] == a.lights[3]
+			&& b.tile == a.tile
+			&& a.tile.rotation == 0
+			&& !(a.tile.material_flags & MATERIAL_FLAG_IN_ATLAS)
+			&& b.light_source == a.light_source);
+}
+
+/*
+	Makes the faces of a slice of the block, merging rectangles of faces
+	that look the same into one, widest first.
+
+	startpos: corner of the slice
+	u_dir, v_dir: the texture u and v directions of faces in face_dir;
+	              unit vectors with only one of x, y or z
+	faces: MAP_BLOCKSIZE * MAP_BLOCKSIZE places to work in
+*/
+static void updateFastFaceSlice(
+		MeshMakeData *data,
+		v3s16 startpos,
+		v3s16 u_dir,
+		v3s16 v_dir,
+		v3s16 face_dir,
+		std::vector<FastFaceInfo> &faces,
+		std::vector<FastFace> &dest)
+{
+	for(u16 v=0; v<MAP_BLOCKSIZE; v++)
+	for(u16 u=0; u<MAP_BLOCKSIZE; u++)
+	{
+		FastFaceInfo &f = faces[v * MAP_BLOCKSIZE + u];
+		f.merged = false;
+		getTileInfo(data, startpos + u_dir * u + v_dir * v, face_dir,
+				f.makes_face, f.p_corrected, f.face_dir_corrected,
+				f.lights, f.tile, f.light_source);
+	}
+
+	for(u16 v=0; v<MAP_BLOCKSIZE; v++)
+	for(u16 u=0; u<MAP_BLOCKSIZE; u++)
+	{
+		FastFaceInfo &f = faces[v * MAP_BLOCKSIZE + u];
+		if(!f.makes_face || f.merged)
+			continue;
+
+		u16 w = 1;
+		while(u + w < MAP_BLOCKSIZE && canMergeFaces(f,
+				faces[v * MAP_BLOCKSIZE + u + w], u_dir * w))
+			w++;
+
+		u16 h = 1;
+		for(; v + h < MAP_BLOCKSIZE; h++)
+		{
+			u16 i = 0;
+			while(i < w && canMergeFaces(f,
+					faces[(v + h) * MAP_BLOCKSIZE + u + i],
+					u_dir * i + v_dir * h))
+				i++;
+			if(i != w)
+				break;
+		}
+
+		for(u16 j=0; j<h; j++)
+		for(u16 i=0; i<w; i++)
+			faces[(v + j) * MAP_BLOCKSIZE + u + i].merged = true;
+
+		v3f u_dir_f(u_dir.X, u_dir.Y, u_dir.Z);
+		v3f v_dir_f(v_dir.X, v_dir.Y, v_dir.Z);
+		v3f pf(f.p_corrected.X, f.p_corrected.Y, f.p_corrected.Z);
+		// Center point of face
+		v3f sp = pf + u_dir_f * ((w - 1) / 2.0) + v_dir_f * ((h - 1) / 2.0);
+		v3f scale = v3f(1,1,1) + u_dir_f * (w - 1) + v_dir_f * (h - 1);
+
+		makeFastFace(f.tile, f.lights[0], f.lights[1], f.lights[2],
+				f.lights[3], sp, f.face_dir_corrected, scale,
+				f.light_source, dest);
+
+		g_profiler->avg("Meshgen: faces drawn by tiling", 0);
+		for(int i = 1; i < w * h; i++){
+			g_profiler->avg("Meshgen: faces drawn by tiling", 1);
+		}
+	}
+}
+
+static void updateAllFastFaceSlices(MeshMakeData *data,
+		std::vector<FastFace> &dest)
+{
+	std::vector<FastFaceInfo> faces(MAP_BLOCKSIZE * MAP_BLOCKSIZE);
+
+	for(s16 i = 0; i < MAP_BLOCKSIZE; i++) {
+		// top(y+) faces
+		updateFastFaceSlice(data, v3s16(0,i,0),
+				v3s16(1,0,0), v3s16(0,0,1), v3s16(0,1,0),
+				faces, dest);
+		// right(x+) faces
+		updateFastFaceSlice(data, v3s16(i,0,0),
+				v3s16(0,0,1), v3s16(0,1,0), v3s16(1,0,0),
+				faces, dest);
+		// back(z+) faces
+		updateFastFaceSlice(data, v3s16(0,0,i),
+				v3s16(1,0,0), v3s16(0,1,0), v3s16(0,0,1),
+				faces, dest);
+	}
+}
+
 static void updateAllFastFaceRows(MeshMakeData *data,
 		std::vector<FastFace> &dest)
 {
@@ -1009,6 +1236,221 @@ static void updateAllFastFaceRows(MeshMakeData *data,
 	}
 }
 
+/*
+	Low detail faces for far away blocks.  The block is looked at in
+	cells of MESH_LOD_CELL_SIZE^3 nodes, and the faces are made between
+	cells that are mostly filled and cells that aren't, with the highest
+	node of the cell giving the tile.  Nodes of the special draw types,
+	like plants, are left out.
+*/
+
+enum LodCellKind
+{
+	LOD_CELL_EMPTY = 0,
+	LOD_CELL_LIQUID = 1,
+	LOD_CELL_SOLID = 2,
+};
+
+static u8 getLodNodeKind(const ContentFeatures &f)
+{
+	switch(f.drawtype){
+	case NDT_NORMAL:
+	case NDT_ALLFACES:
+	case NDT_ALLFACES_OPTIONAL:
+		return LOD_CELL_SOLID;
+	case NDT_LIQUID:
+	case NDT_FLOWINGLIQUID:
+		return LOD_CELL_LIQUID;
+	default:
+		return LOD_CELL_EMPTY;
+	}
+}
+
+/*
+	cell: position in cells relative to the block.  It can be one cell out
+	      of the block, of which only the node layer next to the block is
+	      known; a cell with no known nodes is solid, making no faces.
+	top:  the highest node of the kind of the cell, relative to the block
+*/
+static u8 getLodCell(MeshMakeData *data, v3s16 cell, v3s16 &top)
+{
+	VoxelManipulator &vmanip = data->m_vmanip;
+	INodeDefManager *ndef = data->m_gamedef->ndef();
+	v3s16 p0 = data->m_blockpos * MAP_BLOCKSIZE + cell * MESH_LOD_CELL_SIZE;
+
+	u16 counts[3] = {0, 0, 0};
+	v3s16 tops[3];
+	u16 known = 0;
+	for(s16 y = MESH_LOD_CELL_SIZE - 1; y >= 0; y--)
+	for(s16 z = 0; z < MESH_LOD_CELL_SIZE; z++)
+	for(s16 x = 0; x < MESH_LOD_CELL_SIZE; x++)
+	{
+		v3s16 p = cell * MESH_LOD_CELL_SIZE + v3s16(x,y,z);
+		// Doesn't grow the area when out of it
+		MapNode n = vmanip.getNodeNoExNoEmerge(p0 + v3s16(x,y,z));
+		if(n.getContent() == CONTENT_IGNORE)
+			continue;
+		known++;
+		u8 kind = getLodNodeKind(ndef->get(n));
+		if(counts[kind] == 0)
+			tops[kind] = p;
+		counts[kind]++;
+	}
+
+	if(known == 0){
+		top = cell * MESH_LOD_CELL_SIZE;
+		return LOD_CELL_SOLID;
+	}
+	u8 kind = LOD_CELL_EMPTY;
+	if(counts[LOD_CELL_SOLID] * 2 >= known)
+		kind = LOD_CELL_SOLID;
+	else if((counts[LOD_CELL_SOLID] + counts[LOD_CELL_LIQUID]) * 2 >= known)
+		kind = counts[LOD_CELL_LIQUID] != 0 ? LOD_CELL_LIQUID : LOD_CELL_SOLID;
+	top = tops[kind];
+	return kind;
+}
+
+static void updateLodFaces(MeshMakeData *data, std::vector<FastFace> &dest)
+{
+	VoxelManipulator &vmanip = data->m_vmanip;
+	INodeDefManager *ndef = data->m_gamedef->ndef();
+	v3s16 blockpos_nodes = data->m_blockpos * MAP_BLOCKSIZE;
+
+	// The cells of the block and the ones next to it
+	const s16 cells = MAP_BLOCKSIZE / MESH_LOD_CELL_SIZE;
+	VoxelArea area(v3s16(-1,-1,-1), v3s16(1,1,1) * cells);
+	std::vector<u8> kinds(area.getVolume());
+	std::vector<v3s16> tops(area.getVolume());
+	for(s16 z = -1; z <= cells; z++)
+	for(s16 y = -1; y <= cells; y++)
+	for(s16 x = -1; x <= cells; x++)
+	{
+		s32 i = area.index(x,y,z);
+		kinds[i] = getLodCell(data, v3s16(x,y,z), tops[i]);
+	}
+
+	for(s16 z = 0; z < cells; z++)
+	for(s16 y = 0; y < cells; y++)
+	for(s16 x = 0; x < cells; x++)
+	{
+		v3s16 cell(x,y,z);
+		s32 i = area.index(cell);
+		u8 kind = kinds[i];
+		if(kind == LOD_CELL_EMPTY)
+			continue;
+		v3s16 p = tops[i];
+		MapNode n = vmanip.getNodeNoExNoEmerge(blockpos_nodes + p);
+		// A cell without known nodes
+		if(n.getContent() == CONTENT_IGNORE)
+			continue;
+		const ContentFeatures &f = ndef->get(n);
+
+		for(u16 j = 0; j < 6; j++)
+		{
+			const v3s16 &dir = g_6dirs[j];
+			// Solid cells hide everything, liquid cells hide liquid
+			if(kinds[area.index(cell + dir)] >= kind)
+				continue;
+
+			// The light is that of the node next to the cell, in line
+			// with the top node
+			v3s16 p2 = p;
+			if(dir.X != 0)
+				p2.X = (x + (dir.X > 0)) * MESH_LOD_CELL_SIZE - (dir.X < 0);
+			if(dir.Y != 0)
+				p2.Y = (y + (dir.Y > 0)) * MESH_LOD_CELL_SIZE - (dir.Y < 0);
+			if(dir.Z != 0)
+				p2.Z = (z + (dir.Z > 0)) * MESH_LOD_CELL_SIZE - (dir.Z < 0);
+			MapNode n2 = vmanip.getNodeNoExNoEmerge(blockpos_nodes + p2);
+			u16 light = getFaceLight(n, n2, dir, ndef);
+
+			TileSpec tile = getNodeTile(n, p, dir, data);
+
+			// The center of the cell
+			v3f pf = intToFloat(cell * MESH_LOD_CELL_SIZE, 1)
+					+ v3f(1,1,1) * (MESH_LOD_CELL_SIZE - 1) / 2.0;
+			v3f scale = v3f(1,1,1) * MESH_LOD_CELL_SIZE;
+
+			makeFastFace(tile, light, light, light, light, pf, dir, scale,
+					f.light_source, dest);
+		}
+	}
+}
+
+/*
+	Moves the buffers of tiles that are in texture atlases to them, and
+	puts those with the same atlas and material together. A buffer stays
+	as it is if any texture coordinate of it is out of 0..1, as the atlas
+	can't repeat the texture.
+*/
+static void moveTilesToAtlases(MeshCollector &collector, ITextureSource *tsrc)
+{
+	const f32 d = 0.001;
+	std::vector<PreMeshBuffer> prebuffers;
+	for(u32 i = 0; i < collector.prebuffers.size(); i++)
+	{
+		PreMeshBuffer &p = collector.prebuffers[i];
+
+		core::rect<f32> rect;
+		video::ITexture *atlas = NULL;
+		if(p.tile.normal_texture == NULL && !(p.tile.material_flags &
+				(MATERIAL_FLAG_CRACK | MATERIAL_FLAG_HIGHLIGHTED |
+				MATERIAL_FLAG_ANIMATION_VERTICAL_FRAMES)))
+			atlas = tsrc->getAtlasTexture(p.tile.texture_id, rect);
+		for(u32 j = 0; atlas != NULL && j < p.vertices.size(); j++)
+		{
+			const v2f &tc = p.vertices[j].TCoords;
+			if(tc.X < -d || tc.X > 1 + d || tc.Y < -d || tc.Y > 1 + d)
+				atlas = NULL;
+		}
+		if(atlas == NULL)
+		{
+			prebuffers.push_back(PreMeshBuffer());
+			prebuffers.back().tile = p.tile;
+			prebuffers.back().indices.swap(p.indices);
+			prebuffers.back().vertices.swap(p.vertices);
+			continue;
+		}
+
+		for(u32 j = 0; j < p.vertices.size(); j++)
+		{
+			v2f &tc = p.vertices[j].TCoords;
+			tc.X = rect.UpperLeftCorner.X + tc.X * rect.getWidth();
+			tc.Y = rect.UpperLeftCorner.Y + tc.Y * rect.getHeight();
+		}
+		// The texture coordinates have the rotation now
+		p.tile.texture = atlas;
+		p.tile.texture_id = 0;
+		p.tile.rotation = 0;
+
+		PreMeshBuffer *to = NULL;
+		for(u32 j = 0; j < prebuffers.size(); j++)
+		{
+			PreMeshBuffer &pp = prebuffers[j];
+			if(pp.tile.texture == atlas && pp.tile == p.tile
+					&& pp.tile.shader_id == p.tile.shader_id
+					&& pp.vertices.size() + p.vertices.size() <= 65535)
+			{
+				to = &pp;
+				break;
+			}
+		}
+		if(to == NULL)
+		{
+			prebuffers.push_back(PreMeshBuffer());
+			to = &prebuffers.back();
+			to->tile = p.tile;
+		}
+
+		u32 vertex_count = to->vertices.size();
+		for(u32 j = 0; j < p.indices.size(); j++)
+			to->indices.push_back(p.indices[j] + vertex_count);
+		to->vertices.insert(to->vertices.end(),
+				p.vertices.begin(), p.vertices.end());
+	}
+	collector.prebuffers.swap(prebuffers);
+}
+
 /*
 	MapBlockMesh
 */
@@ -1016,6 +1458,8 @@ static void updateAllFastFaceRows(MeshMakeData *data,
 MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 	m_mesh(new scene::SMesh()),
 	m_gamedef(data->m_gamedef),
+	m_lod(data->m_lod),
+	m_memory_usage(0),
 	m_animation_force_timer(0), // force initial animation
 	m_last_crack(-1),
 	m_crack_materials(),
@@ -1042,7 +1486,14 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 	{
 		// 4-23ms for MAP_BLOCKSIZE=16  (NOTE: probably outdated)
 		//TimeTaker timer2("updateAllFastFaceRows()");
-		updateAllFastFaceRows(data, fastfaces_new);
+		if(data->m_node_overlay)
+			updateNodeOverlayFaces(data, fastfaces_new);
+		else if(m_lod != 0)
+			updateLodFaces(data, fastfaces_new);
+		else if(g_settings->getBool("merge_faces"))
+			updateAllFastFaceSlices(data, fastfaces_new);
+		else
+			updateAllFastFaceRows(data, fastfaces_new);
 	}
 	// End of slow part
 
@@ -1090,15 +1541,24 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 		- whatever
 	*/
 
-	mapblock_mesh_generate_special(data, collector);
+	if(m_lod == 0)
+		mapblock_mesh_generate_special(data, collector);
 
 	m_highlight_mesh_color = data->m_highlight_mesh_color;
 
+	ITextureSource *tsrc = m_gamedef->tsrc();
+	IShaderSource *shdrsrc = m_gamedef->getShaderSource();
+
+	if(data->m_use_atlas)
+		moveTilesToAtlases(collector, tsrc);
+
+	// The shaders can pick the frames from the whole texture themselves
+	bool shader_animation = m_enable_shaders &&
+			g_settings->getBool("shader_texture_animation");
+
 	/*
 		Convert MeshCollector to SMesh
 	*/
-	ITextureSource *tsrc = m_gamedef->tsrc();
-	IShaderSource *shdrsrc = m_gamedef->getShaderSource();
 
 	for(u32 i = 0; i < collector.prebuffers.size(); i++)
 	{
@@ -1121,28 +1581,48 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 					&p.tile.texture_id);
 		}
 		// - Texture animation
+		bool shader_animated = false;
+		int frame_offset = 0;
 		if(p.tile.material_flags & MATERIAL_FLAG_ANIMATION_VERTICAL_FRAMES)
 		{
-			// Add to MapBlockMesh in order to animate these tiles
-			m_animation_tiles[i] = p.tile;
-			m_animation_frames[i] = 0;
 			if(g_settings->getBool("desynchronize_mapblock_texture_animation")){
 				// Get starting position from noise
-				m_animation_frame_offsets[i] = 100000 * (2.0 + noise3d(
+				frame_offset = 100000 * (2.0 + noise3d(
 						data->m_blockpos.X, data->m_blockpos.Y,
 						data->m_blockpos.Z, 0));
 			} else {
 				// Play all synchronized
-				m_animation_frame_offsets[i] = 0;
+				frame_offset = 0;
+			}
+			// animationTimer wraps every 100 s, so only animations whose
+			// period divides that stay in step when it wraps
+			u32 period_ms = p.tile.animation_frame_count *
+					p.tile.animation_frame_length_ms;
+			if(shader_animation && period_ms > 0 && 100000 % period_ms == 0)
+			{
+				// The tile keeps the texture with all the frames
+				shader_animated = true;
+			}
+			else
+			{
+				// Add to MapBlockMesh in order to animate these tiles
+				m_animation_tiles[i] = p.tile;
+				m_animation_frames[i] = 0;
+				m_animation_frame_offsets[i] = frame_offset;
+				// Replace tile texture with the first animation frame
+				FrameSpec animation_frame = p.tile.frames.find(0)->second;
+				p.tile.texture = animation_frame.texture;
 			}
-			// Replace tile texture with the first animation frame
-			FrameSpec animation_frame = p.tile.frames.find(0)->second;
-			p.tile.texture = animation_frame.texture;
 		}
 
 		if(m_enable_highlighting && p.tile.material_flags & MATERIAL_FLAG_HIGHLIGHTED)
 			m_highlighted_materials.push_back(i);	
 
+		// The shaders blend day and night light themselves; the highlight
+		// material isn't drawn with them
+		bool shader_daynight = m_enable_shaders &&
+				!(p.tile.material_flags & MATERIAL_FLAG_HIGHLIGHTED);
+
 		for(u32 j = 0; j < p.vertices.size(); j++)
 		{
 			// Note applyFacesShading second parameter is precalculated sqrt
@@ -1162,6 +1642,8 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 					applyFacesShading (vc, 0.836660);
 				}
 			}
+			if(shader_daynight)
+				continue;
 			// - Classic lighting
 			// Set initial real color and store for later updates
 			u8 day = vc.getRed();
@@ -1183,6 +1665,7 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 		} else {
 			if (m_enable_shaders) {
 				material.MaterialType = shdrsrc->getShaderInfo(p.tile.shader_id).material;
+				material.MaterialTypeParam2 = SHADER_BLEND_DAYNIGHT;
 				p.tile.applyMaterialOptionsWithShaders(material);
 				if (p.tile.normal_texture) {
 					material.setTexture(1, p.tile.normal_texture);
@@ -1195,6 +1678,28 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 			}
 		}
 
+		/*
+			The third column of the texture matrix, which the texture
+			coordinates don't use, has the frame count, the length of a
+			frame in ms and the frame to start from for the shaders
+		*/
+		if(shader_animated)
+		{
+			core::matrix4 &m = material.getTextureMatrix(0);
+			m[8] = p.tile.animation_frame_count;
+			m[9] = p.tile.animation_frame_length_ms;
+			m[10] = frame_offset % p.tile.animation_frame_count;
+		}
+
+		// The crack of an overlay is drawn over the same faces of the
+		// block mesh, which may be merged with others
+		if(data->m_node_overlay &&
+				(p.tile.material_flags & MATERIAL_FLAG_CRACK))
+		{
+			material.PolygonOffsetFactor = 1;
+			material.PolygonOffsetDirection = video::EPO_FRONT;
+		}
+
 		// Create meshbuffer
 		// This is a "Standard MeshBuffer",
 		// it's a typedeffed CMeshBuffer<video::S3DVertex>
@@ -1226,15 +1731,24 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 				<<" materials (meshbuffers)"<<std::endl;
 #endif
 
-		// Use VBO for mesh (this just would set this for ever buffer)
-		// This will lead to infinite memory usage because or irrlicht.
-		//m_mesh->setHardwareMappingHint(scene::EHM_STATIC);
-
 		/*
-			NOTE: If that is enabled, some kind of a queue to the main
-			thread should be made which would call irrlicht to delete
-			the hardware buffer and then delete the mesh
+			Upload the buffers once and keep them on the GPU. The driver
+			keeps a hardware buffer for every mesh buffer it has drawn
+			until it is told otherwise, so the destructor removes them;
+			meshes are only deleted in the main thread once they have
+			been drawn.
 		*/
+		if(g_settings->getBool("enable_vbo"))
+			m_mesh->setHardwareMappingHint(scene::EHM_STATIC);
+
+		for(u32 i = 0; i < m_mesh->getMeshBufferCount(); i++)
+		{
+			scene::IMeshBuffer *buf = m_mesh->getMeshBuffer(i);
+			m_memory_usage += buf->getVertexCount()
+					* video::getVertexPitchFromType(buf->getVertexType());
+			m_memory_usage += buf->getIndexCount()
+					* (buf->getIndexType() == video::EIT_16BIT ? 2 : 4);
+		}
 	}
 
 	//std::cout<<"added "<<fastfaces.getSize()<<" faces."<<std::endl;
@@ -1249,10 +1763,25 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 
 MapBlockMesh::~MapBlockMesh()
 {
+	if(m_mesh->getMeshBufferCount() != 0){
+		video::IVideoDriver *driver =
+				m_gamedef->getSceneManager()->getVideoDriver();
+		for(u32 i = 0; i < m_mesh->getMeshBufferCount(); i++)
+			driver->removeHardwareBuffer(m_mesh->getMeshBuffer(i));
+	}
 	m_mesh->drop();
 	m_mesh = NULL;
 }
 
+bool MapBlockMesh::isStaticBuffer(u32 i) const
+{
+	return m_crack_materials.find(i) == m_crack_materials.end()
+		&& m_animation_tiles.find(i) == m_animation_tiles.end()
+		&& m_daynight_diffs.find(i) == m_daynight_diffs.end()
+		&& std::find(m_highlighted_materials.begin(),
+			m_highlighted_materials.end(), i) == m_highlighted_materials.end();
+}
+
 bool MapBlockMesh::animate(bool faraway, float time, int crack, u32 daynight_ratio)
 {
 
@@ -1349,6 +1878,7 @@ bool MapBlockMesh::animate(bool faraway, float time, int crack, u32 daynight_rat
 				finalColorBlend(vertices[vertexIndex].Color,
 						day, night, daynight_ratio);
 			}
+			buf->setDirty(scene::EBT_VERTEX);
 		}
 		m_last_daynight_ratio = daynight_ratio;
 	}
@@ -1374,6 +1904,7 @@ bool MapBlockMesh::animate(bool faraway, float time, int crack, u32 daynight_rat
 			video::S3DVertex *vertices = (video::S3DVertex*)buf->getVertices();
 			for (u32 j = 0; j < buf->getVertexCount() ;j++)
 				vertices[j].Color = hc;
+			buf->setDirty(scene::EBT_VERTEX);
 		}
 	}
 
@@ -1384,6 +1915,7 @@ void MapBlockMesh::updateCameraOffset(v3s16 camera_offset)
 {
 	if (camera_offset != m_camera_offset) {
 		translateMesh(m_mesh, intToFloat(m_camera_offset-camera_offset, BS));
+		m_mesh->setDirty(scene::EBT_VERTEX);
 		m_camera_offset = camera_offset;
 	}
 }
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "tile.h"
 #include "voxel.h"
 #include <map>
+#include <vector>
 
 class IGameDef;
 
@@ -33,6 +34,10 @@ class IGameDef;
 
 
 class MapBlock;
+class Map;
+
+// Size in nodes of the cells that low detail meshes are made of
+#define MESH_LOD_CELL_SIZE 2
 
 struct MeshMakeData
 {
@@ -41,9 +46,26 @@ struct MeshMakeData
 	v3s16 m_crack_pos_relative;
 	v3s16 m_highlighted_pos_relative;
 	bool m_smooth_lighting;
+	// 0: full detail, 1: low detail, for far away
+	u8 m_lod;
+	// Draw the tiles that are in texture atlases from them. Set by
+	// fill(); the item meshes of fillSingleNode() change the textures of
+	// their materials themselves.
+	bool m_use_atlas;
+	// Made by fillNode(): only the crack and the highlight of one node are
+	// made, to be drawn over the mesh of its block
+	bool m_node_overlay;
 	bool m_show_hud;
 	video::SColor m_highlight_mesh_color;
 
+	/*
+		Smooth light at the XYZ- corners of the nodes of the block and of
+		the next nodes in X+, Y+ and Z+, index (z*17 + y)*17 + x relative
+		to the block.  Made by getSmoothLight() when it is first needed;
+		0xffffffff is not made yet.
+	*/
+	std::vector<u32> m_smooth_lights;
+
 	IGameDef *m_gamedef;
 
 	MeshMakeData(IGameDef *gamedef);
@@ -59,6 +81,14 @@ struct MeshMakeData
 	*/
 	void fillSingleNode(MapNode *node);
 
+	/*
+		Copy the node at p of the map and the nodes around it, for the
+		overlay of the crack or the highlight of the node.  The crack or
+		the highlight is set with setCrack() or setHighlighted() as for a
+		block.
+	*/
+	void fillNode(Map *map, v3s16 p);
+
 	/*
 		Set the (node) position of a crack
 	*/
@@ -73,6 +103,11 @@ struct MeshMakeData
 		Enable or disable smooth lighting
 	*/
 	void setSmoothLighting(bool smooth_lighting);
+
+	/*
+		Set the level of detail
+	*/
+	void setLod(u8 lod);
 };
 
 /*
@@ -119,9 +154,28 @@ class MapBlockMesh
 	
 	void updateCameraOffset(v3s16 camera_offset);
 
+	// Whether animate() leaves the mesh buffer as it is, so that it can be
+	// drawn from a copy
+	bool isStaticBuffer(u32 i) const;
+
+	// The level of detail the mesh was made with
+	u8 getLod() const
+	{
+		return m_lod;
+	}
+
+	// Bytes taken by the vertices and indices; the driver keeps a copy
+	// of them on the GPU
+	u32 getMemoryUsage() const
+	{
+		return m_memory_usage;
+	}
+
 private:
 	scene::SMesh *m_mesh;
 	IGameDef *m_gamedef;
+	u8 m_lod;
+	u32 m_memory_usage;
 
 	bool m_enable_shaders;
 	bool m_enable_highlighting;
@@ -34,6 +34,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "treegen.h"
 #include "serialization.h"
 #include "util/serialize.h"
+#include "util/directiontables.h"
 #include "filesys.h"
 #include "log.h"
 
@@ -142,6 +143,7 @@ void Mapgen::updateHeightmap(v3s16 nmin, v3s16 nmax) {
 
 
 void Mapgen::updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nmax) {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen liquids", SPT_AVG);
 	bool isliquid, wasliquid;
 	v3s16 em  = vm->m_area.getExtent();
 
@@ -179,26 +181,47 @@ void Mapgen::setLighting(v3s16 nmin, v3s16 nmax, u8 light) {
 }
 
 
-void Mapgen::lightSpread(VoxelArea &a, v3s16 p, u8 light) {
+void Mapgen::lightSpread(VoxelArea &a, v3s16 p, u8 light,
+	std::vector<v3s16> &queue)
+{
 	if (light <= 1 || !a.contains(p))
 		return;
 
 	u32 vi = vm->m_area.index(p);
-	MapNode &nn = vm->m_data[vi];
+	MapNode &n = vm->m_data[vi];
 
 	light--;
 	// should probably compare masked, but doesn't seem to make a difference
-	if (light <= nn.param1 || !ndef->get(nn).light_propagates)
+	if (light <= n.param1 || !ndef->get(n).light_propagates)
 		return;
 
-	nn.param1 = light;
+	n.param1 = light;
+
+	// Breadth first, on a queue instead of the stack.  Every node of the
+	// queue is one brighter than the ones queued after it, so it has got
+	// its final light when it is taken out, and it is visited only once.
+	queue.clear();
+	queue.push_back(p);
+	for (size_t qi = 0; qi != queue.size(); qi++) {
+		v3s16 pos = queue[qi];
+		light = vm->m_data[vm->m_area.index(pos)].param1;
+		if (light <= 1)
+			continue;
+		light--;
+
+		for (u16 i = 0; i != 6; i++) {
+			v3s16 p2 = pos + g_6dirs[i];
+			if (!a.contains(p2))
+				continue;
+
+			MapNode &n2 = vm->m_data[vm->m_area.index(p2)];
+			if (light <= n2.param1 || !ndef->get(n2).light_propagates)
+				continue;
 
-	lightSpread(a, p + v3s16(0, 0, 1), light);
-	lightSpread(a, p + v3s16(0, 1, 0), light);
-	lightSpread(a, p + v3s16(1, 0, 0), light);
-	lightSpread(a, p - v3s16(0, 0, 1), light);
-	lightSpread(a, p - v3s16(0, 1, 0), light);
-	lightSpread(a, p - v3s16(1, 0, 0), light);
+			n2.param1 = light;
+			queue.push_back(p2);
+		}
+	}
 }
 
 
@@ -234,28 +257,43 @@ void Mapgen::calcLighting(v3s16 nmin, v3s16 nmax) {
 	}
 
 	// now spread the sunlight and light up any sources
+	std::vector<v3s16> queue;
+	u32 ystride = em.X;
+	u32 zstride = em.X * em.Y;
 	for (int z = a.MinEdge.Z; z <= a.MaxEdge.Z; z++) {
 		for (int y = a.MinEdge.Y; y <= a.MaxEdge.Y; y++) {
 			u32 i = vm->m_area.index(a.MinEdge.X, y, z);
 			for (int x = a.MinEdge.X; x <= a.MaxEdge.X; x++, i++) {
 				MapNode &n = vm->m_data[i];
-				if (n.getContent() == CONTENT_IGNORE ||
-					!ndef->get(n).light_propagates)
+				if (n.getContent() == CONTENT_IGNORE)
+					continue;
+				const ContentFeatures &f = ndef->get(n);
+				if (!f.light_propagates)
 					continue;
 
-				u8 light_produced = ndef->get(n).light_source & 0x0F;
+				u8 light_produced = f.light_source & 0x0F;
 				if (light_produced)
 					n.param1 = light_produced;
 
+				// Most of the neighbors are at least as bright as the light
+				// that would get to them, so look at them in place first
 				u8 light = n.param1 & 0x0F;
-				if (light) {
-					lightSpread(a, v3s16(x,     y,     z + 1), light - 1);
-					lightSpread(a, v3s16(x,     y + 1, z    ), light - 1);
-					lightSpread(a, v3s16(x + 1, y,     z    ), light - 1);
-					lightSpread(a, v3s16(x,     y,     z - 1), light - 1);
-					lightSpread(a, v3s16(x,     y - 1, z    ), light - 1);
-					lightSpread(a, v3s16(x - 1, y,     z    ), light - 1);
-				}
+				if (light <= 2)
+					continue;
+				u8 light2 = light - 2;
+				v3s16 p(x, y, z);
+				if (z < a.MaxEdge.Z && light2 > vm->m_data[i + zstride].param1)
+					lightSpread(a, p + g_6dirs[0], light - 1, queue);
+				if (y < a.MaxEdge.Y && light2 > vm->m_data[i + ystride].param1)
+					lightSpread(a, p + g_6dirs[1], light - 1, queue);
+				if (x < a.MaxEdge.X && light2 > vm->m_data[i + 1].param1)
+					lightSpread(a, p + g_6dirs[2], light - 1, queue);
+				if (z > a.MinEdge.Z && light2 > vm->m_data[i - zstride].param1)
+					lightSpread(a, p + g_6dirs[3], light - 1, queue);
+				if (y > a.MinEdge.Y && light2 > vm->m_data[i - ystride].param1)
+					lightSpread(a, p + g_6dirs[4], light - 1, queue);
+				if (x > a.MinEdge.X && light2 > vm->m_data[i - 1].param1)
+					lightSpread(a, p + g_6dirs[5], light - 1, queue);
 			}
 		}
 	}
@@ -119,12 +119,20 @@ class Mapgen {
 	void updateHeightmap(v3s16 nmin, v3s16 nmax);
 	void updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nmax);
 	void setLighting(v3s16 nmin, v3s16 nmax, u8 light);
-	void lightSpread(VoxelArea &a, v3s16 p, u8 light);
+	void lightSpread(VoxelArea &a, v3s16 p, u8 light,
+		std::vector<v3s16> &queue);
 	void calcLighting(v3s16 nmin, v3s16 nmax);
 	void calcLightingOld(v3s16 nmin, v3s16 nmax);
 
 	virtual void makeChunk(BlockMakeData *data) {}
 	virtual int getGroundLevelAtPoint(v2s16 p) { return 0; }
+	// Gets conservative bounds of the ground level of the MAP_BLOCKSIZE
+	// by MAP_BLOCKSIZE node column of blockpos_2d.  They hold for the
+	// generated terrain and for the levels above water_level returned by
+	// getGroundLevelAtPoint().  Returns false if the mapgen can't tell.
+	// May be called from any thread.
+	virtual bool getGroundLevelBounds(v2s16 blockpos_2d,
+		s16 *min_y, s16 *max_y) { return false; }
 };
 
 struct MapgenFactory {
@@ -0,0 +1,155 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapgen_benchmark.h"
+#include <cmath>
+#include <cstdlib>
+#include "server.h"
+#include "emerge.h"
+#include "mapgen.h"
+#include "map.h"
+#include "subgame.h"
+#include "settings.h"
+#include "filesys.h"
+#include "profiler.h"
+#include "porting.h"
+#include "sha1.h"
+#include "hex.h"
+#include "log.h"
+#include "main.h" // for g_settings, g_profiler
+#include "util/serialize.h"
+#include "util/numeric.h"
+#include "util/string.h"
+
+// Profiler entries of the stages of mapgen; the rest of the time is
+// taken by the terrain, biomes and noise
+static const char *benchmark_stages[][2] = {
+	{"EmergeThread: mapgen caves",           "caves"},
+	{"EmergeThread: mapgen dungeons",        "dungeons"},
+	{"EmergeThread: mapgen ores",            "ores"},
+	{"EmergeThread: mapgen decorations",     "decorations"},
+	{"EmergeThread: mapgen lighting update", "lighting"},
+	{"EmergeThread: mapgen liquids",         "liquids"},
+};
+
+bool run_mapgen_benchmark(const SubgameSpec &gamespec, u32 num_chunks)
+{
+	// A world of its own, so that the chunks are really generated and no
+	// world of the user is touched
+	std::string world_path = fs::TempPath() + DIR_DELIM
+		+ "minetest-mapgen-benchmark";
+	fs::RecursiveDelete(world_path);
+
+	bool fixed_seed = !g_settings->get("fixed_map_seed").empty();
+	bool success = true;
+	{
+		Server server(world_path, gamespec, false, false);
+		EmergeManager *emerge = server.getEmergeManager();
+		Mapgen *mapgen = emerge->mapgen[0];
+		INodeDefManager *ndef = server.getNodeDefManager();
+
+		s16 csize = emerge->params.chunksize;
+		s16 coffset = -csize / 2;
+		v3s16 chunk_offset(coffset, coffset, coffset);
+
+		dstream << "Mapgen benchmark: generating " << num_chunks
+			<< " mapchunks with mapgen " << emerge->params.mg_name
+			<< ", seed " << emerge->params.seed
+			<< (fixed_seed ? "" : " (random; set fixed_map_seed to"
+				" compare the hashes of runs)") << std::endl;
+
+		g_profiler->clear();
+
+		SHA1 sha1;
+		float time_total = 0;
+
+		// Chunks around the origin, one column after the other, the ones
+		// at and just below the surface level
+		s16 side = ceil(sqrt((num_chunks + 1) / 2.0));
+		for (u32 i = 0; i != num_chunks; i++) {
+			u32 column = i / 2;
+			v3s16 chunkpos((s16)(column % side) - side / 2, -(s16)(i % 2),
+				(s16)(column / side) - side / 2);
+
+			BlockMakeData data;
+			data.seed = emerge->params.seed;
+			data.blockpos_min = chunkpos * csize + chunk_offset;
+			data.blockpos_max = data.blockpos_min + v3s16(1,1,1) * (csize - 1);
+			data.blockpos_requested = data.blockpos_min;
+			data.nodedef = ndef;
+
+			// Like the freshly created blocks of ServerMap::initBlockMake()
+			data.vmanip = new ManualMapVoxelManipulator(&server.getMap());
+			ManualMapVoxelManipulator *vm = data.vmanip;
+			vm->addArea(VoxelArea(
+				(data.blockpos_min - v3s16(1,1,1)) * MAP_BLOCKSIZE,
+				(data.blockpos_max + v3s16(2,2,2)) * MAP_BLOCKSIZE -
+				v3s16(1,1,1)));
+			u32 volume = vm->m_area.getVolume();
+			for (u32 j = 0; j != volume; j++) {
+				vm->m_data[j] = MapNode(CONTENT_IGNORE);
+				vm->m_flags[j] = 0;
+			}
+
+			u32 t1 = porting::getTimeUs();
+			mapgen->makeChunk(&data);
+			time_total += (u32)(porting::getTimeUs() - t1) / 1000000.0;
+
+			// The content ids, and so the hash, are only the same for
+			// the same game and mods
+			std::string buf(volume * 4, 0);
+			for (u32 j = 0; j != volume; j++) {
+				writeU16((u8 *)&buf[j * 4], vm->m_data[j].getContent());
+				buf[j * 4 + 2] = vm->m_data[j].param1;
+				buf[j * 4 + 3] = vm->m_data[j].param2;
+			}
+			sha1.addBytes(buf.c_str(), buf.size());
+		}
+
+		unsigned char *digest = sha1.getDigest();
+		std::string hash = hex_encode((char *)digest, 20);
+		free(digest);
+
+		if (num_chunks == 0 || time_total <= 0) {
+			errorstream << "Mapgen benchmark: nothing was generated"
+				<< std::endl;
+			success = false;
+		} else {
+			dstream << "Generated " << num_chunks << " mapchunks in "
+				<< time_total << " s, " << (num_chunks / time_total)
+				<< " mapchunks/s" << std::endl;
+
+			float time_rest = time_total;
+			for (size_t i = 0; i != ARRLEN(benchmark_stages); i++) {
+				float t = g_profiler->getTotal(benchmark_stages[i][0]);
+				time_rest -= t;
+				dstream << "  " << padStringRight(benchmark_stages[i][1], 24)
+					<< t << " s (" << (t * 100 / time_total) << "%)"
+					<< std::endl;
+			}
+			dstream << "  " << padStringRight("terrain and other", 24)
+				<< time_rest << " s (" << (time_rest * 100 / time_total)
+				<< "%)" << std::endl;
+			dstream << "Hash of the generated nodes: " << hash << std::endl;
+		}
+	}
+
+	fs::RecursiveDelete(world_path);
+	return success;
+}
@@ -0,0 +1,35 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPGEN_BENCHMARK_HEADER
+#define MAPGEN_BENCHMARK_HEADER
+
+#include "irrlichttypes.h"
+
+struct SubgameSpec;
+
+/*
+	Generates num_chunks mapchunks around the origin with the mapgen set
+	by mg_name and the seed set by fixed_map_seed, in a temporary world
+	of the given game, and prints the rate, the time taken by each stage
+	and a hash of the generated nodes.
+*/
+bool run_mapgen_benchmark(const SubgameSpec &gamespec, u32 num_chunks);
+
+#endif
@@ -195,12 +195,17 @@ void MapgenV5Params::writeParams(Settings *settings) {
 int MapgenV5::getGroundLevelAtPoint(v2s16 p) {
 	//TimeTaker t("getGroundLevelAtPoint", NULL, PRECISION_MICRO);
 
-	float f = 0.55 + NoisePerlin2D(noise_factor->np, p.X, p.Y, seed);
+	NoiseParams *np_factor = noise_factor->np;
+	NoiseParams *np_height = noise_height->np;
+
+	float f = 0.55 + (np_factor->offset + np_factor->scale *
+		emerge->getNoise2DAtPoint(noise_factor, p));
 	if(f < 0.01)
 		f = 0.01;
 	else if(f >= 1.0)
 		f *= 1.6;
-	float h = water_level + NoisePerlin2D(noise_height->np, p.X, p.Y, seed);
+	float h = water_level + (np_height->offset + np_height->scale *
+		emerge->getNoise2DAtPoint(noise_height, p));
 
 	s16 search_top = water_level + 15;
 	s16 search_base = water_level;
@@ -225,6 +230,46 @@ int MapgenV5::getGroundLevelAtPoint(v2s16 p) {
 }
 
 
+bool MapgenV5::getGroundLevelBounds(v2s16 blockpos_2d, s16 *min_y, s16 *max_y) {
+	// Make the noise of the whole column at once, like calculateNoise()
+	// does; the members aren't touched so that this is thread safe
+	int x = blockpos_2d.X * MAP_BLOCKSIZE;
+	int z = blockpos_2d.Y * MAP_BLOCKSIZE;
+
+	Noise n_factor(noise_factor->np, seed, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	Noise n_height(noise_height->np, seed, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	n_factor.perlinMap2D(x, z);
+	n_height.perlinMap2D(x, z);
+	n_height.transformNoiseMap();
+
+	// The ground is where the 3D ground noise times f reaches above y - h
+	NoiseParams *np_ground = noise_ground->np;
+	float ground_max = fabs(np_ground->offset) +
+		fabs(np_ground->scale) * noise_perlin_amplitude(np_ground);
+
+	float level_min = 0, level_max = 0;
+	for (int i = 0; i != MAP_BLOCKSIZE * MAP_BLOCKSIZE; i++) {
+		float f = 0.55 + n_factor.result[i];
+		if(f < 0.01)
+			f = 0.01;
+		else if(f >= 1.0)
+			f *= 1.6;
+		float h = water_level + n_height.result[i];
+
+		if (i == 0 || h - f * ground_max < level_min)
+			level_min = h - f * ground_max;
+		if (i == 0 || h + f * ground_max > level_max)
+			level_max = h + f * ground_max;
+	}
+
+	// The maps are made at a different position than in calculateNoise(),
+	// so allow for rounding differences
+	*min_y = floor(level_min) - 1;
+	*max_y = ceil(level_max) + 1;
+	return true;
+}
+
+
 void MapgenV5::makeChunk(BlockMakeData *data) {
 	assert(data->vmanip);
 	assert(data->nodedef);
@@ -304,9 +349,11 @@ void MapgenV5::calculateNoise() {
 	int y = node_min.Y - 1;
 	int z = node_min.Z;
 	
-	noise_filler_depth->perlinMap2D(x, z);
-	noise_factor->perlinMap2D(x, z);
-	noise_height->perlinMap2D(x, z);
+	// 2D noise is shared with the other mapchunks of the column through
+	// the noise map cache
+	emerge->noisecache->perlinMap2D(noise_filler_depth, x, z);
+	emerge->noisecache->perlinMap2D(noise_factor, x, z);
+	emerge->noisecache->perlinMap2D(noise_height, x, z);
 	noise_height->transformNoiseMap();
 
 	noise_cave1->perlinMap3D(x, y, z, true);
@@ -321,8 +368,8 @@ void MapgenV5::calculateNoise() {
 		noise_wetness->perlinMap3D(x, y, z, false);
 	}
 
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
+	emerge->noisecache->perlinMap2D(noise_heat, x, z);
+	emerge->noisecache->perlinMap2D(noise_humidity, x, z);
 
 	//printf("calculateNoise: %dus\n", t.stop());
 }
@@ -95,6 +95,7 @@ class MapgenV5 : public Mapgen {
 	
 	virtual void makeChunk(BlockMakeData *data);
 	int getGroundLevelAtPoint(v2s16 p);
+	bool getGroundLevelBounds(v2s16 blockpos_2d, s16 *min_y, s16 *max_y);
 	void calculateNoise();
 	void generateBaseTerrain();
 	void generateBlobs();
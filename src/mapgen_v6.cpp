@@ -61,6 +61,8 @@ MapgenV6::MapgenV6(int mapgenid, MapgenParams *params, EmergeManager *emerge) {
 	this->gennotify   = emerge->gennotify;
 
 	this->ystride = csize.X; //////fix this
+
+	this->heightmap = new s16[csize.X * csize.Z];
 	
 	MapgenV6Params *sp = (MapgenV6Params *)params->sparams;
 
@@ -81,6 +83,9 @@ MapgenV6::MapgenV6(int mapgenid, MapgenParams *params, EmergeManager *emerge) {
 	noise_mud            = new Noise(&sp->np_mud,            seed, csize.X, csize.Y);
 	noise_beach          = new Noise(&sp->np_beach,          seed, csize.X, csize.Y);
 	noise_biome          = new Noise(&sp->np_biome,          seed, csize.X, csize.Y);
+	noise_humidity       = new Noise(&sp->np_humidity,       seed, csize.X, csize.Y);
+	noise_trees          = new Noise(&sp->np_trees,          seed, csize.X, csize.Y);
+	noise_apple_trees    = new Noise(&sp->np_apple_trees,    seed, csize.X, csize.Y);
 
 	//// Resolve nodes to be used
 	INodeDefManager *ndef = emerge->ndef;
@@ -122,6 +127,11 @@ MapgenV6::~MapgenV6() {
 	delete noise_mud;
 	delete noise_beach;
 	delete noise_biome;
+	delete noise_humidity;
+	delete noise_trees;
+	delete noise_apple_trees;
+
+	delete[] heightmap;
 }
 
 
@@ -209,15 +219,8 @@ s16 MapgenV6::find_stone_level(v2s16 p2d) {
 // Required by mapgen.h
 bool MapgenV6::block_is_underground(u64 seed, v3s16 blockpos)
 {
-	/*s16 minimum_groundlevel = (s16)get_sector_minimum_ground_level(
-			seed, v2s16(blockpos.X, blockpos.Z));*/
-	// Nah, this is just a heuristic, just return something
-	s16 minimum_groundlevel = water_level;
-
-	if(blockpos.Y*MAP_BLOCKSIZE + MAP_BLOCKSIZE <= minimum_groundlevel)
-		return true;
-	else
-		return false;
+	// The bounds of the column are cached by the emerge manager
+	return emerge->isBlockUnderground(blockpos);
 }
 
 
@@ -254,14 +257,17 @@ float MapgenV6::baseTerrainLevelFromNoise(v2s16 p) {
 	if (flags & MG_FLAT)
 		return water_level;
 		
-	float terrain_base   = NoisePerlin2DPosOffset(noise_terrain_base->np,
-							p.X, 0.5, p.Y, 0.5, seed);
-	float terrain_higher = NoisePerlin2DPosOffset(noise_terrain_higher->np,
-							p.X, 0.5, p.Y, 0.5, seed);
-	float steepness      = NoisePerlin2DPosOffset(noise_steepness->np,
-							p.X, 0.5, p.Y, 0.5, seed);
-	float height_select  = NoisePerlin2DNoTxfmPosOffset(noise_height_select->np,
-							p.X, 0.5, p.Y, 0.5, seed);
+	NoiseParams *np_base    = noise_terrain_base->np;
+	NoiseParams *np_higher  = noise_terrain_higher->np;
+	NoiseParams *np_steep   = noise_steepness->np;
+
+	float terrain_base   = np_base->offset + np_base->scale *
+		emerge->getNoise2DAtPoint(noise_terrain_base, p, 0.5, 0.5);
+	float terrain_higher = np_higher->offset + np_higher->scale *
+		emerge->getNoise2DAtPoint(noise_terrain_higher, p, 0.5, 0.5);
+	float steepness      = np_steep->offset + np_steep->scale *
+		emerge->getNoise2DAtPoint(noise_steepness, p, 0.5, 0.5);
+	float height_select  = emerge->getNoise2DAtPoint(noise_height_select, p, 0.5, 0.5);
 
 	return baseTerrainLevel(terrain_base, terrain_higher,
 							steepness,    height_select);
@@ -298,6 +304,58 @@ int MapgenV6::getGroundLevelAtPoint(v2s16 p) {
 }
 
 
+bool MapgenV6::getGroundLevelBounds(v2s16 blockpos_2d, s16 *min_y, s16 *max_y) {
+	// At most this much mud is put on top of the stone
+	NoiseParams *np_mud = noise_mud->np;
+	float mud_max = (fabs(np_mud->offset) + fabs(np_mud->scale) *
+		noise_perlin_amplitude(np_mud)) / 2.0 + 1.5;
+	s16 mud_reach = MYMAX(AVERAGE_MUD_AMOUNT, (s16)ceil(mud_max));
+
+	if (flags & MG_FLAT) {
+		*min_y = water_level - 1;
+		*max_y = water_level + mud_reach + 1;
+		return true;
+	}
+
+	// Make the noise of the whole column at once, like calculateNoise()
+	// does; the members aren't touched so that this is thread safe
+	int x = blockpos_2d.X * MAP_BLOCKSIZE;
+	int z = blockpos_2d.Y * MAP_BLOCKSIZE;
+	Noise *noises[4] = {noise_terrain_base, noise_terrain_higher,
+		noise_steepness, noise_height_select};
+	Noise *maps[4];
+	for (int i = 0; i != 4; i++) {
+		NoiseParams *np = noises[i]->np;
+		maps[i] = new Noise(np, seed, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+		maps[i]->perlinMap2D(
+			x + 0.5 * np->spread.X,
+			z + 0.5 * np->spread.Z);
+		// height_select is used untransformed
+		if (i != 3)
+			maps[i]->transformNoiseMap();
+	}
+
+	float level_min = 0, level_max = 0;
+	for (int i = 0; i != MAP_BLOCKSIZE * MAP_BLOCKSIZE; i++) {
+		float level = baseTerrainLevel(maps[0]->result[i],
+			maps[1]->result[i], maps[2]->result[i], maps[3]->result[i]);
+		if (i == 0 || level < level_min)
+			level_min = level;
+		if (i == 0 || level > level_max)
+			level_max = level;
+	}
+
+	for (int i = 0; i != 4; i++)
+		delete maps[i];
+
+	// The maps are made at a different position than in calculateNoise(),
+	// so allow for rounding differences
+	*min_y = floor(level_min) - 1;
+	*max_y = ceil(level_max) + mud_reach + 1;
+	return true;
+}
+
+
 //////////////////////// Noise functions
 
 float MapgenV6::getMudAmount(v2s16 p) {
@@ -326,12 +384,7 @@ float MapgenV6::getHumidity(v2s16 p)
 	noise = (noise + 1.0)/2.0;*/
 
 	float noise = NoisePerlin2D(np_humidity, p.X, p.Y, seed);
-
-	if (noise < 0.0)
-		noise = 0.0;
-	if (noise > 1.0)
-		noise = 1.0;
-	return noise;
+	return rangelim(noise, 0.0, 1.0);
 }
 
 
@@ -342,11 +395,7 @@ float MapgenV6::getTreeAmount(v2s16 p)
 			seed+2, 4, 0.66);*/
 	
 	float noise = NoisePerlin2D(np_trees, p.X, p.Y, seed);
-	float zeroval = -0.39;
-	if (noise < zeroval)
-		return 0;
-	else
-		return 0.04 * (noise-zeroval) / (1.0-zeroval);
+	return treeAmountFromNoise(noise);
 }
 
 
@@ -362,6 +411,35 @@ bool MapgenV6::getHaveAppleTree(v2s16 p)
 }
 
 
+// The index versions use the maps of calculateTreeNoise()
+float MapgenV6::getHumidity(int index)
+{
+	return rangelim(noise_humidity->result[index], 0.0, 1.0);
+}
+
+
+float MapgenV6::getTreeAmount(int index)
+{
+	return treeAmountFromNoise(noise_trees->result[index]);
+}
+
+
+bool MapgenV6::getHaveAppleTree(int index)
+{
+	return noise_apple_trees->result[index] > 0.2;
+}
+
+
+float MapgenV6::treeAmountFromNoise(float noise)
+{
+	float zeroval = -0.39;
+	if (noise < zeroval)
+		return 0;
+	else
+		return 0.04 * (noise-zeroval) / (1.0-zeroval);
+}
+
+
 float MapgenV6::getMudAmount(int index)
 {
 	if (flags & MG_FLAT)
@@ -536,6 +614,12 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 	if (flags & MG_TREES)
 		placeTreesAndJungleGrass();
 	
+	// Find the ground level of every column once for the decorations
+	// instead of for each of them
+	for (int i = 0; i != csize.X * csize.Z; i++)
+		heightmap[i] = node_min.Y - 1;
+	updateHeightmap(node_min, node_max);
+
 	// Generate the registered decorations
 	emerge->decomgr->placeAllDecos(this, blockseed, node_min, node_max);
 
@@ -555,43 +639,65 @@ void MapgenV6::calculateNoise() {
 	int x = node_min.X;
 	int z = node_min.Z;
 
+	// The 2D noise is the same for every mapchunk of a column, so it is
+	// shared through the noise map cache.
 	// Need to adjust for the original implementation's +.5 offset...
 	if (!(flags & MG_FLAT)) {
-		noise_terrain_base->perlinMap2D(
+		emerge->noisecache->perlinMap2D(noise_terrain_base,
 			x + 0.5 * noise_terrain_base->np->spread.X,
 			z + 0.5 * noise_terrain_base->np->spread.Z);
 		noise_terrain_base->transformNoiseMap();
 
-		noise_terrain_higher->perlinMap2D(
+		emerge->noisecache->perlinMap2D(noise_terrain_higher,
 			x + 0.5 * noise_terrain_higher->np->spread.X,
 			z + 0.5 * noise_terrain_higher->np->spread.Z);
 		noise_terrain_higher->transformNoiseMap();
 
-		noise_steepness->perlinMap2D(
+		emerge->noisecache->perlinMap2D(noise_steepness,
 			x + 0.5 * noise_steepness->np->spread.X,
 			z + 0.5 * noise_steepness->np->spread.Z);
 		noise_steepness->transformNoiseMap();
 
-		noise_height_select->perlinMap2D(
+		emerge->noisecache->perlinMap2D(noise_height_select,
 			x + 0.5 * noise_height_select->np->spread.X,
 			z + 0.5 * noise_height_select->np->spread.Z);
 
-		noise_mud->perlinMap2D(
+		emerge->noisecache->perlinMap2D(noise_mud,
 			x + 0.5 * noise_mud->np->spread.X,
 			z + 0.5 * noise_mud->np->spread.Z);
 		noise_mud->transformNoiseMap();
 	}
 
-	noise_beach->perlinMap2D(
+	emerge->noisecache->perlinMap2D(noise_beach,
 		x + 0.2 * noise_beach->np->spread.X,
 		z + 0.7 * noise_beach->np->spread.Z);
 
-	noise_biome->perlinMap2D(
+	emerge->noisecache->perlinMap2D(noise_biome,
 		x + 0.6 * noise_biome->np->spread.X,
 		z + 0.2 * noise_biome->np->spread.Z);
 }
 
 
+void MapgenV6::calculateTreeNoise() {
+	int x = node_min.X;
+	int z = node_min.Z;
+
+	// Only the centers of the parts of the chunk need the amount of trees
+	// and the humidity, but a map is still cheaper than the point noise
+	// for most of them, and apple trees can be anywhere
+	emerge->noisecache->perlinMap2D(noise_trees, x, z);
+	noise_trees->transformNoiseMap();
+
+	emerge->noisecache->perlinMap2D(noise_apple_trees, x, z);
+	noise_apple_trees->transformNoiseMap();
+
+	if (spflags & MGV6_JUNGLES) {
+		emerge->noisecache->perlinMap2D(noise_humidity, x, z);
+		noise_humidity->transformNoiseMap();
+	}
+}
+
+
 int MapgenV6::generateGround() {
 	//TimeTaker timer1("Generating ground level");
 	MapNode n_air(CONTENT_AIR), n_water_source(c_water_source);
@@ -866,6 +972,7 @@ void MapgenV6::addDirtGravelBlobs() {
 
 
 void MapgenV6::placeTreesAndJungleGrass() {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen decorations", SPT_AVG);
 	//TimeTaker t("placeTrees");
 	if (node_max.Y < water_level)
 		return;
@@ -877,6 +984,8 @@ void MapgenV6::placeTreesAndJungleGrass() {
 		c_junglegrass = CONTENT_AIR;
 	MapNode n_junglegrass(c_junglegrass);
 	v3s16 em = vm->m_area.getExtent();
+
+	calculateTreeNoise();
 	
 	// Divide area into parts
 	s16 div = 8;
@@ -903,13 +1012,16 @@ void MapgenV6::placeTreesAndJungleGrass() {
 			node_min.Z + sidelen + sidelen * z0 - 1
 		);
 		
+		int index_center = (p2d_center.Y - node_min.Z) * ystride +
+			(p2d_center.X - node_min.X);
+
 		// Amount of trees, jungle area
-		u32 tree_count = area * getTreeAmount(p2d_center);
+		u32 tree_count = area * getTreeAmount(index_center);
 		
 		float humidity;
 		bool is_jungle = false;
 		if (spflags & MGV6_JUNGLES) {
-			humidity = getHumidity(p2d_center);
+			humidity = getHumidity(index_center);
 			if (humidity > 0.75) {
 				is_jungle = true;
 				tree_count *= 4;
@@ -961,8 +1073,9 @@ void MapgenV6::placeTreesAndJungleGrass() {
 			if (is_jungle) {
 				treegen::make_jungletree(*vm, p, ndef, myrand());
 			} else {
+				int index = (z - node_min.Z) * ystride + (x - node_min.X);
 				bool is_apple_tree = (myrand_range(0, 3) == 0) &&
-										getHaveAppleTree(v2s16(x, z));
+										getHaveAppleTree(index);
 				treegen::make_tree(*vm, p, is_apple_tree, ndef, myrand());
 			}
 		}
@@ -1001,6 +1114,7 @@ void MapgenV6::growGrass() {
 
 
 void MapgenV6::generateCaves(int max_stone_y) {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen caves", SPT_AVG);
 	float cave_amount = NoisePerlin2D(np_cave, node_min.X, node_min.Y, seed);
 	int volume_nodes = (node_max.X - node_min.X + 1) *
 					   (node_max.Y - node_min.Y + 1) * MAP_BLOCKSIZE;
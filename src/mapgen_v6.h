@@ -86,6 +86,9 @@ class MapgenV6 : public Mapgen {
 	Noise *noise_mud;
 	Noise *noise_beach;
 	Noise *noise_biome;
+	Noise *noise_humidity;
+	Noise *noise_trees;
+	Noise *noise_apple_trees;
 	NoiseParams *np_cave;
 	NoiseParams *np_humidity;
 	NoiseParams *np_trees;
@@ -114,6 +117,7 @@ class MapgenV6 : public Mapgen {
 	
 	void makeChunk(BlockMakeData *data);
 	int getGroundLevelAtPoint(v2s16 p);
+	bool getGroundLevelBounds(v2s16 blockpos_2d, s16 *min_y, s16 *max_y);
 
 	float baseTerrainLevel(float terrain_base, float terrain_higher,
 						   float steepness, float height_select);
@@ -128,6 +132,10 @@ class MapgenV6 : public Mapgen {
 	float getHumidity(v2s16 p);
 	float getTreeAmount(v2s16 p);
 	bool getHaveAppleTree(v2s16 p);
+	float getHumidity(int index);
+	float getTreeAmount(int index);
+	bool getHaveAppleTree(int index);
+	float treeAmountFromNoise(float noise);
 	float getMudAmount(v2s16 p);
 	virtual float getMudAmount(int index);
 	bool getHaveBeach(v2s16 p);
@@ -138,6 +146,7 @@ class MapgenV6 : public Mapgen {
 	u32 get_blockseed(u64 seed, v3s16 p);
 	
 	virtual void calculateNoise();
+	void calculateTreeNoise();
 	int generateGround();
 	void addMud();
 	void flowMud(s16 &mudflow_minpos, s16 &mudflow_maxpos);
@@ -180,7 +180,7 @@ int MapgenV7::getGroundLevelAtPoint(v2s16 p) {
 	
 	// Ridge/river terrain calculation
 	float width = 0.3;
-	float uwatern = NoisePerlin2DNoTxfm(noise_ridge_uwater->np, p.X, p.Y, seed) * 2;
+	float uwatern = emerge->getNoise2DAtPoint(noise_ridge_uwater, p) * 2;
 	// actually computing the depth of the ridge is much more expensive;
 	// if inside a river, simply guess
 	if (uwatern >= -width && uwatern <= width)
@@ -200,6 +200,72 @@ int MapgenV7::getGroundLevelAtPoint(v2s16 p) {
 }
 
 
+bool MapgenV7::getGroundLevelBounds(v2s16 blockpos_2d, s16 *min_y, s16 *max_y) {
+	// Make the base terrain noise of the whole column at once, like
+	// calculateNoise() does; the members aren't touched so that this is
+	// thread safe
+	int x = blockpos_2d.X * MAP_BLOCKSIZE;
+	int z = blockpos_2d.Y * MAP_BLOCKSIZE;
+	int size = MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+
+	Noise n_hselect(noise_height_select->np, seed,
+		MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	Noise n_persist(noise_terrain_persist->np, seed,
+		MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	Noise n_base(noise_terrain_base->np, seed, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	Noise n_alt(noise_terrain_alt->np, seed, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+
+	n_hselect.perlinMap2D(x, z);
+	n_hselect.transformNoiseMap();
+
+	n_persist.perlinMap2D(x, z);
+	n_persist.transformNoiseMap();
+	float *persistmap = n_persist.result;
+	for (int i = 0; i != size; i++)
+		persistmap[i] = rangelim(persistmap[i], 0.4, 0.9);
+
+	n_base.perlinMap2DModulated(x, z, persistmap);
+	n_base.transformNoiseMap();
+
+	n_alt.perlinMap2DModulated(x, z, persistmap);
+	n_alt.transformNoiseMap();
+
+	float level_min = 0, level_max = 0;
+	for (int i = 0; i != size; i++) {
+		float level = baseTerrainLevel(
+			rangelim(n_hselect.result[i], 0.0, 1.0),
+			n_base.result[i], n_alt.result[i]);
+		if (i == 0 || level < level_min)
+			level_min = level;
+		if (i == 0 || level > level_max)
+			level_max = level;
+	}
+
+	// The maps are made at a different position than in calculateNoise(),
+	// so allow for rounding differences
+	s16 lower = floor(level_min) - 1;
+	s16 upper = ceil(level_max) + 1;
+
+	// Ridges are carved no deeper than height_mod in generateRidgeTerrain()
+	// allows
+	if (spflags & MGV7_RIDGES)
+		lower = MYMIN(lower, MYMIN(water_level, -12) - 2);
+
+	// Mountains can't reach above the height where even the largest
+	// mountain noise is cancelled out by the height modifier, and
+	// getGroundLevelAtPoint() considers them whether enabled or not
+	NoiseParams *np_mnt = noise_mountain->np;
+	float mnt_max = fabs(np_mnt->offset) +
+		fabs(np_mnt->scale) * noise_perlin_amplitude(np_mnt);
+	if (mnt_max > 0.6)
+		upper = MYMAX(upper, (s16)ceil((mnt_max - 0.6) * 150.0) + 1);
+
+	*min_y = lower;
+	*max_y = upper;
+	return true;
+}
+
+
 void MapgenV7::makeChunk(BlockMakeData *data) {
 	assert(data->vmanip);
 	assert(data->nodedef);
@@ -276,10 +342,12 @@ void MapgenV7::calculateNoise() {
 	int y = node_min.Y;
 	int z = node_min.Z;
 	
-	noise_height_select->perlinMap2D(x, z);
+	// 2D noise is shared with the other mapchunks of the column through
+	// the noise map cache, except for the maps modulated by persistmap
+	emerge->noisecache->perlinMap2D(noise_height_select, x, z);
 	noise_height_select->transformNoiseMap();
 	
-	noise_terrain_persist->perlinMap2D(x, z);
+	emerge->noisecache->perlinMap2D(noise_terrain_persist, x, z);
 	noise_terrain_persist->transformNoiseMap();
 	float *persistmap = noise_terrain_persist->result;
 	for (int i = 0; i != csize.X * csize.Z; i++)
@@ -291,29 +359,32 @@ void MapgenV7::calculateNoise() {
 	noise_terrain_alt->perlinMap2DModulated(x, z, persistmap);
 	noise_terrain_alt->transformNoiseMap();
 	
-	noise_filler_depth->perlinMap2D(x, z);
+	emerge->noisecache->perlinMap2D(noise_filler_depth, x, z);
 	
 	if (spflags & MGV7_MOUNTAINS) {
 		noise_mountain->perlinMap3D(x, y, z);
-		noise_mount_height->perlinMap2D(x, z);
+		emerge->noisecache->perlinMap2D(noise_mount_height, x, z);
 		noise_mount_height->transformNoiseMap();
 	}
 
 	if (spflags & MGV7_RIDGES) {
 		noise_ridge->perlinMap3D(x, y, z);
-		noise_ridge_uwater->perlinMap2D(x, z);
+		emerge->noisecache->perlinMap2D(noise_ridge_uwater, x, z);
 	}
 	
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
+	emerge->noisecache->perlinMap2D(noise_heat, x, z);
+	emerge->noisecache->perlinMap2D(noise_humidity, x, z);
 	
 	//printf("calculateNoise: %dus\n", t.stop());
 }
 
 
 Biome *MapgenV7::getBiomeAtPoint(v3s16 p) {
-	float heat      = NoisePerlin2D(bmgr->np_heat, p.X, p.Z, seed);
-	float humidity  = NoisePerlin2D(bmgr->np_humidity, p.X, p.Z, seed);
+	v2s16 p2d(p.X, p.Z);
+	float heat      = bmgr->np_heat->offset + bmgr->np_heat->scale *
+		emerge->getNoise2DAtPoint(noise_heat, p2d);
+	float humidity  = bmgr->np_humidity->offset + bmgr->np_humidity->scale *
+		emerge->getNoise2DAtPoint(noise_humidity, p2d);
 	s16 groundlevel = baseTerrainLevelAtPoint(p.X, p.Z);
 	
 	return bmgr->getBiome(heat, humidity, groundlevel);
@@ -321,10 +392,14 @@ Biome *MapgenV7::getBiomeAtPoint(v3s16 p) {
 
 //needs to be updated
 float MapgenV7::baseTerrainLevelAtPoint(int x, int z) {
-	float hselect = NoisePerlin2D(noise_height_select->np, x, z, seed);
+	NoiseParams *np_hselect = noise_height_select->np;
+	float hselect = np_hselect->offset + np_hselect->scale *
+		emerge->getNoise2DAtPoint(noise_height_select, v2s16(x, z));
 	hselect = rangelim(hselect, 0.0, 1.0);
 	
-	float persist = NoisePerlin2D(noise_terrain_persist->np, x, z, seed);
+	NoiseParams *np_persist = noise_terrain_persist->np;
+	float persist = np_persist->offset + np_persist->scale *
+		emerge->getNoise2DAtPoint(noise_terrain_persist, v2s16(x, z));
 	persist = rangelim(persist, 0.4, 0.9);
 
 	noise_terrain_base->np->persist = persist;
@@ -333,10 +408,7 @@ float MapgenV7::baseTerrainLevelAtPoint(int x, int z) {
 	noise_terrain_alt->np->persist = persist;
 	float height_alt = NoisePerlin2D(noise_terrain_alt->np, x, z, seed);
 
-	if (height_alt > height_base)
-		return height_alt;
-		
-	return (height_base * hselect) + (height_alt * (1.0 - hselect));
+	return baseTerrainLevel(hselect, height_base, height_alt);
 }
 
 
@@ -345,6 +417,12 @@ float MapgenV7::baseTerrainLevelFromMap(int index) {
 	float height_base = noise_terrain_base->result[index];
 	float height_alt  = noise_terrain_alt->result[index];
 	
+	return baseTerrainLevel(hselect, height_base, height_alt);
+}
+
+
+float MapgenV7::baseTerrainLevel(float hselect, float height_base,
+		float height_alt) {
 	if (height_alt > height_base)
 		return height_alt;
 
@@ -353,7 +431,9 @@ float MapgenV7::baseTerrainLevelFromMap(int index) {
 
 
 bool MapgenV7::getMountainTerrainAtPoint(int x, int y, int z) {
-	float mnt_h_n = NoisePerlin2D(noise_mount_height->np, x, z, seed);
+	NoiseParams *np_mnt_h = noise_mount_height->np;
+	float mnt_h_n = np_mnt_h->offset + np_mnt_h->scale *
+		emerge->getNoise2DAtPoint(noise_mount_height, v2s16(x, z));
 	float height_modifier = -((float)y / rangelim(mnt_h_n, 80.0, 150.0));
 	float mnt_n = NoisePerlin3D(noise_mountain->np, x, y, z, seed);
 
@@ -738,6 +818,7 @@ void MapgenV7::addTopNodes() {
 NoiseParams nparams_v7_def_cave(6, 6.0, v3f(250.0, 250.0, 250.0), 34329, 3, 0.50);
 
 void MapgenV7::generateCaves(int max_stone_y) {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen caves", SPT_AVG);
 	PseudoRandom ps(blockseed + 21343);
 
 	int volume_nodes = (node_max.X - node_min.X + 1) *
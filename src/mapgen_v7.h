@@ -98,8 +98,11 @@ class MapgenV7 : public Mapgen {
 	
 	virtual void makeChunk(BlockMakeData *data);
 	int getGroundLevelAtPoint(v2s16 p);
+	bool getGroundLevelBounds(v2s16 blockpos_2d, s16 *min_y, s16 *max_y);
 	Biome *getBiomeAtPoint(v3s16 p);
 
+	float baseTerrainLevel(float hselect, float height_base,
+		float height_alt);
 	float baseTerrainLevelAtPoint(int x, int z);
 	float baseTerrainLevelFromMap(int index);
 	bool getMountainTerrainAtPoint(int x, int y, int z);
@@ -29,6 +29,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include <string>
 #include <sstream>
+#include <vector>
 
 static const Rotation wallmounted_to_rot[] = {
 	ROTATE_0, ROTATE_180, ROTATE_90, ROTATE_270
@@ -506,7 +507,8 @@ void MapNode::deSerialize(u8 *source, u8 version)
 }
 void MapNode::serializeBulk(std::ostream &os, int version,
 		const MapNode *nodes, u32 nodecount,
-		u8 content_width, u8 params_width, bool compressed)
+		u8 content_width, u8 params_width, bool compressed,
+		int compression_level)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapNode format not supported");
@@ -542,7 +544,7 @@ void MapNode::serializeBulk(std::ostream &os, int version,
 
 	if(compressed)
 	{
-		compressZlib(databuf, os);
+		compressZlib(databuf, os, compression_level);
 	}
 	else
 	{
@@ -564,16 +566,14 @@ void MapNode::deSerializeBulk(std::istream &is, int version,
 
 	// Uncompress or read data
 	u32 len = nodecount * (content_width + params_width);
-	SharedBuffer<u8> databuf(len);
+	// One byte more for detecting too long compressed data
+	std::vector<u8> databuf(len + 1);
 	if(compressed)
 	{
-		std::ostringstream os(std::ios_base::binary);
-		decompressZlib(is, os);
-		std::string s = os.str();
-		if(s.size() != len)
+		// Inflated straight to the buffer, without going through a stream
+		if(decompressZlib(is, &databuf[0], len + 1) != len)
 			throw SerializationError("deSerializeBulkNodes: "
 					"decompress resulted in invalid size");
-		memcpy(&databuf[0], s.c_str(), len);
 	}
 	else
 	{
@@ -0,0 +1,515 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapsaver.h"
+#include "database.h"
+#include "jthread/jmutexautolock.h"
+#include "porting.h"
+#include "log.h"
+#include "main.h" // For g_profiler
+#include "profiler.h"
+#include "metrics.h"
+#include "debug.h"
+
+// Limits how long loads from other threads have to wait for a batch
+#define MAP_SAVE_BATCH_MAX_BLOCKS 256
+
+MapSaveThread::MapSaveThread(Database *db, size_t cache_size):
+	JThread(),
+	m_db(db),
+	m_next_ticket(1),
+	m_failing(false),
+	m_cache_size(0),
+	m_cache_size_max(cache_size),
+	m_batches_written(0)
+{
+	// Loads only have to wait for saves if the database can't do both
+	// at once
+	m_db_load_mutex = m_db->canLoadWhileSaving() ?
+			&m_db_read_mutex : &m_db_mutex;
+}
+
+MapSaveThread::~MapSaveThread()
+{
+	// The owner is expected to call stopAndDrain() before deleting
+	if(IsRunning())
+		stopAndDrain();
+}
+
+void * MapSaveThread::Thread()
+{
+	log_register_thread("MapSaveThread");
+
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	ThreadStarted();
+
+	porting::setThreadName("MapSaveThread");
+
+	for(;;)
+	{
+		// Read this before writing so that nothing queued before
+		// stopAndDrain() is left behind
+		bool stop = StopRequested();
+		if(writeBatch())
+			continue;
+		if(stop)
+			break;
+		m_queue_sem.Wait(1000);
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+u32 MapSaveThread::queueBlock(v3s16 p, const std::string &data)
+{
+	u32 ticket;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		ticket = m_next_ticket++;
+		QueuedBlock &q = m_queue[p];
+		q.data = data;
+		q.ticket = ticket;
+		cacheBlock(p, data);
+	}
+	m_queue_sem.Post();
+	return ticket;
+}
+
+void MapSaveThread::getWrittenBlocks(std::list<std::pair<v3s16, u32> > &dst)
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	dst.splice(dst.end(), m_written);
+}
+
+void MapSaveThread::flush()
+{
+	for(;;)
+	{
+		{
+			JMutexAutoLock lock(m_queue_mutex);
+			if(m_queue.empty() && m_writing.empty() &&
+					m_player_queue.empty() && m_player_writing.empty())
+				return;
+			// Don't hang on a database that can't be written to
+			if(m_failing)
+				return;
+		}
+		if(!IsRunning()) {
+			// Nobody else is going to write it
+			while(writeBatch() && !m_failing);
+			return;
+		}
+		m_queue_sem.Post();
+		m_batch_done_sem.Wait(100);
+	}
+}
+
+void MapSaveThread::stopAndDrain()
+{
+	if(IsRunning()) {
+		Stop();
+		m_queue_sem.Post();
+		Wait();
+	}
+	// Write whatever was queued after the thread had already stopped
+	while(writeBatch() && !m_failing);
+
+	JMutexAutoLock lock(m_queue_mutex);
+	if(!m_queue.empty() || !m_player_queue.empty())
+		errorstream<<"MapSaveThread: "<<m_queue.size()
+				<<" blocks and "<<m_player_queue.size()
+				<<" players could not be written"<<std::endl;
+}
+
+std::string MapSaveThread::loadBlock(v3s16 p)
+{
+	std::string data;
+	u32 batches_written;
+	LoadInFlight *load;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		if(getPendingOrCached(p, data))
+			return data;
+		load = beginLoad(p);
+		batches_written = m_batches_written;
+	}
+	if(load != NULL) {
+		waitLoad(p, load, data);
+		return data;
+	}
+	try {
+		JMutexAutoLock lock(*m_db_load_mutex);
+		MetricsScopeTimer timer(&g_server_metrics.db_load_time);
+		data = m_db->loadBlock(p);
+	} catch(...) {
+		// The threads waiting for the read mustn't wait forever
+		JMutexAutoLock lock(m_queue_mutex);
+		finishLoad(p, "");
+		throw;
+	}
+	JMutexAutoLock lock(m_queue_mutex);
+	// Don't cache what might have been overwritten meanwhile
+	if(m_batches_written == batches_written)
+		cacheLoadedBlock(p, data);
+	finishLoad(p, data);
+	return data;
+}
+
+void MapSaveThread::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::vector<std::string> &data)
+{
+	data.clear();
+	data.resize(blockpos.size());
+
+	// Indices of the blocks that have to be read from the database, and
+	// of the ones that other threads are reading already
+	std::vector<size_t> from_db;
+	std::vector<std::pair<size_t, LoadInFlight*> > from_others;
+	u32 batches_written;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		for(size_t k = 0; k < blockpos.size(); k++) {
+			if(getPendingOrCached(blockpos[k], data[k]))
+				continue;
+			LoadInFlight *load = beginLoad(blockpos[k]);
+			if(load != NULL)
+				from_others.push_back(std::make_pair(k, load));
+			else
+				from_db.push_back(k);
+		}
+		batches_written = m_batches_written;
+	}
+	if(!from_db.empty()) {
+		try {
+			loadBlocksFromDatabase(blockpos, from_db, batches_written, data);
+		} catch(...) {
+			JMutexAutoLock lock(m_queue_mutex);
+			for(size_t k = 0; k < from_others.size(); k++)
+				releaseLoad(from_others[k].second);
+			throw;
+		}
+	}
+
+	// Only waited for after finishing the own reads, so that two threads
+	// loading overlapping batches can't wait for each other
+	for(size_t k = 0; k < from_others.size(); k++) {
+		size_t i = from_others[k].first;
+		waitLoad(blockpos[i], from_others[k].second, data[i]);
+	}
+}
+
+void MapSaveThread::loadBlocksFromDatabase(
+		const std::vector<v3s16> &blockpos,
+		const std::vector<size_t> &from_db, u32 batches_written,
+		std::vector<std::string> &data)
+{
+	std::vector<v3s16> db_pos;
+	for(size_t k = 0; k < from_db.size(); k++)
+		db_pos.push_back(blockpos[from_db[k]]);
+
+	std::vector<std::string> db_data;
+	try {
+		JMutexAutoLock lock(*m_db_load_mutex);
+		MetricsScopeTimer timer(&g_server_metrics.db_load_time);
+		m_db->loadBlocks(db_pos, db_data);
+	} catch(...) {
+		// The threads waiting for the reads mustn't wait forever
+		JMutexAutoLock lock(m_queue_mutex);
+		for(size_t k = 0; k < db_pos.size(); k++)
+			finishLoad(db_pos[k], "");
+		throw;
+	}
+
+	JMutexAutoLock lock(m_queue_mutex);
+	for(size_t k = 0; k < from_db.size(); k++) {
+		if(m_batches_written == batches_written)
+			cacheLoadedBlock(db_pos[k], db_data[k]);
+		finishLoad(db_pos[k], db_data[k]);
+		data[from_db[k]].swap(db_data[k]);
+	}
+}
+
+void MapSaveThread::prefetchBlocks(const std::vector<v3s16> &blockpos)
+{
+	// Without the cache the blocks would just be read twice
+	if(m_cache_size_max == 0)
+		return;
+	std::vector<std::string> data;
+	loadBlocks(blockpos, data);
+}
+
+void MapSaveThread::queuePlayer(const std::string &name,
+		const std::string &data)
+{
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		m_player_queue[name] = data;
+	}
+	m_queue_sem.Post();
+}
+
+bool MapSaveThread::loadPlayer(const std::string &name, std::string &data)
+{
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		std::map<std::string, std::string>::iterator i =
+				m_player_queue.find(name);
+		if(i != m_player_queue.end()) {
+			data = i->second;
+			return true;
+		}
+		i = m_player_writing.find(name);
+		if(i != m_player_writing.end()) {
+			data = i->second;
+			return true;
+		}
+	}
+	JMutexAutoLock lock(*m_db_load_mutex);
+	data = m_db->loadPlayer(name);
+	return !data.empty();
+}
+
+void MapSaveThread::listPlayers(std::vector<std::string> &dst)
+{
+	flush();
+	JMutexAutoLock lock(m_db_mutex);
+	m_db->listPlayers(dst);
+}
+
+bool MapSaveThread::supportsPlayers()
+{
+	return m_db->supportsPlayers();
+}
+
+bool MapSaveThread::getPendingOrCached(v3s16 p, std::string &data)
+{
+	std::map<v3s16, QueuedBlock>::iterator i = m_queue.find(p);
+	if(i != m_queue.end()) {
+		data = i->second.data;
+		return true;
+	}
+	i = m_writing.find(p);
+	if(i != m_writing.end()) {
+		data = i->second.data;
+		return true;
+	}
+	std::map<v3s16, CachedBlock>::iterator c = m_cache.find(p);
+	if(c != m_cache.end()) {
+		data = c->second.data;
+		// Move to the front of the LRU list
+		m_cache_lru.splice(m_cache_lru.begin(), m_cache_lru,
+				c->second.lru_position);
+		g_profiler->add("MapSaveThread: block cache hits", 1);
+		return true;
+	}
+	return false;
+}
+
+void MapSaveThread::cacheBlock(v3s16 p, const std::string &data)
+{
+	std::map<v3s16, CachedBlock>::iterator i = m_cache.find(p);
+	if(i != m_cache.end())
+		uncacheBlock(i);
+
+	if(data.empty() || data.size() > m_cache_size_max)
+		return;
+
+	// Evict least recently used blocks to make room
+	while(m_cache_size + data.size() > m_cache_size_max)
+		uncacheBlock(m_cache.find(m_cache_lru.back()));
+
+	m_cache_lru.push_front(p);
+	CachedBlock &c = m_cache[p];
+	c.data = data;
+	c.lru_position = m_cache_lru.begin();
+	m_cache_size += data.size();
+}
+
+void MapSaveThread::uncacheBlock(std::map<v3s16, CachedBlock>::iterator i)
+{
+	m_cache_size -= i->second.data.size();
+	m_cache_lru.erase(i->second.lru_position);
+	m_cache.erase(i);
+}
+
+void MapSaveThread::cacheLoadedBlock(v3s16 p, const std::string &data)
+{
+	if(m_queue.find(p) != m_queue.end() ||
+			m_writing.find(p) != m_writing.end() ||
+			m_cache.find(p) != m_cache.end())
+		return;
+	cacheBlock(p, data);
+}
+
+MapSaveThread::LoadInFlight * MapSaveThread::beginLoad(v3s16 p)
+{
+	std::map<v3s16, LoadInFlight*>::iterator i = m_loading.find(p);
+	if(i != m_loading.end()) {
+		i->second->refs++;
+		g_profiler->add("MapSaveThread: shared block loads", 1);
+		return i->second;
+	}
+	LoadInFlight *load = new LoadInFlight;
+	load->refs = 1;
+	m_loading[p] = load;
+	return NULL;
+}
+
+void MapSaveThread::finishLoad(v3s16 p, const std::string &data)
+{
+	std::map<v3s16, LoadInFlight*>::iterator i = m_loading.find(p);
+	assert(i != m_loading.end());
+	LoadInFlight *load = i->second;
+	m_loading.erase(i);
+	load->data = data;
+	for(u32 k = 1; k < load->refs; k++)
+		load->done.Post();
+	releaseLoad(load);
+}
+
+void MapSaveThread::releaseLoad(LoadInFlight *load)
+{
+	if(--load->refs == 0)
+		delete load;
+}
+
+void MapSaveThread::waitLoad(v3s16 p, LoadInFlight *load, std::string &data)
+{
+	load->done.Wait();
+	JMutexAutoLock lock(m_queue_mutex);
+	// Newer data may have been queued while it was read
+	if(!getPendingOrCached(p, data))
+		data = load->data;
+	releaseLoad(load);
+}
+
+bool MapSaveThread::listLoadableBlocks(std::string &cursor, u32 max_count,
+		std::vector<v3s16> &dst)
+{
+	// Make sure blocks queued before listing started are included
+	if(cursor.empty())
+		flush();
+	JMutexAutoLock lock(m_db_mutex);
+	return m_db->listLoadableBlocks(cursor, max_count, dst);
+}
+
+int MapSaveThread::databaseInitialized()
+{
+	JMutexAutoLock lock(m_db_mutex);
+	return m_db->Initialized();
+}
+
+bool MapSaveThread::writeBatch()
+{
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		if(m_queue.empty() && m_player_queue.empty())
+			return false;
+		assert(m_writing.empty() && m_player_writing.empty());
+		// Players are few, so they are written all at once
+		m_player_writing.swap(m_player_queue);
+		u32 count = 0;
+		while(!m_queue.empty() && count < MAP_SAVE_BATCH_MAX_BLOCKS) {
+			std::map<v3s16, QueuedBlock>::iterator i = m_queue.begin();
+			QueuedBlock &q = m_writing[i->first];
+			q.data.swap(i->second.data);
+			q.ticket = i->second.ticket;
+			m_queue.erase(i);
+			count++;
+		}
+	}
+
+	ScopeProfiler sp(g_profiler, "MapSaveThread: write batch", SPT_AVG);
+
+	// The data in m_writing is only read by other threads while this
+	// thread writes it, so it can be used without holding m_queue_mutex
+	std::list<v3s16> failed;
+	std::list<std::string> failed_players;
+	{
+		JMutexAutoLock lock(m_db_mutex);
+		MetricsScopeTimer timer(&g_server_metrics.db_save_time);
+		try {
+			m_db->beginSave();
+			for(std::map<v3s16, QueuedBlock>::iterator
+					i = m_writing.begin(); i != m_writing.end(); ++i) {
+				if(!m_db->saveBlock(i->first, i->second.data))
+					failed.push_back(i->first);
+			}
+			for(std::map<std::string, std::string>::iterator
+					i = m_player_writing.begin();
+					i != m_player_writing.end(); ++i) {
+				if(!m_db->savePlayer(i->first, i->second))
+					failed_players.push_back(i->first);
+			}
+			m_db->endSave();
+		} catch(std::exception &e) {
+			// Backends that write the whole batch at once fail here
+			errorstream<<"MapSaveThread: Writing batch failed: "
+					<<e.what()<<std::endl;
+			failed.clear();
+			for(std::map<v3s16, QueuedBlock>::iterator
+					i = m_writing.begin(); i != m_writing.end(); ++i)
+				failed.push_back(i->first);
+			failed_players.clear();
+			for(std::map<std::string, std::string>::iterator
+					i = m_player_writing.begin();
+					i != m_player_writing.end(); ++i)
+				failed_players.push_back(i->first);
+		}
+	}
+
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		for(std::list<v3s16>::iterator i = failed.begin();
+				i != failed.end(); ++i) {
+			errorstream<<"MapSaveThread: Failed to write block "
+					<<PP(*i)<<", retrying later"<<std::endl;
+			// Keep it queued unless newer data has been queued already
+			if(m_queue.find(*i) == m_queue.end())
+				m_queue[*i] = m_writing[*i];
+			m_writing.erase(*i);
+		}
+		for(std::list<std::string>::iterator i = failed_players.begin();
+				i != failed_players.end(); ++i) {
+			errorstream<<"MapSaveThread: Failed to write player "
+					<<*i<<", retrying later"<<std::endl;
+			if(m_player_queue.find(*i) == m_player_queue.end())
+				m_player_queue[*i] = m_player_writing[*i];
+		}
+		for(std::map<v3s16, QueuedBlock>::iterator
+				i = m_writing.begin(); i != m_writing.end(); ++i)
+			m_written.push_back(std::make_pair(i->first, i->second.ticket));
+		m_writing.clear();
+		m_player_writing.clear();
+		m_failing = !failed.empty() || !failed_players.empty();
+		m_batches_written++;
+	}
+
+	m_batch_done_sem.Post();
+
+	// Don't spin on a database that keeps failing
+	if(!failed.empty() || !failed_players.empty())
+		sleep_ms(1000);
+
+	return true;
+}
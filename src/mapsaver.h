@@ -0,0 +1,172 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPSAVER_HEADER
+#define MAPSAVER_HEADER
+
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+#include "irr_v3d.h"
+#include "irrlichttypes.h"
+#include "jthread/jthread.h"
+#include "jthread/jmutex.h"
+#include "jthread/jsemaphore.h"
+
+class Database;
+
+/*
+	Writes serialized MapBlocks to the database in the background.
+
+	The thread owns the database handle; everything else accesses the
+	database through it. Queued blocks are written in batches, each batch
+	inside one beginSave()/endSave() pair. Blocks that are queued but not
+	yet written are returned by loadBlock(), so a block can be unloaded
+	before its data has reached the disk.
+
+	Recently saved and loaded blocks are also kept in a size-limited
+	cache of serialized blocks, so that blocks that are unloaded and soon
+	loaded again don't have to be read from the database.
+*/
+class MapSaveThread : public JThread
+{
+public:
+	// cache_size is the memory limit of the block cache in bytes
+	MapSaveThread(Database *db, size_t cache_size);
+	~MapSaveThread();
+
+	void *Thread();
+
+	// Queues a block for writing, replacing older queued data of it.
+	// Returns a ticket that is reported by getWrittenBlocks() once the
+	// data has been written.
+	u32 queueBlock(v3s16 p, const std::string &data);
+	// Blocks written since the last call, as (position, ticket) pairs
+	void getWrittenBlocks(std::list<std::pair<v3s16, u32> > &dst);
+	// Waits until everything queued so far has been written
+	void flush();
+	// Stops the thread after writing everything that is queued
+	void stopAndDrain();
+
+	// Loads from other threads that want a block that is being read from
+	// the database wait for that read and share its data
+	std::string loadBlock(v3s16 p);
+	void loadBlocks(const std::vector<v3s16> &blockpos,
+			std::vector<std::string> &data);
+	// Reads the blocks into the cache, if the cache is enabled
+	void prefetchBlocks(const std::vector<v3s16> &blockpos);
+	bool listLoadableBlocks(std::string &cursor, u32 max_count,
+			std::vector<v3s16> &dst);
+	int databaseInitialized();
+
+	// Player data is queued and written like blocks, if the database
+	// supports storing it
+	bool supportsPlayers();
+	void queuePlayer(const std::string &name, const std::string &data);
+	// Returns false if the player isn't stored
+	bool loadPlayer(const std::string &name, std::string &data);
+	// The players stored in the database, queued ones included
+	void listPlayers(std::vector<std::string> &dst);
+
+private:
+	struct QueuedBlock
+	{
+		std::string data;
+		u32 ticket;
+	};
+
+	struct CachedBlock
+	{
+		std::string data;
+		std::list<v3s16>::iterator lru_position;
+	};
+
+	// A read of a block from the database, which the other loads of the
+	// block wait for instead of reading it again
+	struct LoadInFlight
+	{
+		std::string data;
+		// The reading thread and the waiting ones
+		u32 refs;
+		JSemaphore done;
+	};
+
+	bool writeBatch();
+	// Reads the blocks of blockpos at the indices from_db, registered by
+	// beginLoad(), and finishes their loads
+	void loadBlocksFromDatabase(const std::vector<v3s16> &blockpos,
+			const std::vector<size_t> &from_db, u32 batches_written,
+			std::vector<std::string> &data);
+
+	// These require m_queue_mutex to be locked
+	bool getPendingOrCached(v3s16 p, std::string &data);
+	void cacheBlock(v3s16 p, const std::string &data);
+	void uncacheBlock(std::map<v3s16, CachedBlock>::iterator i);
+	// Caches data read from the database, unless newer data is around
+	void cacheLoadedBlock(v3s16 p, const std::string &data);
+	// Returns the read of p by another thread, referenced for waitLoad(),
+	// or NULL after registering a read by the caller for finishLoad()
+	LoadInFlight *beginLoad(v3s16 p);
+	// Hands the data read by the caller to the threads waiting for it
+	void finishLoad(v3s16 p, const std::string &data);
+	void releaseLoad(LoadInFlight *load);
+	// Waits for a read returned by beginLoad(); locks m_queue_mutex itself
+	void waitLoad(v3s16 p, LoadInFlight *load, std::string &data);
+
+	Database *m_db;
+	// Serializes all use of m_db, except loads if the database supports
+	// loading while saving; those are serialized by m_db_read_mutex
+	JMutex m_db_mutex;
+	JMutex m_db_read_mutex;
+	JMutex *m_db_load_mutex;
+
+	// Protects everything below
+	JMutex m_queue_mutex;
+	// Blocks waiting to be written
+	std::map<v3s16, QueuedBlock> m_queue;
+	// Blocks of the batch that is being written
+	std::map<v3s16, QueuedBlock> m_writing;
+	std::list<std::pair<v3s16, u32> > m_written;
+	// Players waiting to be written and being written, by name
+	std::map<std::string, std::string> m_player_queue;
+	std::map<std::string, std::string> m_player_writing;
+	u32 m_next_ticket;
+	// Set if the last batch could not be written completely
+	bool m_failing;
+
+	// Serialized block cache; most recently used first in m_cache_lru
+	std::map<v3s16, CachedBlock> m_cache;
+	std::list<v3s16> m_cache_lru;
+	size_t m_cache_size;
+	size_t m_cache_size_max;
+	// Counts finished batches; loads don't cache data if a batch has been
+	// written while they read from the database
+	u32 m_batches_written;
+	// Blocks being read from the database
+	std::map<v3s16, LoadInFlight*> m_loading;
+
+	// Posted when blocks are queued or the thread should stop
+	JSemaphore m_queue_sem;
+	// Posted after every batch
+	JSemaphore m_batch_done_sem;
+};
+
+#endif
+
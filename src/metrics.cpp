@@ -0,0 +1,164 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "metrics.h"
+#include <sstream>
+#include "jthread/jmutexautolock.h"
+#include "filesys.h"
+#include "log.h"
+#include "debug.h"
+#include "util/numeric.h"
+
+static const float step_time_bounds[] = {
+	0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5,
+};
+static const float db_time_bounds[] = {
+	0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1,
+};
+
+ServerMetrics g_server_metrics;
+
+/*
+	MetricsHistogram
+*/
+
+MetricsHistogram::MetricsHistogram(const float *bounds, u32 bound_count):
+	m_bounds(bounds, bounds + bound_count),
+	m_counts(bound_count + 1, 0),
+	m_count(0),
+	m_sum(0)
+{
+}
+
+void MetricsHistogram::observe(float value)
+{
+	u32 bucket = 0;
+	while(bucket < m_bounds.size() && value > m_bounds[bucket])
+		bucket++;
+
+	JMutexAutoLock lock(m_mutex);
+	m_counts[bucket]++;
+	m_count++;
+	m_sum += value;
+}
+
+void MetricsHistogram::write(std::ostream &os, const std::string &name)
+{
+	std::vector<u32> counts;
+	u32 count;
+	double sum;
+	{
+		JMutexAutoLock lock(m_mutex);
+		counts = m_counts;
+		count = m_count;
+		sum = m_sum;
+	}
+
+	os<<"# TYPE "<<name<<" histogram\n";
+	u32 cumulative = 0;
+	for(u32 i = 0; i < m_bounds.size(); i++){
+		cumulative += counts[i];
+		os<<name<<"_bucket{le=\""<<m_bounds[i]<<"\"} "<<cumulative<<"\n";
+	}
+	os<<name<<"_bucket{le=\"+Inf\"} "<<count<<"\n";
+	os<<name<<"_sum "<<sum<<"\n";
+	os<<name<<"_count "<<count<<"\n";
+}
+
+/*
+	ServerMetrics
+*/
+
+ServerMetrics::ServerMetrics():
+	step_time(step_time_bounds, ARRLEN(step_time_bounds)),
+	db_load_time(db_time_bounds, ARRLEN(db_time_bounds)),
+	db_save_time(db_time_bounds, ARRLEN(db_time_bounds)),
+	lua_gc_time(db_time_bounds, ARRLEN(db_time_bounds))
+{
+}
+
+void ServerMetrics::setGauges(const std::map<std::string, float> &gauges)
+{
+	JMutexAutoLock lock(m_gauges_mutex);
+	m_gauges = gauges;
+}
+
+void ServerMetrics::write(std::ostream &os)
+{
+	step_time.write(os, "minetest_server_step_seconds");
+	db_load_time.write(os, "minetest_db_load_seconds");
+	db_save_time.write(os, "minetest_db_save_seconds");
+	lua_gc_time.write(os, "minetest_lua_gc_seconds");
+
+	std::map<std::string, float> gauges;
+	{
+		JMutexAutoLock lock(m_gauges_mutex);
+		gauges = m_gauges;
+	}
+
+	// The series of a metric are next to each other, as they are sorted
+	std::string last_name;
+	for(std::map<std::string, float>::iterator
+			i = gauges.begin();
+			i != gauges.end(); ++i)
+	{
+		std::string name = i->first.substr(0, i->first.find('{'));
+		if(name != last_name){
+			os<<"# TYPE "<<name<<" gauge\n";
+			last_name = name;
+		}
+		os<<i->first<<" "<<i->second<<"\n";
+	}
+}
+
+/*
+	MetricsThread
+*/
+
+void * MetricsThread::Thread()
+{
+	log_register_thread("MetricsThread");
+
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	ThreadStarted();
+
+	porting::setThreadName("MetricsThread");
+
+	u32 interval_ms = MYMAX(m_interval, 0.1) * 1000;
+	u32 waited_ms = 0;
+	while(!StopRequested()){
+		// Wake up often enough to stop quickly
+		sleep_ms(100);
+		waited_ms += 100;
+		if(waited_ms < interval_ms)
+			continue;
+		waited_ms = 0;
+
+		std::ostringstream os(std::ios_base::binary);
+		g_server_metrics.write(os);
+		if(!fs::safeWriteToFile(m_path, os.str()))
+			errorstream<<"MetricsThread: failed to write "<<m_path<<std::endl;
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
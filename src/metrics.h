@@ -0,0 +1,127 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef METRICS_HEADER
+#define METRICS_HEADER
+
+#include "irrlichttypes.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include "jthread/jthread.h"
+#include "jthread/jmutex.h"
+#include "porting.h"
+
+/*
+	Server metrics
+
+	The values are kept by the threads that produce them and written to
+	a file in the Prometheus text format by MetricsThread, for example
+	for the textfile collector of the node exporter.  Every value has a
+	mutex of its own, which is held only to update or copy the value, so
+	writing the file doesn't hold up the server.
+*/
+
+class MetricsHistogram
+{
+public:
+	// bounds are the upper bounds of the buckets, in ascending order
+	MetricsHistogram(const float *bounds, u32 bound_count);
+
+	void observe(float value);
+	void write(std::ostream &os, const std::string &name);
+
+private:
+	JMutex m_mutex;
+	std::vector<float> m_bounds;
+	// Not cumulative; the last one counts the values above all bounds
+	std::vector<u32> m_counts;
+	u32 m_count;
+	double m_sum;
+};
+
+class ServerMetrics
+{
+public:
+	ServerMetrics();
+
+	// In seconds; db_load_time per load request, db_save_time per
+	// written batch
+	MetricsHistogram step_time;
+	MetricsHistogram db_load_time;
+	MetricsHistogram db_save_time;
+	// Time spent stepping the Lua garbage collector, per server step
+	MetricsHistogram lua_gc_time;
+
+	// Replaces the gauges.  The keys are the series, like
+	// minetest_peer_rtt_seconds{peer="2"}
+	void setGauges(const std::map<std::string, float> &gauges);
+
+	void write(std::ostream &os);
+
+private:
+	JMutex m_gauges_mutex;
+	std::map<std::string, float> m_gauges;
+};
+
+extern ServerMetrics g_server_metrics;
+
+// Observes the time it exists for, in seconds
+class MetricsScopeTimer
+{
+public:
+	MetricsScopeTimer(MetricsHistogram *histogram):
+		m_histogram(histogram),
+		m_start_us(porting::getTimeUs())
+	{}
+	~MetricsScopeTimer()
+	{
+		m_histogram->observe(
+				(u32)(porting::getTimeUs() - m_start_us) / 1000000.0);
+	}
+
+private:
+	MetricsHistogram *m_histogram;
+	u32 m_start_us;
+};
+
+// Writes g_server_metrics to path every interval seconds
+class MetricsThread : public JThread
+{
+public:
+	MetricsThread(const std::string &path, float interval):
+		JThread(),
+		m_path(path),
+		m_interval(interval)
+	{}
+
+	void *Thread();
+
+	float getInterval() const
+	{
+		return m_interval;
+	}
+
+private:
+	std::string m_path;
+	float m_interval;
+};
+
+#endif
@@ -26,9 +26,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "main.h"
 #include "util/mathconstants.h"
 #include "porting.h"
+#include <algorithm>
 
 const char *BiomeManager::ELEMENT_TITLE = "biome";
 
+// Number of cells of the biome lookup grid along heat and humidity
+#define BIOME_LOOKUP_GRID_SIZE 32
+
 NoiseParams nparams_biome_def_heat(50, 50, v3f(500.0, 500.0, 500.0), 5349, 3, 0.70);
 NoiseParams nparams_biome_def_humidity(50, 50, v3f(500.0, 500.0, 500.0), 842, 3, 0.55);
 
@@ -36,7 +40,8 @@ NoiseParams nparams_biome_def_humidity(50, 50, v3f(500.0, 500.0, 500.0), 842, 3,
 ///////////////////////////////////////////////////////////////////////////////
 
 
-BiomeManager::BiomeManager(IGameDef *gamedef)
+BiomeManager::BiomeManager(IGameDef *gamedef) :
+	m_lookup_valid(false)
 {
 	NodeResolver *resolver = gamedef->getNodeDefManager()->getResolver();
 
@@ -76,7 +81,115 @@ BiomeManager::~BiomeManager()
 
 
 
-// just a PoC, obviously needs optimization later on (precalculate this)
+u32 BiomeManager::add(GenElement *elem)
+{
+	m_lookup_valid = false;
+	return GenElementManager::add(elem);
+}
+
+
+GenElement *BiomeManager::update(u32 id, GenElement *elem)
+{
+	m_lookup_valid = false;
+	return GenElementManager::update(id, elem);
+}
+
+
+GenElement *BiomeManager::remove(u32 id)
+{
+	m_lookup_valid = false;
+	return GenElementManager::remove(id);
+}
+
+
+void BiomeManager::updateLookup()
+{
+	const int gsize = BIOME_LOOKUP_GRID_SIZE;
+
+	m_lookup_valid = false;
+	m_lookup_band_min.clear();
+	m_lookup_cells.clear();
+	m_lookup_candidates.clear();
+
+	// The grid covers the usual 0..100 range of heat and humidity and
+	// every biome point, with some margin; values outside of it are
+	// looked up from all biomes
+	float hmin = 0.0, hmax = 100.0, umin = 0.0, umax = 100.0;
+	std::vector<Biome *> biomes;
+	std::vector<s32> bounds;
+	for (size_t i = 1; i < m_elements.size(); i++) {
+		Biome *b = (Biome *)m_elements[i];
+		if (!b)
+			continue;
+		biomes.push_back(b);
+		hmin = MYMIN(hmin, b->heat_point);
+		hmax = MYMAX(hmax, b->heat_point);
+		umin = MYMIN(umin, b->humidity_point);
+		umax = MYMAX(umax, b->humidity_point);
+		bounds.push_back(b->height_min);
+		bounds.push_back((s32)b->height_max + 1);
+	}
+
+	float size = MYMAX(hmax - hmin, umax - umin) + 20.0;
+	m_lookup_heat_min     = (hmin + hmax - size) / 2;
+	m_lookup_humidity_min = (umin + umax - size) / 2;
+	m_lookup_cell_size    = size / gsize;
+
+	std::sort(bounds.begin(), bounds.end());
+	bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+	m_lookup_band_min = bounds;
+
+	std::vector<Biome *> present;
+	for (size_t band = 0; band <= bounds.size(); band++) {
+		s32 y = band ? bounds[band - 1] : (bounds.empty() ? 0 : bounds[0] - 1);
+		present.clear();
+		for (size_t i = 0; i != biomes.size(); i++) {
+			if (y >= biomes[i]->height_min && y <= biomes[i]->height_max)
+				present.push_back(biomes[i]);
+		}
+
+		for (int cy = 0; cy != gsize; cy++)
+		for (int cx = 0; cx != gsize; cx++) {
+			float h0 = m_lookup_heat_min + cx * m_lookup_cell_size;
+			float h1 = h0 + m_lookup_cell_size;
+			float u0 = m_lookup_humidity_min + cy * m_lookup_cell_size;
+			float u1 = u0 + m_lookup_cell_size;
+
+			// No point of the cell is farther than dist_max from the
+			// closest biome, so biomes closer than that to the cell are all
+			// that can be the closest one
+			float dist_max = FLT_MAX;
+			for (size_t i = 0; i != present.size(); i++) {
+				float dh = MYMAX(fabs(present[i]->heat_point - h0),
+					fabs(present[i]->heat_point - h1));
+				float du = MYMAX(fabs(present[i]->humidity_point - u0),
+					fabs(present[i]->humidity_point - u1));
+				dist_max = MYMIN(dist_max, dh * dh + du * du);
+			}
+			// Leave room for rounding in getBiomeFromAll()
+			dist_max = dist_max * 1.001 + 0.001;
+
+			m_lookup_cells.push_back(m_lookup_candidates.size());
+			for (size_t i = 0; i != present.size(); i++) {
+				float p_h = present[i]->heat_point;
+				float p_u = present[i]->humidity_point;
+				float dh = MYMAX(MYMAX(h0 - p_h, p_h - h1), 0);
+				float du = MYMAX(MYMAX(u0 - p_u, p_u - u1), 0);
+				if (dh * dh + du * du <= dist_max)
+					m_lookup_candidates.push_back(present[i]->id);
+			}
+		}
+	}
+	m_lookup_cells.push_back(m_lookup_candidates.size());
+
+	m_lookup_valid = true;
+
+	verbosestream << "BiomeManager: lookup has " << (bounds.size() + 1)
+		<< " height bands, " << m_lookup_candidates.size()
+		<< " candidates for " << biomes.size() << " biomes" << std::endl;
+}
+
+
 void BiomeManager::calcBiomes(s16 sx, s16 sy, float *heat_map,
 	float *humidity_map, s16 *height_map, u8 *biomeid_map)
 {
@@ -92,6 +205,43 @@ void BiomeManager::calcBiomes(s16 sx, s16 sy, float *heat_map,
 
 
 Biome *BiomeManager::getBiome(float heat, float humidity, s16 y)
+{
+	if (!m_lookup_valid)
+		return getBiomeFromAll(heat, humidity, y);
+
+	const int gsize = BIOME_LOOKUP_GRID_SIZE;
+	float fx = (heat     - m_lookup_heat_min)     / m_lookup_cell_size;
+	float fy = (humidity - m_lookup_humidity_min) / m_lookup_cell_size;
+	// Also false for NaN
+	if (!(fx >= 0 && fx < gsize && fy >= 0 && fy < gsize))
+		return getBiomeFromAll(heat, humidity, y);
+
+	size_t band = std::upper_bound(m_lookup_band_min.begin(),
+		m_lookup_band_min.end(), (s32)y) - m_lookup_band_min.begin();
+	size_t cell = band * gsize * gsize + (int)fy * gsize + (int)fx;
+
+	// Same comparisons, in the same order, as in getBiomeFromAll()
+	Biome *b, *biome_closest = NULL;
+	float dist_min = FLT_MAX;
+
+	for (u32 i = m_lookup_cells[cell]; i != m_lookup_cells[cell + 1]; i++) {
+		b = (Biome *)m_elements[m_lookup_candidates[i]];
+
+		float d_heat     = heat     - b->heat_point;
+		float d_humidity = humidity - b->humidity_point;
+		float dist = (d_heat * d_heat) +
+					 (d_humidity * d_humidity);
+		if (dist < dist_min) {
+			dist_min = dist;
+			biome_closest = b;
+		}
+	}
+
+	return biome_closest ? biome_closest : (Biome *)m_elements[0];
+}
+
+
+Biome *BiomeManager::getBiomeFromAll(float heat, float humidity, s16 y)
 {
 	Biome *b, *biome_closest = NULL;
 	float dist_min = FLT_MAX;
@@ -113,4 +263,3 @@ Biome *BiomeManager::getBiome(float heat, float humidity, s16 y)
 	
 	return biome_closest ? biome_closest : (Biome *)m_elements[0];
 }
-
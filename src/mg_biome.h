@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef MG_BIOME_HEADER
 #define MG_BIOME_HEADER
 
+#include <vector>
 #include "mapgen.h"
 #include "noise.h"
 
@@ -72,9 +73,39 @@ class BiomeManager : public GenElementManager {
 		return new Biome;
 	}
 
+	u32 add(GenElement *elem);
+	GenElement *update(u32 id, GenElement *elem);
+	GenElement *remove(u32 id);
+
+	// Precomputes the candidate biomes of each part of the heat/humidity
+	// plane used by getBiome().  Must be called again after biomes are
+	// changed, until then getBiome() checks every biome.
+	void updateLookup();
+
 	void calcBiomes(s16 sx, s16 sy, float *heat_map, float *humidity_map,
 		s16 *height_map, u8 *biomeid_map);
 	Biome *getBiome(float heat, float humidity, s16 y);
+
+private:
+	/*
+		The heat/humidity plane is divided into a grid of cells, and the
+		y axis into bands over which the set of biomes existing at that
+		height is the same.  For every band and cell, only the biomes that
+		can be the closest one to some point of the cell are candidates.
+	*/
+	bool m_lookup_valid;
+	float m_lookup_heat_min;
+	float m_lookup_humidity_min;
+	float m_lookup_cell_size;
+	// Lowest y of every band but the first
+	std::vector<s32> m_lookup_band_min;
+	// m_lookup_candidates[m_lookup_cells[i]] to
+	// m_lookup_candidates[m_lookup_cells[i + 1] - 1] are the biome ids of
+	// cell (i % cells per band), band (i / cells per band), in id order
+	std::vector<u32> m_lookup_cells;
+	std::vector<u8> m_lookup_candidates;
+
+	Biome *getBiomeFromAll(float heat, float humidity, s16 y);
 };
 
 #endif
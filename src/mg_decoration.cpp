@@ -23,6 +23,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "noise.h"
 #include "map.h"
 #include "log.h"
+#include "profiler.h"
+#include "main.h" // For g_profiler
 #include "util/numeric.h"
 
 const char *DecorationManager::ELEMENT_TITLE = "decoration";
@@ -40,6 +42,7 @@ FlagDesc flagdesc_deco_schematic[] = {
 
 size_t DecorationManager::placeAllDecos(Mapgen *mg, u32 seed, v3s16 nmin, v3s16 nmax)
 {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen decorations", SPT_AVG);
 	size_t nplaced = 0;
 
 	for (size_t i = 0; i != m_elements.size(); i++) {
@@ -88,12 +91,22 @@ size_t Decoration::placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 	s16 divlen = carea_size / sidelen;
 	int area = sidelen * sidelen;
 
+	// The amount of decorations of every part is taken from one noise map
+	// with a point sidelen nodes apart at each part center
+	NoiseParams np_parts;
+	Noise *noise = NULL;
+	if (np) {
+		np_parts = *np;
+		np_parts.spread /= sidelen;
+		noise = new Noise(&np_parts, mapseed, divlen, divlen);
+		noise->perlinMap2D(
+			(float)(nmin.X + sidelen / 2) / sidelen,
+			(float)(nmin.Z + sidelen / 2) / sidelen);
+		noise->transformNoiseMap();
+	}
+
 	for (s16 z0 = 0; z0 < divlen; z0++)
 	for (s16 x0 = 0; x0 < divlen; x0++) {
-		v2s16 p2d_center( // Center position of part of division
-			nmin.X + sidelen / 2 + sidelen * x0,
-			nmin.Z + sidelen / 2 + sidelen * z0
-		);
 		v2s16 p2d_min( // Minimum edge of part of division
 			nmin.X + sidelen * x0,
 			nmin.Z + sidelen * z0
@@ -104,8 +117,8 @@ size_t Decoration::placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 		);
 
 		// Amount of decorations
-		float nval = np ?
-			NoisePerlin2D(np, p2d_center.X, p2d_center.Y, mapseed) :
+		float nval = noise ?
+			noise->result[z0 * divlen + x0] :
 			fill_ratio;
 		u32 deco_count = area * MYMAX(nval, 0.f);
 
@@ -148,6 +161,7 @@ size_t Decoration::placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 		}
 	}
 
+	delete noise;
 	return 0;
 }
 
@@ -23,6 +23,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include "map.h"
 #include "log.h"
+#include "profiler.h"
+#include "main.h" // For g_profiler
 
 const char *OreManager::ELEMENT_TITLE = "ore";
 
@@ -39,14 +41,32 @@ FlagDesc flagdesc_ore[] = {
 
 size_t OreManager::placeAllOres(Mapgen *mg, u32 seed, v3s16 nmin, v3s16 nmax)
 {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen ores", SPT_AVG);
 	size_t nplaced = 0;
 
+	// Find the contents the ores could replace once, so that ores that
+	// can only be placed in nodes absent from the chunk are skipped
+	std::vector<bool> present(1 << (sizeof(content_t) * 8), false);
+	findPresentContents(mg->vm, nmin, nmax, present);
+
 	for (size_t i = 0; i != m_elements.size(); i++) {
 		Ore *ore = (Ore *)m_elements[i];
 		if (!ore)
 			continue;
 
-		nplaced += ore->placeOre(mg, seed, nmin, nmax);
+		bool wherein_present = false;
+		for (size_t j = 0; j != ore->c_wherein.size(); j++) {
+			if (present[ore->c_wherein[j]]) {
+				wherein_present = true;
+				break;
+			}
+		}
+
+		if (wherein_present) {
+			nplaced += ore->placeOre(mg, seed, nmin, nmax);
+			// Later ores may be placed in this one
+			present[ore->c_ore] = true;
+		}
 		seed++;
 	}
 
@@ -54,6 +74,21 @@ size_t OreManager::placeAllOres(Mapgen *mg, u32 seed, v3s16 nmin, v3s16 nmax)
 }
 
 
+void OreManager::findPresentContents(ManualMapVoxelManipulator *vm,
+	v3s16 nmin, v3s16 nmax, std::vector<bool> &present)
+{
+	// Sheets can extend above and below the chunk, but not past the
+	// voxel manipulator
+	VoxelArea &area = vm->m_area;
+	for (s16 z = nmin.Z; z <= nmax.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++) {
+		u32 i = area.index(nmin.X, y, z);
+		for (s16 x = nmin.X; x <= nmax.X; x++, i++)
+			present[vm->m_data[i].getContent()] = true;
+	}
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 Ore::Ore()
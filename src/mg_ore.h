@@ -110,6 +110,10 @@ class OreManager : public GenElementManager {
 	}
 
 	size_t placeAllOres(Mapgen *mg, u32 seed, v3s16 nmin, v3s16 nmax);
+
+private:
+	void findPresentContents(ManualMapVoxelManipulator *vm,
+		v3s16 nmin, v3s16 nmax, std::vector<bool> &present);
 };
 
 #endif
@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include <fstream>
+#include <cstring>
 #include "mg_schematic.h"
 #include "mapgen.h"
 #include "map.h"
@@ -64,13 +65,80 @@ void Schematic::updateContentIds()
 
 void Schematic::blitToVManip(v3s16 p, ManualMapVoxelManipulator *vm,
 	Rotation rot, bool force_placement, INodeDefManager *ndef)
+{
+	const SchematicSpans &sp = getSpans(rot, ndef);
+	VoxelArea &area = vm->m_area;
+
+	s16 y_map = p.Y;
+	for (s16 y = 0; y != size.Y; y++) {
+		if (slice_probs[y] != MTSCHEM_PROB_ALWAYS &&
+			myrand_range(1, 255) > slice_probs[y])
+			continue;
+
+		for (u32 j = sp.slice_start[y]; j != sp.slice_start[y + 1]; j++) {
+			const SchematicSpan &span = sp.spans[j];
+			s16 z_map = p.Z + span.z;
+			if (y_map < area.MinEdge.Y || y_map > area.MaxEdge.Y ||
+				z_map < area.MinEdge.Z || z_map > area.MaxEdge.Z)
+				continue;
+
+			// Clip the span to the voxel manipulator
+			s16 x_start = p.X + span.x;
+			s16 x_min = MYMAX(x_start, area.MinEdge.X);
+			s16 x_max = MYMIN(x_start + span.length - 1, area.MaxEdge.X);
+			if (x_min > x_max)
+				continue;
+
+			u32 vi = area.index(x_min, y_map, z_map);
+			u32 i  = span.offset + (x_min - x_start);
+			u32 count = x_max - x_min + 1;
+
+			if (force_placement && !span.has_probs) {
+				memcpy(&vm->m_data[vi], &sp.nodes[i], count * sizeof(MapNode));
+				continue;
+			}
+
+			for (u32 k = 0; k != count; k++, vi++, i++) {
+				if (!force_placement) {
+					content_t c = vm->m_data[vi].getContent();
+					if (c != CONTENT_AIR && c != CONTENT_IGNORE)
+						continue;
+				}
+
+				if (sp.probs[i] != MTSCHEM_PROB_ALWAYS &&
+					myrand_range(1, 255) > sp.probs[i])
+					continue;
+
+				vm->m_data[vi] = sp.nodes[i];
+			}
+		}
+		y_map++;
+	}
+}
+
+
+const SchematicSpans &Schematic::getSpans(Rotation rot, INodeDefManager *ndef)
+{
+	JMutexAutoLock lock(m_spans_mutex);
+
+	updateContentIds();
+
+	if (!(flags & SCHEM_SPANS_UPDATED(rot))) {
+		makeSpans(rot, ndef, &m_spans[rot]);
+		flags |= SCHEM_SPANS_UPDATED(rot);
+	}
+
+	return m_spans[rot];
+}
+
+
+void Schematic::makeSpans(Rotation rot, INodeDefManager *ndef,
+	SchematicSpans *spans)
 {
 	int xstride = 1;
 	int ystride = size.X;
 	int zstride = size.X * size.Y;
 
-	updateContentIds();
-
 	s16 sx = size.X;
 	s16 sy = size.Y;
 	s16 sz = size.Z;
@@ -100,44 +168,51 @@ void Schematic::blitToVManip(v3s16 p, ManualMapVoxelManipulator *vm,
 			i_step_z = zstride;
 	}
 
-	s16 y_map = p.Y;
+	spans->spans.clear();
+	spans->slice_start.clear();
+	spans->nodes.clear();
+	spans->probs.clear();
+
 	for (s16 y = 0; y != sy; y++) {
-		if (slice_probs[y] != MTSCHEM_PROB_ALWAYS &&
-			myrand_range(1, 255) > slice_probs[y])
-			continue;
+		spans->slice_start.push_back(spans->spans.size());
 
 		for (s16 z = 0; z != sz; z++) {
+			SchematicSpan *span = NULL;
 			u32 i = z * i_step_z + y * ystride + i_start;
 			for (s16 x = 0; x != sx; x++, i += i_step_x) {
-				u32 vi = vm->m_area.index(p.X + x, y_map, p.Z + z);
-				if (!vm->m_area.contains(vi))
-					continue;
-
-				if (schemdata[i].getContent() == CONTENT_IGNORE)
+				if (schemdata[i].getContent() == CONTENT_IGNORE ||
+					schemdata[i].param1 == MTSCHEM_PROB_NEVER) {
+					span = NULL;
 					continue;
-
-				if (schemdata[i].param1 == MTSCHEM_PROB_NEVER)
-					continue;
-
-				if (!force_placement) {
-					content_t c = vm->m_data[vi].getContent();
-					if (c != CONTENT_AIR && c != CONTENT_IGNORE)
-						continue;
 				}
 
-				if (schemdata[i].param1 != MTSCHEM_PROB_ALWAYS &&
-					myrand_range(1, 255) > schemdata[i].param1)
-					continue;
-
-				vm->m_data[vi] = schemdata[i];
-				vm->m_data[vi].param1 = 0;
+				if (!span) {
+					SchematicSpan newspan;
+					newspan.x         = x;
+					newspan.y         = y;
+					newspan.z         = z;
+					newspan.length    = 0;
+					newspan.offset    = spans->nodes.size();
+					newspan.has_probs = false;
+					spans->spans.push_back(newspan);
+					span = &spans->spans.back();
+				}
 
+				MapNode n = schemdata[i];
+				u8 prob = n.param1;
+				n.param1 = 0;
 				if (rot)
-					vm->m_data[vi].rotateAlongYAxis(ndef, rot);
+					n.rotateAlongYAxis(ndef, rot);
+
+				spans->nodes.push_back(n);
+				spans->probs.push_back(prob);
+				span->length++;
+				if (prob != MTSCHEM_PROB_ALWAYS)
+					span->has_probs = true;
 			}
 		}
-		y_map++;
 	}
+	spans->slice_start.push_back(spans->spans.size());
 }
 
 
@@ -209,6 +284,7 @@ bool Schematic::loadSchematicFromFile(const char *filename,
 	}
 
 	size = readV3S16(is);
+	flags &= ~SCHEM_SPANS_UPDATED_ALL;
 
 	delete []slice_probs;
 	slice_probs = new u8[size.Y];
@@ -345,6 +421,7 @@ bool Schematic::getSchematicFromMap(Map *map, v3s16 p1, v3s16 p2)
 	vm->initialEmerge(bp1, bp2);
 
 	size = p2 - p1 + 1;
+	flags &= ~SCHEM_SPANS_UPDATED_ALL;
 
 	slice_probs = new u8[size.Y];
 	for (s16 y = 0; y != size.Y; y++)
@@ -371,6 +448,8 @@ void Schematic::applyProbabilities(v3s16 p0,
 	std::vector<std::pair<v3s16, u8> > *plist,
 	std::vector<std::pair<s16, u8> > *splist)
 {
+	flags &= ~SCHEM_SPANS_UPDATED_ALL;
+
 	for (size_t i = 0; i != plist->size(); i++) {
 		v3s16 p = (*plist)[i].first - p0;
 		int index = p.Z * (size.Y * size.X) + p.Y * size.X + p.X;
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <map>
 #include "mg_decoration.h"
 #include "util/string.h"
+#include "jthread/jmutex.h"
 
 class Map;
 class Mapgen;
@@ -32,6 +33,9 @@ class NodeResolver;
 
 /////////////////// Schematic flags
 #define SCHEM_CIDS_UPDATED 0x08
+// Spans of rotation rot have been made
+#define SCHEM_SPANS_UPDATED(rot) (0x10 << (rot))
+#define SCHEM_SPANS_UPDATED_ALL  0xF0
 
 
 #define MTSCHEM_FILE_SIGNATURE 0x4d54534d // 'MTSM'
@@ -42,6 +46,34 @@ class NodeResolver;
 #define MTSCHEM_PROB_ALWAYS 0xFF
 
 
+// A row of nodes next to each other along X that are placed at all
+struct SchematicSpan {
+	// Position of the first node in the rotated schematic
+	s16 x;
+	s16 y;
+	s16 z;
+	u16 length;
+	// Index of the first node in SchematicSpans::nodes and probs
+	u32 offset;
+	// Set if some of the nodes are placed only by chance
+	bool has_probs;
+};
+
+/*
+	A schematic prepared for blitting in one rotation: its nodes as rows
+	to be copied, leaving out the ones never placed, with the nodes
+	already rotated.  Spans are ordered by y, z and x like the nodes are
+	placed.
+*/
+struct SchematicSpans {
+	std::vector<SchematicSpan> spans;
+	// Index of the first span of each y slice, and the number of spans
+	std::vector<u32> slice_start;
+	// The nodes with param1 cleared, and their placement probabilities
+	std::vector<MapNode> nodes;
+	std::vector<u8> probs;
+};
+
 class Schematic : public GenElement {
 public:
 	std::vector<content_t> c_nodes;
@@ -69,6 +101,16 @@ class Schematic : public GenElement {
 	void applyProbabilities(v3s16 p0,
 		std::vector<std::pair<v3s16, u8> > *plist,
 		std::vector<std::pair<s16, u8> > *splist);
+
+private:
+	// Guards the content id update and the spans, as decorations are
+	// placed by several emerge threads
+	JMutex m_spans_mutex;
+	SchematicSpans m_spans[4];
+
+	const SchematicSpans &getSpans(Rotation rot, INodeDefManager *ndef);
+	void makeSpans(Rotation rot, INodeDefManager *ndef,
+		SchematicSpans *spans);
 };
 
 class SchematicManager : public GenElementManager {
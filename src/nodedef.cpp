@@ -34,6 +34,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "exceptions.h"
 #include "debug.h"
 #include "gamedef.h"
+#include <algorithm>
 
 /*
 	NodeBox
@@ -202,6 +203,7 @@ void ContentFeatures::reset()
 #ifndef SERVER
 	for(u32 i = 0; i < 24; i++)
 		mesh_ptr[i] = NULL;
+	nodebox_templates.clear();
 #endif
 	visual_scale = 1.0;
 	for(u32 i = 0; i < 6; i++)
@@ -235,6 +237,8 @@ void ContentFeatures::reset()
 	node_box = NodeBox();
 	selection_box = NodeBox();
 	collision_box = NodeBox();
+	collision_boxes_param2_mask = 0;
+	cached_collision_boxes.clear();
 	waving = 0;
 	legacy_facedir_simple = false;
 	legacy_wallmounted = false;
@@ -243,7 +247,7 @@ void ContentFeatures::reset()
 	sound_dug = SimpleSoundSpec();
 }
 
-void ContentFeatures::serialize(std::ostream &os, u16 protocol_version)
+void ContentFeatures::serialize(std::ostream &os, u16 protocol_version) const
 {
 	if(protocol_version < 24){
 		serializeOld(os, protocol_version);
@@ -406,7 +410,10 @@ class CNodeDefManager: public IWritableNodeDefManager {
 
 private:
 	void addNameIdMapping(content_t i, std::string name);
+	void updateCollisionBoxCache(content_t c);
+	void updateIndexes();
 #ifndef SERVER
+	void makeTextureAtlases(ITextureSource *tsrc);
 	void fillTileAttribs(ITextureSource *tsrc, TileSpec *tile, TileDef *tiledef,
 		u32 shader_id, bool use_normal_texture, bool backface_culling,
 		u8 alpha, u8 material_type);
@@ -429,6 +436,18 @@ class CNodeDefManager: public IWritableNodeDefManager {
 	// Note: Not serialized.
 	std::map<std::string, GroupItems> m_group_to_items;
 
+	/*
+		Made by updateAliases() when the registration is finished, and
+		dropped when a node is registered after it:
+		m_name_index is an open addressing hash table of
+		m_name_id_mapping_with_aliases, with "" in the free slots, and
+		m_group_ids has the sorted ids of the nodes of each group that
+		have a rating other than 0.
+	*/
+	bool m_indexes_valid;
+	std::vector<std::pair<std::string, content_t> > m_name_index;
+	std::map<std::string, std::vector<content_t> > m_group_ids;
+
 	// Next possibly free id
 	content_t m_next_id;
 
@@ -464,6 +483,9 @@ void CNodeDefManager::clear()
 	m_name_id_mapping.clear();
 	m_name_id_mapping_with_aliases.clear();
 	m_group_to_items.clear();
+	m_indexes_valid = false;
+	m_name_index.clear();
+	m_group_ids.clear();
 	m_next_id = 0;
 
 	u32 initial_length = 0;
@@ -543,8 +565,27 @@ inline const ContentFeatures& CNodeDefManager::get(const MapNode &n) const
 }
 
 
+static inline u32 name_index_hash(const std::string &name)
+{
+	return murmur_hash_64_ua(name.c_str(), name.size(), 0x1337);
+}
+
+
 bool CNodeDefManager::getId(const std::string &name, content_t &result) const
 {
+	if (m_indexes_valid) {
+		u32 mask = m_name_index.size() - 1;
+		for (u32 i = name_index_hash(name) & mask; ; i = (i + 1) & mask) {
+			const std::pair<std::string, content_t> &slot = m_name_index[i];
+			if (slot.first.empty())
+				return false;
+			if (slot.first == name) {
+				result = slot.second;
+				return true;
+			}
+		}
+	}
+
 	std::map<std::string, content_t>::const_iterator
 		i = m_name_id_mapping_with_aliases.find(name);
 	if(i == m_name_id_mapping_with_aliases.end())
@@ -574,6 +615,19 @@ void CNodeDefManager::getIds(const std::string &name,
 	}
 	std::string group = name.substr(6);
 
+	if (m_indexes_valid) {
+		std::map<std::string, std::vector<content_t> >::const_iterator
+			i = m_group_ids.find(group);
+		if (i == m_group_ids.end())
+			return;
+		// The ids are sorted, so the end is the right hint for a set of
+		// only them
+		const std::vector<content_t> &ids = i->second;
+		for (size_t j = 0; j < ids.size(); j++)
+			result.insert(result.end(), ids[j]);
+		return;
+	}
+
 	std::map<std::string, GroupItems>::const_iterator
 		i = m_group_to_items.find(group);
 	if (i == m_group_to_items.end())
@@ -644,6 +698,8 @@ content_t CNodeDefManager::set(const std::string &name, const ContentFeatures &d
 		addNameIdMapping(id, name);
 	}
 	m_content_features[id] = def;
+	updateCollisionBoxCache(id);
+	m_indexes_valid = false;
 	verbosestream << "NodeDefManager: registering content id \"" << id
 		<< "\": name=\"" << def.name << "\""<<std::endl;
 
@@ -691,6 +747,41 @@ void CNodeDefManager::updateAliases(IItemDefManager *idef)
 					std::make_pair(name, id));
 		}
 	}
+	updateIndexes();
+}
+
+
+void CNodeDefManager::updateIndexes()
+{
+	// At most half full, so that the probes stay short
+	u32 size = 16;
+	while (size < m_name_id_mapping_with_aliases.size() * 2)
+		size *= 2;
+	m_name_index.clear();
+	m_name_index.resize(size, std::make_pair(std::string(), CONTENT_IGNORE));
+	for (std::map<std::string, content_t>::const_iterator
+			i = m_name_id_mapping_with_aliases.begin();
+			i != m_name_id_mapping_with_aliases.end(); ++i) {
+		u32 j = name_index_hash(i->first) & (size - 1);
+		while (!m_name_index[j].first.empty())
+			j = (j + 1) & (size - 1);
+		m_name_index[j] = *i;
+	}
+
+	m_group_ids.clear();
+	for (std::map<std::string, GroupItems>::const_iterator
+			i = m_group_to_items.begin(); i != m_group_to_items.end(); ++i) {
+		std::vector<content_t> &ids = m_group_ids[i->first];
+		for (GroupItems::const_iterator j = i->second.begin();
+				j != i->second.end(); ++j) {
+			if (j->second != 0)
+				ids.push_back(j->first);
+		}
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+	}
+
+	m_indexes_valid = true;
 }
 
 
@@ -868,6 +959,23 @@ void CNodeDefManager::updateTextures(IGameDef *gamedef)
 			recalculateBoundingBox(f->mesh_ptr[0]);
 		}
 
+		// The boxes of the remaining node box nodes are made once for
+		// every rotation, instead of for every node when making meshes
+		f->nodebox_templates.clear();
+		if (f->drawtype == NDT_NODEBOX &&
+				f->node_box.type != NODEBOX_LEVELED) {
+			u32 rotations = f->param_type_2 == CPT2_FACEDIR ? 0x20 :
+					f->param_type_2 == CPT2_WALLMOUNTED ? 0x08 : 1;
+			f->nodebox_templates.resize(rotations);
+			for (u32 j = 0; j < rotations; j++) {
+				MapNode n(i, 0, j);
+				std::vector<aabb3f> boxes = n.getNodeBoxes(this);
+				for (u32 k = 0; k < boxes.size(); k++)
+					f->nodebox_templates[j].push_back(
+							NodeBoxTemplate(boxes[k]));
+			}
+		}
+
 		//Cache 6dfacedir and wallmounted rotated clones of meshes
 		if (enable_mesh_cache && f->mesh_ptr[0] && (f->param_type_2 == CPT2_FACEDIR)) {
 			for (u16 j = 1; j < 24; j++) {
@@ -889,10 +997,89 @@ void CNodeDefManager::updateTextures(IGameDef *gamedef)
 			meshmanip->recalculateNormals(f->mesh_ptr[0], true, false);			
 		}
 	}
+
+	if (g_settings->getBool("enable_texture_atlas"))
+		makeTextureAtlases(tsrc);
 #endif
 }
 
 
+#ifndef SERVER
+NodeBoxTemplate::NodeBoxTemplate(const aabb3f &box_):
+	box(box_)
+{
+	box.repair();
+
+	// Texture coordinates of the faces, up-down-right-left-back-front
+	f32 tx1 = (box.MinEdge.X/BS)+0.5;
+	f32 ty1 = (box.MinEdge.Y/BS)+0.5;
+	f32 tz1 = (box.MinEdge.Z/BS)+0.5;
+	f32 tx2 = (box.MaxEdge.X/BS)+0.5;
+	f32 ty2 = (box.MaxEdge.Y/BS)+0.5;
+	f32 tz2 = (box.MaxEdge.Z/BS)+0.5;
+	f32 coords[24] = {
+		// up
+		tx1, 1-tz2, tx2, 1-tz1,
+		// down
+		tx1, tz1, tx2, tz2,
+		// right
+		tz1, 1-ty2, tz2, 1-ty1,
+		// left
+		1-tz2, 1-ty2, 1-tz1, 1-ty1,
+		// back
+		1-tx2, 1-ty2, 1-tx1, 1-ty1,
+		// front
+		tx1, 1-ty2, tx2, 1-ty1,
+	};
+	for(u32 i = 0; i < 24; i++)
+		txc[i] = coords[i];
+}
+
+/*
+	Puts the plain textures of the tiles in texture atlases. The meshes of
+	the map blocks then draw all the tiles of a material from one texture.
+	Animated tiles change textures, cracked ones and those with normal
+	maps have more of them, so they keep their own.
+*/
+static bool canBeInAtlas(const TileSpec &tile)
+{
+	return tile.texture != NULL && tile.normal_texture == NULL &&
+		!(tile.material_flags & MATERIAL_FLAG_ANIMATION_VERTICAL_FRAMES);
+}
+
+void CNodeDefManager::makeTextureAtlases(ITextureSource *tsrc)
+{
+	std::vector<u32> ids;
+	for (u32 i = 0; i < m_content_features.size(); i++) {
+		ContentFeatures *f = &m_content_features[i];
+		for (u16 j = 0; j < 6; j++)
+			if (canBeInAtlas(f->tiles[j]))
+				ids.push_back(f->tiles[j].texture_id);
+		for (u16 j = 0; j < CF_SPECIAL_COUNT; j++)
+			if (canBeInAtlas(f->special_tiles[j]))
+				ids.push_back(f->special_tiles[j].texture_id);
+	}
+
+	tsrc->makeAtlases(ids);
+
+	core::rect<f32> rect;
+	for (u32 i = 0; i < m_content_features.size(); i++) {
+		ContentFeatures *f = &m_content_features[i];
+		for (u16 j = 0; j < 6; j++) {
+			TileSpec &tile = f->tiles[j];
+			if (canBeInAtlas(tile) && tsrc->getAtlasTexture(tile.texture_id, rect))
+				tile.material_flags |= MATERIAL_FLAG_IN_ATLAS;
+		}
+		for (u16 j = 0; j < CF_SPECIAL_COUNT; j++) {
+			TileSpec &tile = f->special_tiles[j];
+			if (canBeInAtlas(tile) && tsrc->getAtlasTexture(tile.texture_id, rect))
+				tile.material_flags |= MATERIAL_FLAG_IN_ATLAS;
+		}
+	}
+}
+#endif
+
+
 #ifndef SERVER
 void CNodeDefManager::fillTileAttribs(ITextureSource *tsrc, TileSpec *tile,
 		TileDef *tiledef, u32 shader_id, bool use_normal_texture,
@@ -1017,6 +1204,7 @@ void CNodeDefManager::deSerialize(std::istream &is)
 		if (i >= m_content_features.size())
 			m_content_features.resize((u32)(i) + 1);
 		m_content_features[i] = f;
+		updateCollisionBoxCache(i);
 		addNameIdMapping(i, f.name);
 		verbosestream << "deserialized " << f.name << std::endl;
 	}
@@ -1027,6 +1215,33 @@ void CNodeDefManager::addNameIdMapping(content_t i, std::string name)
 {
 	m_name_id_mapping.set(i, name);
 	m_name_id_mapping_with_aliases.insert(std::make_pair(name, i));
+	m_indexes_valid = false;
+}
+
+
+void CNodeDefManager::updateCollisionBoxCache(content_t c)
+{
+	ContentFeatures &f = m_content_features[c];
+	const NodeBox &box = f.collision_box.fixed.empty() ?
+			f.node_box : f.collision_box;
+
+	// Leveled boxes have to be computed for every node; the ones rotated
+	// or wallmounted by param2 are computed for all its values that count
+	f.cached_collision_boxes.clear();
+	if (box.type == NODEBOX_LEVELED)
+		return;
+	u8 mask = 0;
+	if (box.type == NODEBOX_FIXED && f.param_type_2 == CPT2_FACEDIR)
+		mask = 0x1F;
+	else if (box.type == NODEBOX_WALLMOUNTED &&
+			f.param_type_2 == CPT2_WALLMOUNTED)
+		mask = 0x07;
+
+	f.collision_boxes_param2_mask = mask;
+	f.cached_collision_boxes.resize((u32)mask + 1);
+	for (u32 param2 = 0; param2 <= mask; param2++)
+		f.cached_collision_boxes[param2] =
+				MapNode(c, 0, param2).getCollisionBoxes(this);
 }
 
 
@@ -1043,7 +1258,7 @@ IWritableNodeDefManager *createNodeDefManager()
 
 
 //// Serialization of old ContentFeatures formats
-void ContentFeatures::serializeOld(std::ostream &os, u16 protocol_version)
+void ContentFeatures::serializeOld(std::ostream &os, u16 protocol_version) const
 {
 	if (protocol_version == 13)
 	{
@@ -99,6 +99,20 @@ struct NodeBox
 struct MapNode;
 class NodeMetadata;
 
+#ifndef SERVER
+/*
+	A box of a NDT_NODEBOX node, with its edges in order and the texture
+	coordinates of its faces for makeCuboid(), relative to the node
+*/
+struct NodeBoxTemplate
+{
+	aabb3f box;
+	f32 txc[24];
+
+	NodeBoxTemplate(const aabb3f &box_);
+};
+#endif
+
 /*
 	Stand-alone definition of a TileSpec (basically a server-side TileSpec)
 */
@@ -191,6 +205,10 @@ struct ContentFeatures
 	std::string mesh;
 #ifndef SERVER
 	scene::IMesh *mesh_ptr[24];
+	// The boxes of NDT_NODEBOX nodes for every value of the rotation
+	// part of param2, made in CNodeDefManager::updateTextures(); empty
+	// for leveled node boxes, which depend on the level
+	std::vector<std::vector<NodeBoxTemplate> > nodebox_templates;
 #endif	
 	float visual_scale; // Misc. scale parameter
 	TileDef tiledef[6];
@@ -245,6 +263,12 @@ struct ContentFeatures
 	NodeBox node_box;
 	NodeBox selection_box;
 	NodeBox collision_box;
+	// Collision boxes of the node for each value of
+	// param2 & collision_boxes_param2_mask, or none if they have to be
+	// computed for every node (leveled nodes); cached by the node
+	// definition manager, not serialized
+	u8 collision_boxes_param2_mask;
+	std::vector<std::vector<aabb3f> > cached_collision_boxes;
 	// Used for waving leaves/plants
 	u8 waving;
 	// Compatibility with old maps
@@ -265,9 +289,9 @@ struct ContentFeatures
 	ContentFeatures();
 	~ContentFeatures();
 	void reset();
-	void serialize(std::ostream &os, u16 protocol_version);
+	void serialize(std::ostream &os, u16 protocol_version) const;
 	void deSerialize(std::istream &is);
-	void serializeOld(std::ostream &os, u16 protocol_version);
+	void serializeOld(std::ostream &os, u16 protocol_version) const;
 	void deSerializeOld(std::istream &is, int version);
 
 	/*
@@ -280,6 +304,11 @@ struct ContentFeatures
 		if(!isLiquid() || !f.isLiquid()) return false;
 		return (liquid_alternative_flowing == f.liquid_alternative_flowing);
 	}
+	// NULL if the boxes have to be computed with MapNode::getCollisionBoxes
+	const std::vector<aabb3f> *getCachedCollisionBoxes(u8 param2) const{
+		if(cached_collision_boxes.empty()) return NULL;
+		return &cached_collision_boxes[param2 & collision_boxes_param2_mask];
+	}
 };
 
 struct NodeResolveInfo {
@@ -73,6 +73,15 @@ void NodeMetadata::clear()
 	m_inventory->clear();
 }
 
+u32 NodeMetadata::getMemoryUsage() const
+{
+	u32 size = sizeof(NodeMetadata) + m_inventory->getMemoryUsage();
+	for(std::map<std::string, std::string>::const_iterator
+			i = m_stringvars.begin(); i != m_stringvars.end(); ++i)
+		size += i->first.size() + i->second.size();
+	return size;
+}
+
 /*
 	NodeMetadataList
 */
@@ -192,6 +201,15 @@ void NodeMetadataList::clear()
 	m_data.clear();
 }
 
+u32 NodeMetadataList::getMemoryUsage() const
+{
+	u32 size = 0;
+	for(std::map<v3s16, NodeMetadata*>::const_iterator
+			i = m_data.begin(); i != m_data.end(); ++i)
+		size += sizeof(v3s16) + i->second->getMemoryUsage();
+	return size;
+}
+
 std::string NodeMetadata::getString(const std::string &name, unsigned short recursion) const
 {
 	std::map<std::string, std::string>::const_iterator it;
@@ -64,6 +64,9 @@ class NodeMetadata
 		return m_inventory;
 	}
 
+	// Estimate of the bytes taken by the metadata and its inventory
+	u32 getMemoryUsage() const;
+
 private:
 	std::map<std::string, std::string> m_stringvars;
 	Inventory *m_inventory;
@@ -90,6 +93,8 @@ class NodeMetadataList
 	void set(v3s16 p, NodeMetadata *d);
 	// Deletes all
 	void clear();
+	// Estimate of the bytes taken by the metadata of all the nodes
+	u32 getMemoryUsage() const;
 	
 private:
 	std::map<v3s16, NodeMetadata*> m_data;
@@ -47,24 +47,24 @@ void NodeTimerList::serialize(std::ostream &os, u8 map_format_version) const
 {
 	if(map_format_version == 24){
 		// Version 0 is a placeholder for "nothing to see here; go away."
-		if(m_data.size() == 0){
+		if(m_timers.size() == 0){
 			writeU8(os, 0); // version
 			return;
 		}
 		writeU8(os, 1); // version
-		writeU16(os, m_data.size());
+		writeU16(os, m_timers.size());
 	}
 
 	if(map_format_version >= 25){
 		writeU8(os, 2+4+4);
-		writeU16(os, m_data.size());
+		writeU16(os, m_timers.size());
 	}
 
-	for(std::map<v3s16, NodeTimer>::const_iterator
-			i = m_data.begin();
-			i != m_data.end(); i++){
-		v3s16 p = i->first;
-		NodeTimer t = i->second;
+	for(TimerQueue::const_iterator
+			i = m_timers.begin();
+			i != m_timers.end(); i++){
+		v3s16 p = i->second.first;
+		NodeTimer t = getTimer(i);
 
 		u16 p16 = p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X;
 		writeU16(os, p16);
@@ -74,7 +74,7 @@ void NodeTimerList::serialize(std::ostream &os, u8 map_format_version) const
 
 void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
 {
-	m_data.clear();
+	clear();
 	
 	if(map_format_version == 24){
 		u8 timer_version = readU8(is);
@@ -115,7 +115,7 @@ void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
 			continue;
 		}
 
-		if(m_data.find(p) != m_data.end())
+		if(m_positions.find(p) != m_positions.end())
 		{
 			infostream<<"WARNING: NodeTimerList::deSerialize(): "
 					<<"already set data at position"
@@ -124,31 +124,24 @@ void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
 			continue;
 		}
 
-		m_data.insert(std::make_pair(p, t));
+		set(p, t);
 	}
 }
 
 std::map<v3s16, NodeTimer> NodeTimerList::step(float dtime)
 {
 	std::map<v3s16, NodeTimer> elapsed_timers;
-	// Increment timers
-	for(std::map<v3s16, NodeTimer>::iterator
-			i = m_data.begin();
-			i != m_data.end(); i++){
-		v3s16 p = i->first;
-		NodeTimer t = i->second;
-		t.elapsed += dtime;
-		if(t.elapsed >= t.timeout)
-			elapsed_timers.insert(std::make_pair(p, t));
-		else
-			i->second = t;
-	}
-	// Delete elapsed timers
-	for(std::map<v3s16, NodeTimer>::const_iterator
-			i = elapsed_timers.begin();
-			i != elapsed_timers.end(); i++){
-		v3s16 p = i->first;
-		m_data.erase(p);
+	m_time += dtime;
+	// Take the timers that have expired from the front of the queue
+	while(!m_timers.empty() && m_timers.begin()->first <= m_time){
+		TimerQueue::iterator i = m_timers.begin();
+		v3s16 p = i->second.first;
+		elapsed_timers.insert(std::make_pair(p, getTimer(i)));
+		m_positions.erase(p);
+		m_timers.erase(i);
 	}
+	// Keep the time base small while there's nothing to time
+	if(m_timers.empty())
+		m_time = 0.;
 	return elapsed_timers;
 }
@@ -49,12 +49,15 @@ class NodeTimer
 
 /*
 	List of timers of all the nodes of a block
+
+	Timers are kept ordered by the time at which they expire, so that a
+	step in which no timer expires doesn't need to touch any of them.
 */
 
 class NodeTimerList
 {
 public:
-	NodeTimerList() {}
+	NodeTimerList(): m_time(0.) {}
 	~NodeTimerList() {}
 	
 	void serialize(std::ostream &os, u8 map_format_version) const;
@@ -62,29 +65,55 @@ class NodeTimerList
 	
 	// Get timer
 	NodeTimer get(v3s16 p){
-		std::map<v3s16, NodeTimer>::iterator n = m_data.find(p);
-		if(n == m_data.end())
+		std::map<v3s16, TimerQueue::iterator>::iterator n =
+				m_positions.find(p);
+		if(n == m_positions.end())
 			return NodeTimer();
-		return n->second;
+		return getTimer(n->second);
 	}
 	// Deletes timer
 	void remove(v3s16 p){
-		m_data.erase(p);
+		std::map<v3s16, TimerQueue::iterator>::iterator n =
+				m_positions.find(p);
+		if(n == m_positions.end())
+			return;
+		m_timers.erase(n->second);
+		m_positions.erase(n);
 	}
 	// Deletes old timer and sets a new one
 	void set(v3s16 p, NodeTimer t){
-		m_data[p] = t;
+		remove(p);
+		TimerQueue::iterator i = m_timers.insert(std::make_pair(
+				m_time + t.timeout - t.elapsed, std::make_pair(p, t.timeout)));
+		m_positions[p] = i;
+	}
+	// Number of timers
+	u32 size() const {
+		return m_positions.size();
 	}
 	// Deletes all timers
 	void clear(){
-		m_data.clear();
+		m_timers.clear();
+		m_positions.clear();
+		m_time = 0.;
 	}
 
 	// A step in time. Returns map of elapsed timers.
 	std::map<v3s16, NodeTimer> step(float dtime);
 
 private:
-	std::map<v3s16, NodeTimer> m_data;
+	// Expiry time -> (position, timeout)
+	typedef std::multimap<double, std::pair<v3s16, f32> > TimerQueue;
+
+	NodeTimer getTimer(TimerQueue::const_iterator i) const {
+		f32 timeout = i->second.second;
+		return NodeTimer(timeout, timeout - (i->first - m_time));
+	}
+
+	TimerQueue m_timers;
+	std::map<v3s16, TimerQueue::iterator> m_positions;
+	// Time the timers of this list have been stepped by
+	double m_time;
 };
 
 #endif
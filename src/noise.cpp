@@ -36,11 +36,6 @@
 #define NOISE_MAGIC_Z    52591
 #define NOISE_MAGIC_SEED 1013
 
-typedef float (*Interp3dFxn)(
-		float v000, float v100, float v010, float v110,
-		float v001, float v101, float v011, float v111,
-		float x, float y, float z);
-
 float cos_lookup[16] = {
 	1.0,  0.9238,  0.7071,  0.3826, 0, -0.3826, -0.7071, -0.9238,
 	1.0, -0.9238, -0.7071, -0.3826, 0,  0.3826,  0.7071,  0.9238
@@ -53,8 +48,8 @@ float cos_lookup[16] = {
 //noise poly:  p(n) = 60493n^3 + 19990303n + 137612589
 float noise2d(int x, int y, int seed)
 {
-	int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
+	u32 n = (NOISE_MAGIC_X * (u32)x + NOISE_MAGIC_Y * (u32)y
+			+ NOISE_MAGIC_SEED * (u32)seed) & 0x7fffffff;
 	n = (n >> 13) ^ n;
 	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
 	return 1.f - (float)n / 0x40000000;
@@ -63,8 +58,8 @@ float noise2d(int x, int y, int seed)
 
 float noise3d(int x, int y, int z, int seed)
 {
-	int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y + NOISE_MAGIC_Z * z
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
+	u32 n = (NOISE_MAGIC_X * (u32)x + NOISE_MAGIC_Y * (u32)y
+			+ NOISE_MAGIC_Z * (u32)z + NOISE_MAGIC_SEED * (u32)seed) & 0x7fffffff;
 	n = (n >> 13) ^ n;
 	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
 	return 1.f - (float)n / 0x40000000;
@@ -323,6 +318,18 @@ float contour(float v)
 }
 
 
+float noise_perlin_amplitude(NoiseParams *np)
+{
+	float a = 0;
+	float g = 1.0;
+	for (int i = 0; i < np->octaves; i++) {
+		a += g;
+		g *= fabs(np->persist);
+	}
+	return a;
+}
+
+
 ///////////////////////// [ New perlin stuff ] ////////////////////////////
 
 
@@ -340,6 +347,8 @@ Noise::Noise(NoiseParams *np, int seed, int sx, int sy, int sz)
 	try {
 		this->buf    = new float[sx * sy * sz];
 		this->result = new float[sx * sy * sz];
+		this->interpbuf  = new float[sx * 9];
+		this->latticebuf = new int[sx];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
@@ -351,6 +360,8 @@ Noise::~Noise()
 	delete[] buf;
 	delete[] result;
 	delete[] noisebuf;
+	delete[] interpbuf;
+	delete[] latticebuf;
 }
 
 
@@ -365,9 +376,13 @@ void Noise::setSize(int sx, int sy, int sz)
 
 	delete[] buf;
 	delete[] result;
+	delete[] interpbuf;
+	delete[] latticebuf;
 	try {
 		this->buf    = new float[sx * sy * sz];
 		this->result = new float[sx * sy * sz];
+		this->interpbuf  = new float[sx * 9];
+		this->latticebuf = new int[sx];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
@@ -426,6 +441,13 @@ void Noise::resizeNoiseBuf(bool is3d)
  * Another optimization that could save half as many noise calls is to carry over
  * values from the previous noise lattice as midpoints in the new lattice for the
  * next octave.
+ *
+ * The position within the lattice advances the same way along x in every row,
+ * so it and its interpolation factor are computed once per column, and the
+ * interpolation along x only once per lattice row.  What is left for every
+ * point is a loop over contiguous arrays that the compiler can vectorize.
+ * The arithmetic is the same as interpolating each point separately, in the
+ * same order, so the results are identical.
  */
 #define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap2D(
@@ -433,15 +455,17 @@ void Noise::gradientMap2D(
 		float step_x, float step_y,
 		int seed)
 {
-	float v00, v01, v10, v11, u, v, orig_u;
-	int index, i, j, x0, y0, noisex, noisey;
+	float u, v, ty;
+	int index, i, j, x0, y0, noisex, noisey, lerpy;
 	int nlx, nly;
+	float *tx    = interpbuf;
+	float *lerp0 = interpbuf + sx;
+	float *lerp1 = interpbuf + sx * 2;
 
 	x0 = floor(x);
 	y0 = floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
 	//calculate noise point lattice
 	nlx = (int)(u + sx * step_x) + 2;
@@ -451,30 +475,45 @@ void Noise::gradientMap2D(
 		for (i = 0; i != nlx; i++)
 			noisebuf[index++] = noise2d(x0 + i, y0 + j, seed);
 
+	//calculate lattice positions and interpolation factors along x
+	noisex = 0;
+	for (i = 0; i != sx; i++) {
+		tx[i] = easeCurve(u);
+		latticebuf[i] = noisex;
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+
 	//calculate interpolations
 	index  = 0;
 	noisey = 0;
+	lerpy  = -2;  // neither equal to noisey nor right before it
 	for (j = 0; j != sy; j++) {
-		v00 = noisebuf[idx(0, noisey)];
-		v10 = noisebuf[idx(1, noisey)];
-		v01 = noisebuf[idx(0, noisey + 1)];
-		v11 = noisebuf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			buf[index++] = biLinearInterpolation(v00, v10, v01, v11, u, v);
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noisebuf[idx(noisex + 1, noisey)];
-				v11 = noisebuf[idx(noisex + 1, noisey + 1)];
+		if (noisey != lerpy) {
+			if (noisey == lerpy + 1) {
+				float *tmp = lerp0;
+				lerp0 = lerp1;
+				lerp1 = tmp;
+			} else {
+				const float *row = &noisebuf[idx(0, noisey)];
+				for (i = 0; i != sx; i++)
+					lerp0[i] = linearInterpolation(row[latticebuf[i]],
+						row[latticebuf[i] + 1], tx[i]);
 			}
+			const float *row = &noisebuf[idx(0, noisey + 1)];
+			for (i = 0; i != sx; i++)
+				lerp1[i] = linearInterpolation(row[latticebuf[i]],
+					row[latticebuf[i] + 1], tx[i]);
+			lerpy = noisey;
 		}
 
+		ty = easeCurve(v);
+		for (i = 0; i != sx; i++)
+			buf[index++] = linearInterpolation(lerp0[i], lerp1[i], ty);
+
 		v += step_y;
 		if (v >= 1.0) {
 			v -= 1.0;
@@ -491,14 +530,20 @@ void Noise::gradientMap3D(
 		float step_x, float step_y, float step_z,
 		int seed, bool eased)
 {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	int index, i, j, k, x0, y0, z0, noisex, noisey, noisez;
+	float u, v, w, orig_v, ty, tz;
+	int index, i, j, k, x0, y0, z0, noisex, noisey, noisez, lerpy, lerpz;
 	int nlx, nly, nlz;
-
-	Interp3dFxn interpolate = eased ?
-		triLinearInterpolation : triLinearInterpolationNoEase;
+	float *tx = interpbuf;
+	// Lattice values around each column times their x factor, in the
+	// order of the terms of triLinearInterpolation()
+	float *p000 = interpbuf + sx;
+	float *p100 = interpbuf + sx * 2;
+	float *p010 = interpbuf + sx * 3;
+	float *p110 = interpbuf + sx * 4;
+	float *p001 = interpbuf + sx * 5;
+	float *p101 = interpbuf + sx * 6;
+	float *p011 = interpbuf + sx * 7;
+	float *p111 = interpbuf + sx * 8;
 
 	x0 = floor(x);
 	y0 = floor(y);
@@ -506,7 +551,6 @@ void Noise::gradientMap3D(
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
 	orig_v = v;
 
 	//calculate noise point lattice
@@ -519,44 +563,55 @@ void Noise::gradientMap3D(
 			for (i = 0; i != nlx; i++)
 				noisebuf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
 
+	//calculate lattice positions and interpolation factors along x
+	noisex = 0;
+	for (i = 0; i != sx; i++) {
+		tx[i] = eased ? easeCurve(u) : u;
+		latticebuf[i] = noisex;
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+
 	//calculate interpolations
 	index  = 0;
-	noisey = 0;
 	noisez = 0;
+	lerpy  = -1;
+	lerpz  = -1;
 	for (k = 0; k != sz; k++) {
+		tz = eased ? easeCurve(w) : w;
 		v = orig_v;
 		noisey = 0;
 		for (j = 0; j != sy; j++) {
-			v000 = noisebuf[idx(0, noisey,     noisez)];
-			v100 = noisebuf[idx(1, noisey,     noisez)];
-			v010 = noisebuf[idx(0, noisey + 1, noisez)];
-			v110 = noisebuf[idx(1, noisey + 1, noisez)];
-			v001 = noisebuf[idx(0, noisey,     noisez + 1)];
-			v101 = noisebuf[idx(1, noisey,     noisez + 1)];
-			v011 = noisebuf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noisebuf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				buf[index++] = interpolate(
-									v000, v100, v010, v110,
-									v001, v101, v011, v111,
-									u, v, w);
-
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noisebuf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noisebuf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noisebuf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noisebuf[idx(noisex + 1, noisey + 1, noisez + 1)];
+			if (noisey != lerpy || noisez != lerpz) {
+				for (i = 0; i != sx; i++) {
+					int n = latticebuf[i];
+					p000[i] = noisebuf[idx(n,     noisey,     noisez)] * (1 - tx[i]);
+					p100[i] = noisebuf[idx(n + 1, noisey,     noisez)] * tx[i];
+					p010[i] = noisebuf[idx(n,     noisey + 1, noisez)] * (1 - tx[i]);
+					p110[i] = noisebuf[idx(n + 1, noisey + 1, noisez)] * tx[i];
+					p001[i] = noisebuf[idx(n,     noisey,     noisez + 1)] * (1 - tx[i]);
+					p101[i] = noisebuf[idx(n + 1, noisey,     noisez + 1)] * tx[i];
+					p011[i] = noisebuf[idx(n,     noisey + 1, noisez + 1)] * (1 - tx[i]);
+					p111[i] = noisebuf[idx(n + 1, noisey + 1, noisez + 1)] * tx[i];
 				}
+				lerpy = noisey;
+				lerpz = noisez;
+			}
+
+			ty = eased ? easeCurve(v) : v;
+			for (i = 0; i != sx; i++) {
+				buf[index++] =
+					p000[i] * (1 - ty) * (1 - tz) +
+					p100[i] * (1 - ty) * (1 - tz) +
+					p010[i] * ty * (1 - tz) +
+					p110[i] * ty * (1 - tz) +
+					p001[i] * (1 - ty) * tz +
+					p101[i] * (1 - ty) * tz +
+					p011[i] * ty * tz +
+					p111[i] * ty * tz;
 			}
 
 			v += step_y;
@@ -663,13 +718,11 @@ float *Noise::perlinMap3D(float x, float y, float z, bool eased)
 
 void Noise::transformNoiseMap()
 {
-	size_t i = 0;
+	size_t bufsize = sx * sy * sz;
+	float scale  = np->scale;
+	float offset = np->offset;
 
-	for (int z = 0; z != sz; z++)
-	for (int y = 0; y != sy; y++)
-	for (int x = 0; x != sx; x++) {
-		result[i] = result[i] * np->scale + np->offset;
-		i++;
-	}
+	for (size_t i = 0; i != bufsize; i++)
+		result[i] = result[i] * scale + offset;
 }
 
@@ -107,6 +107,9 @@ class Noise {
 	float *noisebuf;
 	float *buf;
 	float *result;
+	// Per-column scratch space of gradientMap2D() and gradientMap3D()
+	float *interpbuf;
+	int *latticebuf;
 
 	Noise(NoiseParams *np, int seed, int sx, int sy, int sz=1);
 	~Noise();
@@ -155,6 +158,10 @@ inline float easeCurve(float t) {
 
 float contour(float v);
 
+// Largest absolute value perlin noise made with np can have, before
+// it is offset and scaled
+float noise_perlin_amplitude(NoiseParams *np);
+
 #define NoisePerlin2D(np, x, y, s) \
 		((np)->offset + (np)->scale * noise2d_perlin( \
 		(float)(x) / (np)->spread.X, \
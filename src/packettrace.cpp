@@ -0,0 +1,298 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "packettrace.h"
+#include "server.h"
+#include "emerge.h"
+#include "settings.h"
+#include "filesys.h"
+#include "porting.h"
+#include "exceptions.h"
+#include "log.h"
+#include "main.h" // for g_settings
+#include "jthread/jmutexautolock.h"
+#include "util/serialize.h"
+#include "util/numeric.h"
+#include "util/string.h"
+
+/*
+	PacketTraceWriter
+*/
+
+PacketTraceWriter::PacketTraceWriter(const std::string &path):
+	m_file(path.c_str(), std::ios_base::binary | std::ios_base::trunc),
+	m_start_ms(porting::getTimeMs())
+{
+	m_file.write("MTPT", 4);
+	writeU16(m_file, PACKET_TRACE_VERSION);
+}
+
+PacketTraceWriter::~PacketTraceWriter()
+{
+	m_file.flush();
+}
+
+void PacketTraceWriter::writeHeader(u8 type)
+{
+	writeU32(m_file, porting::getTimeMs() - m_start_ms);
+	writeU8(m_file, type);
+}
+
+void PacketTraceWriter::writeStep(float dtime, bool initial_step)
+{
+	writeHeader(PACKET_TRACE_STEP);
+	writeU32(m_file, MYMAX(dtime, 0) * 1000000);
+	writeU8(m_file, initial_step);
+}
+
+void PacketTraceWriter::writePeerAdded(u16 peer_id)
+{
+	writeHeader(PACKET_TRACE_PEER_ADDED);
+	writeU16(m_file, peer_id);
+}
+
+void PacketTraceWriter::writePeerRemoved(u16 peer_id, bool timeout)
+{
+	writeHeader(PACKET_TRACE_PEER_REMOVED);
+	writeU16(m_file, peer_id);
+	writeU8(m_file, timeout);
+	// Whatever happens to the server, the sessions up to here are kept
+	m_file.flush();
+}
+
+void PacketTraceWriter::writeData(u16 peer_id, const u8 *data, u32 size)
+{
+	writeHeader(PACKET_TRACE_DATA);
+	writeU16(m_file, peer_id);
+	writeU32(m_file, size);
+	m_file.write((const char *)data, size);
+}
+
+/*
+	PacketTraceReader
+*/
+
+PacketTraceReader::PacketTraceReader(const std::string &path):
+	m_file(path.c_str(), std::ios_base::binary),
+	m_open(false)
+{
+	char magic[4] = {0};
+	m_file.read(magic, 4);
+	if(!m_file.good() || memcmp(magic, "MTPT", 4) != 0)
+		return;
+	u16 version = readU16(m_file);
+	if(version != PACKET_TRACE_VERSION){
+		errorstream<<"Packet trace "<<path<<" has version "<<version
+				<<", only "<<PACKET_TRACE_VERSION<<" is supported"<<std::endl;
+		return;
+	}
+	m_open = m_file.good();
+}
+
+bool PacketTraceReader::read(PacketTraceEvent &event)
+{
+	event.time_ms = readU32(m_file);
+	if(m_file.eof())
+		return false;
+	event.type = readU8(m_file);
+	switch(event.type){
+	case PACKET_TRACE_STEP:
+		event.dtime = readU32(m_file) / 1000000.0;
+		event.initial_step = readU8(m_file);
+		break;
+	case PACKET_TRACE_PEER_ADDED:
+		event.peer_id = readU16(m_file);
+		break;
+	case PACKET_TRACE_PEER_REMOVED:
+		event.peer_id = readU16(m_file);
+		event.timeout = readU8(m_file);
+		break;
+	case PACKET_TRACE_DATA: {
+		event.peer_id = readU16(m_file);
+		u32 size = readU32(m_file);
+		if(!m_file.good())
+			break;
+		event.data.resize(size);
+		if(size != 0)
+			m_file.read(&event.data[0], size);
+		break; }
+	default:
+		throw SerializationError("Packet trace: unknown event type "
+				+ itos(event.type));
+	}
+	if(!m_file.good())
+		throw SerializationError("Packet trace: the last event is cut short");
+	return true;
+}
+
+/*
+	Replay
+*/
+
+// Does what ServerThread and the connection would have done
+class PacketTraceReplayer
+{
+public:
+	PacketTraceReplayer(Server *server):
+		m_server(server)
+	{
+		m_server->m_packet_replay = true;
+	}
+
+	// The replay runs faster than the emerge threads can keep up with;
+	// waiting for them makes every replay see the same map
+	void waitForEmerge()
+	{
+		EmergeManager *emerge = m_server->m_emerge;
+		for(u32 i = 0; i < 10000; i++){
+			{
+				JMutexAutoLock queuelock(emerge->queuemutex);
+				if(emerge->blocks_enqueued.empty())
+					return;
+			}
+			sleep_ms(1);
+		}
+	}
+
+	void step(float dtime, bool initial_step)
+	{
+		{
+			JMutexAutoLock lock(m_server->m_step_dtime_mutex);
+			m_server->m_step_dtime = dtime;
+		}
+		m_server->AsyncRunStep(initial_step);
+	}
+
+	void peerAdded(u16 peer_id)
+	{
+		con::PeerChange c;
+		c.type = con::PEER_ADDED;
+		c.peer_id = peer_id;
+		c.timeout = false;
+		m_server->m_peer_change_queue.push_back(c);
+	}
+
+	void peerRemoved(u16 peer_id, bool timeout)
+	{
+		m_server->m_clients.event(peer_id, CSE_Disconnect);
+		con::PeerChange c;
+		c.type = con::PEER_REMOVED;
+		c.peer_id = peer_id;
+		c.timeout = timeout;
+		m_server->m_peer_change_queue.push_back(c);
+	}
+
+	void data(u16 peer_id, std::string &data)
+	{
+		m_server->handleData((u8 *)&data[0], data.size(), peer_id);
+	}
+
+private:
+	Server *m_server;
+};
+
+bool run_packet_replay(const SubgameSpec &gamespec,
+		const std::string &world_path, const std::string &trace_path)
+{
+	PacketTraceReader reader(trace_path);
+	if(!reader.isOpen()){
+		errorstream<<"Can't read packet trace "<<trace_path<<std::endl;
+		return false;
+	}
+
+	// The world is left as it was, so that the trace can be replayed again
+	std::string copy_path = fs::TempPath() + DIR_DELIM
+		+ "minetest-packet-replay";
+	fs::RecursiveDelete(copy_path);
+	if(!fs::CopyDir(world_path, copy_path)){
+		errorstream<<"Can't copy the world "<<world_path<<" to "
+				<<copy_path<<std::endl;
+		return false;
+	}
+
+	// Everything is done by the server thread, in the same order every time,
+	// and the replay isn't recorded
+	g_settings->set("num_worker_threads", "0");
+	g_settings->set("packet_trace_path", "");
+
+	bool success = true;
+	{
+		Server server(copy_path, gamespec, false, false);
+		PacketTraceReplayer replayer(&server);
+
+		dstream<<"Replaying packet trace "<<trace_path<<std::endl;
+
+		u32 counts[4] = {0, 0, 0, 0};
+		u32 time_ms = 0;
+		u64 step_us = 0;
+		u32 step_max_us = 0;
+		u64 data_us = 0;
+		u64 emerge_us = 0;
+		u32 t_start = porting::getTimeUs();
+		try{
+			PacketTraceEvent event;
+			while(reader.read(event)){
+				counts[event.type]++;
+				time_ms = event.time_ms;
+				u32 t1 = porting::getTimeUs();
+				switch(event.type){
+				case PACKET_TRACE_STEP: {
+					replayer.waitForEmerge();
+					emerge_us += porting::getTimeUs() - t1;
+					t1 = porting::getTimeUs();
+					replayer.step(event.dtime, event.initial_step);
+					u32 t = porting::getTimeUs() - t1;
+					step_us += t;
+					step_max_us = MYMAX(step_max_us, t);
+					break; }
+				case PACKET_TRACE_PEER_ADDED:
+					replayer.peerAdded(event.peer_id);
+					break;
+				case PACKET_TRACE_PEER_REMOVED:
+					replayer.peerRemoved(event.peer_id, event.timeout);
+					break;
+				case PACKET_TRACE_DATA:
+					replayer.data(event.peer_id, event.data);
+					data_us += porting::getTimeUs() - t1;
+					break;
+				}
+			}
+		}
+		catch(SerializationError &e){
+			errorstream<<e.what()<<std::endl;
+			success = false;
+		}
+		u32 total_us = porting::getTimeUs() - t_start - emerge_us;
+
+		dstream<<"Replayed "<<(time_ms / 1000.0)<<" s of server time in "
+				<<(total_us / 1000000.0)<<" s, and waited "
+				<<(emerge_us / 1000000.0)<<" s for the emerge threads"
+				<<std::endl;
+		dstream<<"  "<<padStringRight("steps", 12)<<counts[PACKET_TRACE_STEP]
+				<<", "<<(step_us / 1000000.0)<<" s, the longest "
+				<<(step_max_us / 1000.0)<<" ms"<<std::endl;
+		dstream<<"  "<<padStringRight("packets", 12)
+				<<counts[PACKET_TRACE_DATA]<<", "<<(data_us / 1000000.0)
+				<<" s"<<std::endl;
+		dstream<<"  "<<padStringRight("sessions", 12)
+				<<counts[PACKET_TRACE_PEER_ADDED]<<std::endl;
+	}
+	fs::RecursiveDelete(copy_path);
+	return success;
+}
@@ -0,0 +1,120 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PACKETTRACE_HEADER
+#define PACKETTRACE_HEADER
+
+#include "irrlichttypes.h"
+#include <string>
+#include <fstream>
+
+struct SubgameSpec;
+
+/*
+	Packet traces
+
+	A trace has what ServerThread did: the steps of the server, the peers
+	coming and going and the packets received from them, in order.
+	Replaying it in a copy of the world at the start of the recording
+	repeats the work of ProcessData(), the environment and block sending
+	without clients or network, so the timings of builds can be compared
+	on a real workload.
+
+	Format: "MTPT", u16 version, then events of
+		u32 time since the start of the recording in ms
+		u8 type
+		PACKET_TRACE_STEP:         u32 dtime in us, u8 initial step
+		PACKET_TRACE_PEER_ADDED:   u16 peer id
+		PACKET_TRACE_PEER_REMOVED: u16 peer id, u8 timed out
+		PACKET_TRACE_DATA:         u16 peer id, u32 size, data
+*/
+
+#define PACKET_TRACE_VERSION 1
+
+enum PacketTraceEventType
+{
+	PACKET_TRACE_STEP = 0,
+	PACKET_TRACE_PEER_ADDED = 1,
+	PACKET_TRACE_PEER_REMOVED = 2,
+	PACKET_TRACE_DATA = 3,
+};
+
+struct PacketTraceEvent
+{
+	u32 time_ms;
+	u8 type;
+	float dtime;
+	bool initial_step;
+	u16 peer_id;
+	bool timeout;
+	std::string data;
+};
+
+// Used by ServerThread only
+class PacketTraceWriter
+{
+public:
+	PacketTraceWriter(const std::string &path);
+	~PacketTraceWriter();
+
+	bool isOpen()
+	{
+		return m_file.good();
+	}
+
+	void writeStep(float dtime, bool initial_step);
+	void writePeerAdded(u16 peer_id);
+	void writePeerRemoved(u16 peer_id, bool timeout);
+	void writeData(u16 peer_id, const u8 *data, u32 size);
+
+private:
+	void writeHeader(u8 type);
+
+	std::ofstream m_file;
+	u32 m_start_ms;
+};
+
+class PacketTraceReader
+{
+public:
+	PacketTraceReader(const std::string &path);
+
+	// False if the file can't be read or isn't a packet trace
+	bool isOpen()
+	{
+		return m_open;
+	}
+
+	// Returns false at the end; throws SerializationError if the trace
+	// is cut short
+	bool read(PacketTraceEvent &event);
+
+private:
+	std::ifstream m_file;
+	bool m_open;
+};
+
+/*
+	Replays the trace at trace_path in a copy of the world at world_path,
+	as fast as possible, and prints the time it took.
+*/
+bool run_packet_replay(const SubgameSpec &gamespec,
+		const std::string &world_path, const std::string &trace_path);
+
+#endif
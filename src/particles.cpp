@@ -31,6 +31,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "clientmap.h"
 #include "mapnode.h"
+#include "mapblock.h"
+#include <algorithm>
 
 /*
 	Utility
@@ -43,176 +45,272 @@ v3f random_v3f(v3f min, v3f max)
 			rand()/(float)RAND_MAX*(max.Z-min.Z)+min.Z);
 }
 
-std::vector<Particle*> all_particles;
 std::map<u32, ParticleSpawner*> all_particlespawners;
+// Made by the first particle, removed by clear_particles()
+ParticleRenderer *particle_renderer = NULL;
 
-Particle::Particle(
+// Drawn at most this many at a time, so that the indices fit in u16
+#define PARTICLE_BATCH_MAX (65536 / 4)
+
+/*
+	ParticleRenderer
+*/
+
+ParticleRenderer::ParticleRenderer(
 	IGameDef *gamedef,
 	scene::ISceneManager* smgr,
 	LocalPlayer *player,
-	ClientEnvironment &env,
-	v3f pos,
-	v3f velocity,
-	v3f acceleration,
-	float expirationtime,
-	float size,
-	bool collisiondetection,
-	bool vertical,
-	video::ITexture *texture,
-	v2f texpos,
-	v2f texsize
+	ClientEnvironment &env
 ):
-	scene::ISceneNode(smgr->getRootSceneNode(), smgr)
+	scene::ISceneNode(smgr->getRootSceneNode(), smgr),
+	m_env(&env),
+	m_gamedef(gamedef),
+	m_player(player),
+	m_light_block(NULL),
+	m_light_block_valid(false)
 {
-	// Misc
-	m_gamedef = gamedef;
-	m_env = &env;
-
-	// Texture
 	m_material.setFlag(video::EMF_LIGHTING, false);
 	m_material.setFlag(video::EMF_BACK_FACE_CULLING, false);
 	m_material.setFlag(video::EMF_BILINEAR_FILTER, false);
 	m_material.setFlag(video::EMF_FOG_ENABLE, true);
 	m_material.MaterialType = video::EMT_TRANSPARENT_ALPHA_CHANNEL;
-	m_material.setTexture(0, texture);
-	m_texpos = texpos;
-	m_texsize = texsize;
-
 
-	// Particle related
-	m_pos = pos;
-	m_velocity = velocity;
-	m_acceleration = acceleration;
-	m_expiration = expirationtime;
-	m_time = 0;
-	m_player = player;
-	m_size = size;
-	m_collisiondetection = collisiondetection;
-	m_vertical = vertical;
-
-	// Irrlicht stuff
-	m_collisionbox = core::aabbox3d<f32>
-			(-size/2,-size/2,-size/2,size/2,size/2,size/2);
+	// The vertices are in world space, around the camera offset
+	m_box = core::aabbox3d<f32>(-BS*1000000, -BS*1000000, -BS*1000000,
+			BS*1000000, BS*1000000, BS*1000000);
 	this->setAutomaticCulling(scene::EAC_OFF);
 
-	// Init lighting
-	updateLight();
-
-	// Init model
-	updateVertices();
+	// The quads are always 0,1,2, 2,3,0; only the first index differs
+	m_indices.reserve(PARTICLE_BATCH_MAX * 6);
+	for(u32 i = 0; i < PARTICLE_BATCH_MAX; i++)
+	{
+		u16 v = i * 4;
+		m_indices.push_back(v);
+		m_indices.push_back(v + 1);
+		m_indices.push_back(v + 2);
+		m_indices.push_back(v + 2);
+		m_indices.push_back(v + 3);
+		m_indices.push_back(v);
+	}
+}
 
-	all_particles.push_back(this);
+ParticleRenderer::~ParticleRenderer()
+{
 }
 
-Particle::~Particle()
+void ParticleRenderer::add(const Particle &particle)
 {
+	m_particles.push_back(particle);
+	Particle &p = m_particles.back();
+	p.time = 0;
+	m_light_block_valid = false;
+	p.light = getLight(p.pos, m_env->getDayNightRatio());
 }
 
-void Particle::OnRegisterSceneNode()
+void ParticleRenderer::step(float dtime)
 {
-	if (IsVisible)
+	u32 daynight_ratio = m_env->getDayNightRatio();
+	// Blocks may have been unloaded since the last step
+	m_light_block_valid = false;
+
+	// The live particles are moved to the front as the expired ones are
+	// dropped, keeping their order
+	u32 count = 0;
+	for(u32 i = 0; i < m_particles.size(); i++)
 	{
-		SceneManager->registerNodeForRendering
-				(this, scene::ESNRP_TRANSPARENT);
-		SceneManager->registerNodeForRendering
-				(this, scene::ESNRP_SOLID);
+		Particle &p = m_particles[i];
+		if(p.get_expired())
+			continue;
+
+		p.time += dtime;
+		if(p.collisiondetection)
+		{
+			f32 s = p.size / 2;
+			core::aabbox3d<f32> box(-s, -s, -s, s, s, s);
+			v3f p_pos = p.pos*BS;
+			v3f p_velocity = p.velocity*BS;
+			v3f p_acceleration = p.acceleration*BS;
+			collisionMoveSimple(m_env, m_gamedef,
+				BS*0.5, box,
+				0, dtime,
+				p_pos, p_velocity, p_acceleration);
+			p.pos = p_pos/BS;
+			p.velocity = p_velocity/BS;
+			p.acceleration = p_acceleration/BS;
+		}
+		else
+		{
+			p.velocity += p.acceleration * dtime;
+			p.pos += p.velocity * dtime;
+		}
+
+		p.light = getLight(p.pos, daynight_ratio);
+
+		if(count != i)
+			m_particles[count] = p;
+		count++;
 	}
+	m_particles.resize(count);
 
-	ISceneNode::OnRegisterSceneNode();
+	// Nothing keeps a pointer to the block
+	m_light_block_valid = false;
 }
 
-void Particle::render()
+void ParticleRenderer::clear()
 {
-	// TODO: Render particles in front of water and the selectionbox
+	m_particles.clear();
+	m_vertices.clear();
+	m_batches.clear();
+}
 
-	video::IVideoDriver* driver = SceneManager->getVideoDriver();
-	driver->setMaterial(m_material);
-	driver->setTransform(video::ETS_WORLD, AbsoluteTransformation);
+u8 ParticleRenderer::getLight(v3f pos, u32 daynight_ratio)
+{
+	v3s16 p = v3s16(
+		floor(pos.X+0.5),
+		floor(pos.Y+0.5),
+		floor(pos.Z+0.5)
+	);
+	// The particles of a spawner are mostly in the same block
+	v3s16 blockpos = getNodeBlockPos(p);
+	if(!m_light_block_valid || blockpos != m_light_blockpos)
+	{
+		m_light_block = m_env->getClientMap().getBlockNoCreateNoEx(blockpos);
+		m_light_blockpos = blockpos;
+		m_light_block_valid = true;
+	}
+
+	u8 light;
+	bool pos_ok = false;
+	MapNode n;
+	if(m_light_block)
+		n = m_light_block->getNodeNoCheck(p - blockpos*MAP_BLOCKSIZE, &pos_ok);
+	if(pos_ok)
+		light = n.getLightBlend(daynight_ratio, m_gamedef->ndef());
+	else
+		light = blend_light(daynight_ratio, LIGHT_SUN, 0);
 
-	u16 indices[] = {0,1,2, 2,3,0};
-	driver->drawVertexPrimitiveList(m_vertices, 4,
-			indices, 2, video::EVT_STANDARD,
-			scene::EPT_TRIANGLES, video::EIT_16BIT);
+	return decode_light(light);
 }
 
-void Particle::step(float dtime)
+struct ParticleTextureOrder
 {
-	m_time += dtime;
-	if (m_collisiondetection)
+	const std::vector<Particle> *particles;
+
+	bool operator()(u32 a, u32 b) const
 	{
-		core::aabbox3d<f32> box = m_collisionbox;
-		v3f p_pos = m_pos*BS;
-		v3f p_velocity = m_velocity*BS;
-		v3f p_acceleration = m_acceleration*BS;
-		collisionMoveSimple(m_env, m_gamedef,
-			BS*0.5, box,
-			0, dtime,
-			p_pos, p_velocity, p_acceleration);
-		m_pos = p_pos/BS;
-		m_velocity = p_velocity/BS;
-		m_acceleration = p_acceleration/BS;
+		return (*particles)[a].texture < (*particles)[b].texture;
 	}
-	else
+};
+
+void ParticleRenderer::updateVertices()
+{
+	m_batches.clear();
+	m_vertices.clear();
+	if(m_particles.empty())
+		return;
+
+	// Particles of the same texture go together
+	m_order.resize(m_particles.size());
+	for(u32 i = 0; i < m_order.size(); i++)
+		m_order[i] = i;
+	ParticleTextureOrder order;
+	order.particles = &m_particles;
+	std::stable_sort(m_order.begin(), m_order.end(), order);
+
+	// The corners of a quad of size 1 facing the player are the same for
+	// all the particles that aren't vertical
+	v3f corners[4] = {
+		v3f(-0.5,-0.5,0), v3f(0.5,-0.5,0), v3f(0.5,0.5,0), v3f(-0.5,0.5,0)
+	};
+	v3f facing[4];
+	for(u16 j = 0; j < 4; j++)
 	{
-		m_velocity += m_acceleration * dtime;
-		m_pos += m_velocity * dtime;
+		facing[j] = corners[j];
+		facing[j].rotateYZBy(m_player->getPitch());
+		facing[j].rotateXZBy(m_player->getYaw());
 	}
+	v3f ppos = m_player->getPosition()/BS;
+	v3f offset = intToFloat(m_env->getCameraOffset(), BS);
 
-	// Update lighting
-	updateLight();
+	m_vertices.resize(m_particles.size() * 4);
+	for(u32 i = 0; i < m_order.size(); i++)
+	{
+		const Particle &p = m_particles[m_order[i]];
 
-	// Update model
-	updateVertices();
+		if(m_batches.empty() || m_batches.back().texture != p.texture
+				|| m_batches.back().quad_count == PARTICLE_BATCH_MAX)
+		{
+			Batch batch;
+			batch.texture = p.texture;
+			batch.first_quad = i;
+			batch.quad_count = 0;
+			m_batches.push_back(batch);
+		}
+		m_batches.back().quad_count++;
+
+		v3f rotated[4];
+		const v3f *quad = facing;
+		if(p.vertical)
+		{
+			f32 angle = atan2(ppos.Z-p.pos.Z, ppos.X-p.pos.X)/core::DEGTORAD+90;
+			for(u16 j = 0; j < 4; j++)
+			{
+				rotated[j] = corners[j];
+				rotated[j].rotateXZBy(angle);
+			}
+			quad = rotated;
+		}
+
+		video::SColor c(255, p.light, p.light, p.light);
+		f32 tx0 = p.texpos.X;
+		f32 tx1 = p.texpos.X + p.texsize.X;
+		f32 ty0 = p.texpos.Y;
+		f32 ty1 = p.texpos.Y + p.texsize.Y;
+		v3f center = p.pos*BS - offset;
+
+		video::S3DVertex *v = &m_vertices[i * 4];
+		v[0] = video::S3DVertex(center + quad[0]*p.size, v3f(0,0,0),
+				c, v2f(tx0, ty1));
+		v[1] = video::S3DVertex(center + quad[1]*p.size, v3f(0,0,0),
+				c, v2f(tx1, ty1));
+		v[2] = video::S3DVertex(center + quad[2]*p.size, v3f(0,0,0),
+				c, v2f(tx1, ty0));
+		v[3] = video::S3DVertex(center + quad[3]*p.size, v3f(0,0,0),
+				c, v2f(tx0, ty0));
+	}
 }
 
-void Particle::updateLight()
+void ParticleRenderer::OnRegisterSceneNode()
 {
-	u8 light = 0;
-	bool pos_ok;
+	if (IsVisible && !m_particles.empty())
+	{
+		// Once for the frame, the two passes draw the same
+		updateVertices();
 
-	v3s16 p = v3s16(
-		floor(m_pos.X+0.5),
-		floor(m_pos.Y+0.5),
-		floor(m_pos.Z+0.5)
-	);
-	MapNode n = m_env->getClientMap().getNodeNoEx(p, &pos_ok);
-	if (pos_ok)
-		light = n.getLightBlend(m_env->getDayNightRatio(), m_gamedef->ndef());
-	else
-		light = blend_light(m_env->getDayNightRatio(), LIGHT_SUN, 0);
+		SceneManager->registerNodeForRendering
+				(this, scene::ESNRP_TRANSPARENT);
+		SceneManager->registerNodeForRendering
+				(this, scene::ESNRP_SOLID);
+	}
 
-	m_light = decode_light(light);
+	ISceneNode::OnRegisterSceneNode();
 }
 
-void Particle::updateVertices()
+void ParticleRenderer::render()
 {
-	video::SColor c(255, m_light, m_light, m_light);
-	f32 tx0 = m_texpos.X;
-	f32 tx1 = m_texpos.X + m_texsize.X;
-	f32 ty0 = m_texpos.Y;
-	f32 ty1 = m_texpos.Y + m_texsize.Y;
-
-	m_vertices[0] = video::S3DVertex(-m_size/2,-m_size/2,0, 0,0,0,
-			c, tx0, ty1);
-	m_vertices[1] = video::S3DVertex(m_size/2,-m_size/2,0, 0,0,0,
-			c, tx1, ty1);
-	m_vertices[2] = video::S3DVertex(m_size/2,m_size/2,0, 0,0,0,
-			c, tx1, ty0);
-	m_vertices[3] = video::S3DVertex(-m_size/2,m_size/2,0, 0,0,0,
-			c, tx0, ty0);
-
-	v3s16 camera_offset = m_env->getCameraOffset();
-	for(u16 i=0; i<4; i++)
+	// TODO: Render particles in front of water and the selectionbox
+
+	video::IVideoDriver* driver = SceneManager->getVideoDriver();
+	driver->setTransform(video::ETS_WORLD, core::IdentityMatrix);
+
+	for(u32 i = 0; i < m_batches.size(); i++)
 	{
-		if (m_vertical) {
-			v3f ppos = m_player->getPosition()/BS;
-			m_vertices[i].Pos.rotateXZBy(atan2(ppos.Z-m_pos.Z, ppos.X-m_pos.X)/core::DEGTORAD+90);
-		} else {
-			m_vertices[i].Pos.rotateYZBy(m_player->getPitch());
-			m_vertices[i].Pos.rotateXZBy(m_player->getYaw());
-		}
-		m_box.addInternalPoint(m_vertices[i].Pos);
-		m_vertices[i].Pos += m_pos*BS - intToFloat(camera_offset, BS);
+		const Batch &batch = m_batches[i];
+		m_material.setTexture(0, batch.texture);
+		driver->setMaterial(m_material);
+		driver->drawVertexPrimitiveList(&m_vertices[batch.first_quad * 4],
+				batch.quad_count * 4, &m_indices[0], batch.quad_count * 2,
+				video::EVT_STANDARD, scene::EPT_TRIANGLES, video::EIT_16BIT);
 	}
 }
 
@@ -220,24 +318,34 @@ void Particle::updateVertices()
 	Helpers
 */
 
+void addParticle(IGameDef* gamedef, scene::ISceneManager* smgr,
+		LocalPlayer *player, ClientEnvironment &env,
+		v3f pos, v3f velocity, v3f acceleration,
+		float expirationtime, float size,
+		bool collisiondetection, bool vertical,
+		video::ITexture *texture, v2f texpos, v2f texsize)
+{
+	if(particle_renderer == NULL)
+		particle_renderer = new ParticleRenderer(gamedef, smgr, player, env);
+
+	Particle p;
+	p.pos = pos;
+	p.velocity = velocity;
+	p.acceleration = acceleration;
+	p.expiration = expirationtime;
+	p.size = size;
+	p.collisiondetection = collisiondetection;
+	p.vertical = vertical;
+	p.texture = texture;
+	p.texpos = texpos;
+	p.texsize = texsize;
+	particle_renderer->add(p);
+}
 
 void allparticles_step (float dtime)
 {
-	for(std::vector<Particle*>::iterator i = all_particles.begin();
-			i != all_particles.end();)
-	{
-		if ((*i)->get_expired())
-		{
-			(*i)->remove();
-			delete *i;
-			i = all_particles.erase(i);
-		}
-		else
-		{
-			(*i)->step(dtime);
-			i++;
-		}
-	}
+	if(particle_renderer)
+		particle_renderer->step(dtime);
 }
 
 void addDiggingParticles(IGameDef* gamedef, scene::ISceneManager* smgr,
@@ -291,7 +399,7 @@ void addNodeParticle(IGameDef* gamedef, scene::ISceneManager* smgr,
 		(f32)pos.Z+rand()%100/200.-0.25
 	);
 
-	new Particle(
+	addParticle(
 		gamedef,
 		smgr,
 		player,
@@ -372,7 +480,7 @@ void ParticleSpawner::step(float dtime, ClientEnvironment &env)
 						*(m_maxsize-m_minsize)
 						+m_minsize;
 
-				new Particle(
+				addParticle(
 					m_gamedef,
 					m_smgr,
 					m_player,
@@ -411,7 +519,7 @@ void ParticleSpawner::step(float dtime, ClientEnvironment &env)
 						*(m_maxsize-m_minsize)
 						+m_minsize;
 
-				new Particle(
+				addParticle(
 					m_gamedef,
 					m_smgr,
 					m_player,
@@ -469,12 +577,11 @@ void clear_particles ()
 		all_particlespawners.erase(i++);
 	}
 
-	for(std::vector<Particle*>::iterator i =
-			all_particles.begin();
-			i != all_particles.end();)
+	if(particle_renderer)
 	{
-		(*i)->remove();
-		delete *i;
-		i = all_particles.erase(i);
+		particle_renderer->clear();
+		particle_renderer->remove();
+		particle_renderer->drop();
+		particle_renderer = NULL;
 	}
 }
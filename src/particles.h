@@ -28,26 +28,45 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "localplayer.h"
 #include "environment.h"
 
-class Particle : public scene::ISceneNode
+class MapBlock;
+
+/*
+	A particle is only data; all of them are moved by allparticles_step()
+	and drawn by one ParticleRenderer.
+*/
+struct Particle
+{
+	v3f pos;
+	v3f velocity;
+	v3f acceleration;
+	float time;
+	float expiration;
+	float size;
+	bool collisiondetection;
+	bool vertical;
+	video::ITexture *texture;
+	v2f texpos;
+	v2f texsize;
+	u8 light;
+
+	bool get_expired ()
+	{ return expiration < time; }
+};
+
+/*
+	Keeps the live particles in one array and draws them with one vertex
+	buffer for each texture, made once a frame.
+*/
+class ParticleRenderer : public scene::ISceneNode
 {
 	public:
-	Particle(
+	ParticleRenderer(
 		IGameDef* gamedef,
 		scene::ISceneManager* mgr,
 		LocalPlayer *player,
-		ClientEnvironment &env,
-		v3f pos,
-		v3f velocity,
-		v3f acceleration,
-		float expirationtime,
-		float size,
-		bool collisiondetection,
-		bool vertical,
-		video::ITexture *texture,
-		v2f texpos,
-		v2f texsize
+		ClientEnvironment &env
 	);
-	~Particle();
+	~ParticleRenderer();
 
 	virtual const core::aabbox3d<f32>& getBoundingBox() const
 	{
@@ -67,35 +86,39 @@ class Particle : public scene::ISceneNode
 	virtual void OnRegisterSceneNode();
 	virtual void render();
 
+	void add(const Particle &particle);
 	void step(float dtime);
-
-	bool get_expired ()
-	{ return m_expiration < m_time; }
+	void clear();
 
 private:
-	void updateLight();
+	// Light of the particle at pos, through the block of the last lookup
+	u8 getLight(v3f pos, u32 daynight_ratio);
 	void updateVertices();
 
-	video::S3DVertex m_vertices[4];
-	float m_time;
-	float m_expiration;
+	std::vector<Particle> m_particles;
+
+	// Made by updateVertices(): the quads of the particles, in batches of
+	// the same texture
+	struct Batch
+	{
+		video::ITexture *texture;
+		u32 first_quad;
+		u32 quad_count;
+	};
+	std::vector<video::S3DVertex> m_vertices;
+	std::vector<u16> m_indices;
+	std::vector<Batch> m_batches;
+	std::vector<u32> m_order;
 
 	ClientEnvironment *m_env;
 	IGameDef *m_gamedef;
+	LocalPlayer *m_player;
 	core::aabbox3d<f32> m_box;
-	core::aabbox3d<f32> m_collisionbox;
 	video::SMaterial m_material;
-	v2f m_texpos;
-	v2f m_texsize;
-	v3f m_pos;
-	v3f m_velocity;
-	v3f m_acceleration;
-	LocalPlayer *m_player;
-	float m_size;
-	u8 m_light;
-	bool m_collisiondetection;
-	bool m_vertical;
-	v3s16 m_camera_offset;
+
+	MapBlock *m_light_block;
+	v3s16 m_light_blockpos;
+	bool m_light_block_valid;
 };
 
 class ParticleSpawner
@@ -146,6 +169,13 @@ class ParticleSpawner
 	bool m_vertical;
 };
 
+void addParticle(IGameDef* gamedef, scene::ISceneManager* smgr,
+	LocalPlayer *player, ClientEnvironment &env,
+	v3f pos, v3f velocity, v3f acceleration,
+	float expirationtime, float size,
+	bool collisiondetection, bool vertical,
+	video::ITexture *texture, v2f texpos, v2f texsize);
+
 void allparticles_step (float dtime);
 void allparticlespawners_step (float dtime, ClientEnvironment &env);
 
@@ -24,7 +24,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "pathfinder.h"
 #include "environment.h"
 #include "map.h"
+#include "mapblock.h"
+#include "voxel.h"
 #include "log.h"
+#include "porting.h"
+#include "settings.h"
+#include "main.h" // for g_settings
+#include "jthread/jmutexautolock.h"
+
+#include <algorithm>
 
 #ifdef PATHFINDER_DEBUG
 #include <iomanip>
@@ -44,6 +52,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define LVL "(" << level << ")" <<
 
+/** most paths kept by a path_cache before the oldest are dropped */
+#define PATH_CACHE_MAX_RESULTS 256
+/** most block navigations kept by a path_cache before all are dropped */
+#define PATH_CACHE_MAX_BLOCKS 4096
+
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 #ifdef PATHFINDER_DEBUG
 #define DEBUG_OUT(a)     std::cout << a
 #define INFO_TARGET      std::cout
@@ -68,11 +87,254 @@ std::vector<v3s16> get_Path(ServerEnvironment* env,
 							unsigned int max_drop,
 							algorithm algo) {
 
+	path_cache* cache = env->getPathCache();
+	path_request request(source, destination,
+			searchdistance, max_jump, max_drop, algo);
+
+	static SettingHandle<float> ttl_setting(g_settings, "pathfinder_cache_ttl");
+	float ttl = ttl_setting.get();
+	std::vector<v3s16> path;
+	if ((ttl > 0) && cache->get_result(request, path))
+		return path;
+
 	pathfinder searchclass;
 
-	return searchclass.get_Path(env,
+	path = searchclass.get_Path(env,
 				source,destination,
 				searchdistance,max_jump,max_drop,algo);
+
+	if (ttl > 0) {
+		v3s16 minblock = getNodeBlockPos(v3s16(
+				MYMIN(source.X,destination.X) - searchdistance,
+				MYMIN(source.Y,destination.Y) - searchdistance,
+				MYMIN(source.Z,destination.Z) - searchdistance));
+		v3s16 maxblock = getNodeBlockPos(v3s16(
+				MYMAX(source.X,destination.X) + searchdistance,
+				MYMAX(source.Y,destination.Y) + searchdistance,
+				MYMAX(source.Z,destination.Z) + searchdistance));
+		cache->set_result(request, path, minblock, maxblock, ttl * 1000);
+	}
+	return path;
+}
+
+/******************************************************************************/
+path_block_nav::path_block_nav()
+:	complete(false)
+{
+	//intentionaly empty
+}
+
+/******************************************************************************/
+path_block_key::path_block_key(v3s16 block_, int max_jump_, int max_drop_)
+:	block(block_),
+	max_jump(max_jump_),
+	max_drop(max_drop_)
+{
+	//intentionaly empty
+}
+
+/******************************************************************************/
+bool path_block_key::operator< (const path_block_key& b) const {
+	if (block != b.block)
+		return block < b.block;
+	if (max_jump != b.max_jump)
+		return max_jump < b.max_jump;
+	return max_drop < b.max_drop;
+}
+
+/******************************************************************************/
+path_request::path_request(v3s16 source_, v3s16 destination_,
+		unsigned int searchdistance_, unsigned int max_jump_,
+		unsigned int max_drop_, algorithm algo_)
+:	source(source_),
+	destination(destination_),
+	searchdistance(searchdistance_),
+	max_jump(max_jump_),
+	max_drop(max_drop_),
+	algo(algo_)
+{
+	//intentionaly empty
+}
+
+/******************************************************************************/
+bool path_request::operator< (const path_request& b) const {
+	if (source != b.source)
+		return source < b.source;
+	if (destination != b.destination)
+		return destination < b.destination;
+	if (searchdistance != b.searchdistance)
+		return searchdistance < b.searchdistance;
+	if (max_jump != b.max_jump)
+		return max_jump < b.max_jump;
+	if (max_drop != b.max_drop)
+		return max_drop < b.max_drop;
+	return algo < b.algo;
+}
+
+/******************************************************************************/
+void path_cache::invalidate(const VoxelArea& area) {
+	JMutexAutoLock lock(m_mutex);
+
+	if (m_blocks.empty() && m_results.empty())
+		return;
+
+	// The navigation of a block depends on the nodes around it too
+	v3s16 minblock = getNodeBlockPos(area.MinEdge) - v3s16(1,1,1);
+	v3s16 maxblock = getNodeBlockPos(area.MaxEdge) + v3s16(1,1,1);
+
+	if (!m_blocks.empty()) {
+		v3s16 p;
+		for (p.X = minblock.X; p.X <= maxblock.X; p.X++)
+		for (p.Y = minblock.Y; p.Y <= maxblock.Y; p.Y++)
+		for (p.Z = minblock.Z; p.Z <= maxblock.Z; p.Z++) {
+			std::map<path_block_key, path_block_nav>::iterator i =
+					m_blocks.lower_bound(path_block_key(p, 0, 0));
+			while ((i != m_blocks.end()) && (i->first.block == p))
+				m_blocks.erase(i++);
+		}
+	}
+
+	invalidate_results(minblock, maxblock);
+}
+
+/******************************************************************************/
+void path_cache::invalidate(const std::set<v3s16>& blocks) {
+	if (blocks.empty())
+		return;
+
+	// The navigation of a block depends on the nodes around it too, so
+	// find every block that may be affected before taking the lock
+	std::set<v3s16> affected;
+	v3s16 minblock = *blocks.begin();
+	v3s16 maxblock = *blocks.begin();
+	for (std::set<v3s16>::const_iterator i = blocks.begin();
+			i != blocks.end(); ++i) {
+		v3s16 d;
+		for (d.X = -1; d.X <= 1; d.X++)
+		for (d.Y = -1; d.Y <= 1; d.Y++)
+		for (d.Z = -1; d.Z <= 1; d.Z++)
+			affected.insert(*i + d);
+		minblock.X = MYMIN(minblock.X, i->X);
+		minblock.Y = MYMIN(minblock.Y, i->Y);
+		minblock.Z = MYMIN(minblock.Z, i->Z);
+		maxblock.X = MYMAX(maxblock.X, i->X);
+		maxblock.Y = MYMAX(maxblock.Y, i->Y);
+		maxblock.Z = MYMAX(maxblock.Z, i->Z);
+	}
+	minblock -= v3s16(1,1,1);
+	maxblock += v3s16(1,1,1);
+
+	JMutexAutoLock lock(m_mutex);
+
+	if (!m_blocks.empty()) {
+		for (std::set<v3s16>::iterator p = affected.begin();
+				p != affected.end(); ++p) {
+			std::map<path_block_key, path_block_nav>::iterator i =
+					m_blocks.lower_bound(path_block_key(*p, 0, 0));
+			while ((i != m_blocks.end()) && (i->first.block == *p))
+				m_blocks.erase(i++);
+		}
+	}
+
+	invalidate_results(minblock, maxblock);
+}
+
+/******************************************************************************/
+void path_cache::invalidate_results(v3s16 minblock, v3s16 maxblock) {
+	for (std::map<path_request, result>::iterator i = m_results.begin();
+			i != m_results.end();) {
+		if ((i->second.minblock.X <= maxblock.X) &&
+				(i->second.maxblock.X >= minblock.X) &&
+				(i->second.minblock.Y <= maxblock.Y) &&
+				(i->second.maxblock.Y >= minblock.Y) &&
+				(i->second.minblock.Z <= maxblock.Z) &&
+				(i->second.maxblock.Z >= minblock.Z))
+			m_results.erase(i++);
+		else
+			++i;
+	}
+}
+
+/******************************************************************************/
+void path_cache::clear() {
+	JMutexAutoLock lock(m_mutex);
+	m_blocks.clear();
+	m_results.clear();
+}
+
+/******************************************************************************/
+bool path_cache::get_result(const path_request& request,
+		std::vector<v3s16>& path) {
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<path_request, result>::iterator i = m_results.find(request);
+	if (i == m_results.end())
+		return false;
+
+	if ((int)(porting::getTimeMs() - i->second.expires_ms) >= 0) {
+		m_results.erase(i);
+		return false;
+	}
+	path = i->second.path;
+	return true;
+}
+
+/******************************************************************************/
+void path_cache::set_result(const path_request& request,
+		const std::vector<v3s16>& path,
+		v3s16 minblock, v3s16 maxblock, unsigned int ttl_ms) {
+	JMutexAutoLock lock(m_mutex);
+
+	unsigned int now = porting::getTimeMs();
+
+	if (m_results.size() >= PATH_CACHE_MAX_RESULTS) {
+		for (std::map<path_request, result>::iterator i = m_results.begin();
+				i != m_results.end();) {
+			if ((int)(now - i->second.expires_ms) >= 0)
+				m_results.erase(i++);
+			else
+				++i;
+		}
+		if (m_results.size() >= PATH_CACHE_MAX_RESULTS)
+			m_results.clear();
+	}
+
+	result& r    = m_results[request];
+	r.path       = path;
+	r.minblock   = minblock;
+	r.maxblock   = maxblock;
+	r.expires_ms = now + ttl_ms;
+}
+
+/******************************************************************************/
+bool path_cache::get_block(const path_block_key& key, path_block_nav& nav) {
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<path_block_key, path_block_nav>::iterator i = m_blocks.find(key);
+	if (i == m_blocks.end())
+		return false;
+	nav = i->second;
+	return true;
+}
+
+/******************************************************************************/
+void path_cache::set_block(const path_block_key& key,
+		const path_block_nav& nav) {
+	JMutexAutoLock lock(m_mutex);
+
+	if (m_blocks.size() >= PATH_CACHE_MAX_BLOCKS)
+		m_blocks.clear();
+	m_blocks[key] = nav;
+}
+
+/******************************************************************************/
+void path_cache::set_exit_costs(const path_block_key& key, v3s16 cell,
+		const std::vector<int>& costs) {
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<path_block_key, path_block_nav>::iterator i = m_blocks.find(key);
+	if (i != m_blocks.end())
+		i->second.exit_costs[cell] = costs;
 }
 
 /******************************************************************************/
@@ -233,16 +495,64 @@ std::vector<v3s16> pathfinder::get_Path(ServerEnvironment* env,
 	int min_z = MYMIN(source.Z,destination.Z);
 	int max_z = MYMAX(source.Z,destination.Z);
 
-	m_limits.X.min = min_x - searchdistance;
-	m_limits.X.max = max_x + searchdistance;
-	m_limits.Y.min = min_y - searchdistance;
-	m_limits.Y.max = max_y + searchdistance;
-	m_limits.Z.min = min_z - searchdistance;
-	m_limits.Z.max = max_z + searchdistance;
+	m_search_limits.X.min = min_x - searchdistance;
+	m_search_limits.X.max = max_x + searchdistance;
+	m_search_limits.Y.min = min_y - searchdistance;
+	m_search_limits.Y.max = max_y + searchdistance;
+	m_search_limits.Z.min = min_z - searchdistance;
+	m_search_limits.Z.max = max_z + searchdistance;
 
-	m_max_index_x = m_limits.X.max - m_limits.X.min;
-	m_max_index_y = m_limits.Y.max - m_limits.Y.min;
-	m_max_index_z = m_limits.Z.max - m_limits.Z.min;
+	set_limits(m_search_limits);
+
+	//validate start and end pos
+	v3s16 StartIndex  = getIndexPos(source);
+	v3s16 EndIndex    = getIndexPos(destination);
+
+	if (!valid_index(StartIndex) || !valid_index(EndIndex)) {
+		VERBOSE_TARGET << "startpos or stoppos outside of search area"
+				<< std::endl;
+		return retval;
+	}
+
+	std::vector<v3s16> path;
+
+	if (algo != DIJKSTRA) {
+		if (!is_surface(source)) {
+			VERBOSE_TARGET << "invalid startpos" <<
+					"Realpos: " << PPOS(source) << std::endl;
+			return retval;
+		}
+		if (!is_surface(destination)) {
+			VERBOSE_TARGET << "invalid stoppos" <<
+					"Realpos: " << PPOS(destination) << std::endl;
+			return retval;
+		}
+
+		// Far away, walking from block to block is much less work
+		static SettingHandle<s32> hierarchical_distance_setting(g_settings,
+				"pathfinder_hierarchical_distance");
+		int hierarchical_distance = hierarchical_distance_setting.get();
+		if ((hierarchical_distance > 0) &&
+				(get_manhattandistance(source) >= hierarchical_distance) &&
+				(getNodeBlockPos(source) != getNodeBlockPos(destination))) {
+			m_cache = env->getPathCache();
+			bool found = find_path_hierarchical(path);
+			m_navs.clear();
+			if (found)
+				return optimize_path(path);
+
+			// Block exits don't cover every way through a block
+			VERBOSE_TARGET << "no path found between block exits" << std::endl;
+			path.clear();
+			set_limits(m_search_limits);
+		}
+
+		if (!find_path_astar(StartIndex, EndIndex, path)) {
+			VERBOSE_TARGET << "no path found" << std::endl;
+			return retval;
+		}
+		return optimize_path(path);
+	}
 
 	//build data map
 	if (!build_costmap()) {
@@ -255,10 +565,7 @@ std::vector<v3s16> pathfinder::get_Path(ServerEnvironment* env,
 	print_ydir();
 #endif
 
-	//validate and mark start and end pos
-	v3s16 StartIndex  = getIndexPos(source);
-	v3s16 EndIndex    = getIndexPos(destination);
-
+	//mark start and end pos
 	path_gridnode& startpos = getIndexElement(StartIndex);
 	path_gridnode& endpos   = getIndexElement(EndIndex);
 
@@ -281,18 +588,7 @@ std::vector<v3s16> pathfinder::get_Path(ServerEnvironment* env,
 
 	bool update_cost_retval = false;
 
-	switch (algo) {
-		case DIJKSTRA:
-			update_cost_retval = update_all_costs(StartIndex,v3s16(0,0,0),0,0);
-			break;
-		case A_PLAIN_NP:
-		case A_PLAIN:
-			update_cost_retval = update_cost_heuristic(StartIndex,v3s16(0,0,0),0,0);
-			break;
-		default:
-			ERROR_TARGET << "missing algorithm"<< std::endl;
-			break;
-	}
+	update_cost_retval = update_all_costs(StartIndex,v3s16(0,0,0),0,0);
 
 	if (update_cost_retval) {
 
@@ -302,7 +598,6 @@ std::vector<v3s16> pathfinder::get_Path(ServerEnvironment* env,
 #endif
 
 		//find path
-		std::vector<v3s16> path;
 		build_path(path,EndIndex,0);
 
 #ifdef PATHFINDER_DEBUG
@@ -310,28 +605,11 @@ std::vector<v3s16> pathfinder::get_Path(ServerEnvironment* env,
 		print_path(path);
 #endif
 
-		//optimize path
-		std::vector<v3s16> optimized_path;
-
-		std::vector<v3s16>::iterator startpos = path.begin();
-		optimized_path.push_back(source);
-
 		for (std::vector<v3s16>::iterator i = path.begin();
-					i != path.end(); i++) {
-			if (!m_env->line_of_sight(
-				tov3f(getIndexElement(*startpos).pos),
-				tov3f(getIndexElement(*i).pos))) {
-				optimized_path.push_back(getIndexElement(*(i-1)).pos);
-				startpos = (i-1);
-			}
-		}
-
-		optimized_path.push_back(destination);
+					i != path.end(); i++)
+			*i = getIndexElement(*i).pos;
 
-#ifdef PATHFINDER_DEBUG
-		std::cout << "Optimized path:" << std::endl;
-		print_path(optimized_path);
-#endif
+		std::vector<v3s16> optimized_path = optimize_path(path);
 #ifdef PATHFINDER_CALC_TIME
 		timespec ts2;
 		clock_gettime(CLOCK_REALTIME, &ts2);
@@ -371,6 +649,9 @@ pathfinder::pathfinder() :
 	m_start(0,0,0),
 	m_destination(0,0,0),
 	m_limits(),
+	m_search_limits(),
+	m_cache(0),
+	m_navs(),
 	m_data(),
 	m_env(0)
 {
@@ -726,159 +1007,574 @@ int pathfinder::get_manhattandistance(v3s16 pos) {
 }
 
 /******************************************************************************/
-v3s16 pathfinder::get_dir_heuristic(std::vector<v3s16>& directions,path_gridnode& g_pos) {
-	int   minscore = -1;
-	v3s16 retdir   = v3s16(0,0,0);
-	v3s16 srcpos = g_pos.pos;
-	DEBUG_OUT("Pathfinder: remaining dirs at beginning:"
-				<< directions.size() << std::endl);
+bool pathfinder::is_surface(v3s16 pos) {
+	MapNode current = m_env->getMap().getNodeNoEx(pos);
+	MapNode below   = m_env->getMap().getNodeNoEx(pos + v3s16(0,-1,0));
 
-	for (std::vector<v3s16>::iterator iter = directions.begin();
-			iter != directions.end();
-			iter ++) {
+	return (current.param0 == CONTENT_AIR) &&
+			(below.param0 != CONTENT_AIR) &&
+			(below.param0 != CONTENT_IGNORE);
+}
+
+/******************************************************************************/
+/** 2d manhattan distance between two positions */
+static inline int manhattan_distance(v3s16 a, v3s16 b) {
+	return abs(a.X - b.X) + abs(a.Z - b.Z);
+}
 
-		v3s16 pos1 =  v3s16(srcpos.X + iter->X,0,srcpos.Z+iter->Z);
+/** node of the A* search, valid for the search it was last touched by */
+struct path_astar_node {
+	unsigned int search;     /**< number of the search using the node       */
+	bool         closed;     /**< node has been expanded                    */
+	int          totalcost;  /**< cost to move here from starting point     */
+	unsigned int parent;     /**< index of the node moved here from         */
+};
+
+/** open node of the A* search; outdated entries are skipped when popped */
+struct path_open_entry {
+	int          estimate;   /**< totalcost + distance to target            */
+	int          distance;   /**< manhattan distance to target              */
+	int          totalcost;  /**< cost to move here when it was added       */
+	unsigned int index;      /**< index of the node                         */
+
+	/* std::push_heap keeps the largest entry on top, so the entry with
+	 * the smallest estimate is the largest; on a tie, the one closer to
+	 * the target */
+	bool operator< (const path_open_entry& b) const {
+		if (estimate != b.estimate)
+			return estimate > b.estimate;
+		return distance > b.distance;
+	}
+};
 
-		int cur_manhattan = get_manhattandistance(pos1);
-		path_cost cost    = g_pos.get_cost(*iter);
+/** memory of the searches of a thread, kept for its next searches */
+struct path_arena {
+	path_arena() : search(0) {}
 
-		if (!cost.updated) {
-			cost = calc_cost(g_pos.pos,*iter);
-			g_pos.set_cost(*iter,cost);
-		}
+	unsigned int                 search;
+	std::vector<path_astar_node> nodes;
+	std::vector<path_open_entry> open;
+};
 
-		if (cost.valid) {
-			int score = cost.value + cur_manhattan;
+static THREAD_LOCAL path_arena *t_path_arena = NULL;
 
-			if ((minscore < 0)|| (score < minscore)) {
-				minscore = score;
-				retdir = *iter;
+/******************************************************************************/
+bool pathfinder::run_search(v3s16 start_index, v3s16 end_index,
+		bool to_end) {
+
+	if (t_path_arena == NULL)
+		t_path_arena = new path_arena();
+	path_arena& arena = *t_path_arena;
+
+	unsigned int volume = m_max_index_x * m_max_index_y * m_max_index_z;
+	if (arena.nodes.size() < volume)
+		arena.nodes.resize(volume);
+
+	// The nodes of earlier searches are told apart by their number, so
+	// that the arena doesn't have to be cleared
+	arena.search++;
+	if (arena.search == 0) {
+		for (unsigned int i = 0; i < arena.nodes.size(); i++)
+			arena.nodes[i].search = 0;
+		arena.search = 1;
+	}
+	arena.open.clear();
+
+	unsigned int start = get_flat_index(start_index);
+	unsigned int end   = get_flat_index(end_index);
+	v3s16 target       = getRealPos(end_index);
+
+	path_astar_node& startnode = arena.nodes[start];
+	startnode.search    = arena.search;
+	startnode.closed    = false;
+	startnode.totalcost = 0;
+	startnode.parent    = start;
+
+	path_open_entry first;
+	first.distance  = to_end ? manhattan_distance(getRealPos(start_index),
+			target) : 0;
+	first.estimate  = first.distance;
+	first.totalcost = 0;
+	first.index     = start;
+	arena.open.push_back(first);
+
+	static const v3s16 directions[4] = {
+		v3s16( 1,0, 0),
+		v3s16(-1,0, 0),
+		v3s16( 0,0, 1),
+		v3s16( 0,0,-1)
+	};
+
+	while (!arena.open.empty()) {
+		std::pop_heap(arena.open.begin(), arena.open.end());
+		path_open_entry current = arena.open.back();
+		arena.open.pop_back();
+
+		path_astar_node& node = arena.nodes[current.index];
+		if (node.closed || (node.totalcost != current.totalcost))
+			continue;
+		node.closed = true;
+
+		if (to_end && (current.index == end))
+			return true;
+
+		v3s16 ipos = get_index_from_flat(current.index);
+		v3s16 pos  = getRealPos(ipos);
+
+		// The costs are only calculated for the nodes the search reaches
+		for (unsigned int i = 0; i < 4; i++) {
+			path_cost cost = calc_cost(pos, directions[i]);
+			if (!cost.valid)
+				continue;
+
+			v3s16 ipos2 = ipos + directions[i] + v3s16(0,cost.direction,0);
+			if (!valid_index(ipos2))
+				continue;
+
+			unsigned int index2 = get_flat_index(ipos2);
+			path_astar_node& node2 = arena.nodes[index2];
+			if (node2.search != arena.search) {
+				node2.search    = arena.search;
+				node2.closed    = false;
+				node2.totalcost = -1;
 			}
+
+			int new_cost = node.totalcost + cost.value;
+			if (node2.closed ||
+					((node2.totalcost >= 0) && (node2.totalcost <= new_cost)))
+				continue;
+
+			node2.totalcost = new_cost;
+			node2.parent    = current.index;
+
+			path_open_entry next;
+			next.distance  = to_end ?
+					manhattan_distance(getRealPos(ipos2), target) : 0;
+			next.estimate  = new_cost + next.distance;
+			next.totalcost = new_cost;
+			next.index     = index2;
+			arena.open.push_back(next);
+			std::push_heap(arena.open.begin(), arena.open.end());
 		}
 	}
+	return false;
+}
 
-	if (retdir != v3s16(0,0,0)) {
-		for (std::vector<v3s16>::iterator iter = directions.begin();
-					iter != directions.end();
-					iter ++) {
-			if(*iter == retdir) {
-				DEBUG_OUT("Pathfinder: removing return direction" << std::endl);
-				directions.erase(iter);
-				break;
-			}
-		}
+/******************************************************************************/
+bool pathfinder::find_path_astar(v3s16 start_index, v3s16 end_index,
+		std::vector<v3s16>& path) {
+
+	if (!run_search(start_index, end_index, true))
+		return false;
+
+	path_arena& arena = *t_path_arena;
+	unsigned int start = get_flat_index(start_index);
+	unsigned int first = path.size();
+
+	for (unsigned int i = get_flat_index(end_index); ;
+			i = arena.nodes[i].parent) {
+		path.push_back(getRealPos(get_index_from_flat(i)));
+		if (i == start)
+			break;
 	}
-	else {
-		DEBUG_OUT("Pathfinder: didn't find any valid direction clearing"
-					<< std::endl);
-		directions.clear();
+	std::reverse(path.begin() + first, path.end());
+	return true;
+}
+
+/******************************************************************************/
+void pathfinder::find_costs(v3s16 start_index,
+		const std::vector<v3s16>& targets, std::vector<int>& costs) {
+
+	run_search(start_index, start_index, false);
+
+	path_arena& arena = *t_path_arena;
+	costs.resize(targets.size());
+
+	for (unsigned int i = 0; i < targets.size(); i++) {
+		costs[i] = -1;
+		v3s16 ipos = getIndexPos(targets[i]);
+		if (!valid_index(ipos))
+			continue;
+		path_astar_node& node = arena.nodes[get_flat_index(ipos)];
+		if ((node.search == arena.search) && node.closed)
+			costs[i] = node.totalcost;
 	}
-	DEBUG_OUT("Pathfinder: remaining dirs at end:" << directions.size()
-				<< std::endl);
-	return retdir;
 }
 
 /******************************************************************************/
-bool pathfinder::update_cost_heuristic(	v3s16 ipos,
-									v3s16 srcdir,
-									int current_cost,
-									int level) {
+/** node of the search over block exits */
+struct path_exit_node {
+	int   totalcost;  /**< cost to move here from starting point            */
+	v3s16 parent;     /**< cell moved here from                             */
+	bool  closed;     /**< node has been expanded                           */
+	bool  crossing;   /**< reached by a single move out of the parent block */
+};
+
+/** open node of the search over block exits */
+struct path_exit_entry {
+	int   estimate;   /**< totalcost + distance to target                   */
+	int   distance;   /**< manhattan distance to target                     */
+	int   totalcost;  /**< cost to move here when it was added              */
+	v3s16 pos;        /**< real position of the node                        */
+
+	bool operator< (const path_exit_entry& b) const {
+		if (estimate != b.estimate)
+			return estimate > b.estimate;
+		return distance > b.distance;
+	}
+};
 
-	path_gridnode& g_pos = getIndexElement(ipos);
-	g_pos.totalcost = current_cost;
-	g_pos.sourcedir = srcdir;
+/** add a node to the search over block exits, unless it's known cheaper */
+static void add_exit_node(std::map<v3s16, path_exit_node>& nodes,
+		std::vector<path_exit_entry>& open, v3s16 pos, v3s16 parent,
+		int totalcost, bool crossing, v3s16 destination) {
 
-	level ++;
+	std::map<v3s16, path_exit_node>::iterator i = nodes.find(pos);
+	if ((i != nodes.end()) &&
+			(i->second.closed || (i->second.totalcost <= totalcost)))
+		return;
 
-	//check if target has been found
-	if (g_pos.target) {
-		m_min_target_distance = current_cost;
-		DEBUG_OUT(LVL " Pathfinder: target found!" << std::endl);
-		return true;
-	}
+	path_exit_node& node = nodes[pos];
+	node.totalcost = totalcost;
+	node.parent    = parent;
+	node.closed    = false;
+	node.crossing  = crossing;
+
+	path_exit_entry entry;
+	entry.distance  = manhattan_distance(pos, destination);
+	entry.estimate  = totalcost + entry.distance;
+	entry.totalcost = totalcost;
+	entry.pos       = pos;
+	open.push_back(entry);
+	std::push_heap(open.begin(), open.end());
+}
 
-	bool retval = false;
+/******************************************************************************/
+bool pathfinder::find_path_hierarchical(std::vector<v3s16>& path) {
+
+	// Exits are kept for whole blocks, so the search area is too
+	v3s16 minblock = getNodeBlockPos(v3s16(m_search_limits.X.min,
+			m_search_limits.Y.min, m_search_limits.Z.min));
+	v3s16 maxblock = getNodeBlockPos(v3s16(m_search_limits.X.max - 1,
+			m_search_limits.Y.max - 1, m_search_limits.Z.max - 1));
+
+	limits search_area;
+	search_area.X.min = minblock.X * MAP_BLOCKSIZE;
+	search_area.X.max = (maxblock.X + 1) * MAP_BLOCKSIZE;
+	search_area.Y.min = minblock.Y * MAP_BLOCKSIZE;
+	search_area.Y.max = (maxblock.Y + 1) * MAP_BLOCKSIZE;
+	search_area.Z.min = minblock.Z * MAP_BLOCKSIZE;
+	search_area.Z.max = (maxblock.Z + 1) * MAP_BLOCKSIZE;
+
+	v3s16 destblock = getNodeBlockPos(m_destination);
+
+	std::map<v3s16, path_exit_node> nodes;
+	std::vector<path_exit_entry> open;
+	add_exit_node(nodes, open, m_start, m_start, 0, false, m_destination);
+
+	static const v3s16 directions[4] = {
+		v3s16( 1,0, 0),
+		v3s16(-1,0, 0),
+		v3s16( 0,0, 1),
+		v3s16( 0,0,-1)
+	};
+
+	bool found = false;
+	while (!open.empty()) {
+		std::pop_heap(open.begin(), open.end());
+		path_exit_entry current = open.back();
+		open.pop_back();
+
+		path_exit_node& node = nodes[current.pos];
+		if (node.closed || (node.totalcost != current.totalcost))
+			continue;
+		node.closed = true;
+
+		if (current.pos == m_destination) {
+			found = true;
+			break;
+		}
 
-	std::vector<v3s16> directions;
+		v3s16 blockpos = getNodeBlockPos(current.pos);
+		path_block_nav* nav = get_block_nav(blockpos);
+
+		if (blockpos == destblock) {
+			set_block_limits(blockpos);
+			std::vector<v3s16> targets(1, m_destination);
+			std::vector<int> costs;
+			find_costs(getIndexPos(current.pos), targets, costs);
+			if (costs[0] >= 0)
+				add_exit_node(nodes, open, m_destination, current.pos,
+						node.totalcost + costs[0], false, m_destination);
+		}
 
-	directions.push_back(v3s16( 1,0, 0));
-	directions.push_back(v3s16(-1,0, 0));
-	directions.push_back(v3s16( 0,0, 1));
-	directions.push_back(v3s16( 0,0,-1));
+		std::vector<int> costs;
+		get_exit_costs(current.pos, *nav, costs);
+		for (unsigned int i = 0; i < nav->exits.size(); i++) {
+			if (costs[i] > 0)
+				add_exit_node(nodes, open, nav->exits[i], current.pos,
+						node.totalcost + costs[i], false, m_destination);
+		}
 
-	v3s16 direction = get_dir_heuristic(directions,g_pos);
+		if (std::find(nav->exits.begin(), nav->exits.end(), current.pos) ==
+				nav->exits.end())
+			continue;
 
-	while (direction != v3s16(0,0,0) && (!retval)) {
+		set_limits(search_area);
+		for (unsigned int i = 0; i < 4; i++) {
+			path_cost cost = calc_cost(current.pos, directions[i]);
+			if (!cost.valid)
+				continue;
 
-		if (direction != srcdir) {
-			path_cost cost = g_pos.get_cost(direction);
+			v3s16 pos2 = current.pos + directions[i] +
+					v3s16(0,cost.direction,0);
+			if ((getNodeBlockPos(pos2) == blockpos) ||
+					!valid_index(getIndexPos(pos2)))
+				continue;
 
-			if (cost.valid) {
-				direction.Y = cost.direction;
+			add_exit_node(nodes, open, pos2, current.pos,
+					node.totalcost + cost.value, true, m_destination);
+		}
+	}
 
-				v3s16 ipos2 = ipos + direction;
+	if (!found)
+		return false;
 
-				if (!valid_index(ipos2)) {
-					DEBUG_OUT(LVL " Pathfinder: " << PPOS(ipos2) <<
-							" out of range (" << m_limits.X.max << "," <<
-							m_limits.Y.max << "," << m_limits.Z.max
-							<<")" << std::endl);
-					direction = get_dir_heuristic(directions,g_pos);
-					continue;
-				}
+	std::vector<v3s16> exits;
+	for (v3s16 pos = m_destination; ; pos = nodes[pos].parent) {
+		exits.push_back(pos);
+		if (pos == m_start)
+			break;
+	}
+	std::reverse(exits.begin(), exits.end());
+
+	// Find the nodes walked on between the exits
+	path.push_back(m_start);
+	for (unsigned int i = 1; i < exits.size(); i++) {
+		if (nodes[exits[i]].crossing) {
+			path.push_back(exits[i]);
+			continue;
+		}
+		set_block_limits(getNodeBlockPos(exits[i - 1]));
+		v3s16 last = path.back();
+		path.pop_back();
+		if (!find_path_astar(getIndexPos(last), getIndexPos(exits[i]), path))
+			return false;
+	}
+	return true;
+}
 
-				path_gridnode& g_pos2 = getIndexElement(ipos2);
+/******************************************************************************/
+path_block_nav* pathfinder::get_block_nav(v3s16 blockpos) {
+	std::map<v3s16, path_block_nav>::iterator i = m_navs.find(blockpos);
+	if (i != m_navs.end())
+		return &i->second;
+
+	path_block_nav& nav = m_navs[blockpos];
+	path_block_key key(blockpos, m_maxjump, m_maxdrop);
+	if (!m_cache->get_block(key, nav)) {
+		build_block_nav(blockpos, nav);
+		// Exits into blocks that weren't loaded would be missing
+		if (nav.complete)
+			m_cache->set_block(key, nav);
+	}
+	return &nav;
+}
 
-				if (!g_pos2.valid) {
-					VERBOSE_TARGET << LVL "Pathfinder: no data for new position: "
-												<< PPOS(ipos2) << std::endl;
-					direction = get_dir_heuristic(directions,g_pos);
-					continue;
-				}
+/******************************************************************************/
+void pathfinder::build_block_nav(v3s16 blockpos, path_block_nav& nav) {
+	Map& map = m_env->getMap();
 
-				assert(cost.value > 0);
+	if (map.getBlockNoCreateNoEx(blockpos) == NULL)
+		return;
 
-				int new_cost = current_cost + cost.value;
+	nav.complete = true;
+	v3s16 p;
+	for (p.X = -1; p.X <= 1; p.X++)
+	for (p.Y = -1; p.Y <= 1; p.Y++)
+	for (p.Z = -1; p.Z <= 1; p.Z++) {
+		if (map.getBlockNoCreateNoEx(blockpos + p) == NULL)
+			nav.complete = false;
+	}
 
-				// check if there already is a smaller path
-				if ((m_min_target_distance > 0) &&
-						(m_min_target_distance < new_cost)) {
-					DEBUG_OUT(LVL "Pathfinder:"
-							" already longer than best already found path "
-							<< PPOS(ipos2) << std::endl);
-					return false;
-				}
+	// Moves out of the block end in the blocks around it
+	v3s16 base = blockpos * MAP_BLOCKSIZE;
+	limits around;
+	around.X.min = base.X - MAP_BLOCKSIZE;
+	around.X.max = base.X + 2 * MAP_BLOCKSIZE;
+	around.Y.min = base.Y - MAP_BLOCKSIZE;
+	around.Y.max = base.Y + 2 * MAP_BLOCKSIZE;
+	around.Z.min = base.Z - MAP_BLOCKSIZE;
+	around.Z.max = base.Z + 2 * MAP_BLOCKSIZE;
+	set_limits(around);
+
+	static const v3s16 directions[4] = {
+		v3s16( 1,0, 0),
+		v3s16(-1,0, 0),
+		v3s16( 0,0, 1),
+		v3s16( 0,0,-1)
+	};
+
+	// Cells that can be left and the block each of them leads to
+	std::vector<std::pair<v3s16, v3s16> > leaving;
+
+	for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+	for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+	for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++) {
+		// Only cells at the sides, or close enough to the top or bottom
+		// to jump or drop out, can be left
+		if ((p.X != 0) && (p.X != MAP_BLOCKSIZE - 1) &&
+				(p.Z != 0) && (p.Z != MAP_BLOCKSIZE - 1) &&
+				(p.Y > m_maxdrop) && (p.Y + m_maxjump < MAP_BLOCKSIZE - 1))
+			continue;
+
+		v3s16 pos = base + p;
+		if (!is_surface(pos))
+			continue;
+
+		for (unsigned int i = 0; i < 4; i++) {
+			path_cost cost = calc_cost(pos, directions[i]);
+			if (!cost.valid)
+				continue;
+
+			v3s16 toblock = getNodeBlockPos(pos + directions[i] +
+					v3s16(0,cost.direction,0));
+			if (toblock != blockpos)
+				leaving.push_back(std::make_pair(toblock, pos));
+		}
+	}
 
-				if ((g_pos2.totalcost < 0) ||
-						(g_pos2.totalcost > new_cost)) {
-					DEBUG_OUT(LVL "Pathfinder: updating path at: "<<
-							PPOS(ipos2) << " from: " << g_pos2.totalcost << " to "<<
-							new_cost << " srcdir=" <<
-							PPOS(invert(direction))<< std::endl);
-					if (update_cost_heuristic(ipos2,invert(direction),
-											new_cost,level)) {
-						retval = true;
-						}
-					}
-				else {
-					DEBUG_OUT(LVL "Pathfinder:"
-							" already found shorter path to: "
-							<< PPOS(ipos2) << std::endl);
+	std::sort(leaving.begin(), leaving.end());
+	leaving.erase(std::unique(leaving.begin(), leaving.end()), leaving.end());
+
+	// Each group of touching cells leading to the same block gets one exit,
+	// the cell closest to the middle of the group
+	std::vector<bool> grouped(leaving.size(), false);
+	for (unsigned int i = 0; i < leaving.size(); i++) {
+		if (grouped[i])
+			continue;
+
+		std::vector<unsigned int> group(1, i);
+		grouped[i] = true;
+		for (unsigned int g = 0; g < group.size(); g++) {
+			v3s16 cell = leaving[group[g]].second;
+			for (unsigned int j = i + 1; (j < leaving.size()) &&
+					(leaving[j].first == leaving[i].first); j++) {
+				v3s16 d = leaving[j].second - cell;
+				if (!grouped[j] && (abs(d.X) <= 1) && (abs(d.Y) <= 1) &&
+						(abs(d.Z) <= 1)) {
+					grouped[j] = true;
+					group.push_back(j);
 				}
 			}
-			else {
-				DEBUG_OUT(LVL "Pathfinder:"
-						" not moving to invalid direction: "
-						<< PPOS(direction) << std::endl);
-			}
 		}
-		else {
-			DEBUG_OUT(LVL "Pathfinder:"
-							" skipping srcdir: "
-							<< PPOS(direction) << std::endl);
+
+		v3f middle(0,0,0);
+		for (unsigned int g = 0; g < group.size(); g++)
+			middle += tov3f(leaving[group[g]].second);
+		middle /= group.size();
+
+		v3s16 exit = leaving[i].second;
+		for (unsigned int g = 1; g < group.size(); g++) {
+			v3s16 cell = leaving[group[g]].second;
+			if (tov3f(cell).getDistanceFromSQ(middle) <
+					tov3f(exit).getDistanceFromSQ(middle))
+				exit = cell;
 		}
-		direction = get_dir_heuristic(directions,g_pos);
+
+		if (std::find(nav.exits.begin(), nav.exits.end(), exit) ==
+				nav.exits.end())
+			nav.exits.push_back(exit);
+	}
+}
+
+/******************************************************************************/
+void pathfinder::get_exit_costs(v3s16 cell, path_block_nav& nav,
+		std::vector<int>& costs) {
+	std::map<v3s16, std::vector<int> >::iterator i = nav.exit_costs.find(cell);
+	if (i != nav.exit_costs.end()) {
+		costs = i->second;
+		return;
 	}
+
+	if (nav.exits.empty()) {
+		costs.clear();
+		return;
+	}
+
+	v3s16 blockpos = getNodeBlockPos(cell);
+	set_block_limits(blockpos);
+	find_costs(getIndexPos(cell), nav.exits, costs);
+
+	// The cells moved to from the exits of the blocks around come back,
+	// the starting point hardly does
+	if (cell == m_start)
+		return;
+	nav.exit_costs[cell] = costs;
+	if (nav.complete)
+		m_cache->set_exit_costs(path_block_key(blockpos, m_maxjump, m_maxdrop),
+				cell, costs);
+}
+
+/******************************************************************************/
+void pathfinder::set_limits(const limits& l) {
+	m_limits = l;
+
+	m_max_index_x = m_limits.X.max - m_limits.X.min;
+	m_max_index_y = m_limits.Y.max - m_limits.Y.min;
+	m_max_index_z = m_limits.Z.max - m_limits.Z.min;
+}
+
+/******************************************************************************/
+void pathfinder::set_block_limits(v3s16 blockpos) {
+	limits l;
+	l.X.min = blockpos.X * MAP_BLOCKSIZE;
+	l.X.max = l.X.min + MAP_BLOCKSIZE;
+	l.Y.min = blockpos.Y * MAP_BLOCKSIZE;
+	l.Y.max = l.Y.min + MAP_BLOCKSIZE;
+	l.Z.min = blockpos.Z * MAP_BLOCKSIZE;
+	l.Z.max = l.Z.min + MAP_BLOCKSIZE;
+
+	set_limits(l);
+}
+
+/******************************************************************************/
+std::vector<v3s16> pathfinder::optimize_path(std::vector<v3s16>& path) {
+	std::vector<v3s16> optimized_path;
+
+	std::vector<v3s16>::iterator startpos = path.begin();
+	optimized_path.push_back(m_start);
+
+	for (std::vector<v3s16>::iterator i = path.begin();
+				i != path.end(); i++) {
+		if (!m_env->line_of_sight(tov3f(*startpos), tov3f(*i))) {
+			optimized_path.push_back(*(i-1));
+			startpos = (i-1);
+		}
+	}
+
+	optimized_path.push_back(m_destination);
+
+#ifdef PATHFINDER_DEBUG
+	std::cout << "Optimized path:" << std::endl;
+	print_path(optimized_path);
+#endif
+	return optimized_path;
+}
+
+/******************************************************************************/
+unsigned int pathfinder::get_flat_index(v3s16 ipos) {
+	return ((unsigned int)ipos.X * m_max_index_z + ipos.Z) * m_max_index_y
+			+ ipos.Y;
+}
+
+/******************************************************************************/
+v3s16 pathfinder::get_index_from_flat(unsigned int index) {
+	v3s16 retval;
+	retval.Y = index % m_max_index_y;
+	index /= m_max_index_y;
+	retval.Z = index % m_max_index_z;
+	retval.X = index / m_max_index_z;
 	return retval;
 }
 
@@ -24,8 +24,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 /* Includes                                                                   */
 /******************************************************************************/
 #include <vector>
+#include <map>
+#include <set>
 
 #include "irr_v3d.h"
+#include "jthread/jmutex.h"
 
 
 /******************************************************************************/
@@ -33,6 +36,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 /******************************************************************************/
 
 class ServerEnvironment;
+class VoxelArea;
 
 /******************************************************************************/
 /* Typedefs and macros                                                        */
@@ -51,7 +55,7 @@ typedef enum {
 typedef enum {
 	DIJKSTRA,           /**< Dijkstra shortest path algorithm             */
 	A_PLAIN,            /**< A* algorithm using heuristics to find a path */
-	A_PLAIN_NP          /**< A* algorithm without prefetching of map data */
+	A_PLAIN_NP          /**< same as A_PLAIN, kept for compatibility      */
 } algorithm;
 
 /******************************************************************************/
@@ -67,6 +71,105 @@ std::vector<v3s16> get_Path(ServerEnvironment* env,
 							unsigned int max_drop,
 							algorithm algo);
 
+/** navigation data of a MapBlock for one set of jump and drop limits */
+struct path_block_nav {
+	path_block_nav();
+
+	/** cells leading out of the block, one for each group of them */
+	std::vector<v3s16> exits;
+	/** cost of walking from a cell to each of the exits, -1 if impossible */
+	std::map<v3s16, std::vector<int> > exit_costs;
+	/** the block and the ones around it were loaded when it was built */
+	bool complete;
+};
+
+/** key of a cached block navigation */
+struct path_block_key {
+	path_block_key(v3s16 block_, int max_jump_, int max_drop_);
+	bool operator< (const path_block_key& b) const;
+
+	v3s16 block;
+	int   max_jump;
+	int   max_drop;
+};
+
+/** key of a cached path */
+struct path_request {
+	path_request(v3s16 source_, v3s16 destination_,
+			unsigned int searchdistance_, unsigned int max_jump_,
+			unsigned int max_drop_, algorithm algo_);
+	bool operator< (const path_request& b) const;
+
+	v3s16        source;
+	v3s16        destination;
+	unsigned int searchdistance;
+	unsigned int max_jump;
+	unsigned int max_drop;
+	algorithm    algo;
+};
+
+/**
+ * paths and block navigation kept between the searches of a
+ * ServerEnvironment, until the map around them changes
+ */
+class path_cache {
+public:
+	/**
+	 * forget everything that depends on the nodes in area
+	 * @param area nodes that have changed
+	 */
+	void invalidate(const VoxelArea& area);
+
+	/**
+	 * forget everything that depends on the nodes of some blocks
+	 * @param blocks positions of the blocks that have changed
+	 */
+	void invalidate(const std::set<v3s16>& blocks);
+
+	/** forget everything */
+	void clear();
+
+	/**
+	 * look up a path found earlier
+	 * @param request parameters of the search
+	 * @param path set to the path if it is known and not outdated
+	 * @return true/false path is known
+	 */
+	bool get_result(const path_request& request, std::vector<v3s16>& path);
+
+	/**
+	 * keep a path
+	 * @param request parameters of the search
+	 * @param path path found, empty if there is none
+	 * @param minblock first block of the search area
+	 * @param maxblock last block of the search area
+	 * @param ttl_ms time to keep the path if the map doesn't change
+	 */
+	void set_result(const path_request& request,
+			const std::vector<v3s16>& path,
+			v3s16 minblock, v3s16 maxblock, unsigned int ttl_ms);
+
+	bool get_block(const path_block_key& key, path_block_nav& nav);
+	void set_block(const path_block_key& key, const path_block_nav& nav);
+	void set_exit_costs(const path_block_key& key, v3s16 cell,
+			const std::vector<int>& costs);
+
+private:
+	struct result {
+		std::vector<v3s16> path;
+		v3s16              minblock;
+		v3s16              maxblock;
+		unsigned int       expires_ms;
+	};
+
+	/** drop the results whose search area overlaps minblock..maxblock */
+	void invalidate_results(v3s16 minblock, v3s16 maxblock);
+
+	JMutex m_mutex;
+	std::map<path_block_key, path_block_nav> m_blocks;
+	std::map<path_request, result>            m_results;
+};
+
 /** representation of cost in specific direction */
 class path_cost {
 public:
@@ -226,12 +329,11 @@ class pathfinder {
 	int           get_manhattandistance(v3s16 pos);
 
 	/**
-	 * get best direction based uppon heuristics
-	 * @param directions list of unchecked directions
-	 * @param g_pos mapnode to start from
-	 * @return direction to check
+	 * check if a node can be walked on, without the costmap
+	 * @param pos real world position to check
+	 * @return true/false
 	 */
-	v3s16         get_dir_heuristic(std::vector<v3s16>& directions,path_gridnode& g_pos);
+	bool          is_surface(v3s16 pos);
 
 	/**
 	 * build internal data representation of search area
@@ -258,14 +360,98 @@ class pathfinder {
 	bool          update_all_costs(v3s16 ipos,v3s16 srcdir,int total_cost,int level);
 
 	/**
-	 * recursive try to find a patrh to destionation
-	 * @param ipos position to check next
-	 * @param srcdir positionc checked last time
-	 * @param total_cost cost of moving to ipos
-	 * @param level current recursion depth
+	 * A* search calculating the costs of the nodes it reaches only; the
+	 * search memory is kept by each thread for its next searches
+	 * @param start_index index position of source
+	 * @param end_index index position of destination
+	 * @param path vector to add the real positions of the path to
 	 * @return true/false path to destination has been found
 	 */
-	bool          update_cost_heuristic(v3s16 ipos,v3s16 srcdir,int current_cost,int level);
+	bool          find_path_astar(v3s16 start_index,v3s16 end_index,
+	                              std::vector<v3s16>& path);
+
+	/**
+	 * remove the nodes that can be skipped walking straight
+	 * @param path full path in real positions
+	 * @return path from source to destination
+	 */
+	std::vector<v3s16> optimize_path(std::vector<v3s16>& path);
+
+	/**
+	 * hierarchical search, walking from one cached block exit to the next
+	 * and finding the nodes between them in the block after that
+	 * @param path vector to add the real positions of the path to
+	 * @return true/false path to destination has been found
+	 */
+	bool          find_path_hierarchical(std::vector<v3s16>& path);
+
+	/**
+	 * Dijkstra search of the whole current search area
+	 * @param start_index index position to start from
+	 * @param targets real positions to get the cost of
+	 * @param costs set to the cost of each target, -1 if unreachable
+	 */
+	void          find_costs(v3s16 start_index,
+	                         const std::vector<v3s16>& targets,
+	                         std::vector<int>& costs);
+
+	/**
+	 * search memory shared by find_path_astar and find_costs
+	 * @param start_index index position to start from
+	 * @param end_index index position to stop at
+	 * @param to_end use heuristics and stop at end_index
+	 * @return true/false end_index has been reached
+	 */
+	bool          run_search(v3s16 start_index,v3s16 end_index,bool to_end);
+
+	/**
+	 * get the navigation of a block from the cache, or build it
+	 * @param blockpos block position
+	 * @return navigation, valid until the end of the search
+	 */
+	path_block_nav* get_block_nav(v3s16 blockpos);
+
+	/**
+	 * find the cells leading out of a block
+	 * @param blockpos block position
+	 * @param nav navigation to fill in
+	 */
+	void          build_block_nav(v3s16 blockpos, path_block_nav& nav);
+
+	/**
+	 * get the cost of walking from a cell to the exits of its block
+	 * @param cell real position within the block
+	 * @param nav navigation of the block
+	 * @param costs set to the cost to each exit, -1 if impossible
+	 */
+	void          get_exit_costs(v3s16 cell, path_block_nav& nav,
+	                             std::vector<int>& costs);
+
+	/**
+	 * set the area searched by the next searches
+	 * @param l limits in real map coordinates, max excluded
+	 */
+	void          set_limits(const limits& l);
+
+	/**
+	 * set the search area to a single block
+	 * @param blockpos block position
+	 */
+	void          set_block_limits(v3s16 blockpos);
+
+	/**
+	 * transform index pos to a position in the A* search memory
+	 * @param ipos a index position
+	 * @return flat index
+	 */
+	unsigned int  get_flat_index(v3s16 ipos);
+
+	/**
+	 * transform a position in the A* search memory to index pos
+	 * @param index flat index
+	 * @return index position
+	 */
+	v3s16         get_index_from_flat(unsigned int index);
 
 	/**
 	 * recursive build a vector containing all nodes from source to destination
@@ -292,6 +478,11 @@ class pathfinder {
 	v3s16 m_destination;        /**< destination position                     */
 
 	limits m_limits;            /**< position limits in real map coordinates  */
+	limits m_search_limits;     /**< limits asked for by the caller           */
+
+	path_cache* m_cache;        /**< caches of the environment                */
+	/** navigation of the blocks looked at by the current search */
+	std::map<v3s16, path_block_nav> m_navs;
 
 	/** 3d grid containing all map data already collected and analyzed */
 	std::vector<std::vector<std::vector<path_gridnode> > > m_data;
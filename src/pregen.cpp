@@ -0,0 +1,264 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "pregen.h"
+#include <fstream>
+#include <sstream>
+#include "emerge.h"
+#include "mapblock.h"
+#include "settings.h"
+#include "filesys.h"
+#include "log.h"
+#include "main.h" // for g_settings
+#include "util/numeric.h"
+
+#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+
+// Seconds between updates of the smoothed rate and between progress
+// reports in the log
+#define PREGEN_RATE_INTERVAL 10.0
+#define PREGEN_REPORT_INTERVAL 60.0
+
+MapPregenerator::MapPregenerator(EmergeManager *emerge,
+		const std::string &statefilepath):
+	m_emerge(emerge),
+	m_statefilepath(statefilepath),
+	m_active(false),
+	m_total(0),
+	m_next(0),
+	m_budget(0),
+	m_rate(0),
+	m_rate_timer(0),
+	m_rate_done(0),
+	m_report_timer(0),
+	m_modified(false)
+{
+	load();
+}
+
+MapPregenerator::~MapPregenerator()
+{
+	save();
+}
+
+void MapPregenerator::setArea(v3s16 minp, v3s16 maxp)
+{
+	sortBoxVerticies(minp, maxp);
+	m_minp = minp;
+	m_maxp = maxp;
+
+	// Same mapchunk division as ServerMap::initBlockMake()
+	s16 csize = m_emerge->params.chunksize;
+	s16 coffset = -csize / 2;
+	v3s16 chunk_offset(coffset, coffset, coffset);
+	m_chunk_min = getContainerPos(getNodeBlockPos(minp) - chunk_offset, csize);
+	m_chunk_max = getContainerPos(getNodeBlockPos(maxp) - chunk_offset, csize);
+
+	v3s16 d = m_chunk_max - m_chunk_min + v3s16(1,1,1);
+	m_total = (u32)d.X * d.Y * d.Z;
+}
+
+v3s16 MapPregenerator::getChunkBlockPos(u32 i)
+{
+	// Whole columns of mapchunks are done one after the other
+	v3s16 d = m_chunk_max - m_chunk_min + v3s16(1,1,1);
+	v3s16 chunkpos = m_chunk_min + v3s16(
+		(i / d.Y) % d.X,
+		i % d.Y,
+		i / d.Y / d.X);
+
+	s16 csize = m_emerge->params.chunksize;
+	s16 coffset = -csize / 2;
+	return chunkpos * csize + v3s16(coffset, coffset, coffset);
+}
+
+u32 MapPregenerator::getDone()
+{
+	// Mapchunks still in the emerge queue are not done yet
+	u32 inflight = m_emerge->getPeerQueueCount(EMERGE_PEER_PREGEN);
+	return m_next > inflight ? m_next - inflight : 0;
+}
+
+void MapPregenerator::start(v3s16 minp, v3s16 maxp)
+{
+	setArea(minp, maxp);
+	m_active = true;
+	m_next = 0;
+	m_budget = 0;
+	m_rate = 0;
+	m_rate_timer = 0;
+	m_rate_done = 0;
+	m_report_timer = 0;
+	m_modified = true;
+
+	actionstream << "MapPregenerator: generating " << PP(m_minp) << " to "
+		<< PP(m_maxp) << ", " << m_total << " mapchunks" << std::endl;
+	save();
+}
+
+void MapPregenerator::stop()
+{
+	if (!m_active)
+		return;
+
+	actionstream << "MapPregenerator: stopped after " << getDone()
+		<< " of " << m_total << " mapchunks" << std::endl;
+	m_active = false;
+	m_modified = true;
+	save();
+}
+
+void MapPregenerator::step(float dtime, u32 num_players)
+{
+	if (!m_active)
+		return;
+
+	float rate = g_settings->getFloat(num_players ?
+		"pregen_chunks_per_second_with_players" : "pregen_chunks_per_second");
+
+	// Don't let more than a second worth of requests pile up, so that the
+	// rate holds when the emerge queue is full for a while
+	if (rate > 0)
+		m_budget = MYMIN(m_budget + rate * dtime, MYMAX(rate, 1.0f));
+	else
+		m_budget = 0;
+
+	// One block of each mapchunk makes the whole mapchunk to be
+	// generated.  The queue limit of the emerge manager keeps this
+	// from flooding the emerge threads.
+	while (m_budget >= 1.0 && m_next < m_total) {
+		if (!m_emerge->enqueueBlockEmerge(EMERGE_PEER_PREGEN,
+				getChunkBlockPos(m_next), true))
+			break;
+		m_next++;
+		m_budget -= 1.0;
+		m_modified = true;
+	}
+
+	u32 done = getDone();
+
+	m_rate_timer += dtime;
+	if (m_rate_timer >= PREGEN_RATE_INTERVAL) {
+		float cur_rate = (float)(done > m_rate_done ?
+			done - m_rate_done : 0) / m_rate_timer;
+		m_rate = m_rate > 0 ? m_rate * 0.7 + cur_rate * 0.3 : cur_rate;
+		m_rate_timer = 0;
+		m_rate_done = done;
+	}
+
+	if (done >= m_total) {
+		actionstream << "MapPregenerator: done, generated " << m_total
+			<< " mapchunks from " << PP(m_minp) << " to "
+			<< PP(m_maxp) << std::endl;
+		m_active = false;
+		m_modified = true;
+		save();
+		return;
+	}
+
+	m_report_timer += dtime;
+	if (m_report_timer >= PREGEN_REPORT_INTERVAL) {
+		m_report_timer = 0;
+		float eta;
+		getProgress(&done, NULL, &eta);
+		actionstream << "MapPregenerator: " << done << "/" << m_total
+			<< " mapchunks (" << (done * 100 / m_total) << "%)";
+		if (eta >= 0)
+			actionstream << ", about " << (u32)eta << " s left";
+		else if (num_players && rate <= 0)
+			actionstream << ", paused while players are online";
+		actionstream << std::endl;
+	}
+}
+
+bool MapPregenerator::getProgress(u32 *done, u32 *total, float *eta)
+{
+	if (!m_active)
+		return false;
+
+	u32 d = getDone();
+	if (done)
+		*done = d;
+	if (total)
+		*total = m_total;
+	if (eta)
+		*eta = m_rate > 0 ? (m_total - d) / m_rate : -1;
+	return true;
+}
+
+void MapPregenerator::getArea(v3s16 *minp, v3s16 *maxp)
+{
+	*minp = m_minp;
+	*maxp = m_maxp;
+}
+
+void MapPregenerator::load()
+{
+	std::ifstream is(m_statefilepath.c_str(), std::ios_base::binary);
+	if (!is.good())
+		return;
+
+	Settings args;
+	args.parseConfigLines(is);
+
+	v3f minp, maxp;
+	u64 next;
+	if (!args.getV3FNoEx("minp", minp) || !args.getV3FNoEx("maxp", maxp) ||
+			!args.getU64NoEx("next", next)) {
+		errorstream << "MapPregenerator: invalid state file "
+			<< m_statefilepath << std::endl;
+		return;
+	}
+
+	setArea(floatToInt(minp, 1.0), floatToInt(maxp, 1.0));
+	m_active = true;
+	m_next = MYMIN(next, (u64)m_total);
+	m_rate_done = m_next;
+	m_modified = false;
+
+	actionstream << "MapPregenerator: resuming generation of " << PP(m_minp)
+		<< " to " << PP(m_maxp) << " at mapchunk " << m_next << " of "
+		<< m_total << std::endl;
+}
+
+void MapPregenerator::save()
+{
+	if (!m_modified)
+		return;
+	m_modified = false;
+
+	if (!m_active) {
+		if (fs::PathExists(m_statefilepath))
+			fs::DeleteSingleFileOrEmptyDirectory(m_statefilepath);
+		return;
+	}
+
+	// Mapchunks that are still queued are requested again after a restart
+	Settings args;
+	args.setV3F("minp", intToFloat(m_minp, 1.0));
+	args.setV3F("maxp", intToFloat(m_maxp, 1.0));
+	args.setU64("next", getDone());
+
+	std::ostringstream ss(std::ios_base::binary);
+	args.writeLines(ss);
+	if (!fs::safeWriteToFile(m_statefilepath, ss.str())) {
+		errorstream << "MapPregenerator: failed to write "
+			<< m_statefilepath << std::endl;
+	}
+}
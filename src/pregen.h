@@ -0,0 +1,87 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PREGEN_HEADER
+#define PREGEN_HEADER
+
+#include <string>
+#include "irr_v3d.h"
+
+class EmergeManager;
+
+/*
+	Generates an area of the world in the background, one mapchunk at a
+	time, at a rate limited by the pregen_* settings.  The job is saved
+	to a file in the world directory so that it is resumed after a
+	restart.  Not thread-safe; the server calls it under the envlock.
+*/
+class MapPregenerator
+{
+public:
+	MapPregenerator(EmergeManager *emerge, const std::string &statefilepath);
+	~MapPregenerator();
+
+	// Replaces any running job by one generating every mapchunk that
+	// intersects the node area minp..maxp
+	void start(v3s16 minp, v3s16 maxp);
+	void stop();
+	bool isActive() { return m_active; }
+
+	// Requests as many mapchunks as the rate for the given number of
+	// connected players allows
+	void step(float dtime, u32 num_players);
+
+	// Mapchunks done and in total, and the estimated number of seconds
+	// left (negative if unknown).  Returns false if no job is running.
+	bool getProgress(u32 *done, u32 *total, float *eta);
+	void getArea(v3s16 *minp, v3s16 *maxp);
+
+	void load();
+	void save();
+
+private:
+	EmergeManager *m_emerge;
+	std::string m_statefilepath;
+
+	bool m_active;
+	// Requested node area and the mapchunks covering it, in units of
+	// mapchunks
+	v3s16 m_minp;
+	v3s16 m_maxp;
+	v3s16 m_chunk_min;
+	v3s16 m_chunk_max;
+	u32 m_total;
+	// Index of the next mapchunk to request
+	u32 m_next;
+
+	// Number of mapchunks that may be requested right now
+	float m_budget;
+	// Smoothed number of mapchunks done per second, for the ETA
+	float m_rate;
+	float m_rate_timer;
+	u32 m_rate_done;
+	float m_report_timer;
+	bool m_modified;
+
+	u32 getDone();
+	v3s16 getChunkBlockPos(u32 i);
+	void setArea(v3s16 minp, v3s16 maxp);
+};
+
+#endif
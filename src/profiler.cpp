@@ -0,0 +1,535 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "profiler.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include "gettime.h"
+#include "log.h"
+#include "settings.h"
+#include "main.h" // for g_settings
+#include "json/json.h"
+#if __cplusplus >= 201103L
+#include <atomic>
+#endif
+
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+/*
+	The data of the profilers a thread has used last, so that the thread
+	finds its data without locking the profiler
+*/
+#define PROFILER_THREAD_CACHE_SIZE 4
+
+struct ProfilerThreadCache
+{
+	u32 serial;
+	void *data;
+};
+
+static THREAD_LOCAL ProfilerThreadCache
+		t_profiler_cache[PROFILER_THREAD_CACHE_SIZE];
+static THREAD_LOCAL u32 t_profiler_cache_next;
+
+// 0 is never used, it marks the unused slots of the caches
+#if __cplusplus >= 201103L
+static std::atomic<u32> s_profiler_next_serial(1);
+#else
+static volatile u32 s_profiler_next_serial = 1;
+#endif
+
+Profiler::Profiler():
+	m_serial(s_profiler_next_serial++)
+{
+}
+
+Profiler::~Profiler()
+{
+	for(std::map<threadid_t, ThreadData*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); ++i)
+		delete i->second;
+}
+
+u32 Profiler::getId(const std::string &name)
+{
+	JMutexAutoLock lock(m_mutex);
+	std::map<std::string, u32>::iterator n = m_ids.find(name);
+	if(n != m_ids.end())
+		return n->second;
+	u32 id = m_names.size();
+	m_ids[name] = id;
+	m_names.push_back(name);
+	return id;
+}
+
+Profiler::ThreadData *Profiler::getThreadData()
+{
+	for(u32 i = 0; i < PROFILER_THREAD_CACHE_SIZE; i++){
+		if(t_profiler_cache[i].serial == m_serial)
+			return (ThreadData*)t_profiler_cache[i].data;
+	}
+
+	ThreadData *data;
+	{
+		JMutexAutoLock lock(m_mutex);
+		// A thread that has ended leaves its data to the next thread
+		// that gets its id
+		threadid_t thread_id = get_current_thread_id();
+		std::map<threadid_t, ThreadData*>::iterator n =
+				m_threads.find(thread_id);
+		if(n != m_threads.end()){
+			data = n->second;
+		} else {
+			data = new ThreadData;
+			m_threads[thread_id] = data;
+		}
+	}
+
+	ProfilerThreadCache &cache = t_profiler_cache[t_profiler_cache_next];
+	t_profiler_cache_next =
+			(t_profiler_cache_next + 1) % PROFILER_THREAD_CACHE_SIZE;
+	cache.serial = m_serial;
+	cache.data = data;
+	return data;
+}
+
+void Profiler::mergeNoLock(std::vector<Entry> &result)
+{
+	result.clear();
+	result.resize(m_names.size());
+	for(std::map<threadid_t, ThreadData*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); ++i)
+	{
+		ThreadData *data = i->second;
+		JMutexAutoLock lock(data->mutex);
+		for(u32 id = 0; id < data->entries.size(); id++){
+			const Entry &e = data->entries[id];
+			Entry &r = result[id];
+			if(e.used){
+				r.used = true;
+				r.value += e.value;
+				if(e.avgcount >= 1)
+					r.avgcount = MYMAX(r.avgcount, 0) + e.avgcount;
+				else if(e.avgcount == -2 && r.avgcount == 0)
+					r.avgcount = -2;
+			}
+			if(e.graph_used){
+				r.graph_used = true;
+				r.graph_value += e.graph_value;
+			}
+		}
+	}
+}
+
+void Profiler::clear()
+{
+	JMutexAutoLock lock(m_mutex);
+	for(std::map<threadid_t, ThreadData*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); ++i)
+	{
+		ThreadData *data = i->second;
+		JMutexAutoLock lock(data->mutex);
+		for(u32 id = 0; id < data->entries.size(); id++){
+			data->entries[id].value = 0;
+			data->entries[id].avgcount = 0;
+		}
+	}
+}
+
+void Profiler::printPage(std::ostream &o, u32 page, u32 pagecount)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::vector<Entry> merged;
+	mergeNoLock(merged);
+
+	// Sorted by name
+	std::map<std::string, Entry*> entries;
+	for(u32 id = 0; id < merged.size(); id++){
+		if(merged[id].used)
+			entries[m_names[id]] = &merged[id];
+	}
+
+	u32 minindex, maxindex;
+	paging(entries.size(), page, pagecount, minindex, maxindex);
+
+	for(std::map<std::string, Entry*>::iterator
+			i = entries.begin();
+			i != entries.end(); ++i)
+	{
+		if(maxindex == 0)
+			break;
+		maxindex--;
+
+		if(minindex != 0)
+		{
+			minindex--;
+			continue;
+		}
+
+		const std::string &name = i->first;
+		int avgcount = 1;
+		if(i->second->avgcount >= 1)
+			avgcount = i->second->avgcount;
+		o<<"  "<<name<<": ";
+		s32 clampsize = 40;
+		s32 space = clampsize - name.size();
+		for(s32 j=0; j<space; j++)
+		{
+			if(j%2 == 0 && j < space - 1)
+				o<<"-";
+			else
+				o<<" ";
+		}
+		o<<(i->second->value / avgcount);
+		o<<std::endl;
+	}
+}
+
+void Profiler::graphGet(GraphValues &result)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::vector<Entry> merged;
+	mergeNoLock(merged);
+
+	result.clear();
+	for(u32 id = 0; id < merged.size(); id++){
+		if(merged[id].graph_used)
+			result[m_names[id]] = merged[id].graph_value;
+	}
+
+	for(std::map<threadid_t, ThreadData*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); ++i)
+	{
+		ThreadData *data = i->second;
+		JMutexAutoLock lock(data->mutex);
+		for(u32 id = 0; id < data->entries.size(); id++){
+			data->entries[id].graph_used = false;
+			data->entries[id].graph_value = 0;
+		}
+	}
+}
+
+float Profiler::getTotal(const std::string &name)
+{
+	JMutexAutoLock lock(m_mutex);
+	std::map<std::string, u32>::iterator n = m_ids.find(name);
+	if(n == m_ids.end())
+		return 0;
+	u32 id = n->second;
+
+	float total = 0;
+	for(std::map<threadid_t, ThreadData*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); ++i)
+	{
+		ThreadData *data = i->second;
+		JMutexAutoLock lock(data->mutex);
+		if(id < data->entries.size())
+			total += data->entries[id].value;
+	}
+	return total;
+}
+
+void Profiler::remove(const std::string &name)
+{
+	JMutexAutoLock lock(m_mutex);
+	std::map<std::string, u32>::iterator n = m_ids.find(name);
+	if(n == m_ids.end())
+		return;
+	u32 id = n->second;
+
+	for(std::map<threadid_t, ThreadData*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); ++i)
+	{
+		ThreadData *data = i->second;
+		JMutexAutoLock lock(data->mutex);
+		if(id < data->entries.size()){
+			data->entries[id].used = false;
+			data->entries[id].value = 0;
+			data->entries[id].avgcount = 0;
+		}
+	}
+}
+
+/*
+	Tracing
+*/
+
+bool g_profiler_trace_enabled = false;
+
+struct TraceEvent
+{
+	u32 name;
+	u32 start_us;
+	u32 duration_us;
+};
+
+struct TraceBuffer
+{
+	std::string thread_name;
+	// Only used by the thread itself
+	std::map<std::string, u32> ids;
+	// Locked by the thread when recording and by the writer
+	JMutex mutex;
+	std::vector<std::string> names;
+	std::vector<TraceEvent> events;
+	// Where the next event goes once events is full
+	u32 next;
+};
+
+static u32 s_trace_events_per_thread = 0;
+// Locks s_trace_buffers
+static JMutex s_trace_mutex;
+static std::map<threadid_t, TraceBuffer*> s_trace_buffers;
+static THREAD_LOCAL TraceBuffer *t_trace_buffer;
+
+void profiler_trace_init(u32 events_per_thread)
+{
+	s_trace_events_per_thread = events_per_thread;
+	g_profiler_trace_enabled = events_per_thread != 0;
+}
+
+static TraceBuffer *get_trace_buffer()
+{
+	if(t_trace_buffer)
+		return t_trace_buffer;
+
+	JMutexAutoLock lock(s_trace_mutex);
+	// A thread that has ended leaves its buffer to the next thread that
+	// gets its id
+	threadid_t thread_id = get_current_thread_id();
+	std::map<threadid_t, TraceBuffer*>::iterator n =
+			s_trace_buffers.find(thread_id);
+	TraceBuffer *buffer;
+	if(n != s_trace_buffers.end()){
+		buffer = n->second;
+	} else {
+		buffer = new TraceBuffer;
+		buffer->next = 0;
+		s_trace_buffers[thread_id] = buffer;
+	}
+	{
+		JMutexAutoLock bufferlock(buffer->mutex);
+		buffer->thread_name = log_get_thread_name();
+	}
+	t_trace_buffer = buffer;
+	return buffer;
+}
+
+void profiler_trace_record(const char *name, u32 start_us, u32 duration_us)
+{
+	TraceBuffer *buffer = get_trace_buffer();
+
+	// The name is looked up before locking; the ids are only used by
+	// this thread
+	u32 id;
+	std::map<std::string, u32>::iterator n = buffer->ids.find(name);
+	bool new_name = n == buffer->ids.end();
+	if(new_name){
+		id = buffer->ids.size();
+		buffer->ids[name] = id;
+	} else {
+		id = n->second;
+	}
+
+	TraceEvent event;
+	event.name = id;
+	event.start_us = start_us;
+	event.duration_us = duration_us;
+
+	JMutexAutoLock lock(buffer->mutex);
+	if(new_name)
+		buffer->names.push_back(name);
+	if(buffer->events.size() < s_trace_events_per_thread){
+		buffer->events.push_back(event);
+	} else {
+		buffer->events[buffer->next] = event;
+		buffer->next = (buffer->next + 1) % buffer->events.size();
+	}
+}
+
+void profiler_trace_write(std::ostream &os)
+{
+	JMutexAutoLock lock(s_trace_mutex);
+	u32 now = getTime(PRECISION_MICRO);
+
+	// The times wrap around every 71 minutes; the events are placed by
+	// their age, ending at the oldest end of a thread
+	u32 max_age = 0;
+	for(std::map<threadid_t, TraceBuffer*>::iterator
+			i = s_trace_buffers.begin();
+			i != s_trace_buffers.end(); ++i)
+	{
+		TraceBuffer *buffer = i->second;
+		JMutexAutoLock bufferlock(buffer->mutex);
+		for(u32 j = 0; j < buffer->events.size(); j++)
+			max_age = MYMAX(max_age, now - buffer->events[j].start_us);
+	}
+
+	os<<"{\"traceEvents\":[";
+	bool first = true;
+	u32 tid = 1;
+	for(std::map<threadid_t, TraceBuffer*>::iterator
+			i = s_trace_buffers.begin();
+			i != s_trace_buffers.end(); ++i, tid++)
+	{
+		TraceBuffer *buffer = i->second;
+		JMutexAutoLock bufferlock(buffer->mutex);
+
+		if(!first)
+			os<<",";
+		first = false;
+		os<<"\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+				<<tid<<",\"args\":{\"name\":"
+				<<Json::valueToQuotedString(buffer->thread_name.c_str())
+				<<"}}";
+
+		for(u32 j = 0; j < buffer->events.size(); j++){
+			const TraceEvent &event = buffer->events[j];
+			os<<",\n{\"name\":"
+					<<Json::valueToQuotedString(
+						buffer->names[event.name].c_str())
+					<<",\"ph\":\"X\",\"pid\":1,\"tid\":"<<tid
+					<<",\"ts\":"<<(max_age - (now - event.start_us))
+					<<",\"dur\":"<<event.duration_us<<"}";
+		}
+	}
+	os<<"\n]}\n";
+}
+
+/*
+	Slow step watchdog
+*/
+
+// Reports after the first are limited to one in this time
+#define STEP_WATCHDOG_REPORT_INTERVAL_MS 10000
+#define STEP_WATCHDOG_TOP_COUNT 5
+
+StepWatchdog g_step_watchdog;
+
+StepWatchdog::StepWatchdog():
+	m_threshold(NULL),
+	m_timing(false),
+	m_step_start_us(0),
+	m_last_report_ms(0),
+	m_reported(false),
+	m_unreported_count(0)
+{
+}
+
+StepWatchdog::~StepWatchdog()
+{
+	delete m_threshold;
+}
+
+void StepWatchdog::beginStep()
+{
+	if(m_threshold == NULL)
+		m_threshold = new SettingHandle<float>(g_settings,
+				"slow_step_threshold");
+	m_timing = m_threshold->get() > 0;
+	if(!m_timing)
+		return;
+	m_thread = get_current_thread_id();
+	m_phases.clear();
+	m_culprits.clear();
+	m_step_start_us = getTime(PRECISION_MICRO);
+}
+
+static void write_top_times(std::ostream &os,
+		const std::map<std::string, std::pair<u32, u32> > &times)
+{
+	std::vector<std::pair<u32, std::string> > sorted;
+	for(std::map<std::string, std::pair<u32, u32> >::const_iterator
+			i = times.begin();
+			i != times.end(); ++i)
+		sorted.push_back(std::make_pair(i->second.first, i->first));
+	std::sort(sorted.rbegin(), sorted.rend());
+
+	if(sorted.empty())
+		os<<" none";
+	for(u32 i = 0; i < sorted.size() && i < STEP_WATCHDOG_TOP_COUNT; i++){
+		u32 count = times.find(sorted[i].second)->second.second;
+		os<<(i == 0 ? " " : ", ")<<sorted[i].second<<" "
+				<<(sorted[i].first / 1000000.0)<<"s";
+		if(count > 1)
+			os<<" ("<<count<<" times)";
+	}
+}
+
+void StepWatchdog::endStep()
+{
+	if(!m_timing)
+		return;
+	m_timing = false;
+
+	u32 step_us = getTime(PRECISION_MICRO) - m_step_start_us;
+	float threshold = m_threshold->get();
+	if(step_us < threshold * 1000000)
+		return;
+
+	// A server that is slow all the time shouldn't flood the log
+	u32 now_ms = getTimeMs();
+	if(m_reported && now_ms - m_last_report_ms <
+			STEP_WATCHDOG_REPORT_INTERVAL_MS){
+		m_unreported_count++;
+		return;
+	}
+	m_reported = true;
+	m_last_report_ms = now_ms;
+
+	std::ostringstream os(std::ios_base::binary);
+	os<<std::fixed<<std::setprecision(3);
+	os<<"Slow server step: "<<(step_us / 1000000.0)<<"s (threshold "
+			<<threshold<<"s); phases:";
+	write_top_times(os, m_phases);
+	os<<"; culprits:";
+	write_top_times(os, m_culprits);
+	if(m_unreported_count != 0)
+		os<<"; "<<m_unreported_count<<" more slow steps since the last report";
+	m_unreported_count = 0;
+	errorstream<<os.str()<<std::endl;
+}
+
+void StepWatchdog::addPhase(const char *name, u32 time_us)
+{
+	std::pair<u32, u32> &phase = m_phases[name];
+	phase.first += time_us;
+	phase.second++;
+}
+
+void StepWatchdog::addCulprit(const char *kind, const std::string &name,
+		u32 time_us)
+{
+	std::pair<u32, u32> &culprit = m_culprits[std::string(kind) + " " + name];
+	culprit.first += time_us;
+	culprit.second++;
+}
@@ -23,160 +23,166 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes.h"
 #include <string>
 #include <map>
+#include <vector>
 
 #include "jthread/jmutex.h"
 #include "jthread/jmutexautolock.h"
+#include "threads.h"
+#include "gettime.h"
 #include "util/timetaker.h"
 #include "util/numeric.h" // paging()
 #include "debug.h" // assert()
 
+template<typename T> class SettingHandle;
+
 /*
 	Time profiler
+
+	The values are accumulated by every thread in data of its own, so
+	that profiling threads don't wait for each other; the data of the
+	threads is only merged when it is read.  Each name gets an id, which
+	can be registered in advance with getId().
 */
 
 class Profiler
 {
 public:
-	Profiler()
-	{
-	}
+	Profiler();
+	~Profiler();
+
+	// Returns the id of name, registering it if needed
+	u32 getId(const std::string &name);
 
 	void add(const std::string &name, float value)
 	{
-		JMutexAutoLock lock(m_mutex);
-		{
-			/* No average shall have been used; mark add used as -2 */
-			std::map<std::string, int>::iterator n = m_avgcounts.find(name);
-			if(n == m_avgcounts.end())
-				m_avgcounts[name] = -2;
-			else{
-				if(n->second == -1)
-					n->second = -2;
-				assert(n->second == -2);
-			}
-		}
-		{
-			std::map<std::string, float>::iterator n = m_data.find(name);
-			if(n == m_data.end())
-				m_data[name] = value;
-			else
-				n->second += value;
-		}
+		ThreadData *data = getThreadData();
+		add(data, data->getId(this, name), value);
+	}
+	void add(u32 id, float value)
+	{
+		add(getThreadData(), id, value);
 	}
 
 	void avg(const std::string &name, float value)
 	{
-		JMutexAutoLock lock(m_mutex);
-		{
-			std::map<std::string, int>::iterator n = m_avgcounts.find(name);
-			if(n == m_avgcounts.end())
-				m_avgcounts[name] = 1;
-			else{
-				/* No add shall have been used */
-				assert(n->second != -2);
-				n->second = MYMAX(n->second, 0) + 1;
-			}
-		}
-		{
-			std::map<std::string, float>::iterator n = m_data.find(name);
-			if(n == m_data.end())
-				m_data[name] = value;
-			else
-				n->second += value;
-		}
+		ThreadData *data = getThreadData();
+		avg(data, data->getId(this, name), value);
 	}
-
-	void clear()
+	void avg(u32 id, float value)
 	{
-		JMutexAutoLock lock(m_mutex);
-		for(std::map<std::string, float>::iterator
-				i = m_data.begin();
-				i != m_data.end(); ++i)
-		{
-			i->second = 0;
-		}
-		m_avgcounts.clear();
+		avg(getThreadData(), id, value);
 	}
 
+	void clear();
+
 	void print(std::ostream &o)
 	{
 		printPage(o, 1, 1);
 	}
 
-	void printPage(std::ostream &o, u32 page, u32 pagecount)
+	void printPage(std::ostream &o, u32 page, u32 pagecount);
+
+	typedef std::map<std::string, float> GraphValues;
+
+	void graphAdd(const std::string &name, float value)
+	{
+		ThreadData *data = getThreadData();
+		graphAdd(data, data->getId(this, name), value);
+	}
+	void graphAdd(u32 id, float value)
+	{
+		graphAdd(getThreadData(), id, value);
+	}
+	void graphGet(GraphValues &result);
+
+	// Sum of the values given for name, also if they are averaged
+	float getTotal(const std::string &name);
+
+	void remove(const std::string &name);
+
+private:
+	struct Entry
 	{
-		JMutexAutoLock lock(m_mutex);
+		Entry():
+			used(false),
+			value(0),
+			avgcount(0),
+			graph_used(false),
+			graph_value(0)
+		{}
 
-		u32 minindex, maxindex;
-		paging(m_data.size(), page, pagecount, minindex, maxindex);
+		bool used;
+		float value;
+		// -2 if add() is used, the number of values if avg() is used
+		int avgcount;
+		bool graph_used;
+		float graph_value;
+	};
 
-		for(std::map<std::string, float>::iterator
-				i = m_data.begin();
-				i != m_data.end(); ++i)
-		{
-			if(maxindex == 0)
-				break;
-			maxindex--;
-
-			if(minindex != 0)
-			{
-				minindex--;
-				continue;
-			}
+	struct ThreadData
+	{
+		// Only used by the thread itself; resolves names without
+		// locking the profiler
+		std::map<std::string, u32> ids;
+		// Locked by the thread when adding and by the readers
+		JMutex mutex;
+		// Indexed by id
+		std::vector<Entry> entries;
 
-			std::string name = i->first;
-			int avgcount = 1;
-			std::map<std::string, int>::iterator n = m_avgcounts.find(name);
-			if(n != m_avgcounts.end()){
-				if(n->second >= 1)
-					avgcount = n->second;
-			}
-			o<<"  "<<name<<": ";
-			s32 clampsize = 40;
-			s32 space = clampsize - name.size();
-			for(s32 j=0; j<space; j++)
-			{
-				if(j%2 == 0 && j < space - 1)
-					o<<"-";
-				else
-					o<<" ";
-			}
-			o<<(i->second / avgcount);
-			o<<std::endl;
+		u32 getId(Profiler *profiler, const std::string &name)
+		{
+			std::map<std::string, u32>::iterator n = ids.find(name);
+			if(n != ids.end())
+				return n->second;
+			u32 id = profiler->getId(name);
+			ids[name] = id;
+			return id;
 		}
-	}
+		// Call with mutex locked
+		Entry &getEntry(u32 id)
+		{
+			if(id >= entries.size())
+				entries.resize(id + 1);
+			return entries[id];
+		}
+	};
 
-	typedef std::map<std::string, float> GraphValues;
+	ThreadData *getThreadData();
+	// Call with m_mutex locked
+	void mergeNoLock(std::vector<Entry> &result);
 
-	void graphAdd(const std::string &id, float value)
+	void add(ThreadData *data, u32 id, float value)
 	{
-		JMutexAutoLock lock(m_mutex);
-		std::map<std::string, float>::iterator i =
-				m_graphvalues.find(id);
-		if(i == m_graphvalues.end())
-			m_graphvalues[id] = value;
-		else
-			i->second += value;
+		JMutexAutoLock lock(data->mutex);
+		Entry &e = data->getEntry(id);
+		e.used = true;
+		e.value += value;
+		e.avgcount = -2;
 	}
-	void graphGet(GraphValues &result)
+	void avg(ThreadData *data, u32 id, float value)
 	{
-		JMutexAutoLock lock(m_mutex);
-		result = m_graphvalues;
-		m_graphvalues.clear();
+		JMutexAutoLock lock(data->mutex);
+		Entry &e = data->getEntry(id);
+		e.used = true;
+		e.value += value;
+		e.avgcount = MYMAX(e.avgcount, 0) + 1;
 	}
-
-	void remove(const std::string& name)
+	void graphAdd(ThreadData *data, u32 id, float value)
 	{
-		JMutexAutoLock lock(m_mutex);
-		m_avgcounts.erase(name);
-		m_data.erase(name);
+		JMutexAutoLock lock(data->mutex);
+		Entry &e = data->getEntry(id);
+		e.graph_used = true;
+		e.graph_value += value;
 	}
 
-private:
+	// Identifies the profiler in the caches of the threads; unlike the
+	// address, it is never reused
+	u32 m_serial;
+	// Locks m_ids, m_names and m_threads
 	JMutex m_mutex;
-	std::map<std::string, float> m_data;
-	std::map<std::string, int> m_avgcounts;
-	std::map<std::string, float> m_graphvalues;
+	std::map<std::string, u32> m_ids;
+	std::vector<std::string> m_names;
+	std::map<threadid_t, ThreadData*> m_threads;
 };
 
 enum ScopeProfilerType{
@@ -196,7 +202,7 @@ class ScopeProfiler
 		m_type(type)
 	{
 		if(m_profiler)
-			m_timer = new TimeTaker(m_name.c_str());
+			m_timer = new TimeTaker(m_name.c_str(), NULL, PRECISION_MICRO);
 	}
 	// name is copied
 	ScopeProfiler(Profiler *profiler, const char *name,
@@ -207,14 +213,14 @@ class ScopeProfiler
 		m_type(type)
 	{
 		if(m_profiler)
-			m_timer = new TimeTaker(m_name.c_str());
+			m_timer = new TimeTaker(m_name.c_str(), NULL, PRECISION_MICRO);
 	}
 	~ScopeProfiler()
 	{
 		if(m_timer)
 		{
-			float duration_ms = m_timer->stop(true);
-			float duration = duration_ms / 1000.0;
+			float duration_us = m_timer->stop(true);
+			float duration = duration_us / 1000000.0;
 			if(m_profiler){
 				switch(m_type){
 				case SPT_ADD:
@@ -238,5 +244,126 @@ class ScopeProfiler
 	enum ScopeProfilerType m_type;
 };
 
+/*
+	Tracing
+
+	When enabled, every TimeTaker, also the ones of ScopeProfiler, is
+	recorded with its thread, start time and duration in a ring buffer of
+	the thread, which holds its latest events.  The events are written in
+	the Chrome trace event format, which chrome://tracing and Perfetto
+	can show as a timeline of the threads.
+*/
+
+extern bool g_profiler_trace_enabled;
+
+// Call before the threads are started; 0 keeps tracing disabled
+void profiler_trace_init(u32 events_per_thread);
+
+inline bool profiler_trace_enabled()
+{
+	return g_profiler_trace_enabled;
+}
+
+void profiler_trace_record(const char *name, u32 start_us, u32 duration_us);
+
+// Writes the recorded events of all threads, ending at the current time
+void profiler_trace_write(std::ostream &os);
+
+/*
+	Slow step watchdog
+
+	Times the phases of the server steps, and inside them the work that
+	has a name, like the ABMs and the Lua callbacks of entities.  A step
+	that takes longer than slow_step_threshold seconds is logged with its
+	slowest phases and culprits.  Only the thread that runs the steps is
+	timed; the others are ignored.
+*/
+
+class StepWatchdog
+{
+public:
+	StepWatchdog();
+	~StepWatchdog();
+
+	void beginStep();
+	void endStep();
+
+	bool isTiming()
+	{
+		return m_timing && get_current_thread_id() == m_thread;
+	}
+
+	void addPhase(const char *name, u32 time_us);
+	// Culprits are named by their kind, like "ABM", and their name
+	void addCulprit(const char *kind, const std::string &name, u32 time_us);
+
+private:
+	// Only touched by the stepping thread
+	SettingHandle<float> *m_threshold;
+	bool m_timing;
+	threadid_t m_thread;
+	u32 m_step_start_us;
+	u32 m_last_report_ms;
+	bool m_reported;
+	u32 m_unreported_count;
+	// Time and count
+	std::map<std::string, std::pair<u32, u32> > m_phases;
+	std::map<std::string, std::pair<u32, u32> > m_culprits;
+};
+
+extern StepWatchdog g_step_watchdog;
+
+// Times a phase of the step for g_step_watchdog
+class StepWatchdogPhase
+{
+public:
+	// name must stay valid until the end of the scope
+	StepWatchdogPhase(const char *name):
+		m_name(name),
+		m_timing(g_step_watchdog.isTiming())
+	{
+		if(m_timing)
+			m_start_us = getTime(PRECISION_MICRO);
+	}
+	~StepWatchdogPhase()
+	{
+		if(m_timing)
+			g_step_watchdog.addPhase(m_name,
+					getTime(PRECISION_MICRO) - m_start_us);
+	}
+
+private:
+	const char *m_name;
+	bool m_timing;
+	u32 m_start_us;
+};
+
+// Times something that might be the cause of a slow step
+class StepWatchdogCulprit
+{
+public:
+	// name must stay valid until the end of the scope
+	StepWatchdogCulprit(const char *kind, const std::string &name):
+		m_kind(kind),
+		m_name(name),
+		m_timing(g_step_watchdog.isTiming())
+	{
+		if(m_timing)
+			m_start_us = getTime(PRECISION_MICRO);
+	}
+	~StepWatchdogCulprit()
+	{
+		if(m_timing)
+			g_step_watchdog.addCulprit(m_kind, m_name,
+					getTime(PRECISION_MICRO) - m_start_us);
+	}
+
+private:
+	const char *m_kind;
+	const std::string &m_name;
+	bool m_timing;
+	u32 m_start_us;
+};
+
 #endif
 
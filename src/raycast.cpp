@@ -0,0 +1,163 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "raycast.h"
+#include "map.h"
+#include "mapblock.h"
+#include "nodedef.h"
+#include "util/numeric.h"
+
+/*
+	VoxelLineIterator
+*/
+
+VoxelLineIterator::VoxelLineIterator(v3f start, v3f end):
+	m_current(floatToInt(start, BS)),
+	m_entered_from(0, 0, 0)
+{
+	v3s16 last = floatToInt(end, BS);
+	v3f dir = end - start;
+
+	f32 *d = &dir.X;
+	f32 *s = &start.X;
+	s16 *c = &m_current.X;
+	s16 *l = &last.X;
+	s16 *step = &m_step.X;
+	s16 *left = &m_left.X;
+	f32 *boundary = &m_next_boundary.X;
+	f32 *delta = &m_delta.X;
+
+	// An axis is only stepped on the number of times the nodes of the
+	// start and the end are apart on it, so that rounding can't take the
+	// line past the end
+	for (u32 i = 0; i < 3; i++) {
+		step[i] = (l[i] > c[i]) ? 1 : (l[i] < c[i]) ? -1 : 0;
+		left[i] = abs(l[i] - c[i]);
+		if (step[i] == 0 || d[i] == 0) {
+			boundary[i] = 0;
+			delta[i] = 0;
+			continue;
+		}
+		f32 edge = (c[i] + step[i] * 0.5f) * BS;
+		boundary[i] = (edge - s[i]) / d[i];
+		delta[i] = BS / fabs(d[i]);
+	}
+	m_remaining = m_left.X + m_left.Y + m_left.Z;
+}
+
+void VoxelLineIterator::next()
+{
+	if (m_remaining == 0)
+		return;
+
+	// The axis of the nearest node boundary still to be crossed
+	s16 *left = &m_left.X;
+	f32 *boundary = &m_next_boundary.X;
+	int axis = -1;
+	for (int i = 0; i < 3; i++) {
+		if (left[i] == 0)
+			continue;
+		if (axis == -1 || boundary[i] < boundary[axis])
+			axis = i;
+	}
+
+	(&m_current.X)[axis] += (&m_step.X)[axis];
+	m_entered_from = v3s16(0, 0, 0);
+	(&m_entered_from.X)[axis] = -(&m_step.X)[axis];
+	boundary[axis] += (&m_delta.X)[axis];
+	left[axis]--;
+	m_remaining--;
+}
+
+/*
+	CachedNodeReader
+*/
+
+MapNode CachedNodeReader::getNode(v3s16 p, bool *is_valid_position)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	if (!m_has_block || blockpos != m_blockpos) {
+		m_block = m_map->getBlockNoCreateNoEx(blockpos);
+		m_blockpos = blockpos;
+		m_has_block = true;
+	}
+
+	if (m_block == NULL) {
+		if (is_valid_position != NULL)
+			*is_valid_position = false;
+		return MapNode(CONTENT_IGNORE);
+	}
+
+	bool is_valid_p;
+	MapNode n = m_block->getNodeNoCheck(p - blockpos * MAP_BLOCKSIZE,
+			&is_valid_p);
+	if (is_valid_position != NULL)
+		*is_valid_position = is_valid_p;
+	return n;
+}
+
+/*
+	Raycasts
+*/
+
+RaycastFilter parseRaycastFilter(const std::string &name)
+{
+	if (name == "walkable")
+		return RAYCAST_WALKABLE;
+	if (name == "pointable")
+		return RAYCAST_POINTABLE;
+	return RAYCAST_NOT_AIR;
+}
+
+bool raycastFilterMatches(MapNode n, bool is_valid_position,
+		INodeDefManager *ndef, RaycastFilter filter)
+{
+	switch (filter) {
+	case RAYCAST_NOT_AIR:
+		return n.getContent() != CONTENT_AIR;
+	case RAYCAST_WALKABLE:
+		return is_valid_position && ndef->get(n).walkable;
+	case RAYCAST_POINTABLE:
+		return is_valid_position && ndef->get(n).pointable;
+	}
+	return false;
+}
+
+bool raycastFirstNode(Map *map, INodeDefManager *ndef, v3f start, v3f end,
+		RaycastFilter filter, v3s16 *hit, v3s16 *above)
+{
+	CachedNodeReader reader(map);
+	VoxelLineIterator line(start, end);
+	for (;;) {
+		v3s16 p = line.getCurrent();
+		bool is_valid_position;
+		MapNode n = reader.getNode(p, &is_valid_position);
+		if (raycastFilterMatches(n, is_valid_position, ndef, filter)) {
+			if (hit)
+				*hit = p;
+			if (above)
+				*above = p + line.getEnteredFrom();
+			return true;
+		}
+		if (!line.hasNext())
+			return false;
+		line.next();
+	}
+}
+
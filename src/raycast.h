@@ -0,0 +1,121 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef RAYCAST_HEADER
+#define RAYCAST_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include "mapnode.h"
+#include <string>
+
+class Map;
+class MapBlock;
+class INodeDefManager;
+
+/*
+	The nodes a line goes through, in order, each of them once, from the
+	node of the start to the node of the end (3D DDA). Positions are in
+	BS units like the positions of objects.
+*/
+class VoxelLineIterator
+{
+public:
+	VoxelLineIterator(v3f start, v3f end);
+
+	v3s16 getCurrent() const
+	{
+		return m_current;
+	}
+
+	// Side of the current node the line came in through, pointing to the
+	// previous node; (0,0,0) for the first one
+	v3s16 getEnteredFrom() const
+	{
+		return m_entered_from;
+	}
+
+	bool hasNext() const
+	{
+		return m_remaining > 0;
+	}
+
+	void next();
+
+private:
+	v3s16 m_current;
+	v3s16 m_entered_from;
+	v3s16 m_step;
+	// Steps left on each axis and in total
+	v3s16 m_left;
+	u32 m_remaining;
+	// Part of the line where it enters the next node on each axis, and
+	// the part of it one node takes
+	v3f m_next_boundary;
+	v3f m_delta;
+};
+
+/*
+	Reads the nodes of a map, keeping the block of the last one looked up,
+	which nodes along a line mostly share. The blocks must not be deleted
+	while it's used, so it shouldn't be kept longer than a map lock.
+*/
+class CachedNodeReader
+{
+public:
+	CachedNodeReader(Map *map):
+		m_map(map),
+		m_block(NULL),
+		m_has_block(false)
+	{
+	}
+
+	MapNode getNode(v3s16 p, bool *is_valid_position = NULL);
+
+private:
+	Map *m_map;
+	MapBlock *m_block;
+	v3s16 m_blockpos;
+	bool m_has_block;
+};
+
+enum RaycastFilter
+{
+	// Everything but air stops the line, unloaded nodes too
+	RAYCAST_NOT_AIR,
+	RAYCAST_WALKABLE,
+	RAYCAST_POINTABLE,
+};
+
+// Reads "walkable" and "pointable" to a filter; anything else is
+// RAYCAST_NOT_AIR
+RaycastFilter parseRaycastFilter(const std::string &name);
+
+bool raycastFilterMatches(MapNode n, bool is_valid_position,
+		INodeDefManager *ndef, RaycastFilter filter);
+
+/*
+	Finds the first node on the line from start to end (BS units) that
+	matches the filter. above is set to the node the line came from, or
+	the hit itself if it starts there.
+*/
+bool raycastFirstNode(Map *map, INodeDefManager *ndef, v3f start, v3f end,
+		RaycastFilter filter, v3s16 *hit, v3s16 *above = NULL);
+
+#endif
+
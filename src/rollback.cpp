@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include <list>
 #include <sstream>
+#include <algorithm>
+#include <cstring>
 #include "log.h"
 #include "mapnode.h"
 #include "gamedef.h"
@@ -31,9 +33,32 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "inventorymanager.h" // deserializing InventoryLocations
 #include "sqlite3.h"
 #include "filesys.h"
+#include "main.h" // for g_settings
+#include "settings.h"
+#include "constants.h"
+#include "porting.h"
+#include "debug.h"
+#include "jthread/jthread.h"
+#include "jthread/jsemaphore.h"
+#include "jthread/jmutexautolock.h"
 
 #define POINTS_PER_NODE (16.0)
 
+// The writer thread is woken up when this many actions are queued...
+#define ROLLBACK_WRITE_BATCH_SIZE 500
+// ...and otherwise writes what there is this often
+#define ROLLBACK_WRITE_INTERVAL_MS 5000
+// getSuspect() doesn't look further back than this
+#define ROLLBACK_LATEST_BUFFER_SECONDS 100
+// Size of the cells the recent actions are kept in, in nodes; a suspect
+// can't be more than 100 / POINTS_PER_NODE nodes away
+#define ROLLBACK_SUSPECT_CELL_SIZE 8
+// Area queries covering more blocks than this scan by position instead
+#define ROLLBACK_RANGE_MAX_BLOCKS 512
+// How often old actions are deleted, and how many per transaction
+#define ROLLBACK_PRUNE_INTERVAL 3600
+#define ROLLBACK_PRUNE_CHUNK 10000
+
 #define SQLRES(f, good) \
 	if ((f) != (good)) {\
 		throw FileNotGoodException(std::string("RollbackManager: " \
@@ -74,17 +99,71 @@ struct ActionRow {
 };
 
 
-struct Entity {
-	int         id;
-	std::string name;
+// Key of the block containing a node; the same in SQL in
+// addBlockColumn()
+static s64 getBlockKey(int x, int y, int z)
+{
+	return (s64) getContainerPos(z, MAP_BLOCKSIZE) * 0x1000000 +
+		(s64) getContainerPos(y, MAP_BLOCKSIZE) * 0x1000 +
+		(s64) getContainerPos(x, MAP_BLOCKSIZE);
+}
+
+
+class RollbackWriteThread : public JThread
+{
+public:
+	RollbackWriteThread(RollbackManager * mgr) :
+		JThread(),
+		m_mgr(mgr)
+	{}
+
+	void * Thread();
+
+	JSemaphore m_queue_sem;
+
+private:
+	RollbackManager * m_mgr;
 };
 
 
+void * RollbackWriteThread::Thread()
+{
+	log_register_thread("RollbackWriteThread");
+
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	ThreadStarted();
+
+	porting::setThreadName("RollbackWriteThread");
+
+	time_t max_age = (time_t) g_settings->getU16("rollback_max_age_days") * 24 * 3600;
+	time_t last_prune = 0;
+
+	while (!StopRequested()) {
+		m_queue_sem.Wait(ROLLBACK_WRITE_INTERVAL_MS);
+		m_mgr->writeQueuedActions();
+
+		if (max_age != 0 && time(0) - last_prune >= ROLLBACK_PRUNE_INTERVAL) {
+			last_prune = time(0);
+			// In chunks, so that writes and queries aren't held up
+			while (!StopRequested() &&
+					m_mgr->pruneActions(last_prune - max_age));
+		}
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+
 
 RollbackManager::RollbackManager(const std::string & world_path,
 		IGameDef * gamedef_) :
 	gamedef(gamedef_),
-	current_actor_is_guess(false)
+	current_actor_is_guess(false),
+	suspect_seq(0)
 {
 	verbosestream << "RollbackManager::RollbackManager(" << world_path
 		<< ")" << std::endl;
@@ -102,15 +181,27 @@ RollbackManager::RollbackManager(const std::string & world_path,
 		migrate(txt_filename);
 		fs::DeleteSingleFileOrEmptyDirectory(migrating_flag);
 	}
+
+	write_thread = new RollbackWriteThread(this);
+	write_thread->Start();
 }
 
 
 RollbackManager::~RollbackManager()
 {
+	write_thread->Stop();
+	write_thread->m_queue_sem.Post();
+	write_thread->Wait();
+	delete write_thread;
+	// Write whatever was queued after the last write
+	writeQueuedActions();
+
 	SQLOK(sqlite3_finalize(stmt_insert));
 	SQLOK(sqlite3_finalize(stmt_replace));
 	SQLOK(sqlite3_finalize(stmt_select));
 	SQLOK(sqlite3_finalize(stmt_select_range));
+	SQLOK(sqlite3_finalize(stmt_select_range_block));
+	SQLOK(sqlite3_finalize(stmt_prune));
 	SQLOK(sqlite3_finalize(stmt_select_withActor));
 	SQLOK(sqlite3_finalize(stmt_knownActor_select));
 	SQLOK(sqlite3_finalize(stmt_knownActor_insert));
@@ -123,25 +214,23 @@ RollbackManager::~RollbackManager()
 
 void RollbackManager::registerNewActor(const int id, const std::string &name)
 {
-	Entity actor = {id, name};
-	knownActors.push_back(actor);
+	knownActorIds[name] = id;
+	knownActorNames[id] = name;
 }
 
 
 void RollbackManager::registerNewNode(const int id, const std::string &name)
 {
-	Entity node = {id, name};
-	knownNodes.push_back(node);
+	knownNodeIds[name] = id;
+	knownNodeNames[id] = name;
 }
 
 
 int RollbackManager::getActorId(const std::string &name)
 {
-	for (std::vector<Entity>::const_iterator iter = knownActors.begin();
-			iter != knownActors.end(); ++iter) {
-		if (iter->name == name) {
-			return iter->id;
-		}
+	std::map<std::string, int>::const_iterator iter = knownActorIds.find(name);
+	if (iter != knownActorIds.end()) {
+		return iter->second;
 	}
 
 	SQLOK(sqlite3_bind_text(stmt_knownActor_insert, 1, name.c_str(), name.size(), NULL));
@@ -157,11 +246,9 @@ int RollbackManager::getActorId(const std::string &name)
 
 int RollbackManager::getNodeId(const std::string &name)
 {
-	for (std::vector<Entity>::const_iterator iter = knownNodes.begin();
-			iter != knownNodes.end(); ++iter) {
-		if (iter->name == name) {
-			return iter->id;
-		}
+	std::map<std::string, int>::const_iterator iter = knownNodeIds.find(name);
+	if (iter != knownNodeIds.end()) {
+		return iter->second;
 	}
 
 	SQLOK(sqlite3_bind_text(stmt_knownNode_insert, 1, name.c_str(), name.size(), NULL));
@@ -177,11 +264,9 @@ int RollbackManager::getNodeId(const std::string &name)
 
 const char * RollbackManager::getActorName(const int id)
 {
-	for (std::vector<Entity>::const_iterator iter = knownActors.begin();
-			iter != knownActors.end(); ++iter) {
-		if (iter->id == id) {
-			return iter->name.c_str();
-		}
+	std::map<int, std::string>::const_iterator iter = knownActorNames.find(id);
+	if (iter != knownActorNames.end()) {
+		return iter->second.c_str();
 	}
 
 	return "";
@@ -190,17 +275,48 @@ const char * RollbackManager::getActorName(const int id)
 
 const char * RollbackManager::getNodeName(const int id)
 {
-	for (std::vector<Entity>::const_iterator iter = knownNodes.begin();
-			iter != knownNodes.end(); ++iter) {
-		if (iter->id == id) {
-			return iter->name.c_str();
-		}
+	std::map<int, std::string>::const_iterator iter = knownNodeNames.find(id);
+	if (iter != knownNodeNames.end()) {
+		return iter->second.c_str();
 	}
 
 	return "";
 }
 
 
+void RollbackManager::addBlockColumn()
+{
+	sqlite3_stmt *stmt;
+	SQLOK(sqlite3_prepare_v2(db, "PRAGMA table_info(`action`)", -1, &stmt, NULL));
+	bool found = false;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *name = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+		if (name && strcmp(name, "block") == 0) {
+			found = true;
+		}
+	}
+	SQLOK(sqlite3_finalize(stmt));
+
+	if (!found) {
+		infostream << "RollbackManager: Adding block index to rollback "
+			"database, this may take a while" << std::endl;
+		// >> rounds towards negative infinity in SQLite, too
+		SQLOK(sqlite3_exec(db,
+			"BEGIN;\n"
+			"ALTER TABLE `action` ADD COLUMN `block` INTEGER;\n"
+			"UPDATE `action` SET `block` =\n"
+			"	(`z` >> 4) * 16777216 + (`y` >> 4) * 4096 + (`x` >> 4)\n"
+			"	WHERE `x` IS NOT NULL AND `y` IS NOT NULL AND `z` IS NOT NULL;\n"
+			"COMMIT;\n",
+			NULL, NULL, NULL));
+	}
+
+	SQLOK(sqlite3_exec(db,
+		"CREATE INDEX IF NOT EXISTS `actionBlock` ON `action`(`block`, `timestamp`);\n",
+		NULL, NULL, NULL));
+}
+
+
 bool RollbackManager::createTables()
 {
 	SQLOK(sqlite3_exec(db,
@@ -235,6 +351,7 @@ bool RollbackManager::createTables()
 		"	`newParam2` INTEGER,\n"
 		"	`newMeta` TEXT,\n"
 		"	`guessedActor` INTEGER,\n"
+		"	`block` INTEGER,\n"
 		"	FOREIGN KEY (`actor`) REFERENCES `actor`(`id`),\n"
 		"	FOREIGN KEY (`stackNode`) REFERENCES `node`(`id`),\n"
 		"	FOREIGN KEY (`oldNode`)   REFERENCES `node`(`id`),\n"
@@ -258,8 +375,11 @@ void RollbackManager::initDatabase()
 			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL));
 
 	if (needsCreate) {
+		// Lets pruneActions() give space back to the file system
+		SQLOK(sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL", NULL, NULL, NULL));
 		createTables();
 	}
+	addBlockColumn();
 
 	SQLOK(sqlite3_prepare_v2(db,
 		"INSERT INTO `action` (\n"
@@ -268,14 +388,14 @@ void RollbackManager::initDatabase()
 		"	`x`, `y`, `z`,\n"
 		"	`oldNode`, `oldParam1`, `oldParam2`, `oldMeta`,\n"
 		"	`newNode`, `newParam1`, `newParam2`, `newMeta`,\n"
-		"	`guessedActor`\n"
+		"	`guessedActor`, `block`\n"
 		") VALUES (\n"
 		"	?, ?, ?,\n"
 		"	?, ?, ?, ?, ?, ?,\n"
 		"	?, ?, ?,\n"
 		"	?, ?, ?, ?,\n"
 		"	?, ?, ?, ?,\n"
-		"	?"
+		"	?, ?"
 		");",
 		-1, &stmt_insert, NULL));
 
@@ -286,14 +406,14 @@ void RollbackManager::initDatabase()
 		"	`x`, `y`, `z`,\n"
 		"	`oldNode`, `oldParam1`, `oldParam2`, `oldMeta`,\n"
 		"	`newNode`, `newParam1`, `newParam2`, `newMeta`,\n"
-		"	`guessedActor`, `id`\n"
+		"	`guessedActor`, `block`, `id`\n"
 		") VALUES (\n"
 		"	?, ?, ?,\n"
 		"	?, ?, ?, ?, ?, ?,\n"
 		"	?, ?, ?,\n"
 		"	?, ?, ?, ?,\n"
 		"	?, ?, ?, ?,\n"
-		"	?, ?\n"
+		"	?, ?, ?\n"
 		");",
 		-1, &stmt_replace, NULL));
 
@@ -330,6 +450,29 @@ void RollbackManager::initDatabase()
 		"LIMIT 0,?",
 		-1, &stmt_select_range, NULL));
 
+	SQLOK(sqlite3_prepare_v2(db,
+		"SELECT\n"
+		"	`actor`, `timestamp`, `type`,\n"
+		"	`list`, `index`, `add`, `stackNode`, `stackQuantity`, `nodemeta`,\n"
+		"	`x`, `y`, `z`,\n"
+		"	`oldNode`, `oldParam1`, `oldParam2`, `oldMeta`,\n"
+		"	`newNode`, `newParam1`, `newParam2`, `newMeta`,\n"
+		"	`guessedActor`, `id`\n"
+		"FROM `action`\n"
+		"WHERE `block` = ?\n"
+		"	AND `timestamp` >= ?\n"
+		"	AND `x` BETWEEN ? AND ?\n"
+		"	AND `y` BETWEEN ? AND ?\n"
+		"	AND `z` BETWEEN ? AND ?\n"
+		"ORDER BY `timestamp` DESC, `id` DESC\n"
+		"LIMIT 0,?",
+		-1, &stmt_select_range_block, NULL));
+
+	SQLOK(sqlite3_prepare_v2(db,
+		"DELETE FROM `action` WHERE `id` IN (\n"
+		"	SELECT `id` FROM `action` WHERE `timestamp` < ? LIMIT ?)",
+		-1, &stmt_prune, NULL));
+
 	SQLOK(sqlite3_prepare_v2(db,
 		"SELECT\n"
 		"	`actor`, `timestamp`, `type`,\n"
@@ -409,6 +552,8 @@ bool RollbackManager::registerRow(const ActionRow & row)
 			SQLOK(sqlite3_bind_int(stmt_do, 10, atoi(x.c_str())));
 			SQLOK(sqlite3_bind_int(stmt_do, 11, atoi(y.c_str())));
 			SQLOK(sqlite3_bind_int(stmt_do, 12, atoi(z.c_str())));
+			SQLOK(sqlite3_bind_int64(stmt_do, 22, getBlockKey(
+				atoi(x.c_str()), atoi(y.c_str()), atoi(z.c_str()))));
 		}
 	} else {
 		SQLOK(sqlite3_bind_null(stmt_do, 4));
@@ -432,11 +577,13 @@ bool RollbackManager::registerRow(const ActionRow & row)
 		SQLOK(sqlite3_bind_int (stmt_do, 19, row.newParam2));
 		SQLOK(sqlite3_bind_text(stmt_do, 20, row.newMeta.c_str(), row.newMeta.size(), NULL));
 		SQLOK(sqlite3_bind_int (stmt_do, 21, row.guessed ? 1 : 0));
+		SQLOK(sqlite3_bind_int64(stmt_do, 22, getBlockKey(row.x, row.y, row.z)));
 	} else {
 		if (!nodeMeta) {
 			SQLOK(sqlite3_bind_null(stmt_do, 10));
 			SQLOK(sqlite3_bind_null(stmt_do, 11));
 			SQLOK(sqlite3_bind_null(stmt_do, 12));
+			SQLOK(sqlite3_bind_null(stmt_do, 22));
 		}
 		SQLOK(sqlite3_bind_null(stmt_do, 13));
 		SQLOK(sqlite3_bind_null(stmt_do, 14));
@@ -450,7 +597,7 @@ bool RollbackManager::registerRow(const ActionRow & row)
 	}
 
 	if (row.id) {
-		SQLOK(sqlite3_bind_int(stmt_do, 22, row.id));
+		SQLOK(sqlite3_bind_int(stmt_do, 23, row.id));
 	}
 
 	int written = sqlite3_step(stmt_do);
@@ -467,9 +614,12 @@ const std::list<ActionRow> RollbackManager::actionRowsFromSelect(sqlite3_stmt* s
 	const unsigned char * text;
 	size_t size;
 
+	bool has_id = sqlite3_column_count(stmt) > 21;
+
 	while (sqlite3_step(stmt) == SQLITE_ROW) {
 		ActionRow row;
 
+		row.id        = has_id ? sqlite3_column_int(stmt, 21) : 0;
 		row.actor     = sqlite3_column_int  (stmt, 0);
 		row.timestamp = sqlite3_column_int64(stmt, 1);
 		row.type      = sqlite3_column_int  (stmt, 2);
@@ -626,29 +776,98 @@ const std::list<ActionRow> RollbackManager::getRowsSince(time_t firstTime, const
 }
 
 
+static bool actionRowNewer(const ActionRow &a, const ActionRow &b)
+{
+	if (a.timestamp != b.timestamp) {
+		return a.timestamp > b.timestamp;
+	}
+	return a.id > b.id;
+}
+
+
 const std::list<ActionRow> RollbackManager::getRowsSince_range(
 		time_t start_time, v3s16 p, int range, int limit)
 {
+	v3s16 minp = getContainerPos(p - v3s16(range, range, range), MAP_BLOCKSIZE);
+	v3s16 maxp = getContainerPos(p + v3s16(range, range, range), MAP_BLOCKSIZE);
+	v3s16 extent = maxp - minp + v3s16(1, 1, 1);
+	s32 num_blocks = (s32) extent.X * extent.Y * extent.Z;
+
+	sqlite3_stmt *stmt = stmt_select_range;
+	int i = 1;
+	if (num_blocks <= ROLLBACK_RANGE_MAX_BLOCKS) {
+		stmt = stmt_select_range_block;
+		i = 2;
+	}
+	sqlite3_bind_int64(stmt, i,     start_time);
+	sqlite3_bind_int  (stmt, i + 1, static_cast<int>(p.X - range));
+	sqlite3_bind_int  (stmt, i + 2, static_cast<int>(p.X + range));
+	sqlite3_bind_int  (stmt, i + 3, static_cast<int>(p.Y - range));
+	sqlite3_bind_int  (stmt, i + 4, static_cast<int>(p.Y + range));
+	sqlite3_bind_int  (stmt, i + 5, static_cast<int>(p.Z - range));
+	sqlite3_bind_int  (stmt, i + 6, static_cast<int>(p.Z + range));
+	sqlite3_bind_int  (stmt, i + 7, limit);
+
+	if (stmt == stmt_select_range) {
+		const std::list<ActionRow> & rows = actionRowsFromSelect(stmt);
+		sqlite3_reset(stmt);
+		return rows;
+	}
 
-	sqlite3_bind_int64(stmt_select_range, 1, start_time);
-	sqlite3_bind_int  (stmt_select_range, 2, static_cast<int>(p.X - range));
-	sqlite3_bind_int  (stmt_select_range, 3, static_cast<int>(p.X + range));
-	sqlite3_bind_int  (stmt_select_range, 4, static_cast<int>(p.Y - range));
-	sqlite3_bind_int  (stmt_select_range, 5, static_cast<int>(p.Y + range));
-	sqlite3_bind_int  (stmt_select_range, 6, static_cast<int>(p.Z - range));
-	sqlite3_bind_int  (stmt_select_range, 7, static_cast<int>(p.Z + range));
-	sqlite3_bind_int  (stmt_select_range, 8, limit);
+	// Look up every block in the area through the block index and merge
+	// the newest rows of all of them
+	std::vector<ActionRow> merged;
+	v3s16 bp;
+	for (bp.Z = minp.Z; bp.Z <= maxp.Z; bp.Z++)
+	for (bp.Y = minp.Y; bp.Y <= maxp.Y; bp.Y++)
+	for (bp.X = minp.X; bp.X <= maxp.X; bp.X++) {
+		sqlite3_bind_int64(stmt, 1, getBlockKey(bp.X * MAP_BLOCKSIZE,
+				bp.Y * MAP_BLOCKSIZE, bp.Z * MAP_BLOCKSIZE));
+		const std::list<ActionRow> & rows = actionRowsFromSelect(stmt);
+		merged.insert(merged.end(), rows.begin(), rows.end());
+	}
+	sqlite3_reset(stmt);
 
-	const std::list<ActionRow> & rows = actionRowsFromSelect(stmt_select_range);
-	sqlite3_reset(stmt_select_range);
+	std::sort(merged.begin(), merged.end(), actionRowNewer);
+	if (limit >= 0 && merged.size() > (size_t) limit) {
+		merged.resize(limit);
+	}
+	return std::list<ActionRow>(merged.begin(), merged.end());
+}
 
-	return rows;
+
+bool RollbackManager::pruneActions(time_t older_than)
+{
+	JMutexAutoLock lock(db_mutex);
+
+	sqlite3_bind_int64(stmt_prune, 1, older_than);
+	sqlite3_bind_int  (stmt_prune, 2, ROLLBACK_PRUNE_CHUNK);
+	int rc = sqlite3_step(stmt_prune);
+	sqlite3_reset(stmt_prune);
+	if (rc != SQLITE_DONE) {
+		errorstream << "RollbackManager: Failed to delete old actions: "
+			<< sqlite3_errmsg(db) << std::endl;
+		return false;
+	}
+
+	int deleted = sqlite3_changes(db);
+	if (deleted == 0) {
+		return false;
+	}
+	verbosestream << "RollbackManager: Deleted " << deleted
+		<< " old actions" << std::endl;
+
+	// Does nothing unless the database was created with incremental
+	// auto_vacuum; otherwise the free pages are reused by new actions
+	sqlite3_exec(db, "PRAGMA incremental_vacuum", NULL, NULL, NULL);
+	return true;
 }
 
 
 const std::list<RollbackAction> RollbackManager::getActionsSince_range(
 		time_t start_time, v3s16 p, int range, int limit)
 {
+	JMutexAutoLock lock(db_mutex);
 	return rollbackActionsFromActionRows(getRowsSince_range(start_time, p, range, limit));
 }
 
@@ -656,6 +875,7 @@ const std::list<RollbackAction> RollbackManager::getActionsSince_range(
 const std::list<RollbackAction> RollbackManager::getActionsSince(
 		time_t start_time, const std::string & actor)
 {
+	JMutexAutoLock lock(db_mutex);
 	return rollbackActionsFromActionRows(getRowsSince(start_time, actor));
 }
 
@@ -854,76 +1074,184 @@ std::string RollbackManager::getSuspect(v3s16 p, float nearness_shortcut,
 	}
 	int cur_time = time(0);
 	time_t first_time = cur_time - (100 - min_nearness);
-	RollbackAction likely_suspect;
+	// Actions further away than this can't be near enough
+	s16 r = (100 - MYMAX(min_nearness, 0)) / POINTS_PER_NODE + 1;
+	v3s16 cell_min = getContainerPos(p - v3s16(r, r, r),
+			ROLLBACK_SUSPECT_CELL_SIZE);
+	v3s16 cell_max = getContainerPos(p + v3s16(r, r, r),
+			ROLLBACK_SUSPECT_CELL_SIZE);
+
+	// Gives what going through all the actions newest first would: the
+	// newest one reaching nearness_shortcut, or else the nearest one,
+	// the newest of them on a tie
+	const SuspectAction *shortcut_suspect = NULL;
+	const SuspectAction *likely_suspect = NULL;
 	float likely_suspect_nearness = 0;
-	for (std::list<RollbackAction>::const_reverse_iterator
-	     i = action_latest_buffer.rbegin();
-	     i != action_latest_buffer.rend(); i++) {
-		if (i->unix_time < first_time) {
-			break;
-		}
-		if (i->actor == "") {
-			continue;
-		}
-		// Find position of suspect or continue
-		v3s16 suspect_p;
-		if (!i->getPosition(&suspect_p)) {
+	v3s16 cell;
+	for (cell.Z = cell_min.Z; cell.Z <= cell_max.Z; cell.Z++)
+	for (cell.Y = cell_min.Y; cell.Y <= cell_max.Y; cell.Y++)
+	for (cell.X = cell_min.X; cell.X <= cell_max.X; cell.X++) {
+		std::map<v3s16, std::deque<SuspectAction> >::const_iterator
+			n = suspect_cells.find(cell);
+		if (n == suspect_cells.end()) {
 			continue;
 		}
-		float f = getSuspectNearness(i->actor_is_guess, suspect_p,
-					     i->unix_time, p, cur_time);
-		if (f >= min_nearness && f > likely_suspect_nearness) {
-			likely_suspect_nearness = f;
-			likely_suspect = *i;
-			if (likely_suspect_nearness >= nearness_shortcut) {
+		const std::deque<SuspectAction> &actions = n->second;
+		for (std::deque<SuspectAction>::const_reverse_iterator
+		     i = actions.rbegin(); i != actions.rend(); i++) {
+			if (i->unix_time < first_time) {
 				break;
 			}
+			float f = getSuspectNearness(i->actor_is_guess, i->p,
+						     i->unix_time, p, cur_time);
+			if (f < min_nearness || f == 0) {
+				continue;
+			}
+			if (f >= nearness_shortcut) {
+				// Older ones in the cell can't beat this one
+				if (!shortcut_suspect || i->seq > shortcut_suspect->seq) {
+					shortcut_suspect = &*i;
+				}
+				break;
+			}
+			if (f > likely_suspect_nearness ||
+					(f == likely_suspect_nearness &&
+					i->seq > likely_suspect->seq)) {
+				likely_suspect_nearness = f;
+				likely_suspect = &*i;
+			}
 		}
 	}
+	if (shortcut_suspect) {
+		return shortcut_suspect->actor;
+	}
 	// No likely suspect was found
-	if (likely_suspect_nearness == 0) {
+	if (!likely_suspect) {
 		return "";
 	}
 	// Likely suspect was found
-	return likely_suspect.actor;
+	return likely_suspect->actor;
 }
 
 
 void RollbackManager::flush()
 {
-	sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+	write_thread->m_queue_sem.Post();
+}
 
-	std::list<RollbackAction>::const_iterator iter;
 
-	for (iter  = action_todisk_buffer.begin();
-			iter != action_todisk_buffer.end();
-			iter++) {
-		if (iter->actor == "") {
-			continue;
+void RollbackManager::writeQueuedActions()
+{
+	// Taking the queue only with the database locked keeps the batches
+	// in order
+	JMutexAutoLock db_lock(db_mutex);
+
+	std::list<RollbackAction> actions;
+	{
+		JMutexAutoLock queue_lock(queue_mutex);
+		actions.swap(action_todisk_buffer);
+	}
+	if (actions.empty()) {
+		return;
+	}
+
+	try {
+		SQLOK(sqlite3_exec(db, "BEGIN", NULL, NULL, NULL));
+
+		std::list<RollbackAction>::const_iterator iter;
+
+		for (iter  = actions.begin();
+				iter != actions.end();
+				iter++) {
+			if (iter->actor == "") {
+				continue;
+			}
+
+			registerRow(actionRowFromRollbackAction(*iter));
 		}
 
-		registerRow(actionRowFromRollbackAction(*iter));
+		SQLOK(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL));
+	} catch (FileNotGoodException &e) {
+		errorstream << "RollbackManager: Failed to write "
+			<< actions.size() << " actions: " << e.what() << std::endl;
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+	}
+}
+
+
+static u64 get_actions_memory_usage(const std::list<RollbackAction> &actions)
+{
+	u64 size = 0;
+	for (std::list<RollbackAction>::const_iterator i = actions.begin();
+			i != actions.end(); ++i) {
+		size += sizeof(RollbackAction) + i->actor.size() +
+			i->n_old.name.size() + i->n_old.meta.size() +
+			i->n_new.name.size() + i->n_new.meta.size() +
+			i->inventory_location.size() + i->inventory_list.size() +
+			i->inventory_stack.name.size() + i->inventory_stack.metadata.size();
 	}
+	return size;
+}
+
 
-	sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
-	action_todisk_buffer.clear();
+u64 RollbackManager::getBufferMemoryUsage()
+{
+	u64 size = 0;
+	for (std::map<v3s16, std::deque<SuspectAction> >::const_iterator
+			i = suspect_cells.begin(); i != suspect_cells.end(); ++i) {
+		for (std::deque<SuspectAction>::const_iterator
+				j = i->second.begin(); j != i->second.end(); ++j) {
+			size += sizeof(SuspectAction) + sizeof(v3s16) + j->actor.size();
+		}
+	}
+	JMutexAutoLock lock(queue_mutex);
+	return size + get_actions_memory_usage(action_todisk_buffer);
 }
 
 
 void RollbackManager::addAction(const RollbackAction & action)
 {
-	action_todisk_buffer.push_back(action);
-	action_latest_buffer.push_back(action);
+	size_t queued;
+	{
+		JMutexAutoLock lock(queue_mutex);
+		action_todisk_buffer.push_back(action);
+		queued = action_todisk_buffer.size();
+	}
+
+	// Only actions with an actor and a position can make suspects
+	SuspectAction suspect;
+	if (!action.actor.empty() && action.getPosition(&suspect.p)) {
+		suspect.unix_time = action.unix_time;
+		suspect.actor_is_guess = action.actor_is_guess;
+		suspect.actor = action.actor;
+		suspect.seq = suspect_seq++;
+		v3s16 cell = getContainerPos(suspect.p, ROLLBACK_SUSPECT_CELL_SIZE);
+		suspect_cells[cell].push_back(suspect);
+		suspect_cell_order.push_back(cell);
+	}
+	while (!suspect_cell_order.empty()) {
+		std::map<v3s16, std::deque<SuspectAction> >::iterator
+			n = suspect_cells.find(suspect_cell_order.front());
+		if (action.unix_time - n->second.front().unix_time <=
+				ROLLBACK_LATEST_BUFFER_SECONDS) {
+			break;
+		}
+		n->second.pop_front();
+		if (n->second.empty()) {
+			suspect_cells.erase(n);
+		}
+		suspect_cell_order.pop_front();
+	}
 
-	// Flush to disk sometimes
-	if (action_todisk_buffer.size() >= 500) {
+	// Write to disk sometimes
+	if (queued == ROLLBACK_WRITE_BATCH_SIZE) {
 		flush();
 	}
 }
 
 std::list<RollbackAction> RollbackManager::getEntriesSince(time_t first_time)
 {
-	flush();
+	writeQueuedActions();
 	return getActionsSince(first_time);
 }
 
@@ -943,7 +1271,7 @@ std::list<RollbackAction> RollbackManager::getRevertActions(
 	time_t cur_time = time(0);
 	time_t first_time = cur_time - seconds;
 
-	flush();
+	writeQueuedActions();
 
 	return getActionsSince(first_time, actor_filter);
 }
@@ -24,13 +24,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irr_v3d.h"
 #include "rollback_interface.h"
 #include <list>
+#include <map>
+#include <deque>
 #include <vector>
+#include <ctime>
 #include "sqlite3.h"
+#include "jthread/jmutex.h"
 
 class IGameDef;
 
 class ActionRow;
-class Entity;
+class RollbackWriteThread;
 
 class RollbackManager: public IRollbackManager
 {
@@ -44,6 +48,7 @@ class RollbackManager: public IRollbackManager
 	void setActor(const std::string & actor, bool is_guess);
 	std::string getSuspect(v3s16 p, float nearness_shortcut,
 			float min_nearness);
+	// Wakes up the writer thread; doesn't wait for the write
 	void flush();
 
 	void addAction(const RollbackAction & action);
@@ -52,8 +57,18 @@ class RollbackManager: public IRollbackManager
 			time_t seconds, int limit);
 	std::list<RollbackAction> getRevertActions(
 			const std::string & actor_filter, time_t seconds);
+	u64 getBufferMemoryUsage();
 
 private:
+	friend class RollbackWriteThread;
+
+	// Writes everything in action_todisk_buffer in one transaction.
+	// Callable from any thread; the actions are written in order.
+	void writeQueuedActions();
+	// Deletes a chunk of actions older than older_than. Returns false
+	// once there are none left.
+	bool pruneActions(time_t older_than);
+
 	void registerNewActor(const int id, const std::string & name);
 	void registerNewNode(const int id, const std::string & name);
 	int getActorId(const std::string & name);
@@ -61,6 +76,8 @@ class RollbackManager: public IRollbackManager
 	const char * getActorName(const int id);
 	const char * getNodeName(const int id);
 	bool createTables();
+	// Adds and fills the `block` column of databases that lack it
+	void addBlockColumn();
 	void initDatabase();
 	bool registerRow(const ActionRow & row);
 	const std::list<ActionRow> actionRowsFromSelect(sqlite3_stmt * stmt);
@@ -85,8 +102,31 @@ class RollbackManager: public IRollbackManager
 	std::string current_actor;
 	bool current_actor_is_guess;
 
+	// Filled by the server thread in reportAction() and swapped out by
+	// writeQueuedActions(), usually in the writer thread; both only under
+	// queue_mutex
 	std::list<RollbackAction> action_todisk_buffer;
-	std::list<RollbackAction> action_latest_buffer;
+	JMutex queue_mutex;
+	// A recent action whose actor can be the suspect of a later one
+	struct SuspectAction
+	{
+		v3s16 p;
+		time_t unix_time;
+		bool actor_is_guess;
+		std::string actor;
+		// Tells which of two actions is newer
+		u32 seq;
+	};
+	// Recent actions for getSuspect(), in cells of nodes so that only the
+	// ones near enough to matter are looked at; older ones are dropped
+	std::map<v3s16, std::deque<SuspectAction> > suspect_cells;
+	// The cell of every action in suspect_cells, oldest first
+	std::deque<v3s16> suspect_cell_order;
+	u32 suspect_seq;
+
+	RollbackWriteThread * write_thread;
+	// Protects the database, its statements and the id caches below
+	JMutex db_mutex;
 
 	std::string database_path;
 	sqlite3 * db;
@@ -94,14 +134,19 @@ class RollbackManager: public IRollbackManager
 	sqlite3_stmt * stmt_replace;
 	sqlite3_stmt * stmt_select;
 	sqlite3_stmt * stmt_select_range;
+	sqlite3_stmt * stmt_select_range_block;
+	sqlite3_stmt * stmt_prune;
 	sqlite3_stmt * stmt_select_withActor;
 	sqlite3_stmt * stmt_knownActor_select;
 	sqlite3_stmt * stmt_knownActor_insert;
 	sqlite3_stmt * stmt_knownNode_select;
 	sqlite3_stmt * stmt_knownNode_insert;
 
-	std::vector<Entity> knownActors;
-	std::vector<Entity> knownNodes;
+	// Both ways, so that neither lookup has to scan or hit the database
+	std::map<std::string, int> knownActorIds;
+	std::map<int, std::string> knownActorNames;
+	std::map<std::string, int> knownNodeIds;
+	std::map<int, std::string> knownNodeNames;
 };
 
 #endif
@@ -135,6 +135,8 @@ class IRollbackManager
 	// Get actions to revert <seconds> of history made by <actor>
 	virtual std::list<RollbackAction> getRevertActions(const std::string &actor,
 	                time_t seconds) = 0;
+	// Estimate of the bytes taken by the actions kept in memory
+	virtual u64 getBufferMemoryUsage() = 0;
 };
 
 
@@ -567,10 +567,40 @@ MapNode readnode(lua_State *L, int index, INodeDefManager *ndef)
 }
 
 /******************************************************************************/
+// Key of the registry table with the name string of each content id
+static char node_name_cache_key;
+
+void push_content_name(lua_State *L, content_t c, INodeDefManager *ndef)
+{
+	lua_pushlightuserdata(L, &node_name_cache_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushlightuserdata(L, &node_name_cache_key);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, -1, c);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		const ContentFeatures &f = ndef->get(c);
+		lua_pushlstring(L, f.name.c_str(), f.name.size());
+		// An id that isn't registered yet may still be, so it isn't cached;
+		// ids below the last registered one can be unnamed too
+		if (!f.name.empty() &&
+				(&f != &ndef->get(CONTENT_UNKNOWN) || c == CONTENT_UNKNOWN)) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, -3, c);
+		}
+	}
+	lua_remove(L, -2);
+}
+
 void pushnode(lua_State *L, const MapNode &n, INodeDefManager *ndef)
 {
-	lua_newtable(L);
-	lua_pushstring(L, ndef->get(n).name.c_str());
+	lua_createtable(L, 0, 3);
+	push_content_name(L, n.getContent(), ndef);
 	lua_setfield(L, -2, "name");
 	lua_pushnumber(L, n.getParam1());
 	lua_setfield(L, -2, "param1");
@@ -618,6 +648,99 @@ bool string_to_enum(const EnumString *spec, int &result,
 }
 
 /******************************************************************************/
+/*
+	Item names as written by the mods, like "default:cobble" or an alias
+	of it, with the name of their definition. Cleared when items or
+	aliases are registered.
+*/
+struct ItemNameCacheEntry
+{
+	std::string name;
+	bool is_tool;
+};
+static IItemDefManager *item_name_cache_idef = NULL;
+static std::map<std::string, ItemNameCacheEntry> item_name_cache;
+
+void clear_item_name_cache()
+{
+	item_name_cache.clear();
+}
+
+static const ItemNameCacheEntry &resolve_item_name(const std::string &name,
+		IItemDefManager *idef)
+{
+	// Names that aren't items are cached too; don't let them pile up
+	if (idef != item_name_cache_idef || item_name_cache.size() >= 10000) {
+		item_name_cache.clear();
+		item_name_cache_idef = idef;
+	}
+	std::map<std::string, ItemNameCacheEntry>::iterator i =
+			item_name_cache.find(name);
+	if (i != item_name_cache.end())
+		return i->second;
+	ItemNameCacheEntry &entry = item_name_cache[name];
+	entry.name = idef->getAlias(name);
+	entry.is_tool = idef->get(entry.name).type == ITEM_TOOL;
+	return entry;
+}
+
+// Same as the ItemStack constructor, with the cached name
+static void make_item(ItemStack &item, const std::string &name,
+		u16 count, u16 wear, const std::string &metadata,
+		IItemDefManager *idef)
+{
+	const ItemNameCacheEntry &entry = resolve_item_name(name, idef);
+	item.name = entry.name;
+	item.count = count;
+	item.wear = wear;
+	item.metadata = metadata;
+	if (item.name.empty() || item.count == 0)
+		item.clear();
+	else if (entry.is_tool)
+		item.count = 1;
+}
+
+/*
+	Reads the usual "modname:name[ count[ wear]]" without a stream. Returns
+	false for anything else, like strings with metadata or JSON and the
+	obsolete formats, which are left to ItemStack::deSerialize().
+*/
+static bool read_simple_itemstring(const char *str, size_t len,
+		IItemDefManager *idef, ItemStack &item)
+{
+	const char *end = str + len;
+	const char *p = str;
+	bool has_modname = false;
+	for (; p != end && *p != ' '; p++) {
+		if (*p == '"')
+			return false;
+		if (*p == ':')
+			has_modname = true;
+	}
+	if (!has_modname)
+		return false;
+	std::string name(str, p);
+
+	u32 values[2] = {1, 0};
+	for (u32 i = 0; i < 2 && p != end; i++) {
+		const char *start = ++p; // Skip the space
+		u32 value = 0;
+		for (; p != end && *p >= '0' && *p <= '9'; p++) {
+			value = value * 10 + (*p - '0');
+			if (value > 65535)
+				return false;
+		}
+		if (p == start || (p != end && *p != ' '))
+			return false;
+		values[i] = value;
+	}
+	if (p != end)
+		return false;
+
+	make_item(item, name, values[0], values[1], "", idef);
+	return true;
+}
+
 ItemStack read_item(lua_State* L, int index,Server* srv)
 {
 	if(index < 0)
@@ -636,11 +759,15 @@ ItemStack read_item(lua_State* L, int index,Server* srv)
 	else if(lua_isstring(L, index))
 	{
 		// Convert from itemstring
-		std::string itemstring = lua_tostring(L, index);
+		size_t len;
+		const char *str = lua_tolstring(L, index, &len);
 		IItemDefManager *idef = srv->idef();
+		ItemStack item;
+		if (read_simple_itemstring(str, len, idef, item))
+			return item;
+		std::string itemstring(str, len);
 		try
 		{
-			ItemStack item;
 			item.deSerialize(itemstring, idef);
 			return item;
 		}
@@ -659,7 +786,9 @@ ItemStack read_item(lua_State* L, int index,Server* srv)
 		int count = getintfield_default(L, index, "count", 1);
 		int wear = getintfield_default(L, index, "wear", 0);
 		std::string metadata = getstringfield_default(L, index, "metadata", "");
-		return ItemStack(name, count, wear, metadata, idef);
+		ItemStack item;
+		make_item(item, name, count, wear, metadata, idef);
+		return item;
 	}
 	else
 	{
@@ -716,7 +845,8 @@ void push_tool_capabilities(lua_State *L,
 }
 
 /******************************************************************************/
-void push_inventory_list(lua_State *L, Inventory *inv, const char *name)
+void push_inventory_list(lua_State *L, Inventory *inv, const char *name,
+		int reuse_table)
 {
 	InventoryList *invlist = inv->getList(name);
 	if(invlist == NULL){
@@ -724,9 +854,10 @@ void push_inventory_list(lua_State *L, Inventory *inv, const char *name)
 		return;
 	}
 	std::vector<ItemStack> items;
+	items.reserve(invlist->getSize());
 	for(u32 i=0; i<invlist->getSize(); i++)
 		items.push_back(invlist->getItem(i));
-	push_items(L, items);
+	push_items(L, items, reuse_table);
 }
 
 /******************************************************************************/
@@ -927,14 +1058,43 @@ void read_groups(lua_State *L, int index,
 }
 
 /******************************************************************************/
-void push_items(lua_State *L, const std::vector<ItemStack> &items)
+void push_items(lua_State *L, const std::vector<ItemStack> &items,
+		int reuse_table)
 {
-	// Create and fill table
-	lua_createtable(L, items.size(), 0);
-	std::vector<ItemStack>::const_iterator iter = items.begin();
-	for (u32 i = 0; iter != items.end(); iter++) {
-		LuaItemStack::create(L, *iter);
-		lua_rawseti(L, -2, ++i);
+	if (reuse_table == 0) {
+		// Create and fill table
+		lua_createtable(L, items.size(), 0);
+		std::vector<ItemStack>::const_iterator iter = items.begin();
+		for (u32 i = 0; iter != items.end(); iter++) {
+			LuaItemStack::create(L, *iter);
+			lua_rawseti(L, -2, ++i);
+		}
+		return;
+	}
+
+	if (reuse_table < 0)
+		reuse_table = lua_gettop(L) + 1 + reuse_table;
+	lua_pushvalue(L, reuse_table);
+	for (u32 i = 0; i < items.size(); i++) {
+		lua_rawgeti(L, -1, i + 1);
+		LuaItemStack *o = LuaItemStack::testobject(L, -1);
+		lua_pop(L, 1);
+		if (o) {
+			o->getItem() = items[i];
+		} else {
+			LuaItemStack::create(L, items[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+	}
+	// Cut off what is left of a longer list
+	for (u32 i = items.size() + 1; ; i++) {
+		lua_rawgeti(L, -1, i);
+		bool end = lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if (end)
+			break;
+		lua_pushnil(L);
+		lua_rawseti(L, -2, i);
 	}
 }
 
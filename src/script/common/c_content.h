@@ -75,6 +75,9 @@ void          push_dig_params           (lua_State *L,const DigParams &params);
 void          push_hit_params           (lua_State *L,const HitParams &params);
 
 ItemStack     read_item                 (lua_State *L, int index, Server* srv);
+// read_item() caches the definitions of the item names; call when items
+// or aliases are registered
+void          clear_item_name_cache     ();
 
 
 ToolCapabilities   read_tool_capabilities    (lua_State *L,
@@ -89,9 +92,12 @@ void               read_object_properties    (lua_State *L,
                                               int index,
                                               ObjectProperties *prop);
 
+// With reuse_table, the list is written to the table at that index, as by
+// push_items(), and the table is pushed
 void               push_inventory_list       (lua_State *L,
                                               Inventory *inv,
-                                              const char *name);
+                                              const char *name,
+                                              int reuse_table=0);
 void               read_inventory_list       (lua_State *L,
                                               int tableindex,
                                               Inventory *inv,
@@ -105,6 +111,10 @@ MapNode            readnode                  (lua_State *L,
 void               pushnode                  (lua_State *L,
                                               const MapNode &n,
                                               INodeDefManager *ndef);
+// The name strings are cached in the registry by content id
+void               push_content_name         (lua_State *L,
+                                              u16 content,
+                                              INodeDefManager *ndef);
 
 NodeBox            read_nodebox              (lua_State *L, int index);
 
@@ -131,8 +141,12 @@ bool               read_flags                (lua_State *L, int index,
 u32                read_flags_table          (lua_State *L, int table,
                                               FlagDesc *flagdesc, u32 *flagmask);
 
+// With reuse_table, the ItemStacks in the table at that index are set
+// to the items instead of making new ones, the table is cut to the
+// length of the list and pushed again
 void               push_items                (lua_State *L,
-                                              const std::vector<ItemStack> &items);
+                                              const std::vector<ItemStack> &items,
+                                              int reuse_table=0);
 
 std::vector<ItemStack> read_items            (lua_State *L,
                                               int index,
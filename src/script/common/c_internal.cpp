@@ -79,41 +79,6 @@ void script_error(lua_State *L)
 	throw LuaError(str);
 }
 
-// Push the list of callbacks (a lua table).
-// Then push nargs arguments.
-// Then call this function, which
-// - runs the callbacks
-// - replaces the table and arguments with the return value,
-//     computed depending on mode
-void script_run_callbacks(lua_State *L, int nargs, RunCallbacksMode mode)
-{
-	assert(lua_gettop(L) >= nargs + 1);
-
-	// Insert error handler
-	lua_pushcfunction(L, script_error_handler);
-	int errorhandler = lua_gettop(L) - nargs - 1;
-	lua_insert(L, errorhandler);
-
-	// Insert run_callbacks between error handler and table
-	lua_getglobal(L, "core");
-	lua_getfield(L, -1, "run_callbacks");
-	lua_remove(L, -2);
-	lua_insert(L, errorhandler + 1);
-
-	// Insert mode after table
-	lua_pushnumber(L, (int) mode);
-	lua_insert(L, errorhandler + 3);
-
-	// Stack now looks like this:
-	// ... <error handler> <run_callbacks> <table> <mode> <arg#1> <arg#2> ... <arg#n>
-
-	if (lua_pcall(L, nargs + 2, 1, errorhandler)) {
-		script_error(L);
-	}
-
-	lua_remove(L, -2); // Remove error handler
-}
-
 void log_deprecated(lua_State *L, std::string message)
 {
 	static bool configured = false;
@@ -34,7 +34,7 @@ extern "C" {
 
 #include "common/c_types.h"
 
-// What script_run_callbacks does with the return values of callbacks.
+// What ScriptApiBase::runCallbacks does with the return values of callbacks.
 // Regardless of the mode, if only one callback is defined,
 // its return value is the total return value.
 // Modes only affect the case where 0 or >= 2 callbacks are defined.
@@ -68,7 +68,6 @@ std::string script_get_backtrace(lua_State *L);
 int script_error_handler(lua_State *L);
 int script_exception_wrapper(lua_State *L, lua_CFunction f);
 void script_error(lua_State *L);
-void script_run_callbacks(lua_State *L, int nargs, RunCallbacksMode mode);
 void log_deprecated(lua_State *L, std::string message);
 
 #endif /* C_INTERNAL_H_ */
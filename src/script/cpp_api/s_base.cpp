@@ -26,7 +26,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "log.h"
 #include "mods.h"
 #include "porting.h"
+#include "settings.h"
+#include "main.h" // for g_settings
+#include "sha1.h"
+#include "hex.h"
 #include "util/string.h"
+#include "common/c_converter.h"
 
 
 extern "C" {
@@ -38,6 +43,8 @@ extern "C" {
 
 #include <stdio.h>
 #include <cstdarg>
+#include <fstream>
+#include <iterator>
 
 
 class ModNameStorer
@@ -61,6 +68,95 @@ class ModNameStorer
 };
 
 
+/*
+	Bytecode cache
+
+	With script_bytecode_cache, scripts are compiled once and kept in
+	cache/lua_bytecode under the SHA1 of the Lua version, the script's path
+	and its source, so that a changed script is always compiled again.
+*/
+
+static std::string getBytecodeCachePath()
+{
+	return porting::path_user + DIR_DELIM + "cache" + DIR_DELIM
+			+ "lua_bytecode";
+}
+
+static int bytecode_writer(lua_State *L, const void *p, size_t size, void *ud)
+{
+	((std::string *)ud)->append((const char *)p, size);
+	return 0;
+}
+
+// Leaves the script as a function on the stack, or an error message, like
+// luaL_loadfile()
+static int script_load_file(lua_State *L, const std::string &path)
+{
+	if (!g_settings->getBool("script_bytecode_cache"))
+		return luaL_loadfile(L, path.c_str());
+
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if (!is.good()) {
+		lua_pushfstring(L, "cannot open %s", path.c_str());
+		return LUA_ERRFILE;
+	}
+	std::string source((std::istreambuf_iterator<char>(is)),
+			std::istreambuf_iterator<char>());
+	// Skip a first line starting with # like luaL_loadfile(), keeping
+	// the line numbers
+	if (!source.empty() && source[0] == '#')
+		source.erase(0, source.find('\n') == std::string::npos ?
+				source.size() : source.find('\n'));
+	std::string chunkname = "@" + path;
+
+	SHA1 sha1;
+#if USE_LUAJIT
+	std::string version = LUAJIT_VERSION;
+#else
+	std::string version = LUA_RELEASE;
+#endif
+	version += " " + itos(sizeof(void *));
+	sha1.addBytes(version.c_str(), version.size() + 1);
+	sha1.addBytes(chunkname.c_str(), chunkname.size() + 1);
+	sha1.addBytes(source.c_str(), source.size());
+	unsigned char *digest = sha1.getDigest();
+	std::string cache_path = getBytecodeCachePath() + DIR_DELIM
+			+ hex_encode((char *)digest, 20);
+	free(digest);
+
+	std::ifstream cached(cache_path.c_str(), std::ios_base::binary);
+	if (cached.good()) {
+		std::string bytecode((std::istreambuf_iterator<char>(cached)),
+				std::istreambuf_iterator<char>());
+		if (luaL_loadbuffer(L, bytecode.c_str(), bytecode.size(),
+				chunkname.c_str()) == 0)
+			return 0;
+		// Broken; compiled and written again below
+		lua_pop(L, 1);
+	}
+
+	int ret = luaL_loadbuffer(L, source.c_str(), source.size(),
+			chunkname.c_str());
+	if (ret != 0)
+		return ret;
+	std::string bytecode;
+	if (lua_dump(L, bytecode_writer, &bytecode) == 0 &&
+			fs::CreateAllDirs(getBytecodeCachePath()))
+		fs::safeWriteToFile(cache_path, bytecode);
+	return 0;
+}
+
+// dofile() going through the bytecode cache
+static int script_dofile(lua_State *L)
+{
+	std::string path = luaL_checkstring(L, 1);
+	int top = lua_gettop(L);
+	if (script_load_file(L, path) != 0)
+		return lua_error(L);
+	lua_call(L, 0, LUA_MULTRET);
+	return lua_gettop(L) - top;
+}
+
 /*
 	ScriptApiBase
 */
@@ -102,6 +198,11 @@ ScriptApiBase::ScriptApiBase()
 	lua_pushstring(m_luastack, porting::getPlatformName());
 	lua_setglobal(m_luastack, "PLATFORM");
 
+	if (g_settings->getBool("script_bytecode_cache")) {
+		lua_pushcfunction(m_luastack, script_dofile);
+		lua_setglobal(m_luastack, "dofile");
+	}
+
 	m_server = NULL;
 	m_environment = NULL;
 	m_guiengine = NULL;
@@ -133,7 +234,8 @@ bool ScriptApiBase::loadScript(const std::string &scriptpath)
 
 	lua_State *L = getStack();
 
-	int ret = luaL_loadfile(L, scriptpath.c_str()) || lua_pcall(L, 0, 0, m_errorhandler);
+	int ret = script_load_file(L, scriptpath) ||
+			lua_pcall(L, 0, 0, m_errorhandler);
 	if (ret) {
 		errorstream << "========== ERROR FROM LUA ===========" << std::endl;
 		errorstream << "Failed to load and run script from " << std::endl;
@@ -196,6 +298,107 @@ void ScriptApiBase::stackDump(std::ostream &o)
 	o<<std::endl;
 }
 
+void ScriptApiBase::getCallbackOrigin(int origins, const char *callback,
+		std::string &mod, std::string &name)
+{
+	lua_State *L = getStack();
+
+	mod = "??";
+	name = callback;
+	if (lua_istable(L, origins)) {
+		lua_pushvalue(L, -1);
+		lua_rawget(L, origins);
+		if (lua_istable(L, -1)) {
+			getstringfield(L, -1, "mod", mod);
+			std::string source;
+			if (getstringfield(L, -1, "source", source))
+				name += " (" + source + ")";
+		}
+		lua_pop(L, 1);
+	}
+}
+
+void ScriptApiBase::runCallbacks(int nargs, RunCallbacksMode mode,
+		const char *callback)
+{
+	lua_State *L = getStack();
+	assert(lua_gettop(L) >= nargs + 1);
+
+	int table = lua_gettop(L) - nargs;
+	luaL_checktype(L, table, LUA_TTABLE);
+	int cb_len = lua_objlen(L, table);
+
+	// The mods and sources of the callbacks, recorded by builtin when
+	// they are registered
+	lua_getglobal(L, "core");
+	lua_getfield(L, -1, "callback_origins");
+	lua_remove(L, -2);
+	int origins = lua_gettop(L);
+
+	// Return value if there are no callbacks
+	if (cb_len == 0 && (mode == RUN_CALLBACKS_MODE_AND ||
+			mode == RUN_CALLBACKS_MODE_AND_SC))
+		lua_pushboolean(L, true);
+	else if (cb_len == 0 && (mode == RUN_CALLBACKS_MODE_OR ||
+			mode == RUN_CALLBACKS_MODE_OR_SC))
+		lua_pushboolean(L, false);
+	else
+		lua_pushnil(L);
+	int ret = lua_gettop(L);
+
+	for (int i = 1; i <= cb_len; i++) {
+		lua_rawgeti(L, table, i);
+
+		std::string mod, name;
+		getCallbackOrigin(origins, callback, mod, name);
+
+		for (int j = 1; j <= nargs; j++)
+			lua_pushvalue(L, table + j);
+		{
+			ScriptCallbackTimer timer(&m_callback_stats, mod, name);
+			if (lua_pcall(L, nargs, 1, m_errorhandler))
+				scriptError();
+		}
+
+		// The return value of the callback is at the top
+		bool cb_ret = lua_toboolean(L, -1);
+		bool use = false;
+		bool stop = false;
+		switch (mode) {
+		case RUN_CALLBACKS_MODE_FIRST:
+			use = (i == 1);
+			break;
+		case RUN_CALLBACKS_MODE_LAST:
+			use = (i == cb_len);
+			break;
+		case RUN_CALLBACKS_MODE_AND:
+			use = (!cb_ret || i == 1);
+			break;
+		case RUN_CALLBACKS_MODE_AND_SC:
+			use = (!cb_ret || i == 1);
+			stop = !cb_ret;
+			break;
+		case RUN_CALLBACKS_MODE_OR:
+			use = ((cb_ret && !lua_toboolean(L, ret)) || i == 1);
+			break;
+		case RUN_CALLBACKS_MODE_OR_SC:
+			use = (cb_ret || i == 1);
+			stop = cb_ret;
+			break;
+		}
+		if (use)
+			lua_replace(L, ret);
+		else
+			lua_pop(L, 1);
+		if (stop)
+			break;
+	}
+
+	// Replace the table and the arguments with the return value
+	lua_replace(L, table);
+	lua_settop(L, table);
+}
+
 void ScriptApiBase::addObjectReference(ServerActiveObject *cobj)
 {
 	SCRIPTAPI_PRECHECKHEADER
@@ -264,3 +467,54 @@ void ScriptApiBase::objectrefGet(lua_State *L, u16 id)
 	lua_remove(L, -2); // core
 }
 
+
+/*
+	ScriptCallbackStats
+*/
+
+void ScriptCallbackStats::record(const std::string &mod,
+		const std::string &callback, u32 time_us)
+{
+	JMutexAutoLock lock(m_mutex);
+	Entry &entry = m_entries[mod][callback];
+	entry.count++;
+	entry.time_us += time_us;
+}
+
+void ScriptCallbackStats::get(Entries &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+	dst = m_entries;
+}
+
+void ScriptCallbackStats::clear()
+{
+	JMutexAutoLock lock(m_mutex);
+	m_entries.clear();
+}
+
+std::string ScriptCallbackStats::getItemMod(const std::string &name)
+{
+	size_t pos = name.find(':');
+	if (pos == std::string::npos || pos == 0)
+		return "__builtin";
+	return name.substr(0, pos);
+}
+
+/*
+	ScriptCallbackTimer
+*/
+
+ScriptCallbackTimer::ScriptCallbackTimer(ScriptCallbackStats *stats,
+		const std::string &mod, const std::string &callback):
+	m_stats(stats),
+	m_mod(mod),
+	m_callback(callback),
+	m_start_us(porting::getTimeUs())
+{
+}
+
+ScriptCallbackTimer::~ScriptCallbackTimer()
+{
+	m_stats->record(m_mod, m_callback, porting::getTimeUs() - m_start_us);
+}
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <iostream>
 #include <string>
+#include <map>
 
 extern "C" {
 #include <lua.h>
@@ -40,6 +41,37 @@ class Environment;
 class GUIEngine;
 class ServerActiveObject;
 
+/*
+	Call counts and time spent in the callbacks of the mods, per mod and
+	callback.  A callback is named by what calls it and by the item or
+	the source of the function, like "on_step mobs:dog" or
+	"globalstep (mods/mobs/init.lua:42)".
+*/
+class ScriptCallbackStats
+{
+public:
+	struct Entry
+	{
+		Entry(): count(0), time_us(0) {}
+		u32 count;
+		u64 time_us;
+	};
+	// mod -> callback -> entry
+	typedef std::map<std::string, std::map<std::string, Entry> > Entries;
+
+	void record(const std::string &mod, const std::string &callback,
+			u32 time_us);
+	void get(Entries &dst);
+	void clear();
+
+	// The mod part of an item or entity name like "default:stone"
+	static std::string getItemMod(const std::string &name);
+
+private:
+	JMutex m_mutex;
+	Entries m_entries;
+};
+
 class ScriptApiBase {
 public:
 
@@ -53,6 +85,9 @@ class ScriptApiBase {
 	void addObjectReference(ServerActiveObject *cobj);
 	void removeObjectReference(ServerActiveObject *cobj);
 
+	ScriptCallbackStats *getCallbackStats()
+		{ return &m_callback_stats; }
+
 protected:
 	friend class LuaABM;
 	friend class InvRef;
@@ -69,6 +104,19 @@ class ScriptApiBase {
 	void scriptError();
 	void stackDump(std::ostream &o);
 
+	// Push the list of callbacks (a lua table).
+	// Then push nargs arguments.
+	// Then call this function, which
+	// - runs the callbacks, recording their time under the name callback
+	// - replaces the table and arguments with the return value,
+	//     computed depending on mode
+	void runCallbacks(int nargs, RunCallbacksMode mode,
+			const char *callback);
+	// The mod and the name for the callback statistics of the function at
+	// the top of the stack, from core.callback_origins at index origins
+	void getCallbackOrigin(int origins, const char *callback,
+			std::string &mod, std::string &name);
+
 	Server* getServer() { return m_server; }
 	void setServer(Server* server) { m_server = server; }
 
@@ -94,6 +142,23 @@ class ScriptApiBase {
 	Server*         m_server;
 	Environment*    m_environment;
 	GUIEngine*      m_guiengine;
+
+	ScriptCallbackStats m_callback_stats;
+};
+
+// Records the time it exists for in stats
+class ScriptCallbackTimer
+{
+public:
+	ScriptCallbackTimer(ScriptCallbackStats *stats, const std::string &mod,
+			const std::string &callback);
+	~ScriptCallbackTimer();
+
+private:
+	ScriptCallbackStats *m_stats;
+	std::string m_mod;
+	std::string m_callback;
+	u32 m_start_us;
 };
 
 #endif /* S_BASE_H_ */
@@ -24,6 +24,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/c_converter.h"
 #include "common/c_content.h"
 
+// Name of the entity at index object, for the callback statistics
+static std::string get_luaentity_name(lua_State *L, int object)
+{
+	std::string name = "??";
+	getstringfield(L, object, "name", name);
+	return name;
+}
+
 bool ScriptApiEntity::luaentity_Add(u16 id, const char *name)
 {
 	SCRIPTAPI_PRECHECKHEADER
@@ -91,6 +99,9 @@ void ScriptApiEntity::luaentity_Activate(u16 id,
 		lua_pushvalue(L, object); // self
 		lua_pushlstring(L, staticdata.c_str(), staticdata.size());
 		lua_pushinteger(L, dtime_s);
+		std::string name = get_luaentity_name(L, object);
+		ScriptCallbackTimer timer(getCallbackStats(),
+				ScriptCallbackStats::getItemMod(name), "on_activate " + name);
 		// Call with 3 arguments, 0 results
 		if (lua_pcall(L, 3, 0, m_errorhandler))
 			scriptError();
@@ -190,29 +201,55 @@ void ScriptApiEntity::luaentity_GetProperties(u16 id,
 	lua_pop(L, 1);
 }
 
-void ScriptApiEntity::luaentity_Step(u16 id, float dtime)
+void ScriptApiEntity::luaentity_StepBatch(const std::string &name,
+		const std::vector<u16> &ids, const std::vector<float> &dtimes,
+		std::vector<bool> &has_on_step)
 {
 	SCRIPTAPI_PRECHECKHEADER
 
-	//infostream<<"scriptapi_luaentity_step: id="<<id<<std::endl;
+	// The loop is in Lua so that there is one call for all of them
+	lua_getglobal(L, "core");
+	lua_getfield(L, -1, "luaentity_step_batch");
+	luaL_checktype(L, -1, LUA_TFUNCTION);
+	lua_createtable(L, ids.size(), 0);
+	for (u32 i = 0; i < ids.size(); i++) {
+		lua_pushinteger(L, ids[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_createtable(L, dtimes.size(), 0);
+	for (u32 i = 0; i < dtimes.size(); i++) {
+		lua_pushnumber(L, dtimes[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	{
+		ScriptCallbackTimer timer(getCallbackStats(),
+				ScriptCallbackStats::getItemMod(name), "on_step " + name);
+		// Call with 2 arguments, 1 result
+		if (lua_pcall(L, 2, 1, m_errorhandler))
+			scriptError();
+	}
+
+	// The result has true for the entities without on_step
+	has_on_step.resize(ids.size());
+	for (u32 i = 0; i < ids.size(); i++) {
+		lua_rawgeti(L, -1, i + 1);
+		has_on_step[i] = !lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2); // Pop result and core
+}
+
+float ScriptApiEntity::luaentity_GetIdleStepInterval(u16 id)
+{
+	SCRIPTAPI_PRECHECKHEADER
 
 	// Get core.luaentities[id]
 	luaentity_get(L, id);
-	int object = lua_gettop(L);
-	// State: object is at top of stack
-	// Get step function
-	lua_getfield(L, -1, "on_step");
-	if (lua_isnil(L, -1)) {
-		lua_pop(L, 2); // Pop on_step and entity
-		return;
-	}
-	luaL_checktype(L, -1, LUA_TFUNCTION);
-	lua_pushvalue(L, object); // self
-	lua_pushnumber(L, dtime); // dtime
-	// Call with 2 arguments, 0 results
-	if (lua_pcall(L, 2, 0, m_errorhandler))
-		scriptError();
-	lua_pop(L, 1); // Pop object
+
+	float interval = 0;
+	getfloatfield(L, -1, "idle_step_interval", interval);
+	lua_pop(L, 1); // Pop entity
+	return interval;
 }
 
 // Calls entity:on_punch(ObjectRef puncher, time_from_last_punch,
@@ -241,6 +278,9 @@ void ScriptApiEntity::luaentity_Punch(u16 id,
 	lua_pushnumber(L, time_from_last_punch);
 	push_tool_capabilities(L, *toolcap);
 	push_v3f(L, dir);
+	std::string name = get_luaentity_name(L, object);
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "on_punch " + name);
 	// Call with 5 arguments, 0 results
 	if (lua_pcall(L, 5, 0, m_errorhandler))
 		scriptError();
@@ -268,6 +308,9 @@ void ScriptApiEntity::luaentity_Rightclick(u16 id,
 	luaL_checktype(L, -1, LUA_TFUNCTION);
 	lua_pushvalue(L, object); // self
 	objectrefGetOrCreate(L, clicker); // Clicker reference
+	std::string name = get_luaentity_name(L, object);
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "on_rightclick " + name);
 	// Call with 2 arguments, 0 results
 	if (lua_pcall(L, 2, 0, m_errorhandler))
 		scriptError();
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "cpp_api/s_base.h"
 #include "irr_v3d.h"
+#include <vector>
 
 struct ObjectProperties;
 struct ToolCapabilities;
@@ -37,7 +38,13 @@ class ScriptApiEntity
 	std::string luaentity_GetStaticdata(u16 id);
 	void luaentity_GetProperties(u16 id,
 			ObjectProperties *prop);
-	void luaentity_Step(u16 id, float dtime);
+	// Calls on_step of the entities of kind name with one call to Lua;
+	// has_on_step is false for those that have none
+	void luaentity_StepBatch(const std::string &name,
+			const std::vector<u16> &ids, const std::vector<float> &dtimes,
+			std::vector<bool> &has_on_step);
+	// idle_step_interval of the entity definition, 0 if not set
+	float luaentity_GetIdleStepInterval(u16 id);
 	void luaentity_Punch(u16 id,
 			ServerActiveObject *puncher, float time_from_last_punch,
 			const ToolCapabilities *toolcap, v3f dir);
@@ -24,7 +24,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "mapgen.h"
 #include "lua_api/l_env.h"
+#include "lua_api/l_vmanip.h"
+#include "map.h"
 #include "server.h"
+#include <cmath>
 
 void ScriptApiEnv::environment_OnGenerated(v3s16 minp, v3s16 maxp,
 		u32 blockseed)
@@ -38,7 +41,36 @@ void ScriptApiEnv::environment_OnGenerated(v3s16 minp, v3s16 maxp,
 	push_v3s16(L, minp);
 	push_v3s16(L, maxp);
 	lua_pushnumber(L, blockseed);
-	script_run_callbacks(L, 3, RUN_CALLBACKS_MODE_FIRST);
+	runCallbacks(3, RUN_CALLBACKS_MODE_FIRST, "on_generated");
+}
+
+bool ScriptApiEnv::environment_OnMapgenStage(ManualMapVoxelManipulator *vm,
+		v3s16 minp, v3s16 maxp, u32 blockseed)
+{
+	SCRIPTAPI_PRECHECKHEADER
+
+	lua_getglobal(L, "core");
+	lua_getfield(L, -1, "registered_mapgen_stages");
+	bool have_stages = lua_istable(L, -1) && lua_objlen(L, -1) != 0;
+	lua_pop(L, 2);
+	if (!have_stages)
+		return false;
+
+	// Call core.run_mapgen_stages(vm, emin, emax, minp, maxp, blockseed)
+	lua_getglobal(L, "core");
+	lua_getfield(L, -1, "run_mapgen_stages");
+	LuaVoxelManip *o = new LuaVoxelManip(vm, true);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, "VoxelManip");
+	lua_setmetatable(L, -2);
+	push_v3s16(L, vm->m_area.MinEdge);
+	push_v3s16(L, vm->m_area.MaxEdge);
+	push_v3s16(L, minp);
+	push_v3s16(L, maxp);
+	lua_pushnumber(L, blockseed);
+	if (lua_pcall(L, 6, 0, m_errorhandler))
+		scriptError();
+	return true;
 }
 
 void ScriptApiEnv::environment_Step(float dtime)
@@ -52,12 +84,69 @@ void ScriptApiEnv::environment_Step(float dtime)
 	// Call callbacks
 	lua_pushnumber(L, dtime);
 	try {
-		script_run_callbacks(L, 1, RUN_CALLBACKS_MODE_FIRST);
+		runCallbacks(1, RUN_CALLBACKS_MODE_FIRST, "globalstep");
+
+		lua_getglobal(L, "core");
+		lua_getfield(L, -1, "registered_interval_globalsteps");
+		if (lua_istable(L, -1))
+			stepIntervalGlobalsteps(L, lua_gettop(L), dtime);
 	} catch (LuaError &e) {
 		getServer()->setAsyncFatalError(e.what());
 	}
 }
 
+void ScriptApiEnv::stepIntervalGlobalsteps(lua_State *L, int table,
+		float dtime)
+{
+	// Pick up the ones registered since the last step. Those of the same
+	// interval are spread over it by the golden ratio, which puts each one
+	// in the largest gap left by those before it.
+	int count = lua_objlen(L, table);
+	for (int i = m_interval_globalsteps.size(); i < count; i++) {
+		IntervalGlobalstep g;
+		g.interval = 0;
+		lua_rawgeti(L, table, i + 1);
+		getfloatfield(L, -1, "interval", g.interval);
+		lua_pop(L, 1);
+		u32 same = 0;
+		for (u32 j = 0; j < m_interval_globalsteps.size(); j++)
+			if (m_interval_globalsteps[j].interval == g.interval)
+				same++;
+		float phase = same * 0.618034;
+		g.timer = (phase - floor(phase)) * g.interval;
+		g.elapsed = 0;
+		m_interval_globalsteps.push_back(g);
+	}
+
+	lua_getglobal(L, "core");
+	lua_getfield(L, -1, "callback_origins");
+	lua_remove(L, -2);
+	int origins = lua_gettop(L);
+
+	for (u32 i = 0; i < m_interval_globalsteps.size(); i++) {
+		IntervalGlobalstep &g = m_interval_globalsteps[i];
+		g.timer += dtime;
+		g.elapsed += dtime;
+		if (g.timer < g.interval)
+			continue;
+		// Calls missed to lag are not made up for
+		g.timer = g.interval > 0 ? fmod(g.timer, g.interval) : 0;
+		float elapsed = g.elapsed;
+		g.elapsed = 0;
+
+		lua_rawgeti(L, table, i + 1);
+		lua_getfield(L, -1, "func");
+		lua_remove(L, -2);
+		std::string mod, name;
+		getCallbackOrigin(origins, "globalstep", mod, name);
+		lua_pushnumber(L, elapsed);
+		ScriptCallbackTimer timer(getCallbackStats(), mod, name);
+		if (lua_pcall(L, 1, 0, m_errorhandler))
+			scriptError();
+	}
+	lua_pop(L, 1); // Pop origins
+}
+
 void ScriptApiEnv::player_event(ServerActiveObject* player, std::string type)
 {
 	SCRIPTAPI_PRECHECKHEADER
@@ -73,7 +162,7 @@ void ScriptApiEnv::player_event(ServerActiveObject* player, std::string type)
 	objectrefGetOrCreate(L, player);   // player
 	lua_pushstring(L,type.c_str()); // event type
 	try {
-		script_run_callbacks(L, 2, RUN_CALLBACKS_MODE_FIRST);
+		runCallbacks(2, RUN_CALLBACKS_MODE_FIRST, "playerevent");
 	} catch (LuaError &e) {
 		getServer()->setAsyncFatalError(e.what());
 	}
@@ -104,7 +193,7 @@ void ScriptApiEnv::environment_OnMapgenInit(MapgenParams *mgparams)
 	lua_pushstring(L, flagstr.c_str());
 	lua_setfield(L, -2, "flags");
 	
-	script_run_callbacks(L, 1, RUN_CALLBACKS_MODE_FIRST);
+	runCallbacks(1, RUN_CALLBACKS_MODE_FIRST, "on_mapgen_init");
 }
 
 void ScriptApiEnv::initializeEnvironment(ServerEnvironment *env)
@@ -171,7 +260,14 @@ void ScriptApiEnv::initializeEnvironment(ServerEnvironment *env)
 			int trigger_chance = 50;
 			getintfield(L, current_abm, "chance", trigger_chance);
 
-			LuaABM *abm = new LuaABM(L, id, trigger_contents,
+			// Named by the mod and the first of the nodes
+			std::string mod = "??";
+			getstringfield(L, current_abm, "mod_origin", mod);
+			std::string name = mod;
+			if(!trigger_contents.empty())
+				name += " " + *trigger_contents.begin();
+
+			LuaABM *abm = new LuaABM(L, id, mod, name, trigger_contents,
 					required_neighbors, trigger_interval, trigger_chance);
 
 			env->addActiveBlockModifier(abm);
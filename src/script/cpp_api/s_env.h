@@ -22,8 +22,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "cpp_api/s_base.h"
 #include "irr_v3d.h"
+#include <vector>
 
 class ServerEnvironment;
+class ManualMapVoxelManipulator;
 struct MapgenParams;
 
 class ScriptApiEnv
@@ -34,6 +36,10 @@ class ScriptApiEnv
 	void environment_Step(float dtime);
 	// After generating a piece of map
 	void environment_OnGenerated(v3s16 minp, v3s16 maxp,u32 blockseed);
+	// Before the generated piece of map is put on the map; returns
+	// false if there are no stages
+	bool environment_OnMapgenStage(ManualMapVoxelManipulator *vm,
+			v3s16 minp, v3s16 maxp, u32 blockseed);
 	// After initializing mapgens
 	void environment_OnMapgenInit(MapgenParams *mgparams);
 
@@ -41,6 +47,22 @@ class ScriptApiEnv
 	void player_event(ServerActiveObject* player, std::string type);
 
 	void initializeEnvironment(ServerEnvironment *env);
+
+private:
+	/*
+		The globalsteps registered with an interval, in the order of
+		core.registered_interval_globalsteps. timer sets when they are due;
+		elapsed is the time since the last call, given to them as dtime.
+	*/
+	struct IntervalGlobalstep
+	{
+		float interval;
+		float timer;
+		float elapsed;
+	};
+	std::vector<IntervalGlobalstep> m_interval_globalsteps;
+
+	void stepIntervalGlobalsteps(lua_State *L, int table, float dtime);
 };
 
 #endif /* S_ENV_H_ */
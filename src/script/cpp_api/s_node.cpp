@@ -106,6 +106,9 @@ bool ScriptApiNode::node_on_punch(v3s16 p, MapNode node,
 	pushnode(L, node, ndef);
 	objectrefGetOrCreate(L, puncher);
 	pushPointedThing(pointed);
+	const std::string &name = ndef->get(node).name;
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "on_punch " + name);
 	if (lua_pcall(L, 4, 0, m_errorhandler))
 		scriptError();
 	return true;
@@ -126,6 +129,9 @@ bool ScriptApiNode::node_on_dig(v3s16 p, MapNode node,
 	push_v3s16(L, p);
 	pushnode(L, node, ndef);
 	objectrefGetOrCreate(L, digger);
+	const std::string &name = ndef->get(node).name;
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "on_dig " + name);
 	if (lua_pcall(L, 3, 0, m_errorhandler))
 		scriptError();
 	return true;
@@ -143,6 +149,9 @@ void ScriptApiNode::node_on_construct(v3s16 p, MapNode node)
 
 	// Call function
 	push_v3s16(L, p);
+	const std::string &name = ndef->get(node).name;
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "on_construct " + name);
 	if (lua_pcall(L, 1, 0, m_errorhandler))
 		scriptError();
 }
@@ -159,6 +168,9 @@ void ScriptApiNode::node_on_destruct(v3s16 p, MapNode node)
 
 	// Call function
 	push_v3s16(L, p);
+	const std::string &name = ndef->get(node).name;
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "on_destruct " + name);
 	if (lua_pcall(L, 1, 0, m_errorhandler))
 		scriptError();
 }
@@ -176,6 +188,9 @@ void ScriptApiNode::node_after_destruct(v3s16 p, MapNode node)
 	// Call function
 	push_v3s16(L, p);
 	pushnode(L, node, ndef);
+	const std::string &name = ndef->get(node).name;
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "after_destruct " + name);
 	if (lua_pcall(L, 2, 0, m_errorhandler))
 		scriptError();
 }
@@ -193,6 +208,9 @@ bool ScriptApiNode::node_on_timer(v3s16 p, MapNode node, f32 dtime)
 	// Call function
 	push_v3s16(L, p);
 	lua_pushnumber(L,dtime);
+	const std::string &name = ndef->get(node).name;
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "on_timer " + name);
 	if (lua_pcall(L, 2, 1, m_errorhandler))
 		scriptError();
 	return (bool) lua_isboolean(L, -1) && (bool) lua_toboolean(L, -1) == true;
@@ -229,6 +247,9 @@ void ScriptApiNode::node_on_receive_fields(v3s16 p,
 		lua_settable(L, -3);
 	}
 	objectrefGetOrCreate(L, sender);        // player
+	const std::string &name = ndef->get(node).name;
+	ScriptCallbackTimer timer(getCallbackStats(),
+			ScriptCallbackStats::getItemMod(name), "on_receive_fields " + name);
 	if (lua_pcall(L, 4, 0, m_errorhandler))
 		scriptError();
 }
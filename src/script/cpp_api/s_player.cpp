@@ -30,7 +30,7 @@ void ScriptApiPlayer::on_newplayer(ServerActiveObject *player)
 	lua_getfield(L, -1, "registered_on_newplayers");
 	// Call callbacks
 	objectrefGetOrCreate(L, player);
-	script_run_callbacks(L, 1, RUN_CALLBACKS_MODE_FIRST);
+	runCallbacks(1, RUN_CALLBACKS_MODE_FIRST, "on_newplayer");
 }
 
 void ScriptApiPlayer::on_dieplayer(ServerActiveObject *player)
@@ -42,7 +42,7 @@ void ScriptApiPlayer::on_dieplayer(ServerActiveObject *player)
 	lua_getfield(L, -1, "registered_on_dieplayers");
 	// Call callbacks
 	objectrefGetOrCreate(L, player);
-	script_run_callbacks(L, 1, RUN_CALLBACKS_MODE_FIRST);
+	runCallbacks(1, RUN_CALLBACKS_MODE_FIRST, "on_dieplayer");
 }
 
 bool ScriptApiPlayer::on_respawnplayer(ServerActiveObject *player)
@@ -54,7 +54,7 @@ bool ScriptApiPlayer::on_respawnplayer(ServerActiveObject *player)
 	lua_getfield(L, -1, "registered_on_respawnplayers");
 	// Call callbacks
 	objectrefGetOrCreate(L, player);
-	script_run_callbacks(L, 1, RUN_CALLBACKS_MODE_OR);
+	runCallbacks(1, RUN_CALLBACKS_MODE_OR, "on_respawnplayer");
 	bool positioning_handled_by_some = lua_toboolean(L, -1);
 	return positioning_handled_by_some;
 }
@@ -68,7 +68,7 @@ bool ScriptApiPlayer::on_prejoinplayer(std::string name, std::string ip, std::st
 	lua_getfield(L, -1, "registered_on_prejoinplayers");
 	lua_pushstring(L, name.c_str());
 	lua_pushstring(L, ip.c_str());
-	script_run_callbacks(L, 2, RUN_CALLBACKS_MODE_OR);
+	runCallbacks(2, RUN_CALLBACKS_MODE_OR, "on_prejoinplayer");
 	if (lua_isstring(L, -1)) {
 		reason.assign(lua_tostring(L, -1));
 		return true;
@@ -85,7 +85,7 @@ void ScriptApiPlayer::on_joinplayer(ServerActiveObject *player)
 	lua_getfield(L, -1, "registered_on_joinplayers");
 	// Call callbacks
 	objectrefGetOrCreate(L, player);
-	script_run_callbacks(L, 1, RUN_CALLBACKS_MODE_FIRST);
+	runCallbacks(1, RUN_CALLBACKS_MODE_FIRST, "on_joinplayer");
 }
 
 void ScriptApiPlayer::on_leaveplayer(ServerActiveObject *player)
@@ -97,7 +97,7 @@ void ScriptApiPlayer::on_leaveplayer(ServerActiveObject *player)
 	lua_getfield(L, -1, "registered_on_leaveplayers");
 	// Call callbacks
 	objectrefGetOrCreate(L, player);
-	script_run_callbacks(L, 1, RUN_CALLBACKS_MODE_FIRST);
+	runCallbacks(1, RUN_CALLBACKS_MODE_FIRST, "on_leaveplayer");
 }
 
 void ScriptApiPlayer::on_cheat(ServerActiveObject *player,
@@ -113,7 +113,7 @@ void ScriptApiPlayer::on_cheat(ServerActiveObject *player,
 	lua_newtable(L);
 	lua_pushlstring(L, cheat_type.c_str(), cheat_type.size());
 	lua_setfield(L, -2, "type");
-	script_run_callbacks(L, 2, RUN_CALLBACKS_MODE_FIRST);
+	runCallbacks(2, RUN_CALLBACKS_MODE_FIRST, "on_cheat");
 }
 
 void ScriptApiPlayer::on_playerReceiveFields(ServerActiveObject *player,
@@ -140,7 +140,7 @@ void ScriptApiPlayer::on_playerReceiveFields(ServerActiveObject *player,
 		lua_pushlstring(L, value.c_str(), value.size());
 		lua_settable(L, -3);
 	}
-	script_run_callbacks(L, 3, RUN_CALLBACKS_MODE_OR_SC);
+	runCallbacks(3, RUN_CALLBACKS_MODE_OR_SC, "on_player_receive_fields");
 }
 ScriptApiPlayer::~ScriptApiPlayer() {
 }
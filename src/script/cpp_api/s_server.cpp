@@ -136,7 +136,7 @@ bool ScriptApiServer::on_chat_message(const std::string &name,
 	// Call callbacks
 	lua_pushstring(L, name.c_str());
 	lua_pushstring(L, message.c_str());
-	script_run_callbacks(L, 2, RUN_CALLBACKS_MODE_OR_SC);
+	runCallbacks(2, RUN_CALLBACKS_MODE_OR_SC, "on_chat_message");
 	bool ate = lua_toboolean(L, -1);
 	return ate;
 }
@@ -149,6 +149,6 @@ void ScriptApiServer::on_shutdown()
 	lua_getglobal(L, "core");
 	lua_getfield(L, -1, "registered_on_shutdown");
 	// Call callbacks
-	script_run_callbacks(L, 0, RUN_CALLBACKS_MODE_FIRST);
+	runCallbacks(0, RUN_CALLBACKS_MODE_FIRST, "on_shutdown");
 }
 
@@ -34,6 +34,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_sao.h"
 #include "treegen.h"
 #include "pathfinder.h"
+#include "workerpool.h"
+#include "noise.h"
+#include <algorithm>
 
 #define GET_ENV_PTR ServerEnvironment* env =                                   \
 				dynamic_cast<ServerEnvironment*>(getEnv(L));                   \
@@ -77,8 +80,12 @@ void LuaABM::trigger(ServerEnvironment *env, v3s16 p, MapNode n,
 	pushnode(L, n, env->getGameDef()->ndef());
 	lua_pushnumber(L, active_object_count);
 	lua_pushnumber(L, active_object_count_wider);
-	if(lua_pcall(L, 4, 0, errorhandler))
-		script_error(L);
+	{
+		ScriptCallbackTimer timer(scriptIface->getCallbackStats(),
+				m_mod, m_callback);
+		if(lua_pcall(L, 4, 0, errorhandler))
+			script_error(L);
+	}
 	lua_pop(L, 1); // Pop error handler
 }
 
@@ -105,6 +112,46 @@ int ModApiEnvMod::l_add_node(lua_State *L)
 	return l_set_node(L);
 }
 
+// bulk_set_node(positions, node)
+// positions = {{x=num, y=num, z=num}, ...}
+// node = {name=...} or {{name=...}, ...}, one for each position
+int ModApiEnvMod::l_bulk_set_node(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	INodeDefManager *ndef = env->getGameDef()->ndef();
+	// parameters
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_getfield(L, 2, "name");
+	bool single = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+
+	std::vector<v3s16> positions;
+	std::vector<MapNode> nodes;
+	MapNode n;
+	if (single)
+		n = readnode(L, 2, ndef);
+	int count = lua_objlen(L, 1);
+	positions.reserve(count);
+	nodes.reserve(count);
+	for (int i = 1; i <= count; i++) {
+		lua_rawgeti(L, 1, i);
+		positions.push_back(read_v3s16(L, -1));
+		lua_pop(L, 1);
+		if (!single) {
+			lua_rawgeti(L, 2, i);
+			n = readnode(L, lua_gettop(L), ndef);
+			lua_pop(L, 1);
+		}
+		nodes.push_back(n);
+	}
+	// Do it
+	bool succeeded = env->setNodes(positions, nodes);
+	lua_pushboolean(L, succeeded);
+	return 1;
+}
+
 // remove_node(pos)
 // pos = {x=num, y=num, z=num}
 int ModApiEnvMod::l_remove_node(lua_State *L)
@@ -150,6 +197,27 @@ int ModApiEnvMod::l_get_node(lua_State *L)
 	return 1;
 }
 
+// bulk_get_node(positions)
+// positions = {{x=num, y=num, z=num}, ...}
+int ModApiEnvMod::l_bulk_get_node(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	INodeDefManager *ndef = env->getGameDef()->ndef();
+	Map &map = env->getMap();
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int count = lua_objlen(L, 1);
+	lua_createtable(L, count, 0);
+	for (int i = 1; i <= count; i++) {
+		lua_rawgeti(L, 1, i);
+		v3s16 pos = read_v3s16(L, -1);
+		lua_pop(L, 1);
+		pushnode(L, map.getNodeNoEx(pos), ndef);
+		lua_rawseti(L, -2, i);
+	}
+	return 1;
+}
+
 // get_node_or_nil(pos)
 // pos = {x=num, y=num, z=num}
 int ModApiEnvMod::l_get_node_or_nil(lua_State *L)
@@ -170,6 +238,20 @@ int ModApiEnvMod::l_get_node_or_nil(lua_State *L)
 	return 1;
 }
 
+// get_node_raw(pos) -> content_id, param1, param2
+// pos = {x=num, y=num, z=num}
+int ModApiEnvMod::l_get_node_raw(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	v3s16 pos = read_v3s16(L, 1);
+	MapNode n = env->getMap().getNodeNoEx(pos);
+	lua_pushinteger(L, n.getContent());
+	lua_pushinteger(L, n.getParam1());
+	lua_pushinteger(L, n.getParam2());
+	return 3;
+}
+
 // get_node_light(pos, timeofday)
 // pos = {x=num, y=num, z=num}
 // timeofday: nil = current time, 0 = night, 0.5 = day
@@ -505,38 +587,90 @@ int ModApiEnvMod::l_get_gametime(lua_State *L)
 }
 
 
-// find_node_near(pos, radius, nodenames) -> pos or nil
-// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
-int ModApiEnvMod::l_find_node_near(lua_State *L)
+/*
+	Returns false if no node of the block at blockpos can match filter.
+	Results are cached in cache, as blocks are visited many times.
+*/
+static bool block_may_contain(Map &map, v3s16 blockpos,
+		const std::set<content_t> &filter, std::map<v3s16, bool> &cache)
 {
-	GET_ENV_PTR;
+	std::map<v3s16, bool>::iterator i = cache.find(blockpos);
+	if(i != cache.end())
+		return i->second;
+	bool result;
+	MapBlock *block = map.getBlockNoCreateNoEx(blockpos);
+	if(block == NULL || block->isDummy())
+		// Nodes of unloaded blocks read as ignore
+		result = filter.count(CONTENT_IGNORE) != 0;
+	else
+		result = block->mayContainAny(filter);
+	cache[blockpos] = result;
+	return result;
+}
 
-	INodeDefManager *ndef = getServer(L)->ndef();
-	v3s16 pos = read_v3s16(L, 1);
-	int radius = luaL_checkinteger(L, 2);
-	std::set<content_t> filter;
-	if(lua_istable(L, 3)){
-		int table = 3;
+/*
+	Reads nodenames at index into filter, and makes match[c] true for the
+	content ids in it
+*/
+static void read_node_filter(lua_State *L, int index, INodeDefManager *ndef,
+		std::set<content_t> &filter, std::vector<bool> &match)
+{
+	if(lua_istable(L, index)){
 		lua_pushnil(L);
-		while(lua_next(L, table) != 0){
+		while(lua_next(L, index) != 0){
 			// key at index -2 and value at index -1
 			luaL_checktype(L, -1, LUA_TSTRING);
 			ndef->getIds(lua_tostring(L, -1), filter);
 			// removes value, keeps key for next iteration
 			lua_pop(L, 1);
 		}
-	} else if(lua_isstring(L, 3)){
-		ndef->getIds(lua_tostring(L, 3), filter);
+	} else if(lua_isstring(L, index)){
+		ndef->getIds(lua_tostring(L, index), filter);
 	}
+	match.assign(filter.empty() ? 0 : *filter.rbegin() + 1, false);
+	for(std::set<content_t>::const_iterator i = filter.begin();
+			i != filter.end(); ++i)
+		match[*i] = true;
+}
 
+// find_node_near(pos, radius, nodenames) -> pos or nil
+// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
+int ModApiEnvMod::l_find_node_near(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	INodeDefManager *ndef = getServer(L)->ndef();
+	v3s16 pos = read_v3s16(L, 1);
+	int radius = luaL_checkinteger(L, 2);
+	std::set<content_t> filter;
+	std::vector<bool> match;
+	read_node_filter(L, 3, ndef, filter, match);
+
+	Map &map = env->getMap();
+	std::map<v3s16, bool> block_cache;
+	// The shells go around the same few blocks over and over
+	v3s16 last_blockpos(32767, 32767, 32767);
+	MapBlock *block = NULL;
 	for(int d=1; d<=radius; d++){
 		std::list<v3s16> list;
 		getFacePositions(list, d);
 		for(std::list<v3s16>::iterator i = list.begin();
 				i != list.end(); ++i){
 			v3s16 p = pos + (*i);
-			content_t c = env->getMap().getNodeNoEx(p).getContent();
-			if(filter.count(c) != 0){
+			v3s16 blockpos = getNodeBlockPos(p);
+			if(!block_may_contain(map, blockpos, filter, block_cache))
+				continue;
+			if(blockpos != last_blockpos){
+				block = map.getBlockNoCreateNoEx(blockpos);
+				last_blockpos = blockpos;
+			}
+			content_t c = CONTENT_IGNORE;
+			bool valid = false;
+			if(block != NULL){
+				v3s16 rp = p - blockpos * MAP_BLOCKSIZE;
+				c = block->getNodeNoCheck(rp, &valid).getContent();
+			}
+			if(c < match.size() && match[c]){
 				push_v3s16(L, p);
 				return 1;
 			}
@@ -545,8 +679,10 @@ int ModApiEnvMod::l_find_node_near(lua_State *L)
 	return 0;
 }
 
-// find_nodes_in_area(minp, maxp, nodenames) -> list of positions
+// find_nodes_in_area(minp, maxp, nodenames, [format]) -> list of positions
 // nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
+// format: nil for a list of positions, "flat" for {x1, y1, z1, x2, ...},
+//         "count" for the number and a table of counts by name
 int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
 {
 	GET_ENV_PTR;
@@ -555,33 +691,77 @@ int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
 	v3s16 minp = read_v3s16(L, 1);
 	v3s16 maxp = read_v3s16(L, 2);
 	std::set<content_t> filter;
-	if(lua_istable(L, 3)){
-		int table = 3;
-		lua_pushnil(L);
-		while(lua_next(L, table) != 0){
-			// key at index -2 and value at index -1
-			luaL_checktype(L, -1, LUA_TSTRING);
-			ndef->getIds(lua_tostring(L, -1), filter);
-			// removes value, keeps key for next iteration
-			lua_pop(L, 1);
+	std::vector<bool> match;
+	read_node_filter(L, 3, ndef, filter, match);
+	std::string format = lua_isstring(L, 4) ? lua_tostring(L, 4) : "";
+	bool flat = format == "flat";
+	bool count_only = format == "count";
+
+	Map &map = env->getMap();
+	std::map<content_t, u32> counts;
+	u32 count = 0;
+	if(!count_only)
+		lua_newtable(L);
+
+	// Block by block, reading the nodes of each straight from it
+	v3s16 bpmin = getNodeBlockPos(minp);
+	v3s16 bpmax = getNodeBlockPos(maxp);
+	for(s16 bx = bpmin.X; bx <= bpmax.X; bx++)
+	for(s16 by = bpmin.Y; by <= bpmax.Y; by++)
+	for(s16 bz = bpmin.Z; bz <= bpmax.Z; bz++) {
+		v3s16 blockpos(bx, by, bz);
+		MapBlock *block = map.getBlockNoCreateNoEx(blockpos);
+		if(block != NULL && block->isDummy())
+			block = NULL;
+		// Nodes of unloaded blocks read as ignore
+		if(block == NULL ? filter.count(CONTENT_IGNORE) == 0
+				: !block->mayContainAny(filter))
+			continue;
+
+		v3s16 base = blockpos * MAP_BLOCKSIZE;
+		v3s16 p1(MYMAX(minp.X, base.X), MYMAX(minp.Y, base.Y),
+				MYMAX(minp.Z, base.Z));
+		v3s16 p2(MYMIN(maxp.X, base.X + MAP_BLOCKSIZE - 1),
+				MYMIN(maxp.Y, base.Y + MAP_BLOCKSIZE - 1),
+				MYMIN(maxp.Z, base.Z + MAP_BLOCKSIZE - 1));
+		for(s16 x = p1.X; x <= p2.X; x++)
+		for(s16 y = p1.Y; y <= p2.Y; y++)
+		for(s16 z = p1.Z; z <= p2.Z; z++) {
+			content_t c = CONTENT_IGNORE;
+			if(block != NULL){
+				bool valid;
+				c = block->getNodeNoCheck(x - base.X, y - base.Y,
+						z - base.Z, &valid).getContent();
+			}
+			if(c >= match.size() || !match[c])
+				continue;
+			count++;
+			if(count_only){
+				counts[c]++;
+			} else if(flat){
+				lua_pushinteger(L, x);
+				lua_rawseti(L, -2, count * 3 - 2);
+				lua_pushinteger(L, y);
+				lua_rawseti(L, -2, count * 3 - 1);
+				lua_pushinteger(L, z);
+				lua_rawseti(L, -2, count * 3);
+			} else {
+				push_v3s16(L, v3s16(x, y, z));
+				lua_rawseti(L, -2, count);
+			}
 		}
-	} else if(lua_isstring(L, 3)){
-		ndef->getIds(lua_tostring(L, 3), filter);
 	}
 
+	if(!count_only)
+		return 1;
+	lua_pushinteger(L, count);
 	lua_newtable(L);
-	u64 i = 0;
-	for(s16 x = minp.X; x <= maxp.X; x++)
-	for(s16 y = minp.Y; y <= maxp.Y; y++)
-	for(s16 z = minp.Z; z <= maxp.Z; z++) {
-		v3s16 p(x, y, z);
-		content_t c = env->getMap().getNodeNoEx(p).getContent();
-		if(filter.count(c) != 0) {
-			push_v3s16(L, p);
-			lua_rawseti(L, -2, ++i);
-		}
+	for(std::map<content_t, u32>::iterator i = counts.begin();
+			i != counts.end(); ++i){
+		lua_pushinteger(L, i->second);
+		lua_setfield(L, -2, ndef->get(i->first).name.c_str());
 	}
-	return 1;
+	return 2;
 }
 
 // get_perlin(seeddiff, octaves, persistence, scale)
@@ -621,6 +801,79 @@ int ModApiEnvMod::l_get_perlin_map(lua_State *L)
 	return 1;
 }
 
+// Computes the maps of several noises at once on the worker threads
+class PerlinMapsTask : public WorkerTask
+{
+public:
+	std::vector<Noise*> noises;
+	v3f pos;
+	bool is_3d;
+
+	void run(u32 index)
+	{
+		Noise *n = noises[index];
+		if (is_3d)
+			n->perlinMap3D(pos.X, pos.Y, pos.Z, n->np->eased);
+		else
+			n->perlinMap2D(pos.X, pos.Y);
+	}
+};
+
+// get_perlin_maps_flat(maps, pos, [buffers])
+// maps = {PerlinNoiseMap, ...}
+// pos = {x=num, y=num} for 2d maps, {x=num, y=num, z=num} for 3d maps
+int ModApiEnvMod::l_get_perlin_maps_flat(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int count = lua_objlen(L, 1);
+	std::vector<Noise*> noises(count);
+	PerlinMapsTask task;
+	for (int i = 0; i < count; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		noises[i] = LuaPerlinNoiseMap::checkobject(L, -1)->getNoise();
+		lua_pop(L, 1);
+		// A map given twice is computed once
+		if (std::find(task.noises.begin(), task.noises.end(), noises[i])
+				== task.noises.end())
+			task.noises.push_back(noises[i]);
+	}
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_getfield(L, 2, "z");
+	task.is_3d = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	if (task.is_3d) {
+		task.pos = read_v3f(L, 2);
+	} else {
+		v2f p = read_v2f(L, 2);
+		task.pos = v3f(p.X, p.Y, 0);
+	}
+
+	getWorkerPool()->run(&task, task.noises.size());
+
+	bool has_buffers = lua_istable(L, 3);
+	lua_createtable(L, count, 0);
+	for (int i = 0; i < count; i++) {
+		Noise *n = noises[i];
+		int maplen = n->sx * n->sy * (task.is_3d ? n->sz : 1);
+		int buffer = 0;
+		if (has_buffers) {
+			lua_rawgeti(L, 3, i + 1);
+			if (lua_istable(L, -1))
+				buffer = lua_gettop(L);
+			else
+				lua_pop(L, 1);
+		}
+		LuaPerlinNoiseMap::pushFlatMap(L, n, maplen, buffer);
+		if (buffer != 0)
+			lua_remove(L, buffer);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
 // get_voxel_manip()
 // returns voxel manipulator
 int ModApiEnvMod::l_get_voxel_manip(lua_State *L)
@@ -646,6 +899,27 @@ int ModApiEnvMod::l_clear_objects(lua_State *L)
 	return 0;
 }
 
+// get_clear_objects_progress()
+// returns {blocks_checked=, blocks_cleared=, objects_cleared=} or nil if
+// not clearing objects
+int ModApiEnvMod::l_get_clear_objects_progress(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	ClearObjectsProgress progress;
+	if (!env->getClearObjectsProgress(progress))
+		return 0;
+
+	lua_newtable(L);
+	lua_pushnumber(L, progress.blocks_checked);
+	lua_setfield(L, -2, "blocks_checked");
+	lua_pushnumber(L, progress.blocks_cleared);
+	lua_setfield(L, -2, "blocks_cleared");
+	lua_pushnumber(L, progress.objects_cleared);
+	lua_setfield(L, -2, "objects_cleared");
+	return 1;
+}
+
 // line_of_sight(pos1, pos2, stepsize) -> true/false, pos
 int ModApiEnvMod::l_line_of_sight(lua_State *L) {
 	float stepsize = 1.0;
@@ -671,6 +945,12 @@ int ModApiEnvMod::l_line_of_sight(lua_State *L) {
 	return 1;
 }
 
+// raycast(pos1, pos2, filter) -> Raycast
+int ModApiEnvMod::l_raycast(lua_State *L)
+{
+	return LuaRaycast::create_object(L);
+}
+
 // find_path(pos1, pos2, searchdistance,
 //     max_jump, max_drop, algorithm) -> table containing path
 int ModApiEnvMod::l_find_path(lua_State *L)
@@ -783,25 +1063,33 @@ int ModApiEnvMod::l_transforming_liquid_add(lua_State *L)
 	return 1;
 }
 
-// forceload_block(blockpos)
+// forceload_block(blockpos, lite)
 // blockpos = {x=num, y=num, z=num}
 int ModApiEnvMod::l_forceload_block(lua_State *L)
 {
 	GET_ENV_PTR;
 
 	v3s16 blockpos = read_v3s16(L, 1);
-	env->getForceloadedBlocks()->insert(blockpos);
+	bool lite = lua_toboolean(L, 2);
+	if (lite)
+		env->getForceloadedLiteBlocks()->insert(blockpos);
+	else
+		env->getForceloadedBlocks()->insert(blockpos);
 	return 0;
 }
 
-// forceload_free_block(blockpos)
+// forceload_free_block(blockpos, lite)
 // blockpos = {x=num, y=num, z=num}
 int ModApiEnvMod::l_forceload_free_block(lua_State *L)
 {
 	GET_ENV_PTR;
 
 	v3s16 blockpos = read_v3s16(L, 1);
-	env->getForceloadedBlocks()->erase(blockpos);
+	bool lite = lua_toboolean(L, 2);
+	if (lite)
+		env->getForceloadedLiteBlocks()->erase(blockpos);
+	else
+		env->getForceloadedBlocks()->erase(blockpos);
 	return 0;
 }
 
@@ -816,11 +1104,14 @@ void ModApiEnvMod::Initialize(lua_State *L, int top)
 {
 	API_FCT(set_node);
 	API_FCT(add_node);
+	API_FCT(bulk_set_node);
 	API_FCT(swap_node);
 	API_FCT(add_item);
 	API_FCT(remove_node);
 	API_FCT(get_node);
+	API_FCT(bulk_get_node);
 	API_FCT(get_node_or_nil);
+	API_FCT(get_node_raw);
 	API_FCT(get_node_light);
 	API_FCT(place_node);
 	API_FCT(dig_node);
@@ -841,13 +1132,131 @@ void ModApiEnvMod::Initialize(lua_State *L, int top)
 	API_FCT(find_nodes_in_area);
 	API_FCT(get_perlin);
 	API_FCT(get_perlin_map);
+	API_FCT(get_perlin_maps_flat);
 	API_FCT(get_voxel_manip);
 	API_FCT(clear_objects);
+	API_FCT(get_clear_objects_progress);
 	API_FCT(spawn_tree);
 	API_FCT(find_path);
 	API_FCT(line_of_sight);
+	API_FCT(raycast);
 	API_FCT(transforming_liquid_add);
 	API_FCT(forceload_block);
 	API_FCT(forceload_free_block);
 	API_FCT(get_us_time);
 }
+
+/*
+	LuaRaycast
+*/
+
+// garbage collector
+int LuaRaycast::gc_object(lua_State *L)
+{
+	LuaRaycast *o = *(LuaRaycast **)(lua_touserdata(L, 1));
+	delete o;
+	return 0;
+}
+
+// next(self) -> pos, above or nil
+int LuaRaycast::l_next(lua_State *L)
+{
+	LuaRaycast *o = checkobject(L, 1);
+
+	GET_ENV_PTR;
+
+	// Blocks may be unloaded between the calls
+	CachedNodeReader reader(&env->getMap());
+	INodeDefManager *ndef = env->getGameDef()->ndef();
+	VoxelLineIterator &line = o->m_iterator;
+	for (;;) {
+		if (o->m_started) {
+			if (!line.hasNext()) {
+				lua_pushnil(L);
+				return 1;
+			}
+			line.next();
+		}
+		o->m_started = true;
+
+		v3s16 p = line.getCurrent();
+		bool is_valid_position;
+		MapNode n = reader.getNode(p, &is_valid_position);
+		if (raycastFilterMatches(n, is_valid_position, ndef, o->m_filter)) {
+			push_v3s16(L, p);
+			push_v3s16(L, p + line.getEnteredFrom());
+			return 2;
+		}
+	}
+}
+
+LuaRaycast::LuaRaycast(v3f pos1, v3f pos2, RaycastFilter filter):
+	m_iterator(pos1, pos2),
+	m_filter(filter),
+	m_started(false)
+{
+}
+
+// Raycast(pos1, pos2, filter)
+// Creates a LuaRaycast and leaves it on top of stack
+int LuaRaycast::create_object(lua_State *L)
+{
+	v3f pos1 = checkFloatPos(L, 1);
+	v3f pos2 = checkFloatPos(L, 2);
+	RaycastFilter filter = RAYCAST_NOT_AIR;
+	if (lua_isstring(L, 3))
+		filter = parseRaycastFilter(lua_tostring(L, 3));
+
+	LuaRaycast *o = new LuaRaycast(pos1, pos2, filter);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+LuaRaycast* LuaRaycast::checkobject(lua_State *L, int narg)
+{
+	luaL_checktype(L, narg, LUA_TUSERDATA);
+	void *ud = luaL_checkudata(L, narg, className);
+	if(!ud) luaL_typerror(L, narg, className);
+	return *(LuaRaycast**)ud;  // unbox pointer
+}
+
+void LuaRaycast::Register(lua_State *L)
+{
+	lua_newtable(L);
+	int methodtable = lua_gettop(L);
+	luaL_newmetatable(L, className);
+	int metatable = lua_gettop(L);
+
+	lua_pushliteral(L, "__metatable");
+	lua_pushvalue(L, methodtable);
+	lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, methodtable);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__gc");
+	lua_pushcfunction(L, gc_object);
+	lua_settable(L, metatable);
+
+	// So that it can be the iterator of a for loop
+	lua_pushliteral(L, "__call");
+	lua_pushcfunction(L, l_next);
+	lua_settable(L, metatable);
+
+	lua_pop(L, 1);  // drop metatable
+
+	luaL_openlib(L, 0, methods, 0);  // fill methodtable
+	lua_pop(L, 1);  // drop methodtable
+
+	// Can be created from Lua (Raycast(pos1, pos2, filter))
+	lua_register(L, className, create_object);
+}
+
+const char LuaRaycast::className[] = "Raycast";
+const luaL_reg LuaRaycast::methods[] = {
+	luamethod(LuaRaycast, next),
+	{0,0}
+};
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "lua_api/l_base.h"
 #include "environment.h"
+#include "raycast.h"
 
 class ModApiEnvMod : public ModApiBase {
 private:
@@ -31,6 +32,10 @@ class ModApiEnvMod : public ModApiBase {
 
 	static int l_add_node(lua_State *L);
 
+	// bulk_set_node(positions, node)
+	// node is one node for all or a list of one for each position
+	static int l_bulk_set_node(lua_State *L);
+
 	// remove_node(pos)
 	// pos = {x=num, y=num, z=num}
 	static int l_remove_node(lua_State *L);
@@ -43,10 +48,17 @@ class ModApiEnvMod : public ModApiBase {
 	// pos = {x=num, y=num, z=num}
 	static int l_get_node(lua_State *L);
 
+	// bulk_get_node(positions)
+	static int l_bulk_get_node(lua_State *L);
+
 	// get_node_or_nil(pos)
 	// pos = {x=num, y=num, z=num}
 	static int l_get_node_or_nil(lua_State *L);
 
+	// get_node_raw(pos) -> content_id, param1, param2
+	// pos = {x=num, y=num, z=num}
+	static int l_get_node_raw(lua_State *L);
+
 	// get_node_light(pos, timeofday)
 	// pos = {x=num, y=num, z=num}
 	// timeofday: nil = current time, 0 = night, 0.5 = day
@@ -115,7 +127,7 @@ class ModApiEnvMod : public ModApiBase {
 	// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 	static int l_find_node_near(lua_State *L);
 
-	// find_nodes_in_area(minp, maxp, nodenames) -> list of positions
+	// find_nodes_in_area(minp, maxp, nodenames, [format]) -> list of positions
 	// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 	static int l_find_nodes_in_area(lua_State *L);
 
@@ -126,6 +138,10 @@ class ModApiEnvMod : public ModApiBase {
 	// get_perlin_map(noiseparams, size)
 	// returns world-specific PerlinNoiseMap
 	static int l_get_perlin_map(lua_State *L);
+
+	// get_perlin_maps_flat(maps, pos, [buffers])
+	// returns the flat maps of several PerlinNoiseMaps at pos
+	static int l_get_perlin_maps_flat(lua_State *L);
 	
 	// get_voxel_manip()
 	// returns world-specific voxel manipulator
@@ -135,12 +151,19 @@ class ModApiEnvMod : public ModApiBase {
 	// clear all objects in the environment
 	static int l_clear_objects(lua_State *L);
 
+	// get_clear_objects_progress()
+	// returns {blocks_checked=, blocks_cleared=, objects_cleared=} or nil
+	static int l_get_clear_objects_progress(lua_State *L);
+
 	// spawn_tree(pos, treedef)
 	static int l_spawn_tree(lua_State *L);
 
 	// line_of_sight(pos1, pos2, stepsize) -> true/false
 	static int l_line_of_sight(lua_State *L);
 
+	// raycast(pos1, pos2, filter) -> Raycast
+	static int l_raycast(lua_State *L);
+
 	// find_path(pos1, pos2, searchdistance,
 	//     max_jump, max_drop, algorithm) -> table containing path
 	static int l_find_path(lua_State *L);
@@ -148,11 +171,11 @@ class ModApiEnvMod : public ModApiBase {
 	// transforming_liquid_add(pos)
 	static int l_transforming_liquid_add(lua_State *L);
 
-	// forceload_block(blockpos)
-	// forceloads a block
+	// forceload_block(blockpos, lite)
+	// forceloads a block; lite ones only run node timers
 	static int l_forceload_block(lua_State *L);
 	
-	// forceload_free_block(blockpos)
+	// forceload_free_block(blockpos, lite)
 	// stops forceloading a position
 	static int l_forceload_free_block(lua_State *L);
 	
@@ -167,23 +190,35 @@ class LuaABM : public ActiveBlockModifier
 {
 private:
 	int m_id;
+	std::string m_mod;
+	std::string m_name;
+	// Name in the callback statistics
+	std::string m_callback;
 
 	std::set<std::string> m_trigger_contents;
 	std::set<std::string> m_required_neighbors;
 	float m_trigger_interval;
 	u32 m_trigger_chance;
 public:
-	LuaABM(lua_State *L, int id,
+	LuaABM(lua_State *L, int id, const std::string &mod,
+			const std::string &name,
 			const std::set<std::string> &trigger_contents,
 			const std::set<std::string> &required_neighbors,
 			float trigger_interval, u32 trigger_chance):
 		m_id(id),
+		m_mod(mod),
+		m_name(name),
+		m_callback("abm" + name.substr(mod.size())),
 		m_trigger_contents(trigger_contents),
 		m_required_neighbors(required_neighbors),
 		m_trigger_interval(trigger_interval),
 		m_trigger_chance(trigger_chance)
 	{
 	}
+	virtual std::string getName()
+	{
+		return m_name;
+	}
 	virtual std::set<std::string> getTriggerContents()
 	{
 		return m_trigger_contents;
@@ -204,4 +239,35 @@ class LuaABM : public ActiveBlockModifier
 			u32 active_object_count, u32 active_object_count_wider);
 };
 
+/*
+	Raycast: the nodes on a line matching a filter, one call at a time
+*/
+class LuaRaycast : public ModApiBase {
+private:
+	VoxelLineIterator m_iterator;
+	RaycastFilter m_filter;
+	// The node of the start has been looked at
+	bool m_started;
+
+	static const char className[];
+	static const luaL_reg methods[];
+
+	// garbage collector
+	static int gc_object(lua_State *L);
+
+	// next(self) -> pos, above or nil
+	static int l_next(lua_State *L);
+
+public:
+	LuaRaycast(v3f pos1, v3f pos2, RaycastFilter filter);
+
+	// Raycast(pos1, pos2, filter)
+	// Creates a LuaRaycast and leaves it on top of stack
+	static int create_object(lua_State *L);
+
+	static LuaRaycast* checkobject(lua_State *L, int narg);
+
+	static void Register(lua_State *L);
+};
+
 #endif /* L_ENV_H_ */
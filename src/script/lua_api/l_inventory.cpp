@@ -206,7 +206,7 @@ int InvRef::l_set_stack(lua_State *L)
 	return 1;
 }
 
-// get_list(self, listname) -> list or nil
+// get_list(self, listname, [list]) -> list or nil
 int InvRef::l_get_list(lua_State *L)
 {
 	NO_MAP_LOCK_REQUIRED;
@@ -214,7 +214,10 @@ int InvRef::l_get_list(lua_State *L)
 	const char *listname = luaL_checkstring(L, 2);
 	Inventory *inv = getinv(L, ref);
 	if(inv){
-		push_inventory_list(L, inv, listname);
+		int reuse_table = 0;
+		if(lua_istable(L, 3))
+			reuse_table = 3;
+		push_inventory_list(L, inv, listname, reuse_table);
 	} else {
 		lua_pushnil(L);
 	}
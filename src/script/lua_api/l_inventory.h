@@ -73,7 +73,7 @@ class InvRef : public ModApiBase {
 	// set_stack(self, listname, i, stack) -> true/false
 	static int l_set_stack(lua_State *L);
 
-	// get_list(self, listname) -> list or nil
+	// get_list(self, listname, [list]) -> list or nil
 	static int l_get_list(lua_State *L);
 
 	// set_list(self, listname, list)
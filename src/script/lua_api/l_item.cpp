@@ -390,6 +390,18 @@ LuaItemStack* LuaItemStack::checkobject(lua_State *L, int narg)
 	return *(LuaItemStack**)ud;  // unbox pointer
 }
 
+LuaItemStack* LuaItemStack::testobject(lua_State *L, int narg)
+{
+	if(!lua_isuserdata(L, narg) || !lua_getmetatable(L, narg))
+		return NULL;
+	luaL_getmetatable(L, className);
+	bool is_itemstack = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	if(!is_itemstack)
+		return NULL;
+	return *(LuaItemStack**)lua_touserdata(L, narg);
+}
+
 void LuaItemStack::Register(lua_State *L)
 {
 	lua_newtable(L);
@@ -493,6 +505,7 @@ int ModApiItemMod::l_register_item_raw(lua_State *L)
 
 	// Register item definition
 	idef->registerItem(def);
+	clear_item_name_cache();
 
 	// Read the node definition (content features) and register it
 	if(def.type == ITEM_NODE){
@@ -521,6 +534,7 @@ int ModApiItemMod::l_register_alias_raw(lua_State *L)
 			getServer(L)->getWritableItemDefManager();
 
 	idef->registerAlias(name, convert_to);
+	clear_item_name_cache();
 
 	return 0; /* number of results */
 }
@@ -128,6 +128,8 @@ class LuaItemStack : public ModApiBase {
 	// Not callable from Lua
 	static int create(lua_State *L, const ItemStack &item);
 	static LuaItemStack* checkobject(lua_State *L, int narg);
+	// NULL if the value isn't an ItemStack
+	static LuaItemStack* testobject(lua_State *L, int narg);
 	static void Register(lua_State *L);
 
 };
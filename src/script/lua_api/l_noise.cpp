@@ -160,6 +160,23 @@ int LuaPerlinNoiseMap::l_get2dMap(lua_State *L)
 	return 1;
 }
 
+void LuaPerlinNoiseMap::pushFlatMap(lua_State *L, Noise *n, int maplen,
+		int buffer)
+{
+	// A table given as buffer is filled in place, so that a mapgen
+	// can reuse one for every chunk instead of making a new one
+	if (buffer != 0)
+		lua_pushvalue(L, buffer);
+	else
+		lua_createtable(L, maplen, 0);
+	float offset = n->np->offset;
+	float scale = n->np->scale;
+	for (int i = 0; i != maplen; i++) {
+		lua_pushnumber(L, offset + scale * n->result[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
 int LuaPerlinNoiseMap::l_get2dMap_flat(lua_State *L)
 {
 	NO_MAP_LOCK_REQUIRED;
@@ -170,14 +187,7 @@ int LuaPerlinNoiseMap::l_get2dMap_flat(lua_State *L)
 	Noise *n = o->noise;
 	n->perlinMap2D(p.X, p.Y);
 
-	int maplen = n->sx * n->sy;
-
-	lua_newtable(L);
-	for (int i = 0; i != maplen; i++) {
-		float noiseval = n->np->offset + n->np->scale * n->result[i];
-		lua_pushnumber(L, noiseval);
-		lua_rawseti(L, -2, i + 1);
-	}
+	pushFlatMap(L, n, n->sx * n->sy, lua_istable(L, 3) ? 3 : 0);
 	return 1;
 }
 
@@ -218,15 +228,7 @@ int LuaPerlinNoiseMap::l_get3dMap_flat(lua_State *L)
 	Noise *n = o->noise;
 	n->perlinMap3D(p.X, p.Y, p.Z, n->np->eased);
 
-
-	int maplen = n->sx * n->sy * n->sz;
-
-	lua_newtable(L);
-	for (int i = 0; i != maplen; i++) {
-		float noiseval = n->np->offset + n->np->scale * n->result[i];
-		lua_pushnumber(L, noiseval);
-		lua_rawseti(L, -2, i + 1);
-	}
+	pushFlatMap(L, n, n->sx * n->sy * n->sz, lua_istable(L, 3) ? 3 : 0);
 	return 1;
 }
 
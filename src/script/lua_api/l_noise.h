@@ -86,6 +86,15 @@ class LuaPerlinNoiseMap : public ModApiBase {
 
 	static LuaPerlinNoiseMap *checkobject(lua_State *L, int narg);
 
+	Noise *getNoise()
+	{
+		return noise;
+	}
+
+	// Pushes the values of the last map of n, scaled and offset, into
+	// the table at index buffer or a new one if buffer is 0
+	static void pushFlatMap(lua_State *L, Noise *n, int maplen, int buffer);
+
 	static void Register(lua_State *L);
 };
 
@@ -44,6 +44,8 @@ int ModApiRollback::l_rollback_get_node_actions(lua_State *L)
 	int limit = luaL_checknumber(L, 4);
 	Server *server = getServer(L);
 	IRollbackManager *rollback = server->getRollbackManager();
+	if (rollback == NULL)
+		return 0;
 
 	std::list<RollbackAction> actions = rollback->getNodeActors(pos, range, seconds, limit);
 	std::list<RollbackAction>::iterator iter = actions.begin();
@@ -80,6 +82,8 @@ int ModApiRollback::l_rollback_revert_actions_by(lua_State *L)
 	int seconds = luaL_checknumber(L, 2);
 	Server *server = getServer(L);
 	IRollbackManager *rollback = server->getRollbackManager();
+	if (rollback == NULL)
+		return 0;
 	std::list<RollbackAction> actions = rollback->getRevertActions(actor, seconds);
 	std::list<std::string> log;
 	bool success = server->rollbackRevertActions(actions, &log);
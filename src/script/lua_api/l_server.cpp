@@ -19,11 +19,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "lua_api/l_server.h"
 #include "lua_api/l_internal.h"
+#include "cpp_api/s_base.h"
+#include "scripting_game.h"
 #include "common/c_converter.h"
 #include "common/c_content.h"
 #include "server.h"
+#include "pregen.h"
 #include "environment.h"
 #include "player.h"
+#include "profiler.h"
+#include "filesys.h"
 #include "log.h"
 
 // request_shutdown()
@@ -409,6 +414,95 @@ int ModApiServer::l_get_worldpath(lua_State *L)
 	return 1;
 }
 
+// write_profiler_trace()
+// returns the path of the written file, or nil if tracing is disabled
+int ModApiServer::l_write_profiler_trace(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	if (!profiler_trace_enabled())
+		return 0;
+	std::string path = getServer(L)->getWorldPath() + DIR_DELIM
+			+ "profiler_trace.json";
+	std::ostringstream os(std::ios_base::binary);
+	profiler_trace_write(os);
+	if (!fs::safeWriteToFile(path, os.str())) {
+		errorstream << "write_profiler_trace: failed to write "
+				<< path << std::endl;
+		return 0;
+	}
+	lua_pushstring(L, path.c_str());
+	return 1;
+}
+
+// get_callback_stats()
+// returns {[mod] = {[callback] = {count = n, time = seconds}}}
+int ModApiServer::l_get_callback_stats(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	ScriptCallbackStats::Entries entries;
+	getScriptApiBase(L)->getCallbackStats()->get(entries);
+
+	lua_newtable(L);
+	for (ScriptCallbackStats::Entries::iterator
+			i = entries.begin();
+			i != entries.end(); ++i) {
+		lua_newtable(L);
+		for (std::map<std::string, ScriptCallbackStats::Entry>::iterator
+				j = i->second.begin();
+				j != i->second.end(); ++j) {
+			lua_newtable(L);
+			lua_pushnumber(L, j->second.count);
+			lua_setfield(L, -2, "count");
+			lua_pushnumber(L, j->second.time_us / 1000000.0);
+			lua_setfield(L, -2, "time");
+			lua_setfield(L, -2, j->first.c_str());
+		}
+		lua_setfield(L, -2, i->first.c_str());
+	}
+	return 1;
+}
+
+// clear_callback_stats()
+int ModApiServer::l_clear_callback_stats(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	getScriptApiBase(L)->getCallbackStats()->clear();
+	return 0;
+}
+
+// get_memory_stats()
+// returns {[part] = bytes, loaded_block_count = n, active_object_count = n,
+//          peers = {[playername] = bytes}}
+int ModApiServer::l_get_memory_stats(lua_State *L)
+{
+	ServerMemoryStats stats;
+	getServer(L)->getMemoryStats(stats);
+
+	lua_newtable(L);
+	for (std::map<std::string, u64>::iterator
+			i = stats.parts.begin();
+			i != stats.parts.end(); ++i) {
+		lua_pushnumber(L, i->second);
+		lua_setfield(L, -2, i->first.c_str());
+	}
+	lua_pushnumber(L, stats.loaded_blocks);
+	lua_setfield(L, -2, "loaded_block_count");
+	lua_pushnumber(L, stats.active_objects);
+	lua_setfield(L, -2, "active_object_count");
+	lua_newtable(L);
+	for (std::map<u16, u32>::iterator
+			i = stats.peer_buffers.begin();
+			i != stats.peer_buffers.end(); ++i) {
+		Player *player = getEnv(L)->getPlayer(i->first);
+		if (player == NULL)
+			continue;
+		lua_pushnumber(L, i->second);
+		lua_setfield(L, -2, player->getName());
+	}
+	lua_setfield(L, -2, "peers");
+	return 1;
+}
+
 // sound_play(spec, parameters)
 int ModApiServer::l_sound_play(lua_State *L)
 {
@@ -450,6 +544,72 @@ int ModApiServer::l_notify_authentication_modified(lua_State *L)
 	return 0;
 }
 
+// pregenerate(minp, maxp)
+// minp, maxp = {x=num, y=num, z=num}
+int ModApiServer::l_pregenerate(lua_State *L)
+{
+	v3s16 minp = read_v3s16(L, 1);
+	v3s16 maxp = read_v3s16(L, 2);
+	getServer(L)->getPregenerator()->start(minp, maxp);
+	return 0;
+}
+
+// pregenerate_stop()
+int ModApiServer::l_pregenerate_stop(lua_State *L)
+{
+	getServer(L)->getPregenerator()->stop();
+	return 0;
+}
+
+// get_pregenerate_progress()
+// returns {minp=, maxp=, done=, total=, eta=} or nil if not pregenerating
+int ModApiServer::l_get_pregenerate_progress(lua_State *L)
+{
+	MapPregenerator *pregen = getServer(L)->getPregenerator();
+	u32 done, total;
+	float eta;
+	if (!pregen->getProgress(&done, &total, &eta))
+		return 0;
+
+	v3s16 minp, maxp;
+	pregen->getArea(&minp, &maxp);
+
+	lua_newtable(L);
+	push_v3s16(L, minp);
+	lua_setfield(L, -2, "minp");
+	push_v3s16(L, maxp);
+	lua_setfield(L, -2, "maxp");
+	lua_pushnumber(L, done);
+	lua_setfield(L, -2, "done");
+	lua_pushnumber(L, total);
+	lua_setfield(L, -2, "total");
+	if (eta >= 0) {
+		lua_pushnumber(L, eta);
+		lua_setfield(L, -2, "eta");
+	}
+	return 1;
+}
+
+// do_async_callback(serialized_func, serialized_param) -> job id
+int ModApiServer::l_do_async_callback(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	size_t func_length, param_length;
+	const char *func = luaL_checklstring(L, 1, &func_length);
+	const char *param = luaL_checklstring(L, 2, &param_length);
+	lua_pushinteger(L, getServer(L)->getScriptIface()->queueAsync(
+			std::string(func, func_length), std::string(param, param_length)));
+	return 1;
+}
+
+// get_finished_jobs() -> list of {jobid=, retval=}
+int ModApiServer::l_get_finished_jobs(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	getServer(L)->getScriptIface()->pushFinishedAsyncJobs(L);
+	return 1;
+}
+
 #ifndef NDEBUG
 // cause_error(type_of_error)
 int ModApiServer::l_cause_error(lua_State *L)
@@ -485,6 +645,10 @@ void ModApiServer::Initialize(lua_State *L, int top)
 	API_FCT(request_shutdown);
 	API_FCT(get_server_status);
 	API_FCT(get_worldpath);
+	API_FCT(write_profiler_trace);
+	API_FCT(get_callback_stats);
+	API_FCT(clear_callback_stats);
+	API_FCT(get_memory_stats);
 	API_FCT(is_singleplayer);
 
 	API_FCT(get_current_modname);
@@ -507,6 +671,13 @@ void ModApiServer::Initialize(lua_State *L, int top)
 	API_FCT(unban_player_or_ip);
 	API_FCT(notify_authentication_modified);
 
+	API_FCT(pregenerate);
+	API_FCT(pregenerate_stop);
+	API_FCT(get_pregenerate_progress);
+
+	API_FCT(do_async_callback);
+	API_FCT(get_finished_jobs);
+
 #ifndef NDEBUG
 	API_FCT(cause_error);
 #endif
@@ -33,6 +33,18 @@ class ModApiServer : public ModApiBase {
 	// get_worldpath()
 	static int l_get_worldpath(lua_State *L);
 
+	// write_profiler_trace()
+	static int l_write_profiler_trace(lua_State *L);
+
+	// get_callback_stats()
+	static int l_get_callback_stats(lua_State *L);
+
+	// clear_callback_stats()
+	static int l_clear_callback_stats(lua_State *L);
+
+	// get_memory_stats()
+	static int l_get_memory_stats(lua_State *L);
+
 	// is_singleplayer()
 	static int l_is_singleplayer(lua_State *L);
 
@@ -88,6 +100,21 @@ class ModApiServer : public ModApiBase {
 	// notify_authentication_modified(name)
 	static int l_notify_authentication_modified(lua_State *L);
 
+	// pregenerate(minp, maxp)
+	static int l_pregenerate(lua_State *L);
+
+	// pregenerate_stop()
+	static int l_pregenerate_stop(lua_State *L);
+
+	// get_pregenerate_progress() -> table or nil
+	static int l_get_pregenerate_progress(lua_State *L);
+
+	// do_async_callback(serialized_func, serialized_param) -> job id
+	static int l_do_async_callback(lua_State *L);
+
+	// get_finished_jobs() -> list of {jobid=, retval=}
+	static int l_get_finished_jobs(lua_State *L);
+
 #ifndef NDEBUG
 	//  cause_error(type_of_error)
 	static int l_cause_error(lua_State *L);
@@ -67,7 +67,12 @@ int LuaVoxelManip::l_get_data(lua_State *L)
 
 	int volume = vm->m_area.getVolume();
 
-	lua_newtable(L);
+	// A table given as buffer is filled in place, so that a mapgen
+	// can reuse one for every chunk instead of making a new one
+	if (lua_istable(L, 2))
+		lua_pushvalue(L, 2);
+	else
+		lua_createtable(L, volume, 0);
 	for (int i = 0; i != volume; i++) {
 		lua_Integer cid = vm->m_data[i].getContent();
 		lua_pushinteger(L, cid);
@@ -150,8 +155,11 @@ int LuaVoxelManip::l_update_liquids(lua_State *L)
 	mg.vm   = vm;
 	mg.ndef = ndef;
 
-	mg.updateLiquid(&map->m_transforming_liquid,
+	UniqueQueue<v3s16> transforming_liquid;
+	mg.updateLiquid(&transforming_liquid,
 			vm->m_area.MinEdge, vm->m_area.MaxEdge);
+	while (transforming_liquid.size() > 0)
+		map->transforming_liquid_add(transforming_liquid.pop_front());
 
 	return 0;
 }
@@ -224,7 +232,10 @@ int LuaVoxelManip::l_get_light_data(lua_State *L)
 
 	int volume = vm->m_area.getVolume();
 
-	lua_newtable(L);
+	if (lua_istable(L, 2))
+		lua_pushvalue(L, 2);
+	else
+		lua_createtable(L, volume, 0);
 	for (int i = 0; i != volume; i++) {
 		lua_Integer light = vm->m_data[i].param1;
 		lua_pushinteger(L, light);
@@ -266,7 +277,10 @@ int LuaVoxelManip::l_get_param2_data(lua_State *L)
 
 	int volume = vm->m_area.getVolume();
 
-	lua_newtable(L);
+	if (lua_istable(L, 2))
+		lua_pushvalue(L, 2);
+	else
+		lua_createtable(L, volume, 0);
 	for (int i = 0; i != volume; i++) {
 		lua_Integer param2 = vm->m_data[i].param2;
 		lua_pushinteger(L, param2);
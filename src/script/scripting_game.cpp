@@ -20,6 +20,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "scripting_game.h"
 #include "server.h"
 #include "log.h"
+#include "settings.h"
+#include "main.h" // for g_settings
+#include "util/numeric.h"
+#include "porting.h"
 #include "cpp_api/s_internal.h"
 #include "lua_api/l_base.h"
 #include "lua_api/l_craft.h"
@@ -42,7 +46,9 @@ extern "C" {
 #include "lualib.h"
 }
 
-GameScripting::GameScripting(Server* server)
+GameScripting::GameScripting(Server* server):
+	m_gc_stepped(false),
+	m_gc_base_kb(0)
 {
 	setServer(server);
 
@@ -93,10 +99,69 @@ void GameScripting::InitializeModApi(lua_State *L, int top)
 	LuaPerlinNoiseMap::Register(L);
 	LuaPseudoRandom::Register(L);
 	LuaVoxelManip::Register(L);
+	LuaRaycast::Register(L);
 	NodeMetaRef::Register(L);
 	NodeTimerRef::Register(L);
 	ObjectRef::Register(L);
 	LuaSettings::Register(L);
+
+	// The async threads have their own states with the thread-safe
+	// functions only; everything else goes through the serialized
+	// parameters and results
+	ModApiUtil::InitializeAsync(asyncEngine);
+	asyncEngine.initialize(MYMAX(g_settings->getS32("server_async_threads"), 1));
+}
+
+unsigned int GameScripting::queueAsync(const std::string &serialized_func,
+		const std::string &serialized_param)
+{
+	return asyncEngine.queueAsyncJob(serialized_func, serialized_param);
+}
+
+void GameScripting::pushFinishedAsyncJobs(lua_State *L)
+{
+	asyncEngine.pushFinishedJobs(L);
+}
+
+u32 GameScripting::stepGarbageCollector(u32 budget_us, u32 limit_kb)
+{
+	lua_State *L = getStack();
+
+	if (budget_us == 0) {
+		if (m_gc_stepped) {
+			lua_gc(L, LUA_GCRESTART, 0);
+			m_gc_stepped = false;
+		}
+		return lua_gc(L, LUA_GCCOUNT, 0);
+	}
+
+	u32 kb = lua_gc(L, LUA_GCCOUNT, 0);
+	if (!m_gc_stepped) {
+		m_gc_stepped = true;
+		m_gc_base_kb = kb;
+	}
+
+	if (limit_kb != 0 && kb > m_gc_base_kb + limit_kb) {
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		m_gc_base_kb = lua_gc(L, LUA_GCCOUNT, 0);
+	} else {
+		u32 start_us = porting::getTimeUs();
+		// A step of 16 KiB at a time keeps the checks of the time cheap
+		// next to the work; a finished cycle is enough for one step
+		// of the server
+		for (;;) {
+			if (lua_gc(L, LUA_GCSTEP, 16)) {
+				m_gc_base_kb = lua_gc(L, LUA_GCCOUNT, 0);
+				break;
+			}
+			if (porting::getTimeUs() - start_us >= budget_us)
+				break;
+		}
+	}
+
+	// Stepping sets the threshold of the automatic collection again
+	lua_gc(L, LUA_GCSTOP, 0);
+	return lua_gc(L, LUA_GCCOUNT, 0);
 }
 
 void log_deprecated(std::string message)
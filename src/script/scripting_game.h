@@ -27,6 +27,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "cpp_api/s_node.h"
 #include "cpp_api/s_player.h"
 #include "cpp_api/s_server.h"
+#include "cpp_api/s_async.h"
 
 /*****************************************************************************/
 /* Scripting <-> Game Interface                                              */
@@ -46,8 +47,29 @@ class GameScripting
 
 	// use ScriptApiBase::loadMod() to load mods
 
+	// Pass a job of minetest.handle_async() to the async threads
+	unsigned int queueAsync(const std::string &serialized_func,
+			const std::string &serialized_param);
+	// Pushes a list of the jobs finished since the last call
+	void pushFinishedAsyncJobs(lua_State *L);
+
+	/*
+		With a budget, the automatic collection of Lua is stopped and the
+		collector is stepped for up to budget_us instead; a full collection
+		is only done when the heap has grown more than limit_kb since the
+		last finished cycle (0 = never). A budget of 0 gives the collection
+		back to Lua. Returns the size of the heap in KiB.
+	*/
+	u32 stepGarbageCollector(u32 budget_us, u32 limit_kb);
+
 private:
 	void InitializeModApi(lua_State *L, int top);
+
+	bool m_gc_stepped;
+	// Size of the heap at the end of the last cycle
+	u32 m_gc_base_kb;
+
+	AsyncEngine asyncEngine;
 };
 
 void log_deprecated(std::string message);
@@ -102,6 +102,84 @@ void compressZlib(const std::string &data, std::ostream &os, int level)
 	compressZlib(databuf, os, level);
 }
 
+// Gives back to the stream the input that inflate didn't take
+static void ungetZlibInput(std::istream &is, u32 count)
+{
+	if(count == 0)
+		return;
+	// String and file streams can just seek back
+	is.seekg(-(std::streamoff)count, std::ios_base::cur);
+	if(!is.fail())
+		return;
+	is.clear();
+	for(u32 i=0; i < count; i++)
+	{
+		is.unget();
+		if(is.fail() || is.bad())
+		{
+			dstream<<"unget #"<<i<<" failed"<<std::endl;
+			dstream<<"fail="<<is.fail()<<" bad="<<is.bad()<<std::endl;
+			throw SerializationError("decompressZlib: unget failed");
+		}
+	}
+}
+
+u32 decompressZlib(std::istream &is, u8 *dst, u32 dst_size)
+{
+	z_stream z;
+	const s32 bufsize = 16384;
+	char input_buffer[bufsize];
+	int status = 0;
+
+	z.zalloc = Z_NULL;
+	z.zfree = Z_NULL;
+	z.opaque = Z_NULL;
+
+	if(inflateInit(&z) != Z_OK)
+		throw SerializationError("decompressZlib: inflateInit failed");
+
+	// Inflate straight to dst
+	z.next_out = (Bytef*)dst;
+	z.avail_out = dst_size;
+	z.avail_in = 0;
+
+	for(;;)
+	{
+		if(z.avail_in == 0)
+		{
+			z.next_in = (Bytef*)input_buffer;
+			z.avail_in = is.readsome(input_buffer, bufsize);
+		}
+		if(z.avail_in == 0)
+			break;
+
+		status = inflate(&z, Z_NO_FLUSH);
+
+		if(status == Z_NEED_DICT || status == Z_DATA_ERROR
+				|| status == Z_MEM_ERROR)
+		{
+			zerr(status);
+			inflateEnd(&z);
+			throw SerializationError("decompressZlib: inflate failed");
+		}
+		if(status == Z_STREAM_END)
+		{
+			u32 unused = z.avail_in;
+			inflateEnd(&z);
+			ungetZlibInput(is, unused);
+			return dst_size - z.avail_out;
+		}
+		if(z.avail_out == 0)
+		{
+			inflateEnd(&z);
+			throw SerializationError("decompressZlib: output is too large");
+		}
+	}
+
+	inflateEnd(&z);
+	return dst_size - z.avail_out;
+}
+
 void decompressZlib(std::istream &is, std::ostream &os)
 {
 	z_stream z;
@@ -166,16 +244,7 @@ void decompressZlib(std::istream &is, std::ostream &os)
 			//dstream<<"z.avail_in="<<z.avail_in<<std::endl;
 			//dstream<<"fail="<<is.fail()<<" bad="<<is.bad()<<std::endl;
 			// Unget all the data that inflate didn't take
-			for(u32 i=0; i < z.avail_in; i++)
-			{
-				is.unget();
-				if(is.fail() || is.bad())
-				{
-					dstream<<"unget #"<<i<<" failed"<<std::endl;
-					dstream<<"fail="<<is.fail()<<" bad="<<is.bad()<<std::endl;
-					throw SerializationError("decompressZlib: unget failed");
-				}
-			}
+			ungetZlibInput(is, z.avail_in);
 			
 			break;
 		}
@@ -81,6 +81,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 void compressZlib(SharedBuffer<u8> data, std::ostream &os, int level = -1);
 void compressZlib(const std::string &data, std::ostream &os, int level = -1);
 void decompressZlib(std::istream &is, std::ostream &os);
+// Inflates to dst and returns the size of the data.  The data must fit.
+u32 decompressZlib(std::istream &is, u8 *dst, u32 dst_size);
 
 // These choose between zlib and a self-made one according to version
 void compress(SharedBuffer<u8> data, std::ostream &os, u8 version);
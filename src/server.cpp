@@ -43,10 +43,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "itemdef.h"
 #include "craftdef.h"
 #include "emerge.h"
+#include "pregen.h"
+#include "metrics.h"
+#include "packettrace.h"
+#include "workerpool.h"
+#include "pathfinder.h"
 #include "mapgen.h"
 #include "mg_biome.h"
 #include "content_mapnode.h"
 #include "content_nodemeta.h"
+#include "nodemetadata.h"
 #include "content_abm.h"
 #include "content_sao.h"
 #include "mods.h"
@@ -65,6 +71,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/thread.h"
 #include "defaultsettings.h"
 
+// Most players whose privileges are kept for checkPriv()
+#define PRIVS_CACHE_MAX_PLAYERS 1000
+
 class ClientNotFoundException : public BaseException
 {
 public:
@@ -106,7 +115,9 @@ void * ServerThread::Thread()
 		try{
 			//TimeTaker timer("AsyncRunStep() + Receive()");
 
+			g_step_watchdog.beginStep();
 			m_server->AsyncRunStep();
+			g_step_watchdog.endStep();
 
 			m_server->Receive();
 
@@ -136,6 +147,97 @@ void * ServerThread::Thread()
 	return NULL;
 }
 
+void BlockSendJob::run()
+{
+	server->processBlockSendJob(this);
+}
+
+/*
+	The results of the per-client parts of AsyncRunStep() are kept in
+	vectors in the order of the client list, and applied in that order
+	after the pool is done, so that the packets go out the same way as
+	when the clients are gone through one at a time.
+*/
+
+struct ObjectListUpdate
+{
+	RemoteClient *client;
+	std::vector<u16> removed_objects;
+	std::vector<u16> added_objects;
+	SharedBuffer<u8> packet;
+
+	ObjectListUpdate(RemoteClient *client_):
+		client(client_)
+	{
+	}
+};
+
+class ObjectListTask : public WorkerTask
+{
+	Server *m_server;
+	s16 m_radius;
+	s16 m_player_radius;
+	std::vector<ObjectListUpdate> &m_updates;
+
+public:
+
+	ObjectListTask(Server *server, s16 radius, s16 player_radius,
+			std::vector<ObjectListUpdate> &updates):
+		m_server(server),
+		m_radius(radius),
+		m_player_radius(player_radius),
+		m_updates(updates)
+	{
+	}
+
+	void run(u32 index)
+	{
+		ObjectListUpdate &u = m_updates[index];
+		m_server->makeObjectListUpdate(u.client, m_radius, m_player_radius,
+				u.removed_objects, u.added_objects, u.packet);
+	}
+};
+
+struct ObjectMessageUpdate
+{
+	RemoteClient *client;
+	SharedBuffer<u8> reliable;
+	SharedBuffer<u8> unreliable;
+
+	ObjectMessageUpdate(RemoteClient *client_):
+		client(client_)
+	{
+	}
+};
+
+class ObjectMessageTask : public WorkerTask
+{
+	Server *m_server;
+	const ActiveObjectMessageBuffer &m_messages;
+	const std::vector<std::pair<u16, u32> > &m_order;
+	std::vector<ObjectMessageUpdate> &m_updates;
+
+public:
+
+	ObjectMessageTask(Server *server,
+			const ActiveObjectMessageBuffer &messages,
+			const std::vector<std::pair<u16, u32> > &order,
+			std::vector<ObjectMessageUpdate> &updates):
+		m_server(server),
+		m_messages(messages),
+		m_order(order),
+		m_updates(updates)
+	{
+	}
+
+	void run(u32 index)
+	{
+		ObjectMessageUpdate &u = m_updates[index];
+		m_server->makeObjectMessages(u.client, m_messages, m_order,
+				u.reliable, u.unreliable);
+	}
+};
+
 v3f ServerSoundParams::getPos(ServerEnvironment *env, bool *pos_exists) const
 {
 	if(pos_exists) *pos_exists = false;
@@ -159,6 +261,67 @@ v3f ServerSoundParams::getPos(ServerEnvironment *env, bool *pos_exists) const
 
 
 
+/*
+	A part of the server startup that doesn't depend on the others, run on
+	the worker pool while the server thread loads the mods
+*/
+class ServerStartupJob : public WorkerJob
+{
+public:
+	typedef void (Server::*Step)();
+
+	ServerStartupJob(Server *server, Step step):
+		m_server(server),
+		m_step(step),
+		m_waited(false)
+	{
+		getWorkerPool()->submit(this, WORKER_PRIORITY_HIGH);
+	}
+
+	// Also when the startup fails elsewhere, the step mustn't outlive
+	// what it works on
+	~ServerStartupJob()
+	{
+		if(!m_waited)
+			m_done.Wait();
+	}
+
+	void run()
+	{
+		try{
+			(m_server->*m_step)();
+		}
+		catch(std::exception &e){
+			m_error = e.what();
+		}
+		m_done.Post();
+	}
+
+	// Waits for the step without throwing; wait() still throws later
+	void finish()
+	{
+		if(!m_waited){
+			m_done.Wait();
+			m_waited = true;
+		}
+	}
+
+	// Throws what the step failed with
+	void wait()
+	{
+		finish();
+		if(m_error != "")
+			throw ServerError(m_error);
+	}
+
+private:
+	Server *m_server;
+	Step m_step;
+	JSemaphore m_done;
+	bool m_waited;
+	std::string m_error;
+};
+
 /*
 	Server
 */
@@ -181,14 +344,21 @@ Server::Server(
 			this),
 	m_banmanager(NULL),
 	m_rollback(NULL),
+	m_rollback_job(NULL),
 	m_enable_rollback_recording(false),
 	m_emerge(NULL),
+	m_pregen(NULL),
 	m_script(NULL),
 	m_itemdef(createItemDefManager()),
 	m_nodedef(createNodeDefManager()),
 	m_craftdef(createCraftDefManager()),
 	m_event(new EventManager()),
 	m_thread(NULL),
+	m_block_send_inline(false),
+	m_block_send_jobs_running(0),
+	m_metrics_thread(NULL),
+	m_packet_trace(NULL),
+	m_packet_replay(false),
 	m_time_of_day_send_timer(0),
 	m_uptime(0),
 	m_clients(&m_con),
@@ -204,6 +374,9 @@ Server::Server(
 	m_objectdata_timer = 0.0;
 	m_emergethread_trigger_timer = 0.0;
 	m_savemap_timer = 0.0;
+	m_metrics_timer = 0.0;
+	m_memory_stats_timer = 0.0;
+	m_lua_memory_kb = 0;
 
 	m_step_dtime = 0.0;
 	m_lag = g_settings->getFloat("dedicated_server_step");
@@ -232,6 +405,30 @@ Server::Server(
 	// Create server thread
 	m_thread = new ServerThread(this);
 
+	// Without worker threads, there is no point in making block jobs
+	m_block_send_inline = getWorkerPool()->getThreadCount() == 0;
+
+	// Create metrics thread
+	float metrics_interval = g_settings->getFloat("metrics_interval");
+	if(metrics_interval > 0)
+		m_metrics_thread = new MetricsThread(
+				m_path_world + DIR_DELIM + "metrics.prom", metrics_interval);
+
+	// Open packet trace
+	std::string packet_trace_path = g_settings->get("packet_trace_path");
+	if(packet_trace_path != ""){
+		m_packet_trace = new PacketTraceWriter(packet_trace_path);
+		if(m_packet_trace->isOpen()){
+			actionstream<<"Recording the received packets to "
+					<<packet_trace_path<<std::endl;
+		} else {
+			errorstream<<"Can't write packet trace "<<packet_trace_path
+					<<std::endl;
+			delete m_packet_trace;
+			m_packet_trace = NULL;
+		}
+	}
+
 	// Create emerge manager
 	m_emerge = new EmergeManager(this);
 
@@ -243,9 +440,6 @@ Server::Server(
 	std::string ban_path = m_path_world + DIR_DELIM "ipban.txt";
 	m_banmanager = new BanManager(ban_path);
 
-	// Create rollback manager
-	m_rollback = new RollbackManager(m_path_world, this);
-
 	ModConfiguration modconf(m_path_world);
 	m_mods = modconf.getMods();
 	std::vector<ModSpec> unsatisfied_mods = modconf.getUnsatisfiedMods();
@@ -292,8 +486,15 @@ Server::Server(
 		errorstream << std::endl;
 	}
 
+	// Hashing the media and opening (or migrating) the rollback database
+	// only need the world and the mod list; they can be done while the
+	// mods are loaded
+	ServerStartupJob media_job(this, &Server::fillMediaCache);
+	ServerStartupJob rollback_job(this, &Server::openRollback);
+	m_rollback_job = &rollback_job;
+
 	// Lock environment
-	JMutexAutoLock envlock(m_env_mutex);
+	RWMutexWriteLock envlock(m_env_mutex);
 
 	// Initialize scripting
 	infostream<<"Server: Initializing Lua"<<std::endl;
@@ -330,8 +531,10 @@ Server::Server(
 		}
 	}
 
-	// Read Textures and calculate sha1 sums
-	fillMediaCache();
+	// The mods may have used the rollback manager already, which waited
+	// for the job then
+	m_rollback_job = NULL;
+	rollback_job.wait();
 
 	// Apply item aliases in the node definition manager
 	m_nodedef->updateAliases(m_itemdef);
@@ -339,6 +542,9 @@ Server::Server(
 	// Perform pending node name resolutions
 	m_nodedef->getResolver()->resolveNodes();
 
+	// Index the crafting recipes now that all of them are registered
+	m_craftdef->initHashes(this);
+
 	// Load the mapgen params from global settings now after any
 	// initial overrides have been set by the mods
 	m_emerge->loadMapgenParams();
@@ -355,6 +561,10 @@ Server::Server(
 	// Initialize mapgens
 	m_emerge->initMapgens();
 
+	// Resume an unfinished pregeneration job, if any
+	m_pregen = new MapPregenerator(m_emerge,
+		m_path_world + DIR_DELIM "pregen.txt");
+
 	// Give environment reference to scripting api
 	m_script->initializeEnvironment(m_env);
 
@@ -372,6 +582,9 @@ Server::Server(
 	add_legacy_abms(m_env, m_nodedef);
 
 	m_liquid_transform_every = g_settings->getFloat("liquid_update");
+
+	// The media are only needed once clients come
+	media_job.wait();
 }
 
 Server::~Server()
@@ -382,7 +595,7 @@ Server::~Server()
 	SendChatMessage(PEER_ID_INEXISTENT, L"*** Server shutting down");
 
 	{
-		JMutexAutoLock envlock(m_env_mutex);
+		RWMutexWriteLock envlock(m_env_mutex);
 
 		// Execute script shutdown hooks
 		m_script->on_shutdown();
@@ -397,6 +610,14 @@ Server::~Server()
 	// Stop threads
 	stop();
 	delete m_thread;
+	delete m_metrics_thread;
+	delete m_packet_trace;
+	while(!m_block_send_done.empty())
+		delete m_block_send_done.pop_frontNoEx();
+
+	// Saves the pregeneration state; must be done before the emerge
+	// queue is cleared
+	delete m_pregen;
 
 	// stop all emerge threads before deleting players that may have
 	// requested blocks to be emerged
@@ -440,8 +661,10 @@ void Server::start(Address bind_addr)
 	m_con.SetTimeoutMs(30);
 	m_con.Serve(bind_addr);
 
-	// Start thread
+	// Start threads
 	m_thread->Start();
+	if(m_metrics_thread)
+		m_metrics_thread->Start();
 
 	// ASCII art for the win!
 	actionstream
@@ -465,8 +688,21 @@ void Server::stop()
 
 	// Stop threads (set run=false first so both start stopping)
 	m_thread->Stop();
+	if(m_metrics_thread)
+		m_metrics_thread->Stop();
 	//m_emergethread.setRun(false);
 	m_thread->Wait();
+	// The block jobs use the server until they are done
+	for(;;){
+		{
+			JMutexAutoLock lock(m_block_send_pending_mutex);
+			if(m_block_send_jobs_running == 0)
+				break;
+		}
+		sleep_ms(1);
+	}
+	if(m_metrics_thread)
+		m_metrics_thread->Wait();
 	//m_emergethread.stop();
 
 	infostream<<"Server: Threads stopped"<<std::endl;
@@ -501,8 +737,12 @@ void Server::AsyncRunStep(bool initial_step)
 		dtime = m_step_dtime;
 	}
 
+	if(m_packet_trace)
+		m_packet_trace->writeStep(dtime, initial_step);
+
 	{
 		// Send blocks to clients
+		StepWatchdogPhase wp("block sends");
 		SendBlocks(dtime);
 	}
 
@@ -511,6 +751,9 @@ void Server::AsyncRunStep(bool initial_step)
 
 	g_profiler->add("Server::AsyncRunStep with dtime (num)", 1);
 
+	MetricsScopeTimer step_timer(&g_server_metrics.step_time);
+	u32 step_start_us = porting::getTimeUs();
+
 	//infostream<<"Server steps "<<dtime<<std::endl;
 	//infostream<<"Server::AsyncRunStep(): dtime="<<dtime<<std::endl;
 
@@ -532,7 +775,7 @@ void Server::AsyncRunStep(bool initial_step)
 		Update time of day and overall game time
 	*/
 	{
-		JMutexAutoLock envlock(m_env_mutex);
+		RWMutexWriteLock envlock(m_env_mutex);
 
 		m_env->setTimeOfDaySpeed(g_settings->getFloat("time_speed"));
 
@@ -551,7 +794,7 @@ void Server::AsyncRunStep(bool initial_step)
 	}
 
 	{
-		JMutexAutoLock lock(m_env_mutex);
+		RWMutexWriteLock lock(m_env_mutex);
 		// Figure out and report maximum lag to environment
 		float max_lag = m_env->getMaxLagEstimate();
 		max_lag *= 0.9998; // Decrease slowly (about half per 5 minutes)
@@ -568,14 +811,26 @@ void Server::AsyncRunStep(bool initial_step)
 		m_env->step(dtime);
 	}
 
+	// Send what the scripts sent to the clients during the step
+	m_clients.flushBatches();
+
 	const float map_timer_and_unload_dtime = 2.92;
 	if(m_map_timer_and_unload_interval.step(dtime, map_timer_and_unload_dtime))
 	{
-		JMutexAutoLock lock(m_env_mutex);
+		RWMutexWriteLock lock(m_env_mutex);
 		// Run Map's timers and unload unused data
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
+		StepWatchdogPhase wp("map unload");
+		float unload_timeout =
+				g_settings->getFloat("server_unload_unused_data_timeout");
+		// Nobody needs the blocks made by pregeneration when no players
+		// are online; write them out instead of piling them up in memory
+		if (m_pregen->isActive() && m_clients.getActiveClientIDs().empty())
+			unload_timeout = MYMIN(unload_timeout,
+					g_settings->getFloat("pregen_unload_timeout"));
 		m_env->getMap().timerUpdate(map_timer_and_unload_dtime,
-				g_settings->getFloat("server_unload_unused_data_timeout"));
+				unload_timeout, NULL,
+				MYMAX(g_settings->getS32("max_loaded_blocks"), 0));
 	}
 
 	/*
@@ -586,13 +841,14 @@ void Server::AsyncRunStep(bool initial_step)
 		Handle players
 	*/
 	{
-		JMutexAutoLock lock(m_env_mutex);
+		RWMutexWriteLock lock(m_env_mutex);
 
-		std::list<u16> clientids = m_clients.getClientIDs();
+		ClientIDList clientids = m_clients.getActiveClientIDs();
 
 		ScopeProfiler sp(g_profiler, "Server: handle players");
+		StepWatchdogPhase wp("players");
 
-		for(std::list<u16>::iterator
+		for(ClientIDList::const_iterator
 			i = clientids.begin();
 			i != clientids.end(); ++i)
 		{
@@ -627,7 +883,7 @@ void Server::AsyncRunStep(bool initial_step)
 			}
 			if(playersao->m_inventory_not_sent){
 				UpdateCrafting(*i);
-				SendInventory(*i);
+				SendInventory(*i, false);
 			}
 		}
 	}
@@ -638,9 +894,10 @@ void Server::AsyncRunStep(bool initial_step)
 	{
 		m_liquid_transform_timer -= m_liquid_transform_every;
 
-		JMutexAutoLock lock(m_env_mutex);
+		RWMutexWriteLock lock(m_env_mutex);
 
 		ScopeProfiler sp(g_profiler, "Server: liquid transform");
+		StepWatchdogPhase wp("liquids");
 
 		std::map<v3s16, MapBlock*> modified_blocks;
 		m_env->getMap().transformLiquids(modified_blocks);
@@ -690,6 +947,7 @@ void Server::AsyncRunStep(bool initial_step)
 			counter = 0.01;
 		}
 		counter += dtime;
+		ServerList::checkAnnounce();
 	}
 #endif
 
@@ -698,11 +956,12 @@ void Server::AsyncRunStep(bool initial_step)
 	*/
 	{
 		//infostream<<"Server: Checking added and deleted active objects"<<std::endl;
-		JMutexAutoLock envlock(m_env_mutex);
+		RWMutexWriteLock envlock(m_env_mutex);
 
 		m_clients.Lock();
 		std::map<u16, RemoteClient*> clients = m_clients.getClientList();
 		ScopeProfiler sp(g_profiler, "Server: checking added and deleted objs");
+		StepWatchdogPhase wp("object lists");
 
 		// Radius inside which objects are active
 		s16 radius = g_settings->getS16("active_object_send_range_blocks");
@@ -715,118 +974,62 @@ void Server::AsyncRunStep(bool initial_step)
 		radius *= MAP_BLOCKSIZE;
 		player_radius *= MAP_BLOCKSIZE;
 
+		std::vector<ObjectListUpdate> updates;
 		for(std::map<u16, RemoteClient*>::iterator
 			i = clients.begin();
 			i != clients.end(); ++i)
 		{
-			RemoteClient *client = i->second;
-
 			// If definitions and textures have not been sent, don't
 			// send objects either
-			if (client->getState() < CS_DefinitionsSent)
+			if (i->second->getState() < CS_DefinitionsSent)
 				continue;
+			updates.push_back(ObjectListUpdate(i->second));
+		}
 
-			Player *player = m_env->getPlayer(client->peer_id);
-			if(player==NULL)
-			{
-				// This can happen if the client timeouts somehow
-				/*infostream<<"WARNING: "<<__FUNCTION_NAME<<": Client "
-						<<client->peer_id
-						<<" has no associated player"<<std::endl;*/
-				continue;
-			}
-			v3s16 pos = floatToInt(player->getPosition(), BS);
-
-			std::set<u16> removed_objects;
-			std::set<u16> added_objects;
-			m_env->getRemovedActiveObjects(pos, radius, player_radius,
-					client->m_known_objects, removed_objects);
-			m_env->getAddedActiveObjects(pos, radius, player_radius,
-					client->m_known_objects, added_objects);
+		ObjectListTask task(this, radius, player_radius, updates);
+		getWorkerPool()->run(&task, updates.size());
 
+		for(std::vector<ObjectListUpdate>::iterator
+				i = updates.begin();
+				i != updates.end(); ++i)
+		{
 			// Ignore if nothing happened
-			if(removed_objects.size() == 0 && added_objects.size() == 0)
-			{
-				//infostream<<"active objects: none changed"<<std::endl;
+			if(i->packet.getSize() == 0)
 				continue;
-			}
 
-			std::string data_buffer;
+			RemoteClient *client = i->client;
 
-			char buf[4];
-
-			// Handle removed objects
-			writeU16((u8*)buf, removed_objects.size());
-			data_buffer.append(buf, 2);
-			for(std::set<u16>::iterator
-					i = removed_objects.begin();
-					i != removed_objects.end(); ++i)
+			for(std::vector<u16>::iterator
+					j = i->removed_objects.begin();
+					j != i->removed_objects.end(); ++j)
 			{
-				// Get object
-				u16 id = *i;
-				ServerActiveObject* obj = m_env->getActiveObject(id);
-
-				// Add to data buffer for sending
-				writeU16((u8*)buf, id);
-				data_buffer.append(buf, 2);
-
 				// Remove from known objects
-				client->m_known_objects.erase(id);
+				client->m_known_objects.erase(*j);
 
+				ServerActiveObject* obj = m_env->getActiveObject(*j);
 				if(obj && obj->m_known_by_count > 0)
 					obj->m_known_by_count--;
 			}
 
-			// Handle added objects
-			writeU16((u8*)buf, added_objects.size());
-			data_buffer.append(buf, 2);
-			for(std::set<u16>::iterator
-					i = added_objects.begin();
-					i != added_objects.end(); ++i)
+			for(std::vector<u16>::iterator
+					j = i->added_objects.begin();
+					j != i->added_objects.end(); ++j)
 			{
-				// Get object
-				u16 id = *i;
-				ServerActiveObject* obj = m_env->getActiveObject(id);
-
-				// Get object type
-				u8 type = ACTIVEOBJECT_TYPE_INVALID;
-				if(obj == NULL)
-					infostream<<"WARNING: "<<__FUNCTION_NAME
-							<<": NULL object"<<std::endl;
-				else
-					type = obj->getSendType();
-
-				// Add to data buffer for sending
-				writeU16((u8*)buf, id);
-				data_buffer.append(buf, 2);
-				writeU8((u8*)buf, type);
-				data_buffer.append(buf, 1);
-
-				if(obj)
-					data_buffer.append(serializeLongString(
-							obj->getClientInitializationData(client->net_proto_version)));
-				else
-					data_buffer.append(serializeLongString(""));
-
 				// Add to known objects
-				client->m_known_objects.insert(id);
+				client->m_known_objects.insert(*j);
 
+				ServerActiveObject* obj = m_env->getActiveObject(*j);
 				if(obj)
 					obj->m_known_by_count++;
 			}
 
-			// Send packet
-			SharedBuffer<u8> reply(2 + data_buffer.size());
-			writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_REMOVE_ADD);
-			memcpy((char*)&reply[2], data_buffer.c_str(),
-					data_buffer.size());
 			// Send as reliable
-			m_clients.send(client->peer_id, 0, reply, true);
+			m_clients.send(client->peer_id, 0, i->packet, true);
 
 			verbosestream<<"Server: Sent object remove/add: "
-					<<removed_objects.size()<<" removed, "
-					<<added_objects.size()<<" added, "
-					<<"packet size is "<<reply.getSize()<<std::endl;
+					<<i->removed_objects.size()<<" removed, "
+					<<i->added_objects.size()<<" added, "
+					<<"packet size is "<<i->packet.getSize()<<std::endl;
 		}
 		m_clients.Unlock();
 #if 0
@@ -861,116 +1064,49 @@ void Server::AsyncRunStep(bool initial_step)
 		Send object messages
 	*/
 	{
-		JMutexAutoLock envlock(m_env_mutex);
+		RWMutexWriteLock envlock(m_env_mutex);
 		ScopeProfiler sp(g_profiler, "Server: sending object messages");
+		StepWatchdogPhase wp("object messages");
 
-		// Key = object id
-		// Value = data sent by object
-		std::map<u16, std::list<ActiveObjectMessage>* > buffered_messages;
-
-		// Get active object messages from environment
-		for(;;)
-		{
-			ActiveObjectMessage aom = m_env->getActiveObjectMessage();
-			if(aom.id == 0)
-				break;
-
-			std::list<ActiveObjectMessage>* message_list = NULL;
-			std::map<u16, std::list<ActiveObjectMessage>* >::iterator n;
-			n = buffered_messages.find(aom.id);
-			if(n == buffered_messages.end())
-			{
-				message_list = new std::list<ActiveObjectMessage>;
-				buffered_messages[aom.id] = message_list;
-			}
-			else
-			{
-				message_list = n->second;
-			}
-			message_list->push_back(aom);
-		}
+		// Get active object messages from environment, grouped by object
+		// in the order each object sent them
+		ActiveObjectMessageBuffer &messages = m_env->getActiveObjectMessages();
+		std::vector<std::pair<u16, u32> > order;
+		order.reserve(messages.size());
+		for(u32 i = 0; i < messages.size(); i++)
+			order.push_back(std::make_pair(messages[i].id, i));
+		std::sort(order.begin(), order.end());
 
 		m_clients.Lock();
 		std::map<u16, RemoteClient*> clients = m_clients.getClientList();
-		// Route data to every client
+		std::vector<ObjectMessageUpdate> updates;
 		for(std::map<u16, RemoteClient*>::iterator
 			i = clients.begin();
 			i != clients.end(); ++i)
+			updates.push_back(ObjectMessageUpdate(i->second));
+
+		// Route data to every client
+		ObjectMessageTask task(this, messages, order, updates);
+		getWorkerPool()->run(&task, updates.size());
+
+		for(std::vector<ObjectMessageUpdate>::iterator
+				i = updates.begin();
+				i != updates.end(); ++i)
 		{
-			RemoteClient *client = i->second;
-			std::string reliable_data;
-			std::string unreliable_data;
-			// Go through all objects in message buffer
-			for(std::map<u16, std::list<ActiveObjectMessage>* >::iterator
-					j = buffered_messages.begin();
-					j != buffered_messages.end(); ++j)
-			{
-				// If object is not known by client, skip it
-				u16 id = j->first;
-				if(client->m_known_objects.find(id) == client->m_known_objects.end())
-					continue;
-				// Get message list of object
-				std::list<ActiveObjectMessage>* list = j->second;
-				// Go through every message
-				for(std::list<ActiveObjectMessage>::iterator
-						k = list->begin(); k != list->end(); ++k)
-				{
-					// Compose the full new data with header
-					ActiveObjectMessage aom = *k;
-					std::string new_data;
-					// Add object id
-					char buf[2];
-					writeU16((u8*)&buf[0], aom.id);
-					new_data.append(buf, 2);
-					// Add data
-					new_data += serializeString(aom.datastring);
-					// Add data to buffer
-					if(aom.reliable)
-						reliable_data += new_data;
-					else
-						unreliable_data += new_data;
-				}
-			}
-			/*
-				reliable_data and unreliable_data are now ready.
-				Send them.
-			*/
-			if(reliable_data.size() > 0)
+			if(i->reliable.getSize() > 2)
 			{
-				SharedBuffer<u8> reply(2 + reliable_data.size());
-				writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_MESSAGES);
-				memcpy((char*)&reply[2], reliable_data.c_str(),
-						reliable_data.size());
 				// Send as reliable
-				m_clients.send(client->peer_id, 0, reply, true);
+				m_clients.send(i->client->peer_id, 0, i->reliable, true);
 			}
-			if(unreliable_data.size() > 0)
+			if(i->unreliable.getSize() > 2)
 			{
-				SharedBuffer<u8> reply(2 + unreliable_data.size());
-				writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_MESSAGES);
-				memcpy((char*)&reply[2], unreliable_data.c_str(),
-						unreliable_data.size());
 				// Send as unreliable
-				m_clients.send(client->peer_id, 1, reply, false);
+				m_clients.send(i->client->peer_id, 1, i->unreliable, false);
 			}
-
-			/*if(reliable_data.size() > 0 || unreliable_data.size() > 0)
-			{
-				infostream<<"Server: Size of object message data: "
-						<<"reliable: "<<reliable_data.size()
-						<<", unreliable: "<<unreliable_data.size()
-						<<std::endl;
-			}*/
 		}
 		m_clients.Unlock();
 
-		// Clear buffered_messages
-		for(std::map<u16, std::list<ActiveObjectMessage>* >::iterator
-				i = buffered_messages.begin();
-				i != buffered_messages.end(); ++i)
-		{
-			delete i->second;
-		}
+		messages.clear();
 	}
 
 	/*
@@ -978,7 +1114,9 @@ void Server::AsyncRunStep(bool initial_step)
 	*/
 	{
 		// We will be accessing the environment
-		JMutexAutoLock lock(m_env_mutex);
+		RWMutexWriteLock lock(m_env_mutex);
+
+		StepWatchdogPhase wp("map edits");
 
 		// Don't send too many at a time
 		//u32 count = 0;
@@ -993,6 +1131,19 @@ void Server::AsyncRunStep(bool initial_step)
 		// We'll log the amount of each
 		Profiler prof;
 
+		/*
+			Changed blocks are sent once below, after all events have
+			been looked at. Blocks changed by single node edits are
+			already handled for old clients by sendAddNode() and
+			sendRemoveNode().
+		*/
+		std::set<v3s16> node_edit_blocks;
+		std::set<v3s16> other_edit_blocks;
+		// Nodes whose metadata the clients have to remove
+		std::set<v3s16> cleared_metadata;
+		// Nodes whose metadata was changed
+		std::set<v3s16> changed_metadata;
+
 		while(m_unsent_map_edit_queue.size() != 0)
 		{
 			MapEditEvent* event = m_unsent_map_edit_queue.pop_front();
@@ -1012,6 +1163,10 @@ void Server::AsyncRunStep(bool initial_step)
 				else
 					sendAddNode(event->p, event->n, event->already_known_by_peer,
 							&far_players, 30, event->type == MEET_ADDNODE);
+				node_edit_blocks.insert(event->modified_blocks.begin(),
+						event->modified_blocks.end());
+				if(event->type == MEET_ADDNODE)
+					cleared_metadata.insert(event->p);
 			}
 			else if(event->type == MEET_REMOVENODE)
 			{
@@ -1023,6 +1178,9 @@ void Server::AsyncRunStep(bool initial_step)
 				else
 					sendRemoveNode(event->p, event->already_known_by_peer,
 							&far_players, 30);
+				node_edit_blocks.insert(event->modified_blocks.begin(),
+						event->modified_blocks.end());
+				cleared_metadata.insert(event->p);
 			}
 			else if(event->type == MEET_BLOCK_NODE_METADATA_CHANGED)
 			{
@@ -1030,16 +1188,17 @@ void Server::AsyncRunStep(bool initial_step)
 				prof.add("MEET_BLOCK_NODE_METADATA_CHANGED", 1);
 				setBlockNotSent(event->p);
 			}
+			else if(event->type == MEET_NODE_METADATA_CHANGED)
+			{
+				prof.add("MEET_NODE_METADATA_CHANGED", 1);
+				changed_metadata.insert(event->p);
+			}
 			else if(event->type == MEET_OTHER)
 			{
 				infostream<<"Server: MEET_OTHER"<<std::endl;
 				prof.add("MEET_OTHER", 1);
-				for(std::set<v3s16>::iterator
-						i = event->modified_blocks.begin();
-						i != event->modified_blocks.end(); ++i)
-				{
-					setBlockNotSent(*i);
-				}
+				other_edit_blocks.insert(event->modified_blocks.begin(),
+						event->modified_blocks.end());
 			}
 			else
 			{
@@ -1083,6 +1242,27 @@ void Server::AsyncRunStep(bool initial_step)
 				break;*/
 		}
 
+		// Objects resting on or in changed nodes have to react
+		m_env->wakeObjectsInBlocks(node_edit_blocks);
+		m_env->wakeObjectsInBlocks(other_edit_blocks);
+
+		for(std::set<v3s16>::iterator
+				i = other_edit_blocks.begin();
+				i != other_edit_blocks.end(); ++i)
+		{
+			sendBlockNodeChanges(*i, cleared_metadata, true);
+			node_edit_blocks.erase(*i);
+		}
+		for(std::set<v3s16>::iterator
+				i = node_edit_blocks.begin();
+				i != node_edit_blocks.end(); ++i)
+		{
+			sendBlockNodeChanges(*i, cleared_metadata, false);
+		}
+		// After the nodes, so that the metadata goes to the new ones
+		if(!changed_metadata.empty())
+			sendNodeMetadataChanges(changed_metadata);
+
 		if(event_count >= 5){
 			infostream<<"Server: MapEditEvents:"<<std::endl;
 			prof.print(infostream);
@@ -1112,6 +1292,16 @@ void Server::AsyncRunStep(bool initial_step)
 		}
 	}
 
+	/*
+		Pregenerate the map in the background
+	*/
+	if (m_pregen->isActive()) {
+		RWMutexWriteLock lock(m_env_mutex);
+		ScopeProfiler sp(g_profiler, "Server: map pregeneration");
+		StepWatchdogPhase wp("pregeneration");
+		m_pregen->step(dtime, m_clients.getActiveClientIDs().size());
+	}
+
 	// Save map, players and auth stuff
 	{
 		float &counter = m_savemap_timer;
@@ -1119,9 +1309,10 @@ void Server::AsyncRunStep(bool initial_step)
 		if(counter >= g_settings->getFloat("server_map_save_interval"))
 		{
 			counter = 0.0;
-			JMutexAutoLock lock(m_env_mutex);
+			RWMutexWriteLock lock(m_env_mutex);
 
 			ScopeProfiler sp(g_profiler, "Server: saving stuff");
+			StepWatchdogPhase wp("save");
 
 			// Save ban file
 			if (m_banmanager->isModified()) {
@@ -1136,19 +1327,240 @@ void Server::AsyncRunStep(bool initial_step)
 
 			// Save environment metadata
 			m_env->saveMeta();
+
+			// Save pregeneration progress
+			m_pregen->save();
+		}
+	}
+
+	/*
+		Step the Lua garbage collector in the time left of the step
+	*/
+	{
+		StepWatchdogPhase wp("lua gc");
+		u32 budget_us = MYMAX(g_settings->getFloat("lua_gc_step_budget"), 0)
+				* 1000;
+		if(budget_us > 0){
+			u32 step_us = g_settings->getFloat("dedicated_server_step") * 1000000;
+			u32 used_us = porting::getTimeUs() - step_start_us;
+			// Always a little, so that the collection moves on when the
+			// steps take all their time
+			budget_us = MYMAX(MYMIN(budget_us,
+					used_us < step_us ? step_us - used_us : 0), 100);
+		}
+		u32 limit_kb = MYMAX(g_settings->getS32("lua_gc_memory_limit"), 0) * 1024;
+
+		RWMutexWriteLock envlock(m_env_mutex);
+		u32 gc_start_us = porting::getTimeUs();
+		m_lua_memory_kb = m_script->stepGarbageCollector(budget_us, limit_kb);
+		if(budget_us > 0)
+			g_server_metrics.lua_gc_time.observe(
+					(u32)(porting::getTimeUs() - gc_start_us) / 1000000.0);
+	}
+
+	/*
+		Show where the memory goes in the profiler
+	*/
+	{
+		float &counter = m_memory_stats_timer;
+		counter += dtime;
+		static SettingHandle<float> interval_setting(g_settings,
+				"memory_stats_interval");
+		float interval = interval_setting.get();
+		if(interval > 0 && counter >= interval)
+		{
+			counter = 0.0;
+			ScopeProfiler sp(g_profiler, "Server: memory stats");
+			ServerMemoryStats stats;
+			{
+				RWMutexReadLock lock(m_env_mutex);
+				getMemoryStats(stats);
+			}
+			for(std::map<std::string, u64>::const_iterator
+					i = stats.parts.begin();
+					i != stats.parts.end(); ++i)
+				g_profiler->avg("Server: memory of " + i->first + " [MiB]",
+						i->second / 1048576.0);
+		}
+	}
+
+	/*
+		Update the metrics written by the metrics thread
+	*/
+	if(m_metrics_thread)
+	{
+		float &counter = m_metrics_timer;
+		counter += dtime;
+		if(counter >= m_metrics_thread->getInterval())
+		{
+			counter = 0.0;
+			ScopeProfiler sp(g_profiler, "Server: updating metrics");
+			updateMetrics();
+		}
+	}
+}
+
+void Server::updateMetrics()
+{
+	std::map<std::string, float> gauges;
+
+	ServerMemoryStats memory_stats;
+	{
+		RWMutexReadLock lock(m_env_mutex);
+		gauges["minetest_active_objects"] = m_env->getActiveObjectCount();
+		gauges["minetest_active_blocks"] = m_env->getActiveBlockCount();
+		gauges["minetest_loaded_blocks"] = m_env->getMap().getBlockCount();
+		getMemoryStats(memory_stats);
+	}
+	for(std::map<std::string, u64>::const_iterator
+			i = memory_stats.parts.begin();
+			i != memory_stats.parts.end(); ++i)
+		gauges["minetest_memory_bytes{part=\"" + i->first + "\"}"] =
+				i->second;
+
+	std::vector<u32> queue_lengths;
+	m_emerge->getQueueLengths(queue_lengths);
+	for(u32 i = 0; i < queue_lengths.size(); i++)
+		gauges["minetest_emerge_queue_length{thread=\"" + itos(i) + "\"}"] =
+				queue_lengths[i];
+
+	{
+		JMutexAutoLock lock(m_block_send_pending_mutex);
+		gauges["minetest_block_send_pending"] = m_block_send_pending.size();
+	}
+
+	ClientIDList clients = m_clients.getActiveClientIDs();
+	gauges["minetest_clients"] = clients.size();
+	gauges["minetest_lua_memory_bytes"] = m_lua_memory_kb * 1024.0;
+
+	// The link statistics are read before locking the clients, like in
+	// SendBlocks()
+	std::map<u16, std::string> labels;
+	for(ClientIDList::const_iterator
+			i = clients.begin();
+			i != clients.end(); ++i)
+	{
+		std::string label = "{peer=\"" + itos(*i) + "\"}";
+		labels[*i] = label;
+		gauges["minetest_peer_rtt_seconds" + label] =
+				m_con.getPeerStat(*i, con::AVG_RTT);
+		gauges["minetest_peer_download_kibps" + label] =
+				MYMAX(m_con.getPeerRate(*i, con::AVG_DL_RATE), 0);
+		gauges["minetest_peer_loss_kibps" + label] =
+				MYMAX(m_con.getPeerRate(*i, con::AVG_LOSS_RATE), 0);
+		gauges["minetest_peer_buffered_bytes" + label] =
+				memory_stats.peer_buffers[*i];
+	}
+
+	m_clients.Lock();
+	for(ClientIDList::const_iterator
+			i = clients.begin();
+			i != clients.end(); ++i)
+	{
+		RemoteClient *client = m_clients.lockedGetClientNoEx(*i);
+		if(client == NULL)
+			continue;
+		gauges["minetest_peer_blocks_sending" + labels[*i]] =
+				client->SendingCount();
+	}
+	m_clients.Unlock();
+
+	// Totals of the Lua callbacks of each mod
+	ScriptCallbackStats::Entries callback_stats;
+	m_script->getCallbackStats()->get(callback_stats);
+	for(ScriptCallbackStats::Entries::iterator
+			i = callback_stats.begin();
+			i != callback_stats.end(); ++i)
+	{
+		u32 count = 0;
+		u64 time_us = 0;
+		for(std::map<std::string, ScriptCallbackStats::Entry>::iterator
+				j = i->second.begin();
+				j != i->second.end(); ++j)
+		{
+			count += j->second.count;
+			time_us += j->second.time_us;
 		}
+		std::string label = "{mod=\"" + i->first + "\"}";
+		gauges["minetest_lua_callback_calls" + label] = count;
+		gauges["minetest_lua_callback_seconds" + label] = time_us / 1000000.0;
+	}
+
+	g_server_metrics.setGauges(gauges);
+}
+
+void Server::getMemoryStats(ServerMemoryStats &stats)
+{
+	Map::MemoryStats map_stats;
+	m_env->getMap().getMemoryStats(map_stats);
+	stats.parts["map_blocks"] = map_stats.blocks;
+	stats.parts["node_metadata"] = map_stats.metadata;
+	stats.parts["static_objects"] = map_stats.static_objects;
+	stats.parts["block_caches"] = map_stats.caches;
+	stats.parts["mapgen_caches"] = m_emerge->getCacheMemoryUsage();
+	stats.parts["emerge_vmanips"] = m_emerge->getVManipMemoryUsage();
+	stats.parts["active_objects"] = m_env->getActiveObjectMemoryUsage();
+	stats.parts["lua_heap"] = (u64)m_lua_memory_kb * 1024;
+	stats.parts["rollback_buffer"] =
+			m_rollback ? m_rollback->getBufferMemoryUsage() : 0;
+
+	u64 buffers = 0;
+	ClientIDList clients = m_clients.getActiveClientIDs();
+	for(ClientIDList::const_iterator
+			i = clients.begin();
+			i != clients.end(); ++i)
+	{
+		u32 size = m_con.getPeerBufferedBytes(*i);
+		stats.peer_buffers[*i] = size;
+		buffers += size;
 	}
+	stats.parts["connection_buffers"] = buffers;
+
+	stats.loaded_blocks = m_env->getMap().getBlockCount();
+	stats.active_objects = m_env->getActiveObjectCount();
 }
 
 void Server::Receive()
 {
 	DSTACK(__FUNCTION_NAME);
-	SharedBuffer<u8> data;
-	u16 peer_id;
-	u32 datasize;
+	/*
+		Packets wake the server thread up, and a burst of them is handled
+		at once instead of one per AsyncRunStep(), which sends blocks
+		every time.  The environment steps when Server::step() has given
+		it time, on its own tick.
+	*/
+	for(bool first = true; ; first = false)
+	{
+		SharedBuffer<u8> data;
+		u16 peer_id;
+		u32 datasize;
+		try{
+			if(first)
+				datasize = m_con.Receive(peer_id, data);
+			else
+				datasize = m_con.Receive(peer_id, data, 0);
+		}
+		catch(con::InvalidIncomingDataException &e)
+		{
+			infostream<<"Server::Receive(): "
+					"InvalidIncomingDataException: what()="
+					<<e.what()<<std::endl;
+			return;
+		}
+		if(m_packet_trace)
+			m_packet_trace->writeData(peer_id, *data, datasize);
+		handleData(*data, datasize, peer_id);
+
+		JMutexAutoLock lock(m_step_dtime_mutex);
+		if(m_step_dtime >= 0.001)
+			return;
+	}
+}
+
+void Server::handleData(u8 *data, u32 datasize, u16 peer_id)
+{
 	try{
-		datasize = m_con.Receive(peer_id,data);
-		ProcessData(*data, datasize, peer_id);
+		ProcessData(data, datasize, peer_id);
 	}
 	catch(con::InvalidIncomingDataException &e)
 	{
@@ -1223,7 +1635,7 @@ PlayerSAO* Server::StageTwoClientInit(u16 peer_id)
 
 	// Send inventory
 	UpdateCrafting(peer_id);
-	SendInventory(peer_id);
+	SendInventory(peer_id, true);
 
 	// Send HP
 	if(g_settings->getBool("enable_damage"))
@@ -1282,7 +1694,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 {
 	DSTACK(__FUNCTION_NAME);
 	// Environment is locked first.
-	JMutexAutoLock envlock(m_env_mutex);
+	RWMutexWriteLock envlock(m_env_mutex);
 
 	ScopeProfiler sp(g_profiler, "Server::ProcessData");
 
@@ -1349,7 +1761,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 
 		// Do not allow multiple players in simple singleplayer mode.
 		// This isn't a perfect way to do it, but will suffice for now
-		if(m_simple_singleplayer_mode && m_clients.getClientIDs().size() > 1){
+		if(m_simple_singleplayer_mode && m_clients.getActiveClientIDs().size() > 1){
 			infostream<<"Server: Not allowing another client ("<<addr_s
 					<<") to connect in simple singleplayer mode"<<std::endl;
 			DenyAccess(peer_id, L"Running in simple singleplayer mode.");
@@ -1581,6 +1993,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 				initial_password = given_password;
 
 			m_script->createAuth(playername, initial_password);
+			m_cached_privs.erase(playername);
 		}
 
 		has_auth = m_script->getAuth(playername, &checkpwd, NULL);
@@ -1616,13 +2029,18 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 			Answer with a TOCLIENT_INIT
 		*/
 		{
-			SharedBuffer<u8> reply(2+1+6+8+4);
+			SharedBuffer<u8> reply(2+1+6+8+4+1);
 			writeU16(&reply[0], TOCLIENT_INIT);
 			writeU8(&reply[2], deployed);
 			//send dummy pos for legacy reasons only
 			writeV3S16(&reply[2+1], floatToInt(v3f(0,0,0), BS));
 			writeU64(&reply[2+1+6], m_env->getServerMap().getSeed());
 			writeF1000(&reply[2+1+6+8], g_settings->getFloat("dedicated_server_step"));
+			// TOSERVER_CACHED_BLOCKS is taken, the definitions are sent
+			// by hash and the player positions are extrapolated
+			writeU8(&reply[2+1+6+8+4],
+					0x01 | (net_proto_version >= 29 ? 0x02 : 0) |
+					(net_proto_version >= 30 ? 0x04 : 0));
 
 			// Send as reliable
 			m_clients.send(peer_id, 0, reply, true);
@@ -1666,11 +2084,19 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		// Send player movement settings
 		SendMovement(peer_id);
 
+		// The definitions the client has cached
+		std::string client_itemdef_sha1;
+		std::string client_nodedef_sha1;
+		if(protocol_version >= 29 && datasize >= 2+20+20){
+			client_itemdef_sha1.assign((char*)&data[2], 20);
+			client_nodedef_sha1.assign((char*)&data[2+20], 20);
+		}
+
 		// Send item definitions
-		SendItemDef(peer_id, m_itemdef, protocol_version);
+		SendItemDef(peer_id, protocol_version, client_itemdef_sha1);
 
 		// Send node definitions
-		SendNodeDef(peer_id, m_nodedef, protocol_version);
+		SendNodeDef(peer_id, protocol_version, client_nodedef_sha1);
 
 		m_clients.event(peer_id, CSE_SetDefinitionsSent);
 
@@ -1804,6 +2230,24 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		}
 		return;
 	}
+	else if(command == TOSERVER_CACHED_BLOCKS)
+	{
+		if(datasize < 2+2)
+			return;
+
+		u16 count = readU16(&data[2]);
+		if(datasize < 2+2+(u32)count*14)
+			throw con::InvalidIncomingDataException
+				("CACHED_BLOCKS length is too short");
+		RemoteClient *client = getClient(peer_id, CS_InitDone);
+		for(u16 i = 0; i < count; i++)
+		{
+			v3s16 p = readV3S16(&data[2+2+i*14]);
+			u64 token = readU64(&data[2+2+i*14+6]);
+			client->addClientCachedBlock(p, token);
+		}
+		return;
+	}
 
 	if (m_clients.getClientState(peer_id) < CS_Active)
 	{
@@ -1871,6 +2315,10 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 			// Call callbacks
 			m_script->on_cheat(playersao, "moved_too_fast");
 		}
+		// The client leaves out the reports that can be extrapolated
+		else if(m_clients.getProtocolVersion(peer_id) >= 30){
+			playersao->setMovementReport(position, speed);
+		}
 
 		/*infostream<<"Server::ProcessData(): Moved player "<<peer_id<<" to "
 				<<"("<<position.X<<","<<position.Y<<","<<position.Z<<")"
@@ -2160,9 +2608,9 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 			{
 				actionstream<<"CHAT: "<<wide_to_narrow(line)<<std::endl;
 
-				std::list<u16> clients = m_clients.getClientIDs();
+				ClientIDList clients = m_clients.getActiveClientIDs();
 
-				for(std::list<u16>::iterator
+				for(ClientIDList::const_iterator
 					i = clients.begin();
 					i != clients.end(); ++i)
 				{
@@ -2751,6 +3199,14 @@ void Server::setTimeOfDay(u32 time)
 void Server::onMapEditEvent(MapEditEvent *event)
 {
 	//infostream<<"Server::onMapEditEvent()"<<std::endl;
+	// Paths may go through the changes even when they aren't sent
+	if(m_env) {
+		// A bounding box of far apart blocks would cover many more
+		if(event->type == MEET_OTHER)
+			m_env->getPathCache()->invalidate(event->modified_blocks);
+		else
+			m_env->getPathCache()->invalidate(event->getArea());
+	}
 	if(m_ignore_map_edit_events)
 		return;
 	if(m_ignore_map_edit_events_area.contains(event->getArea()))
@@ -2830,7 +3286,7 @@ void Server::setInventoryModified(const InventoryLocation &loc)
 	break;
 	case InventoryLocation::DETACHED:
 	{
-		sendDetachedInventory(loc.name,PEER_ID_INEXISTENT);
+		sendDetachedInventory(loc.name, PEER_ID_INEXISTENT, false);
 	}
 	break;
 	default:
@@ -2840,10 +3296,10 @@ void Server::setInventoryModified(const InventoryLocation &loc)
 
 void Server::SetBlocksNotSent(std::map<v3s16, MapBlock *>& block)
 {
-	std::list<u16> clients = m_clients.getClientIDs();
+	ClientIDList clients = m_clients.getActiveClientIDs();
 	m_clients.Lock();
 	// Set the modified blocks unsent for all the clients
-	for (std::list<u16>::iterator
+	for (ClientIDList::const_iterator
 		 i = clients.begin();
 		 i != clients.end(); ++i) {
 			RemoteClient *client = m_clients.lockedGetClientNoEx(*i);
@@ -2859,6 +3315,9 @@ void Server::peerAdded(con::Peer *peer)
 	verbosestream<<"Server::peerAdded(): peer->id="
 			<<peer->id<<std::endl;
 
+	if(m_packet_trace)
+		m_packet_trace->writePeerAdded(peer->id);
+
 	con::PeerChange c;
 	c.type = con::PEER_ADDED;
 	c.peer_id = peer->id;
@@ -2872,6 +3331,9 @@ void Server::deletingPeer(con::Peer *peer, bool timeout)
 	verbosestream<<"Server::deletingPeer(): peer->id="
 			<<peer->id<<", timeout="<<timeout<<std::endl;
 
+	if(m_packet_trace)
+		m_packet_trace->writePeerRemoved(peer->id, timeout);
+
 	m_clients.event(peer->id, CSE_Disconnect);
 	con::PeerChange c;
 	c.type = con::PEER_REMOVED;
@@ -3037,23 +3499,53 @@ void Server::SendDeathscreen(u16 peer_id,bool set_camera_point_target,
 	m_clients.send(peer_id, 0, data, true);
 }
 
-void Server::SendItemDef(u16 peer_id,
-		IItemDefManager *itemdef, u16 protocol_version)
+const Server::DefinitionsData &Server::getDefinitionsData(u8 type,
+		u16 protocol_version)
 {
-	DSTACK(__FUNCTION_NAME);
-	std::ostringstream os(std::ios_base::binary);
+	std::map<u16, DefinitionsData>::iterator i =
+			m_definitions_data[type].find(protocol_version);
+	if(i != m_definitions_data[type].end())
+		return i->second;
 
-	/*
-		u16 command
-		u32 length of the next item
-		zlib-compressed serialized ItemDefManager
-	*/
-	writeU16(os, TOCLIENT_ITEMDEF);
 	std::ostringstream tmp_os(std::ios::binary);
-	itemdef->serialize(tmp_os, protocol_version);
+	if(type == 0)
+		m_itemdef->serialize(tmp_os, protocol_version);
+	else
+		m_nodedef->serialize(tmp_os, protocol_version);
 	std::ostringstream tmp_os2(std::ios::binary);
 	compressZlib(tmp_os.str(), tmp_os2);
-	os<<serializeLongString(tmp_os2.str());
+
+	DefinitionsData &d = m_definitions_data[type][protocol_version];
+	d.compressed = tmp_os2.str();
+	SHA1 sha1;
+	sha1.addBytes(d.compressed.c_str(), d.compressed.size());
+	unsigned char *digest = sha1.getDigest();
+	d.sha1.assign((char*)digest, 20);
+	free(digest);
+	return d;
+}
+
+void Server::SendItemDef(u16 peer_id, u16 protocol_version,
+		const std::string &client_sha1)
+{
+	DSTACK(__FUNCTION_NAME);
+	std::ostringstream os(std::ios_base::binary);
+
+	/*
+		u16 command
+		u8[20] SHA1 of the compressed definitions (new as of 29)
+		u32 length of the next item
+		zlib-compressed serialized ItemDefManager; left out (length 0) if
+		the client has them cached (new as of 29)
+	*/
+	writeU16(os, TOCLIENT_ITEMDEF);
+	const DefinitionsData &d = getDefinitionsData(0, protocol_version);
+	if(protocol_version >= 29){
+		os<<d.sha1;
+		os<<serializeLongString(client_sha1 == d.sha1 ? "" : d.compressed);
+	} else {
+		os<<serializeLongString(d.compressed);
+	}
 
 	// Make data buffer
 	std::string s = os.str();
@@ -3064,23 +3556,27 @@ void Server::SendItemDef(u16 peer_id,
 	m_clients.send(peer_id, 0, data, true);
 }
 
-void Server::SendNodeDef(u16 peer_id,
-		INodeDefManager *nodedef, u16 protocol_version)
+void Server::SendNodeDef(u16 peer_id, u16 protocol_version,
+		const std::string &client_sha1)
 {
 	DSTACK(__FUNCTION_NAME);
 	std::ostringstream os(std::ios_base::binary);
 
 	/*
 		u16 command
+		u8[20] SHA1 of the compressed definitions (new as of 29)
 		u32 length of the next item
-		zlib-compressed serialized NodeDefManager
+		zlib-compressed serialized NodeDefManager; left out (length 0) if
+		the client has them cached (new as of 29)
 	*/
 	writeU16(os, TOCLIENT_NODEDEF);
-	std::ostringstream tmp_os(std::ios::binary);
-	nodedef->serialize(tmp_os, protocol_version);
-	std::ostringstream tmp_os2(std::ios::binary);
-	compressZlib(tmp_os.str(), tmp_os2);
-	os<<serializeLongString(tmp_os2.str());
+	const DefinitionsData &d = getDefinitionsData(1, protocol_version);
+	if(protocol_version >= 29){
+		os<<d.sha1;
+		os<<serializeLongString(client_sha1 == d.sha1 ? "" : d.compressed);
+	} else {
+		os<<serializeLongString(d.compressed);
+	}
 
 	// Make data buffer
 	std::string s = os.str();
@@ -3095,7 +3591,7 @@ void Server::SendNodeDef(u16 peer_id,
 	Non-static send methods
 */
 
-void Server::SendInventory(u16 peer_id)
+void Server::SendInventory(u16 peer_id, bool full)
 {
 	DSTACK(__FUNCTION_NAME);
 
@@ -3105,20 +3601,27 @@ void Server::SendInventory(u16 peer_id)
 	playersao->m_inventory_not_sent = false;
 
 	/*
-		Serialize it
+		Serialize it; only the changed slots if the client has the rest
 	*/
 
-	std::ostringstream os;
-	playersao->getInventory()->serialize(os);
+	Inventory *inventory = playersao->getInventory();
+	std::ostringstream os(std::ios_base::binary);
+	u16 command = TOCLIENT_INVENTORY_CHANGES;
+	if(full || m_clients.getProtocolVersion(peer_id) < 27 ||
+			!inventory->serializeChanges(os)){
+		command = TOCLIENT_INVENTORY;
+		inventory->serialize(os);
+	}
+	inventory->clearChanges();
 
 	std::string s = os.str();
 
-	SharedBuffer<u8> data(s.size()+2);
-	writeU16(&data[0], TOCLIENT_INVENTORY);
-	memcpy(&data[2], s.c_str(), s.size());
+	BufferWriter writer(2 + s.size());
+	writer.writeU16(command);
+	writer.writeRaw(s);
 
 	// Send as reliable
-	m_clients.send(peer_id, 0, data, true);
+	m_clients.send(peer_id, 0, writer.takeSharedBuffer(), true);
 }
 
 void Server::SendChatMessage(u16 peer_id, const std::wstring &message)
@@ -3148,15 +3651,11 @@ void Server::SendChatMessage(u16 peer_id, const std::wstring &message)
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 
+	// Chat comes in bursts, and is batched with the rest of the step
 	if (peer_id != PEER_ID_INEXISTENT)
-	{
-		// Send as reliable
-		m_clients.send(peer_id, 0, data, true);
-	}
+		m_clients.sendBatched(peer_id, data);
 	else
-	{
-		m_clients.sendToAll(0,data,true);
-	}
+		m_clients.sendBatchedToAll(data);
 }
 
 void Server::SendShowFormspecMessage(u16 peer_id, const std::string &formspec,
@@ -3301,8 +3800,8 @@ void Server::SendHUDAdd(u16 peer_id, u32 id, HudElement *form)
 	// Make data buffer
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
-	// Send as reliable
-	m_clients.send(peer_id, 1, data, true);
+	// Send as reliable, with the other HUD messages of the step
+	m_clients.sendBatched(peer_id, data);
 }
 
 void Server::SendHUDRemove(u16 peer_id, u32 id)
@@ -3316,9 +3815,8 @@ void Server::SendHUDRemove(u16 peer_id, u32 id)
 	// Make data buffer
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
-	// Send as reliable
-
-	m_clients.send(peer_id, 1, data, true);
+	// Send as reliable, with the other HUD messages of the step
+	m_clients.sendBatched(peer_id, data);
 }
 
 void Server::SendHUDChange(u16 peer_id, u32 id, HudElementStat stat, void *value)
@@ -3357,8 +3855,8 @@ void Server::SendHUDChange(u16 peer_id, u32 id, HudElementStat stat, void *value
 	// Make data buffer
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8 *)s.c_str(), s.size());
-	// Send as reliable
-	m_clients.send(peer_id, 0, data, true);
+	// Send as reliable, with the other HUD messages of the step
+	m_clients.sendBatched(peer_id, data);
 }
 
 void Server::SendHUDSetFlags(u16 peer_id, u32 flags, u32 mask)
@@ -3377,8 +3875,8 @@ void Server::SendHUDSetFlags(u16 peer_id, u32 flags, u32 mask)
 	// Make data buffer
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8 *)s.c_str(), s.size());
-	// Send as reliable
-	m_clients.send(peer_id, 0, data, true);
+	// Send as reliable, with the other HUD messages of the step
+	m_clients.sendBatched(peer_id, data);
 }
 
 void Server::SendHUDSetParam(u16 peer_id, u16 param, const std::string &value)
@@ -3393,8 +3891,8 @@ void Server::SendHUDSetParam(u16 peer_id, u16 param, const std::string &value)
 	// Make data buffer
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8 *)s.c_str(), s.size());
-	// Send as reliable
-	m_clients.send(peer_id, 0, data, true);
+	// Send as reliable, with the other HUD messages of the step
+	m_clients.sendBatched(peer_id, data);
 }
 
 void Server::SendSetSky(u16 peer_id, const video::SColor &bgcolor,
@@ -3612,9 +4110,9 @@ s32 Server::playSound(const SimpleSoundSpec &spec,
 	}
 	else
 	{
-		std::list<u16> clients = m_clients.getClientIDs();
+		ClientIDList clients = m_clients.getActiveClientIDs();
 
-		for(std::list<u16>::iterator
+		for(ClientIDList::const_iterator
 				i = clients.begin(); i != clients.end(); ++i)
 		{
 			Player *player = m_env->getPlayer(*i);
@@ -3700,11 +4198,15 @@ void Server::sendRemoveNode(v3s16 p, u16 ignore_id,
 	writeS16(&reply[4], p.Y);
 	writeS16(&reply[6], p.Z);
 
-	std::list<u16> clients = m_clients.getClientIDs();
-	for(std::list<u16>::iterator
+	ClientIDList clients = m_clients.getActiveClientIDs();
+	for(ClientIDList::const_iterator
 		i = clients.begin();
 		i != clients.end(); ++i)
 	{
+		// Newer clients get the changes batched per block
+		if(m_clients.getProtocolVersion(*i) >= 25)
+			continue;
+
 		if(far_players)
 		{
 			// Get player
@@ -3733,12 +4235,16 @@ void Server::sendAddNode(v3s16 p, MapNode n, u16 ignore_id,
 	float maxd = far_d_nodes*BS;
 	v3f p_f = intToFloat(p, BS);
 
-	std::list<u16> clients = m_clients.getClientIDs();
-		for(std::list<u16>::iterator
+	ClientIDList clients = m_clients.getActiveClientIDs();
+		for(ClientIDList::const_iterator
 			i = clients.begin();
 			i != clients.end(); ++i)
 		{
 
+		// Newer clients get the changes batched per block
+		if(m_clients.getProtocolVersion(*i) >= 25)
+			continue;
+
 		if(far_players)
 		{
 			// Get player
@@ -3788,9 +4294,9 @@ void Server::sendAddNode(v3s16 p, MapNode n, u16 ignore_id,
 
 void Server::setBlockNotSent(v3s16 p)
 {
-	std::list<u16> clients = m_clients.getClientIDs();
+	ClientIDList clients = m_clients.getActiveClientIDs();
 	m_clients.Lock();
-	for(std::list<u16>::iterator
+	for(ClientIDList::const_iterator
 		i = clients.begin();
 		i != clients.end(); ++i)
 	{
@@ -3800,7 +4306,344 @@ void Server::setBlockNotSent(v3s16 p)
 	m_clients.Unlock();
 }
 
-void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version)
+void Server::appendObjectMessage(const ActiveObjectMessage &aom,
+		u16 net_proto_version, BufferWriter &data)
+{
+	// Add object id
+	data.writeU16(aom.id);
+	// Add data
+	if(!aom.packed_datastring.empty() && net_proto_version >= 26)
+		data.writeString(aom.packed_datastring);
+	else
+		data.writeString(aom.datastring);
+}
+
+void Server::appendObjectMessage(const ActiveObjectMessageBuffer &messages,
+		const ActiveObjectMessageBuffer::Entry &e,
+		u16 net_proto_version, BufferWriter &data)
+{
+	u32 size;
+	const char *payload = messages.getPayload(e, net_proto_version, size);
+	if(size > 65535)
+		throw SerializationError("String too long for writeString");
+	data.writeU16(e.id);
+	data.writeU16(size);
+	data.writeRaw(payload, size);
+}
+
+u32 Server::getObjectPositionInterval(Player *player, u16 id)
+{
+	ServerActiveObject *obj = m_env->getActiveObject(id);
+	if(player == NULL || obj == NULL)
+		return 1;
+
+	/*
+		Full rate in the nearest third of the object sending range, half
+		rate in the middle third and a quarter beyond it
+	*/
+	static SettingHandle<s16> range_setting(g_settings,
+			"active_object_send_range_blocks");
+	f32 range = range_setting.get() * MAP_BLOCKSIZE * BS;
+	f32 d = player->getPosition().getDistanceFrom(obj->getBasePosition());
+	if(d < range / 3)
+		return 1;
+	if(d < range * 2 / 3)
+		return 2;
+	return 4;
+}
+
+void Server::makeObjectListUpdate(RemoteClient *client, s16 radius,
+		s16 player_radius, std::vector<u16> &removed_objects,
+		std::vector<u16> &added_objects, SharedBuffer<u8> &packet)
+{
+	Player *player = m_env->getPlayer(client->peer_id);
+	if(player==NULL)
+	{
+		// This can happen if the client timeouts somehow
+		return;
+	}
+	v3s16 pos = floatToInt(player->getPosition(), BS);
+
+	m_env->getRemovedActiveObjects(pos, radius, player_radius,
+			client->m_known_objects, removed_objects);
+	m_env->getAddedActiveObjects(pos, radius, player_radius,
+			client->m_known_objects, added_objects);
+
+	// Ignore if nothing happened
+	if(removed_objects.size() == 0 && added_objects.size() == 0)
+		return;
+
+	BufferWriter writer(256);
+	writer.writeU16(TOCLIENT_ACTIVE_OBJECT_REMOVE_ADD);
+
+	// Handle removed objects
+	writer.writeU16(removed_objects.size());
+	for(std::vector<u16>::iterator
+			i = removed_objects.begin();
+			i != removed_objects.end(); ++i)
+	{
+		// Add to data buffer for sending
+		writer.writeU16(*i);
+	}
+
+	// Handle added objects
+	writer.writeU16(added_objects.size());
+	for(std::vector<u16>::iterator
+			i = added_objects.begin();
+			i != added_objects.end(); ++i)
+	{
+		// Get object
+		u16 id = *i;
+		ServerActiveObject* obj = m_env->getActiveObject(id);
+
+		// Get object type
+		u8 type = ACTIVEOBJECT_TYPE_INVALID;
+		if(obj == NULL)
+			infostream<<"WARNING: "<<__FUNCTION_NAME
+					<<": NULL object"<<std::endl;
+		else
+			type = obj->getSendType();
+
+		// Add to data buffer for sending
+		writer.writeU16(id);
+		writer.writeU8(type);
+
+		if(obj)
+			writer.writeLongString(
+					obj->getClientInitializationData(client->net_proto_version));
+		else
+			writer.writeLongString("");
+	}
+
+	packet = writer.takeSharedBuffer();
+}
+
+void Server::makeObjectMessages(RemoteClient *client,
+		const ActiveObjectMessageBuffer &messages,
+		const std::vector<std::pair<u16, u32> > &order,
+		SharedBuffer<u8> &reliable, SharedBuffer<u8> &unreliable)
+{
+	BufferWriter reliable_data;
+	BufferWriter unreliable_data;
+	reliable_data.writeU16(TOCLIENT_ACTIVE_OBJECT_MESSAGES);
+	unreliable_data.writeU16(TOCLIENT_ACTIVE_OBJECT_MESSAGES);
+	Player *player = m_env->getPlayer(client->peer_id);
+	u32 step = client->m_object_send_step++;
+	// Go through the messages, one object at a time
+	for(u32 j = 0; j < order.size();)
+	{
+		// If object is not known by client, skip it
+		u16 id = order[j].first;
+		u32 end = j + 1;
+		while(end < order.size() && order[end].first == id)
+			end++;
+		if(client->m_known_objects.count(id) == 0){
+			j = end;
+			continue;
+		}
+		bool position_turn = (step + id) %
+				getObjectPositionInterval(player, id) == 0;
+		// Go through every message of the object
+		for(; j < end; j++)
+		{
+			const ActiveObjectMessageBuffer::Entry &e =
+					messages[order[j].second];
+			if(e.is_position){
+				// Only the latest deferred update is kept, as a copy
+				// since the buffer is cleared after this step
+				client->m_deferred_object_positions.erase(id);
+				if(!position_turn){
+					client->m_deferred_object_positions.insert(
+							std::make_pair(id, messages.getMessage(e)));
+					continue;
+				}
+			}
+			appendObjectMessage(messages, e, client->net_proto_version,
+					e.reliable ? reliable_data : unreliable_data);
+		}
+	}
+	// Send the deferred updates of objects that didn't send more
+	for(std::map<u16, ActiveObjectMessage>::iterator
+			j = client->m_deferred_object_positions.begin();
+			j != client->m_deferred_object_positions.end();)
+	{
+		u16 id = j->first;
+		if(client->m_known_objects.count(id) == 0){
+			client->m_deferred_object_positions.erase(j++);
+			continue;
+		}
+		if((step + id) % getObjectPositionInterval(player, id) != 0){
+			++j;
+			continue;
+		}
+		appendObjectMessage(j->second, client->net_proto_version,
+				j->second.reliable ? reliable_data : unreliable_data);
+		client->m_deferred_object_positions.erase(j++);
+	}
+	reliable = reliable_data.takeSharedBuffer();
+	unreliable = unreliable_data.takeSharedBuffer();
+}
+
+void Server::sendBlockNodeChanges(v3s16 blockpos,
+		const std::set<v3s16> &cleared_metadata, bool resend_to_old_clients)
+{
+	MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(blockpos);
+	std::vector<u16> changed;
+	bool whole = (block == NULL || !block->takeNodeChangeLog(changed));
+
+	/*
+		Removed metadata has to be sent even if the node itself stayed
+		the same
+	*/
+	v3s16 p0 = blockpos * MAP_BLOCKSIZE;
+	for(std::set<v3s16>::const_iterator
+			i = cleared_metadata.lower_bound(p0);
+			i != cleared_metadata.end() && !whole; ++i)
+	{
+		v3s16 rel = *i - p0;
+		// The set is ordered by X, then Y, then Z
+		if(rel.X >= MAP_BLOCKSIZE)
+			break;
+		if(rel.Y < 0 || rel.Y >= MAP_BLOCKSIZE ||
+				rel.Z < 0 || rel.Z >= MAP_BLOCKSIZE)
+			continue;
+		changed.push_back(rel.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+				+ rel.Y*MAP_BLOCKSIZE + rel.X);
+	}
+	std::sort(changed.begin(), changed.end());
+	changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+	if(!whole && changed.empty())
+		return;
+
+	std::vector<MapNode> nodes;
+	std::vector<u8> flags;
+	if(!whole){
+		nodes.reserve(changed.size());
+		flags.reserve(changed.size());
+		for(std::vector<u16>::iterator
+				i = changed.begin();
+				i != changed.end(); ++i)
+		{
+			v3s16 p(*i % MAP_BLOCKSIZE, *i / MAP_BLOCKSIZE % MAP_BLOCKSIZE,
+					*i / (MAP_BLOCKSIZE * MAP_BLOCKSIZE));
+			nodes.push_back(block->getNodeNoEx(p));
+			flags.push_back(cleared_metadata.count(p0 + p) ? 0x01 : 0x00);
+		}
+	}
+
+	ClientIDList clients = m_clients.getActiveClientIDs();
+	for(ClientIDList::const_iterator
+		i = clients.begin();
+		i != clients.end(); ++i)
+	{
+		SharedBuffer<u8> reply(0);
+		m_clients.Lock();
+		RemoteClient* client = m_clients.lockedGetClientNoEx(*i);
+		if (client != 0)
+		{
+			if (isBlockSendPending(*i, blockpos)) {
+				// The data in the sending thread is already out of date
+				client->SetBlockNotSent(blockpos);
+			} else if (client->net_proto_version < 25) {
+				if (resend_to_old_clients)
+					client->SetBlockNotSent(blockpos);
+			} else if (whole || !client->isBlockSent(blockpos)) {
+				// Clients without the block get it whole later
+				client->SetBlockNotSent(blockpos);
+			} else {
+				u8 ser_ver = client->serialization_version;
+				u32 nodesize = MapNode::serializedLength(ser_ver);
+				reply = SharedBuffer<u8>(10 + changed.size() * (3 + nodesize));
+				writeU16(&reply[0], TOCLIENT_BLOCK_NODE_CHANGES);
+				writeS16(&reply[2], blockpos.X);
+				writeS16(&reply[4], blockpos.Y);
+				writeS16(&reply[6], blockpos.Z);
+				writeU16(&reply[8], changed.size());
+				u32 index = 10;
+				for(u32 j = 0; j < changed.size(); j++)
+				{
+					writeU16(&reply[index], changed[j]);
+					writeU8(&reply[index + 2], flags[j]);
+					nodes[j].serialize(&reply[index + 3], ser_ver);
+					index += 3 + nodesize;
+				}
+			}
+		}
+		m_clients.Unlock();
+
+		// Send on the block channel, after any block data already on wire
+		if (reply.getSize() > 0)
+			m_clients.send(*i, 2, reply, true);
+	}
+}
+
+void Server::sendNodeMetadataChanges(const std::set<v3s16> &positions)
+{
+	std::map<v3s16, std::vector<v3s16> > blocks;
+	for(std::set<v3s16>::const_iterator
+			i = positions.begin();
+			i != positions.end(); ++i)
+		blocks[getNodeBlockPos(*i)].push_back(*i);
+
+	ClientIDList clients = m_clients.getActiveClientIDs();
+	for(std::map<v3s16, std::vector<v3s16> >::iterator
+			i = blocks.begin();
+			i != blocks.end(); ++i)
+	{
+		v3s16 blockpos = i->first;
+		MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(blockpos);
+		if(block == NULL)
+			continue;
+
+		std::ostringstream os(std::ios_base::binary);
+		writeU16(os, i->second.size());
+		v3s16 p0 = blockpos * MAP_BLOCKSIZE;
+		for(std::vector<v3s16>::iterator
+				j = i->second.begin();
+				j != i->second.end(); ++j)
+		{
+			v3s16 rel = *j - p0;
+			writeU16(os, rel.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+					+ rel.Y*MAP_BLOCKSIZE + rel.X);
+			NodeMetadata *meta = block->getNodeMetadata().get(rel);
+			writeU8(os, meta != NULL);
+			if(meta != NULL)
+				meta->serialize(os);
+		}
+		std::ostringstream reply_os(std::ios_base::binary);
+		writeU16(reply_os, TOCLIENT_NODEMETA_CHANGES);
+		writeV3S16(reply_os, blockpos);
+		compressZlib(os.str(), reply_os);
+		std::string s = reply_os.str();
+		SharedBuffer<u8> reply((u8*)s.c_str(), s.size());
+
+		for(ClientIDList::const_iterator
+			j = clients.begin();
+			j != clients.end(); ++j)
+		{
+			bool send = false;
+			m_clients.Lock();
+			RemoteClient* client = m_clients.lockedGetClientNoEx(*j);
+			if (client != 0)
+			{
+				if (isBlockSendPending(*j, blockpos) ||
+						client->net_proto_version < 31)
+					client->SetBlockNotSent(blockpos);
+				else
+					// Clients without the block get it whole later
+					send = client->isBlockSent(blockpos);
+			}
+			m_clients.Unlock();
+
+			// On the block channel, after the block and its node changes
+			if (send)
+				m_clients.send(*j, 2, reply, true);
+		}
+	}
+}
+
+void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver,
+		u16 net_proto_version, const u64 *client_token)
 {
 	DSTACK(__FUNCTION_NAME);
 
@@ -3831,19 +4674,41 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 		Create a packet with the block in the right format
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
-	block->serializeNetworkSpecific(os, net_proto_version);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
+	/*
+		Serializing compresses the block, which is done only once for
+		all clients that use the same versions
+	*/
+	const std::string *s = block->getCachedNetworkSerialization(
+			ver, net_proto_version);
+	if(s == NULL){
+		std::ostringstream os(std::ios_base::binary);
+		block->serialize(os, ver, false, rangelim(
+				g_settings->getS16("map_compression_level_net"), -1, 9));
+		block->serializeNetworkSpecific(os, net_proto_version);
+		block->setCachedNetworkSerialization(ver, net_proto_version, os.str());
+		s = block->getCachedNetworkSerialization(ver, net_proto_version);
+	}
 
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
-	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
-	writeS16(&reply[2], p.X);
-	writeS16(&reply[4], p.Y);
-	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+	// The client has it already
+	if(client_token != NULL && getNetworkSerializationToken(*s) == *client_token)
+	{
+		SharedBuffer<u8> reply(2+6);
+		writeU16(&reply[0], TOCLIENT_BLOCK_CACHED);
+		writeV3S16(&reply[2], p);
+		m_clients.send(peer_id, 2, reply, true);
+		return;
+	}
+
+	sendBlockData(peer_id, p, *s);
+}
+
+void Server::sendBlockData(u16 peer_id, v3s16 p, const std::string &data)
+{
+	BufferWriter writer(8 + data.size());
+	writer.writeU16(TOCLIENT_BLOCKDATA);
+	writer.writeV3S16(p);
+	writer.writeRaw(data);
+	SharedBuffer<u8> reply = writer.takeSharedBuffer();
 
 	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
 			<<":  \tpacket size: "<<replysize<<std::endl;*/
@@ -3854,15 +4719,65 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 	m_clients.send(peer_id, 2, reply, true);
 }
 
+void Server::processBlockSendJob(BlockSendJob *job)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::ostringstream os(std::ios_base::binary);
+	job->snapshot.serialize(os, job->ser_ver, job->net_proto_version,
+			rangelim(g_settings->getS16("map_compression_level_net"), -1, 9));
+	job->data = os.str();
+
+	v3s16 p = job->snapshot.pos;
+	for(std::vector<u16>::iterator
+			i = job->peer_ids.begin();
+			i != job->peer_ids.end(); ++i)
+	{
+		sendBlockData(*i, p, job->data);
+
+		// Anything sent on the block channel from now on comes after this
+		JMutexAutoLock lock(m_block_send_pending_mutex);
+		m_block_send_pending.erase(std::make_pair(*i, p));
+	}
+
+	m_block_send_done.push_back(job);
+
+	JMutexAutoLock lock(m_block_send_pending_mutex);
+	m_block_send_jobs_running--;
+}
+
+bool Server::isBlockSendPending(u16 peer_id, v3s16 p)
+{
+	JMutexAutoLock lock(m_block_send_pending_mutex);
+	return m_block_send_pending.find(std::make_pair(peer_id, p)) !=
+			m_block_send_pending.end();
+}
+
 void Server::SendBlocks(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
 
-	JMutexAutoLock envlock(m_env_mutex);
-	//TODO check if one big lock could be faster then multiple small ones
+	// Selecting and sending blocks only looks at the map
+	RWMutexReadLock envlock(m_env_mutex);
 
 	ScopeProfiler sp(g_profiler, "Server: sel and send blocks to clients");
 
+	/*
+		Cache what the worker threads have compressed, unless the
+		block has changed in the meantime
+	*/
+	while(!m_block_send_done.empty())
+	{
+		BlockSendJob *job = m_block_send_done.pop_frontNoEx();
+		MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(
+				job->snapshot.pos);
+		if(block != NULL && block->getNetworkSerializationSerial() ==
+				job->snapshot.serial)
+			block->setCachedNetworkSerialization(job->ser_ver,
+					job->net_proto_version, job->data);
+		delete job;
+	}
+
 	std::vector<PrioritySortedBlockTransfer> queue;
 
 	s32 total_sending = 0;
@@ -3870,10 +4785,50 @@ void Server::SendBlocks(float dtime)
 	{
 		ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending");
 
-		std::list<u16> clients = m_clients.getClientIDs();
+		ClientIDList clients = m_clients.getActiveClientIDs();
+
+		/*
+			Get the link statistics of the clients and split
+			block_send_bandwidth between them so that no client gets more
+			than it uses while the others are limited (max-min fairness).
+		*/
+		std::map<u16, float> rtts;
+		std::map<u16, float> rates;
+		std::map<u16, float> losses;
+		for(ClientIDList::const_iterator
+			i = clients.begin();
+			i != clients.end(); ++i)
+		{
+			rtts[*i] = m_con.getPeerStat(*i, con::AVG_RTT);
+			rates[*i] = MYMAX(m_con.getPeerRate(*i, con::CUR_DL_RATE), 0);
+			losses[*i] = MYMAX(m_con.getPeerRate(*i, con::CUR_LOSS_RATE), 0);
+		}
+
+		float rate_share = 0;
+		float bandwidth = g_settings->getFloat("block_send_bandwidth");
+		if(bandwidth > 0 && !clients.empty())
+		{
+			std::vector<float> sorted_rates;
+			for(std::map<u16, float>::iterator
+					i = rates.begin();
+					i != rates.end(); ++i)
+				sorted_rates.push_back(i->second);
+			std::sort(sorted_rates.begin(), sorted_rates.end());
+
+			float left = bandwidth;
+			u32 count = sorted_rates.size();
+			rate_share = left / count;
+			for(u32 i = 0; i < count; i++)
+			{
+				rate_share = left / (count - i);
+				if(sorted_rates[i] > rate_share)
+					break;
+				left -= sorted_rates[i];
+			}
+		}
 
 		m_clients.Lock();
-		for(std::list<u16>::iterator
+		for(ClientIDList::const_iterator
 			i = clients.begin();
 			i != clients.end(); ++i)
 		{
@@ -3882,6 +4837,9 @@ void Server::SendBlocks(float dtime)
 			if (client == NULL)
 				continue;
 
+			client->updateSendBudget(dtime, rtts[*i], rates[*i], losses[*i],
+					rate_share);
+
 			total_sending += client->SendingCount();
 			client->GetNextBlocks(m_env,m_emerge, dtime, queue);
 		}
@@ -3893,6 +4851,8 @@ void Server::SendBlocks(float dtime)
 	// Lowest is most important.
 	std::sort(queue.begin(), queue.end());
 
+	std::map<std::pair<v3s16, u32>, BlockSendJob*> jobs;
+
 	m_clients.Lock();
 	for(u32 i=0; i<queue.size(); i++)
 	{
@@ -3918,12 +4878,148 @@ void Server::SendBlocks(float dtime)
 		if(!client)
 			continue;
 
-		SendBlockNoLock(q.peer_id, block, client->serialization_version, client->net_proto_version);
+		// An outdated copy is still on its way; send this after it
+		if(isBlockSendPending(q.peer_id, q.pos))
+			continue;
+
+		u8 ver = client->serialization_version;
+		u16 net_proto_version = client->net_proto_version;
+
+		// A block the client may have in its cache is compared here
+		u64 client_token = 0;
+		bool client_cached = client->takeClientCachedBlock(q.pos,
+				client_token);
+
+		if(m_block_send_inline || client_cached ||
+				block->getCachedNetworkSerialization(
+				ver, net_proto_version) != NULL)
+		{
+			SendBlockNoLock(q.peer_id, block, ver, net_proto_version,
+					client_cached ? &client_token : NULL);
+		}
+		else
+		{
+			/*
+				Compress in a worker thread, once for all the clients
+				using the same versions
+			*/
+			u32 key = ((u32)ver << 16) | net_proto_version;
+			BlockSendJob *&job = jobs[std::make_pair(q.pos, key)];
+			if(job == NULL){
+				job = new BlockSendJob(this);
+				job->ser_ver = ver;
+				job->net_proto_version = net_proto_version;
+				block->makeNetworkSnapshot(&job->snapshot);
+			}
+			job->peer_ids.push_back(q.peer_id);
+
+			JMutexAutoLock lock(m_block_send_pending_mutex);
+			m_block_send_pending.insert(std::make_pair(q.peer_id, q.pos));
+		}
 
 		client->SentBlock(q.pos);
 		total_sending++;
 	}
 	m_clients.Unlock();
+
+	{
+		JMutexAutoLock lock(m_block_send_pending_mutex);
+		m_block_send_jobs_running += jobs.size();
+	}
+	for(std::map<std::pair<v3s16, u32>, BlockSendJob*>::iterator
+			i = jobs.begin();
+			i != jobs.end(); ++i)
+		getWorkerPool()->submit(i->second);
+}
+
+/*
+	The SHA1s of the media files from the last start, in
+	cache/server_media_sha1.txt, one "size mtime sha1_base64 path" a line
+*/
+
+static std::string getMediaHashCachePath()
+{
+	return porting::path_user + DIR_DELIM + "cache" + DIR_DELIM
+			+ "server_media_sha1.txt";
+}
+
+struct MediaHashCacheEntry
+{
+	u32 size;
+	u32 mtime;
+	std::string sha1_base64;
+};
+
+struct MediaFileToHash
+{
+	std::string filename;
+	std::string filepath;
+	u32 size;
+	u32 mtime;
+	// Set if cached, else by MediaHashTask
+	std::string sha1_base64;
+	std::string error;
+};
+
+// Reads and hashes the files that weren't in the cache, one each
+class MediaHashTask: public WorkerTask
+{
+public:
+	MediaHashTask(std::vector<MediaFileToHash> &files):
+		m_files(files)
+	{
+	}
+
+	void run(u32 index)
+	{
+		MediaFileToHash &f = m_files[index];
+		if(f.sha1_base64 != "")
+			return;
+		std::ifstream fis(f.filepath.c_str(), std::ios_base::binary);
+		if(fis.good() == false){
+			f.error = "Could not open \"" + f.filename + "\" for reading";
+			return;
+		}
+		SHA1 sha1;
+		u32 length = 0;
+		for(;;){
+			char buf[4096];
+			fis.read(buf, 4096);
+			std::streamsize len = fis.gcount();
+			sha1.addBytes(buf, len);
+			length += len;
+			if(fis.eof())
+				break;
+			if(!fis.good()){
+				f.error = "Failed to read \"" + f.filename + "\"";
+				return;
+			}
+		}
+		if(length == 0){
+			f.error = "Empty file \"" + f.filepath + "\"";
+			return;
+		}
+		unsigned char *digest = sha1.getDigest();
+		f.sha1_base64 = base64_encode(digest, 20);
+		free(digest);
+	}
+
+private:
+	std::vector<MediaFileToHash> &m_files;
+};
+
+IRollbackManager *Server::getRollbackManager()
+{
+	// The mods can edit the map, or call the rollback API, while the
+	// rollback database is still being opened
+	if(m_rollback_job)
+		m_rollback_job->finish();
+	return m_rollback;
+}
+
+void Server::openRollback()
+{
+	m_rollback = new RollbackManager(m_path_world, this);
 }
 
 void Server::fillMediaCache()
@@ -3944,7 +5040,8 @@ void Server::fillMediaCache()
 	}
 	paths.push_back(porting::path_user + DIR_DELIM + "textures" + DIR_DELIM + "server");
 
-	// Collect media file information from paths into cache
+	// Collect media files from paths, in order
+	std::vector<MediaFileToHash> files;
 	for(std::list<std::string>::iterator i = paths.begin();
 			i != paths.end(); i++)
 	{
@@ -3973,52 +5070,85 @@ void Server::fillMediaCache()
 						<<filename<<"\""<<std::endl;
 				continue;
 			}
-			// Ok, attempt to load the file and add to cache
-			std::string filepath = mediapath + DIR_DELIM + filename;
-			// Read data
-			std::ifstream fis(filepath.c_str(), std::ios_base::binary);
-			if(fis.good() == false){
-				errorstream<<"Server::fillMediaCache(): Could not open \""
-						<<filename<<"\" for reading"<<std::endl;
-				continue;
-			}
-			std::ostringstream tmp_os(std::ios_base::binary);
-			bool bad = false;
-			for(;;){
-				char buf[1024];
-				fis.read(buf, 1024);
-				std::streamsize len = fis.gcount();
-				tmp_os.write(buf, len);
-				if(fis.eof())
-					break;
-				if(!fis.good()){
-					bad = true;
-					break;
-				}
-			}
-			if(bad){
-				errorstream<<"Server::fillMediaCache(): Failed to read \""
-						<<filename<<"\""<<std::endl;
-				continue;
-			}
-			if(tmp_os.str().length() == 0){
-				errorstream<<"Server::fillMediaCache(): Empty file \""
-						<<filepath<<"\""<<std::endl;
-				continue;
-			}
+			MediaFileToHash f;
+			f.filename = filename;
+			f.filepath = mediapath + DIR_DELIM + filename;
+			f.size = 0;
+			f.mtime = 0;
+			fs::GetFileStat(f.filepath, f.size, f.mtime);
+			files.push_back(f);
+		}
+	}
 
-			SHA1 sha1;
-			sha1.addBytes(tmp_os.str().c_str(), tmp_os.str().length());
+	// Files that haven't changed since the last start aren't read again
+	std::map<std::string, MediaHashCacheEntry> cache;
+	{
+		std::ifstream is(getMediaHashCachePath().c_str());
+		std::string line;
+		while(std::getline(is, line)){
+			std::istringstream ls(line);
+			MediaHashCacheEntry e;
+			std::string path;
+			ls>>e.size>>e.mtime>>e.sha1_base64;
+			ls.get();
+			std::getline(ls, path);
+			if(!ls.fail() && path != "")
+				cache[path] = e;
+		}
+	}
+	u32 hash_count = 0;
+	for(u32 i = 0; i < files.size(); i++){
+		MediaFileToHash &f = files[i];
+		std::map<std::string, MediaHashCacheEntry>::iterator
+				n = cache.find(f.filepath);
+		if(n != cache.end() && f.size != 0 &&
+				n->second.size == f.size && n->second.mtime == f.mtime)
+			f.sha1_base64 = n->second.sha1_base64;
+		else
+			hash_count++;
+	}
 
-			unsigned char *digest = sha1.getDigest();
-			std::string sha1_base64 = base64_encode(digest, 20);
-			std::string sha1_hex = hex_encode((char*)digest, 20);
-			free(digest);
+	// Read and hash the rest on all the threads there are
+	if(hash_count != 0){
+		infostream<<"Server: Hashing "<<hash_count<<" of "<<files.size()
+				<<" media files"<<std::endl;
+		MediaHashTask task(files);
+		getWorkerPool()->run(&task, files.size());
+	}
 
-			// Put in list
-			this->m_media[filename] = MediaInfo(filepath, sha1_base64);
-			verbosestream<<"Server: "<<sha1_hex<<" is "<<filename<<std::endl;
+	for(u32 i = 0; i < files.size(); i++){
+		const MediaFileToHash &f = files[i];
+		if(f.error != ""){
+			errorstream<<"Server::fillMediaCache(): "<<f.error<<std::endl;
+			cache.erase(f.filepath);
+			continue;
+		}
+		MediaHashCacheEntry &e = cache[f.filepath];
+		e.size = f.size;
+		e.mtime = f.mtime;
+		e.sha1_base64 = f.sha1_base64;
+
+		// Put in list
+		this->m_media[f.filename] = MediaInfo(f.filepath, f.sha1_base64);
+		verbosestream<<"Server: "<<hex_encode(base64_decode(f.sha1_base64))
+				<<" is "<<f.filename<<std::endl;
+	}
+
+	// The cache is shared by all the games; only files that are gone
+	// are left out
+	if(hash_count != 0){
+		std::ostringstream os;
+		for(std::map<std::string, MediaHashCacheEntry>::iterator
+				i = cache.begin(); i != cache.end(); i++){
+			if(!fs::PathExists(i->first))
+				continue;
+			os<<i->second.size<<" "<<i->second.mtime<<" "
+					<<i->second.sha1_base64<<" "<<i->first<<"\n";
 		}
+		fs::CreateAllDirs(porting::path_user + DIR_DELIM + "cache");
+		if(!fs::safeWriteToFile(getMediaHashCachePath(), os.str()))
+			errorstream<<"Server: Can't write "<<getMediaHashCachePath()
+					<<std::endl;
 	}
 }
 
@@ -4214,7 +5344,8 @@ void Server::sendRequestedMedia(u16 peer_id,
 	}
 }
 
-void Server::sendDetachedInventory(const std::string &name, u16 peer_id)
+void Server::sendDetachedInventory(const std::string &name, u16 peer_id,
+		bool full)
 {
 	if(m_detached_inventories.count(name) == 0){
 		errorstream<<__FUNCTION_NAME<<": \""<<name<<"\" not found"<<std::endl;
@@ -4222,6 +5353,46 @@ void Server::sendDetachedInventory(const std::string &name, u16 peer_id)
 	}
 	Inventory *inv = m_detached_inventories[name];
 
+	// Clients that are sent the whole inventory
+	std::list<u16> clients;
+	if(peer_id != PEER_ID_INEXISTENT)
+	{
+		// Sent when the client joins; the changes are left for the others
+		clients.push_back(peer_id);
+	}
+	else
+	{
+		/*
+			Every client that has the inventory has been sent all the
+			changes before it, so the ones that understand it get only
+			the new changes
+		*/
+		std::ostringstream os(std::ios_base::binary);
+		writeU16(os, TOCLIENT_DETACHED_INVENTORY_CHANGES);
+		os<<serializeString(name);
+		bool send_changes = !full && inv->serializeChanges(os);
+		inv->clearChanges();
+		std::string s = os.str();
+		SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+
+		std::list<u16> all_clients = m_clients.getClientIDs(CS_Created);
+		for(std::list<u16>::iterator
+			i = all_clients.begin();
+			i != all_clients.end(); ++i)
+		{
+			u16 version = m_clients.getProtocolVersion(*i);
+			if(version == 0)
+				continue;
+			if(send_changes && version >= 27)
+				m_clients.send(*i, 0, data, true);
+			else
+				clients.push_back(*i);
+		}
+	}
+
+	if(clients.empty())
+		return;
+
 	std::ostringstream os(std::ios_base::binary);
 	writeU16(os, TOCLIENT_DETACHED_INVENTORY);
 	os<<serializeString(name);
@@ -4231,14 +5402,12 @@ void Server::sendDetachedInventory(const std::string &name, u16 peer_id)
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 
-	if (peer_id != PEER_ID_INEXISTENT)
+	for(std::list<u16>::iterator
+		i = clients.begin();
+		i != clients.end(); ++i)
 	{
 		// Send as reliable
-		m_clients.send(peer_id, 0, data, true);
-	}
-	else
-	{
-		m_clients.sendToAll(0,data,true);
+		m_clients.send(*i, 0, data, true);
 	}
 }
 
@@ -4251,7 +5420,7 @@ void Server::sendDetachedInventories(u16 peer_id)
 			i != m_detached_inventories.end(); i++){
 		const std::string &name = i->first;
 		//Inventory *inv = i->second;
-		sendDetachedInventory(name, peer_id);
+		sendDetachedInventory(name, peer_id, true);
 	}
 }
 
@@ -4330,6 +5499,12 @@ void Server::DeleteClient(u16 peer_id, ClientDeletionReason reason)
 
 		Player *player = m_env->getPlayer(peer_id);
 
+		// Also the privileges of a name that was denied, and never got
+		// a player, may have been checked
+		RemoteClient *client = m_clients.lockedGetClientNoEx(peer_id, CS_Invalid);
+		if(client != NULL)
+			m_cached_privs.erase(client->getName());
+
 		// Collect information about leaving in chat
 		{
 			if(player != NULL && reason != CDR_DENY)
@@ -4353,6 +5528,7 @@ void Server::DeleteClient(u16 peer_id, ClientDeletionReason reason)
 				m_script->on_leaveplayer(playersao);
 
 				playersao->disconnected();
+				m_cached_privs.erase(player->getName());
 			}
 		}
 
@@ -4363,9 +5539,9 @@ void Server::DeleteClient(u16 peer_id, ClientDeletionReason reason)
 			if(player != NULL && reason != CDR_DENY)
 			{
 				std::ostringstream os(std::ios_base::binary);
-				std::list<u16> clients = m_clients.getClientIDs();
+				ClientIDList clients = m_clients.getActiveClientIDs();
 
-				for(std::list<u16>::iterator
+				for(ClientIDList::const_iterator
 					i = clients.begin();
 					i != clients.end(); ++i)
 				{
@@ -4383,9 +5559,10 @@ void Server::DeleteClient(u16 peer_id, ClientDeletionReason reason)
 			}
 		}
 		{
-			JMutexAutoLock env_lock(m_env_mutex);
+			RWMutexWriteLock env_lock(m_env_mutex);
 			m_clients.DeleteClient(peer_id);
 		}
+		m_emerge->cancelPeerEmerges(peer_id);
 	}
 
 	// Send leave chat message to all remaining clients
@@ -4400,12 +5577,31 @@ void Server::UpdateCrafting(u16 peer_id)
 	Player* player = m_env->getPlayer(peer_id);
 	assert(player);
 
+	// The preview depends only on the craft grid, so the recipe search
+	// and the predict callbacks are skipped if it didn't change
+	PlayerSAO *playersao = player->getPlayerSAO();
+	InventoryList *clist = player->inventory.getList("craft");
+	std::ostringstream grid_os(std::ios_base::binary);
+	if(clist)
+		clist->serialize(grid_os);
+	std::string grid = grid_os.str();
+
 	// Get a preview for crafting
 	ItemStack preview;
-	InventoryLocation loc;
-	loc.setPlayer(player->getName());
-	getCraftingResult(&player->inventory, preview, false, this);
-	m_env->getScriptIface()->item_CraftPredict(preview, player->getPlayerSAO(), (&player->inventory)->getList("craft"), loc);
+	if(playersao && playersao->m_craft_preview_valid &&
+			playersao->m_craft_preview_grid == grid){
+		preview = playersao->m_craft_preview;
+	} else {
+		InventoryLocation loc;
+		loc.setPlayer(player->getName());
+		getCraftingResult(&player->inventory, preview, false, this);
+		m_env->getScriptIface()->item_CraftPredict(preview, playersao, clist, loc);
+		if(playersao){
+			playersao->m_craft_preview_grid = grid;
+			playersao->m_craft_preview = preview;
+			playersao->m_craft_preview_valid = true;
+		}
+	}
 
 	// Put the new preview in
 	InventoryList *plist = player->inventory.getList("craftpreview");
@@ -4456,8 +5652,8 @@ std::wstring Server::getStatusString()
 	// Information about clients
 	bool first = true;
 	os<<L", clients={";
-	std::list<u16> clients = m_clients.getClientIDs();
-	for(std::list<u16>::iterator i = clients.begin();
+	ClientIDList clients = m_clients.getActiveClientIDs();
+	for(ClientIDList::const_iterator i = clients.begin();
 		i != clients.end(); ++i)
 	{
 		// Get player
@@ -4490,15 +5686,49 @@ std::set<std::string> Server::getPlayerEffectivePrivs(const std::string &name)
 
 bool Server::checkPriv(const std::string &name, const std::string &priv)
 {
-	std::set<std::string> privs = getPlayerEffectivePrivs(name);
-	return (privs.count(priv) != 0);
+	std::map<std::string, std::vector<bool> >::iterator i =
+			m_cached_privs.find(name);
+	if(i == m_cached_privs.end()){
+		// A name without an auth entry yet gets one with the default
+		// privileges when it joins, so it isn't cached
+		std::set<std::string> privs;
+		if(!m_script->getAuth(name, NULL, &privs))
+			return false;
+		// Names that try to join but don't end up here too
+		if(m_cached_privs.size() >= PRIVS_CACHE_MAX_PLAYERS)
+			m_cached_privs.clear();
+		std::vector<bool> bits;
+		for(std::set<std::string>::const_iterator
+				j = privs.begin(); j != privs.end(); ++j){
+			std::map<std::string, u16>::iterator k = m_priv_ids.find(*j);
+			if(k == m_priv_ids.end())
+				k = m_priv_ids.insert(std::make_pair(*j,
+						(u16)m_priv_ids.size())).first;
+			if(k->second >= bits.size())
+				bits.resize(k->second + 1, false);
+			bits[k->second] = true;
+		}
+		i = m_cached_privs.insert(std::make_pair(name, bits)).first;
+	}
+
+	// A privilege without a number is one that no cached player has
+	std::map<std::string, u16>::const_iterator id = m_priv_ids.find(priv);
+	if(id == m_priv_ids.end())
+		return false;
+	const std::vector<bool> &bits = i->second;
+	return id->second < bits.size() && bits[id->second];
 }
 
 void Server::reportPrivsModified(const std::string &name)
 {
+	if(name == "")
+		m_cached_privs.clear();
+	else
+		m_cached_privs.erase(name);
+
 	if(name == ""){
-		std::list<u16> clients = m_clients.getClientIDs();
-		for(std::list<u16>::iterator
+		ClientIDList clients = m_clients.getActiveClientIDs();
+		for(ClientIDList::const_iterator
 				i = clients.begin();
 				i != clients.end(); ++i){
 			Player *player = m_env->getPlayer(*i);
@@ -4803,7 +6033,7 @@ Inventory* Server::createDetachedInventory(const std::string &name)
 	assert(inv);
 	m_detached_inventories[name] = inv;
 	//TODO find a better way to do this
-	sendDetachedInventory(name,PEER_ID_INEXISTENT);
+	sendDetachedInventory(name, PEER_ID_INEXISTENT, true);
 	return inv;
 }
 
@@ -4970,6 +6200,16 @@ v3f findSpawnPos(ServerMap &map)
 				-range + (myrand() % (range * 2)),
 				-range + (myrand() % (range * 2)));
 
+		// Skip columns that surely are too low or too high before
+		// doing the more expensive ground level query
+		s16 ground_min, ground_max;
+		if (map.getGroundLevelBounds(
+				getContainerPos(nodepos2d, MAP_BLOCKSIZE),
+				&ground_min, &ground_max) &&
+				(ground_max <= water_level ||
+				ground_min > water_level + 6))
+			continue;
+
 		// Get ground height at point
 		s16 groundheight = map.findGroundLevel(nodepos2d);
 		if (groundheight <= water_level) // Don't go underwater
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "connection.h"
 #include "irr_v3d.h"
 #include "map.h"
+#include "mapblock.h" // MapBlockNetworkSnapshot
 #include "hud.h"
 #include "gamedef.h"
 #include "serialization.h" // For SER_FMT_VER_INVALID
@@ -33,9 +34,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/thread.h"
 #include "environment.h"
 #include "clientiface.h"
+#include "workerpool.h"
 #include <string>
 #include <list>
 #include <map>
+#include <set>
 #include <vector>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
@@ -51,10 +54,16 @@ class PlayerSAO;
 class IRollbackManager;
 class RollbackAction;
 class EmergeManager;
+class MapPregenerator;
 class GameScripting;
 class ServerEnvironment;
 struct SimpleSoundSpec;
 class ServerThread;
+class Server;
+class MetricsThread;
+class PacketTraceWriter;
+class BufferWriter;
+class ServerStartupJob;
 
 enum ClientDeletionReason {
 	CDR_LEAVE,
@@ -62,6 +71,28 @@ enum ClientDeletionReason {
 	CDR_DENY
 };
 
+/*
+	A block to be serialized and sent by a worker thread. The result is
+	handed back to the server thread for the block's serialization cache.
+*/
+struct BlockSendJob : public WorkerJob
+{
+	Server *server;
+	std::vector<u16> peer_ids;
+	u8 ser_ver;
+	u16 net_proto_version;
+	MapBlockNetworkSnapshot snapshot;
+	// Set by the thread
+	std::string data;
+
+	BlockSendJob(Server *server_):
+		server(server_)
+	{
+	}
+
+	void run();
+};
+
 /*
 	Some random functions
 */
@@ -157,6 +188,22 @@ struct ServerSoundParams
 	v3f getPos(ServerEnvironment *env, bool *pos_exists) const;
 };
 
+/*
+	Estimates of the memory taken by the parts of the server, in bytes,
+	without the overhead of the allocator
+*/
+struct ServerMemoryStats
+{
+	// By the names of the parts, see get_memory_stats() in lua_api.txt
+	std::map<std::string, u64> parts;
+	// The connection buffers of each peer
+	std::map<u16, u32> peer_buffers;
+	u32 loaded_blocks;
+	u32 active_objects;
+
+	ServerMemoryStats(): loaded_blocks(0), active_objects(0) {}
+};
+
 struct ServerPlayingSound
 {
 	ServerSoundParams params;
@@ -185,9 +232,16 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void step(float dtime);
 	// This is run by ServerThread and does the actual processing
 	void AsyncRunStep(bool initial_step=false);
+	/*
+		Waits for a packet and handles it, and then the ones that are
+		already queued until a step is due. Throws
+		con::NoIncomingDataException when there's nothing more.
+	*/
 	void Receive();
 	PlayerSAO* StageTwoClientInit(u16 peer_id);
 	void ProcessData(u8 *data, u32 datasize, u16 peer_id);
+	// ProcessData() and the handling of the errors it throws
+	void handleData(u8 *data, u32 datasize, u16 peer_id);
 
 	// Environment must be locked when called
 	void setTimeOfDay(u32 time);
@@ -208,6 +262,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Connection must be locked when called
 	std::wstring getStatusString();
 
+	// Goes through all loaded blocks; the environment must be locked
+	void getMemoryStats(ServerMemoryStats &stats);
+
 	// read shutdown state
 	inline bool getShutdownRequested()
 			{ return m_shutdown_requested; }
@@ -271,6 +328,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	//TODO: determine what (if anything) should be locked to access EmergeManager
 	EmergeManager *getEmergeManager(){ return m_emerge; }
 
+	// Envlock should be locked when using the pregenerator
+	MapPregenerator *getPregenerator(){ return m_pregen; }
+
 	// actions: time-reversed list
 	// Return value: success/failure
 	bool rollbackRevertActions(const std::list<RollbackAction> &actions,
@@ -287,7 +347,7 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	virtual ISoundManager* getSoundManager();
 	virtual MtEventManager* getEventManager();
 	virtual scene::ISceneManager* getSceneManager();
-	virtual IRollbackManager *getRollbackManager() { return m_rollback; }
+	virtual IRollbackManager *getRollbackManager();
 
 
 	IWritableItemDefManager* getWritableItemDefManager();
@@ -319,7 +379,12 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void hudSetHotbarSelectedImage(Player *player, std::string name);
 
 	inline Address getPeerAddress(u16 peer_id)
-			{ return m_con.GetPeerAddress(peer_id); }
+	{
+		// The peers of a replayed packet trace only exist in the trace
+		if(m_packet_replay)
+			return Address(127,0,0,1, peer_id);
+		return m_con.GetPeerAddress(peer_id);
+	}
 			
 	bool setLocalPlayerAnimations(Player *player, v2s32 animation_frames[4], f32 frame_speed);
 	bool setPlayerEyeOffset(Player *player, v3f first, v3f third);
@@ -344,20 +409,28 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	friend class EmergeThread;
 	friend class RemoteClient;
+	friend struct BlockSendJob;
+	friend class ObjectListTask;
+	friend class ObjectMessageTask;
+	friend class PacketTraceReplayer;
 
 	void SendMovement(u16 peer_id);
 	void SendHP(u16 peer_id, u8 hp);
 	void SendBreath(u16 peer_id, u16 breath);
 	void SendAccessDenied(u16 peer_id,const std::wstring &reason);
 	void SendDeathscreen(u16 peer_id,bool set_camera_point_target, v3f camera_point_target);
-	void SendItemDef(u16 peer_id,IItemDefManager *itemdef, u16 protocol_version);
-	void SendNodeDef(u16 peer_id,INodeDefManager *nodedef, u16 protocol_version);
+	// client_sha1 is the SHA1 of the definitions the client has cached
+	void SendItemDef(u16 peer_id, u16 protocol_version,
+			const std::string &client_sha1);
+	void SendNodeDef(u16 peer_id, u16 protocol_version,
+			const std::string &client_sha1);
 
 	/* mark blocks not sent for all clients */
 	void SetBlocksNotSent(std::map<v3s16, MapBlock *>& block);
 
 	// Envlock and conlock should be locked when calling these
-	void SendInventory(u16 peer_id);
+	// full: also send the slots that were not changed, as on joining
+	void SendInventory(u16 peer_id, bool full);
 	void SendChatMessage(u16 peer_id, const std::wstring &message);
 	void SendTimeOfDay(u16 peer_id, u16 time, f32 time_speed);
 	void SendPlayerHP(u16 peer_id);
@@ -390,18 +463,75 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			bool remove_metadata=true);
 	void setBlockNotSent(v3s16 p);
 
+	// Appends the message with its header to an ACTIVE_OBJECT_MESSAGES packet
+	void appendObjectMessage(const ActiveObjectMessage &aom,
+			u16 net_proto_version, BufferWriter &data);
+	void appendObjectMessage(const ActiveObjectMessageBuffer &messages,
+			const ActiveObjectMessageBuffer::Entry &e,
+			u16 net_proto_version, BufferWriter &data);
+	// Position updates of the object are sent to the player's client only
+	// every this many times; environment must be locked
+	u32 getObjectPositionInterval(Player *player, u16 id);
+
+	/*
+		The per-client parts of AsyncRunStep(), run on the worker pool. They
+		read the environment and write only to the client and to their
+		arguments, so they can run for many clients at the same time.
+	*/
+	// Finds the objects that came into or went out of the client's range
+	// and makes the TOCLIENT_ACTIVE_OBJECT_REMOVE_ADD packet for them;
+	// the packet is left empty if nothing changed
+	void makeObjectListUpdate(RemoteClient *client, s16 radius,
+			s16 player_radius, std::vector<u16> &removed_objects,
+			std::vector<u16> &added_objects, SharedBuffer<u8> &packet);
+	// Makes the TOCLIENT_ACTIVE_OBJECT_MESSAGES packets of the client;
+	// order has the (object id, entry index) pairs of messages, sorted
+	void makeObjectMessages(RemoteClient *client,
+			const ActiveObjectMessageBuffer &messages,
+			const std::vector<std::pair<u16, u32> > &order,
+			SharedBuffer<u8> &reliable, SharedBuffer<u8> &unreliable);
+
+	/*
+		Sends the nodes changed since the block's change log was last
+		taken, or sets the block not sent if too many changed. Clients
+		older than TOCLIENT_BLOCK_NODE_CHANGES only get the block resent if
+		resend_to_old_clients is set.
+	*/
+	void sendBlockNodeChanges(v3s16 blockpos,
+			const std::set<v3s16> &cleared_metadata,
+			bool resend_to_old_clients);
+	/*
+		Sends the metadata of the nodes to the clients that have their
+		blocks; older clients get the blocks resent
+	*/
+	void sendNodeMetadataChanges(const std::set<v3s16> &positions);
+
 	// Environment and Connection must be locked when called
-	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version);
+	// With client_token, sends TOCLIENT_BLOCK_CACHED instead of the data
+	// if the token of the data is the same
+	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver,
+			u16 net_proto_version, const u64 *client_token = NULL);
+	// Sends a serialized block; can be called from any thread
+	void sendBlockData(u16 peer_id, v3s16 p, const std::string &data);
+	// Run by BlockSendJob
+	void processBlockSendJob(BlockSendJob *job);
+	// True if the block is waiting in a worker thread to be sent to peer_id
+	bool isBlockSendPending(u16 peer_id, v3s16 p);
 
 	// Sends blocks to clients (locks env and con on its own)
 	void SendBlocks(float dtime);
 
+	// Parts of the startup that are run while the mods are loaded
 	void fillMediaCache();
+	void openRollback();
 	void sendMediaAnnouncement(u16 peer_id);
 	void sendRequestedMedia(u16 peer_id,
 			const std::list<std::string> &tosend);
 
-	void sendDetachedInventory(const std::string &name, u16 peer_id);
+	// peer_id PEER_ID_INEXISTENT: to all clients, only the changes
+	// unless full is set
+	void sendDetachedInventory(const std::string &name, u16 peer_id,
+			bool full);
 	void sendDetachedInventories(u16 peer_id);
 
 	// Adds a ParticleSpawner on peer with peer_id (PEER_ID_INEXISTENT == all)
@@ -449,6 +579,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	void handlePeerChanges();
 
+	// Gives the current values to g_server_metrics
+	void updateMetrics();
+
 	/*
 		Variables
 	*/
@@ -472,11 +605,24 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	float m_objectdata_timer;
 	float m_emergethread_trigger_timer;
 	float m_savemap_timer;
+	float m_metrics_timer;
+	float m_memory_stats_timer;
+	// Size of the heap of the game scripts at the end of the last step
+	u32 m_lua_memory_kb;
 	IntervalLimiter m_map_timer_and_unload_interval;
 
-	// Environment
+	/*
+		Environment
+
+		Everything that changes the map or the objects, and everything
+		involving Lua, holds the write lock. The read lock is enough for
+		looking at them, so that the emerge threads can look for loaded
+		blocks while blocks are selected for sending. Under it only the
+		server thread may do bookkeeping the other readers don't look at,
+		like the usage timers and cached serializations of the blocks.
+	*/
 	ServerEnvironment *m_env;
-	JMutex m_env_mutex;
+	RWMutex m_env_mutex;
 
 	// server connection
 	con::Connection m_con;
@@ -486,11 +632,16 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// Rollback manager (behind m_env_mutex)
 	IRollbackManager *m_rollback;
+	// The job opening it while the mods are loaded, until it is waited for
+	ServerStartupJob *m_rollback_job;
 	bool m_enable_rollback_recording; // Updated once in a while
 
 	// Emerge manager
 	EmergeManager *m_emerge;
 
+	// Background map pregeneration (behind m_env_mutex)
+	MapPregenerator *m_pregen;
+
 	// Scripting
 	// Envlock and conlock should be locked when using Lua
 	GameScripting *m_script;
@@ -525,6 +676,28 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// The server mainly operates in this thread
 	ServerThread *m_thread;
 
+	/*
+		Jobs on the worker pool compress blocks for SendBlocks() without
+		holding m_env_mutex. Finished jobs come back in m_block_send_done.
+		m_block_send_pending holds the peer ids and positions of the blocks
+		that have not been given to the connection yet, and
+		m_block_send_jobs_running the number of jobs not yet finished
+		(both behind m_block_send_pending_mutex).
+	*/
+	bool m_block_send_inline;
+	MutexedQueue<BlockSendJob*> m_block_send_done;
+	std::set<std::pair<u16, v3s16> > m_block_send_pending;
+	u32 m_block_send_jobs_running;
+	JMutex m_block_send_pending_mutex;
+
+	// Writes the metrics file; NULL if metrics_interval is 0
+	MetricsThread *m_metrics_thread;
+
+	// Records what m_thread does; NULL if packet_trace_path is empty
+	PacketTraceWriter *m_packet_trace;
+	// Set by PacketTraceReplayer
+	bool m_packet_replay;
+
 	/*
 		Time related stuff
 	*/
@@ -539,6 +712,15 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	 */
 	ClientInterface m_clients;
 
+	/*
+		Privileges, for checkPriv() without going through the auth handler
+		each time. Each privilege has a number, and each player a set bit
+		for each privilege it has; a player's bits are dropped when
+		reportPrivsModified() is called for it.
+	*/
+	std::map<std::string, u16> m_priv_ids;
+	std::map<std::string, std::vector<bool> > m_cached_privs;
+
 	/*
 		Peer change queue.
 		Queues stuff from peerAdded() and deletingPeer() to
@@ -592,6 +774,18 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// media files known to server
 	std::map<std::string,MediaInfo> m_media;
 
+	/*
+		The compressed item (0) and node (1) definitions for each protocol
+		version, made for the first client that needs them, and their SHA1
+	*/
+	struct DefinitionsData
+	{
+		std::string compressed;
+		std::string sha1;
+	};
+	const DefinitionsData &getDefinitionsData(u8 type, u16 protocol_version);
+	std::map<u16, DefinitionsData> m_definitions_data[2];
+
 	/*
 		Sounds
 	*/
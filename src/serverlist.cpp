@@ -188,6 +188,11 @@ const std::string serializeJson(const std::vector<ServerListSpec> &serverlist)
 
 
 #if USE_CURL
+// The replies to the announces are picked up by checkAnnounce() from
+// the server step, so a slow server list never holds the step up
+static unsigned long announce_caller = HTTPFETCH_DISCARD;
+static bool announce_pending = false;
+
 void sendAnnounce(const std::string &action,
 		const std::vector<std::string> &clients_names,
 		const double uptime,
@@ -248,8 +253,40 @@ void sendAnnounce(const std::string &action,
 	fetch_request.url = g_settings->get("serverlist_url") + std::string("/announce");
 	fetch_request.post_fields["json"] = writer.write(server);
 	fetch_request.multipart = true;
+
+	// Nobody is left to read the reply to a delete
+	if (action != "delete") {
+		// The server list hasn't answered the last announce yet; rather
+		// than queueing up more of them, wait for the next update
+		if (announce_pending && action != "start") {
+			infostream << "Server list hasn't replied to the last announce, "
+				<< "skipping this one" << std::endl;
+			return;
+		}
+		if (announce_caller == HTTPFETCH_DISCARD)
+			announce_caller = httpfetch_caller_alloc();
+		fetch_request.caller = announce_caller;
+		announce_pending = true;
+	}
 	httpfetch_async(fetch_request);
 }
+
+void checkAnnounce()
+{
+	if (!announce_pending)
+		return;
+
+	HTTPFetchResult fetch_result;
+	while (httpfetch_async_get(announce_caller, fetch_result)) {
+		announce_pending = false;
+		// Transfer errors are already logged by httpfetch
+		if (fetch_result.succeeded && fetch_result.response_code != 200) {
+			errorstream << "Server list replied to the announce with "
+				<< "response code " << fetch_result.response_code
+				<< std::endl;
+		}
+	}
+}
 #endif
 
 } //namespace ServerList
@@ -44,6 +44,8 @@ namespace ServerList
 			const float lag = 0, const std::string &gameid = "",
 			const std::string &mg_name = "",
 			const std::vector<ModSpec> &mods = std::vector<ModSpec>());
+	// Picks up the reply to the last announce, if it has come; never waits
+	void checkAnnounce();
 	#endif
 } // ServerList namespace
 
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include "inventory.h"
 #include "constants.h" // BS
+#include "environment.h"
 
 ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 	ActiveObject(0),
@@ -38,6 +39,12 @@ ServerActiveObject::~ServerActiveObject()
 {
 }
 
+u32 ServerActiveObject::getMemoryUsage()
+{
+	return sizeof(ServerActiveObject) +
+			m_messages_out.size() * sizeof(ActiveObjectMessage);
+}
+
 ServerActiveObject* ServerActiveObject::create(u8 type,
 		ServerEnvironment *env, u16 id, v3f pos,
 		const std::string &data)
@@ -67,6 +74,14 @@ void ServerActiveObject::registerType(u16 type, Factory f)
 	m_types[type] = f;
 }
 
+void ServerActiveObject::setBasePosition(v3f pos)
+{
+	m_base_position = pos;
+	// Keep the environment's spatial index in sync
+	if(m_env)
+		m_env->updateActiveObjectBlock(this);
+}
+
 float ServerActiveObject::getMinimumSavedMovement()
 {
 	return 2.0*BS;
@@ -79,7 +79,7 @@ class ServerActiveObject : public ActiveObject
 		Some simple getters/setters
 	*/
 	v3f getBasePosition(){ return m_base_position; }
-	void setBasePosition(v3f pos){ m_base_position = pos; }
+	void setBasePosition(v3f pos);
 	ServerEnvironment* getEnv(){ return m_env; }
 	
 	/*
@@ -96,6 +96,9 @@ class ServerActiveObject : public ActiveObject
 	virtual float getMinimumSavedMovement();
 
 	virtual std::string getDescription(){return "SAO";}
+
+	// Estimate of the bytes taken by the object and its queued messages
+	virtual u32 getMemoryUsage();
 	
 	/*
 		Step object in time.
@@ -108,6 +111,17 @@ class ServerActiveObject : public ActiveObject
 			packet.
 	*/
 	virtual void step(float dtime, bool send_recommended){}
+	/*
+		Called after step() of all the objects and the on_step callbacks
+		of the entities, which are run together for all of them between
+		the two.
+	*/
+	virtual void finishStep(){}
+	/*
+		Idle objects may stop stepping; this makes them step again.
+		Called when something the object might react to changes.
+	*/
+	virtual void wakeUp(){}
 	
 	/*
 		The return value of this is passed to the client-side object
@@ -216,9 +230,10 @@ class ServerActiveObject : public ActiveObject
 	v3s16 m_static_block;
 	
 	/*
-		Queue of messages to be sent to the client
+		Messages to be sent to the clients, moved to the message buffer of
+		the environment after each step of the object
 	*/
-	Queue<ActiveObjectMessage> m_messages_out;
+	std::vector<ActiveObjectMessage> m_messages_out;
 	
 protected:
 	// Used for creating objects based on type
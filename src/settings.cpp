@@ -118,6 +118,7 @@ bool Settings::parseConfigLines(std::istream &is, const std::string &end)
 			break;
 		case SPE_KVPAIR:
 			m_settings[name] = SettingsEntry(value);
+			m_change_count++;
 			break;
 		case SPE_END:
 			return true;
@@ -127,10 +128,12 @@ bool Settings::parseConfigLines(std::istream &is, const std::string &end)
 				return false;
 
 			m_settings[name] = SettingsEntry(branch);
+			m_change_count++;
 			break;
 		}
 		case SPE_MULTILINE:
 			m_settings[name] = SettingsEntry(getMultiline(is));
+			m_change_count++;
 			break;
 		}
 	}
@@ -771,6 +774,7 @@ void Settings::set(const std::string &name, const std::string &value)
 		JMutexAutoLock lock(m_mutex);
 
 		m_settings[name].value = value;
+		m_change_count++;
 	}
 	doCallbacks(name);
 }
@@ -784,6 +788,7 @@ void Settings::setGroup(const std::string &name, Settings *group)
 
 		old_group = m_settings[name].group;
 		m_settings[name].group = group;
+		m_change_count++;
 	}
 	delete old_group;
 }
@@ -794,6 +799,7 @@ void Settings::setDefault(const std::string &name, const std::string &value)
 	JMutexAutoLock lock(m_mutex);
 
 	m_defaults[name].value = value;
+	m_change_count++;
 }
 
 
@@ -805,6 +811,7 @@ void Settings::setGroupDefault(const std::string &name, Settings *group)
 
 		old_group = m_defaults[name].group;
 		m_defaults[name].group = group;
+		m_change_count++;
 	}
 	delete old_group;
 }
@@ -901,6 +908,7 @@ void Settings::setNoiseParams(const std::string &name, const NoiseParams &np)
 		old_group = m_settings[name].group;
 		m_settings[name].group = group;
 		m_settings[name].value = "";
+		m_change_count++;
 	}
 	delete old_group;
 }
@@ -909,7 +917,9 @@ void Settings::setNoiseParams(const std::string &name, const NoiseParams &np)
 bool Settings::remove(const std::string &name)
 {
 	JMutexAutoLock lock(m_mutex);
-	return m_settings.erase(name);
+	bool removed = m_settings.erase(name);
+	m_change_count++;
+	return removed;
 }
 
 
@@ -931,6 +941,7 @@ void Settings::updateValue(const Settings &other, const std::string &name)
 		std::string val = other.get(name);
 
 		m_settings[name] = val;
+		m_change_count++;
 	} catch (SettingNotFoundException &e) {
 	}
 }
@@ -980,6 +991,7 @@ void Settings::updateNoLock(const Settings &other)
 {
 	m_settings.insert(other.m_settings.begin(), other.m_settings.end());
 	m_defaults.insert(other.m_defaults.begin(), other.m_defaults.end());
+	m_change_count++;
 }
 
 
@@ -987,6 +999,7 @@ void Settings::clearNoLock()
 {
 	m_settings.clear();
 	m_defaults.clear();
+	m_change_count++;
 }
 
 
@@ -27,6 +27,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <map>
 #include <list>
 #include <set>
+#if __cplusplus >= 201103L
+#include <atomic>
+#endif
 
 class Settings;
 struct NoiseParams;
@@ -91,7 +94,9 @@ struct SettingsEntry {
 
 class Settings {
 public:
-	Settings() {}
+	Settings():
+		m_change_count(0)
+	{}
 	~Settings();
 
 	Settings & operator += (const Settings &other);
@@ -212,6 +217,13 @@ class Settings {
 	void update(const Settings &other);
 	void registerChangedCallback(std::string name, setting_changed_callback cbf);
 
+	// Incremented after every change of the settings or the defaults,
+	// read without locking
+	u32 getChangeCount() const
+	{
+		return m_change_count;
+	}
+
 private:
 
 	void updateNoLock(const Settings &other);
@@ -224,6 +236,63 @@ class Settings {
 	std::map<std::string, std::vector<setting_changed_callback> > m_callbacks;
 	// All methods that access m_settings/m_defaults directly should lock this.
 	mutable JMutex m_mutex;
+	// Reading and writing u32 values is atomic on all relevant
+	// architectures, like the flags of JThread
+#if __cplusplus >= 201103L
+	std::atomic<u32> m_change_count;
+#else
+	volatile u32 m_change_count;
+#endif
+};
+
+/*
+	Keeps the parsed value of a setting, for the ones that are read very
+	often, like every step or for every client.  The value is only parsed
+	again after the settings have changed.  Throws like the getters of
+	Settings if the setting doesn't exist.
+
+	The handle itself isn't thread-safe; every thread reads a setting
+	through a handle of its own.
+*/
+template<typename T>
+class SettingHandle
+{
+public:
+	SettingHandle(const Settings *settings, const std::string &name):
+		m_settings(settings),
+		m_name(name),
+		m_valid(false),
+		m_change_count(0)
+	{}
+
+	T get()
+	{
+		// Read before the value, so that a change in between only makes
+		// the value to be parsed once more
+		u32 change_count = m_settings->getChangeCount();
+		if (!m_valid || change_count != m_change_count) {
+			read(m_value);
+			m_change_count = change_count;
+			m_valid = true;
+		}
+		return m_value;
+	}
+
+private:
+	void read(bool &value)        { value = m_settings->getBool(m_name); }
+	void read(u16 &value)         { value = m_settings->getU16(m_name); }
+	void read(s16 &value)         { value = m_settings->getS16(m_name); }
+	void read(s32 &value)         { value = m_settings->getS32(m_name); }
+	void read(u64 &value)         { value = m_settings->getU64(m_name); }
+	void read(float &value)       { value = m_settings->getFloat(m_name); }
+	void read(v3f &value)         { value = m_settings->getV3F(m_name); }
+	void read(std::string &value) { value = m_settings->get(m_name); }
+
+	const Settings *m_settings;
+	std::string m_name;
+	bool m_valid;
+	u32 m_change_count;
+	T m_value;
 };
 
 #endif
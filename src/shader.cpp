@@ -27,6 +27,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/thread.h"
 #include "settings.h"
 #include <iterator>
+#include <map>
+#include <cstring>
 #include <ICameraSceneNode.h>
 #include <IGPUProgrammingServices.h>
 #include <IMaterialRenderer.h>
@@ -169,6 +171,73 @@ class SourceShaderCache
 	}
 };
 
+/*
+	ShaderConstants
+*/
+
+u32 ShaderConstants::getSlot(const char *name)
+{
+	std::map<const char *, u32>::iterator i = m_slots_by_address.find(name);
+	if(i != m_slots_by_address.end())
+		return i->second;
+
+	std::map<std::string, u32>::iterator j = m_slots.find(name);
+	u32 slot;
+	if(j != m_slots.end()) {
+		slot = j->second;
+	} else {
+		slot = m_slots.size();
+		m_slots[name] = slot;
+	}
+	m_slots_by_address[name] = slot;
+	return slot;
+}
+
+bool ShaderConstants::update(Values &values, const char *name,
+		const void *data, u32 count)
+{
+	u32 slot = getSlot(name);
+	if(slot >= values.size())
+		values.resize(slot + 1);
+	std::vector<u32> &value = values[slot];
+	if(value.size() == count &&
+			memcmp(&value[0], data, count * sizeof(u32)) == 0)
+		return false;
+	value.resize(count);
+	memcpy(&value[0], data, count * sizeof(u32));
+	return true;
+}
+
+void ShaderConstants::setPixelShaderConstant(const char *name,
+		const f32 *floats, u32 count)
+{
+	if(update(m_program->pixel, name, floats, count))
+		m_services->setPixelShaderConstant(name, floats, count);
+}
+
+void ShaderConstants::setVertexShaderConstant(const char *name,
+		const f32 *floats, u32 count)
+{
+	if(update(m_program->vertex, name, floats, count))
+		m_services->setVertexShaderConstant(name, floats, count);
+}
+
+#if !(IRRLICHT_VERSION_MAJOR == 1 && IRRLICHT_VERSION_MINOR < 8)
+void ShaderConstants::setPixelShaderConstant(const char *name,
+		const s32 *ints, u32 count)
+{
+	if(update(m_program->pixel, name, ints, count))
+		m_services->setPixelShaderConstant(name, ints, count);
+}
+#endif
+
+void ShaderConstants::clear()
+{
+	// The slots of the names stay the same
+	m_programs.clear();
+	m_program = NULL;
+}
+
 /*
 	ShaderCallback: Sets constants that can be used in shaders
 */
@@ -177,7 +246,7 @@ class IShaderConstantSetterRegistry
 {
 public:
 	virtual ~IShaderConstantSetterRegistry(){};
-	virtual void onSetConstants(video::IMaterialRendererServices *services,
+	virtual void onSetConstants(ShaderConstants &constants,
 			bool is_highlevel, const std::string &name) = 0;
 };
 
@@ -185,14 +254,29 @@ class ShaderCallback : public video::IShaderConstantSetCallBack
 {
 	IShaderConstantSetterRegistry *m_scsr;
 	std::string m_name;
+	// MaterialTypeParam2 of the material being drawn, see
+	// SHADER_BLEND_DAYNIGHT
+	f32 m_blend_daynight;
+	// The material type of the material being drawn; there is a program
+	// for every material type
+	s32 m_program;
+	ShaderConstants m_constants;
 
 public:
 	ShaderCallback(IShaderConstantSetterRegistry *scsr, const std::string &name):
 		m_scsr(scsr),
-		m_name(name)
+		m_name(name),
+		m_blend_daynight(0),
+		m_program(0)
 	{}
 	~ShaderCallback() {}
 
+	virtual void OnSetMaterial(const video::SMaterial &material)
+	{
+		m_blend_daynight = material.MaterialTypeParam2;
+		m_program = material.MaterialType;
+	}
+
 	virtual void OnSetConstants(video::IMaterialRendererServices *services, s32 userData)
 	{
 		video::IVideoDriver *driver = services->getVideoDriver();
@@ -200,7 +284,18 @@ class ShaderCallback : public video::IShaderConstantSetCallBack
 
 		bool is_highlevel = userData;
 
-		m_scsr->onSetConstants(services, is_highlevel, m_name);
+		m_constants.begin(services, m_program);
+
+		if(is_highlevel)
+			m_constants.setVertexShaderConstant("blendDayNight",
+					&m_blend_daynight, 1);
+
+		m_scsr->onSetConstants(m_constants, is_highlevel, m_name);
+	}
+
+	void clearConstants()
+	{
+		m_constants.clear();
 	}
 };
 
@@ -210,50 +305,74 @@ class ShaderCallback : public video::IShaderConstantSetCallBack
 
 class MainShaderConstantSetter : public IShaderConstantSetter
 {
+	// The transforms that the matrices below were made of; most things
+	// are drawn with the same ones, which saves the inversion
+	core::matrix4 m_world;
+	core::matrix4 m_view;
+	core::matrix4 m_projection;
+	bool m_matrices_valid;
+
+	core::matrix4 m_inv_world;
+	core::matrix4 m_world_view_proj;
+	core::matrix4 m_trans_world;
+
 public:
-	MainShaderConstantSetter(IrrlichtDevice *device)
+	MainShaderConstantSetter(IrrlichtDevice *device):
+		m_matrices_valid(false)
 	{}
 	~MainShaderConstantSetter() {}
 
-	virtual void onSetConstants(video::IMaterialRendererServices *services,
+	void updateMatrices(video::IVideoDriver *driver)
+	{
+		const core::matrix4 &world = driver->getTransform(video::ETS_WORLD);
+		const core::matrix4 &view = driver->getTransform(video::ETS_VIEW);
+		const core::matrix4 &projection =
+				driver->getTransform(video::ETS_PROJECTION);
+		if(m_matrices_valid && world == m_world && view == m_view &&
+				projection == m_projection)
+			return;
+		m_world = world;
+		m_view = view;
+		m_projection = projection;
+		m_matrices_valid = true;
+
+		// inverted world matrix
+		m_inv_world = world;
+		m_inv_world.makeInverse();
+
+		// clip matrix
+		m_world_view_proj = projection;
+		m_world_view_proj *= view;
+		m_world_view_proj *= world;
+
+		// transposed world matrix
+		m_trans_world = world.getTransposed();
+	}
+
+	virtual void onSetConstants(ShaderConstants &constants,
 			bool is_highlevel)
 	{
+		video::IMaterialRendererServices *services = constants.getServices();
 		video::IVideoDriver *driver = services->getVideoDriver();
 		assert(driver);
 
-		// set inverted world matrix
-		core::matrix4 invWorld = driver->getTransform(video::ETS_WORLD);
-		invWorld.makeInverse();
-		if(is_highlevel)
-			services->setVertexShaderConstant("mInvWorld", invWorld.pointer(), 16);
-		else
-			services->setVertexShaderConstant(invWorld.pointer(), 0, 4);
-
-		// set clip matrix
-		core::matrix4 worldViewProj;
-		worldViewProj = driver->getTransform(video::ETS_PROJECTION);
-		worldViewProj *= driver->getTransform(video::ETS_VIEW);
-		worldViewProj *= driver->getTransform(video::ETS_WORLD);
-		if(is_highlevel)
-			services->setVertexShaderConstant("mWorldViewProj", worldViewProj.pointer(), 16);
-		else
-			services->setVertexShaderConstant(worldViewProj.pointer(), 4, 4);
-
-		// set transposed world matrix
-		core::matrix4 transWorld = driver->getTransform(video::ETS_WORLD);
-		transWorld = transWorld.getTransposed();
-		if(is_highlevel)
-			services->setVertexShaderConstant("mTransWorld", transWorld.pointer(), 16);
-		else
-			services->setVertexShaderConstant(transWorld.pointer(), 8, 4);
-
-		// set world matrix
-		core::matrix4 world = driver->getTransform(video::ETS_WORLD);
-		if(is_highlevel)
-			services->setVertexShaderConstant("mWorld", world.pointer(), 16);
-		else
-			services->setVertexShaderConstant(world.pointer(), 8, 4);
-
+		updateMatrices(driver);
+
+		if(is_highlevel){
+			constants.setVertexShaderConstant("mInvWorld",
+					m_inv_world.pointer(), 16);
+			constants.setVertexShaderConstant("mWorldViewProj",
+					m_world_view_proj.pointer(), 16);
+			constants.setVertexShaderConstant("mTransWorld",
+					m_trans_world.pointer(), 16);
+			constants.setVertexShaderConstant("mWorld",
+					m_world.pointer(), 16);
+		} else {
+			services->setVertexShaderConstant(m_inv_world.pointer(), 0, 4);
+			services->setVertexShaderConstant(m_world_view_proj.pointer(), 4, 4);
+			services->setVertexShaderConstant(m_trans_world.pointer(), 8, 4);
+			services->setVertexShaderConstant(m_world.pointer(), 8, 4);
+		}
 	}
 };
 
@@ -309,7 +428,9 @@ class ShaderSource : public IWritableShaderSource, public IShaderConstantSetterR
 		m_global_setters.push_back(setter);
 	}
 
-	void onSetConstants(video::IMaterialRendererServices *services,
+	void onNewFrame();
+
+	void onSetConstants(ShaderConstants &constants,
 			bool is_highlevel, const std::string &name);
 
 private:
@@ -325,6 +446,11 @@ class ShaderSource : public IWritableShaderSource, public IShaderConstantSetterR
 	// This should be only accessed from the main thread
 	SourceShaderCache m_sourcecache;
 
+	// Materials by the full sources of their programs, so that shaders
+	// that come out the same for other drawtypes or material types are
+	// compiled once. Only accessed from the main thread.
+	std::map<std::string, video::E_MATERIAL_TYPE> m_compiled_materials;
+
 	// A shader id is index in this array.
 	// The first position contains a dummy shader.
 	std::vector<ShaderInfo> m_shaderinfo_cache;
@@ -333,6 +459,7 @@ class ShaderSource : public IWritableShaderSource, public IShaderConstantSetterR
 
 	// Queued shader fetches (to be processed by the main thread)
 	RequestQueue<std::string, u32, u8, u8> m_get_shader_queue;
+	ThreadResultQueues<std::string, u32, u8, u8> m_get_shader_results;
 
 	// Global constant setters
 	// TODO: Delete these in the destructor
@@ -351,7 +478,8 @@ ShaderInfo generate_shader(std::string name,
 		u8 material_type, u8 drawtype,
 		IrrlichtDevice *device,
 		video::IShaderConstantSetCallBack *callback,
-		SourceShaderCache *sourcecache);
+		SourceShaderCache *sourcecache,
+		std::map<std::string, video::E_MATERIAL_TYPE> *compiled_materials);
 
 /*
 	Load shader programs
@@ -405,7 +533,8 @@ u32 ShaderSource::getShader(const std::string &name,
 
 		// We're gonna ask the result to be put into here
 
-		static ResultQueue<std::string, u32, u8, u8> result_queue;
+		ResultQueue<std::string, u32, u8, u8> &result_queue =
+				*m_get_shader_results.get();
 
 		// Throw a request in
 		m_get_shader_queue.add(name, 0, 0, &result_queue);
@@ -464,7 +593,7 @@ u32 ShaderSource::getShaderIdDirect(const std::string &name,
 	}
 
 	ShaderInfo info = generate_shader(name, material_type, drawtype, m_device,
-			m_shader_callback, &m_sourcecache);
+			m_shader_callback, &m_sourcecache, &m_compiled_materials);
 
 	/*
 		Add shader to caches (add dummy shaders too)
@@ -529,23 +658,34 @@ void ShaderSource::rebuildShaders()
 		ShaderInfo *info = &m_shaderinfo_cache[i];
 		if(info->name != ""){
 			*info = generate_shader(info->name, info->material_type,
-					info->drawtype, m_device, m_shader_callback, &m_sourcecache);
+					info->drawtype, m_device, m_shader_callback,
+					&m_sourcecache, &m_compiled_materials);
 		}
 	}
+
+	// The programs are new, none of them has any constants set yet
+	m_shader_callback->clearConstants();
+}
+
+void ShaderSource::onNewFrame()
+{
+	for(u32 i=0; i<m_global_setters.size(); i++)
+		m_global_setters[i]->onNewFrame();
 }
 
-void ShaderSource::onSetConstants(video::IMaterialRendererServices *services,
+void ShaderSource::onSetConstants(ShaderConstants &constants,
 		bool is_highlevel, const std::string &name)
 {
 	for(u32 i=0; i<m_global_setters.size(); i++){
 		IShaderConstantSetter *setter = m_global_setters[i];
-		setter->onSetConstants(services, is_highlevel);
+		setter->onSetConstants(constants, is_highlevel);
 	}
 }
 
 ShaderInfo generate_shader(std::string name, u8 material_type, u8 drawtype,
 		IrrlichtDevice *device,	video::IShaderConstantSetCallBack *callback,
-		SourceShaderCache *sourcecache)
+		SourceShaderCache *sourcecache,
+		std::map<std::string, video::E_MATERIAL_TYPE> *compiled_materials)
 {
 	ShaderInfo shaderinfo;
 	shaderinfo.name = name;
@@ -674,12 +814,19 @@ ShaderInfo generate_shader(std::string name, u8 material_type, u8 drawtype,
 		shaders_header += "\n";
 	}
 
-	shaders_header += "#define MATERIAL_TYPE ";
-	shaders_header += itos(material_type);
-	shaders_header += "\n";
-	shaders_header += "#define DRAW_TYPE ";
-	shaders_header += itos(drawtype);
-	shaders_header += "\n";
+	// Only defined for the programs that look at them, so that the others
+	// come out the same and are compiled once
+	std::string programs = vertex_program + pixel_program + geometry_program;
+	if (programs.find("MATERIAL_TYPE") != std::string::npos) {
+		shaders_header += "#define MATERIAL_TYPE ";
+		shaders_header += itos(material_type);
+		shaders_header += "\n";
+	}
+	if (programs.find("DRAW_TYPE") != std::string::npos) {
+		shaders_header += "#define DRAW_TYPE ";
+		shaders_header += itos(drawtype);
+		shaders_header += "\n";
+	}
 
 	if (g_settings->getBool("generate_normalmaps")){
 		shaders_header += "#define GENERATE_NORMALMAPS\n";
@@ -757,6 +904,19 @@ ShaderInfo generate_shader(std::string name, u8 material_type, u8 drawtype,
 	if(geometry_program != "")
 		geometry_program = shaders_header + geometry_program;
 
+	// Reuse the material if the same programs have been compiled already
+	std::string compiled_key = itos(shaderinfo.base_material) + " "
+			+ itos(is_highlevel) + "\n" + vertex_program + '\0'
+			+ pixel_program + '\0' + geometry_program;
+	std::map<std::string, video::E_MATERIAL_TYPE>::iterator compiled =
+			compiled_materials->find(compiled_key);
+	if(compiled != compiled_materials->end()){
+		infostream<<"generate_shader(): "<<name<<" is the same as a "
+				"shader compiled before"<<std::endl;
+		shaderinfo.material = compiled->second;
+		return shaderinfo;
+	}
+
 	// Call addHighLevelShaderMaterial() or addShaderMaterial()
 	const c8* vertex_program_ptr = 0;
 	const c8* pixel_program_ptr = 0;
@@ -820,6 +980,7 @@ ShaderInfo generate_shader(std::string name, u8 material_type, u8 drawtype,
 
 	// Apply the newly created material type
 	shaderinfo.material = (video::E_MATERIAL_TYPE) shadermat;
+	(*compiled_materials)[compiled_key] = shaderinfo.material;
 	return shaderinfo;
 }
 
@@ -24,6 +24,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes_extrabloated.h"
 #include "threads.h"
 #include <string>
+#include <vector>
+#include <map>
 
 class IGameDef;
 
@@ -66,11 +68,91 @@ namespace irr { namespace video {
 	class IMaterialRendererServices;
 } }
 
+/*
+	Materials with this MaterialTypeParam2 have the day and night light
+	in the red and green of the vertex colors. The nodes shaders blend
+	them with dayNightRatio, so that the vertices don't have to be
+	changed when it changes.
+*/
+#define SHADER_BLEND_DAYNIGHT 1.0f
+
+/*
+	The constants of the shader program that is being drawn with. GL keeps
+	the values of the uniforms of every program, so a value is only sent
+	when it differs from the one last sent to the current program.
+
+	The names are looked up by their address, so they have to stay valid
+	as long as the ShaderConstants; string literals are.
+*/
+class ShaderConstants
+{
+public:
+	ShaderConstants():
+		m_services(NULL),
+		m_program(NULL)
+	{}
+
+	// Called before the setters, with the material type of the program
+	void begin(video::IMaterialRendererServices *services, s32 program)
+	{
+		m_services = services;
+		if(program < 0)
+			program = 0;
+		if((u32)program >= m_programs.size())
+			m_programs.resize(program + 1);
+		m_program = &m_programs[program];
+	}
+	// For the constants of low level shaders, which aren't cached
+	video::IMaterialRendererServices * getServices()
+	{
+		return m_services;
+	}
+
+	void setPixelShaderConstant(const char *name, const f32 *floats,
+			u32 count);
+	void setVertexShaderConstant(const char *name, const f32 *floats,
+			u32 count);
+#if !(IRRLICHT_VERSION_MAJOR == 1 && IRRLICHT_VERSION_MINOR < 8)
+	void setPixelShaderConstant(const char *name, const s32 *ints,
+			u32 count);
+#endif
+	// Forgets what was sent, for when the programs are made again
+	void clear();
+
+private:
+	// The last values sent of each uniform, as their bits, by the slot
+	// of the uniform
+	typedef std::vector<std::vector<u32> > Values;
+	struct Program
+	{
+		Values pixel;
+		Values vertex;
+	};
+
+	// The slot of a uniform name, which is the same for every program
+	u32 getSlot(const char *name);
+	// Remembers the value and tells if it has to be sent
+	bool update(Values &values, const char *name, const void *data,
+			u32 count);
+
+	video::IMaterialRendererServices *m_services;
+	// The slots of the names by their addresses, and by the names for the
+	// same name at other addresses
+	std::map<const char *, u32> m_slots_by_address;
+	std::map<std::string, u32> m_slots;
+	// The programs by their material types
+	std::vector<Program> m_programs;
+	Program *m_program;
+};
+
 class IShaderConstantSetter
 {
 public:
 	virtual ~IShaderConstantSetter(){};
-	virtual void onSetConstants(video::IMaterialRendererServices *services,
+	// Called once before every frame is drawn; values that can't change
+	// within a frame are best worked out here
+	virtual void onNewFrame() {}
+	virtual void onSetConstants(ShaderConstants &constants,
 			bool is_highlevel) = 0;
 };
 
@@ -106,6 +188,8 @@ class IWritableShaderSource : public IShaderSource
 		const std::string &filename, const std::string &program)=0;
 	virtual void rebuildShaders()=0;
 	virtual void addGlobalConstantSetter(IShaderConstantSetter *setter)=0;
+	// Shall be called from the main thread before drawing every frame
+	virtual void onNewFrame()=0;
 };
 
 IWritableShaderSource* createShaderSource(IrrlichtDevice *device);
@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "log.h"
 #include "main.h" // for g_settings
+#include "config.h"
 
 #ifdef _WIN32
 	#ifndef WIN32_LEAN_AND_MEAN
@@ -470,6 +471,87 @@ void UDPSocket::Send(const Address & destination, const void * data, int size)
 		throw SendFailedException("Failed to send packet");
 }
 
+u32 UDPSocket::SendBatch(const UDPDatagram *datagrams, u32 count)
+{
+	u32 failed = 0;
+
+#if HAVE_SENDMMSG
+	// The simulator and debug output need to see every packet
+	if(!INTERNET_SIMULATOR && !socket_enable_debug_output) {
+		struct mmsghdr msgs[UDP_SEND_BATCH_MAX];
+		struct iovec iovecs[UDP_SEND_BATCH_MAX];
+		union {
+			struct sockaddr_in  ipv4;
+			struct sockaddr_in6 ipv6;
+		} addresses[UDP_SEND_BATCH_MAX];
+
+		u32 next = 0;
+		while(next < count) {
+			// Fill in a batch, skipping datagrams that can't be sent
+			u32 indices[UDP_SEND_BATCH_MAX];
+			u32 n = 0;
+			for(; next < count && n < UDP_SEND_BATCH_MAX; next++) {
+				const UDPDatagram &d = datagrams[next];
+				if(d.destination.getFamily() != m_addr_family) {
+					failed++;
+					continue;
+				}
+				memset(&msgs[n], 0, sizeof(msgs[n]));
+				if(m_addr_family == AF_INET6) {
+					addresses[n].ipv6 = d.destination.getAddress6();
+					addresses[n].ipv6.sin6_port =
+							htons(d.destination.getPort());
+					msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+				} else {
+					addresses[n].ipv4 = d.destination.getAddress();
+					addresses[n].ipv4.sin_port =
+							htons(d.destination.getPort());
+					msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+				}
+				iovecs[n].iov_base = const_cast<void *>(d.data);
+				iovecs[n].iov_len = d.size;
+				msgs[n].msg_hdr.msg_name = &addresses[n];
+				msgs[n].msg_hdr.msg_iov = &iovecs[n];
+				msgs[n].msg_hdr.msg_iovlen = 1;
+				indices[n] = next;
+				n++;
+			}
+
+			// The kernel may take only a part of the batch
+			u32 sent = 0;
+			while(sent < n) {
+				int r = sendmmsg(m_handle, &msgs[sent], n - sent, 0);
+				if(r < 0) {
+					if(errno == EINTR)
+						continue;
+					// Drop the datagram that failed and go on
+					failed++;
+					sent++;
+					continue;
+				}
+				for(int i = 0; i < r; i++) {
+					if(msgs[sent + i].msg_len !=
+							(unsigned int)datagrams[indices[sent + i]].size)
+						failed++;
+				}
+				sent += r;
+			}
+		}
+		return failed;
+	}
+#endif
+
+	for(u32 i = 0; i < count; i++) {
+		try {
+			Send(datagrams[i].destination, datagrams[i].data,
+					datagrams[i].size);
+		} catch(SendFailedException &e) {
+			failed++;
+		}
+	}
+	return failed;
+}
+
 int UDPSocket::Receive(Address & sender, void *data, int size)
 {
 	// Return on timeout
@@ -533,6 +615,68 @@ int UDPSocket::Receive(Address & sender, void *data, int size)
 	return received;
 }
 
+u32 UDPSocket::ReceiveBatch(UDPReceiveSlot *slots, u32 count)
+{
+	if(count == 0)
+		return 0;
+
+#if HAVE_RECVMMSG
+	// Debug output wants to see every packet
+	if(!socket_enable_debug_output) {
+		struct mmsghdr msgs[UDP_RECEIVE_BATCH_MAX];
+		struct iovec iovecs[UDP_RECEIVE_BATCH_MAX];
+		union {
+			struct sockaddr_in  ipv4;
+			struct sockaddr_in6 ipv6;
+		} addresses[UDP_RECEIVE_BATCH_MAX];
+
+		if(count > UDP_RECEIVE_BATCH_MAX)
+			count = UDP_RECEIVE_BATCH_MAX;
+
+		memset(msgs, 0, sizeof(msgs[0]) * count);
+		memset(addresses, 0, sizeof(addresses[0]) * count);
+		for(u32 i = 0; i < count; i++) {
+			iovecs[i].iov_base = slots[i].data;
+			iovecs[i].iov_len = slots[i].capacity;
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int r;
+		do {
+			r = recvmmsg(m_handle, msgs, count, MSG_DONTWAIT, NULL);
+		} while(r < 0 && errno == EINTR);
+
+		if(r <= 0)
+			return 0;
+
+		for(int i = 0; i < r; i++) {
+			UDPReceiveSlot &slot = slots[i];
+			slot.size = msgs[i].msg_len;
+			if(m_addr_family == AF_INET6) {
+				IPv6AddressBytes bytes;
+				memcpy(bytes.bytes, addresses[i].ipv6.sin6_addr.s6_addr, 16);
+				slot.sender = Address(&bytes,
+						ntohs(addresses[i].ipv6.sin6_port));
+			} else {
+				slot.sender = Address(
+						ntohl(addresses[i].ipv4.sin_addr.s_addr),
+						ntohs(addresses[i].ipv4.sin_port));
+			}
+		}
+		return r;
+	}
+#endif
+
+	int received = Receive(slots[0].sender, slots[0].data, slots[0].capacity);
+	if(received < 0)
+		return 0;
+	slots[0].size = received;
+	return 1;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
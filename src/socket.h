@@ -72,6 +72,10 @@ class SendFailedException : public BaseException
 void sockets_init();
 void sockets_cleanup();
 
+// Maximum number of datagrams handed to the kernel in one call
+#define UDP_SEND_BATCH_MAX 64
+#define UDP_RECEIVE_BATCH_MAX 32
+
 class IPv6AddressBytes
 {
 public:
@@ -112,6 +116,22 @@ class Address
 	u16 m_port; // Port is separate from sockaddr structures
 };
 
+struct UDPDatagram
+{
+	Address destination;
+	const void *data;
+	int size;
+};
+
+// A caller owned buffer filled in by UDPSocket::ReceiveBatch()
+struct UDPReceiveSlot
+{
+	Address sender;
+	void *data;
+	int capacity;
+	int size; // Set to the received size
+};
+
 class UDPSocket
 {
 public:
@@ -125,8 +145,16 @@ class UDPSocket
 	//void Close();
 	//bool IsOpen();
 	void Send(const Address & destination, const void * data, int size);
+	// Sends many datagrams using as few system calls as the platform
+	// allows. Doesn't throw; returns the number of datagrams that failed.
+	u32 SendBatch(const UDPDatagram *datagrams, u32 count);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	// Fills up to count slots with datagrams that are already queued,
+	// using as few system calls as the platform allows. Should be called
+	// after WaitData() has returned true. Returns the number of slots
+	// filled; doesn't block for more data.
+	u32 ReceiveBatch(UDPReceiveSlot *slots, u32 count);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
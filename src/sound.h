@@ -69,6 +69,8 @@ class ISoundManager
 	virtual void stopSound(int sound) = 0;
 	virtual bool soundExists(int sound) = 0;
 	virtual void updateSoundPosition(int sound, v3f pos) = 0;
+	// Called every frame, for whatever has to be done while sounds play
+	virtual void step(float dtime) {}
 
 	int playSound(const SimpleSoundSpec &spec, bool loop)
 		{ return playSound(spec.name, loop, spec.gain); }
@@ -42,11 +42,21 @@ with this program; ifnot, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h" // myrand()
 #include "debug.h" // assert()
 #include "porting.h"
+#include "workerpool.h"
+#include "settings.h"
+#include "main.h" // for g_settings
 #include <map>
 #include <vector>
-#include <fstream>
+#include <deque>
+#include <cstring>
+#include <cstdio>
 
 #define BUFFER_SIZE 30000
+// Streamed sounds are queued in this many buffers, each decoded separately
+#define STREAM_BUFFER_COUNT 4
+#define STREAM_BUFFER_SIZE 65536
+// Sources of stopped sounds that are kept to be used again
+#define SOURCE_POOL_MAX 32
 
 static const char *alcErrorString(ALCenum err)
 {
@@ -109,17 +119,73 @@ struct SoundBuffer
 	ALsizei freq;
 	ALuint buffer_id;
 	std::vector<char> buffer;
+	std::string name;
+	// Where the sound is decoded from again: the file, or the encoded data
+	// if it was given as data
+	std::string path;
+	std::string data;
+	// Long sounds are decoded while they play and have no buffer_id
+	bool stream;
+	// Bytes in buffer_id
+	u32 size;
+	// Playing sounds using buffer_id; it isn't freed while there are any
+	u32 users;
+	// When it was last played, to free the least recently used ones first
+	u32 last_used;
+
+	SoundBuffer():
+		format(AL_FORMAT_MONO16),
+		freq(0),
+		buffer_id(0),
+		stream(false),
+		size(0),
+		users(0),
+		last_used(0)
+	{}
 };
 
-SoundBuffer* loadOggFile(const std::string &filepath)
+// Reads the vorbis stream from a string, for ov_open_callbacks()
+struct OggMemoryFile
+{
+	const std::string *data;
+	size_t pos;
+};
+
+static size_t ogg_memory_read(void *ptr, size_t size, size_t nmemb,
+		void *datasource)
+{
+	OggMemoryFile *f = (OggMemoryFile*)datasource;
+	if(size == 0)
+		return 0;
+	size_t count = MYMIN(nmemb, (f->data->size() - f->pos) / size);
+	memcpy(ptr, f->data->c_str() + f->pos, count * size);
+	f->pos += count * size;
+	return count;
+}
+
+static int ogg_memory_seek(void *datasource, ogg_int64_t offset, int whence)
+{
+	OggMemoryFile *f = (OggMemoryFile*)datasource;
+	ogg_int64_t pos;
+	switch(whence){
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = f->pos + offset; break;
+	case SEEK_END: pos = f->data->size() + offset; break;
+	default: return -1;
+	}
+	if(pos < 0 || pos > (ogg_int64_t)f->data->size())
+		return -1;
+	f->pos = pos;
+	return 0;
+}
+
+static long ogg_memory_tell(void *datasource)
+{
+	return ((OggMemoryFile*)datasource)->pos;
+}
+
+static bool openOggFile(OggVorbis_File &oggFile, const std::string &filepath)
 {
-	int endian = 0; // 0 for Little-Endian, 1 for Big-Endian
-	int bitStream;
-	long bytes;
-	char array[BUFFER_SIZE]; // Local fixed size array
-	vorbis_info *pInfo;
-	OggVorbis_File oggFile;
-	
 	// Do a dumb-ass static string copy for old versions of ov_fopen
 	// because they expect a non-const char*
 	char nonconst[10000];
@@ -129,10 +195,53 @@ SoundBuffer* loadOggFile(const std::string &filepath)
 	if(ov_fopen(nonconst, &oggFile) != 0)
 	{
 		infostream<<"Audio: Error opening "<<filepath<<" for decoding"<<std::endl;
-		return NULL;
+		return false;
 	}
+	return true;
+}
 
-	SoundBuffer *snd = new SoundBuffer;
+// The data and file have to be kept until ov_clear()
+static bool openOggData(OggVorbis_File &oggFile, OggMemoryFile &file,
+		const std::string &data, const std::string &name)
+{
+	file.data = &data;
+	file.pos = 0;
+	ov_callbacks callbacks;
+	callbacks.read_func = ogg_memory_read;
+	callbacks.seek_func = ogg_memory_seek;
+	callbacks.close_func = NULL;
+	callbacks.tell_func = ogg_memory_tell;
+
+	if(ov_open_callbacks(&file, &oggFile, NULL, 0, callbacks) != 0)
+	{
+		infostream<<"Audio: Error opening "<<name<<" for decoding"<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Opens the file or the data that snd was loaded from
+static bool openOggSource(OggVorbis_File &oggFile, OggMemoryFile &file,
+		const SoundBuffer *snd)
+{
+	if(!snd->data.empty())
+		return openOggData(oggFile, file, snd->data, snd->name);
+	return openOggFile(oggFile, snd->path);
+}
+
+/*
+	Decodes the whole stream into snd without touching OpenAL, so that it
+	can be done on any thread. A sound of at least stream_length seconds is
+	only marked to be streamed instead; 0 streams nothing. Clears oggFile.
+*/
+static bool decodeOgg(SoundBuffer *snd, OggVorbis_File &oggFile,
+		const std::string &name, float stream_length)
+{
+	int endian = 0; // 0 for Little-Endian, 1 for Big-Endian
+	int bitStream;
+	long bytes;
+	char array[BUFFER_SIZE]; // Local fixed size array
+	vorbis_info *pInfo;
 
 	// Get some information about the OGG file
 	pInfo = ov_info(&oggFile, -1);
@@ -146,6 +255,13 @@ SoundBuffer* loadOggFile(const std::string &filepath)
 	// The frequency of the sampling rate
 	snd->freq = pInfo->rate;
 
+	if(stream_length > 0 && ov_time_total(&oggFile, -1) >= stream_length)
+	{
+		ov_clear(&oggFile);
+		snd->stream = true;
+		return true;
+	}
+
 	// Keep reading until all is read
 	do
 	{
@@ -155,14 +271,32 @@ SoundBuffer* loadOggFile(const std::string &filepath)
 		if(bytes < 0)
 		{
 			ov_clear(&oggFile);
-			infostream<<"Audio: Error decoding "<<filepath<<std::endl;
-			return NULL;
+			infostream<<"Audio: Error decoding "<<name<<std::endl;
+			snd->buffer.clear();
+			return false;
 		}
 
 		// Append to end of buffer
 		snd->buffer.insert(snd->buffer.end(), array, array + bytes);
 	} while (bytes > 0);
 
+	// Clean up!
+	ov_clear(&oggFile);
+
+	return true;
+}
+
+/*
+	Needs the OpenAL context, so only from the thread of the sound manager.
+	OpenAL keeps its own copy, so the decoded data is freed.
+*/
+static void uploadSoundBuffer(SoundBuffer *snd)
+{
+	if(snd->stream){
+		infostream<<"Audio file "<<snd->name<<" will be streamed"<<std::endl;
+		return;
+	}
+
 	alGenBuffers(1, &snd->buffer_id);
 	alBufferData(snd->buffer_id, snd->format,
 			&(snd->buffer[0]), snd->buffer.size(),
@@ -175,18 +309,87 @@ SoundBuffer* loadOggFile(const std::string &filepath)
 				<<"preparing sound buffer"<<std::endl;
 	}
 
-	infostream<<"Audio file "<<filepath<<" loaded"<<std::endl;
+	snd->size = snd->buffer.size();
+	std::vector<char>().swap(snd->buffer);
 
-	// Clean up!
-	ov_clear(&oggFile);
+	verbosestream<<"Audio file "<<snd->name<<" loaded"<<std::endl;
+}
+
+SoundBuffer* loadOggFile(const std::string &name, const std::string &filepath,
+		float stream_length)
+{
+	OggVorbis_File oggFile;
+	if(!openOggFile(oggFile, filepath))
+		return NULL;
 
+	SoundBuffer *snd = new SoundBuffer;
+	snd->name = name;
+	snd->path = filepath;
+	if(!decodeOgg(snd, oggFile, filepath, stream_length)){
+		delete snd;
+		return NULL;
+	}
+	uploadSoundBuffer(snd);
 	return snd;
 }
 
+// Decodes a sound given as data on a worker thread
+class SoundDecodeJob : public WorkerJob
+{
+public:
+	SoundDecodeJob(const std::string &name, const std::string &data,
+			float stream_length):
+		name(name),
+		data(data),
+		stream_length(stream_length),
+		buf(NULL)
+	{
+	}
+
+	void run()
+	{
+		OggVorbis_File oggFile;
+		OggMemoryFile file;
+		if(openOggData(oggFile, file, data, name)){
+			buf = new SoundBuffer;
+			buf->name = name;
+			if(decodeOgg(buf, oggFile, name, stream_length)){
+				// Kept to decode it again later
+				buf->data.swap(data);
+			} else {
+				delete buf;
+				buf = NULL;
+			}
+		}
+		data.clear();
+		done.Post();
+	}
+
+	std::string name;
+	std::string data;
+	float stream_length;
+	SoundBuffer *buf;
+	// Posted when buf is ready
+	JSemaphore done;
+};
+
+// What a streamed sound is being decoded from and queued in
+struct SoundStream
+{
+	OggVorbis_File file;
+	OggMemoryFile memory;
+	ALuint buffers[STREAM_BUFFER_COUNT];
+	// Set when everything to play has been queued
+	bool ended;
+};
+
 struct PlayingSound
 {
 	ALuint source_id;
 	bool loop;
+	SoundBuffer *buf;
+	// NULL unless buf is streamed
+	SoundStream *stream;
 };
 
 class OpenALSoundManager: public ISoundManager
@@ -200,6 +403,19 @@ class OpenALSoundManager: public ISoundManager
 	std::map<std::string, std::vector<SoundBuffer*> > m_buffers;
 	std::map<int, PlayingSound*> m_sounds_playing;
 	v3f m_listener_pos;
+	// Sounds given as data that are being decoded, in the order they came
+	std::deque<SoundDecodeJob*> m_decode_jobs;
+	// Sounds at least this long are streamed
+	float m_stream_length;
+	// Bytes in the buffers of the sounds that aren't streamed; the least
+	// recently played ones that aren't playing are freed to stay under
+	// m_cache_max
+	u32 m_cache_size;
+	u32 m_cache_max;
+	// Incremented when a sound is played, for SoundBuffer::last_used
+	u32 m_use_count;
+	std::vector<ALuint> m_free_sources;
+	std::vector<char> m_stream_data;
 public:
 	bool m_is_initialized;
 	OpenALSoundManager(OnDemandSoundFetcher *fetcher):
@@ -208,10 +424,17 @@ class OpenALSoundManager: public ISoundManager
 		m_context(NULL),
 		m_can_vorbis(false),
 		m_next_id(1),
+		m_cache_size(0),
+		m_use_count(0),
+		m_stream_data(STREAM_BUFFER_SIZE),
 		m_is_initialized(false)
 	{
 		ALCenum error = ALC_NO_ERROR;
-		
+
+		m_stream_length = MYMAX(g_settings->getFloat("sound_stream_min_length"), 0);
+		m_cache_max = (u32)MYMAX(g_settings->getS32("sound_buffer_cache_size"), 0)
+				* 1024 * 1024;
+
 		infostream<<"Audio: Initializing..."<<std::endl;
 
 		m_device = alcOpenDevice(NULL);
@@ -264,8 +487,21 @@ class OpenALSoundManager: public ISoundManager
 	~OpenALSoundManager()
 	{
 		infostream<<"Audio: Deinitializing..."<<std::endl;
-		// KABOOM!
-		// TODO: Clear SoundBuffers
+		finishDecoding(true);
+		if(m_context){
+			while(!m_sounds_playing.empty())
+				deleteSound(m_sounds_playing.begin()->first);
+			if(!m_free_sources.empty())
+				alDeleteSources(m_free_sources.size(), &m_free_sources[0]);
+			m_free_sources.clear();
+			for (std::map<std::string, std::vector<SoundBuffer*> >::iterator i = m_buffers.begin();
+					i != m_buffers.end(); i++) {
+				for (std::vector<SoundBuffer*>::iterator iter = (*i).second.begin();
+						iter != (*i).second.end(); iter++) {
+					unloadBuffer(*iter);
+				}
+			}
+		}
 		alcMakeContextCurrent(NULL);
 		alcDestroyContext(m_context);
 		m_context = NULL;
@@ -283,9 +519,11 @@ class OpenALSoundManager: public ISoundManager
 		m_buffers.clear();
 		infostream<<"Audio: Deinitialized."<<std::endl;
 	}
-	
+
 	void addBuffer(const std::string &name, SoundBuffer *buf)
 	{
+		m_cache_size += buf->size;
+		trimCache();
 		std::map<std::string, std::vector<SoundBuffer*> >::iterator i =
 				m_buffers.find(name);
 		if(i != m_buffers.end()){
@@ -298,8 +536,79 @@ class OpenALSoundManager: public ISoundManager
 		return;
 	}
 
+	void unloadBuffer(SoundBuffer *buf)
+	{
+		if(buf->buffer_id == 0)
+			return;
+		alDeleteBuffers(1, &buf->buffer_id);
+		buf->buffer_id = 0;
+		m_cache_size -= buf->size;
+		buf->size = 0;
+	}
+
+	// Frees the least recently played buffers that aren't playing
+	void trimCache()
+	{
+		while(m_cache_size > m_cache_max){
+			SoundBuffer *oldest = NULL;
+			for(std::map<std::string, std::vector<SoundBuffer*> >::iterator
+					i = m_buffers.begin(); i != m_buffers.end(); i++){
+				std::vector<SoundBuffer*> &bufs = i->second;
+				for(u32 j = 0; j < bufs.size(); j++){
+					SoundBuffer *buf = bufs[j];
+					if(buf->buffer_id == 0 || buf->users != 0)
+						continue;
+					if(oldest == NULL || buf->last_used < oldest->last_used)
+						oldest = buf;
+				}
+			}
+			if(oldest == NULL)
+				return;
+			verbosestream<<"Audio: Freeing the buffer of "<<oldest->name
+					<<std::endl;
+			unloadBuffer(oldest);
+		}
+	}
+
+	// Decodes a sound again if its buffer was freed
+	bool reloadBuffer(SoundBuffer *buf)
+	{
+		if(buf->stream || buf->buffer_id != 0)
+			return true;
+		OggVorbis_File oggFile;
+		OggMemoryFile file;
+		if(!openOggSource(oggFile, file, buf) ||
+				!decodeOgg(buf, oggFile, buf->name, 0))
+			return false;
+		uploadSoundBuffer(buf);
+		m_cache_size += buf->size;
+		return true;
+	}
+
+	/*
+		Uploads and adds the decoded sounds, in order. Without wait, stops
+		at the first one that isn't decoded yet.
+	*/
+	void finishDecoding(bool wait)
+	{
+		while(!m_decode_jobs.empty()){
+			SoundDecodeJob *job = m_decode_jobs.front();
+			if(wait)
+				job->done.Wait();
+			else if(!job->done.Wait(0))
+				return;
+			m_decode_jobs.pop_front();
+			if(job->buf){
+				uploadSoundBuffer(job->buf);
+				addBuffer(job->name, job->buf);
+			}
+			delete job;
+		}
+	}
+
 	SoundBuffer* getBuffer(const std::string &name)
 	{
+		finishDecoding(true);
 		std::map<std::string, std::vector<SoundBuffer*> >::iterator i =
 				m_buffers.find(name);
 		if(i == m_buffers.end())
@@ -309,20 +618,137 @@ class OpenALSoundManager: public ISoundManager
 		return bufs[j];
 	}
 
+	ALuint takeSource()
+	{
+		ALuint source_id;
+		if(m_free_sources.empty()){
+			alGenSources(1, &source_id);
+		} else {
+			source_id = m_free_sources.back();
+			m_free_sources.pop_back();
+		}
+		return source_id;
+	}
+
+	void giveSource(ALuint source_id)
+	{
+		alSourceStop(source_id);
+		alSourcei(source_id, AL_BUFFER, 0);
+		if(m_free_sources.size() < SOURCE_POOL_MAX)
+			m_free_sources.push_back(source_id);
+		else
+			alDeleteSources(1, &source_id);
+	}
+
+	// Decodes the next part of a streamed sound into buffer_id
+	bool fillStreamBuffer(PlayingSound *sound, ALuint buffer_id)
+	{
+		SoundStream *stream = sound->stream;
+		u32 size = 0;
+		bool rewound = false;
+		while(size < STREAM_BUFFER_SIZE){
+			int bitStream;
+			long bytes = ov_read(&stream->file, &m_stream_data[size],
+					STREAM_BUFFER_SIZE - size, 0, 2, 1, &bitStream);
+			if(bytes > 0){
+				size += bytes;
+				rewound = false;
+				continue;
+			}
+			if(bytes < 0)
+				infostream<<"Audio: Error decoding "<<sound->buf->name
+						<<std::endl;
+			// Twice in a row would mean there's nothing to loop
+			if(bytes < 0 || !sound->loop || rewound ||
+					ov_pcm_seek(&stream->file, 0) != 0){
+				stream->ended = true;
+				break;
+			}
+			rewound = true;
+		}
+		if(size == 0)
+			return false;
+		alBufferData(buffer_id, sound->buf->format, &m_stream_data[0], size,
+				sound->buf->freq);
+		return true;
+	}
+
+	// Queues the parts that have been played again with what comes next
+	void updateStream(PlayingSound *sound)
+	{
+		SoundStream *stream = sound->stream;
+		ALint processed = 0;
+		alGetSourcei(sound->source_id, AL_BUFFERS_PROCESSED, &processed);
+		for(; processed > 0; processed--){
+			ALuint buffer_id;
+			alSourceUnqueueBuffers(sound->source_id, 1, &buffer_id);
+			if(!stream->ended && fillStreamBuffer(sound, buffer_id))
+				alSourceQueueBuffers(sound->source_id, 1, &buffer_id);
+		}
+		// If the step came too late, the source stopped with nothing queued
+		ALint state;
+		alGetSourcei(sound->source_id, AL_SOURCE_STATE, &state);
+		ALint queued = 0;
+		alGetSourcei(sound->source_id, AL_BUFFERS_QUEUED, &queued);
+		if(state == AL_STOPPED && queued > 0)
+			alSourcePlay(sound->source_id);
+		warn_if_error(alGetError(), "updateStream");
+	}
+
+	/*
+		Gives the sound a source with its buffer, or streams its file or
+		data into queued buffers. What depends on whether the sound is
+		positional is left to the caller.
+	*/
+	PlayingSound* newPlayingSound(SoundBuffer *buf, bool loop)
+	{
+		if(!reloadBuffer(buf))
+			return NULL;
+		SoundStream *stream = NULL;
+		if(buf->stream){
+			stream = new SoundStream;
+			if(!openOggSource(stream->file, stream->memory, buf)){
+				delete stream;
+				return NULL;
+			}
+			stream->ended = false;
+			alGenBuffers(STREAM_BUFFER_COUNT, stream->buffers);
+		}
+		PlayingSound *sound = new PlayingSound;
+		sound->source_id = takeSource();
+		sound->loop = loop;
+		sound->buf = buf;
+		sound->stream = stream;
+		if(stream){
+			// The whole queue would be looped, so the stream loops itself
+			alSourcei(sound->source_id, AL_LOOPING, AL_FALSE);
+			for(u32 i = 0; i < STREAM_BUFFER_COUNT; i++){
+				if(!fillStreamBuffer(sound, stream->buffers[i]))
+					break;
+				alSourceQueueBuffers(sound->source_id, 1, &stream->buffers[i]);
+			}
+		} else {
+			alSourcei(sound->source_id, AL_BUFFER, buf->buffer_id);
+			alSourcei(sound->source_id, AL_LOOPING, loop ? AL_TRUE : AL_FALSE);
+			buf->users++;
+		}
+		buf->last_used = ++m_use_count;
+		return sound;
+	}
+
 	PlayingSound* createPlayingSound(SoundBuffer *buf, bool loop,
 			float volume)
 	{
 		infostream<<"OpenALSoundManager: Creating playing sound"<<std::endl;
 		assert(buf);
-		PlayingSound *sound = new PlayingSound;
-		assert(sound);
 		warn_if_error(alGetError(), "before createPlayingSound");
-		alGenSources(1, &sound->source_id);
-		alSourcei(sound->source_id, AL_BUFFER, buf->buffer_id);
+		PlayingSound *sound = newPlayingSound(buf, loop);
+		if(!sound)
+			return NULL;
 		alSourcei(sound->source_id, AL_SOURCE_RELATIVE, true);
 		alSource3f(sound->source_id, AL_POSITION, 0, 0, 0);
 		alSource3f(sound->source_id, AL_VELOCITY, 0, 0, 0);
-		alSourcei(sound->source_id, AL_LOOPING, loop ? AL_TRUE : AL_FALSE);
+		alSourcef(sound->source_id, AL_REFERENCE_DISTANCE, 1.0);
 		volume = MYMAX(0.0, volume);
 		alSourcef(sound->source_id, AL_GAIN, volume);
 		alSourcePlay(sound->source_id);
@@ -336,17 +762,15 @@ class OpenALSoundManager: public ISoundManager
 		infostream<<"OpenALSoundManager: Creating positional playing sound"
 				<<std::endl;
 		assert(buf);
-		PlayingSound *sound = new PlayingSound;
-		assert(sound);
 		warn_if_error(alGetError(), "before createPlayingSoundAt");
-		alGenSources(1, &sound->source_id);
-		alSourcei(sound->source_id, AL_BUFFER, buf->buffer_id);
+		PlayingSound *sound = newPlayingSound(buf, loop);
+		if(!sound)
+			return NULL;
 		alSourcei(sound->source_id, AL_SOURCE_RELATIVE, false);
 		alSource3f(sound->source_id, AL_POSITION, pos.X, pos.Y, pos.Z);
 		alSource3f(sound->source_id, AL_VELOCITY, 0, 0, 0);
 		//alSourcef(sound->source_id, AL_ROLLOFF_FACTOR, 0.7);
 		alSourcef(sound->source_id, AL_REFERENCE_DISTANCE, 30.0);
-		alSourcei(sound->source_id, AL_LOOPING, loop ? AL_TRUE : AL_FALSE);
 		volume = MYMAX(0.0, volume);
 		alSourcef(sound->source_id, AL_GAIN, volume);
 		alSourcePlay(sound->source_id);
@@ -375,7 +799,7 @@ class OpenALSoundManager: public ISoundManager
 		m_sounds_playing[id] = sound;
 		return id;
 	}
-	
+
 	void deleteSound(int id)
 	{
 		std::map<int, PlayingSound*>::iterator i =
@@ -383,8 +807,16 @@ class OpenALSoundManager: public ISoundManager
 		if(i == m_sounds_playing.end())
 			return;
 		PlayingSound *sound = i->second;
-		
-		alDeleteSources(1, &sound->source_id);
+
+		giveSource(sound->source_id);
+
+		if(sound->stream){
+			alDeleteBuffers(STREAM_BUFFER_COUNT, sound->stream->buffers);
+			ov_clear(&sound->stream->file);
+			delete sound->stream;
+		} else {
+			sound->buf->users--;
+		}
 
 		delete sound;
 		m_sounds_playing.erase(id);
@@ -411,7 +843,7 @@ class OpenALSoundManager: public ISoundManager
 		}
 		return getBuffer(name);
 	}
-	
+
 	// Remove stopped sounds
 	void maintain()
 	{
@@ -425,6 +857,8 @@ class OpenALSoundManager: public ISoundManager
 		{
 			int id = i->first;
 			PlayingSound *sound = i->second;
+			if(sound->stream)
+				updateStream(sound);
 			// If not playing, remove it
 			{
 				ALint state;
@@ -442,6 +876,7 @@ class OpenALSoundManager: public ISoundManager
 		{
 			deleteSound(*i);
 		}
+		trimCache();
 	}
 
 	/* Interface */
@@ -449,7 +884,7 @@ class OpenALSoundManager: public ISoundManager
 	bool loadSoundFile(const std::string &name,
 			const std::string &filepath)
 	{
-		SoundBuffer *buf = loadOggFile(filepath);
+		SoundBuffer *buf = loadOggFile(name, filepath, m_stream_length);
 		if(buf)
 			addBuffer(name, buf);
 		return false;
@@ -457,18 +892,14 @@ class OpenALSoundManager: public ISoundManager
 	bool loadSoundData(const std::string &name,
 			const std::string &filedata)
 	{
-		// The vorbis API sucks; just write it to a file and use vorbisfile
-		// TODO: Actually load it directly from memory
-		std::string basepath = porting::path_user + DIR_DELIM + "cache" +
-				DIR_DELIM + "tmp";
-		std::string path = basepath + DIR_DELIM + "tmp.ogg";
-		verbosestream<<"OpenALSoundManager::loadSoundData(): Writing "
-				<<"temporary file to ["<<path<<"]"<<std::endl;
-		fs::CreateAllDirs(basepath);
-		std::ofstream of(path.c_str(), std::ios::binary);
-		of.write(filedata.c_str(), filedata.size());
-		of.close();
-		return loadSoundFile(name, path);
+		// Decoded on the worker pool; the sound is there for the first
+		// getBuffer() after this in any case
+		SoundDecodeJob *job = new SoundDecodeJob(name, filedata,
+				m_stream_length);
+		m_decode_jobs.push_back(job);
+		getWorkerPool()->submit(job);
+		finishDecoding(false);
+		return true;
 	}
 
 	void updateListener(v3f pos, v3f vel, v3f at, v3f up)
@@ -482,12 +913,23 @@ class OpenALSoundManager: public ISoundManager
 		alListenerfv(AL_ORIENTATION, f);
 		warn_if_error(alGetError(), "updateListener");
 	}
-	
+
 	void setListenerGain(float gain)
 	{
 		alListenerf(AL_GAIN, gain);
 	}
 
+	void step(float dtime)
+	{
+		for(std::map<int, PlayingSound*>::iterator
+				i = m_sounds_playing.begin();
+				i != m_sounds_playing.end(); i++)
+		{
+			if(i->second->stream)
+				updateStream(i->second);
+		}
+	}
+
 	int playSound(const std::string &name, bool loop, float volume)
 	{
 		maintain();
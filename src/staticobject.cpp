@@ -76,3 +76,15 @@ void StaticObjectList::deSerialize(std::istream &is)
 	}
 }
 
+u32 StaticObjectList::getMemoryUsage() const
+{
+	u32 size = 0;
+	for(std::list<StaticObject>::const_iterator
+			i = m_stored.begin(); i != m_stored.end(); ++i)
+		size += sizeof(StaticObject) + i->data.size();
+	for(std::map<u16, StaticObject>::const_iterator
+			i = m_active.begin(); i != m_active.end(); ++i)
+		size += sizeof(u16) + sizeof(StaticObject) + i->second.data.size();
+	return size;
+}
+
@@ -89,6 +89,8 @@ class StaticObjectList
 
 	void serialize(std::ostream &os);
 	void deSerialize(std::istream &is);
+	// Estimate of the bytes taken by the objects
+	u32 getMemoryUsage() const;
 	
 	/*
 		NOTE: When an object is transformed to active, it is removed
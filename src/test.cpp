@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "nodedef.h"
 #include "mapsector.h"
+#include "mapblock.h"
 #include "settings.h"
 #include "log.h"
 #include "util/string.h"
@@ -41,8 +42,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "inventory.h"
 #include "util/numeric.h"
 #include "util/serialize.h"
+#include "util/container.h"
 #include "noise.h" // PseudoRandom used for random data for compression
 #include "clientserver.h" // LATEST_PROTOCOL_VERSION
+#include "workerpool.h"
+#include "filecache.h"
+#include "database-region.h"
+#include "environment.h"
+#include <fstream>
 #include <algorithm>
 
 /*
@@ -209,6 +216,41 @@ struct TestUtilities: public TestBase
 			UASSERT(is_power_of_two((1 << exponent) + 1) == false);
 		}
 		UASSERT(is_power_of_two((u32)-1) == false);
+
+		DenseIdMap<int> idmap;
+		idmap[3] = 30;
+		idmap[1] = 10;
+		idmap[7] = 70;
+		UASSERT(idmap.size() == 3);
+		UASSERT(idmap.find(1)->second == 10);
+		UASSERT(idmap.find(2) == idmap.end());
+		UASSERT(idmap.erase(3) == 1);
+		UASSERT(idmap.erase(3) == 0);
+		UASSERT(idmap.count(3) == 0);
+		UASSERT(idmap.find(7)->second == 70);
+		int idsum = 0;
+		for(DenseIdMap<int>::iterator i = idmap.begin();
+				i != idmap.end(); ++i)
+			idsum += i->first;
+		UASSERT(idsum == 8);
+		idmap.clear();
+		UASSERT(idmap.empty() && idmap.count(1) == 0);
+
+		DenseIdSet idset;
+		UASSERT(idset.begin() == idset.end());
+		UASSERT(idset.insert(40) == true);
+		UASSERT(idset.insert(3) == true);
+		UASSERT(idset.insert(65535) == true);
+		UASSERT(idset.insert(3) == false);
+		UASSERT(idset.size() == 3);
+		UASSERT(idset.count(40) == 1 && idset.count(41) == 0);
+		DenseIdSet::const_iterator j = idset.begin();
+		UASSERT(*j == 3 && *++j == 40 && *++j == 65535 && ++j == idset.end());
+		UASSERT(idset.erase(40) == 1);
+		UASSERT(idset.erase(40) == 0);
+		UASSERT(idset.size() == 2 && *++idset.begin() == 65535);
+		idset.clear();
+		UASSERT(idset.empty() && idset.count(3) == 0);
 	}
 };
 
@@ -517,6 +559,16 @@ struct TestSettings: public TestBase
 		UASSERT(fabs(s.getV3F("coord2").Y - 2.0) < 0.001);
 		UASSERT(fabs(s.getV3F("coord2").Z - 3.3) < 0.001);
 
+		// Test the cached values of setting handles
+		SettingHandle<s32> leet(&s, "leet");
+		UASSERT(leet.get() == 1337);
+		s.setS32("leet", 31337);
+		UASSERT(leet.get() == 31337);
+		s.remove("leet");
+		EXCEPTION_CHECK(SettingNotFoundException, leet.get());
+		s.setDefault("leet", "1337");
+		UASSERT(leet.get() == 1337);
+
 		// Test settings groups
 		Settings *group = s.getGroup("asdf");
 		UASSERT(group != NULL);
@@ -683,6 +735,32 @@ struct TestSerialization: public TestBase
 			is.get();
 			UASSERT(is.eof());
 		}
+		{
+			// Starts small to test growing
+			BufferWriter writer(1);
+			writer.writeU16(0x1234);
+			writer.writeS32(-5);
+			writer.writeV3S16(v3s16(-1,2,-3));
+			writer.writeF1000(1.5);
+			writer.writeString(teststring);
+			writer.writeLongString(teststring2);
+			SharedBuffer<u8> buf = writer.takeSharedBuffer();
+			UASSERT(writer.getSize() == 0);
+			UASSERT(buf.getSize() == 2+4+6+4 + 2+teststring.size()
+					+ 4+teststring2.size());
+			UASSERT(std::string((char*)&buf[18], teststring.size())
+					== teststring);
+
+			BufferReader reader(*buf, buf.getSize());
+			UASSERT(reader.readU16() == 0x1234);
+			UASSERT(reader.readS32() == -5);
+			UASSERT(reader.readV3S16() == v3s16(-1,2,-3));
+			UASSERT(reader.readF1000() == 1.5);
+			UASSERT(reader.readString() == teststring);
+			UASSERT(reader.readLongString() == teststring2);
+			UASSERT(reader.getRemaining() == 0);
+			EXCEPTION_CHECK(SerializationError, reader.readU8());
+		}
 	}
 };
 
@@ -706,6 +784,243 @@ struct TestNodedefSerialization: public TestBase
 	}
 };
 
+struct TestNodedefLookup: public TestBase
+{
+	void Run()
+	{
+		IWritableItemDefManager *idef = createItemDefManager();
+		IWritableNodeDefManager *ndef = createNodeDefManager();
+		content_t ids[3];
+		const char *names[3] = {"test:a", "test:b", "test:c"};
+		for(u32 i = 0; i < 3; i++){
+			ItemDefinition itemdef;
+			itemdef.type = ITEM_NODE;
+			itemdef.name = names[i];
+			idef->registerItem(itemdef);
+			ContentFeatures f;
+			f.name = names[i];
+			f.groups["even"] = i % 2 == 0 ? 1 : 0;
+			ids[i] = ndef->set(f.name, f);
+		}
+		idef->registerAlias("test:alias", "test:b");
+
+		// Before and after the indexes are made by updateAliases()
+		for(u32 pass = 0; pass < 2; pass++){
+			content_t c = CONTENT_IGNORE;
+			UASSERT(ndef->getId("test:b", c) && c == ids[1]);
+			UASSERT(!ndef->getId("test:d", c));
+			UASSERT(ndef->getId("test:alias") ==
+					(pass == 0 ? CONTENT_IGNORE : ids[1]));
+			std::set<content_t> group;
+			ndef->getIds("group:even", group);
+			UASSERT(group.size() == 2);
+			UASSERT(group.count(ids[0]) && group.count(ids[2]));
+			group.clear();
+			ndef->getIds("group:none", group);
+			UASSERT(group.empty());
+			ndef->updateAliases(idef);
+		}
+
+		// Registering a node after it still works
+		ContentFeatures f;
+		f.name = "test:d";
+		f.groups["even"] = 1;
+		content_t d = ndef->set(f.name, f);
+		UASSERT(ndef->getId("test:d") == d);
+		std::set<content_t> group;
+		ndef->getIds("group:even", group);
+		UASSERT(group.size() == 3 && group.count(d));
+
+		delete idef;
+		delete ndef;
+	}
+};
+
+struct TestNodeTimerList: public TestBase
+{
+	void Run()
+	{
+		NodeTimerList timers;
+		timers.set(v3s16(1,2,3), NodeTimer(2.0, 0.0));
+		timers.set(v3s16(4,5,6), NodeTimer(5.0, 1.0));
+
+		// Nothing expires yet
+		UASSERT(timers.step(1.5).empty());
+		NodeTimer t = timers.get(v3s16(4,5,6));
+		UASSERT(fabs(t.timeout - 5.0) < 0.001);
+		UASSERT(fabs(t.elapsed - 2.5) < 0.001);
+
+		// First timer expires and is removed from the list
+		std::map<v3s16, NodeTimer> elapsed = timers.step(1.0);
+		UASSERT(elapsed.size() == 1);
+		UASSERT(elapsed.count(v3s16(1,2,3)) == 1);
+		UASSERT(fabs(elapsed[v3s16(1,2,3)].elapsed - 2.5) < 0.001);
+		UASSERT(timers.get(v3s16(1,2,3)).timeout == 0);
+
+		// Setting a timer again replaces the old one
+		timers.set(v3s16(4,5,6), NodeTimer(1.0, 0.0));
+		UASSERT(timers.step(0.5).empty());
+
+		// Timers survive serialization
+		std::ostringstream os(std::ios::binary);
+		timers.serialize(os, 25);
+		NodeTimerList timers2;
+		std::istringstream is(os.str(), std::ios::binary);
+		timers2.deSerialize(is, 25);
+		t = timers2.get(v3s16(4,5,6));
+		UASSERT(fabs(t.timeout - 1.0) < 0.001);
+		UASSERT(fabs(t.elapsed - 0.5) < 0.001);
+		elapsed = timers2.step(0.5);
+		UASSERT(elapsed.size() == 1);
+		UASSERT(elapsed.count(v3s16(4,5,6)) == 1);
+	}
+};
+
+struct TestActiveBlockList: public TestBase
+{
+	void Run()
+	{
+		ActiveBlockList list;
+		std::map<u16, v3s16> players;
+		PseudoRandom pr(1234);
+
+		for(u32 round = 0; round < 200; round++)
+		{
+			// Players come, move by a block or jump away and leave
+			u16 peer_id = pr.range(1, 4);
+			switch(pr.range(0, 3)){
+			case 0:
+				players.erase(peer_id);
+				break;
+			case 1:
+				players[peer_id] = v3s16(pr.range(-20, 20),
+						pr.range(-3, 3), pr.range(-20, 20));
+				break;
+			default:
+				players[peer_id] += v3s16(pr.range(-1, 1), 0,
+						pr.range(-1, 1));
+				break;
+			}
+			v3s16 forced(pr.range(-5, 5), 0, 0);
+			if(pr.range(0, 1))
+				list.m_forceloaded_list.insert(forced);
+			else
+				list.m_forceloaded_list.erase(forced);
+			s16 radius = round < 150 ? 2 : 1;
+
+			std::set<v3s16> old_list = list.m_list;
+			std::set<v3s16> removed, added;
+			list.update(players, radius, removed, added);
+
+			// The same as making the whole list anew
+			std::set<v3s16> expected = list.m_forceloaded_list;
+			for(std::map<u16, v3s16>::iterator i = players.begin();
+					i != players.end(); ++i){
+				v3s16 p;
+				for(p.X = i->second.X - radius; p.X <= i->second.X + radius; p.X++)
+				for(p.Y = i->second.Y - radius; p.Y <= i->second.Y + radius; p.Y++)
+				for(p.Z = i->second.Z - radius; p.Z <= i->second.Z + radius; p.Z++)
+					expected.insert(p);
+			}
+			UASSERT(list.m_list == expected);
+			for(std::set<v3s16>::iterator i = added.begin();
+					i != added.end(); ++i)
+				UASSERT(old_list.count(*i) == 0 && expected.count(*i) == 1);
+			for(std::set<v3s16>::iterator i = removed.begin();
+					i != removed.end(); ++i)
+				UASSERT(old_list.count(*i) == 1 && expected.count(*i) == 0);
+			UASSERT(old_list.size() + added.size() - removed.size() ==
+					expected.size());
+		}
+
+		// A block that couldn't be activated comes back on the next update
+		std::set<v3s16> removed, added;
+		players[1] = v3s16(0,0,0);
+		list.update(players, 1, removed, added);
+		v3s16 p(1,1,1);
+		list.retryLater(p);
+		UASSERT(!list.contains(p));
+		removed.clear();
+		added.clear();
+		list.update(players, 1, removed, added);
+		UASSERT(list.contains(p));
+		UASSERT(added.size() == 1 && added.count(p) == 1);
+		UASSERT(removed.empty());
+	}
+};
+
+struct TestV3s16PtrHashMap: public TestBase
+{
+	void Run()
+	{
+		V3s16PtrHashMap<int> map;
+		int values[3];
+		UASSERT(map.get(v3s16(0,0,0)) == NULL);
+
+		// Enough entries to make it grow a few times
+		for(s16 i=0; i<1000; i++)
+			map.set(v3s16(i, -i, i % 7), &values[i % 3]);
+		UASSERT(map.size() == 1000);
+		for(s16 i=0; i<1000; i++)
+			UASSERT(map.get(v3s16(i, -i, i % 7)) == &values[i % 3]);
+		UASSERT(map.get(v3s16(1, 1, 1)) == NULL);
+
+		// Replacing a value doesn't add an entry
+		map.set(v3s16(5, -5, 5), &values[2]);
+		UASSERT(map.size() == 1000);
+		UASSERT(map.get(v3s16(5, -5, 5)) == &values[2]);
+
+		// Removing leaves the others findable
+		for(s16 i=0; i<1000; i+=2)
+			UASSERT(map.remove(v3s16(i, -i, i % 7)));
+		UASSERT(map.remove(v3s16(0, 0, 0)) == false);
+		UASSERT(map.size() == 500);
+		for(s16 i=0; i<1000; i++)
+			UASSERT((map.get(v3s16(i, -i, i % 7)) != NULL) == (i % 2 == 1));
+
+		map.clear();
+		UASSERT(map.size() == 0);
+		UASSERT(map.get(v3s16(1, -1, 1)) == NULL);
+	}
+};
+
+struct TestLiquidQueue: public TestBase
+{
+	void Run()
+	{
+		LiquidQueue queue;
+		v3s16 a(0,0,0);
+		v3s16 b(MAP_BLOCKSIZE,0,0);
+
+		// Positions are queued only once
+		UASSERT(queue.push_back(a) == true);
+		UASSERT(queue.push_back(a) == false);
+		UASSERT(queue.size() == 1);
+		UASSERT(queue.pop_front() == a);
+		UASSERT(queue.size() == 0);
+
+		// A block with lots of nodes queued doesn't keep the turn
+		for(s16 i=0; i<MAP_BLOCKSIZE; i++)
+		for(s16 j=0; j<MAP_BLOCKSIZE; j++)
+			queue.push_back(a + v3s16(i,j,0));
+		queue.push_back(b);
+		u32 size = queue.size();
+		UASSERT(size == MAP_BLOCKSIZE * MAP_BLOCKSIZE + 1);
+		bool b_popped = false;
+		for(u32 i=0; i<size; i++)
+		{
+			v3s16 p = queue.pop_front();
+			if(p == b)
+			{
+				UASSERT(i < size - 1);
+				b_popped = true;
+			}
+		}
+		UASSERT(b_popped);
+		UASSERT(queue.size() == 0);
+	}
+};
+
 struct TestCompress: public TestBase
 {
 	void Run()
@@ -840,6 +1155,28 @@ struct TestCompress: public TestBase
 						"index out[%i]=%i differs from in[%i]=%i",
 						i, str_decompressed[i], i, data_in[i]);
 			}
+
+			// Decompressing to a buffer leaves what follows in the stream
+			std::istringstream is_compressed2(os_compressed.str() + "after",
+					std::ios::binary);
+			std::vector<u8> buf(size);
+			UASSERT(decompressZlib(is_compressed2, &buf[0], size) == size);
+			UASSERT(memcmp(&buf[0], data_in.c_str(), size) == 0);
+			std::string after;
+			is_compressed2>>after;
+			UASSERT(after == "after");
+
+			// ...and refuses data that doesn't fit
+			std::istringstream is_compressed3(os_compressed.str(),
+					std::ios::binary);
+			bool too_large = false;
+			try{
+				decompressZlib(is_compressed3, &buf[0], size - 1);
+			}
+			catch(SerializationError &e){
+				too_large = true;
+			}
+			UASSERT(too_large);
 		}
 	}
 };
@@ -1177,6 +1514,125 @@ struct TestInventory: public TestBase
 		std::ostringstream inv_os(std::ios::binary);
 		inv.serialize(inv_os);
 		UASSERT(inv_os.str() == serialized_inventory_2);
+
+		// Only the changed slots are sent to a copy of the inventory
+		Inventory inv2(inv);
+		std::ostringstream changes_os(std::ios::binary);
+		UASSERT(!inv.serializeChanges(changes_os));
+		inv.clearChanges();
+		UASSERT(!inv.serializeChanges(changes_os));
+		InventoryList *list = inv.getList("main");
+		list->changeItem(1, ItemStack("default:dirt", 5, 0, "", idef));
+		list->takeItem(9, 1);
+		UASSERT(list->getChangedSlots().size() == 2);
+		UASSERT(inv.serializeChanges(changes_os));
+		std::istringstream changes_is(changes_os.str(), std::ios::binary);
+		inv2.deSerializeChanges(changes_is);
+		UASSERT(inv2 == inv);
+		list->setSize(list->getSize() + 1);
+		UASSERT(!inv.serializeChanges(changes_os));
+	}
+};
+
+struct TestMapBlockPacking: public TestBase
+{
+	void Run()
+	{
+		u32 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+		MapBlock b(NULL, v3s16(0,0,0), NULL);
+
+		// A block of one kind of node needs no indices
+		MapNode air(CONTENT_AIR);
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+			b.setNode(v3s16(x,y,z), air);
+		b.pack();
+		UASSERT(b.isPacked());
+		UASSERT(b.getNodeMemoryUsage() < nodecount);
+		UASSERT(b.getNodeNoEx(v3s16(3,4,5)) == air);
+
+		// A new kind of node unpacks the block
+		MapNode n(5, 1, 2);
+		b.setNode(v3s16(1,2,3), n);
+		UASSERT(b.isPacked() == false);
+		UASSERT(b.getNodeNoEx(v3s16(1,2,3)) == n);
+		UASSERT(b.getNodeNoEx(v3s16(2,2,3)) == air);
+
+		// Up to 16 kinds take 4 bits, more take 8 bits
+		for(u16 i=0; i<20; i++)
+		{
+			MapNode n2(10 + i);
+			b.setNode(v3s16(i % MAP_BLOCKSIZE, i / MAP_BLOCKSIZE, 0), n2);
+		}
+		b.pack();
+		UASSERT(b.isPacked());
+		UASSERT(b.getNodeMemoryUsage() < nodecount * sizeof(MapNode) / 2);
+		for(u16 i=0; i<20; i++)
+			UASSERT(b.getNodeNoEx(v3s16(i % MAP_BLOCKSIZE, i / MAP_BLOCKSIZE, 0))
+					== MapNode(10 + i));
+		UASSERT(b.getNodeNoEx(v3s16(1,2,3)) == n);
+		UASSERT(b.getNodeNoEx(v3s16(15,15,15)) == air);
+
+		// Known kinds of nodes are written in place
+		b.setNode(v3s16(15,15,15), n);
+		UASSERT(b.isPacked());
+		UASSERT(b.getNodeNoEx(v3s16(15,15,15)) == n);
+		UASSERT(b.getNodeNoEx(v3s16(14,15,15)) == air);
+
+		// Snapshots are the same until the block is written, and aren't
+		// changed by the writes
+		MapBlockNodeSnapshot *s1 = b.getNodeSnapshot();
+		UASSERT(b.getNodeSnapshot() == s1);
+		s1->drop();
+		UASSERT(s1->getNodeNoCheck(15,15,15) == n);
+		b.setNode(v3s16(15,15,15), air);
+		UASSERT(s1->getNodeNoCheck(15,15,15) == n);
+		MapBlockNodeSnapshot *s2 = b.getNodeSnapshot();
+		UASSERT(s2 != s1);
+		UASSERT(s2->getNodeNoCheck(15,15,15) == air);
+		s1->drop();
+
+		// The nodes of an unpacked block are shared, and kept by the
+		// snapshot when the block is packed
+		MapNode n3(100);
+		b.setNode(v3s16(0,0,0), n3);
+		UASSERT(b.isPacked() == false);
+		MapBlockNodeSnapshot *s3 = b.getNodeSnapshot();
+		b.pack();
+		UASSERT(b.isPacked());
+		b.setNode(v3s16(0,0,0), air);
+		UASSERT(s3->getNodeNoCheck(0,0,0) == n3);
+		UASSERT(s3->getNodeNoCheck(15,15,15) == air);
+		UASSERT(b.getNodeNoEx(v3s16(0,0,0)) == air);
+		s2->drop();
+		s3->drop();
+
+		// Only the nodes in the area are copied, like the layer next to
+		// the block at (1,0,0) when making its mesh
+		VoxelManipulator v;
+		VoxelArea area(v3s16(MAP_BLOCKSIZE - 1, -1, -1),
+				v3s16(MAP_BLOCKSIZE * 2, MAP_BLOCKSIZE, MAP_BLOCKSIZE));
+		v.addArea(area);
+		b.copyTo(v, area);
+		UASSERT(v.getNodeNoExNoEmerge(v3s16(15,0,0)) == MapNode(25));
+		UASSERT(v.getNodeNoExNoEmerge(v3s16(15,15,15)) == air);
+		UASSERT(v.getNodeNoExNoEmerge(v3s16(16,0,0)).getContent()
+				== CONTENT_IGNORE);
+		UASSERT(v.getNodeNoExNoEmerge(v3s16(15,-1,0)).getContent()
+				== CONTENT_IGNORE);
+
+		// A layer thinner than the block in y, like the one next to the
+		// block above
+		MapNode n4(30);
+		b.setNode(v3s16(3,15,7), n4);
+		VoxelManipulator v2;
+		VoxelArea area2(v3s16(-1, MAP_BLOCKSIZE - 1, -1),
+				v3s16(MAP_BLOCKSIZE, MAP_BLOCKSIZE * 2, MAP_BLOCKSIZE));
+		v2.addArea(area2);
+		b.copyTo(v2, area2);
+		UASSERT(v2.getNodeNoExNoEmerge(v3s16(3,15,7)) == n4);
+		UASSERT(v2.getNodeNoExNoEmerge(v3s16(3,15,6)) == air);
 	}
 };
 
@@ -1658,6 +2114,306 @@ struct TestCollision: public TestBase
 	}
 };
 
+struct TestNoise: public TestBase
+{
+	static float lerp(float v0, float v1, float t)
+	{
+		return v0 + (v1 - v0) * t;
+	}
+
+	/*
+		Straightforward versions of Noise::gradientMap2D() and
+		gradientMap3D() that interpolate every point on its own
+	*/
+	static void gradientMap2DScalar(float *dst, int sx, int sy,
+			float x, float y, float step_x, float step_y, int seed)
+	{
+		int x0 = floor(x), y0 = floor(y);
+		float v = y - (float)y0;
+		int noisey = 0;
+		for (int j = 0; j != sy; j++) {
+			float u = x - (float)x0;
+			int noisex = 0;
+			for (int i = 0; i != sx; i++) {
+				int nx = x0 + noisex, ny = y0 + noisey;
+				float tx = easeCurve(u);
+				float a = lerp(noise2d(nx, ny, seed), noise2d(nx + 1, ny, seed), tx);
+				float b = lerp(noise2d(nx, ny + 1, seed), noise2d(nx + 1, ny + 1, seed), tx);
+				*dst++ = lerp(a, b, easeCurve(v));
+				u += step_x;
+				if (u >= 1.0) {
+					u -= 1.0;
+					noisex++;
+				}
+			}
+			v += step_y;
+			if (v >= 1.0) {
+				v -= 1.0;
+				noisey++;
+			}
+		}
+	}
+
+	static void gradientMap3DScalar(float *dst, int sx, int sy, int sz,
+			float x, float y, float z, float step_x, float step_y,
+			float step_z, int seed, bool eased)
+	{
+		int x0 = floor(x), y0 = floor(y), z0 = floor(z);
+		float w = z - (float)z0;
+		int noisez = 0;
+		for (int k = 0; k != sz; k++) {
+			float v = y - (float)y0;
+			int noisey = 0;
+			for (int j = 0; j != sy; j++) {
+				float u = x - (float)x0;
+				int noisex = 0;
+				for (int i = 0; i != sx; i++) {
+					int nx = x0 + noisex, ny = y0 + noisey, nz = z0 + noisez;
+					float tx = eased ? easeCurve(u) : u;
+					float ty = eased ? easeCurve(v) : v;
+					float tz = eased ? easeCurve(w) : w;
+					*dst++ =
+						noise3d(nx,     ny,     nz,     seed) * (1 - tx) * (1 - ty) * (1 - tz) +
+						noise3d(nx + 1, ny,     nz,     seed) * tx * (1 - ty) * (1 - tz) +
+						noise3d(nx,     ny + 1, nz,     seed) * (1 - tx) * ty * (1 - tz) +
+						noise3d(nx + 1, ny + 1, nz,     seed) * tx * ty * (1 - tz) +
+						noise3d(nx,     ny,     nz + 1, seed) * (1 - tx) * (1 - ty) * tz +
+						noise3d(nx + 1, ny,     nz + 1, seed) * tx * (1 - ty) * tz +
+						noise3d(nx,     ny + 1, nz + 1, seed) * (1 - tx) * ty * tz +
+						noise3d(nx + 1, ny + 1, nz + 1, seed) * tx * ty * tz;
+					u += step_x;
+					if (u >= 1.0) {
+						u -= 1.0;
+						noisex++;
+					}
+				}
+				v += step_y;
+				if (v >= 1.0) {
+					v -= 1.0;
+					noisey++;
+				}
+			}
+			w += step_z;
+			if (w >= 1.0) {
+				w -= 1.0;
+				noisez++;
+			}
+		}
+	}
+
+	void Run()
+	{
+		// Worlds depend on these being exactly the same
+		for (int t = 0; t < 8; t++) {
+			NoiseParams np(0, 1, v3f(20 + t * 13, 30 + t * 7, 25), t, 4, 0.6);
+			int sx = 7 + t * 5, sy = 5 + t * 3, sz = 3 + t;
+			float x = -123.4 + t * 57.1, y = 87.6 - t * 31.3, z = t * 19.9;
+			float step_x = 1.0 / np.spread.X * (1 << t % 4);
+			float step_y = 1.0 / np.spread.Y * (1 << t % 4);
+			float step_z = 1.0 / np.spread.Z * (1 << t % 4);
+
+			Noise noise_2d(&np, t, sx, sy);
+			std::vector<float> expected(sx * sy * sz);
+			noise_2d.gradientMap2D(x, y, step_x, step_y, t);
+			gradientMap2DScalar(&expected[0], sx, sy,
+					x, y, step_x, step_y, t);
+			for (int i = 0; i != sx * sy; i++)
+				UASSERT(noise_2d.buf[i] == expected[i]);
+
+			// Mapgens rely on this for their ground level bounds
+			float amplitude = noise_perlin_amplitude(&np);
+			noise_2d.perlinMap2D(x, y);
+			for (int i = 0; i != sx * sy; i++)
+				UASSERT(fabs(noise_2d.result[i]) <= amplitude);
+
+			Noise noise_3d(&np, t, sx, sy, sz);
+			for (int eased = 0; eased != 2; eased++) {
+				noise_3d.gradientMap3D(x, y, z, step_x, step_y, step_z,
+						t, eased);
+				gradientMap3DScalar(&expected[0], sx, sy, sz,
+						x, y, z, step_x, step_y, step_z, t, eased);
+				for (int i = 0; i != sx * sy * sz; i++)
+					UASSERT(noise_3d.buf[i] == expected[i]);
+			}
+		}
+	}
+};
+
+struct TestWorkerPool: public TestBase
+{
+	struct SquareTask: public WorkerTask
+	{
+		std::vector<u32> results;
+
+		SquareTask(u32 count):
+			results(count, 0)
+		{
+		}
+
+		void run(u32 index)
+		{
+			results[index] += index * index;
+		}
+	};
+
+	struct CountJob: public WorkerJob
+	{
+		u32 runs;
+		JSemaphore done;
+
+		CountJob():
+			runs(0)
+		{
+		}
+		CountJob(const CountJob &other):
+			runs(other.runs)
+		{
+		}
+
+		void run()
+		{
+			runs++;
+			done.Post();
+		}
+	};
+
+	void Run()
+	{
+		WorkerPool pool(3);
+		UASSERT(pool.getThreadCount() == 3);
+		// Every part is run exactly once, also when the pool is reused
+		for(u32 count = 0; count < 200; count += 7){
+			SquareTask task(count);
+			pool.run(&task, count);
+			for(u32 i = 0; i < count; i++)
+				UASSERT(task.results[i] == i * i);
+		}
+		WorkerPool serial(0);
+		SquareTask task(10);
+		serial.run(&task, 10);
+		UASSERT(task.results[9] == 81);
+
+		// Jobs are all run, also while tasks are being run
+		std::vector<CountJob> jobs(100);
+		for(u32 i = 0; i < jobs.size(); i++)
+			pool.submit(&jobs[i], (WorkerPriority)(i % WORKER_PRIORITY_COUNT));
+		SquareTask task2(50);
+		pool.run(&task2, 50);
+		UASSERT(task2.results[49] == 49 * 49);
+		for(u32 i = 0; i < jobs.size(); i++)
+			jobs[i].done.Wait();
+		for(u32 i = 0; i < jobs.size(); i++)
+			UASSERT(jobs[i].runs == 1);
+	}
+};
+
+struct TestPackedFileCache: public TestBase
+{
+	void Run()
+	{
+		std::string dir = fs::TempPath() + DIR_DELIM + "mt_test_packcache";
+		fs::RecursiveDelete(dir);
+		UASSERT(fs::CreateAllDirs(dir));
+
+		std::string data;
+		bool checked;
+		{
+			PackedFileCache cache(dir);
+			UASSERT(!cache.load("a", data, checked));
+			UASSERT(cache.update("a", "first"));
+			UASSERT(cache.update("b", std::string(5000, 'b')));
+			UASSERT(cache.update("a", "second"));
+			UASSERT(cache.load("a", data, checked));
+			UASSERT(data == "second" && checked);
+		}
+		{
+			// What was written is kept, and still counts as checked
+			PackedFileCache cache(dir);
+			UASSERT(cache.load("b", data, checked));
+			UASSERT(data == std::string(5000, 'b') && checked);
+			UASSERT(cache.load("a", data, checked));
+			UASSERT(data == "second");
+		}
+		{
+			// Something else added to the pack
+			std::ofstream of((dir + DIR_DELIM + "media.pack").c_str(),
+					std::ios_base::binary | std::ios_base::app);
+			of << "garbage";
+		}
+		{
+			PackedFileCache cache(dir);
+			UASSERT(cache.load("a", data, checked));
+			UASSERT(data == "second" && !checked);
+			cache.setChecked("a");
+		}
+		{
+			PackedFileCache cache(dir);
+			UASSERT(cache.load("a", data, checked) && checked);
+			UASSERT(cache.load("b", data, checked) && !checked);
+		}
+		fs::RecursiveDelete(dir);
+	}
+};
+
+struct TestDatabaseRegion: public TestBase
+{
+	void Run()
+	{
+		std::string dir = fs::TempPath() + DIR_DELIM + "mt_test_region";
+		fs::RecursiveDelete(dir);
+		UASSERT(fs::CreateAllDirs(dir));
+
+		std::string a = "first";
+		std::string b(3000, 'b');
+		std::string a2(1000, 'a');
+		std::string path = dir + DIR_DELIM + "regions" + DIR_DELIM
+				+ "r.0.0.0.mtr";
+		u32 size;
+		{
+			Database_Region db(NULL, dir);
+			UASSERT(db.loadBlock(v3s16(1,2,3)) == "");
+			db.beginSave();
+			UASSERT(db.saveBlock(v3s16(1,2,3), a));
+			UASSERT(db.saveBlock(v3s16(15,0,0), b));
+			db.endSave();
+			UASSERT(db.loadBlock(v3s16(1,2,3)) == a);
+			UASSERT(db.loadBlock(v3s16(15,0,0)) == b);
+
+			// Until it is synced, the table on disk still has the old one
+			UASSERT(db.saveBlock(v3s16(1,2,3), a2));
+			UASSERT(db.loadBlock(v3s16(1,2,3)) == a2);
+			{
+				Database_Region other(NULL, dir);
+				UASSERT(other.loadBlock(v3s16(1,2,3)) == a);
+			}
+			db.endSave();
+		}
+		{
+			Database_Region db(NULL, dir);
+			UASSERT(db.loadBlock(v3s16(1,2,3)) == a2);
+			UASSERT(db.loadBlock(v3s16(15,0,0)) == b);
+			UASSERT(db.loadBlock(v3s16(0,0,0)) == "");
+
+			// Overwriting again reuses the freed slots
+			std::ifstream is(path.c_str(), std::ios_base::binary);
+			is.seekg(0, std::ios_base::end);
+			size = is.tellg();
+			for (u32 i = 0; i < 4; i++) {
+				UASSERT(db.saveBlock(v3s16(1,2,3), a));
+				db.endSave();
+				UASSERT(db.saveBlock(v3s16(1,2,3), a2));
+				db.endSave();
+			}
+			UASSERT(db.loadBlock(v3s16(1,2,3)) == a2);
+		}
+		std::ifstream is(path.c_str(), std::ios_base::binary);
+		is.seekg(0, std::ios_base::end);
+		UASSERT((u32)is.tellg() <= size + 1024);
+		is.close();
+		fs::RecursiveDelete(dir);
+	}
+};
+
 struct TestSocket: public TestBase
 {
 	void Run()
@@ -1783,6 +2539,125 @@ struct TestConnection: public TestBase
 		UASSERT(readU8(&p2[3]) == data1[0]);
 	}
 
+	con::BufferedPacket makeReliable(u16 seqnum)
+	{
+		SharedBuffer<u8> data(1);
+		data[0] = seqnum & 0xff;
+		Address a(127,0,0,1, 10);
+		SharedBuffer<u8> reliable = con::makeReliablePacket(data, seqnum);
+		return con::makePacket(a, reliable, 0x12345678, 123, 0);
+	}
+
+	void TestReliablePacketBuffer()
+	{
+		/*
+			Out of order inserts across the seqnum wrap around
+		*/
+		con::ReliablePacketBuffer incoming;
+		u16 next_expected = 65530;
+		u16 seqnums[] = {2, 65535, 65531, 0, 65533, 300};
+		for (u32 i = 0; i < sizeof(seqnums) / sizeof(seqnums[0]); i++) {
+			con::BufferedPacket p = makeReliable(seqnums[i]);
+			incoming.insert(p, next_expected);
+		}
+		// A resent duplicate is ignored
+		con::BufferedPacket dup = makeReliable(65533);
+		incoming.insert(dup, next_expected);
+		UASSERT(incoming.size() == 6);
+		UASSERT(incoming.containsPacket(0));
+		UASSERT(!incoming.containsPacket(1));
+
+		u16 sorted[] = {65531, 65533, 65535, 0, 2, 300};
+		for (u32 i = 0; i < 6; i++) {
+			u16 first;
+			UASSERT(incoming.getFirstSeqnum(first));
+			UASSERT(first == sorted[i]);
+			con::BufferedPacket p = incoming.popFirst();
+			UASSERT(readU16(&p.data[BASE_HEADER_SIZE+1]) == sorted[i]);
+		}
+		UASSERT(incoming.empty());
+
+		/*
+			Acks and resends
+		*/
+		con::ReliablePacketBuffer sent;
+		for (u16 seqnum = 65500; seqnum != 100; seqnum++) {
+			con::BufferedPacket p = makeReliable(seqnum);
+			sent.insert(p, 65000);
+		}
+		UASSERT(sent.size() == 136);
+		sent.popSeqnum(65500);
+		sent.popSeqnum(10);
+		UASSERT(!sent.containsPacket(10));
+		u16 first;
+		UASSERT(sent.getFirstSeqnum(first) && first == 65501);
+
+		sent.incrementTimeouts(0.5);
+		UASSERT(sent.getTimedOuts(1.0, 1000).empty());
+		sent.incrementTimeouts(0.6);
+		std::list<con::BufferedPacket> timed_outs = sent.getTimedOuts(1.0, 100);
+		UASSERT(timed_outs.size() == 100);
+		UASSERT(timed_outs.front().time >= 1.0);
+		// The ones just resent have to wait for another timeout
+		timed_outs = sent.getTimedOuts(1.0, 1000);
+		UASSERT(timed_outs.size() == 34);
+		UASSERT(sent.getTimedOuts(1.0, 1000).empty());
+
+		con::BufferedPacket p = sent.popSeqnum(99);
+		UASSERT(p.totaltime >= 1.0);
+		UASSERT(sent.size() == 133);
+	}
+
+	SharedBuffer<u8> insertSplit(con::IncomingSplitBuffer &buffer,
+			SharedBuffer<u8> chunk)
+	{
+		Address a(127,0,0,1, 10);
+		con::BufferedPacket p = con::makePacket(a, chunk, 0x12345678, 123, 0);
+		return buffer.insert(p, true);
+	}
+
+	void TestIncomingSplitBuffer()
+	{
+		SharedBuffer<u8> data(1234);
+		for (u32 i = 0; i < data.getSize(); i++)
+			data[i] = i % 251;
+
+		// The last chunk first and the others backwards, with a duplicate
+		con::IncomingSplitBuffer buffer;
+		std::list<SharedBuffer<u8> > chunks =
+				con::makeSplitPacket(data, 107, 77);
+		UASSERT(chunks.size() == 13);
+		SharedBuffer<u8> whole;
+		for (std::list<SharedBuffer<u8> >::reverse_iterator
+				i = chunks.rbegin(); i != chunks.rend(); ++i) {
+			UASSERT(whole.getSize() == 0);
+			whole = insertSplit(buffer, *i);
+			if (i == chunks.rbegin())
+				UASSERT(insertSplit(buffer, *i).getSize() == 0);
+		}
+		UASSERT(whole.getSize() == data.getSize());
+		UASSERT(memcmp(*whole, *data, data.getSize()) == 0);
+
+		// A packet small enough for one chunk
+		SharedBuffer<u8> small(10);
+		small[3] = 42;
+		chunks = con::makeSplitPacket(small, 107, 78);
+		UASSERT(chunks.size() == 1);
+		whole = insertSplit(buffer, chunks.front());
+		UASSERT(whole.getSize() == 10 && whole[3] == 42);
+
+		// A few chunks claiming a huge packet don't get its whole buffer
+		SharedBuffer<u8> chunk(7 + 500);
+		writeU8(&chunk[0], TYPE_SPLIT);
+		writeU16(&chunk[1], 79);
+		writeU16(&chunk[3], 65535);
+		writeU16(&chunk[5], 0);
+		UASSERT(insertSplit(buffer, chunk).getSize() == 0);
+		writeU16(&chunk[5], 60000);
+		UASSERT(insertSplit(buffer, chunk).getSize() == 0);
+		UASSERT(buffer.dataSize() < 65536);
+	}
+
 	struct Handler : public con::PeerHandler
 	{
 		Handler(const char *a_name)
@@ -1817,6 +2692,8 @@ struct TestConnection: public TestBase
 		DSTACK("TestConnection::Run");
 
 		TestHelpers();
+		TestReliablePacketBuffer();
+		TestIncomingSplitBuffer();
 
 		/*
 			Test some real connections
@@ -2174,9 +3051,15 @@ void run_tests()
 	TEST(TestUtilities);
 	TEST(TestPath);
 	TEST(TestSettings);
+	TEST(TestNodeTimerList);
+	TEST(TestActiveBlockList);
+	TEST(TestV3s16PtrHashMap);
+	TEST(TestLiquidQueue);
+	TEST(TestMapBlockPacking);
 	TEST(TestCompress);
 	TEST(TestSerialization);
 	TEST(TestNodedefSerialization);
+	TEST(TestNodedefLookup);
 	TESTPARAMS(TestMapNode, ndef);
 	TESTPARAMS(TestVoxelManipulator, ndef);
 	TESTPARAMS(TestVoxelAlgorithms, ndef);
@@ -2184,6 +3067,10 @@ void run_tests()
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	TEST(TestCollision);
+	TEST(TestNoise);
+	TEST(TestWorkerPool);
+	TEST(TestPackedFileCache);
+	TEST(TestDatabaseRegion);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
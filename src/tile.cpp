@@ -20,6 +20,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "tile.h"
 
 #include <ICameraSceneNode.h>
+#include <sstream>
+#include <set>
+#include <algorithm>
 #include "util/string.h"
 #include "util/container.h"
 #include "util/thread.h"
@@ -34,6 +37,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gamedef.h"
 #include "strfnd.h"
 #include "util/string.h" // for parseColorString()
+#include "porting.h"
+#include "sha1.h"
+#include "hex.h"
 
 #ifdef __ANDROID__
 #include <GLES/gl.h>
@@ -171,13 +177,18 @@ struct TextureInfo
 {
 	std::string name;
 	video::ITexture *texture;
+	// The texture atlas that has a copy of the texture, or NULL, and the
+	// texture coordinates of the copy in it
+	video::ITexture *atlas;
+	core::rect<f32> atlas_rect;
 
 	TextureInfo(
 			const std::string &name_,
 			video::ITexture *texture_=NULL
 		):
 		name(name_),
-		texture(texture_)
+		texture(texture_),
+		atlas(NULL)
 	{
 	}
 };
@@ -373,6 +384,21 @@ class TextureSource : public IWritableTextureSource
 	video::IImage* generateImage(const std::string &name);
 
 	video::ITexture* getNormalTexture(const std::string &name);
+
+	// Returns the texture atlas that has the texture, or NULL if none
+	// does; rect gets the texture coordinates of the texture in it.
+	// Can be called from any thread.
+	video::ITexture* getAtlasTexture(u32 id, core::rect<f32> &rect);
+
+	// Packs the textures into texture atlases, leaving out the ones
+	// that are too large. Earlier atlases are kept.
+	// Shall be called from the main thread.
+	void makeAtlases(const std::vector<u32> &ids);
+
+	// From now on, keep the images made with modifiers on disk, for the
+	// media with the given hash (a hex string).
+	// Shall be called from the main thread.
+	void enableImageCache(const std::string &media_hash);
 private:
 
 	// The id of the thread that is allowed to use irrlicht directly
@@ -387,6 +413,16 @@ class TextureSource : public IWritableTextureSource
 	// Generate a texture
 	u32 generateTexture(const std::string &name);
 
+	// generateImage(), through the image cache if it is enabled
+	video::IImage* generateCachedImage(const std::string &name);
+	// Path of an image in the image cache
+	std::string getCachedImagePath(const std::string &name);
+	// generateTextureFromMesh() without the image cache
+	video::ITexture* renderTextureFromMesh(
+			const TextureFromMeshParams &params);
+	// The directory of the image cache, or "" if it isn't enabled
+	std::string m_image_cache_dir;
+
 	// Generate image based on a string like "stone.png" or "[crack:1:0".
 	// if baseimg is NULL, it is created. Otherwise stuff is made on it.
 	bool generateImagePart(std::string part_of_name, video::IImage *& baseimg);
@@ -404,11 +440,15 @@ class TextureSource : public IWritableTextureSource
 
 	// Queued texture fetches (to be processed by the main thread)
 	RequestQueue<std::string, u32, u8, u8> m_get_texture_queue;
+	ThreadResultQueues<std::string, u32, u8, u8> m_get_texture_results;
 
 	// Textures that have been overwritten with other ones
 	// but can't be deleted because the ITexture* might still be used
 	std::list<video::ITexture*> m_texture_trash;
 
+	// Made by makeAtlases()
+	std::vector<video::ITexture*> m_atlases;
+
 	// Cached settings needed for making textures from meshes
 	bool m_setting_trilinear_filter;
 	bool m_setting_bilinear_filter;
@@ -455,6 +495,10 @@ TextureSource::~TextureSource()
 	}
 	m_textureinfo_cache.clear();
 
+	for (u32 i = 0; i < m_atlases.size(); i++)
+		driver->removeTexture(m_atlases[i]);
+	m_atlases.clear();
+
 	for (std::list<video::ITexture*>::iterator iter =
 			m_texture_trash.begin(); iter != m_texture_trash.end();
 			iter++)
@@ -498,7 +542,8 @@ u32 TextureSource::getTextureId(const std::string &name)
 		infostream<<"getTextureId(): Queued: name=\""<<name<<"\""<<std::endl;
 
 		// We're gonna ask the result to be put into here
-		static ResultQueue<std::string, u32, u8, u8> result_queue;
+		ResultQueue<std::string, u32, u8, u8> &result_queue =
+				*m_get_texture_results.get();
 
 		// Throw a request in
 		m_get_texture_queue.add(name, 0, 0, &result_queue);
@@ -595,7 +640,7 @@ u32 TextureSource::generateTexture(const std::string &name)
 	video::IVideoDriver *driver = m_device->getVideoDriver();
 	assert(driver);
 
-	video::IImage *img = generateImage(name);
+	video::IImage *img = generateCachedImage(name);
 
 	video::ITexture *tex = NULL;
 
@@ -696,7 +741,7 @@ void TextureSource::rebuildImagesAndTextures()
 	// Recreate textures
 	for(u32 i=0; i<m_textureinfo_cache.size(); i++){
 		TextureInfo *ti = &m_textureinfo_cache[i];
-		video::IImage *img = generateImage(ti->name);
+		video::IImage *img = generateCachedImage(ti->name);
 #ifdef __ANDROID__
 		img = Align2Npot2(img, driver);
 		assert(img->getDimension().Height == npot2(img->getDimension().Height));
@@ -711,14 +756,296 @@ void TextureSource::rebuildImagesAndTextures()
 		video::ITexture *t_old = ti->texture;
 		// Replace texture
 		ti->texture = t;
+		// The atlases have the old images
+		ti->atlas = NULL;
 
 		if (t_old)
 			m_texture_trash.push_back(t_old);
 	}
+
+	for (u32 i = 0; i < m_atlases.size(); i++)
+		m_texture_trash.push_back(m_atlases[i]);
+	m_atlases.clear();
+}
+
+void TextureSource::enableImageCache(const std::string &media_hash)
+{
+	assert(get_current_thread_id() == m_main_thread);
+
+	std::string dir = porting::path_user + DIR_DELIM + "cache" + DIR_DELIM
+			+ "textures" + DIR_DELIM + media_hash;
+	if (!fs::CreateAllDirs(dir)) {
+		errorstream << "TextureSource: can't make the image cache "
+				<< dir << std::endl;
+		return;
+	}
+	infostream << "TextureSource: caching images in " << dir << std::endl;
+	m_image_cache_dir = dir;
+}
+
+/*
+	Plain source images are loaded as they are; those made with modifiers
+	are kept in the image cache as PNGs named by the SHA1 of their names.
+	The directory of the cache is different for other media, so a file
+	that is found is what generateImage(name) would make.
+*/
+video::IImage* TextureSource::generateCachedImage(const std::string &name)
+{
+	if (m_image_cache_dir == "" || (name.find('^') == std::string::npos
+			&& (name.empty() || name[0] != '[')))
+		return generateImage(name);
+
+	std::string path = getCachedImagePath(name);
+
+	video::IVideoDriver *driver = m_device->getVideoDriver();
+	assert(driver);
+
+	if (fs::PathExists(path)) {
+		video::IImage *img = driver->createImageFromFile(path.c_str());
+		if (img)
+			return img;
+		errorstream << "TextureSource: can't read the cached image "
+				<< path << " of \"" << name << "\"" << std::endl;
+	}
+
+	video::IImage *img = generateImage(name);
+	if (img && !driver->writeImageToFile(img, path.c_str()))
+		infostream << "TextureSource: can't cache the image of \""
+				<< name << "\" in " << path << std::endl;
+	return img;
+}
+
+std::string TextureSource::getCachedImagePath(const std::string &name)
+{
+	SHA1 sha1;
+	sha1.addBytes(name.c_str(), name.size());
+	unsigned char *digest = sha1.getDigest();
+	std::string path = m_image_cache_dir + DIR_DELIM
+			+ hex_encode((char *)digest, 20) + ".png";
+	free(digest);
+	return path;
+}
+
+video::ITexture* TextureSource::getAtlasTexture(u32 id, core::rect<f32> &rect)
+{
+	JMutexAutoLock lock(m_textureinfo_cache_mutex);
+
+	if (id >= m_textureinfo_cache.size())
+		return NULL;
+
+	TextureInfo &ti = m_textureinfo_cache[id];
+	if (ti.atlas == NULL)
+		return NULL;
+	rect = ti.atlas_rect;
+	return ti.atlas;
 }
 
+/*
+	Texture atlases are squares of TEXTURE_ATLAS_SIZE (or the largest the
+	video card takes), cut in height when the last one isn't full.
+	Textures are copied with a border of TEXTURE_ATLAS_BORDER pixels taken
+	from their other side, so that filtering near the edges looks like it
+	does on a repeated texture.
+*/
+#define TEXTURE_ATLAS_SIZE 2048
+#define TEXTURE_ATLAS_MAX_TILE_SIZE 256
+#define TEXTURE_ATLAS_BORDER 1
+
+struct AtlasPlace
+{
+	u32 id;
+	video::IImage *image;
+	u32 atlas;
+	v2u32 pos;
+};
+
+// Tallest first, so that the rows of the atlas are filled
+static bool compareAtlasPlaceHeight(const AtlasPlace &a, const AtlasPlace &b)
+{
+	return a.image->getDimension().Height > b.image->getDimension().Height;
+}
+
+void TextureSource::makeAtlases(const std::vector<u32> &ids)
+{
+	assert(get_current_thread_id() == m_main_thread);
+
+	video::IVideoDriver *driver = m_device->getVideoDriver();
+	assert(driver);
+
+	core::dimension2d<u32> max_size = driver->getMaxTextureSize();
+	u32 size = MYMIN(TEXTURE_ATLAS_SIZE,
+			MYMIN(max_size.Width, max_size.Height));
+	u32 max_tile_size = MYMIN(TEXTURE_ATLAS_MAX_TILE_SIZE,
+			size - 2 * TEXTURE_ATLAS_BORDER);
+
+	std::vector<AtlasPlace> places;
+	std::set<u32> seen;
+	for (u32 i = 0; i < ids.size(); i++) {
+		if (ids[i] == 0 || seen.count(ids[i]) != 0)
+			continue;
+		seen.insert(ids[i]);
+		video::IImage *img = generateCachedImage(getTextureName(ids[i]));
+		if (img == NULL)
+			continue;
+		core::dimension2d<u32> dim = img->getDimension();
+		if (dim.Width == 0 || dim.Height == 0 ||
+				dim.Width > max_tile_size || dim.Height > max_tile_size) {
+			img->drop();
+			continue;
+		}
+		AtlasPlace place;
+		place.id = ids[i];
+		place.image = img;
+		places.push_back(place);
+	}
+	if (places.empty())
+		return;
+
+	std::sort(places.begin(), places.end(), compareAtlasPlaceHeight);
+
+	// Lay out the textures in rows, from the top left
+	std::vector<u32> heights;
+	heights.push_back(0);
+	u32 x = 0;
+	u32 y = 0;
+	u32 row_height = 0;
+	for (u32 i = 0; i < places.size(); i++) {
+		core::dimension2d<u32> dim = places[i].image->getDimension();
+		u32 w = dim.Width + 2 * TEXTURE_ATLAS_BORDER;
+		u32 h = dim.Height + 2 * TEXTURE_ATLAS_BORDER;
+		if (x + w > size) {
+			x = 0;
+			y += row_height;
+			row_height = 0;
+		}
+		if (y + h > size) {
+			heights.push_back(0);
+			x = 0;
+			y = 0;
+			row_height = 0;
+		}
+		places[i].atlas = heights.size() - 1;
+		places[i].pos = v2u32(x, y);
+		x += w;
+		row_height = MYMAX(row_height, h);
+		heights.back() = MYMAX(heights.back(), y + row_height);
+	}
+
+	// The atlases are drawn from a distance mostly, where the mip maps
+	// would mix the textures next to each other
+	bool mip_maps = driver->getTextureCreationFlag(video::ETCF_CREATE_MIP_MAPS);
+	driver->setTextureCreationFlag(video::ETCF_CREATE_MIP_MAPS, false);
+
+	for (u32 a = 0; a < heights.size(); a++) {
+		u32 height = 1;
+		while (height < heights[a])
+			height <<= 1;
+		video::IImage *atlas_img = driver->createImage(video::ECF_A8R8G8B8,
+				core::dimension2d<u32>(size, height));
+		atlas_img->fill(video::SColor(0, 0, 0, 0));
+
+		std::vector<AtlasPlace*> in_atlas;
+		for (u32 i = 0; i < places.size(); i++) {
+			if (places[i].atlas != a)
+				continue;
+			AtlasPlace &place = places[i];
+			core::dimension2d<u32> dim = place.image->getDimension();
+			s32 b = TEXTURE_ATLAS_BORDER;
+			for (s32 dy = -b; dy < (s32)dim.Height + b; dy++)
+			for (s32 dx = -b; dx < (s32)dim.Width + b; dx++) {
+				u32 sx = (dx + dim.Width) % dim.Width;
+				u32 sy = (dy + dim.Height) % dim.Height;
+				atlas_img->setPixel(place.pos.X + b + dx, place.pos.Y + b + dy,
+						place.image->getPixel(sx, sy));
+			}
+			in_atlas.push_back(&place);
+		}
+
+		std::ostringstream os(std::ios::binary);
+		os << "[atlas:" << m_atlases.size();
+		video::ITexture *atlas = driver->addTexture(os.str().c_str(), atlas_img);
+		atlas_img->drop();
+		if (atlas == NULL) {
+			errorstream << "TextureSource::makeAtlases(): can't make a "
+					<< size << "x" << height << " texture" << std::endl;
+			continue;
+		}
+		m_atlases.push_back(atlas);
+
+		JMutexAutoLock lock(m_textureinfo_cache_mutex);
+		for (u32 i = 0; i < in_atlas.size(); i++) {
+			AtlasPlace &place = *in_atlas[i];
+			core::dimension2d<u32> dim = place.image->getDimension();
+			v2f pos(place.pos.X + TEXTURE_ATLAS_BORDER,
+					place.pos.Y + TEXTURE_ATLAS_BORDER);
+			TextureInfo &ti = m_textureinfo_cache[place.id];
+			ti.atlas = atlas;
+			ti.atlas_rect = core::rect<f32>(
+					pos.X / size, pos.Y / height,
+					(pos.X + dim.Width) / size, (pos.Y + dim.Height) / height);
+		}
+	}
+
+	driver->setTextureCreationFlag(video::ETCF_CREATE_MIP_MAPS, mip_maps);
+
+	for (u32 i = 0; i < places.size(); i++)
+		places[i].image->drop();
+
+	infostream << "TextureSource::makeAtlases(): " << places.size()
+			<< " textures in " << heights.size() << " atlases" << std::endl;
+}
+
+/*
+	Meshes rendered to textures for the inventory take the longest of the
+	images, so they are kept in the image cache too when they have a name
+	there; the render target is then read back once.
+*/
 video::ITexture* TextureSource::generateTextureFromMesh(
 		const TextureFromMeshParams &params)
+{
+	if (m_image_cache_dir == "" || params.cache_name == "")
+		return renderTextureFromMesh(params);
+
+	video::IVideoDriver *driver = m_device->getVideoDriver();
+	assert(driver);
+
+	std::string path = getCachedImagePath("[mesh:" + itos(params.dim.Width)
+			+ "x" + itos(params.dim.Height) + ":" + params.cache_name);
+	if (fs::PathExists(path)) {
+		video::IImage *img = driver->createImageFromFile(path.c_str());
+		if (img && img->getDimension() == params.dim) {
+			video::ITexture *texture = driver->addTexture(
+					params.rtt_texture_name.c_str(), img);
+			img->drop();
+			if (texture) {
+				if (params.delete_texture_on_shutdown)
+					m_texture_trash.push_back(texture);
+				return texture;
+			}
+		} else {
+			if (img)
+				img->drop();
+			errorstream << "TextureSource: can't read the cached image "
+					<< path << " of a mesh" << std::endl;
+		}
+	}
+
+	video::ITexture *rtt = renderTextureFromMesh(params);
+	if (rtt == NULL)
+		return NULL;
+
+	video::IImage *img = driver->createImage(rtt, v2s32(0, 0), params.dim);
+	if (img) {
+		if (!driver->writeImageToFile(img, path.c_str()))
+			infostream << "TextureSource: can't cache the image of a mesh in "
+					<< path << std::endl;
+		img->drop();
+	}
+	return rtt;
+}
+
+video::ITexture* TextureSource::renderTextureFromMesh(
+		const TextureFromMeshParams &params)
 {
 	video::IVideoDriver *driver = m_device->getVideoDriver();
 	assert(driver);
@@ -28,6 +28,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "threads.h"
 #include <string>
 #include <map>
+#include <vector>
 
 class IGameDef;
 
@@ -77,6 +78,9 @@ struct TextureFromMeshParams
 	v3f light_position;
 	video::SColorf light_color;
 	f32 light_radius;
+	// If not empty, the image is kept in the image cache under this name
+	// (which must tell everything the mesh is made of)
+	std::string cache_name;
 };
 
 /*
@@ -107,6 +111,8 @@ class ITextureSource : public ISimpleTextureSource
 	virtual video::ITexture* generateTextureFromMesh(
 			const TextureFromMeshParams &params)=0;
 	virtual video::ITexture* getNormalTexture(const std::string &name)=0;
+	virtual video::ITexture* getAtlasTexture(u32 id, core::rect<f32> &rect)=0;
+	virtual void makeAtlases(const std::vector<u32> &ids)=0;
 };
 
 class IWritableTextureSource : public ITextureSource
@@ -128,6 +134,9 @@ class IWritableTextureSource : public ITextureSource
 	virtual void insertSourceImage(const std::string &name, video::IImage *img)=0;
 	virtual void rebuildImagesAndTextures()=0;
 	virtual video::ITexture* getNormalTexture(const std::string &name)=0;
+	virtual video::ITexture* getAtlasTexture(u32 id, core::rect<f32> &rect)=0;
+	virtual void makeAtlases(const std::vector<u32> &ids)=0;
+	virtual void enableImageCache(const std::string &media_hash)=0;
 };
 
 IWritableTextureSource* createTextureSource(IrrlichtDevice *device);
@@ -172,6 +181,9 @@ enum MaterialType{
 // defined by extra parameters
 #define MATERIAL_FLAG_ANIMATION_VERTICAL_FRAMES 0x08
 #define MATERIAL_FLAG_HIGHLIGHTED 0x10
+// The texture is in a texture atlas. The faces of the tile are not merged,
+// so that their texture coordinates stay in 0..1 and can be moved to it.
+#define MATERIAL_FLAG_IN_ATLAS 0x20
 
 /*
 	This fully defines the looks of a tile.
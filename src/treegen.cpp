@@ -19,6 +19,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irr_v3d.h"
 #include <stack>
+#include <map>
+#include <sstream>
 #include "util/pointer.h"
 #include "util/numeric.h"
 #include "util/mathconstants.h"
@@ -26,6 +28,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "nodedef.h"
 #include "treegen.h"
+#include "jthread/jmutex.h"
+#include "jthread/jmutexautolock.h"
 
 namespace treegen
 {
@@ -150,108 +154,83 @@ treegen::error spawn_ltree(ServerEnvironment *env, v3s16 p0, INodeDefManager *nd
 	return SUCCESS;
 }
 
-//L-System tree generator
-treegen::error make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefManager *ndef,
-		TreeDef tree_definition)
-{
-	MapNode dirtnode(ndef->getId("mapgen_dirt"));
-	int seed;
-	if (tree_definition.explicit_seed)
-	{
-		seed = tree_definition.seed+14002;
-	}
-	else
+/*
+	Compiled L-system trees
+
+	Interpreting the axiom is the slow part of placing an L-system tree,
+	and trees of one definition mostly repeat a few axioms. The nodes the
+	turtle places are kept, relative to the root and in their original
+	order, so that placing the leaves takes the same random numbers.
+*/
+
+enum LTreeNodeType {
+	LTREE_DIRT,
+	LTREE_TRUNK,
+	LTREE_LEAVES,
+	LTREE_SINGLE_LEAVES,
+	LTREE_FRUIT
+};
+
+struct LTreeTemplate {
+	struct Node {
+		u8 type;
+		v3s16 offset;
+	};
+	std::vector<Node> nodes;
+	// An unbalanced bracket stops the tree where it is found
+	treegen::error error;
+	// The cache and the trees being placed from it; only changed under
+	// g_ltree_templates_mutex. The rest isn't changed once cached.
+	u32 refs;
+
+	void add(u8 type, v3f p)
 	{
-		seed = p0.X*2 + p0.Y*4 + p0.Z;      // use the tree position to seed PRNG
+		Node n;
+		n.type = type;
+		n.offset = v3s16(myround(p.X), myround(p.Y), myround(p.Z));
+		nodes.push_back(n);
 	}
-	PseudoRandom ps(seed);
+};
 
-	// chance of inserting abcd rules
-	double prop_a = 9;
-	double prop_b = 8;
-	double prop_c = 7;
-	double prop_d = 6;
+#define LTREE_TEMPLATE_CACHE_SIZE 256
 
-	//randomize tree growth level, minimum=2
-	s16 iterations = tree_definition.iterations;
-	if (tree_definition.iterations_random_level>0)
-		iterations -= ps.range(0,tree_definition.iterations_random_level);
-	if (iterations<2)
-		iterations=2;
+static std::map<std::string, LTreeTemplate *> g_ltree_templates;
+static JMutex g_ltree_templates_mutex;
 
-	s16 MAX_ANGLE_OFFSET = 5;
-	double angle_in_radians = (double)tree_definition.angle*M_PI/180;
-	double angleOffset_in_radians = (s16)(ps.range(0,1)%MAX_ANGLE_OFFSET)*M_PI/180;
+// Requires g_ltree_templates_mutex
+static void release_ltree_template(LTreeTemplate *tree)
+{
+	if (--tree->refs == 0)
+		delete tree;
+}
+
+// Runs the turtle from the origin, recording the nodes it would place
+static void make_ltree_template(LTreeTemplate &tree, const std::string &axiom,
+		TreeDef &tree_definition, double angle_in_radians,
+		double angleOffset_in_radians)
+{
+	tree.error = SUCCESS;
 
 	//initialize rotation matrix, position and stacks for branches
 	core::matrix4 rotation;
 	rotation = setRotationAxisRadians(rotation, M_PI/2,v3f(0,0,1));
-	v3f position;
-	position.X = p0.X;
-	position.Y = p0.Y;
-	position.Z = p0.Z;
+	v3f position(0, 0, 0);
 	std::stack <core::matrix4> stack_orientation;
 	std::stack <v3f> stack_position;
 
-	//generate axiom
-	std::string axiom = tree_definition.initial_axiom;
-	for(s16 i=0; i<iterations; i++)
-	{
-		std::string temp = "";
-		for(s16 j=0; j<(s16)axiom.size(); j++)
-		{
-			char axiom_char = axiom.at(j);
-			switch (axiom_char)
-			{
-			case 'A':
-				temp+=tree_definition.rules_a;
-				break;
-			case 'B':
-				temp+=tree_definition.rules_b;
-				break;
-			case 'C':
-				temp+=tree_definition.rules_c;
-				break;
-			case 'D':
-				temp+=tree_definition.rules_d;
-				break;
-			case 'a':
-				if (prop_a >= ps.range(1,10))
-					temp+=tree_definition.rules_a;
-				break;
-			case 'b':
-				if (prop_b >= ps.range(1,10))
-					temp+=tree_definition.rules_b;
-				break;
-			case 'c':
-				if (prop_c >= ps.range(1,10))
-					temp+=tree_definition.rules_c;
-				break;
-			case 'd':
-				if (prop_d >= ps.range(1,10))
-					temp+=tree_definition.rules_d;
-				break;
-			default:
-				temp+=axiom_char;
-				break;
-			}
-		}
-		axiom=temp;
-	}
-
 	//make sure tree is not floating in the air
 	if (tree_definition.trunk_type == "double")
 	{
-		tree_node_placement(vmanip,v3f(position.X+1,position.Y-1,position.Z),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X,position.Y-1,position.Z+1),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X+1,position.Y-1,position.Z+1),dirtnode);
+		tree.add(LTREE_DIRT,v3f(position.X+1,position.Y-1,position.Z));
+		tree.add(LTREE_DIRT,v3f(position.X,position.Y-1,position.Z+1));
+		tree.add(LTREE_DIRT,v3f(position.X+1,position.Y-1,position.Z+1));
 	}
 	else if (tree_definition.trunk_type == "crossed")
 	{
-		tree_node_placement(vmanip,v3f(position.X+1,position.Y-1,position.Z),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X-1,position.Y-1,position.Z),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X,position.Y-1,position.Z+1),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X,position.Y-1,position.Z-1),dirtnode);
+		tree.add(LTREE_DIRT,v3f(position.X+1,position.Y-1,position.Z));
+		tree.add(LTREE_DIRT,v3f(position.X-1,position.Y-1,position.Z));
+		tree.add(LTREE_DIRT,v3f(position.X,position.Y-1,position.Z+1));
+		tree.add(LTREE_DIRT,v3f(position.X,position.Y-1,position.Z-1));
 	}
 
 	/* build tree out of generated axiom
@@ -297,40 +276,40 @@ treegen::error make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefM
 			position+=dir;
 			break;
 		case 'T':
-			tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z),tree_definition);
+			tree.add(LTREE_TRUNK,v3f(position.X,position.Y,position.Z));
 			if (tree_definition.trunk_type == "double" && !tree_definition.thin_branches)
 			{
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z+1),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z+1),tree_definition);
+				tree.add(LTREE_TRUNK,v3f(position.X+1,position.Y,position.Z));
+				tree.add(LTREE_TRUNK,v3f(position.X,position.Y,position.Z+1));
+				tree.add(LTREE_TRUNK,v3f(position.X+1,position.Y,position.Z+1));
 			}
 			else if (tree_definition.trunk_type == "crossed" && !tree_definition.thin_branches)
 			{
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X-1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z+1),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z-1),tree_definition);
+				tree.add(LTREE_TRUNK,v3f(position.X+1,position.Y,position.Z));
+				tree.add(LTREE_TRUNK,v3f(position.X-1,position.Y,position.Z));
+				tree.add(LTREE_TRUNK,v3f(position.X,position.Y,position.Z+1));
+				tree.add(LTREE_TRUNK,v3f(position.X,position.Y,position.Z-1));
 			}
 			dir = v3f(1,0,0);
 			dir = transposeMatrix(rotation,dir);
 			position+=dir;
 			break;
 		case 'F':
-			tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z),tree_definition);
+			tree.add(LTREE_TRUNK,v3f(position.X,position.Y,position.Z));
 			if ((stack_orientation.empty() && tree_definition.trunk_type == "double") ||
 				(!stack_orientation.empty() && tree_definition.trunk_type == "double" && !tree_definition.thin_branches))
 			{
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z+1),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z+1),tree_definition);
+				tree.add(LTREE_TRUNK,v3f(position.X+1,position.Y,position.Z));
+				tree.add(LTREE_TRUNK,v3f(position.X,position.Y,position.Z+1));
+				tree.add(LTREE_TRUNK,v3f(position.X+1,position.Y,position.Z+1));
 			}
 			else if ((stack_orientation.empty() && tree_definition.trunk_type == "crossed") ||
 				(!stack_orientation.empty() && tree_definition.trunk_type == "crossed" && !tree_definition.thin_branches))
 			{
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X-1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z+1),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z-1),tree_definition);
+				tree.add(LTREE_TRUNK,v3f(position.X+1,position.Y,position.Z));
+				tree.add(LTREE_TRUNK,v3f(position.X-1,position.Y,position.Z));
+				tree.add(LTREE_TRUNK,v3f(position.X,position.Y,position.Z+1));
+				tree.add(LTREE_TRUNK,v3f(position.X,position.Y,position.Z-1));
 			}
 			if (stack_orientation.empty() == false)
 			{
@@ -340,10 +319,10 @@ treegen::error make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefM
 						for(z=-size; z<=size; z++)
 							if (abs(x) == size && abs(y) == size && abs(z) == size)
 							{
-								tree_leaves_placement(vmanip,v3f(position.X+x+1,position.Y+y,position.Z+z),ps.next(), tree_definition);
-								tree_leaves_placement(vmanip,v3f(position.X+x-1,position.Y+y,position.Z+z),ps.next(), tree_definition);
-								tree_leaves_placement(vmanip,v3f(position.X+x,position.Y+y,position.Z+z+1),ps.next(), tree_definition);
-								tree_leaves_placement(vmanip,v3f(position.X+x,position.Y+y,position.Z+z-1),ps.next(), tree_definition);
+								tree.add(LTREE_LEAVES,v3f(position.X+x+1,position.Y+y,position.Z+z));
+								tree.add(LTREE_LEAVES,v3f(position.X+x-1,position.Y+y,position.Z+z));
+								tree.add(LTREE_LEAVES,v3f(position.X+x,position.Y+y,position.Z+z+1));
+								tree.add(LTREE_LEAVES,v3f(position.X+x,position.Y+y,position.Z+z-1));
 							}
 			}
 			dir = v3f(1,0,0);
@@ -351,13 +330,13 @@ treegen::error make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefM
 			position+=dir;
 			break;
 		case 'f':
-			tree_single_leaves_placement(vmanip,v3f(position.X,position.Y,position.Z),ps.next() ,tree_definition);
+			tree.add(LTREE_SINGLE_LEAVES,v3f(position.X,position.Y,position.Z));
 			dir = v3f(1,0,0);
 			dir = transposeMatrix(rotation,dir);
 			position+=dir;
 			break;
 		case 'R':
-			tree_fruit_placement(vmanip,v3f(position.X,position.Y,position.Z),tree_definition);
+			tree.add(LTREE_FRUIT,v3f(position.X,position.Y,position.Z));
 			dir = v3f(1,0,0);
 			dir = transposeMatrix(rotation,dir);
 			position+=dir;
@@ -370,7 +349,10 @@ treegen::error make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefM
 			break;
 		case ']':
 			if (stack_orientation.empty())
-				return UNBALANCED_BRACKETS;
+			{
+				tree.error = UNBALANCED_BRACKETS;
+				return;
+			}
 			rotation=stack_orientation.top();
 			stack_orientation.pop();
 			position=stack_position.top();
@@ -410,8 +392,159 @@ treegen::error make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefM
 			break;
 		}
 	}
+}
 
-	return SUCCESS;
+//L-System tree generator
+treegen::error make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefManager *ndef,
+		TreeDef tree_definition)
+{
+	MapNode dirtnode(ndef->getId("mapgen_dirt"));
+	int seed;
+	if (tree_definition.explicit_seed)
+	{
+		seed = tree_definition.seed+14002;
+	}
+	else
+	{
+		seed = p0.X*2 + p0.Y*4 + p0.Z;      // use the tree position to seed PRNG
+	}
+	PseudoRandom ps(seed);
+
+	// chance of inserting abcd rules
+	double prop_a = 9;
+	double prop_b = 8;
+	double prop_c = 7;
+	double prop_d = 6;
+
+	//randomize tree growth level, minimum=2
+	s16 iterations = tree_definition.iterations;
+	if (tree_definition.iterations_random_level>0)
+		iterations -= ps.range(0,tree_definition.iterations_random_level);
+	if (iterations<2)
+		iterations=2;
+
+	s16 MAX_ANGLE_OFFSET = 5;
+	double angle_in_radians = (double)tree_definition.angle*M_PI/180;
+	double angleOffset_in_radians = (s16)(ps.range(0,1)%MAX_ANGLE_OFFSET)*M_PI/180;
+
+	//generate axiom
+	std::string axiom = tree_definition.initial_axiom;
+	for(s16 i=0; i<iterations; i++)
+	{
+		std::string temp = "";
+		for(s16 j=0; j<(s16)axiom.size(); j++)
+		{
+			char axiom_char = axiom.at(j);
+			switch (axiom_char)
+			{
+			case 'A':
+				temp+=tree_definition.rules_a;
+				break;
+			case 'B':
+				temp+=tree_definition.rules_b;
+				break;
+			case 'C':
+				temp+=tree_definition.rules_c;
+				break;
+			case 'D':
+				temp+=tree_definition.rules_d;
+				break;
+			case 'a':
+				if (prop_a >= ps.range(1,10))
+					temp+=tree_definition.rules_a;
+				break;
+			case 'b':
+				if (prop_b >= ps.range(1,10))
+					temp+=tree_definition.rules_b;
+				break;
+			case 'c':
+				if (prop_c >= ps.range(1,10))
+					temp+=tree_definition.rules_c;
+				break;
+			case 'd':
+				if (prop_d >= ps.range(1,10))
+					temp+=tree_definition.rules_d;
+				break;
+			default:
+				temp+=axiom_char;
+				break;
+			}
+		}
+		axiom=temp;
+	}
+
+	// The shape only depends on the axiom and on a few fields of the
+	// definition; the randomness of the leaves is applied when placing
+	std::ostringstream os(std::ios::binary);
+	os<<tree_definition.trunk_type<<'\n'<<tree_definition.thin_branches
+		<<'\n'<<angle_in_radians<<'\n'<<angleOffset_in_radians<<'\n'<<axiom;
+	std::string key = os.str();
+
+	// The lock is only held for the lookups, so that the emerge threads
+	// can make and place trees at the same time
+	LTreeTemplate *tree = NULL;
+	{
+		JMutexAutoLock lock(g_ltree_templates_mutex);
+		std::map<std::string, LTreeTemplate *>::iterator it =
+			g_ltree_templates.find(key);
+		if (it != g_ltree_templates.end()) {
+			tree = it->second;
+			tree->refs++;
+		}
+	}
+	if (tree == NULL) {
+		LTreeTemplate *made = new LTreeTemplate;
+		make_ltree_template(*made, axiom, tree_definition,
+			angle_in_radians, angleOffset_in_radians);
+
+		JMutexAutoLock lock(g_ltree_templates_mutex);
+		std::map<std::string, LTreeTemplate *>::iterator it =
+			g_ltree_templates.find(key);
+		if (it != g_ltree_templates.end()) {
+			// Made by another thread meanwhile
+			delete made;
+			tree = it->second;
+		} else {
+			if (g_ltree_templates.size() >= LTREE_TEMPLATE_CACHE_SIZE) {
+				for (it = g_ltree_templates.begin();
+						it != g_ltree_templates.end(); ++it)
+					release_ltree_template(it->second);
+				g_ltree_templates.clear();
+			}
+			tree = made;
+			tree->refs = 1;
+			g_ltree_templates[key] = tree;
+		}
+		tree->refs++;
+	}
+
+	for (std::vector<LTreeTemplate::Node>::iterator
+			i = tree->nodes.begin(); i != tree->nodes.end(); ++i) {
+		v3s16 p = p0 + i->offset;
+		v3f pf(p.X, p.Y, p.Z);
+		switch (i->type) {
+		case LTREE_DIRT:
+			tree_node_placement(vmanip, pf, dirtnode);
+			break;
+		case LTREE_TRUNK:
+			tree_trunk_placement(vmanip, pf, tree_definition);
+			break;
+		case LTREE_LEAVES:
+			tree_leaves_placement(vmanip, pf, ps.next(), tree_definition);
+			break;
+		case LTREE_SINGLE_LEAVES:
+			tree_single_leaves_placement(vmanip, pf, ps.next(), tree_definition);
+			break;
+		case LTREE_FRUIT:
+			tree_fruit_placement(vmanip, pf, tree_definition);
+			break;
+		}
+	}
+
+	treegen::error error = tree->error;
+	JMutexAutoLock lock(g_ltree_templates_mutex);
+	release_ltree_template(tree);
+	return error;
 }
 
 void tree_node_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
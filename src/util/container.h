@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define UTIL_CONTAINER_HEADER
 
 #include "../irrlichttypes.h"
+#include "../irr_v3d.h"
 #include "../exceptions.h"
 #include "../jthread/jmutex.h"
 #include "../jthread/jmutexautolock.h"
@@ -28,6 +29,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <list>
 #include <vector>
 #include <map>
+#include <cassert>
 
 /*
 	Queue with unique values with fast checking of value existence
@@ -390,5 +392,404 @@ class MutexedQueue
 	JSemaphore m_size;
 };
 
+/*
+	Map from u16 ids to values that stores the entries contiguously.
+	Lookup by id goes through a table covering every id, iteration walks
+	the entries in a vector. Erasing moves the last entry into the place
+	of the erased one, so the order of iteration is not the order of ids.
+
+	Iterators stay valid when entries are added (the new entries are
+	visited by loops that are still running), but not when erased.
+*/
+template<typename T>
+class DenseIdMap
+{
+public:
+	typedef std::pair<u16, T> value_type;
+
+	class iterator
+	{
+	public:
+		iterator():
+			m_map(NULL),
+			m_pos(0)
+		{
+		}
+		iterator(DenseIdMap *map, u32 pos):
+			m_map(map),
+			m_pos(pos)
+		{
+		}
+		value_type & operator*() const
+		{
+			return m_map->m_entries[m_pos];
+		}
+		value_type * operator->() const
+		{
+			return &m_map->m_entries[m_pos];
+		}
+		iterator & operator++()
+		{
+			m_pos++;
+			return *this;
+		}
+		iterator operator++(int)
+		{
+			iterator old = *this;
+			m_pos++;
+			return old;
+		}
+		bool operator==(const iterator &other) const
+		{
+			return m_pos == other.m_pos;
+		}
+		bool operator!=(const iterator &other) const
+		{
+			return m_pos != other.m_pos;
+		}
+	private:
+		DenseIdMap *m_map;
+		u32 m_pos;
+	};
+
+	DenseIdMap():
+		m_index(0x10000, INDEX_NONE)
+	{
+	}
+
+	u32 size() const
+	{
+		return m_entries.size();
+	}
+	bool empty() const
+	{
+		return m_entries.empty();
+	}
+
+	iterator begin()
+	{
+		return iterator(this, 0);
+	}
+	iterator end()
+	{
+		return iterator(this, m_entries.size());
+	}
+
+	iterator find(u16 id)
+	{
+		u16 pos = m_index[id];
+		if(pos == INDEX_NONE)
+			return end();
+		return iterator(this, pos);
+	}
+	u32 count(u16 id) const
+	{
+		return m_index[id] == INDEX_NONE ? 0 : 1;
+	}
+
+	// Inserts a default value if id is not in the map
+	T & operator[](u16 id)
+	{
+		u16 pos = m_index[id];
+		if(pos == INDEX_NONE){
+			pos = m_entries.size();
+			m_index[id] = pos;
+			m_entries.push_back(value_type(id, T()));
+		}
+		return m_entries[pos].second;
+	}
+
+	u32 erase(u16 id)
+	{
+		u16 pos = m_index[id];
+		if(pos == INDEX_NONE)
+			return 0;
+		if(pos != m_entries.size() - 1){
+			m_entries[pos] = m_entries.back();
+			m_index[m_entries[pos].first] = pos;
+		}
+		m_entries.pop_back();
+		m_index[id] = INDEX_NONE;
+		return 1;
+	}
+
+	void clear()
+	{
+		for(u32 i = 0; i < m_entries.size(); i++)
+			m_index[m_entries[i].first] = INDEX_NONE;
+		m_entries.clear();
+	}
+
+private:
+	// There are at most 0xffff entries since id 0 is never used either
+	enum { INDEX_NONE = 0xffff };
+
+	std::vector<u16> m_index;
+	std::vector<value_type> m_entries;
+};
+
+/*
+	Set of u16 ids as a bit for every id: 8 KiB whatever the count of
+	ids, with constant time insertion, erasure and lookup. Iteration goes
+	through the ids in increasing order and skips empty words at once.
+*/
+class DenseIdSet
+{
+public:
+	class const_iterator
+	{
+	public:
+		const_iterator():
+			m_set(NULL),
+			m_pos(END)
+		{
+		}
+		const_iterator(const DenseIdSet *set, u32 pos):
+			m_set(set),
+			m_pos(pos)
+		{
+		}
+		u16 operator*() const
+		{
+			return m_pos;
+		}
+		const_iterator & operator++()
+		{
+			m_pos = m_set->next(m_pos + 1);
+			return *this;
+		}
+		const_iterator operator++(int)
+		{
+			const_iterator old = *this;
+			++*this;
+			return old;
+		}
+		bool operator==(const const_iterator &other) const
+		{
+			return m_pos == other.m_pos;
+		}
+		bool operator!=(const const_iterator &other) const
+		{
+			return m_pos != other.m_pos;
+		}
+	private:
+		const DenseIdSet *m_set;
+		u32 m_pos;
+	};
+
+	DenseIdSet():
+		m_words(WORD_COUNT, 0),
+		m_count(0)
+	{
+	}
+
+	u32 size() const
+	{
+		return m_count;
+	}
+	bool empty() const
+	{
+		return m_count == 0;
+	}
+
+	const_iterator begin() const
+	{
+		return const_iterator(this, next(0));
+	}
+	const_iterator end() const
+	{
+		return const_iterator(this, END);
+	}
+
+	u32 count(u16 id) const
+	{
+		return (m_words[id >> 5] >> (id & 31)) & 1;
+	}
+
+	// Returns false if id was in the set already
+	bool insert(u16 id)
+	{
+		u32 bit = (u32)1 << (id & 31);
+		u32 &word = m_words[id >> 5];
+		if(word & bit)
+			return false;
+		word |= bit;
+		m_count++;
+		return true;
+	}
+
+	u32 erase(u16 id)
+	{
+		u32 bit = (u32)1 << (id & 31);
+		u32 &word = m_words[id >> 5];
+		if(!(word & bit))
+			return 0;
+		word &= ~bit;
+		m_count--;
+		return 1;
+	}
+
+	void clear()
+	{
+		if(m_count == 0)
+			return;
+		m_words.assign(WORD_COUNT, 0);
+		m_count = 0;
+	}
+
+private:
+	enum { END = 0x10000, WORD_COUNT = 0x10000 / 32 };
+
+	// The first id in the set from pos on, or END
+	u32 next(u32 pos) const
+	{
+		while(pos < END){
+			u32 word = m_words[pos >> 5] >> (pos & 31);
+			if(word == 0){
+				pos = (pos | 31) + 1;
+				continue;
+			}
+			while(!(word & 1)){
+				word >>= 1;
+				pos++;
+			}
+			return pos;
+		}
+		return END;
+	}
+
+	std::vector<u32> m_words;
+	u32 m_count;
+};
+
+/*
+	Hash table of pointers by v3s16, with open addressing and linear
+	probing.  A lookup of a position that is in the table usually takes
+	one probe.  NULL can't be stored; it is returned for positions that
+	are not in the table.
+*/
+template<typename T>
+class V3s16PtrHashMap
+{
+public:
+	V3s16PtrHashMap():
+		m_size(0)
+	{
+		resize(64);
+	}
+
+	T *get(v3s16 p) const
+	{
+		u64 key = packKey(p);
+		for(u32 i = slot(key);; i = (i + 1) & m_mask){
+			if(m_values[i] == NULL)
+				return NULL;
+			if(m_keys[i] == key)
+				return m_values[i];
+		}
+	}
+
+	// Replaces the old value of p if there is one
+	void set(v3s16 p, T *value)
+	{
+		assert(value != NULL);
+		// Kept at most half full, so that the probe sequences stay short
+		if((m_size + 1) * 2 > m_keys.size())
+			resize(m_keys.size() * 2);
+
+		u64 key = packKey(p);
+		u32 i = slot(key);
+		while(m_values[i] != NULL && m_keys[i] != key)
+			i = (i + 1) & m_mask;
+		if(m_values[i] == NULL)
+			m_size++;
+		m_keys[i] = key;
+		m_values[i] = value;
+	}
+
+	// Returns false if p was not in the table
+	bool remove(v3s16 p)
+	{
+		u64 key = packKey(p);
+		u32 i = slot(key);
+		for(;; i = (i + 1) & m_mask){
+			if(m_values[i] == NULL)
+				return false;
+			if(m_keys[i] == key)
+				break;
+		}
+
+		// Move back the entries after it that would not be found anymore
+		// with the hole, instead of leaving a tombstone
+		u32 hole = i;
+		for(u32 j = (i + 1) & m_mask; m_values[j] != NULL;
+				j = (j + 1) & m_mask){
+			u32 home = slot(m_keys[j]);
+			// Can the entry at j stay, ie. is its home in (hole, j]?
+			if(((j - home) & m_mask) < ((j - hole) & m_mask))
+				continue;
+			m_keys[hole] = m_keys[j];
+			m_values[hole] = m_values[j];
+			hole = j;
+		}
+		m_values[hole] = NULL;
+		m_size--;
+		return true;
+	}
+
+	u32 size() const
+	{
+		return m_size;
+	}
+
+	void clear()
+	{
+		m_keys.clear();
+		m_values.clear();
+		resize(64);
+	}
+
+private:
+	static u64 packKey(v3s16 p)
+	{
+		return (u64)(u16)p.X | ((u64)(u16)p.Y << 16) | ((u64)(u16)p.Z << 32);
+	}
+
+	u32 slot(u64 key) const
+	{
+		// Fibonacci hashing; the high bits are mixed from all the key
+		return (u32)((key * 0x9E3779B97F4A7C15ULL) >> 32) & m_mask;
+	}
+
+	void resize(u32 capacity)
+	{
+		std::vector<u64> keys;
+		std::vector<T*> values;
+		keys.swap(m_keys);
+		values.swap(m_values);
+
+		m_keys.resize(capacity, 0);
+		m_values.resize(capacity, NULL);
+		m_mask = capacity - 1;
+		m_size = 0;
+
+		for(u32 i = 0; i < keys.size(); i++){
+			if(values[i] == NULL)
+				continue;
+			u32 j = slot(keys[i]);
+			while(m_values[j] != NULL)
+				j = (j + 1) & m_mask;
+			m_keys[j] = keys[i];
+			m_values[j] = values[i];
+			m_size++;
+		}
+	}
+
+	std::vector<u64> m_keys;
+	std::vector<T*> m_values;
+	u32 m_mask;
+	u32 m_size;
+};
+
 #endif
 
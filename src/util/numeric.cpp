@@ -201,45 +201,57 @@ bool isBlockInSight(v3s16 blockpos_b, v3f camera_pos, v3f camera_dir,
 			((float)blockpos_nodes.Z + MAP_BLOCKSIZE/2) * BS
 	);
 
-	// Block position relative to camera
-	v3f blockpos_relative = blockpos - camera_pos;
+	// Maximum radius of a block.  The magic number is
+	// sqrt(3.0) / 2.0 in literal form.
+	f32 block_max_radius = 0.866025403784 * MAP_BLOCKSIZE * BS;
+
+	return isSphereInSight(blockpos, block_max_radius, camera_pos,
+			camera_dir, camera_fov, range, distance_ptr);
+}
+
+/*
+	center: center of the sphere in nodes * BS
+	radius: radius of the sphere in nodes * BS
+	range: the farthest the center can be
+*/
+bool isSphereInSight(v3f center, f32 radius, v3f camera_pos, v3f camera_dir,
+		f32 camera_fov, f32 range, f32 *distance_ptr)
+{
+	// Sphere position relative to camera
+	v3f center_relative = center - camera_pos;
 
 	// Total distance
-	f32 d = blockpos_relative.getLength();
+	f32 d = center_relative.getLength();
 
 	if(distance_ptr)
 		*distance_ptr = d;
 	
-	// If block is far away, it's not in sight
+	// If sphere is far away, it's not in sight
 	if(d > range)
 		return false;
 
-	// Maximum radius of a block.  The magic number is
-	// sqrt(3.0) / 2.0 in literal form.
-	f32 block_max_radius = 0.866025403784 * MAP_BLOCKSIZE * BS;
-	
-	// If block is (nearly) touching the camera, don't
+	// If sphere is (nearly) touching the camera, don't
 	// bother validating further (that is, render it anyway)
-	if(d < block_max_radius)
+	if(d < radius)
 		return true;
 
 	// Adjust camera position, for purposes of computing the angle,
-	// such that a block that has any portion visible with the
+	// such that a sphere that has any portion visible with the
 	// current camera position will have the center visible at the
 	// adjusted postion
-	f32 adjdist = block_max_radius / cos((M_PI - camera_fov) / 2);
+	f32 adjdist = radius / cos((M_PI - camera_fov) / 2);
 
-	// Block position relative to adjusted camera
-	v3f blockpos_adj = blockpos - (camera_pos - camera_dir * adjdist);
+	// Sphere position relative to adjusted camera
+	v3f center_adj = center - (camera_pos - camera_dir * adjdist);
 
 	// Distance in camera direction (+=front, -=back)
-	f32 dforward = blockpos_adj.dotProduct(camera_dir);
+	f32 dforward = center_adj.dotProduct(camera_dir);
 
 	// Cosine of the angle between the camera direction
-	// and the block direction (camera_dir is an unit vector)
-	f32 cosangle = dforward / blockpos_adj.getLength();
+	// and the sphere direction (camera_dir is an unit vector)
+	f32 cosangle = dforward / center_adj.getLength();
 	
-	// If block is not in the field of view, skip it
+	// If sphere is not in the field of view, skip it
 	if(cosangle < cos(camera_fov / 2))
 		return false;
 
@@ -252,6 +252,17 @@ class SharedBuffer
 		refcount = new unsigned int;
 		(*refcount) = 1;
 	}
+	/*
+		Takes the ownership of data, which must have been allocated
+		with new[] and may be longer than size
+	*/
+	static SharedBuffer<T> adopt(T *data, unsigned int size)
+	{
+		SharedBuffer<T> buffer;
+		buffer.data = data;
+		buffer.m_size = size;
+		return buffer;
+	}
 	~SharedBuffer()
 	{
 		drop();
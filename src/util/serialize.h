@@ -22,6 +22,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "../irrlichttypes_bloated.h"
 #include "config.h"
+#include "pointer.h"
+#include "../exceptions.h"
 #if HAVE_ENDIAN_H
 #include <endian.h>
 #include <string.h> // for memcpy
@@ -460,5 +462,163 @@ bool serializeStructToString(std::string *out,
 bool deSerializeStringToStruct(std::string valstr,
 	std::string format, void *out, size_t olen);
 
-#endif
+/*
+	Growable buffer for building packets without an ostringstream.  The
+	values are written straight into the storage, which is then handed
+	over to a SharedBuffer without copying.  Same byte order as above.
+*/
+class BufferWriter
+{
+public:
+	BufferWriter(u32 capacity = 64):
+		m_data(NULL),
+		m_size(0),
+		m_capacity(0)
+	{
+		reserve(capacity);
+	}
+	~BufferWriter()
+	{
+		delete[] m_data;
+	}
+
+	void reserve(u32 capacity)
+	{
+		if(capacity <= m_capacity)
+			return;
+		u8 *data = new u8[capacity];
+		if(m_size != 0)
+			memcpy(data, m_data, m_size);
+		delete[] m_data;
+		m_data = data;
+		m_capacity = capacity;
+	}
+	u32 getSize() const
+	{
+		return m_size;
+	}
+
+	void writeU8(u8 i) { ::writeU8(grow(1), i); }
+	void writeU16(u16 i) { ::writeU16(grow(2), i); }
+	void writeU32(u32 i) { ::writeU32(grow(4), i); }
+	void writeS16(s16 i) { ::writeS16(grow(2), i); }
+	void writeS32(s32 i) { ::writeS32(grow(4), i); }
+	void writeF1000(f32 i) { ::writeF1000(grow(4), i); }
+	void writeV2S16(v2s16 p) { ::writeV2S16(grow(4), p); }
+	void writeV3S16(v3s16 p) { ::writeV3S16(grow(6), p); }
+	void writeV3F1000(v3f p) { ::writeV3F1000(grow(12), p); }
+
+	void writeRaw(const void *data, u32 size)
+	{
+		if(size != 0)
+			memcpy(grow(size), data, size);
+	}
+	void writeRaw(const std::string &s)
+	{
+		writeRaw(s.c_str(), s.size());
+	}
+	// Same format as serializeString()
+	void writeString(const std::string &s)
+	{
+		if(s.size() > 65535)
+			throw SerializationError("String too long for writeString");
+		writeU16(s.size());
+		writeRaw(s);
+	}
+	// Same format as serializeLongString()
+	void writeLongString(const std::string &s)
+	{
+		writeU32(s.size());
+		writeRaw(s);
+	}
+
+	// Leaves the writer empty
+	SharedBuffer<u8> takeSharedBuffer()
+	{
+		SharedBuffer<u8> buffer = SharedBuffer<u8>::adopt(m_data, m_size);
+		m_data = NULL;
+		m_size = 0;
+		m_capacity = 0;
+		return buffer;
+	}
+
+private:
+	u8 *grow(u32 size)
+	{
+		if(m_size + size > m_capacity)
+			reserve(m_size + size > m_capacity * 2 ?
+					m_size + size : m_capacity * 2);
+		u8 *p = &m_data[m_size];
+		m_size += size;
+		return p;
+	}
+
+	u8 *m_data;
+	u32 m_size;
+	u32 m_capacity;
+
+	BufferWriter(const BufferWriter &);
+	BufferWriter &operator=(const BufferWriter &);
+};
 
+/*
+	Reads the values written by BufferWriter from a buffer that is not
+	owned by the reader.  Throws SerializationError instead of reading
+	past the end.
+*/
+class BufferReader
+{
+public:
+	BufferReader(const u8 *data, u32 size):
+		m_data(data),
+		m_size(size),
+		m_pos(0)
+	{
+	}
+
+	u32 getRemaining() const
+	{
+		return m_size - m_pos;
+	}
+
+	u8 readU8() { return ::readU8(take(1)); }
+	u16 readU16() { return ::readU16(take(2)); }
+	u32 readU32() { return ::readU32(take(4)); }
+	s16 readS16() { return ::readS16(take(2)); }
+	s32 readS32() { return ::readS32(take(4)); }
+	f32 readF1000() { return ::readF1000(take(4)); }
+	v2s16 readV2S16() { return ::readV2S16(take(4)); }
+	v3s16 readV3S16() { return ::readV3S16(take(6)); }
+	v3f readV3F1000() { return ::readV3F1000(take(12)); }
+
+	std::string readRaw(u32 size)
+	{
+		return std::string((const char*)take(size), size);
+	}
+	// Reads what BufferWriter::writeString() wrote
+	std::string readString()
+	{
+		return readRaw(readU16());
+	}
+	// Reads what BufferWriter::writeLongString() wrote
+	std::string readLongString()
+	{
+		return readRaw(readU32());
+	}
+
+private:
+	const u8 *take(u32 size)
+	{
+		if(size > m_size - m_pos)
+			throw SerializationError("BufferReader: data is too short");
+		const u8 *p = &m_data[m_pos];
+		m_pos += size;
+		return p;
+	}
+
+	const u8 *m_data;
+	u32 m_size;
+	u32 m_pos;
+};
+
+#endif
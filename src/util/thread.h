@@ -24,7 +24,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../jthread/jthread.h"
 #include "../jthread/jmutex.h"
 #include "../jthread/jmutexautolock.h"
+#include "../jthread/jsemaphore.h"
 #include "porting.h"
+#include "../threads.h"
+#include <map>
 
 template<typename T>
 class MutexedVariable
@@ -60,6 +63,94 @@ class MutexedVariable
 	JMutex m_mutex;
 };
 
+/*
+	A lock held either by any number of readers or by one writer.
+
+	A waiting writer keeps new readers out, so that a steady stream of
+	readers can't starve it.  It isn't recursive: a thread holding it in
+	any way mustn't lock it again.  The room is a semaphore and not a
+	mutex because the reader leaving it last isn't always the one that
+	entered it first.
+*/
+class RWMutex
+{
+public:
+	RWMutex():
+		m_readers(0),
+		m_room(1)
+	{
+	}
+
+	void ReadLock()
+	{
+		JMutexAutoLock gatelock(m_gate);
+		JMutexAutoLock lock(m_readers_mutex);
+		if(m_readers++ == 0)
+			m_room.Wait();
+	}
+
+	void ReadUnlock()
+	{
+		JMutexAutoLock lock(m_readers_mutex);
+		if(--m_readers == 0)
+			m_room.Post();
+	}
+
+	void WriteLock()
+	{
+		m_gate.Lock();
+		m_room.Wait();
+	}
+
+	void WriteUnlock()
+	{
+		m_room.Post();
+		m_gate.Unlock();
+	}
+
+private:
+	// Held by a writer from the moment it starts waiting
+	JMutex m_gate;
+	JMutex m_readers_mutex;
+	u32 m_readers;
+	// Free when neither readers nor a writer are in
+	JSemaphore m_room;
+};
+
+class RWMutexReadLock
+{
+public:
+	RWMutexReadLock(RWMutex &mutex):
+		m_mutex(mutex)
+	{
+		m_mutex.ReadLock();
+	}
+	~RWMutexReadLock()
+	{
+		m_mutex.ReadUnlock();
+	}
+
+private:
+	RWMutex &m_mutex;
+};
+
+class RWMutexWriteLock
+{
+public:
+	RWMutexWriteLock(RWMutex &mutex):
+		m_mutex(mutex)
+	{
+		m_mutex.WriteLock();
+	}
+	~RWMutexWriteLock()
+	{
+		m_mutex.WriteUnlock();
+	}
+
+private:
+	RWMutex &m_mutex;
+};
+
 /*
 	A single worker thread - multiple client threads queue framework.
 */
@@ -77,6 +168,40 @@ class ResultQueue: public MutexedQueue< GetResult<Key, T, Caller, CallerData> >
 {
 };
 
+/*
+	A ResultQueue for each thread asking for results, so that threads
+	waiting at the same time don't take each other's results.  The queues
+	live as long as this, so a result arriving after its caller gave up
+	waiting doesn't go to a freed queue.
+*/
+template<typename Key, typename T, typename Caller, typename CallerData>
+class ThreadResultQueues
+{
+public:
+	~ThreadResultQueues()
+	{
+		for(typename std::map<threadid_t,
+				ResultQueue<Key, T, Caller, CallerData>*>::iterator
+				i = m_queues.begin(); i != m_queues.end(); ++i)
+			delete i->second;
+	}
+
+	// The queue of the calling thread
+	ResultQueue<Key, T, Caller, CallerData> *get()
+	{
+		JMutexAutoLock lock(m_mutex);
+		ResultQueue<Key, T, Caller, CallerData> *&queue =
+				m_queues[get_current_thread_id()];
+		if(queue == NULL)
+			queue = new ResultQueue<Key, T, Caller, CallerData>;
+		return queue;
+	}
+
+private:
+	std::map<threadid_t, ResultQueue<Key, T, Caller, CallerData>*> m_queues;
+	JMutex m_mutex;
+};
+
 template<typename Caller, typename Data, typename Key, typename T>
 class CallerInfo
 {
@@ -128,7 +253,9 @@ class RequestQueue
 			JMutexAutoLock lock(m_queue.getMutex());
 
 			/*
-				If the caller is already on the list, only update CallerData
+				If the caller is already on the list, only update CallerData;
+				callers are told apart by dest too, since threads asking
+				for the same key can all pass the same caller
 			*/
 			for(typename std::list< GetRequest<Key, T, Caller, CallerData> >::iterator
 					i = m_queue.getList().begin();
@@ -143,7 +270,7 @@ class RequestQueue
 							i != request.callers.end(); ++i)
 					{
 						CallerInfo<Caller, CallerData, Key, T> &ca = *i;
-						if(ca.caller == caller)
+						if(ca.caller == caller && ca.dest == dest)
 						{
 							ca.data = callerdata;
 							return;
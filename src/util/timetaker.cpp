@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "../gettime.h"
 #include "../log.h"
+#include "../profiler.h"
 #include <ostream>
 
 TimeTaker::TimeTaker(const char *name, u32 *result, TimePrecision prec)
@@ -30,6 +31,9 @@ TimeTaker::TimeTaker(const char *name, u32 *result, TimePrecision prec)
 	m_running = true;
 	m_precision = prec;
 	m_time1 = getTime(prec);
+	m_trace = profiler_trace_enabled();
+	if(m_trace)
+		m_trace_start_us = getTime(PRECISION_MICRO);
 }
 
 u32 TimeTaker::stop(bool quiet)
@@ -38,6 +42,11 @@ u32 TimeTaker::stop(bool quiet)
 	{
 		u32 time2 = getTime(m_precision);
 		u32 dtime = time2 - m_time1;
+		if(m_trace)
+		{
+			profiler_trace_record(m_name, m_trace_start_us,
+					getTime(PRECISION_MICRO) - m_trace_start_us);
+		}
 		if(m_result != NULL)
 		{
 			(*m_result) += dtime;
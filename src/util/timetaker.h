@@ -48,6 +48,9 @@ class TimeTaker
 	bool m_running;
 	TimePrecision m_precision;
 	u32 *m_result;
+	// Set if the profiler trace is enabled
+	bool m_trace;
+	u32 m_trace_start_us;
 };
 
 #endif
@@ -22,7 +22,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gettime.h"
 #include "nodedef.h"
 #include "util/timetaker.h"
+#include "util/directiontables.h"
+#include "util/numeric.h"
 #include <string.h>  // memcpy, memset
+#include <algorithm> // std::swap
+#include <vector>
 
 /*
 	Debug stuff
@@ -37,31 +41,103 @@ u32 updateareawaterpressure_time = 0;
 u32 flowwater_pre_time = 0;
 
 
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+/*
+	The buffers of the VoxelManipulators a thread has cleared, kept for its
+	next ones. Mapgen and the Lua VoxelManips emerge areas of the same size
+	over and over, so a buffer is nearly always there to be taken instead
+	of allocated.
+*/
+
+// Most buffers kept by each thread
+#define VOXEL_BUFFER_POOL_MAX 2
+
+struct VoxelBuffer
+{
+	u32 capacity;
+	MapNode *data;
+	u8 *flags;
+};
+
+static THREAD_LOCAL std::vector<VoxelBuffer> *t_voxel_buffers = NULL;
+
+// Takes the smallest kept buffer with room for volume nodes, or allocates
+static VoxelBuffer takeVoxelBuffer(u32 volume)
+{
+	if(t_voxel_buffers == NULL)
+		t_voxel_buffers = new std::vector<VoxelBuffer>;
+	std::vector<VoxelBuffer> &pool = *t_voxel_buffers;
+
+	s32 best = -1;
+	for(u32 i = 0; i < pool.size(); i++){
+		if(pool[i].capacity >= volume && (best == -1 ||
+				pool[i].capacity < pool[best].capacity))
+			best = i;
+	}
+	if(best != -1){
+		VoxelBuffer buf = pool[best];
+		pool.erase(pool.begin() + best);
+		return buf;
+	}
+
+	VoxelBuffer buf;
+	buf.capacity = volume;
+	buf.data = new MapNode[volume];
+	buf.flags = new u8[volume];
+	return buf;
+}
+
+// Keeps the buffer for the thread, in place of the smallest one if full
+static void giveVoxelBuffer(const VoxelBuffer &buf)
+{
+	if(t_voxel_buffers == NULL)
+		t_voxel_buffers = new std::vector<VoxelBuffer>;
+	std::vector<VoxelBuffer> &pool = *t_voxel_buffers;
+
+	VoxelBuffer dropped = buf;
+	if(pool.size() < VOXEL_BUFFER_POOL_MAX){
+		pool.push_back(buf);
+		return;
+	}
+	for(u32 i = 0; i < pool.size(); i++){
+		if(pool[i].capacity < dropped.capacity)
+			std::swap(pool[i], dropped);
+	}
+	delete[] dropped.data;
+	delete[] dropped.flags;
+}
+
 VoxelManipulator::VoxelManipulator():
 	m_data(NULL),
-	m_flags(NULL)
+	m_flags(NULL),
+	m_capacity(0)
 {
 }
 
 VoxelManipulator::~VoxelManipulator()
 {
 	clear();
-	if(m_data)
-		delete[] m_data;
-	if(m_flags)
-		delete[] m_flags;
 }
 
 void VoxelManipulator::clear()
 {
 	// Reset area to volume=0
 	m_area = VoxelArea();
-	if(m_data)
-		delete[] m_data;
+	if(m_data){
+		VoxelBuffer buf;
+		buf.capacity = m_capacity;
+		buf.data = m_data;
+		buf.flags = m_flags;
+		giveVoxelBuffer(buf);
+	}
 	m_data = NULL;
-	if(m_flags)
-		delete[] m_flags;
 	m_flags = NULL;
+	m_capacity = 0;
 }
 
 void VoxelManipulator::print(std::ostream &o, INodeDefManager *ndef,
@@ -179,11 +255,11 @@ void VoxelManipulator::addArea(const VoxelArea &area)
 	dstream<<", new_size="<<new_size;
 	dstream<<std::endl;*/
 
-	// Allocate and clear new data
-	MapNode *new_data = new MapNode[new_size];
-	assert(new_data);
-	u8 *new_flags = new u8[new_size];
-	assert(new_flags);
+	// Take and clear new data; the nodes are left as they were, as they
+	// are all flagged as having no data
+	VoxelBuffer new_buf = takeVoxelBuffer(new_size);
+	MapNode *new_data = new_buf.data;
+	u8 *new_flags = new_buf.flags;
 	memset(new_flags, VOXELFLAG_NO_DATA, new_size);
 
 	// Copy old data
@@ -200,23 +276,20 @@ void VoxelManipulator::addArea(const VoxelArea &area)
 				old_x_width * sizeof(u8));
 	}
 
-	// Replace area, data and flags
+	// Replace area, data and flags; the old ones go back to the pool
 
-	m_area = new_area;
-
-	MapNode *old_data = m_data;
-	u8 *old_flags = m_flags;
-
-	/*dstream<<"old_data="<<(int)old_data<<", new_data="<<(int)new_data
-	<<", old_flags="<<(int)m_flags<<", new_flags="<<(int)new_flags<<std::endl;*/
+	if(m_data){
+		VoxelBuffer old_buf;
+		old_buf.capacity = m_capacity;
+		old_buf.data = m_data;
+		old_buf.flags = m_flags;
+		giveVoxelBuffer(old_buf);
+	}
 
+	m_area = new_area;
 	m_data = new_data;
 	m_flags = new_flags;
-
-	if(old_data)
-		delete[] old_data;
-	if(old_flags)
-		delete[] old_flags;
+	m_capacity = new_buf.capacity;
 
 	//dstream<<"addArea done"<<std::endl;
 }
@@ -250,6 +323,9 @@ void VoxelManipulator::copyFrom(MapNode *src, const VoxelArea& src_area,
 	 */
 
 	s32 src_step = src_area.getExtent().X;
+	s32 src_mod = src_area.index(from_pos.X, from_pos.Y, from_pos.Z + 1)
+			- src_area.index(from_pos.X, from_pos.Y, from_pos.Z)
+			- src_step * size.Y;
 	s32 dest_step = m_area.getExtent().X;
 	s32 dest_mod = m_area.index(to_pos.X, to_pos.Y, to_pos.Z + 1)
 			- m_area.index(to_pos.X, to_pos.Y, to_pos.Z)
@@ -258,13 +334,32 @@ void VoxelManipulator::copyFrom(MapNode *src, const VoxelArea& src_area,
 	s32 i_src = src_area.index(from_pos.X, from_pos.Y, from_pos.Z);
 	s32 i_local = m_area.index(to_pos.X, to_pos.Y, to_pos.Z);
 
-	for (s16 z = 0; z < size.Z; z++) {
-		for (s16 y = 0; y < size.Y; y++) {
-			memcpy(&m_data[i_local], &src[i_src], size.X * sizeof(*m_data));
-			memset(&m_flags[i_local], 0, size.X);
+	/* When the rows are as wide as both areas, they follow each other and
+	 * a whole z plane is copied at once; when the planes are too, the
+	 * whole volume is.
+	 */
+	s32 run_length = size.X;
+	s32 runs = size.Y;
+	s32 planes = size.Z;
+	if (size.X == src_step && size.X == dest_step) {
+		run_length = size.X * size.Y;
+		src_step = dest_step = run_length;
+		runs = 1;
+		if (src_mod == 0 && dest_mod == 0) {
+			run_length *= size.Z;
+			planes = 1;
+		}
+	}
+
+	for (s32 z = 0; z < planes; z++) {
+		for (s32 y = 0; y < runs; y++) {
+			memcpy(&m_data[i_local], &src[i_src],
+					run_length * sizeof(*m_data));
+			memset(&m_flags[i_local], 0, run_length);
 			i_src += src_step;
 			i_local += dest_step;
 		}
+		i_src += src_mod;
 		i_local += dest_mod;
 	}
 }
@@ -272,17 +367,41 @@ void VoxelManipulator::copyFrom(MapNode *src, const VoxelArea& src_area,
 void VoxelManipulator::copyTo(MapNode *dst, const VoxelArea& dst_area,
 		v3s16 dst_pos, v3s16 from_pos, v3s16 size)
 {
-	for(s16 z=0; z<size.Z; z++)
-	for(s16 y=0; y<size.Y; y++)
-	{
-		s32 i_dst = dst_area.index(dst_pos.X, dst_pos.Y+y, dst_pos.Z+z);
-		s32 i_local = m_area.index(from_pos.X, from_pos.Y+y, from_pos.Z+z);
-		for (s16 x = 0; x < size.X; x++) {
-			if (m_data[i_local].getContent() != CONTENT_IGNORE)
-				dst[i_dst] = m_data[i_local];
-			i_dst++;
-			i_local++;
+	// The same stepping of the indices as in copyFrom()
+	s32 dst_step = dst_area.getExtent().X;
+	s32 dst_mod = dst_area.index(dst_pos.X, dst_pos.Y, dst_pos.Z + 1)
+			- dst_area.index(dst_pos.X, dst_pos.Y, dst_pos.Z)
+			- dst_step * size.Y;
+	s32 local_step = m_area.getExtent().X;
+	s32 local_mod = m_area.index(from_pos.X, from_pos.Y, from_pos.Z + 1)
+			- m_area.index(from_pos.X, from_pos.Y, from_pos.Z)
+			- local_step * size.Y;
+
+	s32 i_dst = dst_area.index(dst_pos.X, dst_pos.Y, dst_pos.Z);
+	s32 i_local = m_area.index(from_pos.X, from_pos.Y, from_pos.Z);
+
+	for (s16 z = 0; z < size.Z; z++) {
+		for (s16 y = 0; y < size.Y; y++) {
+			const MapNode *row = &m_data[i_local];
+			MapNode *dst_row = &dst[i_dst];
+			// Nearly all rows have no ignore and are copied at once
+			s16 x = 0;
+			while (x < size.X && row[x].getContent() != CONTENT_IGNORE)
+				x++;
+			if (x == size.X) {
+				memcpy(dst_row, row, size.X * sizeof(*dst));
+			} else {
+				memcpy(dst_row, row, x * sizeof(*dst));
+				for (; x < size.X; x++) {
+					if (row[x].getContent() != CONTENT_IGNORE)
+						dst_row[x] = row[x];
+				}
+			}
+			i_dst += dst_step;
+			i_local += local_step;
 		}
+		i_dst += dst_mod;
+		i_local += local_mod;
 	}
 }
 
@@ -336,71 +455,13 @@ void VoxelManipulator::clearFlag(u8 flags)
 void VoxelManipulator::unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
 		std::set<v3s16> & light_sources, INodeDefManager *nodemgr)
 {
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	VoxelArea voxel_area(p - v3s16(1,1,1), p + v3s16(1,1,1));
-	addArea(voxel_area);
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-
-		/*
-			If the neighbor is dimmer than what was specified
-			as oldlight (the light of the previous node)
-		*/
-		u8 light2 = n2.getLight(bank, nodemgr);
-		if(light2 < oldlight)
-		{
-			/*
-				And the neighbor is transparent and it has some light
-			*/
-			if(nodemgr->get(n2).light_propagates && light2 != 0)
-			{
-				/*
-					Set light to 0 and add to queue
-				*/
-
-				n2.setLight(bank, 0, nodemgr);
-
-				unspreadLight(bank, n2pos, light2, light_sources, nodemgr);
-
-				/*
-					Remove from light_sources if it is there
-					NOTE: This doesn't happen nearly at all
-				*/
-				/*if(light_sources.find(n2pos))
-				{
-					std::cout<<"Removed from light_sources"<<std::endl;
-					light_sources.remove(n2pos);
-				}*/
-			}
-		}
-		else{
-			light_sources.insert(n2pos);
-		}
-	}
+	std::map<v3s16, u8> from_nodes;
+	from_nodes[p] = oldlight;
+	unspreadLight(bank, from_nodes, light_sources, nodemgr);
 }
 
-#if 1
 /*
-	Goes recursively through the neighbours of the node.
+	Goes through the neighbours of the nodes, breadth first.
 
 	Alters only transparent nodes.
 
@@ -415,6 +476,8 @@ void VoxelManipulator::unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
 	light_sources to re-light the area without the removed light.
 
 	values of from_nodes are lighting values.
+
+	Nodes outside of the area are left alone.
 */
 void VoxelManipulator::unspreadLight(enum LightBank bank,
 		std::map<v3s16, u8> & from_nodes,
@@ -423,67 +486,22 @@ void VoxelManipulator::unspreadLight(enum LightBank bank,
 	if(from_nodes.size() == 0)
 		return;
 
-	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
-	{
-		unspreadLight(bank, j->first, j->second, light_sources, nodemgr);
-	}
-}
-#endif
-
-#if 0
-/*
-	Goes recursively through the neighbours of the node.
+	// The nodes that were set to 0 and the light they had
+	std::vector<std::pair<v3s16, u8> > queue(from_nodes.begin(),
+			from_nodes.end());
 
-	Alters only transparent nodes.
-
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
-
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
-
-	values of from_nodes are lighting values.
-*/
-void VoxelManipulator::unspreadLight(enum LightBank bank,
-		core::map<v3s16, u8> & from_nodes,
-		core::map<v3s16, bool> & light_sources)
-{
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.size() == 0)
-		return;
-
-	core::map<v3s16, u8> unlighted_nodes;
-	core::map<v3s16, u8>::Iterator j;
-	j = from_nodes.getIterator();
-
-	for(; j.atEnd() == false; j++)
+	for(size_t j = 0; j != queue.size(); j++)
 	{
-		v3s16 pos = j.getNode()->getKey();
-
-		addArea(VoxelArea(pos - v3s16(1,1,1), pos + v3s16(1,1,1)));
-
-		//MapNode &n = m_data[m_area.index(pos)];
-
-		u8 oldlight = j.getNode()->getValue();
+		v3s16 pos = queue[j].first;
+		u8 oldlight = queue[j].second;
 
 		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
+		for(u16 d=0; d<6; d++)
 		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
+			v3s16 n2pos = pos + g_6dirs[d];
+			if(!m_area.contains(n2pos))
+				continue;
 
 			u32 n2i = m_area.index(n2pos);
 
@@ -496,232 +514,129 @@ void VoxelManipulator::unspreadLight(enum LightBank bank,
 				If the neighbor is dimmer than what was specified
 				as oldlight (the light of the previous node)
 			*/
-			if(n2.getLight(bank, nodemgr) < oldlight)
+			u8 light2 = n2.getLight(bank, nodemgr);
+			if(light2 >= oldlight)
 			{
-				/*
-					And the neighbor is transparent and it has some light
-				*/
-				if(nodemgr->get(n2).light_propagates && n2.getLight(bank, nodemgr) != 0)
-				{
-					/*
-						Set light to 0 and add to queue
-					*/
-
-					u8 current_light = n2.getLight(bank, nodemgr);
-					n2.setLight(bank, 0);
+				light_sources.insert(n2pos);
+				continue;
+			}
 
-					unlighted_nodes.insert(n2pos, current_light);
+			/*
+				And the neighbor is transparent and it has some light
+			*/
+			if(light2 == 0 || !nodemgr->get(n2).light_propagates)
+				continue;
 
-					/*
-						Remove from light_sources if it is there
-						NOTE: This doesn't happen nearly at all
-					*/
-					/*if(light_sources.find(n2pos))
-					{
-						std::cout<<"Removed from light_sources"<<std::endl;
-						light_sources.remove(n2pos);
-					}*/
-				}
-			}
-			else{
-				light_sources.insert(n2pos, true);
-			}
+			/*
+				Set light to 0 and add to queue
+			*/
+			n2.setLight(bank, 0, nodemgr);
+			queue.push_back(std::make_pair(n2pos, light2));
 		}
 	}
-
-	/*dstream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources);
 }
-#endif
 
 void VoxelManipulator::spreadLight(enum LightBank bank, v3s16 p,
 		INodeDefManager *nodemgr)
 {
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	VoxelArea voxel_area(p - v3s16(1,1,1), p + v3s16(1,1,1));
-	addArea(voxel_area);
-
-	u32 i = m_area.index(p);
-
-	if(m_flags[i] & VOXELFLAG_NO_DATA)
-		return;
-
-	MapNode &n = m_data[i];
-
-	u8 oldlight = n.getLight(bank, nodemgr);
-	u8 newlight = diminish_light(oldlight);
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-
-		u8 light2 = n2.getLight(bank, nodemgr);
-
-		/*
-			If the neighbor is brighter than the current node,
-			add to list (it will light up this node on its turn)
-		*/
-		if(light2 > undiminish_light(oldlight))
-		{
-			spreadLight(bank, n2pos, nodemgr);
-		}
-		/*
-			If the neighbor is dimmer than how much light this node
-			would spread on it, add to list
-		*/
-		if(light2 < newlight)
-		{
-			if(nodemgr->get(n2).light_propagates)
-			{
-				n2.setLight(bank, newlight, nodemgr);
-				spreadLight(bank, n2pos, nodemgr);
-			}
-		}
-	}
+	std::set<v3s16> from_nodes;
+	from_nodes.insert(p);
+	spreadLight(bank, from_nodes, nodemgr);
 }
 
-#if 0
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	Lights neighbors of from_nodes and goes on with the lighted ones.
 
-	NOTE: This is faster on small areas but will overflow the
-	      stack on large areas. Thus it is not used.
-*/
-void VoxelManipulator::spreadLight(enum LightBank bank,
-		core::map<v3s16, bool> & from_nodes)
-{
-	if(from_nodes.size() == 0)
-		return;
-
-	core::map<v3s16, bool> lighted_nodes;
-	core::map<v3s16, bool>::Iterator j;
-	j = from_nodes.getIterator();
+	The nodes to go on with are kept in a queue for each light level,
+	and the brightest ones are taken first, like in Map::spreadLight().
 
-	for(; j.atEnd() == false; j++)
-	{
-		v3s16 pos = j.getNode()->getKey();
-
-		spreadLight(bank, pos);
-	}
-}
-#endif
-
-#if 1
-/*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	Nodes outside of the area are left alone.
 */
 void VoxelManipulator::spreadLight(enum LightBank bank,
 		std::set<v3s16> & from_nodes, INodeDefManager *nodemgr)
 {
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
 	if(from_nodes.size() == 0)
 		return;
 
-	std::set<v3s16> lighted_nodes;
+	// The queues, indexed by the light the nodes had when queued
+	std::vector<v3s16> queues[LIGHT_SUN + 1];
+	// Brighter neighbors found on the way; these are queued only once
+	std::set<v3s16> found_sources;
 
 	for(std::set<v3s16>::iterator j = from_nodes.begin();
 		j != from_nodes.end(); ++j)
 	{
-		v3s16 pos = *j;
+		if(!m_area.contains(*j))
+			continue;
+		u32 i = m_area.index(*j);
+		if(m_flags[i] & VOXELFLAG_NO_DATA)
+			continue;
+		queues[m_data[i].getLight(bank, nodemgr)].push_back(*j);
+	}
 
-		VoxelArea voxel_area(pos - v3s16(1,1,1), pos + v3s16(1,1,1));
-		addArea(voxel_area);
+	s16 level = LIGHT_SUN;
+	while(level >= 0)
+	{
+		if(queues[level].empty())
+		{
+			level--;
+			continue;
+		}
 
+		v3s16 pos = queues[level].back();
+		queues[level].pop_back();
 		u32 i = m_area.index(pos);
 
-		if(m_flags[i] & VOXELFLAG_NO_DATA)
+		u8 oldlight = m_data[i].getLight(bank, nodemgr);
+		// Got brighter after it was queued; it is queued again for that
+		if(oldlight > level)
 			continue;
-
-		MapNode &n = m_data[i];
-
-		u8 oldlight = n.getLight(bank, nodemgr);
 		u8 newlight = diminish_light(oldlight);
 
 		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
+		for(u16 d=0; d<6; d++)
 		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
+			v3s16 n2pos = pos + g_6dirs[d];
+			if(!m_area.contains(n2pos))
+				continue;
 
-			try
-			{
-				u32 n2i = m_area.index(n2pos);
+			u32 n2i = m_area.index(n2pos);
 
-				if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-					continue;
+			if(m_flags[n2i] & VOXELFLAG_NO_DATA)
+				continue;
 
-				MapNode &n2 = m_data[n2i];
+			MapNode &n2 = m_data[n2i];
 
-				u8 light2 = n2.getLight(bank, nodemgr);
+			u8 light2 = n2.getLight(bank, nodemgr);
 
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(light2 > undiminish_light(oldlight))
-				{
-					lighted_nodes.insert(n2pos);
-				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(light2 < newlight)
+			/*
+				If the neighbor is brighter than the current node,
+				add to queue (it will light up this node on its turn)
+			*/
+			if(light2 > undiminish_light(oldlight))
+			{
+				if(from_nodes.find(n2pos) == from_nodes.end() &&
+						found_sources.insert(n2pos).second)
 				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						lighted_nodes.insert(n2pos);
-					}
+					queues[light2].push_back(n2pos);
+					level = MYMAX(level, light2);
 				}
 			}
-			catch(InvalidPositionException &e)
+			/*
+				If the neighbor is dimmer than how much light this node
+				would spread on it, add to queue
+			*/
+			if(light2 < newlight)
 			{
-				continue;
+				if(nodemgr->get(n2).light_propagates)
+				{
+					n2.setLight(bank, newlight, nodemgr);
+					queues[newlight].push_back(n2pos);
+				}
 			}
 		}
 	}
-
-	/*dstream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, nodemgr);
 }
-#endif
 
 //END
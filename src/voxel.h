@@ -560,6 +560,12 @@ class VoxelManipulator /*: public NodeContainer*/
 	*/
 	u8 *m_flags;
 
+	/*
+		Number of nodes m_data and m_flags have room for; the buffers
+		come from a pool of the thread and may be larger than m_area
+	*/
+	u32 m_capacity;
+
 	//TODO: Use these or remove them
 	//TODO: Would these make any speed improvement?
 	//bool m_pressure_route_valid;
@@ -152,6 +152,11 @@ class ExtrusionMeshCache: public IReferenceCounted
 			it->second->drop();
 		}
 		m_cube->drop();
+		for (std::map<std::string, scene::IMesh*>::iterator
+				it = m_node_meshes.begin();
+				it != m_node_meshes.end(); ++it) {
+			it->second->drop();
+		}
 	}
 	// Get closest extrusion mesh for given image dimensions
 	// Caller must drop the returned pointer
@@ -184,10 +189,29 @@ class ExtrusionMeshCache: public IReferenceCounted
 		m_cube->grab();
 		return m_cube;
 	}
+	// Get the mesh made of the node of an item, or NULL if there's none
+	// Caller must drop the returned pointer
+	scene::IMesh* getNodeMesh(const std::string &name)
+	{
+		std::map<std::string, scene::IMesh*>::iterator
+			it = m_node_meshes.find(name);
+		if (it == m_node_meshes.end())
+			return NULL;
+		it->second->grab();
+		return it->second;
+	}
+	void setNodeMesh(const std::string &name, scene::IMesh *mesh)
+	{
+		mesh->grab();
+		m_node_meshes[name] = mesh;
+	}
 
 private:
 	std::map<int, scene::IMesh*> m_extrusion_meshes;
 	scene::IMesh *m_cube;
+	// The item definitions don't change while there are wield meshes,
+	// this is dropped with the last one
+	std::map<std::string, scene::IMesh*> m_node_meshes;
 };
 
 ExtrusionMeshCache *g_extrusion_mesh_cache = NULL;
@@ -296,6 +320,36 @@ void WieldMeshSceneNode::setExtruded(const std::string &imagename,
 		material.setTexture(2, tsrc->getTexture("disable_img.png"));
 }
 
+// Caller must drop the returned pointer
+scene::IMesh* WieldMeshSceneNode::createNodeMesh(IGameDef *gamedef,
+		content_t id)
+{
+	MeshMakeData mesh_make_data(gamedef);
+	MapNode mesh_make_node(id, 255, 0);
+	mesh_make_data.fillSingleNode(&mesh_make_node);
+	MapBlockMesh mapblock_mesh(&mesh_make_data, v3s16(0, 0, 0));
+	scene::IMesh *mesh = mapblock_mesh.getMesh();
+	mesh->grab();
+	translateMesh(mesh, v3f(-BS, -BS, -BS));
+	// The mesh outlives the MapBlockMesh that would remove its
+	// hardware buffers
+	mesh->setHardwareMappingHint(scene::EHM_NEVER);
+	if (m_enable_shaders) {
+		// The map shaders blend the day and night light of the
+		// vertices, here they are drawn as they are
+		for (u32 i = 0; i < mesh->getMeshBufferCount(); i++) {
+			scene::IMeshBuffer *buf = mesh->getMeshBuffer(i);
+			video::S3DVertex *vertices =
+					(video::S3DVertex *)buf->getVertices();
+			for (u32 j = 0; j < buf->getVertexCount(); j++) {
+				video::SColor &c = vertices[j].Color;
+				finalColorBlend(c, c.getRed(), c.getGreen(), 1000);
+			}
+		}
+	}
+	return mesh;
+}
+
 void WieldMeshSceneNode::setItem(const ItemStack &item, IGameDef *gamedef)
 {
 	ITextureSource *tsrc = gamedef->getTextureSource();
@@ -333,12 +387,13 @@ void WieldMeshSceneNode::setItem(const ItemStack &item, IGameDef *gamedef)
 		} else if (f.drawtype == NDT_NORMAL || f.drawtype == NDT_ALLFACES) {
 			setCube(f.tiles, def.wield_scale, tsrc);
 		} else {
-			MeshMakeData mesh_make_data(gamedef);
-			MapNode mesh_make_node(id, 255, 0);
-			mesh_make_data.fillSingleNode(&mesh_make_node);
-			MapBlockMesh mapblock_mesh(&mesh_make_data, v3s16(0, 0, 0));
-			changeToMesh(mapblock_mesh.getMesh());
-			translateMesh(m_meshnode->getMesh(), v3f(-BS, -BS, -BS));
+			scene::IMesh *mesh = g_extrusion_mesh_cache->getNodeMesh(def.name);
+			if (mesh == NULL) {
+				mesh = createNodeMesh(gamedef, id);
+				g_extrusion_mesh_cache->setNodeMesh(def.name, mesh);
+			}
+			changeToMesh(mesh);
+			mesh->drop();
 			m_meshnode->setScale(
 					def.wield_scale * WIELD_SCALE_FACTOR
 					/ (BS * f.visual_scale));	
@@ -357,6 +412,7 @@ void WieldMeshSceneNode::setItem(const ItemStack &item, IGameDef *gamedef)
 				material.setTexture(0, f.tiles[i].texture);
 			}
 			material.MaterialType = m_material_type;
+			material.MaterialTypeParam2 = 0;
 			if (m_enable_shaders) {
 				if (f.tiles[i].normal_texture) {
 					if (animated) {
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define WIELDMESH_HEADER
 
 #include "irrlichttypes_extrabloated.h"
+#include "mapnode.h"
 #include <string>
 
 class ItemStack;
@@ -55,6 +56,7 @@ class WieldMeshSceneNode: public scene::ISceneNode
 
 private:
 	void changeToMesh(scene::IMesh *mesh);
+	scene::IMesh* createNodeMesh(IGameDef *gamedef, content_t id);
 
 	// Child scene node with the current wield mesh
 	scene::IMeshSceneNode *m_meshnode;
@@ -0,0 +1,227 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "workerpool.h"
+#include "jthread/jthread.h"
+#include "jthread/jmutexautolock.h"
+#include "porting.h"
+#include "threads.h"
+#include "settings.h"
+#include "main.h" // for g_settings
+#include "debug.h"
+#include "log.h"
+#include "util/numeric.h"
+
+class WorkerThread : public JThread
+{
+	WorkerPool *m_pool;
+	// Processor to stay on, or -1
+	int m_processor;
+
+public:
+
+	WorkerThread(WorkerPool *pool, int processor):
+		JThread(),
+		m_pool(pool),
+		m_processor(processor)
+	{
+	}
+
+	void * Thread();
+};
+
+void * WorkerThread::Thread()
+{
+	log_register_thread("WorkerThread");
+
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	ThreadStarted();
+
+	porting::setThreadName("WorkerThread");
+
+#ifndef __ANDROID__
+	if(m_processor >= 0 && !porting::threadBindToProcessor(
+			get_current_thread_id(), m_processor))
+		infostream<<"WorkerThread: Can't bind to processor "
+				<<m_processor<<std::endl;
+#endif
+
+	while(!StopRequested())
+	{
+		if(!m_pool->m_work.Wait(100))
+			continue;
+		while(m_pool->runNext());
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+WorkerPool::WorkerPool(u32 thread_count, bool bind_to_processors):
+	m_task(NULL),
+	m_count(0),
+	m_next(0),
+	m_finished(0)
+{
+	int processors = MYMAX(porting::getNumberOfProcessors(), 1);
+	for(u32 i = 0; i < thread_count; i++){
+		WorkerThread *thread = new WorkerThread(this,
+				bind_to_processors ? (int)(i % processors) : -1);
+		thread->Start();
+		m_threads.push_back(thread);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	for(u32 i = 0; i < m_threads.size(); i++)
+		m_threads[i]->Stop();
+	for(u32 i = 0; i < m_threads.size(); i++){
+		m_threads[i]->Wait();
+		delete m_threads[i];
+	}
+}
+
+void WorkerPool::run(WorkerTask *task, u32 count)
+{
+	// Not worth waking anyone up
+	if(m_threads.empty() || count <= 1){
+		for(u32 i = 0; i < count; i++)
+			task->run(i);
+		return;
+	}
+
+	JMutexAutoLock runlock(m_run_mutex);
+
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_task = task;
+		m_count = count;
+		m_next = 0;
+		m_finished = 0;
+	}
+
+	// The calling thread takes parts too, so one less helper is enough
+	u32 helpers = MYMIN(m_threads.size(), count - 1);
+	for(u32 i = 0; i < helpers; i++)
+		m_work.Post();
+	while(runNextPart());
+	m_task_done.Wait();
+}
+
+void WorkerPool::submit(WorkerJob *job, WorkerPriority priority)
+{
+	if(m_threads.empty()){
+		job->run();
+		return;
+	}
+
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_jobs[priority].push_back(job);
+	}
+	m_work.Post();
+}
+
+u32 WorkerPool::getQueuedJobCount()
+{
+	JMutexAutoLock lock(m_mutex);
+	u32 count = 0;
+	for(u32 i = 0; i < WORKER_PRIORITY_COUNT; i++)
+		count += m_jobs[i].size();
+	return count;
+}
+
+bool WorkerPool::runNextPart()
+{
+	WorkerTask *task;
+	u32 index;
+	{
+		JMutexAutoLock lock(m_mutex);
+		if(m_task == NULL || m_next >= m_count)
+			return false;
+		task = m_task;
+		index = m_next++;
+	}
+
+	task->run(index);
+
+	JMutexAutoLock lock(m_mutex);
+	if(++m_finished == m_count){
+		m_task = NULL;
+		m_task_done.Post();
+	}
+	return true;
+}
+
+bool WorkerPool::runNext()
+{
+	if(runNextPart())
+		return true;
+
+	WorkerJob *job = NULL;
+	{
+		JMutexAutoLock lock(m_mutex);
+		for(u32 i = 0; i < WORKER_PRIORITY_COUNT && job == NULL; i++){
+			if(m_jobs[i].empty())
+				continue;
+			job = m_jobs[i].front();
+			m_jobs[i].pop_front();
+		}
+	}
+	if(job == NULL)
+		return false;
+
+	job->run();
+	return true;
+}
+
+/*
+	Shared pool
+*/
+
+static WorkerPool *g_worker_pool = NULL;
+static JMutex g_worker_pool_mutex;
+
+WorkerPool *getWorkerPool()
+{
+	JMutexAutoLock lock(g_worker_pool_mutex);
+	if(g_worker_pool == NULL){
+		// If unspecified, leave a processor for the thread giving the work
+		s16 nthreads = 0;
+		if(!g_settings->getS16NoEx("num_worker_threads", nthreads))
+			nthreads = porting::getNumberOfProcessors() - 1;
+		nthreads = MYMAX(nthreads, 0);
+		bool affinity = g_settings->getBool("worker_thread_affinity");
+		infostream<<"Starting "<<nthreads<<" worker threads"<<std::endl;
+		g_worker_pool = new WorkerPool(nthreads, affinity);
+	}
+	return g_worker_pool;
+}
+
+void shutdownWorkerPool()
+{
+	JMutexAutoLock lock(g_worker_pool_mutex);
+	delete g_worker_pool;
+	g_worker_pool = NULL;
+}
+
@@ -0,0 +1,129 @@
+/*
+Minetest
+Copyright (C) 2014 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef WORKERPOOL_HEADER
+#define WORKERPOOL_HEADER
+
+#include "irrlichttypes.h"
+#include "jthread/jmutex.h"
+#include "jthread/jsemaphore.h"
+#include <vector>
+#include <deque>
+
+class WorkerThread;
+
+/*
+	A task split in count independent parts, run(0) ... run(count - 1).
+	The parts may run at the same time on different threads, so each of
+	them should only write to its own results; the caller merges them in
+	index order afterwards, which keeps the outcome the same as a serial
+	loop.
+*/
+class WorkerTask
+{
+public:
+	virtual ~WorkerTask() {}
+	virtual void run(u32 index) = 0;
+};
+
+/*
+	A piece of work that nobody waits for. The job tells its owner when
+	it is done, if the owner cares; the pool doesn't delete it.
+*/
+class WorkerJob
+{
+public:
+	virtual ~WorkerJob() {}
+	virtual void run() = 0;
+};
+
+enum WorkerPriority
+{
+	WORKER_PRIORITY_HIGH = 0,
+	WORKER_PRIORITY_NORMAL = 1,
+	WORKER_PRIORITY_LOW = 2,
+	WORKER_PRIORITY_COUNT
+};
+
+/*
+	Threads that take the parts of the task being run first and the
+	queued jobs by priority after that, so that the work of the whole
+	engine is spread on the processors by what there is to do rather
+	than by a fixed number of threads for each kind of work.
+
+	With no threads, run() is a plain loop and submit() runs the job
+	right away.
+*/
+class WorkerPool
+{
+public:
+	// With bind_to_processors, the threads are kept on one processor each
+	WorkerPool(u32 thread_count, bool bind_to_processors = false);
+	~WorkerPool();
+
+	u32 getThreadCount()
+	{
+		return m_threads.size();
+	}
+
+	// Returns when all the parts of the task are done. The calling thread
+	// runs parts too, but no jobs. One task at a time can be run.
+	void run(WorkerTask *task, u32 count);
+
+	void submit(WorkerJob *job, WorkerPriority priority = WORKER_PRIORITY_NORMAL);
+
+	// Number of jobs that have not been started
+	u32 getQueuedJobCount();
+
+private:
+	friend class WorkerThread;
+
+	// Runs the next part of the current task; false if there is none
+	bool runNextPart();
+	// Runs the next part or else the next queued job
+	bool runNext();
+
+	std::vector<WorkerThread*> m_threads;
+	// A post for each job and each thread asked to help with a task;
+	// a thread that wakes up works until there is nothing left
+	JSemaphore m_work;
+	// Posted by whoever finishes the last part of the task
+	JSemaphore m_task_done;
+
+	JMutex m_mutex;
+	WorkerTask *m_task;
+	u32 m_count;
+	u32 m_next;
+	u32 m_finished;
+	std::deque<WorkerJob*> m_jobs[WORKER_PRIORITY_COUNT];
+	// Serializes run()
+	JMutex m_run_mutex;
+};
+
+/*
+	The pool shared by the whole engine. It is made on the first call, with
+	num_worker_threads and worker_thread_affinity, and kept until
+	shutdownWorkerPool().
+*/
+WorkerPool *getWorkerPool();
+// Anything that submitted jobs must have waited for them before this
+void shutdownWorkerPool();
+
+#endif
+